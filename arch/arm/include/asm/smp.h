@@ -48,6 +48,15 @@ extern void smp_init_cpus(void);
  */
 extern void set_smp_cross_call(void (*)(const struct cpumask *, unsigned int));
 
+/*
+ * Claim, release and raise the IPIs Linux doesn't use for itself (from
+ * NR_IPI on), e.g. to signal remote processors on cores it isn't
+ * running on.
+ */
+extern int set_ipi_handler(int ipinr, void (*fn)(void *), void *data);
+extern void clear_ipi_handler(int ipinr);
+extern void smp_send_ipi(const struct cpumask *mask, int ipinr);
+
 /*
  * Boot a secondary CPU, and assign it the specified idle task.
  * This also gives us the initial stack to use for this CPU.
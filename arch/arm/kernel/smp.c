@@ -25,6 +25,7 @@
 #include <linux/clockchips.h>
 #include <linux/completion.h>
 #include <linux/cpufreq.h>
+#include <linux/mutex.h>
 
 #include <linux/atomic.h>
 #include <asm/smp.h>
@@ -68,6 +69,23 @@ enum ipi_msg_type {
 	IPI_CPU_STOP,
 };
 
+/* the IPIs are the GIC's SGIs: those from NR_IPI on are left spare */
+#define NR_SGI	16
+
+/**
+ * struct ipi_handler - handler of a spare IPI
+ * @fn: called, in interrupt context, when the IPI is raised (RCU-sched
+ *	protected; NULL while the IPI is unclaimed)
+ * @data: passed to @fn
+ */
+struct ipi_handler {
+	void (*fn)(void *data);
+	void *data;
+};
+
+static struct ipi_handler ipi_handlers[NR_SGI - NR_IPI];
+static DEFINE_MUTEX(ipi_handlers_lock);
+
 static DECLARE_COMPLETION(cpu_running);
 
 static struct smp_operations smp_ops;
@@ -416,6 +434,110 @@ void __init set_smp_cross_call(void (*fn)(const struct cpumask *, unsigned int))
 	smp_cross_call = fn;
 }
 
+/**
+ * set_ipi_handler() - claim a spare IPI
+ * @ipinr: the IPI to claim, from NR_IPI to 15
+ * @fn: called, in interrupt context, whenever @ipinr is raised on any cpu
+ * @data: passed to @fn
+ *
+ * The IPIs Linux doesn't use for itself may be claimed by drivers, e.g. as
+ * the doorbell of a remote processor which runs on a core of the cluster
+ * Linux isn't running on, and shares its interrupt controller.
+ *
+ * Returns 0 on success, -EINVAL if @ipinr isn't a spare IPI, or -EBUSY if
+ * it's already claimed.
+ */
+int set_ipi_handler(int ipinr, void (*fn)(void *), void *data)
+{
+	struct ipi_handler *h;
+	int ret = 0;
+
+	if (ipinr < NR_IPI || ipinr >= NR_SGI || !fn)
+		return -EINVAL;
+
+	h = &ipi_handlers[ipinr - NR_IPI];
+
+	mutex_lock(&ipi_handlers_lock);
+
+	if (h->fn) {
+		ret = -EBUSY;
+		goto unlock;
+	}
+
+	h->data = data;
+	/* the data must be there before the handler is found */
+	smp_wmb();
+	h->fn = fn;
+
+unlock:
+	mutex_unlock(&ipi_handlers_lock);
+	return ret;
+}
+EXPORT_SYMBOL(set_ipi_handler);
+
+/**
+ * clear_ipi_handler() - release a spare IPI
+ * @ipinr: the IPI claimed with set_ipi_handler()
+ *
+ * The handler of @ipinr is no longer running, on any cpu, once this
+ * returns. This function may sleep.
+ */
+void clear_ipi_handler(int ipinr)
+{
+	if (ipinr < NR_IPI || ipinr >= NR_SGI)
+		return;
+
+	mutex_lock(&ipi_handlers_lock);
+	ipi_handlers[ipinr - NR_IPI].fn = NULL;
+	mutex_unlock(&ipi_handlers_lock);
+
+	/* IPIs are handled with interrupts off: wait for those running */
+	synchronize_sched();
+}
+EXPORT_SYMBOL(clear_ipi_handler);
+
+/**
+ * smp_send_ipi() - raise a spare IPI
+ * @mask: the cpus to raise @ipinr on
+ * @ipinr: the IPI to raise, from NR_IPI to 15
+ *
+ * @mask may include possible cpus which aren't online (i.e. which Linux
+ * was kept off): that's how the remote processors running on them are
+ * signalled. The IPI is raised right away, from any context.
+ */
+void smp_send_ipi(const struct cpumask *mask, int ipinr)
+{
+	if (WARN_ON(ipinr < NR_IPI || ipinr >= NR_SGI))
+		return;
+
+	smp_cross_call(mask, ipinr);
+}
+EXPORT_SYMBOL(smp_send_ipi);
+
+/* returns whether @ipinr is a spare IPI which was claimed, and handled */
+static bool handle_spare_IPI(int ipinr)
+{
+	struct ipi_handler *h;
+	void (*fn)(void *);
+
+	if (ipinr < NR_IPI || ipinr >= NR_SGI)
+		return false;
+
+	h = &ipi_handlers[ipinr - NR_IPI];
+	fn = ACCESS_ONCE(h->fn);
+	if (!fn)
+		return false;
+
+	/* pairs with the barrier of set_ipi_handler() */
+	smp_rmb();
+
+	irq_enter();
+	fn(h->data);
+	irq_exit();
+
+	return true;
+}
+
 void arch_send_call_function_ipi_mask(const struct cpumask *mask)
 {
 	smp_cross_call(mask, IPI_CALL_FUNC);
@@ -617,6 +739,9 @@ void handle_IPI(int ipinr, struct pt_regs *regs)
 		break;
 
 	default:
+		if (handle_spare_IPI(ipinr))
+			break;
+
 		printk(KERN_CRIT "CPU%u: Unknown IPI message 0x%x\n",
 		       cpu, ipinr);
 		break;
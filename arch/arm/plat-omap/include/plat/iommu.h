@@ -47,9 +47,11 @@ struct omap_iommu {
 	int		nr_tlb_entries;
 
 	struct list_head	mmap;
+	struct rb_root		mmap_tree; /* mmap, for lookups and holes */
 	struct mutex		mmap_lock; /* protect mmap */
 
 	void *ctx; /* iommu context: registres saved area */
+	bool ctx_saved; /* ctx is that of the current page table */
 	u32 da_start;
 	u32 da_end;
 };
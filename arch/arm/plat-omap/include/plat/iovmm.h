@@ -14,6 +14,7 @@
 #define __IOMMU_MMAP_H
 
 #include <linux/iommu.h>
+#include <linux/rbtree.h>
 
 struct iovm_struct {
 	struct omap_iommu	*iommu;	/* iommu object which this belongs to */
@@ -21,6 +22,9 @@ struct iovm_struct {
 	u32			da_end;
 	u32			flags; /* IOVMF_: see below */
 	struct list_head	list; /* linked in ascending order */
+	struct rb_node		node; /* in the iommu's mmap_tree, by address */
+	u32			gap; /* free space right below this area */
+	u32			subtree_gap; /* largest gap in its subtree */
 	const struct sg_table	*sgt; /* keep 'page' <-> 'da' mapping */
 	void			*va; /* mpu side mapped address */
 };
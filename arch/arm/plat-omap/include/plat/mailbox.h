@@ -8,6 +8,7 @@
 #include <linux/interrupt.h>
 #include <linux/device.h>
 #include <linux/kfifo.h>
+#include <linux/hrtimer.h>
 
 typedef u32 mbox_msg_t;
 struct omap_mbox;
@@ -42,12 +43,43 @@ struct omap_mbox_ops {
 };
 
 struct omap_mbox_queue {
+	/* serializes the senders; the rx queue only needs it to unthrottle */
 	spinlock_t		lock;
 	struct kfifo		fifo;
 	struct work_struct	work;
 	struct tasklet_struct	tasklet;
 	struct omap_mbox	*mbox;
+	/* the rx queue filled up, and the rx interrupt was disabled */
 	bool full;
+	/* a doorbell waiting for room in the hw fifo, see omap_mbox_doorbell */
+	bool doorbell_queued;
+	mbox_msg_t		doorbell;
+	/* polls a full TYPE1 hw fifo, which has no notFull interrupt */
+	struct hrtimer		tx_timer;
+	/* polls a full TYPE1 hw fifo may spin for, see mbox_tx_room */
+	unsigned int		tx_spin;
+};
+
+/*
+ * what went through a mailbox, since it was registered (see its "stats"
+ * debugfs entry), to size its queues by
+ * @tx_deferred: messages queued for the tx tasklet, rather than written
+ *		 straight into the hw fifo
+ * @tx_polls: times the tx tasklet had to wait for room in the hw fifo
+ *	      (a notFull interrupt, or a poll of TYPE1 mailboxes)
+ * @tx_overflows: messages dropped, as the tx queue was full
+ * @rx_overflows: times the rx queue filled up, which held off the rx
+ *		  interrupt until there was room again
+ * @tx_max: most messages the tx queue held at once
+ * @rx_max: most messages the rx queue held at once
+ */
+struct omap_mbox_stats {
+	unsigned long		tx_deferred;
+	unsigned long		tx_polls;
+	unsigned long		tx_overflows;
+	unsigned long		rx_overflows;
+	unsigned int		tx_max;
+	unsigned int		rx_max;
 };
 
 struct omap_mbox {
@@ -59,13 +91,25 @@ struct omap_mbox {
 	void			*priv;
 	int			use_count;
 	struct blocking_notifier_head   notifier;
+	/* consumers that are called right from the mailbox interrupt */
+	struct atomic_notifier_head	atomic_notifier;
+	int			blocking_count;
+	/* messages each of its queues holds, or 0 for mbox_kfifo_size */
+	unsigned int		depth;
+	struct omap_mbox_stats	stats;
+	struct dentry		*dbg_dir;
 };
 
 int omap_mbox_msg_send(struct omap_mbox *, mbox_msg_t msg);
+void omap_mbox_doorbell(struct omap_mbox *mbox, mbox_msg_t msg,
+							mbox_msg_t all);
 void omap_mbox_init_seq(struct omap_mbox *);
 
 struct omap_mbox *omap_mbox_get(const char *, struct notifier_block *nb);
+struct omap_mbox *omap_mbox_get_atomic(const char *,
+					struct notifier_block *nb);
 void omap_mbox_put(struct omap_mbox *mbox, struct notifier_block *nb);
+int omap_mbox_request_depth(const char *name, unsigned int depth);
 
 int omap_mbox_register(struct device *parent, struct omap_mbox **);
 int omap_mbox_unregister(void);
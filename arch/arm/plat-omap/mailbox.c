@@ -24,12 +24,13 @@
 #include <linux/interrupt.h>
 #include <linux/spinlock.h>
 #include <linux/mutex.h>
-#include <linux/delay.h>
+#include <linux/hrtimer.h>
 #include <linux/slab.h>
 #include <linux/kfifo.h>
 #include <linux/err.h>
 #include <linux/notifier.h>
 #include <linux/module.h>
+#include <linux/debugfs.h>
 
 #include <plat/mailbox.h>
 
@@ -38,9 +39,33 @@ static struct omap_mbox **mboxes;
 static int mbox_configured;
 static DEFINE_MUTEX(mbox_configured_lock);
 
+/* the blocking consumers get the messages there, not behind other work */
+static struct workqueue_struct *mbox_rx_wq;
+
+static struct dentry *mbox_dbg_root;
+
+/* most distinct messages the atomic consumers get at once */
+#define MBOX_RX_BATCH	8
+
 static unsigned int mbox_kfifo_size = CONFIG_OMAP_MBOX_KFIFO_SIZE;
 module_param(mbox_kfifo_size, uint, S_IRUGO);
-MODULE_PARM_DESC(mbox_kfifo_size, "Size of omap's mailbox kfifo (bytes)");
+MODULE_PARM_DESC(mbox_kfifo_size,
+	"Size of omap's mailbox kfifo (bytes), unless a user asks otherwise");
+
+/*
+ * TYPE1 mailboxes have no notFull interrupt: when their hw fifo is full,
+ * senders spin for a bounded number of polls (adapting to how well that
+ * worked lately), and otherwise leave it to a timer to poll it again.
+ */
+static unsigned int mbox_tx_spin_max = 16;
+module_param(mbox_tx_spin_max, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(mbox_tx_spin_max,
+	"Most polls of a full TYPE1 mailbox fifo before deferring (0: none)");
+
+static unsigned int mbox_tx_poll_us = 50;
+module_param(mbox_tx_poll_us, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(mbox_tx_poll_us,
+	"Period of the polls of a full TYPE1 mailbox fifo (usecs)");
 
 /* Mailbox FIFO handle functions */
 static inline mbox_msg_t mbox_fifo_read(struct omap_mbox *mbox)
@@ -74,33 +99,82 @@ static inline int is_mbox_irq(struct omap_mbox *mbox, omap_mbox_irq_t irq)
 /*
  * message sender
  */
-static int __mbox_poll_for_space(struct omap_mbox *mbox)
+
+/*
+ * Is there room in the hw fifo ? TYPE2 mailboxes don't wait: the notFull
+ * interrupt tells when there is. TYPE1 ones spin for up to mq->tx_spin
+ * polls, which grows as long as spinning pays off, and shrinks otherwise.
+ *
+ * Must be called with mq->lock held.
+ */
+static bool mbox_tx_room(struct omap_mbox *mbox, struct omap_mbox_queue *mq)
 {
-	int ret = 0, i = 1000;
+	unsigned int i;
+
+	if (!mbox_fifo_full(mbox))
+		return true;
+
+	if (mbox->ops->type != OMAP_MBOX_TYPE1)
+		return false;
 
-	while (mbox_fifo_full(mbox)) {
-		if (mbox->ops->type == OMAP_MBOX_TYPE2)
-			return -1;
-		if (--i == 0)
-			return -1;
-		udelay(1);
+	for (i = 0; i < mq->tx_spin; i++) {
+		cpu_relax();
+		if (!mbox_fifo_full(mbox)) {
+			mq->tx_spin = min(mq->tx_spin * 2, mbox_tx_spin_max);
+			return true;
+		}
 	}
-	return ret;
+
+	mq->tx_spin = min(max(mq->tx_spin / 2, 1U), mbox_tx_spin_max);
+
+	return false;
+}
+
+/*
+ * Have the tx tasklet run again once there's room in the hw fifo: on the
+ * notFull interrupt, or on the next poll of TYPE1 mailboxes.
+ *
+ * Must be called with mq->lock held.
+ */
+static void mbox_tx_wait(struct omap_mbox *mbox, struct omap_mbox_queue *mq)
+{
+	mbox->stats.tx_polls++;
+
+	if (mbox->ops->type != OMAP_MBOX_TYPE1) {
+		omap_mbox_enable_irq(mbox, IRQ_TX);
+		return;
+	}
+
+	hrtimer_start(&mq->tx_timer,
+			ns_to_ktime((u64)mbox_tx_poll_us * NSEC_PER_USEC),
+			HRTIMER_MODE_REL);
+}
+
+static enum hrtimer_restart mbox_tx_timer(struct hrtimer *timer)
+{
+	struct omap_mbox_queue *mq = container_of(timer,
+					struct omap_mbox_queue, tx_timer);
+
+	tasklet_schedule(&mq->tasklet);
+
+	return HRTIMER_NORESTART;
 }
 
 int omap_mbox_msg_send(struct omap_mbox *mbox, mbox_msg_t msg)
 {
 	struct omap_mbox_queue *mq = mbox->txq;
+	unsigned long flags;
 	int ret = 0, len;
 
-	spin_lock_bh(&mq->lock);
+	spin_lock_irqsave(&mq->lock, flags);
 
 	if (kfifo_avail(&mq->fifo) < sizeof(msg)) {
+		mbox->stats.tx_overflows++;
 		ret = -ENOMEM;
 		goto out;
 	}
 
-	if (kfifo_is_empty(&mq->fifo) && !__mbox_poll_for_space(mbox)) {
+	if (kfifo_is_empty(&mq->fifo) && mbox_tx_room(mbox, mq)) {
 		mbox_fifo_write(mbox, msg);
 		goto out;
 	}
@@ -108,37 +182,132 @@ int omap_mbox_msg_send(struct omap_mbox *mbox, mbox_msg_t msg)
 	len = kfifo_in(&mq->fifo, (unsigned char *)&msg, sizeof(msg));
 	WARN_ON(len != sizeof(msg));
 
+	mbox->stats.tx_deferred++;
+	len = kfifo_len(&mq->fifo) / sizeof(msg);
+	if (len > mbox->stats.tx_max)
+		mbox->stats.tx_max = len;
+
 	tasklet_schedule(&mbox->txq->tasklet);
 
 out:
-	spin_unlock_bh(&mq->lock);
+	spin_unlock_irqrestore(&mq->lock, flags);
 	return ret;
 }
 EXPORT_SYMBOL(omap_mbox_msg_send);
 
-static void mbox_tx_tasklet(unsigned long tx_data)
+/**
+ * omap_mbox_doorbell() - ring the doorbell of the remote end of a mailbox
+ * @mbox: the mailbox
+ * @msg: the doorbell message
+ * @all: a doorbell message that has the remote look at everything that was
+ *	 posted for it, whichever doorbell it was posted with
+ *
+ * @msg is written straight into the hw fifo when there's room there, and no
+ * message is queued ahead of it. Otherwise, @all is kept aside until there
+ * is, and sent ahead of the queued messages; and as long as it's waiting,
+ * ringing the doorbell again is redundant (whatever was posted in the
+ * meantime is seen once @all is read), so it's a no-op.
+ *
+ * Doorbells thus are never lost: unlike omap_mbox_msg_send(), this can't
+ * fail when the message queue is full. It can be called from any context.
+ */
+void omap_mbox_doorbell(struct omap_mbox *mbox, mbox_msg_t msg,
+							mbox_msg_t all)
 {
-	struct omap_mbox *mbox = (struct omap_mbox *)tx_data;
 	struct omap_mbox_queue *mq = mbox->txq;
+	unsigned long flags;
+
+	spin_lock_irqsave(&mq->lock, flags);
+
+	if (mq->doorbell_queued)
+		goto out;
+
+	if (kfifo_is_empty(&mq->fifo) && mbox_tx_room(mbox, mq)) {
+		mbox_fifo_write(mbox, msg);
+		goto out;
+	}
+
+	mq->doorbell = all;
+	mq->doorbell_queued = true;
+	tasklet_schedule(&mq->tasklet);
+
+out:
+	spin_unlock_irqrestore(&mq->lock, flags);
+}
+EXPORT_SYMBOL(omap_mbox_doorbell);
+
+/*
+ * Move the next queued message to the hw fifo. Returns false once there's
+ * nothing left to send, or no room left to send it.
+ *
+ * Must be called with mq->lock held.
+ */
+static bool mbox_tx_next(struct omap_mbox *mbox, struct omap_mbox_queue *mq)
+{
 	mbox_msg_t msg;
 	int ret;
 
-	while (kfifo_len(&mq->fifo)) {
-		if (__mbox_poll_for_space(mbox)) {
-			omap_mbox_enable_irq(mbox, IRQ_TX);
-			break;
-		}
+	if (!mq->doorbell_queued && !kfifo_len(&mq->fifo))
+		return false;
 
-		ret = kfifo_out(&mq->fifo, (unsigned char *)&msg,
-								sizeof(msg));
+	if (!mbox_tx_room(mbox, mq)) {
+		mbox_tx_wait(mbox, mq);
+		return false;
+	}
+
+	/* the doorbell stands for everything posted so far: it's first */
+	if (mq->doorbell_queued) {
+		msg = mq->doorbell;
+		mq->doorbell_queued = false;
+	} else {
+		ret = kfifo_out(&mq->fifo, (unsigned char *)&msg, sizeof(msg));
 		WARN_ON(ret != sizeof(msg));
+	}
 
-		mbox_fifo_write(mbox, msg);
+	mbox_fifo_write(mbox, msg);
+
+	return true;
+}
+
+/*
+ * The tx queue has many producers (messages are sent from any context, on
+ * any cpu), and its lock also keeps them in order with what the tasklet
+ * writes into the hw fifo. It's only held for a message at a time though,
+ * so draining a burst doesn't keep interrupts off all along.
+ */
+static void mbox_tx_tasklet(unsigned long tx_data)
+{
+	struct omap_mbox *mbox = (struct omap_mbox *)tx_data;
+	struct omap_mbox_queue *mq = mbox->txq;
+	unsigned long flags;
+	bool more;
+
+	do {
+		spin_lock_irqsave(&mq->lock, flags);
+		more = mbox_tx_next(mbox, mq);
+		spin_unlock_irqrestore(&mq->lock, flags);
+	} while (more);
+}
+
+/* let the interrupt handler queue messages again, if it ran out of room */
+static void mbox_rx_unthrottle(struct omap_mbox_queue *mq)
+{
+	spin_lock_irq(&mq->lock);
+	if (mq->full) {
+		mq->full = false;
+		omap_mbox_enable_irq(mq->mbox, IRQ_RX);
 	}
+	spin_unlock_irq(&mq->lock);
 }
 
 /*
- * Message receiver(workqueue)
+ * Message receiver(workqueue), for the blocking consumers
+ *
+ * The rx queue has a single producer, the interrupt handler, and a single
+ * consumer, this work (which doesn't run concurrently with itself), so it
+ * goes without a lock: kfifo is safe for one reader and one writer. The
+ * lock is only taken when the queue filled up (which the handler tells
+ * with mq->full, before it queues this work again).
  */
 static void mbox_rx_work(struct work_struct *work)
 {
@@ -153,13 +322,14 @@ static void mbox_rx_work(struct work_struct *work)
 
 		blocking_notifier_call_chain(&mq->mbox->notifier, len,
 								(void *)msg);
-		spin_lock_irq(&mq->lock);
-		if (mq->full) {
-			mq->full = false;
-			omap_mbox_enable_irq(mq->mbox, IRQ_RX);
-		}
-		spin_unlock_irq(&mq->lock);
+
+		if (unlikely(ACCESS_ONCE(mq->full)))
+			mbox_rx_unthrottle(mq);
 	}
+
+	/* it may have filled up just as it was drained */
+	if (unlikely(ACCESS_ONCE(mq->full)))
+		mbox_rx_unthrottle(mq);
 }
 
 /*
@@ -172,23 +342,56 @@ static void __mbox_tx_interrupt(struct omap_mbox *mbox)
 	tasklet_schedule(&mbox->txq->tasklet);
 }
 
+/*
+ * Hand a burst of messages over to the atomic consumers. They're doorbells,
+ * so every distinct message of the burst is only delivered once.
+ */
+static void mbox_rx_deliver(struct omap_mbox *mbox, mbox_msg_t *batch, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		atomic_notifier_call_chain(&mbox->atomic_notifier,
+					sizeof(batch[i]), (void *)batch[i]);
+}
+
 static void __mbox_rx_interrupt(struct omap_mbox *mbox)
 {
 	struct omap_mbox_queue *mq = mbox->rxq;
-	mbox_msg_t msg;
-	int len;
+	/* messages only go through the kfifo if blocking consumers want them */
+	bool queue = ACCESS_ONCE(mbox->blocking_count);
+	mbox_msg_t msg, batch[MBOX_RX_BATCH];
+	int len, i, n = 0;
 
 	while (!mbox_fifo_empty(mbox)) {
-		if (unlikely(kfifo_avail(&mq->fifo) < sizeof(msg))) {
+		if (queue && unlikely(kfifo_avail(&mq->fifo) < sizeof(msg))) {
 			omap_mbox_disable_irq(mbox, IRQ_RX);
 			mq->full = true;
+			mbox->stats.rx_overflows++;
 			goto nomem;
 		}
 
 		msg = mbox_fifo_read(mbox);
 
-		len = kfifo_in(&mq->fifo, (unsigned char *)&msg, sizeof(msg));
-		WARN_ON(len != sizeof(msg));
+		/* drop the repeats of a message that's pending already */
+		for (i = 0; i < n && batch[i] != msg; i++)
+			;
+		if (i == n)
+			batch[n++] = msg;
+		if (n == MBOX_RX_BATCH) {
+			mbox_rx_deliver(mbox, batch, n);
+			n = 0;
+		}
+
+		if (queue) {
+			len = kfifo_in(&mq->fifo, (unsigned char *)&msg,
+								sizeof(msg));
+			WARN_ON(len != sizeof(msg));
+
+			len = kfifo_len(&mq->fifo) / sizeof(msg);
+			if (len > mbox->stats.rx_max)
+				mbox->stats.rx_max = len;
+		}
 
 		if (mbox->ops->type == OMAP_MBOX_TYPE1)
 			break;
@@ -197,7 +400,10 @@ static void __mbox_rx_interrupt(struct omap_mbox *mbox)
 	/* no more messages in the fifo. clear IRQ source. */
 	ack_mbox_irq(mbox, IRQ_RX);
 nomem:
-	schedule_work(&mbox->rxq->work);
+	mbox_rx_deliver(mbox, batch, n);
+
+	if (queue)
+		queue_work(mbox_rx_wq, &mbox->rxq->work);
 }
 
 static irqreturn_t mbox_interrupt(int irq, void *p)
@@ -217,22 +423,31 @@ static struct omap_mbox_queue *mbox_queue_alloc(struct omap_mbox *mbox,
 					void (*work) (struct work_struct *),
 					void (*tasklet)(unsigned long))
 {
+	unsigned int size = mbox_kfifo_size;
 	struct omap_mbox_queue *mq;
 
+	/* as deep as its users asked for, if they did */
+	if (mbox->depth)
+		size = mbox->depth * sizeof(mbox_msg_t);
+
 	mq = kzalloc(sizeof(struct omap_mbox_queue), GFP_KERNEL);
 	if (!mq)
 		return NULL;
 
 	spin_lock_init(&mq->lock);
 
-	if (kfifo_alloc(&mq->fifo, mbox_kfifo_size, GFP_KERNEL))
+	if (kfifo_alloc(&mq->fifo, size, GFP_KERNEL))
 		goto error;
 
 	if (work)
 		INIT_WORK(&mq->work, work);
 
-	if (tasklet)
+	if (tasklet) {
 		tasklet_init(&mq->tasklet, tasklet, (unsigned long)mbox);
+		hrtimer_init(&mq->tx_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+		mq->tx_timer.function = mbox_tx_timer;
+		mq->tx_spin = mbox_tx_spin_max;
+	}
 	return mq;
 error:
 	kfree(mq);
@@ -302,13 +517,39 @@ fail_startup:
 	return ret;
 }
 
+/* unregister @nb, from whichever notifier chain it's on */
+static void omap_mbox_put_nb(struct omap_mbox *mbox, struct notifier_block *nb)
+{
+	if (!nb)
+		return;
+
+	if (!atomic_notifier_chain_unregister(&mbox->atomic_notifier, nb))
+		return;
+
+	if (!blocking_notifier_chain_unregister(&mbox->notifier, nb)) {
+		mutex_lock(&mbox_configured_lock);
+		mbox->blocking_count--;
+		mutex_unlock(&mbox_configured_lock);
+	}
+}
+
 static void omap_mbox_fini(struct omap_mbox *mbox)
 {
 	mutex_lock(&mbox_configured_lock);
 
 	if (!--mbox->use_count) {
+		struct omap_mbox_queue *mq = mbox->txq;
+
 		omap_mbox_disable_irq(mbox, IRQ_RX);
 		free_irq(mbox->irq, mbox);
+
+		/* with nothing left to send, the tx tasklet stops polling */
+		spin_lock_irq(&mq->lock);
+		kfifo_reset(&mq->fifo);
+		mq->doorbell_queued = false;
+		spin_unlock_irq(&mq->lock);
+
+		hrtimer_cancel(&mq->tx_timer);
 		tasklet_kill(&mbox->txq->tasklet);
 		flush_work(&mbox->rxq->work);
 		mbox_queue_free(mbox->txq);
@@ -323,7 +564,8 @@ static void omap_mbox_fini(struct omap_mbox *mbox)
 	mutex_unlock(&mbox_configured_lock);
 }
 
-struct omap_mbox *omap_mbox_get(const char *name, struct notifier_block *nb)
+static struct omap_mbox *__omap_mbox_get(const char *name,
+				struct notifier_block *nb, bool atomic)
 {
 	struct omap_mbox *_mbox, *mbox = NULL;
 	int i, ret;
@@ -341,26 +583,144 @@ struct omap_mbox *omap_mbox_get(const char *name, struct notifier_block *nb)
 	if (!mbox)
 		return ERR_PTR(-ENOENT);
 
-	if (nb)
+	if (nb && atomic) {
+		atomic_notifier_chain_register(&mbox->atomic_notifier, nb);
+	} else if (nb) {
 		blocking_notifier_chain_register(&mbox->notifier, nb);
+		mutex_lock(&mbox_configured_lock);
+		mbox->blocking_count++;
+		mutex_unlock(&mbox_configured_lock);
+	}
 
 	ret = omap_mbox_startup(mbox);
 	if (ret) {
-		blocking_notifier_chain_unregister(&mbox->notifier, nb);
+		omap_mbox_put_nb(mbox, nb);
 		return ERR_PTR(-ENODEV);
 	}
 
 	return mbox;
 }
+
+struct omap_mbox *omap_mbox_get(const char *name, struct notifier_block *nb)
+{
+	return __omap_mbox_get(name, nb, false);
+}
 EXPORT_SYMBOL(omap_mbox_get);
 
+/**
+ * omap_mbox_get_atomic() - get a mailbox, for a consumer that can take its
+ * messages in interrupt context
+ * @name: name of the mailbox
+ * @nb: notifier block that is called for each inbound message
+ *
+ * Unlike with omap_mbox_get(), @nb is called right from the mailbox
+ * interrupt handler, rather than from a workqueue, so the messages reach it
+ * with no scheduling latency. It must not sleep; the mailbox is released
+ * with omap_mbox_put(), just the same.
+ *
+ * The mailbox fifo is drained before @nb is called, and @nb is only called
+ * once for each distinct message of the burst: the messages are taken to be
+ * doorbells, which don't need repeating while they're pending.
+ */
+struct omap_mbox *omap_mbox_get_atomic(const char *name,
+					struct notifier_block *nb)
+{
+	return __omap_mbox_get(name, nb, true);
+}
+EXPORT_SYMBOL(omap_mbox_get_atomic);
+
 void omap_mbox_put(struct omap_mbox *mbox, struct notifier_block *nb)
 {
-	blocking_notifier_chain_unregister(&mbox->notifier, nb);
+	omap_mbox_put_nb(mbox, nb);
 	omap_mbox_fini(mbox);
 }
 EXPORT_SYMBOL(omap_mbox_put);
 
+/**
+ * omap_mbox_request_depth() - ask for the queues of a mailbox to be deeper
+ * @name: name of the mailbox
+ * @depth: how many messages its queues should hold
+ *
+ * The queues of the mailbox hold mbox_kfifo_size bytes by default, unless
+ * its users ask for more (e.g. one message for each vring of a remote
+ * processor): the deepest queues asked for are allocated the next time
+ * the mailbox is started up, i.e. by the first omap_mbox_get() of it.
+ *
+ * Returns 0 on success, or -ENOENT if there's no such mailbox.
+ */
+int omap_mbox_request_depth(const char *name, unsigned int depth)
+{
+	struct omap_mbox *mbox;
+	int i;
+
+	if (!mboxes)
+		return -EINVAL;
+
+	for (i = 0; (mbox = mboxes[i]); i++)
+		if (!strcmp(mbox->name, name))
+			break;
+
+	if (!mbox)
+		return -ENOENT;
+
+	mutex_lock(&mbox_configured_lock);
+	mbox->depth = max(mbox->depth, depth);
+	mutex_unlock(&mbox_configured_lock);
+
+	return 0;
+}
+EXPORT_SYMBOL(omap_mbox_request_depth);
+
+static ssize_t mbox_stats_read(struct file *file, char __user *userbuf,
+						size_t count, loff_t *ppos)
+{
+	struct omap_mbox *mbox = file->private_data;
+	struct omap_mbox_stats *stats = &mbox->stats;
+	unsigned int depth = mbox_kfifo_size / sizeof(mbox_msg_t);
+	char buf[256];
+	int len;
+
+	mutex_lock(&mbox_configured_lock);
+	if (mbox->use_count)
+		depth = kfifo_size(&mbox->txq->fifo) / sizeof(mbox_msg_t);
+	else if (mbox->depth)
+		depth = mbox->depth;
+	mutex_unlock(&mbox_configured_lock);
+
+	len = scnprintf(buf, sizeof(buf),
+			"depth:        %u\n"
+			"tx_max:       %u\n"
+			"tx_deferred:  %lu\n"
+			"tx_polls:     %lu\n"
+			"tx_overflows: %lu\n"
+			"rx_max:       %u\n"
+			"rx_overflows: %lu\n",
+			depth, stats->tx_max, stats->tx_deferred,
+			stats->tx_polls, stats->tx_overflows, stats->rx_max,
+			stats->rx_overflows);
+
+	return simple_read_from_buffer(userbuf, count, ppos, buf, len);
+}
+
+static const struct file_operations mbox_stats_fops = {
+	.open = simple_open,
+	.read = mbox_stats_read,
+	.llseek = generic_file_llseek,
+};
+
+static void mbox_debugfs_add(struct omap_mbox *mbox)
+{
+	if (!mbox_dbg_root)
+		return;
+
+	mbox->dbg_dir = debugfs_create_dir(mbox->name, mbox_dbg_root);
+	if (!mbox->dbg_dir)
+		return;
+
+	debugfs_create_file("stats", 0400, mbox->dbg_dir, mbox,
+							&mbox_stats_fops);
+}
+
 static struct class omap_mbox_class = { .name = "mbox", };
 
 int omap_mbox_register(struct device *parent, struct omap_mbox **list)
@@ -382,12 +742,17 @@ int omap_mbox_register(struct device *parent, struct omap_mbox **list)
 		}
 
 		BLOCKING_INIT_NOTIFIER_HEAD(&mbox->notifier);
+		ATOMIC_INIT_NOTIFIER_HEAD(&mbox->atomic_notifier);
+
+		mbox_debugfs_add(mbox);
 	}
 	return 0;
 
 err_out:
-	while (i--)
+	while (i--) {
+		debugfs_remove_recursive(mboxes[i]->dbg_dir);
 		device_unregister(mboxes[i]->dev);
+	}
 	return ret;
 }
 EXPORT_SYMBOL(omap_mbox_register);
@@ -399,8 +764,10 @@ int omap_mbox_unregister(void)
 	if (!mboxes)
 		return -EINVAL;
 
-	for (i = 0; mboxes[i]; i++)
+	for (i = 0; mboxes[i]; i++) {
+		debugfs_remove_recursive(mboxes[i]->dbg_dir);
 		device_unregister(mboxes[i]->dev);
+	}
 	mboxes = NULL;
 	return 0;
 }
@@ -410,9 +777,20 @@ static int __init omap_mbox_init(void)
 {
 	int err;
 
+	mbox_rx_wq = alloc_workqueue("mbox_rx", WQ_HIGHPRI, 0);
+	if (!mbox_rx_wq)
+		return -ENOMEM;
+
 	err = class_register(&omap_mbox_class);
-	if (err)
+	if (err) {
+		destroy_workqueue(mbox_rx_wq);
 		return err;
+	}
+
+	/* it's only for accounting: the mailboxes work without it */
+	mbox_dbg_root = debugfs_create_dir("mailbox", NULL);
+	if (IS_ERR(mbox_dbg_root))
+		mbox_dbg_root = NULL;
 
 	/* kfifo size sanity check: alignment and minimal size */
 	mbox_kfifo_size = ALIGN(mbox_kfifo_size, sizeof(mbox_msg_t));
@@ -425,7 +803,9 @@ subsys_initcall(omap_mbox_init);
 
 static void __exit omap_mbox_exit(void)
 {
+	debugfs_remove_recursive(mbox_dbg_root);
 	class_unregister(&omap_mbox_class);
+	destroy_workqueue(mbox_rx_wq);
 }
 module_exit(omap_mbox_exit);
 
@@ -91,6 +91,7 @@ enum {
 enum fw_buf_fmt {
 	VMALLOC_BUF,	/* used in direct loading */
 	PAGE_BUF,	/* used in loading via userspace */
+	CALLER_BUF,	/* used in request_firmware_into_buf */
 };
 
 static int loading_timeout = 60;	/* In seconds */
@@ -256,7 +257,7 @@ static void __fw_free_buf(struct kref *ref)
 		for (i = 0; i < buf->nr_pages; i++)
 			__free_page(buf->pages[i]);
 		kfree(buf->pages);
-	} else
+	} else if (buf->fmt == VMALLOC_BUF)
 		vfree(buf->data);
 	kfree(buf);
 }
@@ -295,11 +296,19 @@ static bool fw_read_file_contents(struct file *file, struct firmware_buf *fw_buf
 	size = fw_file_size(file);
 	if (size < 0)
 		return false;
-	buf = vmalloc(size);
-	if (!buf)
-		return false;
+	if (fw_buf->fmt == CALLER_BUF) {
+		/* read it right where the caller wants it, if it fits */
+		if (size > fw_buf->size)
+			return false;
+		buf = fw_buf->data;
+	} else {
+		buf = vmalloc(size);
+		if (!buf)
+			return false;
+	}
 	if (kernel_read(file, 0, buf, size) != size) {
-		vfree(buf);
+		if (fw_buf->fmt != CALLER_BUF)
+			vfree(buf);
 		return false;
 	}
 	fw_buf->data = buf;
@@ -990,6 +999,87 @@ request_firmware(const struct firmware **firmware_p, const char *name,
 	return ret;
 }
 
+/**
+ * request_firmware_into_buf: - load a firmware image straight into a buffer
+ * @firmware_p: pointer to firmware image
+ * @name: name of firmware file
+ * @device: device for which firmware is being loaded
+ * @buf: where to load the firmware image
+ * @size: size of @buf, in bytes
+ *
+ *      Just like request_firmware(), but the image is read right into
+ *      @buf (e.g. the memory the device runs it from), instead of into
+ *      a buffer of its own: (*@firmware_p)->data is @buf, which must stay
+ *      valid until the image is released with release_firmware().
+ *
+ *      The image is only looked for among the built-in images and on
+ *      the filesystem, without falling back on user space, and it is
+ *      neither shared with other requests nor cached. Returns -ENOENT
+ *      if it can't be found, or doesn't fit in @buf.
+ **/
+int
+request_firmware_into_buf(const struct firmware **firmware_p, const char *name,
+			  struct device *device, void *buf, size_t size)
+{
+	struct firmware *firmware;
+	struct firmware_buf *fw_buf;
+	int ret;
+
+	if (!firmware_p)
+		return -EINVAL;
+
+	*firmware_p = NULL;
+
+	firmware = kzalloc(sizeof(*firmware), GFP_KERNEL);
+	if (!firmware) {
+		dev_err(device, "%s: kmalloc(struct firmware) failed\n",
+			__func__);
+		return -ENOMEM;
+	}
+
+	fw_buf = __allocate_fw_buf(name, &fw_cache);
+	if (!fw_buf) {
+		ret = -ENOMEM;
+		goto free_fw;
+	}
+
+	/* it's nobody else's buffer: keep it out of the cached ones */
+	INIT_LIST_HEAD(&fw_buf->list);
+	fw_buf->fmt = CALLER_BUF;
+	fw_buf->data = buf;
+	fw_buf->size = size;
+
+	if (fw_get_builtin_firmware(firmware, name)) {
+		dev_dbg(device, "firmware: copying built-in firmware %s\n",
+			name);
+		if (firmware->size > size) {
+			ret = -ENOENT;
+			goto free_buf;
+		}
+		memcpy(buf, firmware->data, firmware->size);
+		fw_buf->size = firmware->size;
+	} else if (fw_get_filesystem_firmware(fw_buf)) {
+		dev_dbg(device, "firmware: direct-loading firmware %s\n",
+			name);
+	} else {
+		ret = -ENOENT;
+		goto free_buf;
+	}
+
+	firmware->size = fw_buf->size;
+	firmware->data = buf;
+	firmware->priv = fw_buf;
+	*firmware_p = firmware;
+
+	return 0;
+
+free_buf:
+	kfree(fw_buf);
+free_fw:
+	kfree(firmware);
+	return ret;
+}
+
 /**
  * release_firmware: - release the resource associated with a firmware image
  * @fw: firmware resource to release
@@ -1464,5 +1554,6 @@ module_exit(firmware_class_exit);
 EXPORT_SYMBOL(release_firmware);
 EXPORT_SYMBOL(request_firmware);
 EXPORT_SYMBOL(request_firmware_nowait);
+EXPORT_SYMBOL(request_firmware_into_buf);
 EXPORT_SYMBOL_GPL(cache_firmware);
 EXPORT_SYMBOL_GPL(uncache_firmware);
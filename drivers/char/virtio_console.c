@@ -21,6 +21,7 @@
 #include <linux/debugfs.h>
 #include <linux/completion.h>
 #include <linux/device.h>
+#include <linux/dma-mapping.h>
 #include <linux/err.h>
 #include <linux/freezer.h>
 #include <linux/fs.h>
@@ -80,6 +81,13 @@ static struct ports_driver_data pdrvdata;
 DEFINE_SPINLOCK(pdrvdata_lock);
 DECLARE_COMPLETION(early_console_added);
 
+/*
+ * DMA buffers of remoteproc serial ports that were freed in atomic
+ * context; dma_free_coherent() may sleep, so they're released later.
+ */
+static LIST_HEAD(pending_free_dma_bufs);
+static DEFINE_SPINLOCK(dma_bufs_lock);
+
 /* This struct holds information that's relevant only for console ports */
 struct console {
 	/* We'll place all consoles in a list in the pdrvdata struct */
@@ -111,6 +119,15 @@ struct port_buffer {
 	size_t len;
 	/* offset in the buf from which to consume data */
 	size_t offset;
+
+	/* DMA address of buffer, for remoteproc serial ports */
+	dma_addr_t dma;
+
+	/* Device we got the DMA memory from, NULL for kmalloc'ed buffers */
+	struct device *dev;
+
+	/* List of pending DMA buffers to free */
+	struct list_head list;
 };
 
 /*
@@ -336,27 +353,102 @@ static inline bool use_multiport(struct ports_device *portdev)
 	return portdev->vdev->features[0] & (1 << VIRTIO_CONSOLE_F_MULTIPORT);
 }
 
-static void free_buf(struct port_buffer *buf)
+static inline bool is_rproc_enabled(void)
+{
+	return IS_ENABLED(CONFIG_REMOTEPROC);
+}
+
+/*
+ * A remoteproc serial device is a plain, single port link to a remote
+ * processor; typically the remote streams its trace log over it.  The
+ * remote can only reach memory we got from the DMA API.
+ */
+static inline bool is_rproc_serial(const struct virtio_device *vdev)
+{
+	return is_rproc_enabled() && vdev->id.device == VIRTIO_ID_RPROC_SERIAL;
+}
+
+static void free_buf(struct port_buffer *buf, bool can_sleep)
 {
-	kfree(buf->buf);
+	unsigned long flags;
+
+	if (!buf->dev) {
+		kfree(buf->buf);
+		kfree(buf);
+		return;
+	}
+
+	if (!can_sleep) {
+		spin_lock_irqsave(&dma_bufs_lock, flags);
+		list_add_tail(&buf->list, &pending_free_dma_bufs);
+		spin_unlock_irqrestore(&dma_bufs_lock, flags);
+		return;
+	}
+
+	dma_free_coherent(buf->dev, buf->size, buf->buf, buf->dma);
+	/* Release the reference we took on the remoteproc device */
+	put_device(buf->dev);
 	kfree(buf);
 }
 
-static struct port_buffer *alloc_buf(size_t buf_size)
+static void reclaim_dma_bufs(void)
 {
+	unsigned long flags;
+	struct port_buffer *buf, *tmp;
+	LIST_HEAD(tmp_list);
+
+	if (list_empty(&pending_free_dma_bufs))
+		return;
+
+	/* Create a copy of the pending_free_dma_bufs while holding the lock */
+	spin_lock_irqsave(&dma_bufs_lock, flags);
+	list_cut_position(&tmp_list, &pending_free_dma_bufs,
+			  pending_free_dma_bufs.prev);
+	spin_unlock_irqrestore(&dma_bufs_lock, flags);
+
+	/* Release the dma buffers, without irqs enabled */
+	list_for_each_entry_safe(buf, tmp, &tmp_list, list) {
+		list_del(&buf->list);
+		free_buf(buf, true);
+	}
+}
+
+static struct port_buffer *alloc_buf(struct virtqueue *vq, size_t buf_size)
+{
+	struct virtio_device *vdev = vq->vdev;
 	struct port_buffer *buf;
 
+	reclaim_dma_bufs();
+
 	buf = kmalloc(sizeof(*buf), GFP_KERNEL);
 	if (!buf)
 		goto fail;
-	buf->buf = kzalloc(buf_size, GFP_KERNEL);
-	if (!buf->buf)
-		goto free_buf;
+
+	if (is_rproc_serial(vdev)) {
+		/*
+		 * Allocate DMA memory from the remoteproc device, the
+		 * grandparent of the virtio device; hold a reference
+		 * to it for as long as the buffer lives.
+		 */
+		buf->dev = vdev->dev.parent->parent;
+		get_device(buf->dev);
+		buf->buf = dma_alloc_coherent(buf->dev, buf_size, &buf->dma,
+					      GFP_KERNEL);
+		if (!buf->buf)
+			goto put_dev;
+	} else {
+		buf->dev = NULL;
+		buf->buf = kzalloc(buf_size, GFP_KERNEL);
+		if (!buf->buf)
+			goto free_buf;
+	}
 	buf->len = 0;
 	buf->offset = 0;
 	buf->size = buf_size;
 	return buf;
 
+put_dev:
+	put_device(buf->dev);
 free_buf:
 	kfree(buf);
 fail:
@@ -416,7 +508,7 @@ static void discard_port_data(struct port *port)
 		port->stats.bytes_discarded += buf->len - buf->offset;
 		if (add_inbuf(port->in_vq, buf) < 0) {
 			err++;
-			free_buf(buf);
+			free_buf(buf, false);
 		}
 		port->inbuf = NULL;
 		buf = get_inbuf(port);
@@ -478,10 +570,13 @@ static ssize_t send_control_msg(struct port *port, unsigned int event,
 
 struct buffer_token {
 	union {
-		void *buf;
+		struct port_buffer *pbuf;
 		struct scatterlist *sg;
 	} u;
-	/* If sgpages == 0 then buf is used, else sg is used */
+	/*
+	 * If sgpages == 0 then pbuf is used, else sg is used.  pbuf
+	 * is NULL for the console's writes, which are waited for.
+	 */
 	unsigned int sgpages;
 };
 
@@ -512,8 +607,8 @@ static void reclaim_consumed_buffers(struct port *port)
 	while ((tok = virtqueue_get_buf(port->out_vq, &len))) {
 		if (tok->sgpages)
 			reclaim_sg_pages(tok->u.sg, tok->sgpages);
-		else
-			kfree(tok->u.buf);
+		else if (tok->u.pbuf)
+			free_buf(tok->u.pbuf, false);
 		kfree(tok);
 		port->outvq_full = false;
 	}
@@ -572,8 +667,12 @@ done:
 	return in_count;
 }
 
+/*
+ * Send in_count bytes at in_buf; if pbuf is given, it holds in_buf
+ * and is freed once the host has consumed the data.
+ */
 static ssize_t send_buf(struct port *port, void *in_buf, size_t in_count,
-			bool nonblock)
+			struct port_buffer *pbuf, bool nonblock)
 {
 	struct scatterlist sg[1];
 	struct buffer_token *tok;
@@ -582,7 +681,7 @@ static ssize_t send_buf(struct port *port, void *in_buf, size_t in_count,
 	if (!tok)
 		return -ENOMEM;
 	tok->sgpages = 0;
-	tok->u.buf = in_buf;
+	tok->u.pbuf = pbuf;
 
 	sg_init_one(sg, in_buf, in_count);
 
@@ -681,14 +780,14 @@ static bool will_write_block(struct port *port)
 	return ret;
 }
 
-static ssize_t port_fops_read(struct file *filp, char __user *ubuf,
-			      size_t count, loff_t *offp)
+/*
+ * Wait for data to arrive on a port.  Returns 1 once there's data to
+ * read, 0 if the host isn't connected (end of file) or an error.
+ */
+static ssize_t wait_port_readable(struct port *port, bool nonblock)
 {
-	struct port *port;
 	ssize_t ret;
 
-	port = filp->private_data;
-
 	if (!port_has_data(port)) {
 		/*
 		 * If nothing's connected on the host just return 0 in
@@ -697,7 +796,7 @@ static ssize_t port_fops_read(struct file *filp, char __user *ubuf,
 		 */
 		if (!port->host_connected)
 			return 0;
-		if (filp->f_flags & O_NONBLOCK)
+		if (nonblock)
 			return -EAGAIN;
 
 		ret = wait_event_freezable(port->waitqueue,
@@ -721,9 +820,107 @@ static ssize_t port_fops_read(struct file *filp, char __user *ubuf,
 	if (!port_has_data(port) && !port->host_connected)
 		return 0;
 
+	return 1;
+}
+
+static ssize_t port_fops_read(struct file *filp, char __user *ubuf,
+			      size_t count, loff_t *offp)
+{
+	struct port *port;
+	ssize_t ret;
+
+	port = filp->private_data;
+
+	ret = wait_port_readable(port, filp->f_flags & O_NONBLOCK);
+	if (ret <= 0)
+		return ret;
+
 	return fill_readbuf(port, ubuf, count, true);
 }
 
+static void port_spd_release(struct splice_pipe_desc *spd, unsigned int i)
+{
+	put_page(spd->pages[i]);
+}
+
+static const struct pipe_buf_operations port_pipe_buf_ops = {
+	.can_merge = 0,
+	.map = generic_pipe_buf_map,
+	.unmap = generic_pipe_buf_unmap,
+	.confirm = generic_pipe_buf_confirm,
+	.release = generic_pipe_buf_release,
+	.steal = generic_pipe_buf_steal,
+	.get = generic_pipe_buf_get,
+};
+
+/*
+ * Splice the data we received into a pipe, e.g. to stream a remote
+ * processor's trace log into a file without going through user
+ * space.  The data is copied once, into pages of our own, so that the
+ * port's buffers can go straight back to the host.
+ */
+static ssize_t port_fops_splice_read(struct file *filp, loff_t *ppos,
+				     struct pipe_inode_info *pipe, size_t len,
+				     unsigned int flags)
+{
+	struct port *port = filp->private_data;
+	struct page *pages[PIPE_DEF_BUFFERS];
+	struct partial_page partial[PIPE_DEF_BUFFERS];
+	struct splice_pipe_desc spd = {
+		.pages = pages,
+		.partial = partial,
+		.nr_pages_max = PIPE_DEF_BUFFERS,
+		.flags = flags,
+		.ops = &port_pipe_buf_ops,
+		.spd_release = port_spd_release,
+	};
+	ssize_t ret;
+
+	ret = wait_port_readable(port, (filp->f_flags & O_NONBLOCK) ||
+					(flags & SPLICE_F_NONBLOCK));
+	if (ret <= 0)
+		return ret;
+
+	if (splice_grow_spd(pipe, &spd))
+		return -ENOMEM;
+
+	ret = 0;
+	while (len && spd.nr_pages < spd.nr_pages_max) {
+		struct page *page;
+		size_t count, n;
+
+		page = alloc_page(GFP_KERNEL);
+		if (!page) {
+			ret = -ENOMEM;
+			break;
+		}
+
+		/* Pack as much of the queued data into the page as fits */
+		count = min_t(size_t, len, PAGE_SIZE);
+		for (n = 0; n < count; n += ret) {
+			ret = fill_readbuf(port, page_address(page) + n,
+					   count - n, false);
+			if (ret <= 0)
+				break;
+		}
+		if (!n) {
+			__free_page(page);
+			break;
+		}
+
+		spd.pages[spd.nr_pages] = page;
+		spd.partial[spd.nr_pages].offset = 0;
+		spd.partial[spd.nr_pages].len = n;
+		spd.nr_pages++;
+		len -= n;
+	}
+
+	if (spd.nr_pages)
+		ret = splice_to_pipe(pipe, &spd);
+	splice_shrink_spd(&spd);
+	return ret;
+}
+
 static int wait_port_writable(struct port *port, bool nonblock)
 {
 	int ret;
@@ -748,7 +945,7 @@ static ssize_t port_fops_write(struct file *filp, const char __user *ubuf,
 			       size_t count, loff_t *offp)
 {
 	struct port *port;
-	char *buf;
+	struct port_buffer *buf;
 	ssize_t ret;
 	bool nonblock;
 
@@ -766,11 +963,11 @@ static ssize_t port_fops_write(struct file *filp, const char __user *ubuf,
 
 	count = min((size_t)(32 * 1024), count);
 
-	buf = kmalloc(count, GFP_KERNEL);
+	buf = alloc_buf(port->out_vq, count);
 	if (!buf)
 		return -ENOMEM;
 
-	ret = copy_from_user(buf, ubuf, count);
+	ret = copy_from_user(buf->buf, ubuf, count);
 	if (ret) {
 		ret = -EFAULT;
 		goto free_buf;
@@ -784,13 +981,13 @@ static ssize_t port_fops_write(struct file *filp, const char __user *ubuf,
 	 * through to the host.
 	 */
 	nonblock = true;
-	ret = send_buf(port, buf, count, nonblock);
+	ret = send_buf(port, buf->buf, count, buf, nonblock);
 
 	if (nonblock && ret > 0)
 		goto out;
 
 free_buf:
-	kfree(buf);
+	free_buf(buf, true);
 out:
 	return ret;
 }
@@ -863,6 +1060,13 @@ static ssize_t port_fops_splice_write(struct pipe_inode_info *pipe,
 		.u.data = &sgl,
 	};
 
+	/*
+	 * The remote processor can only reach DMA memory; pipe pages
+	 * here are just ordinary pages.
+	 */
+	if (is_rproc_serial(port->out_vq->vdev))
+		return -EINVAL;
+
 	ret = wait_port_writable(port, filp->f_flags & O_NONBLOCK);
 	if (ret < 0)
 		return ret;
@@ -1013,6 +1217,7 @@ static const struct file_operations port_fops = {
 	.open  = port_fops_open,
 	.read  = port_fops_read,
 	.write = port_fops_write,
+	.splice_read = port_fops_splice_read,
 	.splice_write = port_fops_splice_write,
 	.poll  = port_fops_poll,
 	.release = port_fops_release,
@@ -1039,7 +1244,7 @@ static int put_chars(u32 vtermno, const char *buf, int count)
 	if (!port)
 		return -EPIPE;
 
-	return send_buf(port, (void *)buf, count, false);
+	return send_buf(port, (void *)buf, count, NULL, false);
 }
 
 /*
@@ -1260,7 +1465,7 @@ static unsigned int fill_queue(struct virtqueue *vq, spinlock_t *lock)
 
 	nr_added_bufs = 0;
 	do {
-		buf = alloc_buf(PAGE_SIZE);
+		buf = alloc_buf(vq, PAGE_SIZE);
 		if (!buf)
 			break;
 
@@ -1268,7 +1473,7 @@ static unsigned int fill_queue(struct virtqueue *vq, spinlock_t *lock)
 		ret = add_inbuf(vq, buf);
 		if (ret < 0) {
 			spin_unlock_irq(lock);
-			free_buf(buf);
+			free_buf(buf, true);
 			break;
 		}
 		nr_added_bufs++;
@@ -1356,10 +1561,18 @@ static int add_port(struct ports_device *portdev, u32 id)
 		goto free_device;
 	}
 
-	/*
-	 * If we're not using multiport support, this has to be a console port
-	 */
-	if (!use_multiport(port->portdev)) {
+	if (is_rproc_serial(port->portdev->vdev))
+		/*
+		 * For rproc_serial assume remote processor is connected.
+		 * rproc_serial does not want the console port, only
+		 * the generic port implementation.
+		 */
+		port->host_connected = true;
+	else if (!use_multiport(port->portdev)) {
+		/*
+		 * If we're not using multiport support,
+		 * this has to be a console port.
+		 */
 		err = init_port_console(port);
 		if (err)
 			goto free_inbufs;
@@ -1392,7 +1605,7 @@ static int add_port(struct ports_device *portdev, u32 id)
 
 free_inbufs:
 	while ((buf = virtqueue_detach_unused_buf(port->in_vq)))
-		free_buf(buf);
+		free_buf(buf, true);
 free_device:
 	device_destroy(pdrvdata.class, port->dev->devt);
 free_cdev:
@@ -1434,7 +1647,7 @@ static void remove_port_data(struct port *port)
 
 	/* Remove buffers we queued up for the Host to send us data in. */
 	while ((buf = virtqueue_detach_unused_buf(port->in_vq)))
-		free_buf(buf);
+		free_buf(buf, true);
 }
 
 /*
@@ -1636,7 +1849,7 @@ static void control_work_handler(struct work_struct *work)
 		if (add_inbuf(portdev->c_ivq, buf) < 0) {
 			dev_warn(&portdev->vdev->dev,
 				 "Error adding buffer to queue\n");
-			free_buf(buf);
+			free_buf(buf, false);
 		}
 	}
 	spin_unlock(&portdev->cvq_lock);
@@ -1832,10 +2045,10 @@ static void remove_controlq_data(struct ports_device *portdev)
 		return;
 
 	while ((buf = virtqueue_get_buf(portdev->c_ivq, &len)))
-		free_buf(buf);
+		free_buf(buf, true);
 
 	while ((buf = virtqueue_detach_unused_buf(portdev->c_ivq)))
-		free_buf(buf);
+		free_buf(buf, true);
 }
 
 /*
@@ -1966,7 +2179,8 @@ static void virtcons_remove(struct virtio_device *vdev)
 	/* Disable interrupts for vqs */
 	vdev->config->reset(vdev);
 	/* Finish up work that's lined up */
-	cancel_work_sync(&portdev->control_work);
+	if (use_multiport(portdev))
+		cancel_work_sync(&portdev->control_work);
 
 	list_for_each_entry_safe(port, port2, &portdev->ports, list)
 		unplug_port(port);
@@ -1984,6 +2198,9 @@ static void virtcons_remove(struct virtio_device *vdev)
 	remove_controlq_data(portdev);
 	remove_vqs(portdev);
 	kfree(portdev);
+
+	/* Buffers freed from atomic context, e.g. at port unplug */
+	reclaim_dma_bufs();
 }
 
 static struct virtio_device_id id_table[] = {
@@ -2065,6 +2282,16 @@ static int virtcons_restore(struct virtio_device *vdev)
 }
 #endif
 
+static struct virtio_device_id rproc_serial_id_table[] = {
+#if IS_ENABLED(CONFIG_REMOTEPROC)
+	{ VIRTIO_ID_RPROC_SERIAL, VIRTIO_DEV_ANY_ID },
+#endif
+	{ 0 },
+};
+
+static unsigned int rproc_serial_features[] = {
+};
+
 static struct virtio_driver virtio_console = {
 	.feature_table = features,
 	.feature_table_size = ARRAY_SIZE(features),
@@ -2080,6 +2307,16 @@ static struct virtio_driver virtio_console = {
 #endif
 };
 
+static struct virtio_driver virtio_rproc_serial = {
+	.feature_table = rproc_serial_features,
+	.feature_table_size = ARRAY_SIZE(rproc_serial_features),
+	.driver.name =	"virtio_rproc_serial",
+	.driver.owner =	THIS_MODULE,
+	.id_table =	rproc_serial_id_table,
+	.probe =	virtcons_probe,
+	.remove =	virtcons_remove,
+};
+
 static int __init init(void)
 {
 	int err;
@@ -2104,7 +2341,15 @@ static int __init init(void)
 		pr_err("Error %d registering virtio driver\n", err);
 		goto free;
 	}
+	err = register_virtio_driver(&virtio_rproc_serial);
+	if (err < 0) {
+		pr_err("Error %d registering virtio rproc serial driver\n",
+		       err);
+		goto unregister;
+	}
 	return 0;
+unregister:
+	unregister_virtio_driver(&virtio_console);
 free:
 	if (pdrvdata.debugfs_dir)
 		debugfs_remove_recursive(pdrvdata.debugfs_dir);
@@ -2114,7 +2359,10 @@ free:
 
 static void __exit fini(void)
 {
+	reclaim_dma_bufs();
+
 	unregister_virtio_driver(&virtio_console);
+	unregister_virtio_driver(&virtio_rproc_serial);
 
 	class_destroy(pdrvdata.class);
 	if (pdrvdata.debugfs_dir)
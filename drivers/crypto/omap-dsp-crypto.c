@@ -0,0 +1,1104 @@
+/*
+ * Cipher and hash offload to the OMAP DSP, over rpmsg
+ *
+ * The DSP, which remoteproc boots, announces an "omap-dsp-crypto" rpmsg
+ * channel, through which this driver provides asynchronous AES (ecb, cbc)
+ * ciphers and SHA-1/SHA-256 hashes to the crypto API.
+ *
+ * Requests are queued (in a crypto_queue, which backlogs them when it's
+ * full), and a work item hands them to the DSP in batches: up to
+ * DSP_CRYPTO_MAX_BATCH jobs go in a single message, which is built right
+ * in its rpmsg buffer. The DSP reports the jobs it's done, again several
+ * per message, and up to 'max_in_flight' jobs are with the DSP at once.
+ *
+ * Nothing is copied: the scatterlists of a request are mapped with the
+ * device the rpmsg buffers come from (see rpmsg_get_dma_dev()), i.e. into
+ * the DSP's iommu domain, and the DSP gets a table of their segments. The
+ * table, along with the key and the IV (or the state of the hash), is in
+ * the request context, which is mapped too.
+ *
+ * The algorithms are registered when the DSP first shows up, and stay
+ * registered until the module goes away: requests fail with -ENODEV while
+ * the DSP isn't there (e.g. while it's being recovered).
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include <linux/workqueue.h>
+#include <linux/interrupt.h>
+#include <linux/scatterlist.h>
+#include <linux/dma-mapping.h>
+#include <linux/crypto.h>
+#include <linux/rpmsg.h>
+
+#include <crypto/aes.h>
+#include <crypto/sha.h>
+#include <crypto/algapi.h>
+#include <crypto/internal/hash.h>
+
+#define DSP_CRYPTO_NAME		"omap-dsp-crypto"
+
+/* the most jobs the DSP may ever get at once */
+#define DSP_CRYPTO_MAX_JOBS	64
+
+/* the most jobs handed to the DSP in a single message */
+#define DSP_CRYPTO_MAX_BATCH	16
+
+/* the most segments the source (or destination) of a job may have */
+#define DSP_CRYPTO_MAX_SGE	16
+
+/* how many requests are queued before they're backlogged (or refused) */
+#define DSP_CRYPTO_QUEUE_LEN	256
+
+/* the room the DSP has for the IV of a job, or the state of a hash */
+#define DSP_CRYPTO_CTX_SIZE	128
+
+static unsigned int max_in_flight = 32;
+module_param(max_in_flight, uint, 0644);
+MODULE_PARM_DESC(max_in_flight, "Max number of jobs the DSP gets at once");
+
+/* the algorithms of the jobs */
+enum dsp_crypto_alg {
+	DSP_CRYPTO_ECB_AES	= 0,
+	DSP_CRYPTO_CBC_AES	= 1,
+	DSP_CRYPTO_SHA1		= 2,
+	DSP_CRYPTO_SHA256	= 3,
+};
+
+/* what the jobs do */
+enum dsp_crypto_op {
+	DSP_CRYPTO_ENCRYPT	= 0,
+	DSP_CRYPTO_DECRYPT	= 1,
+	DSP_CRYPTO_HASH_UPDATE	= 2,
+	DSP_CRYPTO_HASH_FINAL	= 3,
+};
+
+/* dsp_crypto_job flags: the hash starts over with this job */
+#define DSP_CRYPTO_HASH_INIT	(1 << 0)
+
+/**
+ * struct dsp_crypto_sge - a segment of the source or destination of a job
+ * @da: its address
+ * @len: its length, in bytes
+ */
+struct dsp_crypto_sge {
+	u32 da;
+	u32 len;
+} __packed;
+
+/**
+ * struct dsp_crypto_desc - what the DSP reads (and writes) besides the data
+ * @ctx: the IV of a cipher job (which the DSP replaces with the next one),
+ *	 or the state of a hash (which starts with the digest, once final).
+ *	 Its layout is the DSP's business otherwise.
+ * @key: the key of a cipher job
+ * @src: the segments of the source
+ * @dst: the segments of the destination, if it isn't the source
+ *
+ * This is the first member of the request context, so it's aligned enough
+ * to be mapped on its own.
+ */
+struct dsp_crypto_desc {
+	u8 ctx[DSP_CRYPTO_CTX_SIZE];
+	u8 key[AES_MAX_KEY_SIZE];
+	struct dsp_crypto_sge src[DSP_CRYPTO_MAX_SGE];
+	struct dsp_crypto_sge dst[DSP_CRYPTO_MAX_SGE];
+} ____cacheline_aligned;
+
+/**
+ * struct dsp_crypto_job - a job, as handed to the DSP
+ * @id: the number of the job, echoed back when it's done
+ * @alg: the DSP_CRYPTO_* algorithm
+ * @op: the DSP_CRYPTO_* operation
+ * @flags: DSP_CRYPTO_HASH_INIT, or zero
+ * @keylen: length of the key, in bytes (cipher jobs)
+ * @len: how many bytes to process
+ * @src_nents: number of entries of the desc's @src
+ * @dst_nents: number of entries of the desc's @dst, or 0 to write the
+ *	       result over the source
+ * @reserved: reserved (zero)
+ * @desc_da: address of the job's struct dsp_crypto_desc
+ */
+struct dsp_crypto_job {
+	u32 id;
+	u8 alg;
+	u8 op;
+	u8 flags;
+	u8 keylen;
+	u32 len;
+	u8 src_nents;
+	u8 dst_nents;
+	u16 reserved;
+	u32 desc_da;
+} __packed;
+
+/**
+ * struct dsp_crypto_msg - a batch of jobs (sent by the host)
+ * @num: number of @jobs
+ * @jobs: the jobs
+ */
+struct dsp_crypto_msg {
+	u32 num;
+	struct dsp_crypto_job jobs[0];
+} __packed;
+
+/**
+ * struct dsp_crypto_done - a job is done
+ * @id: the number of the job
+ * @status: 0 on success, or a negative error code
+ */
+struct dsp_crypto_done {
+	u32 id;
+	s32 status;
+} __packed;
+
+/**
+ * struct dsp_crypto_done_msg - a batch of jobs done (sent by the DSP)
+ * @num: number of @done
+ * @done: the jobs which are done
+ */
+struct dsp_crypto_done_msg {
+	u32 num;
+	struct dsp_crypto_done done[0];
+} __packed;
+
+/**
+ * struct dsp_crypto_reqctx - the context of a request
+ * @desc: the descriptor the DSP reads, which must come first
+ * @desc_dma: dma address of @desc, while the DSP has the job
+ * @alg: the DSP_CRYPTO_* algorithm
+ * @op: the DSP_CRYPTO_* operation
+ * @flags: the dsp_crypto_job flags
+ * @keylen: length of the key in @desc, cipher requests
+ * @src: the source scatterlist
+ * @dst: the destination scatterlist, NULL if it's the source
+ * @nbytes: how many bytes of @src (and @dst) to process
+ * @src_sgs: how many entries of @src are mapped
+ * @dst_sgs: how many entries of @dst are mapped
+ * @src_nents: how many segments @src was mapped as
+ * @dst_nents: how many segments @dst was mapped as
+ * @mapped: the DSP's view of the request is mapped
+ * @err: how the request went, once it's done
+ * @first: a hash request hasn't been handed any data yet (so the next job
+ *	   starts the hash over)
+ */
+struct dsp_crypto_reqctx {
+	struct dsp_crypto_desc desc;
+	dma_addr_t desc_dma;
+	u8 alg;
+	u8 op;
+	u8 flags;
+	u8 keylen;
+	struct scatterlist *src;
+	struct scatterlist *dst;
+	unsigned int nbytes;
+	int src_sgs;
+	int dst_sgs;
+	int src_nents;
+	int dst_nents;
+	bool mapped;
+	int err;
+	bool first;
+};
+
+/**
+ * struct dsp_crypto_ctx - the context of a transform
+ * @key: the key (ciphers)
+ * @keylen: length of @key, in bytes
+ * @alg: the DSP_CRYPTO_* algorithm (hashes)
+ */
+struct dsp_crypto_ctx {
+	u8 key[AES_MAX_KEY_SIZE];
+	unsigned int keylen;
+	u8 alg;
+};
+
+/**
+ * struct dsp_crypto_slot - a job the DSP was handed
+ * @req: the request, NULL if the slot is free
+ * @id: the number of the job: its slot, and a sequence number above it
+ */
+struct dsp_crypto_slot {
+	struct crypto_async_request *req;
+	u32 id;
+};
+
+/**
+ * struct dsp_crypto_dev - the DSP
+ * @rpdev: the rpmsg channel of the DSP
+ * @dma_dev: the device the DSP's memory is mapped with
+ * @submit_work: hands the queued requests over to the DSP
+ * @done_task: completes the requests which are done
+ * @lock: protects @queue, @slots, @in_flight, @seq and @done
+ * @queue: the requests the DSP wasn't handed yet
+ * @slots: the jobs the DSP was handed
+ * @in_flight: how many of @slots are in use
+ * @seq: sequence number of the next job
+ * @done: the requests which are done, but not completed yet
+ */
+struct dsp_crypto_dev {
+	struct rpmsg_channel *rpdev;
+	struct device *dma_dev;
+	struct work_struct submit_work;
+	struct tasklet_struct done_task;
+	spinlock_t lock;
+	struct crypto_queue queue;
+	struct dsp_crypto_slot slots[DSP_CRYPTO_MAX_JOBS];
+	unsigned int in_flight;
+	u32 seq;
+	struct list_head done;
+};
+
+/* the DSP, if it's there, and what protects the pointer */
+static struct dsp_crypto_dev *dsp_crypto;
+static DEFINE_SPINLOCK(dsp_crypto_lock);
+
+/* the algorithms are registered once, along with the first DSP */
+static DEFINE_MUTEX(dsp_crypto_algs_lock);
+static bool dsp_crypto_algs_registered;
+
+static inline struct dsp_crypto_reqctx *
+dsp_crypto_reqctx(struct crypto_async_request *req)
+{
+	if (crypto_tfm_alg_type(req->tfm) == CRYPTO_ALG_TYPE_AHASH)
+		return ahash_request_ctx(ahash_request_cast(req));
+
+	return ablkcipher_request_ctx(ablkcipher_request_cast(req));
+}
+
+/*
+ * map the @nbytes first bytes of @sg for the DSP, into the segments table
+ * @sge: returns the number of segments, or a negative error code
+ */
+static int dsp_crypto_map_sg(struct dsp_crypto_dev *dev,
+		struct scatterlist *sg, unsigned int nbytes,
+		enum dma_data_direction dir, struct dsp_crypto_sge *sge,
+		int *sgs)
+{
+	struct scatterlist *s;
+	unsigned int len;
+	int n = 0, i, mapped;
+
+	for (s = sg, len = nbytes; s && len; s = sg_next(s), n++)
+		len -= min(len, s->length);
+
+	if (len || n > DSP_CRYPTO_MAX_SGE)
+		return -EINVAL;
+
+	mapped = dma_map_sg(dev->dma_dev, sg, n, dir);
+	if (!mapped)
+		return -ENOMEM;
+
+	len = nbytes;
+	for_each_sg(sg, s, mapped, i) {
+		sge[i].da = sg_dma_address(s);
+		sge[i].len = min_t(unsigned int, len, sg_dma_len(s));
+		len -= sge[i].len;
+	}
+
+	*sgs = n;
+	return mapped;
+}
+
+
+/* the source is only read, unless the result is written over it */
+static inline enum dma_data_direction
+dsp_crypto_src_dir(struct dsp_crypto_reqctx *rctx)
+{
+	if (rctx->dst || rctx->op == DSP_CRYPTO_HASH_UPDATE ||
+					rctx->op == DSP_CRYPTO_HASH_FINAL)
+		return DMA_TO_DEVICE;
+
+	return DMA_BIDIRECTIONAL;
+}
+
+/* map what the DSP needs to process a request, and describe it in @job */
+static int dsp_crypto_map(struct dsp_crypto_dev *dev,
+			struct crypto_async_request *req,
+			struct dsp_crypto_job *job)
+{
+	struct dsp_crypto_reqctx *rctx = dsp_crypto_reqctx(req);
+	enum dma_data_direction dir = dsp_crypto_src_dir(rctx);
+	int ret;
+
+	rctx->src_nents = rctx->dst_nents = 0;
+	rctx->src_sgs = rctx->dst_sgs = 0;
+
+	if (rctx->nbytes) {
+		ret = dsp_crypto_map_sg(dev, rctx->src, rctx->nbytes, dir,
+					rctx->desc.src, &rctx->src_sgs);
+		if (ret < 0)
+			return ret;
+		rctx->src_nents = ret;
+	}
+
+	if (rctx->dst && rctx->nbytes) {
+		ret = dsp_crypto_map_sg(dev, rctx->dst, rctx->nbytes,
+				DMA_FROM_DEVICE, rctx->desc.dst,
+				&rctx->dst_sgs);
+		if (ret < 0)
+			goto unmap_src;
+		rctx->dst_nents = ret;
+	}
+
+	rctx->desc_dma = dma_map_single(dev->dma_dev, &rctx->desc,
+				sizeof(rctx->desc), DMA_BIDIRECTIONAL);
+	if (dma_mapping_error(dev->dma_dev, rctx->desc_dma)) {
+		ret = -ENOMEM;
+		goto unmap_dst;
+	}
+
+	rctx->mapped = true;
+
+	job->alg = rctx->alg;
+	job->op = rctx->op;
+	job->flags = rctx->flags;
+	job->keylen = rctx->keylen;
+	job->len = rctx->nbytes;
+	job->src_nents = rctx->src_nents;
+	job->dst_nents = rctx->dst_nents;
+	job->reserved = 0;
+	job->desc_da = rctx->desc_dma;
+
+	return 0;
+
+unmap_dst:
+	if (rctx->dst_sgs)
+		dma_unmap_sg(dev->dma_dev, rctx->dst, rctx->dst_sgs,
+							DMA_FROM_DEVICE);
+unmap_src:
+	if (rctx->src_sgs)
+		dma_unmap_sg(dev->dma_dev, rctx->src, rctx->src_sgs, dir);
+	return ret;
+}
+
+/* undo dsp_crypto_map() */
+static void dsp_crypto_unmap(struct dsp_crypto_dev *dev,
+					struct dsp_crypto_reqctx *rctx)
+{
+	enum dma_data_direction dir = dsp_crypto_src_dir(rctx);
+
+	dma_unmap_single(dev->dma_dev, rctx->desc_dma, sizeof(rctx->desc),
+							DMA_BIDIRECTIONAL);
+	if (rctx->dst_sgs)
+		dma_unmap_sg(dev->dma_dev, rctx->dst, rctx->dst_sgs,
+							DMA_FROM_DEVICE);
+	if (rctx->src_sgs)
+		dma_unmap_sg(dev->dma_dev, rctx->src, rctx->src_sgs, dir);
+
+	rctx->mapped = false;
+}
+
+/* hand the results of a request over, and complete it */
+static void dsp_crypto_finish(struct dsp_crypto_dev *dev,
+					struct crypto_async_request *req)
+{
+	struct dsp_crypto_reqctx *rctx = dsp_crypto_reqctx(req);
+	struct ablkcipher_request *creq;
+	struct ahash_request *hreq;
+
+	if (rctx->mapped)
+		dsp_crypto_unmap(dev, rctx);
+
+	if (!rctx->err && rctx->op == DSP_CRYPTO_HASH_FINAL) {
+		hreq = ahash_request_cast(req);
+		memcpy(hreq->result, rctx->desc.ctx,
+			crypto_ahash_digestsize(crypto_ahash_reqtfm(hreq)));
+	} else if (!rctx->err && rctx->alg == DSP_CRYPTO_CBC_AES) {
+		/* the IV to chain the next request with */
+		creq = ablkcipher_request_cast(req);
+		memcpy(creq->info, rctx->desc.ctx, AES_BLOCK_SIZE);
+	}
+
+	if (!rctx->err)
+		rctx->first = false;
+
+	req->complete(req, rctx->err);
+}
+
+/* complete the requests which are done, in softirq context */
+static void dsp_crypto_done_task(unsigned long data)
+{
+	struct dsp_crypto_dev *dev = (struct dsp_crypto_dev *)data;
+	struct crypto_async_request *req, *tmp;
+	unsigned long flags;
+	LIST_HEAD(done);
+
+	spin_lock_irqsave(&dev->lock, flags);
+	list_splice_init(&dev->done, &done);
+	spin_unlock_irqrestore(&dev->lock, flags);
+
+	list_for_each_entry_safe(req, tmp, &done, list)
+		dsp_crypto_finish(dev, req);
+}
+
+/*
+ * a request is done (with @err): it's completed by the done task, with
+ * dev->lock held
+ */
+static void dsp_crypto_req_done(struct dsp_crypto_dev *dev,
+				struct crypto_async_request *req, int err)
+{
+	dsp_crypto_reqctx(req)->err = err;
+	list_add_tail(&req->list, &dev->done);
+}
+
+/* grab a free job slot for @req, with dev->lock held */
+static struct dsp_crypto_slot *dsp_crypto_get_slot(struct dsp_crypto_dev *dev,
+					struct crypto_async_request *req)
+{
+	int i;
+
+	for (i = 0; i < DSP_CRYPTO_MAX_JOBS; i++) {
+		struct dsp_crypto_slot *slot = &dev->slots[i];
+
+		if (slot->req)
+			continue;
+
+		slot->req = req;
+		slot->id = (dev->seq++ * DSP_CRYPTO_MAX_JOBS) + i;
+		dev->in_flight++;
+		return slot;
+	}
+
+	return NULL;
+}
+
+/* the job of a slot is done (with @err): give the slot back */
+static void dsp_crypto_put_slot(struct dsp_crypto_dev *dev,
+				struct dsp_crypto_slot *slot, int err)
+{
+	dsp_crypto_req_done(dev, slot->req, err);
+	slot->req = NULL;
+	dev->in_flight--;
+}
+
+/*
+ * take up to DSP_CRYPTO_MAX_BATCH requests off the queue, as many as the
+ * DSP may get, and give each a slot: returns how many were taken
+ */
+static int dsp_crypto_dequeue(struct dsp_crypto_dev *dev,
+			struct dsp_crypto_slot **slots,
+			struct crypto_async_request **backlogs)
+{
+	unsigned int max = clamp_t(unsigned int, max_in_flight, 1,
+							DSP_CRYPTO_MAX_JOBS);
+	struct crypto_async_request *req;
+	unsigned long flags;
+	int num = 0;
+
+	spin_lock_irqsave(&dev->lock, flags);
+
+	while (num < DSP_CRYPTO_MAX_BATCH && dev->in_flight < max) {
+		backlogs[num] = crypto_get_backlog(&dev->queue);
+		req = crypto_dequeue_request(&dev->queue);
+		if (!req)
+			break;
+
+		slots[num++] = dsp_crypto_get_slot(dev, req);
+	}
+
+	spin_unlock_irqrestore(&dev->lock, flags);
+
+	return num;
+}
+
+/* the jobs of @slots didn't make it to the DSP */
+static void dsp_crypto_drop(struct dsp_crypto_dev *dev,
+			struct dsp_crypto_slot **slots, int num, int err)
+{
+	unsigned long flags;
+	int i;
+
+	spin_lock_irqsave(&dev->lock, flags);
+	for (i = 0; i < num; i++)
+		dsp_crypto_put_slot(dev, slots[i], err);
+	spin_unlock_irqrestore(&dev->lock, flags);
+
+	tasklet_schedule(&dev->done_task);
+}
+
+/*
+ * hand the queued requests over to the DSP, a batch per message, until
+ * either they're all handed over, or the DSP has as many as it may get
+ * (jobs that are done will bring us back)
+ */
+static void dsp_crypto_submit_work(struct work_struct *work)
+{
+	struct dsp_crypto_dev *dev = container_of(work, struct dsp_crypto_dev,
+								submit_work);
+	struct crypto_async_request *backlogs[DSP_CRYPTO_MAX_BATCH];
+	struct dsp_crypto_slot *slots[DSP_CRYPTO_MAX_BATCH];
+	struct dsp_crypto_msg *msg;
+	int num, i, n, ret;
+
+	while ((num = dsp_crypto_dequeue(dev, slots, backlogs))) {
+		for (i = 0; i < num; i++)
+			if (backlogs[i])
+				backlogs[i]->complete(backlogs[i],
+							-EINPROGRESS);
+
+		/* the batch is built right in the tx buffer */
+		msg = rpmsg_alloc_tx_buf(dev->rpdev, sizeof(*msg) +
+					num * sizeof(msg->jobs[0]), true);
+		if (IS_ERR(msg)) {
+			dev_err(&dev->rpdev->dev, "no tx buffer: %ld\n",
+								PTR_ERR(msg));
+			dsp_crypto_drop(dev, slots, num, PTR_ERR(msg));
+			continue;
+		}
+
+		/* the slots of the jobs which are handed over come first */
+		for (i = 0, n = 0; i < num; i++) {
+			ret = dsp_crypto_map(dev, slots[i]->req, &msg->jobs[n]);
+			if (ret) {
+				dsp_crypto_drop(dev, &slots[i], 1, ret);
+				continue;
+			}
+
+			msg->jobs[n].id = slots[i]->id;
+			slots[n++] = slots[i];
+		}
+
+		if (!n) {
+			rpmsg_free_tx_buf(dev->rpdev, msg);
+			continue;
+		}
+
+		msg->num = n;
+
+		ret = rpmsg_send_buf(dev->rpdev, msg, sizeof(*msg) +
+						n * sizeof(msg->jobs[0]));
+		if (ret) {
+			dev_err(&dev->rpdev->dev, "can't submit jobs: %d\n",
+									ret);
+			dsp_crypto_drop(dev, slots, n, ret);
+		}
+	}
+}
+
+/* some jobs are done */
+static void dsp_crypto_cb(struct rpmsg_channel *rpdev, void *data, int len,
+							void *priv, u32 src)
+{
+	struct dsp_crypto_dev *dev = dev_get_drvdata(&rpdev->dev);
+	struct dsp_crypto_done_msg *msg = data;
+	struct dsp_crypto_done *done;
+	struct dsp_crypto_slot *slot;
+	unsigned long flags;
+	u32 i;
+
+	if (!dev || len < sizeof(*msg) ||
+		msg->num > (len - sizeof(*msg)) / sizeof(msg->done[0])) {
+		dev_warn(&rpdev->dev, "unexpected message, len %d\n", len);
+		return;
+	}
+
+	spin_lock_irqsave(&dev->lock, flags);
+
+	for (i = 0; i < msg->num; i++) {
+		done = &msg->done[i];
+
+		slot = &dev->slots[done->id % DSP_CRYPTO_MAX_JOBS];
+		if (!slot->req || slot->id != done->id) {
+			dev_warn(&rpdev->dev, "unexpected job %u\n", done->id);
+			continue;
+		}
+
+		dsp_crypto_put_slot(dev, slot, done->status);
+	}
+
+	spin_unlock_irqrestore(&dev->lock, flags);
+
+	tasklet_schedule(&dev->done_task);
+
+	/* more requests may be handed over now */
+	schedule_work(&dev->submit_work);
+}
+
+/*
+ * queue a request for the DSP: returns -EINPROGRESS, or -EBUSY if it was
+ * backlogged (or refused, if it may not be), or -ENODEV if the DSP isn't
+ * there
+ */
+static int dsp_crypto_enqueue(struct crypto_async_request *req)
+{
+	struct dsp_crypto_dev *dev;
+	unsigned long flags;
+	int ret = -ENODEV;
+
+	spin_lock_irqsave(&dsp_crypto_lock, flags);
+
+	dev = dsp_crypto;
+	if (dev) {
+		spin_lock(&dev->lock);
+		ret = crypto_enqueue_request(&dev->queue, req);
+		spin_unlock(&dev->lock);
+
+		/* the DSP can't go away before this is scheduled */
+		schedule_work(&dev->submit_work);
+	}
+
+	spin_unlock_irqrestore(&dsp_crypto_lock, flags);
+
+	return ret;
+}
+
+static int dsp_crypto_setkey(struct crypto_ablkcipher *tfm, const u8 *key,
+							unsigned int keylen)
+{
+	struct dsp_crypto_ctx *ctx = crypto_ablkcipher_ctx(tfm);
+
+	if (keylen != AES_KEYSIZE_128 && keylen != AES_KEYSIZE_192 &&
+					keylen != AES_KEYSIZE_256) {
+		crypto_ablkcipher_set_flags(tfm, CRYPTO_TFM_RES_BAD_KEY_LEN);
+		return -EINVAL;
+	}
+
+	memcpy(ctx->key, key, keylen);
+	ctx->keylen = keylen;
+
+	return 0;
+}
+
+static int dsp_crypto_crypt(struct ablkcipher_request *req, u8 alg, u8 op)
+{
+	struct dsp_crypto_ctx *ctx = crypto_ablkcipher_ctx(
+					crypto_ablkcipher_reqtfm(req));
+	struct dsp_crypto_reqctx *rctx = ablkcipher_request_ctx(req);
+
+	if (!IS_ALIGNED(req->nbytes, AES_BLOCK_SIZE))
+		return -EINVAL;
+
+	rctx->alg = alg;
+	rctx->op = op;
+	rctx->flags = 0;
+	rctx->keylen = ctx->keylen;
+	rctx->src = req->src;
+	rctx->dst = req->dst != req->src ? req->dst : NULL;
+	rctx->nbytes = req->nbytes;
+	rctx->mapped = false;
+
+	/* the key and the IV go where the DSP reads them */
+	memcpy(rctx->desc.key, ctx->key, ctx->keylen);
+	if (alg == DSP_CRYPTO_CBC_AES)
+		memcpy(rctx->desc.ctx, req->info, AES_BLOCK_SIZE);
+
+	return dsp_crypto_enqueue(&req->base);
+}
+
+static int dsp_crypto_ecb_encrypt(struct ablkcipher_request *req)
+{
+	return dsp_crypto_crypt(req, DSP_CRYPTO_ECB_AES, DSP_CRYPTO_ENCRYPT);
+}
+
+static int dsp_crypto_ecb_decrypt(struct ablkcipher_request *req)
+{
+	return dsp_crypto_crypt(req, DSP_CRYPTO_ECB_AES, DSP_CRYPTO_DECRYPT);
+}
+
+static int dsp_crypto_cbc_encrypt(struct ablkcipher_request *req)
+{
+	return dsp_crypto_crypt(req, DSP_CRYPTO_CBC_AES, DSP_CRYPTO_ENCRYPT);
+}
+
+static int dsp_crypto_cbc_decrypt(struct ablkcipher_request *req)
+{
+	return dsp_crypto_crypt(req, DSP_CRYPTO_CBC_AES, DSP_CRYPTO_DECRYPT);
+}
+
+static int dsp_crypto_cra_init(struct crypto_tfm *tfm)
+{
+	tfm->crt_ablkcipher.reqsize = sizeof(struct dsp_crypto_reqctx);
+
+	return 0;
+}
+
+/* queue a hash job, of @op, over the @nbytes first bytes of @src */
+static int dsp_crypto_hash(struct ahash_request *req, u8 op,
+			struct scatterlist *src, unsigned int nbytes)
+{
+	struct dsp_crypto_ctx *ctx = crypto_ahash_ctx(
+					crypto_ahash_reqtfm(req));
+	struct dsp_crypto_reqctx *rctx = ahash_request_ctx(req);
+
+	rctx->alg = ctx->alg;
+	rctx->op = op;
+	rctx->flags = rctx->first ? DSP_CRYPTO_HASH_INIT : 0;
+	rctx->keylen = 0;
+	rctx->src = src;
+	rctx->dst = NULL;
+	rctx->nbytes = nbytes;
+	rctx->mapped = false;
+
+	return dsp_crypto_enqueue(&req->base);
+}
+
+static int dsp_crypto_hash_init(struct ahash_request *req)
+{
+	struct dsp_crypto_reqctx *rctx = ahash_request_ctx(req);
+
+	/* the DSP sets the state up along with the first job */
+	rctx->first = true;
+
+	return 0;
+}
+
+static int dsp_crypto_hash_update(struct ahash_request *req)
+{
+	if (!req->nbytes)
+		return 0;
+
+	return dsp_crypto_hash(req, DSP_CRYPTO_HASH_UPDATE, req->src,
+								req->nbytes);
+}
+
+static int dsp_crypto_hash_final(struct ahash_request *req)
+{
+	return dsp_crypto_hash(req, DSP_CRYPTO_HASH_FINAL, NULL, 0);
+}
+
+static int dsp_crypto_hash_finup(struct ahash_request *req)
+{
+	return dsp_crypto_hash(req, DSP_CRYPTO_HASH_FINAL, req->src,
+								req->nbytes);
+}
+
+static int dsp_crypto_hash_digest(struct ahash_request *req)
+{
+	dsp_crypto_hash_init(req);
+
+	return dsp_crypto_hash_finup(req);
+}
+
+/**
+ * struct dsp_crypto_hash_state - the exported state of a hash
+ * @ctx: the state, as the DSP left it
+ * @first: the DSP has no state yet
+ */
+struct dsp_crypto_hash_state {
+	u8 ctx[DSP_CRYPTO_CTX_SIZE];
+	bool first;
+};
+
+static int dsp_crypto_hash_export(struct ahash_request *req, void *out)
+{
+	struct dsp_crypto_reqctx *rctx = ahash_request_ctx(req);
+	struct dsp_crypto_hash_state *state = out;
+
+	memcpy(state->ctx, rctx->desc.ctx, sizeof(state->ctx));
+	state->first = rctx->first;
+
+	return 0;
+}
+
+static int dsp_crypto_hash_import(struct ahash_request *req, const void *in)
+{
+	struct dsp_crypto_reqctx *rctx = ahash_request_ctx(req);
+	const struct dsp_crypto_hash_state *state = in;
+
+	memcpy(rctx->desc.ctx, state->ctx, sizeof(state->ctx));
+	rctx->first = state->first;
+
+	return 0;
+}
+
+static int dsp_crypto_hash_cra_init(struct crypto_tfm *tfm, u8 alg)
+{
+	struct dsp_crypto_ctx *ctx = crypto_tfm_ctx(tfm);
+
+	ctx->alg = alg;
+	crypto_ahash_set_reqsize(__crypto_ahash_cast(tfm),
+					sizeof(struct dsp_crypto_reqctx));
+
+	return 0;
+}
+
+static int dsp_crypto_sha1_cra_init(struct crypto_tfm *tfm)
+{
+	return dsp_crypto_hash_cra_init(tfm, DSP_CRYPTO_SHA1);
+}
+
+static int dsp_crypto_sha256_cra_init(struct crypto_tfm *tfm)
+{
+	return dsp_crypto_hash_cra_init(tfm, DSP_CRYPTO_SHA256);
+}
+
+static struct crypto_alg dsp_crypto_algs[] = {
+{
+	.cra_name		= "ecb(aes)",
+	.cra_driver_name	= "ecb-aes-omap-dsp",
+	.cra_priority		= 300,
+	.cra_flags		= CRYPTO_ALG_TYPE_ABLKCIPHER |
+				  CRYPTO_ALG_KERN_DRIVER_ONLY |
+				  CRYPTO_ALG_ASYNC,
+	.cra_blocksize		= AES_BLOCK_SIZE,
+	.cra_ctxsize		= sizeof(struct dsp_crypto_ctx),
+	.cra_alignmask		= 0,
+	.cra_type		= &crypto_ablkcipher_type,
+	.cra_module		= THIS_MODULE,
+	.cra_init		= dsp_crypto_cra_init,
+	.cra_u.ablkcipher = {
+		.min_keysize	= AES_MIN_KEY_SIZE,
+		.max_keysize	= AES_MAX_KEY_SIZE,
+		.setkey		= dsp_crypto_setkey,
+		.encrypt	= dsp_crypto_ecb_encrypt,
+		.decrypt	= dsp_crypto_ecb_decrypt,
+	}
+},
+{
+	.cra_name		= "cbc(aes)",
+	.cra_driver_name	= "cbc-aes-omap-dsp",
+	.cra_priority		= 300,
+	.cra_flags		= CRYPTO_ALG_TYPE_ABLKCIPHER |
+				  CRYPTO_ALG_KERN_DRIVER_ONLY |
+				  CRYPTO_ALG_ASYNC,
+	.cra_blocksize		= AES_BLOCK_SIZE,
+	.cra_ctxsize		= sizeof(struct dsp_crypto_ctx),
+	.cra_alignmask		= 0,
+	.cra_type		= &crypto_ablkcipher_type,
+	.cra_module		= THIS_MODULE,
+	.cra_init		= dsp_crypto_cra_init,
+	.cra_u.ablkcipher = {
+		.min_keysize	= AES_MIN_KEY_SIZE,
+		.max_keysize	= AES_MAX_KEY_SIZE,
+		.ivsize		= AES_BLOCK_SIZE,
+		.setkey		= dsp_crypto_setkey,
+		.encrypt	= dsp_crypto_cbc_encrypt,
+		.decrypt	= dsp_crypto_cbc_decrypt,
+	}
+},
+};
+
+static struct ahash_alg dsp_crypto_hash_algs[] = {
+{
+	.init		= dsp_crypto_hash_init,
+	.update		= dsp_crypto_hash_update,
+	.final		= dsp_crypto_hash_final,
+	.finup		= dsp_crypto_hash_finup,
+	.digest		= dsp_crypto_hash_digest,
+	.export		= dsp_crypto_hash_export,
+	.import		= dsp_crypto_hash_import,
+	.halg.digestsize	= SHA1_DIGEST_SIZE,
+	.halg.statesize		= sizeof(struct dsp_crypto_hash_state),
+	.halg.base	= {
+		.cra_name		= "sha1",
+		.cra_driver_name	= "sha1-omap-dsp",
+		.cra_priority		= 300,
+		.cra_flags		= CRYPTO_ALG_TYPE_AHASH |
+					  CRYPTO_ALG_KERN_DRIVER_ONLY |
+					  CRYPTO_ALG_ASYNC,
+		.cra_blocksize		= SHA1_BLOCK_SIZE,
+		.cra_ctxsize		= sizeof(struct dsp_crypto_ctx),
+		.cra_alignmask		= 0,
+		.cra_module		= THIS_MODULE,
+		.cra_init		= dsp_crypto_sha1_cra_init,
+	}
+},
+{
+	.init		= dsp_crypto_hash_init,
+	.update		= dsp_crypto_hash_update,
+	.final		= dsp_crypto_hash_final,
+	.finup		= dsp_crypto_hash_finup,
+	.digest		= dsp_crypto_hash_digest,
+	.export		= dsp_crypto_hash_export,
+	.import		= dsp_crypto_hash_import,
+	.halg.digestsize	= SHA256_DIGEST_SIZE,
+	.halg.statesize		= sizeof(struct dsp_crypto_hash_state),
+	.halg.base	= {
+		.cra_name		= "sha256",
+		.cra_driver_name	= "sha256-omap-dsp",
+		.cra_priority		= 300,
+		.cra_flags		= CRYPTO_ALG_TYPE_AHASH |
+					  CRYPTO_ALG_KERN_DRIVER_ONLY |
+					  CRYPTO_ALG_ASYNC,
+		.cra_blocksize		= SHA256_BLOCK_SIZE,
+		.cra_ctxsize		= sizeof(struct dsp_crypto_ctx),
+		.cra_alignmask		= 0,
+		.cra_module		= THIS_MODULE,
+		.cra_init		= dsp_crypto_sha256_cra_init,
+	}
+},
+};
+
+static void dsp_crypto_unregister_algs(int num_hashes)
+{
+	int i;
+
+	for (i = 0; i < num_hashes; i++)
+		crypto_unregister_ahash(&dsp_crypto_hash_algs[i]);
+
+	crypto_unregister_algs(dsp_crypto_algs, ARRAY_SIZE(dsp_crypto_algs));
+}
+
+/* register the algorithms, unless a DSP that was there already did */
+static int dsp_crypto_register_algs(struct device *dev)
+{
+	int ret = 0, i;
+
+	mutex_lock(&dsp_crypto_algs_lock);
+
+	if (dsp_crypto_algs_registered)
+		goto unlock;
+
+	ret = crypto_register_algs(dsp_crypto_algs,
+					ARRAY_SIZE(dsp_crypto_algs));
+	if (ret) {
+		dev_err(dev, "can't register ciphers: %d\n", ret);
+		goto unlock;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(dsp_crypto_hash_algs); i++) {
+		ret = crypto_register_ahash(&dsp_crypto_hash_algs[i]);
+		if (ret) {
+			dev_err(dev, "can't register %s: %d\n",
+				dsp_crypto_hash_algs[i].halg.base.cra_name,
+									ret);
+			dsp_crypto_unregister_algs(i);
+			goto unlock;
+		}
+	}
+
+	dsp_crypto_algs_registered = true;
+
+unlock:
+	mutex_unlock(&dsp_crypto_algs_lock);
+	return ret;
+}
+
+static int dsp_crypto_probe(struct rpmsg_channel *rpdev)
+{
+	struct dsp_crypto_dev *dev;
+	int ret;
+
+	dev = devm_kzalloc(&rpdev->dev, sizeof(*dev), GFP_KERNEL);
+	if (!dev)
+		return -ENOMEM;
+
+	dev->rpdev = rpdev;
+	dev->dma_dev = rpmsg_get_dma_dev(rpdev);
+	spin_lock_init(&dev->lock);
+	crypto_init_queue(&dev->queue, DSP_CRYPTO_QUEUE_LEN);
+	INIT_LIST_HEAD(&dev->done);
+	INIT_WORK(&dev->submit_work, dsp_crypto_submit_work);
+	tasklet_init(&dev->done_task, dsp_crypto_done_task,
+						(unsigned long)dev);
+
+	ret = dsp_crypto_register_algs(&rpdev->dev);
+	if (ret)
+		return ret;
+
+	/* the callback may fire as soon as jobs are submitted */
+	dev_set_drvdata(&rpdev->dev, dev);
+
+	spin_lock_irq(&dsp_crypto_lock);
+	if (dsp_crypto)
+		ret = -EBUSY;
+	else
+		dsp_crypto = dev;
+	spin_unlock_irq(&dsp_crypto_lock);
+
+	if (ret) {
+		dev_err(&rpdev->dev, "another DSP serves the requests\n");
+		dev_set_drvdata(&rpdev->dev, NULL);
+		return ret;
+	}
+
+	dev_info(&rpdev->dev, "DSP crypto offload ready\n");
+
+	return 0;
+}
+
+static void __devexit dsp_crypto_remove(struct rpmsg_channel *rpdev)
+{
+	struct dsp_crypto_dev *dev = dev_get_drvdata(&rpdev->dev);
+	struct crypto_async_request *req, *backlog;
+	int i;
+
+	/* no more requests are queued */
+	spin_lock_irq(&dsp_crypto_lock);
+	dsp_crypto = NULL;
+	spin_unlock_irq(&dsp_crypto_lock);
+
+	/* the callback must not touch the DSP anymore (see rpmsg_char) */
+	mutex_lock(&rpdev->ept->cb_lock);
+	dev_set_drvdata(&rpdev->dev, NULL);
+	mutex_unlock(&rpdev->ept->cb_lock);
+
+	cancel_work_sync(&dev->submit_work);
+
+	/* the DSP won't be done with anything now */
+	spin_lock_irq(&dev->lock);
+
+	for (i = 0; i < DSP_CRYPTO_MAX_JOBS; i++)
+		if (dev->slots[i].req)
+			dsp_crypto_put_slot(dev, &dev->slots[i], -ENODEV);
+
+	while (true) {
+		backlog = crypto_get_backlog(&dev->queue);
+		req = crypto_dequeue_request(&dev->queue);
+		if (!req)
+			break;
+
+		if (backlog) {
+			spin_unlock_irq(&dev->lock);
+			backlog->complete(backlog, -EINPROGRESS);
+			spin_lock_irq(&dev->lock);
+		}
+
+		dsp_crypto_req_done(dev, req, -ENODEV);
+	}
+
+	spin_unlock_irq(&dev->lock);
+
+	tasklet_kill(&dev->done_task);
+
+	local_bh_disable();
+	dsp_crypto_done_task((unsigned long)dev);
+	local_bh_enable();
+}
+
+static struct rpmsg_device_id dsp_crypto_id_table[] = {
+	{ .name	= DSP_CRYPTO_NAME },
+	{ },
+};
+MODULE_DEVICE_TABLE(rpmsg, dsp_crypto_id_table);
+
+static struct rpmsg_driver dsp_crypto_driver = {
+	.drv.name	= KBUILD_MODNAME,
+	.drv.owner	= THIS_MODULE,
+	.id_table	= dsp_crypto_id_table,
+	.probe		= dsp_crypto_probe,
+	.callback	= dsp_crypto_cb,
+	.remove		= __devexit_p(dsp_crypto_remove),
+};
+
+static int __init dsp_crypto_init(void)
+{
+	return register_rpmsg_driver(&dsp_crypto_driver);
+}
+module_init(dsp_crypto_init);
+
+static void __exit dsp_crypto_exit(void)
+{
+	unregister_rpmsg_driver(&dsp_crypto_driver);
+
+	if (dsp_crypto_algs_registered)
+		dsp_crypto_unregister_algs(ARRAY_SIZE(dsp_crypto_hash_algs));
+}
+module_exit(dsp_crypto_exit);
+
+MODULE_DESCRIPTION("Cipher and hash offload to the OMAP DSP");
+MODULE_LICENSE("GPL v2");
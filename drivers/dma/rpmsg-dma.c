@@ -0,0 +1,776 @@
+/*
+ * DMA offload to remote processors, over rpmsg
+ *
+ * Remote processors with a DMA controller of their own (and bandwidth to
+ * spare) announce an "rpmsg-dma" rpmsg channel, through which this driver
+ * registers a dmaengine device per remote processor, whose channels do
+ * memcpy and scatter-gather copies. Host clients use them as they'd use
+ * any other dmaengine device (e.g. through async_tx).
+ *
+ * The descriptors clients issue are handed to the remote processor by a
+ * work item, several per message: each is described by a job, right in the
+ * rpmsg tx buffer, along with a table of its source and destination
+ * segments. The remote processor reports the jobs it's done, again several
+ * per message, and up to 'max_in_flight' jobs are with it at once.
+ *
+ * The buffers are mapped by the clients with the dmaengine device, which
+ * is the device the rpmsg buffers come from (see rpmsg_get_dma_dev()), so
+ * the remote processor reaches them at their dma addresses (i.e. through
+ * its iommu, if it has one).
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+#include <linux/scatterlist.h>
+#include <linux/dmaengine.h>
+#include <linux/rpmsg.h>
+
+#include "virt-dma.h"
+
+#define RPMSG_DMA_NAME		"rpmsg-dma"
+
+/* the most channels a remote processor may provide */
+#define RPMSG_DMA_MAX_CHANNELS	16
+
+/* the most jobs a remote processor may ever get at once */
+#define RPMSG_DMA_MAX_JOBS	64
+
+/* the payload of the default rpmsg buffers, if the transport doesn't tell */
+#define RPMSG_DMA_DEF_MTU	496
+
+static unsigned int channels = 4;
+module_param(channels, uint, 0444);
+MODULE_PARM_DESC(channels, "Number of dma channels of each remote processor");
+
+static unsigned int max_in_flight = 32;
+module_param(max_in_flight, uint, 0644);
+MODULE_PARM_DESC(max_in_flight, "Max number of jobs a remote gets at once");
+
+/**
+ * struct rpmsg_dma_sge - a segment of the source or destination of a job
+ * @da: its address
+ * @len: its length, in bytes
+ */
+struct rpmsg_dma_sge {
+	u32 da;
+	u32 len;
+} __packed;
+
+/**
+ * struct rpmsg_dma_job - a job, as handed to the remote processor
+ * @id: the number of the job, echoed back when it's done
+ * @chan: the channel of the job
+ * @src_nents: number of segments of the source
+ * @dst_nents: number of segments of the destination
+ * @reserved: reserved (zero)
+ * @len: how many bytes to copy
+ * @sge: the segments of the source, followed by those of the destination
+ *
+ * The jobs of a channel are to be done in the order they're handed over.
+ */
+struct rpmsg_dma_job {
+	u32 id;
+	u8 chan;
+	u8 src_nents;
+	u8 dst_nents;
+	u8 reserved;
+	u32 len;
+	struct rpmsg_dma_sge sge[0];
+} __packed;
+
+/**
+ * struct rpmsg_dma_msg - a batch of jobs (sent by the host)
+ * @num: number of jobs
+ * @jobs: the jobs, each right after the segments of the previous one
+ */
+struct rpmsg_dma_msg {
+	u32 num;
+	u8 jobs[0];
+} __packed;
+
+/**
+ * struct rpmsg_dma_done - a job is done
+ * @id: the number of the job
+ * @status: 0 on success, or a negative error code
+ */
+struct rpmsg_dma_done {
+	u32 id;
+	s32 status;
+} __packed;
+
+/**
+ * struct rpmsg_dma_done_msg - a batch of jobs done (sent by the remote)
+ * @num: number of @done
+ * @done: the jobs which are done
+ */
+struct rpmsg_dma_done_msg {
+	u32 num;
+	struct rpmsg_dma_done done[0];
+} __packed;
+
+/**
+ * struct rpmsg_dma_desc - a descriptor
+ * @vd: the virtual descriptor
+ * @id: the number of its job, once it's handed over
+ * @len: how many bytes to copy
+ * @src_nents: number of segments of the source
+ * @dst_nents: number of segments of the destination
+ * @done: the remote processor is done with it
+ * @status: how it went, once it's done
+ * @sge: the segments of the source, followed by those of the destination
+ */
+struct rpmsg_dma_desc {
+	struct virt_dma_desc vd;
+	u32 id;
+	size_t len;
+	unsigned int src_nents;
+	unsigned int dst_nents;
+	bool done;
+	int status;
+	struct rpmsg_dma_sge sge[0];
+};
+
+/**
+ * struct rpmsg_dma_chan - a channel
+ * @vc: the virtual channel
+ * @index: the index of the channel, as the remote processor knows it
+ * @seq: sequence number of the next job of the channel
+ * @active: the descriptors the remote processor was handed, in order
+ *	    (protected by vc.lock)
+ */
+struct rpmsg_dma_chan {
+	struct virt_dma_chan vc;
+	unsigned int index;
+	u32 seq;
+	struct list_head active;
+};
+
+/**
+ * struct rpmsg_dma_dev - the dma engine of a remote processor
+ * @ddev: the dmaengine device
+ * @rpdev: the rpmsg channel of the remote processor
+ * @submit_work: hands the issued descriptors over to the remote processor
+ * @in_flight: how many jobs the remote processor has
+ * @mtu: the most bytes a message holds
+ * @max_sge: the most segments a descriptor may have
+ * @gone: the remote processor is going away: nothing is handed over anymore
+ *	  (set under the vc.lock of every channel)
+ * @num_chans: number of @chans
+ * @chans: the channels
+ */
+struct rpmsg_dma_dev {
+	struct dma_device ddev;
+	struct rpmsg_channel *rpdev;
+	struct work_struct submit_work;
+	atomic_t in_flight;
+	int mtu;
+	unsigned int max_sge;
+	bool gone;
+	unsigned int num_chans;
+	struct rpmsg_dma_chan chans[0];
+};
+
+static inline struct rpmsg_dma_dev *to_rpmsg_dma_dev(struct dma_device *d)
+{
+	return container_of(d, struct rpmsg_dma_dev, ddev);
+}
+
+static inline struct rpmsg_dma_chan *to_rpmsg_dma_chan(struct dma_chan *c)
+{
+	return container_of(c, struct rpmsg_dma_chan, vc.chan);
+}
+
+static inline struct rpmsg_dma_desc *
+to_rpmsg_dma_desc(struct dma_async_tx_descriptor *tx)
+{
+	return container_of(tx, struct rpmsg_dma_desc, vd.tx);
+}
+
+static void rpmsg_dma_desc_free(struct virt_dma_desc *vd)
+{
+	kfree(container_of(vd, struct rpmsg_dma_desc, vd));
+}
+
+/* the room the job of @d takes in a message */
+static inline int rpmsg_dma_job_size(struct rpmsg_dma_desc *d)
+{
+	return sizeof(struct rpmsg_dma_job) +
+		(d->src_nents + d->dst_nents) * sizeof(struct rpmsg_dma_sge);
+}
+
+/* allocate a descriptor of up to @nents segments, for @chan */
+static struct rpmsg_dma_desc *rpmsg_dma_alloc_desc(struct dma_chan *chan,
+							unsigned int nents)
+{
+	struct rpmsg_dma_dev *rd = to_rpmsg_dma_dev(chan->device);
+
+	if (rd->gone || !nents || nents > rd->max_sge)
+		return NULL;
+
+	return kzalloc(sizeof(struct rpmsg_dma_desc) +
+			nents * sizeof(struct rpmsg_dma_sge), GFP_NOWAIT);
+}
+
+/* add a segment to @d: the remote processor only has 32-bit addresses */
+static int rpmsg_dma_add_sge(struct rpmsg_dma_desc *d, unsigned int i,
+					dma_addr_t addr, size_t len)
+{
+	if (!len || (u64)addr + len - 1 > 0xffffffffULL)
+		return -EINVAL;
+
+	d->sge[i].da = addr;
+	d->sge[i].len = len;
+
+	return 0;
+}
+
+static struct dma_async_tx_descriptor *
+rpmsg_dma_prep_memcpy(struct dma_chan *chan, dma_addr_t dest, dma_addr_t src,
+					size_t len, unsigned long flags)
+{
+	struct rpmsg_dma_chan *c = to_rpmsg_dma_chan(chan);
+	struct rpmsg_dma_desc *d;
+
+	d = rpmsg_dma_alloc_desc(chan, 2);
+	if (!d)
+		return NULL;
+
+	if (rpmsg_dma_add_sge(d, 0, src, len) ||
+				rpmsg_dma_add_sge(d, 1, dest, len)) {
+		kfree(d);
+		return NULL;
+	}
+
+	d->src_nents = 1;
+	d->dst_nents = 1;
+	d->len = len;
+
+	return vchan_tx_prep(&c->vc, &d->vd, flags);
+}
+
+/* add the segments of @sgl to @d, after its @first ones */
+static int rpmsg_dma_add_sg(struct rpmsg_dma_desc *d, unsigned int first,
+		struct scatterlist *sgl, unsigned int nents, size_t *len)
+{
+	struct scatterlist *sg;
+	int i, ret;
+
+	*len = 0;
+	for_each_sg(sgl, sg, nents, i) {
+		ret = rpmsg_dma_add_sge(d, first + i, sg_dma_address(sg),
+							sg_dma_len(sg));
+		if (ret)
+			return ret;
+		*len += sg_dma_len(sg);
+	}
+
+	return 0;
+}
+
+static struct dma_async_tx_descriptor *
+rpmsg_dma_prep_sg(struct dma_chan *chan,
+		struct scatterlist *dst_sg, unsigned int dst_nents,
+		struct scatterlist *src_sg, unsigned int src_nents,
+		unsigned long flags)
+{
+	struct rpmsg_dma_chan *c = to_rpmsg_dma_chan(chan);
+	struct rpmsg_dma_desc *d;
+	size_t src_len, dst_len;
+
+	if (!src_nents || !dst_nents)
+		return NULL;
+
+	d = rpmsg_dma_alloc_desc(chan, src_nents + dst_nents);
+	if (!d)
+		return NULL;
+
+	if (rpmsg_dma_add_sg(d, 0, src_sg, src_nents, &src_len) ||
+		rpmsg_dma_add_sg(d, src_nents, dst_sg, dst_nents, &dst_len) ||
+		min(src_len, dst_len) > 0xffffffffULL) {
+		kfree(d);
+		return NULL;
+	}
+
+	/* the copy stops at the end of the shortest of the two lists */
+	d->src_nents = src_nents;
+	d->dst_nents = dst_nents;
+	d->len = min(src_len, dst_len);
+
+	return vchan_tx_prep(&c->vc, &d->vd, flags);
+}
+
+/*
+ * complete the descriptors the remote processor is done with, in order,
+ * with c->vc.lock held: those done ahead of their predecessors wait for them
+ */
+static void rpmsg_dma_retire(struct rpmsg_dma_chan *c)
+{
+	struct rpmsg_dma_dev *rd = to_rpmsg_dma_dev(c->vc.chan.device);
+	struct rpmsg_dma_desc *d, *tmp;
+
+	list_for_each_entry_safe(d, tmp, &c->active, vd.node) {
+		if (!d->done)
+			break;
+
+		list_del(&d->vd.node);
+		atomic_dec(&rd->in_flight);
+
+		/* dmaengine has no way to tell the client, so we do */
+		if (d->status)
+			dev_err_ratelimited(rd->ddev.dev,
+					"dma%dchan%u: transfer %d failed: %d\n",
+					rd->ddev.dev_id, c->index,
+					d->vd.tx.cookie, d->status);
+
+		vchan_cookie_complete(&d->vd);
+	}
+}
+
+/*
+ * take issued descriptors off the channels, a channel after another, as
+ * long as their jobs fit in @msg and the remote processor may get them:
+ * returns the length of @msg
+ */
+static int rpmsg_dma_fill(struct rpmsg_dma_dev *rd, struct rpmsg_dma_msg *msg)
+{
+	unsigned int max = clamp_t(unsigned int, max_in_flight, 1,
+							RPMSG_DMA_MAX_JOBS);
+	struct rpmsg_dma_desc *d;
+	struct virt_dma_desc *vd;
+	struct rpmsg_dma_chan *c;
+	struct rpmsg_dma_job *job;
+	int len = sizeof(*msg), i;
+	bool more = true;
+
+	msg->num = 0;
+
+	while (more) {
+		more = false;
+
+		for (i = 0; i < rd->num_chans; i++) {
+			if (atomic_read(&rd->in_flight) >= max)
+				return len;
+
+			c = &rd->chans[i];
+
+			spin_lock_irq(&c->vc.lock);
+
+			vd = vchan_next_desc(&c->vc);
+			d = vd ? to_rpmsg_dma_desc(&vd->tx) : NULL;
+			if (!d || len + rpmsg_dma_job_size(d) > rd->mtu) {
+				spin_unlock_irq(&c->vc.lock);
+				continue;
+			}
+
+			list_move_tail(&vd->node, &c->active);
+			d->id = c->seq++ * RPMSG_DMA_MAX_CHANNELS + c->index;
+			atomic_inc(&rd->in_flight);
+
+			spin_unlock_irq(&c->vc.lock);
+
+			/* it's ours until the remote processor is done */
+			job = (struct rpmsg_dma_job *)((u8 *)msg + len);
+			job->id = d->id;
+			job->chan = c->index;
+			job->src_nents = d->src_nents;
+			job->dst_nents = d->dst_nents;
+			job->reserved = 0;
+			job->len = d->len;
+			memcpy(job->sge, d->sge, (d->src_nents + d->dst_nents) *
+							sizeof(job->sge[0]));
+
+			len += rpmsg_dma_job_size(d);
+			msg->num++;
+			more = true;
+		}
+	}
+
+	return len;
+}
+
+/*
+ * the jobs of @msg didn't make it to the remote processor: their
+ * descriptors are completed (as failed) in order
+ */
+static void rpmsg_dma_drop(struct rpmsg_dma_dev *rd, struct rpmsg_dma_msg *msg,
+								int err)
+{
+	struct rpmsg_dma_desc *d;
+	struct rpmsg_dma_chan *c;
+	struct rpmsg_dma_job *job;
+	int len = sizeof(*msg);
+	u32 i;
+
+	for (i = 0; i < msg->num; i++) {
+		job = (struct rpmsg_dma_job *)((u8 *)msg + len);
+		len += sizeof(*job) + (job->src_nents + job->dst_nents) *
+							sizeof(job->sge[0]);
+
+		c = &rd->chans[job->chan];
+
+		spin_lock_irq(&c->vc.lock);
+		list_for_each_entry(d, &c->active, vd.node) {
+			if (d->id == job->id) {
+				d->status = err;
+				d->done = true;
+				break;
+			}
+		}
+		rpmsg_dma_retire(c);
+		spin_unlock_irq(&c->vc.lock);
+	}
+}
+
+/*
+ * hand the issued descriptors over to the remote processor, a batch per
+ * message, until either they're all handed over, or the remote processor
+ * has as many as it may get (jobs that are done will bring us back)
+ */
+static void rpmsg_dma_submit_work(struct work_struct *work)
+{
+	struct rpmsg_dma_dev *rd = container_of(work, struct rpmsg_dma_dev,
+								submit_work);
+	struct rpmsg_dma_msg *msg;
+	int len, ret;
+
+	while (true) {
+		/* the batch is built right in the tx buffer */
+		msg = rpmsg_alloc_tx_buf(rd->rpdev, rd->mtu, true);
+		if (IS_ERR(msg)) {
+			dev_err(&rd->rpdev->dev, "no tx buffer: %ld\n",
+								PTR_ERR(msg));
+			return;
+		}
+
+		len = rpmsg_dma_fill(rd, msg);
+		if (!msg->num) {
+			rpmsg_free_tx_buf(rd->rpdev, msg);
+			return;
+		}
+
+		ret = rpmsg_send_buf(rd->rpdev, msg, len);
+		if (ret) {
+			dev_err(&rd->rpdev->dev, "can't submit jobs: %d\n",
+									ret);
+			rpmsg_dma_drop(rd, msg, ret);
+		}
+	}
+}
+
+/* some jobs are done */
+static void rpmsg_dma_cb(struct rpmsg_channel *rpdev, void *data, int len,
+							void *priv, u32 src)
+{
+	struct rpmsg_dma_dev *rd = dev_get_drvdata(&rpdev->dev);
+	struct rpmsg_dma_done_msg *msg = data;
+	struct rpmsg_dma_done *done;
+	struct rpmsg_dma_desc *d;
+	struct rpmsg_dma_chan *c;
+	unsigned long flags;
+	bool found;
+	u32 i;
+
+	if (!rd || len < sizeof(*msg) ||
+		msg->num > (len - sizeof(*msg)) / sizeof(msg->done[0])) {
+		dev_warn(&rpdev->dev, "unexpected message, len %d\n", len);
+		return;
+	}
+
+	for (i = 0; i < msg->num; i++) {
+		done = &msg->done[i];
+		found = false;
+
+		if (done->id % RPMSG_DMA_MAX_CHANNELS >= rd->num_chans) {
+			dev_warn(&rpdev->dev, "unexpected job %u\n", done->id);
+			continue;
+		}
+
+		c = &rd->chans[done->id % RPMSG_DMA_MAX_CHANNELS];
+
+		spin_lock_irqsave(&c->vc.lock, flags);
+
+		list_for_each_entry(d, &c->active, vd.node) {
+			if (d->id == done->id && !d->done) {
+				d->status = done->status;
+				d->done = true;
+				found = true;
+				break;
+			}
+		}
+
+		if (found)
+			rpmsg_dma_retire(c);
+
+		spin_unlock_irqrestore(&c->vc.lock, flags);
+
+		if (!found)
+			dev_warn(&rpdev->dev, "unexpected job %u\n", done->id);
+	}
+
+	/* more descriptors may be handed over now */
+	schedule_work(&rd->submit_work);
+}
+
+static void rpmsg_dma_issue_pending(struct dma_chan *chan)
+{
+	struct rpmsg_dma_dev *rd = to_rpmsg_dma_dev(chan->device);
+	struct rpmsg_dma_chan *c = to_rpmsg_dma_chan(chan);
+	unsigned long flags;
+
+	spin_lock_irqsave(&c->vc.lock, flags);
+	if (vchan_issue_pending(&c->vc) && !rd->gone)
+		schedule_work(&rd->submit_work);
+	spin_unlock_irqrestore(&c->vc.lock, flags);
+}
+
+static enum dma_status rpmsg_dma_tx_status(struct dma_chan *chan,
+			dma_cookie_t cookie, struct dma_tx_state *txstate)
+{
+	struct rpmsg_dma_chan *c = to_rpmsg_dma_chan(chan);
+	struct virt_dma_desc *vd;
+	struct rpmsg_dma_desc *d;
+	enum dma_status ret;
+	unsigned long flags;
+
+	ret = dma_cookie_status(chan, cookie, txstate);
+	if (ret == DMA_SUCCESS || !txstate)
+		return ret;
+
+	/* the remote processor doesn't tell how far it got */
+	spin_lock_irqsave(&c->vc.lock, flags);
+
+	vd = vchan_find_desc(&c->vc, cookie);
+	if (vd) {
+		dma_set_residue(txstate, to_rpmsg_dma_desc(&vd->tx)->len);
+	} else {
+		list_for_each_entry(d, &c->active, vd.node) {
+			if (d->vd.tx.cookie == cookie) {
+				dma_set_residue(txstate, d->len);
+				break;
+			}
+		}
+	}
+
+	spin_unlock_irqrestore(&c->vc.lock, flags);
+
+	return ret;
+}
+
+/*
+ * drop the descriptors of a channel which weren't handed over yet: the
+ * remote processor can't be told to stop those it has, so they're left to
+ * complete, but without calling back their clients
+ */
+static int rpmsg_dma_terminate_all(struct rpmsg_dma_chan *c)
+{
+	struct rpmsg_dma_desc *d;
+	unsigned long flags;
+	LIST_HEAD(head);
+
+	spin_lock_irqsave(&c->vc.lock, flags);
+
+	vchan_get_all_descriptors(&c->vc, &head);
+
+	list_for_each_entry(d, &c->active, vd.node) {
+		d->vd.tx.callback = NULL;
+		d->vd.tx.callback_param = NULL;
+	}
+
+	spin_unlock_irqrestore(&c->vc.lock, flags);
+
+	vchan_dma_desc_free_list(&c->vc, &head);
+
+	return 0;
+}
+
+static int rpmsg_dma_control(struct dma_chan *chan, enum dma_ctrl_cmd cmd,
+							unsigned long arg)
+{
+	struct rpmsg_dma_chan *c = to_rpmsg_dma_chan(chan);
+
+	switch (cmd) {
+	case DMA_TERMINATE_ALL:
+		return rpmsg_dma_terminate_all(c);
+	default:
+		return -ENXIO;
+	}
+}
+
+static int rpmsg_dma_alloc_chan_resources(struct dma_chan *chan)
+{
+	return 0;
+}
+
+static void rpmsg_dma_free_chan_resources(struct dma_chan *chan)
+{
+	struct rpmsg_dma_chan *c = to_rpmsg_dma_chan(chan);
+
+	rpmsg_dma_terminate_all(c);
+	vchan_free_chan_resources(&c->vc);
+}
+
+static void rpmsg_dma_free(struct rpmsg_dma_dev *rd)
+{
+	int i;
+
+	for (i = 0; i < rd->num_chans; i++) {
+		list_del(&rd->chans[i].vc.chan.device_node);
+		tasklet_kill(&rd->chans[i].vc.task);
+	}
+
+	kfree(rd);
+}
+
+static int rpmsg_dma_probe(struct rpmsg_channel *rpdev)
+{
+	unsigned int num = clamp_t(unsigned int, channels, 1,
+						RPMSG_DMA_MAX_CHANNELS);
+	struct rpmsg_dma_dev *rd;
+	struct rpmsg_dma_chan *c;
+	int ret, i;
+
+	rd = kzalloc(sizeof(*rd) + num * sizeof(rd->chans[0]), GFP_KERNEL);
+	if (!rd)
+		return -ENOMEM;
+
+	rd->rpdev = rpdev;
+	atomic_set(&rd->in_flight, 0);
+	INIT_WORK(&rd->submit_work, rpmsg_dma_submit_work);
+
+	/* a job must fit in a message on its own */
+	rd->mtu = rpmsg_get_mtu(rpdev);
+	if (rd->mtu < 0)
+		rd->mtu = RPMSG_DMA_DEF_MTU;
+	if (rd->mtu >= (int)(sizeof(struct rpmsg_dma_msg) +
+				sizeof(struct rpmsg_dma_job)))
+		rd->max_sge = min_t(unsigned int, 255,
+			(rd->mtu - sizeof(struct rpmsg_dma_msg) -
+			sizeof(struct rpmsg_dma_job)) /
+			sizeof(struct rpmsg_dma_sge));
+	if (rd->max_sge < 2) {
+		dev_err(&rpdev->dev, "%d-byte rpmsg buffers are too small\n",
+								rd->mtu);
+		kfree(rd);
+		return -EINVAL;
+	}
+
+	dma_cap_set(DMA_MEMCPY, rd->ddev.cap_mask);
+	dma_cap_set(DMA_SG, rd->ddev.cap_mask);
+	rd->ddev.device_alloc_chan_resources = rpmsg_dma_alloc_chan_resources;
+	rd->ddev.device_free_chan_resources = rpmsg_dma_free_chan_resources;
+	rd->ddev.device_prep_dma_memcpy = rpmsg_dma_prep_memcpy;
+	rd->ddev.device_prep_dma_sg = rpmsg_dma_prep_sg;
+	rd->ddev.device_tx_status = rpmsg_dma_tx_status;
+	rd->ddev.device_issue_pending = rpmsg_dma_issue_pending;
+	rd->ddev.device_control = rpmsg_dma_control;
+	rd->ddev.dev = rpmsg_get_dma_dev(rpdev);
+	INIT_LIST_HEAD(&rd->ddev.channels);
+
+	for (i = 0; i < num; i++) {
+		c = &rd->chans[i];
+		c->index = i;
+		INIT_LIST_HEAD(&c->active);
+		c->vc.desc_free = rpmsg_dma_desc_free;
+		vchan_init(&c->vc, &rd->ddev);
+		rd->ddev.chancnt++;
+	}
+	rd->num_chans = num;
+
+	/* the callback may fire as soon as jobs are submitted */
+	dev_set_drvdata(&rpdev->dev, rd);
+
+	ret = dma_async_device_register(&rd->ddev);
+	if (ret) {
+		dev_err(&rpdev->dev, "can't register dma device: %d\n", ret);
+		dev_set_drvdata(&rpdev->dev, NULL);
+		rpmsg_dma_free(rd);
+		return ret;
+	}
+
+	dev_info(&rpdev->dev, "%u dma channels, up to %u segments a copy\n",
+							num, rd->max_sge);
+
+	return 0;
+}
+
+static void __devexit rpmsg_dma_remove(struct rpmsg_channel *rpdev)
+{
+	struct rpmsg_dma_dev *rd = dev_get_drvdata(&rpdev->dev);
+	struct rpmsg_dma_desc *d;
+	struct rpmsg_dma_chan *c;
+	int i;
+
+	/* nothing is handed over anymore */
+	for (i = 0; i < rd->num_chans; i++) {
+		spin_lock_irq(&rd->chans[i].vc.lock);
+		rd->gone = true;
+		spin_unlock_irq(&rd->chans[i].vc.lock);
+	}
+
+	/* the callback must not touch the remote processor anymore */
+	mutex_lock(&rpdev->ept->cb_lock);
+	dev_set_drvdata(&rpdev->dev, NULL);
+	mutex_unlock(&rpdev->ept->cb_lock);
+
+	cancel_work_sync(&rd->submit_work);
+
+	/* it won't be done with anything now */
+	for (i = 0; i < rd->num_chans; i++) {
+		c = &rd->chans[i];
+
+		spin_lock_irq(&c->vc.lock);
+		list_for_each_entry(d, &c->active, vd.node) {
+			if (!d->done) {
+				d->status = -ENODEV;
+				d->done = true;
+			}
+		}
+		rpmsg_dma_retire(c);
+		spin_unlock_irq(&c->vc.lock);
+	}
+
+	dma_async_device_unregister(&rd->ddev);
+	rpmsg_dma_free(rd);
+}
+
+static struct rpmsg_device_id rpmsg_dma_id_table[] = {
+	{ .name	= RPMSG_DMA_NAME },
+	{ },
+};
+MODULE_DEVICE_TABLE(rpmsg, rpmsg_dma_id_table);
+
+static struct rpmsg_driver rpmsg_dma_driver = {
+	.drv.name	= KBUILD_MODNAME,
+	.drv.owner	= THIS_MODULE,
+	.id_table	= rpmsg_dma_id_table,
+	.probe		= rpmsg_dma_probe,
+	.callback	= rpmsg_dma_cb,
+	.remove		= __devexit_p(rpmsg_dma_remove),
+};
+
+static int __init rpmsg_dma_init(void)
+{
+	return register_rpmsg_driver(&rpmsg_dma_driver);
+}
+module_init(rpmsg_dma_init);
+
+static void __exit rpmsg_dma_exit(void)
+{
+	unregister_rpmsg_driver(&rpmsg_dma_driver);
+}
+module_exit(rpmsg_dma_exit);
+
+MODULE_DESCRIPTION("DMA offload to remote processors, over rpmsg");
+MODULE_LICENSE("GPL v2");
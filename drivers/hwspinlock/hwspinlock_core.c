@@ -27,6 +27,12 @@
 #include <linux/hwspinlock.h>
 #include <linux/pm_runtime.h>
 #include <linux/mutex.h>
+#include <linux/sched.h>
+#include <linux/wait.h>
+#include <linux/delay.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/math64.h>
 
 #include "hwspinlock_internal.h"
 
@@ -59,6 +65,17 @@ static RADIX_TREE(hwspinlock_tree, GFP_KERNEL);
  */
 static DEFINE_MUTEX(hwspinlock_tree_lock);
 
+/* bounds of the delay between two attempts, with adaptive backoff */
+#define HWSPINLOCK_BACKOFF_MIN_NS	100
+#define HWSPINLOCK_BACKOFF_MAX_NS	10000
+
+static bool backoff;
+module_param(backoff, bool, 0444);
+MODULE_PARM_DESC(backoff, "spin on busy locks with an adaptive backoff");
+
+/* the root of the debugfs directories of the locks */
+static struct dentry *hwspinlock_dbg;
+
 
 /**
  * __hwspin_trylock() - attempt to lock a specific hwspinlock
@@ -121,6 +138,8 @@ int __hwspin_trylock(struct hwspinlock *hwlock, int mode, unsigned long *flags)
 
 	/* if hwlock is already taken, undo spin_trylock_* and exit */
 	if (!ret) {
+		hwlock->stats.remote_busy++;
+
 		if (mode == HWLOCK_IRQSTATE)
 			spin_unlock_irqrestore(&hwlock->lock, *flags);
 		else if (mode == HWLOCK_IRQ)
@@ -143,10 +162,86 @@ int __hwspin_trylock(struct hwspinlock *hwlock, int mode, unsigned long *flags)
 	 */
 	mb();
 
+	hwlock->stats.acquired++;
+
 	return 0;
 }
 EXPORT_SYMBOL_GPL(__hwspin_trylock);
 
+/*
+ * Account for a wait on @hwlock which started at @start, and eventually
+ * took it. Called with hwlock->lock taken, i.e. with @hwlock locked.
+ */
+static void hwspin_lock_account(struct hwspinlock *hwlock, u64 start,
+								bool slept)
+{
+	struct hwspinlock_stats *stats = &hwlock->stats;
+	u64 ns = local_clock() - start;
+
+	if (slept) {
+		stats->waited++;
+		stats->wait_ns += ns;
+		return;
+	}
+
+	stats->contended++;
+	stats->spin_ns += ns;
+	if (ns > stats->max_spin_ns)
+		stats->max_spin_ns = ns;
+
+	/* what the next backoff starts from */
+	ns = min_t(u64, ns, 8 * HWSPINLOCK_BACKOFF_MAX_NS);
+	hwlock->spin_avg_ns = (7 * hwlock->spin_avg_ns + (u32)ns) / 8;
+}
+
+/*
+ * Account for a wait on @hwlock which started at @start, and timed out.
+ * The lock's spinlock may be held by whoever we interrupted, in which case
+ * this one goes unaccounted for.
+ */
+static void hwspin_lock_account_timeout(struct hwspinlock *hwlock, u64 start,
+								bool slept)
+{
+	struct hwspinlock_stats *stats = &hwlock->stats;
+	u64 ns = local_clock() - start;
+	unsigned long flags;
+
+	if (!spin_trylock_irqsave(&hwlock->lock, flags))
+		return;
+
+	stats->timeouts++;
+	if (slept)
+		stats->wait_ns += ns;
+	else
+		stats->spin_ns += ns;
+
+	spin_unlock_irqrestore(&hwlock->lock, flags);
+}
+
+/*
+ * The first delay of an adaptive backoff: a fraction of how long waiters
+ * usually spin on @hwlock, so short holds are caught early. The delay then
+ * doubles with every attempt, so long holds (typically by a remote
+ * processor) aren't polled for over the interconnect all along.
+ */
+static u32 hwspin_lock_backoff_start(struct hwspinlock *hwlock)
+{
+	return clamp_t(u32, ACCESS_ONCE(hwlock->spin_avg_ns) / 8,
+			HWSPINLOCK_BACKOFF_MIN_NS, HWSPINLOCK_BACKOFF_MAX_NS);
+}
+
+/* let sleeping waiters know @hwlock was released */
+static void hwspin_lock_released(struct hwspinlock *hwlock)
+{
+	atomic_inc(&hwlock->releases);
+
+	/* pairs with the barrier of wait_event_timeout() */
+	smp_mb__after_atomic_inc();
+
+	if (waitqueue_active(&hwlock->waitq))
+		wake_up(&hwlock->waitq);
+}
+
 /**
  * __hwspin_lock_timeout() - lock an hwspinlock with timeout limit
  * @hwlock: the hwspinlock to be locked
@@ -170,6 +265,10 @@ EXPORT_SYMBOL_GPL(__hwspin_trylock);
  * to choose the appropriate @mode of operation, exactly the same way users
  * should decide between spin_lock, spin_lock_irq and spin_lock_irqsave.
  *
+ * With adaptive backoff (see the backoff debugfs entry of @hwlock), the
+ * delay between two attempts starts short, and doubles with each of them,
+ * up to HWSPINLOCK_BACKOFF_MAX_NS.
+ *
  * Returns 0 when the @hwlock was successfully taken, and an appropriate
  * error code otherwise (most notably -ETIMEDOUT if the @hwlock is still
  * busy after @timeout msecs). The function will never sleep.
@@ -179,6 +278,8 @@ int __hwspin_lock_timeout(struct hwspinlock *hwlock, unsigned int to,
 {
 	int ret;
 	unsigned long expire;
+	u64 start = 0;
+	u32 delay = 0;
 
 	expire = msecs_to_jiffies(to) + jiffies;
 
@@ -188,25 +289,120 @@ int __hwspin_lock_timeout(struct hwspinlock *hwlock, unsigned int to,
 		if (ret != -EBUSY)
 			break;
 
+		/* it's contended: account for the time we spin on it */
+		if (!start) {
+			start = local_clock();
+			delay = hwspin_lock_backoff_start(hwlock);
+		}
+
 		/*
 		 * The lock is already taken, let's check if the user wants
 		 * us to try again
 		 */
-		if (time_is_before_eq_jiffies(expire))
+		if (time_is_before_eq_jiffies(expire)) {
+			hwspin_lock_account_timeout(hwlock, start, false);
 			return -ETIMEDOUT;
+		}
 
 		/*
-		 * Allow platform-specific relax handlers to prevent
-		 * hogging the interconnect (no sleeping, though)
+		 * Back off, or allow platform-specific relax handlers to
+		 * prevent hogging the interconnect (no sleeping, though)
 		 */
-		if (hwlock->bank->ops->relax)
+		if (hwlock->backoff) {
+			ndelay(delay);
+			delay = min_t(u32, 2 * delay,
+					HWSPINLOCK_BACKOFF_MAX_NS);
+		} else if (hwlock->bank->ops->relax) {
 			hwlock->bank->ops->relax(hwlock);
+		}
 	}
 
+	if (!ret && start)
+		hwspin_lock_account(hwlock, start, false);
+
 	return ret;
 }
 EXPORT_SYMBOL_GPL(__hwspin_lock_timeout);
 
+/**
+ * __hwspin_lock_wait() - lock an hwspinlock, sleeping while it's taken
+ * @hwlock: the hwspinlock to be locked
+ * @to: timeout value in msecs
+ * @mode: mode which controls whether local interrupts are disabled or not
+ * @flags: a pointer to where the caller's interrupt state will be saved at (if
+ *         requested)
+ *
+ * Same as __hwspin_lock_timeout(), except that the caller sleeps rather
+ * than spin while @hwlock is taken: it tries again as soon as the host
+ * releases @hwlock, or the remote processor tells it did (see
+ * hwspin_lock_notify()), and at every tick otherwise. It's meant for locks
+ * a remote processor may hold for long, when the host has nothing better
+ * to do than wait for them, but shouldn't burn a cpu doing so.
+ *
+ * Must be called from process context, since it may sleep. Upon a
+ * successful return from this function, preemption is disabled (and
+ * possibly local interrupts, too), just like with __hwspin_lock_timeout().
+ *
+ * Returns 0 when the @hwlock was successfully taken, and an appropriate
+ * error code otherwise (most notably -ETIMEDOUT if the @hwlock is still
+ * busy after @timeout msecs).
+ */
+int __hwspin_lock_wait(struct hwspinlock *hwlock, unsigned int to,
+					int mode, unsigned long *flags)
+{
+	unsigned long expire;
+	u64 start = 0;
+	int releases, ret;
+
+	might_sleep();
+
+	expire = msecs_to_jiffies(to) + jiffies;
+
+	for (;;) {
+		/* a release from now on is a reason to try again */
+		releases = atomic_read(&hwlock->releases);
+
+		ret = __hwspin_trylock(hwlock, mode, flags);
+		if (ret != -EBUSY)
+			break;
+
+		if (!start)
+			start = local_clock();
+
+		if (time_is_before_eq_jiffies(expire)) {
+			hwspin_lock_account_timeout(hwlock, start, true);
+			return -ETIMEDOUT;
+		}
+
+		/* the remote processor may not tell about its releases */
+		wait_event_timeout(hwlock->waitq,
+				atomic_read(&hwlock->releases) != releases, 1);
+	}
+
+	if (!ret && start)
+		hwspin_lock_account(hwlock, start, true);
+
+	return ret;
+}
+EXPORT_SYMBOL_GPL(__hwspin_lock_wait);
+
+/**
+ * hwspin_lock_notify() - tell that a remote processor released an hwspinlock
+ * @hwlock: the hwspinlock the remote processor released
+ *
+ * Should be called by whoever learns that a remote processor released
+ * @hwlock, e.g. from the interrupt of the hwspinlock device, if it raises
+ * one, or when the remote processor sends a message saying so, so that
+ * sleeping waiters (see __hwspin_lock_wait()) try again right away.
+ *
+ * Can be called from any context.
+ */
+void hwspin_lock_notify(struct hwspinlock *hwlock)
+{
+	hwspin_lock_released(hwlock);
+}
+EXPORT_SYMBOL_GPL(hwspin_lock_notify);
+
 /**
  * __hwspin_unlock() - unlock a specific hwspinlock
  * @hwlock: a previously-acquired hwspinlock which we want to unlock
@@ -254,9 +450,88 @@ void __hwspin_unlock(struct hwspinlock *hwlock, int mode, unsigned long *flags)
 		spin_unlock_irq(&hwlock->lock);
 	else
 		spin_unlock(&hwlock->lock);
+
+	/* only now may the sleeping waiters take it */
+	hwspin_lock_released(hwlock);
 }
 EXPORT_SYMBOL_GPL(__hwspin_unlock);
 
+static int hwspinlock_stats_show(struct seq_file *s, void *unused)
+{
+	struct hwspinlock *hwlock = s->private;
+	struct hwspinlock_stats stats;
+	unsigned long flags;
+
+	spin_lock_irqsave(&hwlock->lock, flags);
+	stats = hwlock->stats;
+	spin_unlock_irqrestore(&hwlock->lock, flags);
+
+	seq_printf(s, "acquired:    %llu\n", stats.acquired);
+	seq_printf(s, "contended:   %llu\n", stats.contended);
+	seq_printf(s, "waited:      %llu\n", stats.waited);
+	seq_printf(s, "timeouts:    %llu\n", stats.timeouts);
+	seq_printf(s, "remote busy: %llu\n", stats.remote_busy);
+	seq_printf(s, "spin:        %llu ns\n", stats.spin_ns);
+	seq_printf(s, "avg spin:    %llu ns\n", stats.contended ?
+			div64_u64(stats.spin_ns, stats.contended) : 0);
+	seq_printf(s, "max spin:    %llu ns\n", stats.max_spin_ns);
+	seq_printf(s, "wait:        %llu ns\n", stats.wait_ns);
+
+	return 0;
+}
+
+static int hwspinlock_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, hwspinlock_stats_show, inode->i_private);
+}
+
+/* any write resets the statistics */
+static ssize_t hwspinlock_stats_write(struct file *file,
+			const char __user *buf, size_t count, loff_t *ppos)
+{
+	struct seq_file *s = file->private_data;
+	struct hwspinlock *hwlock = s->private;
+	unsigned long flags;
+
+	spin_lock_irqsave(&hwlock->lock, flags);
+	memset(&hwlock->stats, 0, sizeof(hwlock->stats));
+	spin_unlock_irqrestore(&hwlock->lock, flags);
+
+	return count;
+}
+
+static const struct file_operations hwspinlock_stats_ops = {
+	.open		= hwspinlock_stats_open,
+	.read		= seq_read,
+	.write		= hwspinlock_stats_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+/* show the statistics of @hwlock, and let its backoff be set, in debugfs */
+static void hwspinlock_debugfs_add(struct hwspinlock *hwlock, int id)
+{
+	char name[12];
+
+	/* locks are registered early on, so create the root lazily */
+	mutex_lock(&hwspinlock_tree_lock);
+	if (!hwspinlock_dbg)
+		hwspinlock_dbg = debugfs_create_dir("hwspinlock", NULL);
+	mutex_unlock(&hwspinlock_tree_lock);
+
+	if (IS_ERR_OR_NULL(hwspinlock_dbg))
+		return;
+
+	snprintf(name, sizeof(name), "%d", id);
+	hwlock->dbg_dir = debugfs_create_dir(name, hwspinlock_dbg);
+	if (!hwlock->dbg_dir)
+		return;
+
+	debugfs_create_file("stats", 0600, hwlock->dbg_dir, hwlock,
+							&hwspinlock_stats_ops);
+	debugfs_create_bool("backoff", 0600, hwlock->dbg_dir, &hwlock->backoff);
+}
+
 static int hwspin_lock_register_single(struct hwspinlock *hwlock, int id)
 {
 	struct hwspinlock *tmp;
@@ -344,17 +619,24 @@ int hwspin_lock_register(struct hwspinlock_device *bank, struct device *dev,
 
 		spin_lock_init(&hwlock->lock);
 		hwlock->bank = bank;
+		hwlock->backoff = backoff;
+		atomic_set(&hwlock->releases, 0);
+		init_waitqueue_head(&hwlock->waitq);
 
 		ret = hwspin_lock_register_single(hwlock, base_id + i);
 		if (ret)
 			goto reg_failed;
+
+		hwspinlock_debugfs_add(hwlock, base_id + i);
 	}
 
 	return 0;
 
 reg_failed:
-	while (--i >= 0)
+	while (--i >= 0) {
 		hwspin_lock_unregister_single(base_id + i);
+		debugfs_remove_recursive(bank->lock[i].dbg_dir);
+	}
 	return ret;
 }
 EXPORT_SYMBOL_GPL(hwspin_lock_register);
@@ -384,6 +666,9 @@ int hwspin_lock_unregister(struct hwspinlock_device *bank)
 
 		/* self-sanity check that should never fail */
 		WARN_ON(tmp != hwlock);
+
+		debugfs_remove_recursive(hwlock->dbg_dir);
+		hwlock->dbg_dir = NULL;
 	}
 
 	return 0;
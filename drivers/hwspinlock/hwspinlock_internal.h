@@ -20,8 +20,11 @@
 
 #include <linux/spinlock.h>
 #include <linux/device.h>
+#include <linux/wait.h>
+#include <linux/atomic.h>
 
 struct hwspinlock_device;
+struct dentry;
 
 /**
  * struct hwspinlock_ops - platform-specific hwspinlock handlers
@@ -39,16 +42,56 @@ struct hwspinlock_ops {
 	void (*relax)(struct hwspinlock *lock);
 };
 
+/**
+ * struct hwspinlock_stats - contention statistics of an hwspinlock
+ * @acquired: number of times the lock was taken
+ * @contended: number of times it was taken after spinning on it
+ * @waited: number of times it was taken after sleeping on it
+ * @timeouts: number of times it couldn't be taken in time
+ * @remote_busy: number of attempts which found the hardware lock taken,
+ *		 i.e. held by a remote processor (or another host cpu)
+ * @spin_ns: total time spent spinning on the lock, in nsecs
+ * @max_spin_ns: longest time spent spinning on the lock, in nsecs
+ * @wait_ns: total time spent sleeping on the lock, in nsecs
+ *
+ * All of them are only updated with the lock's spinlock taken.
+ */
+struct hwspinlock_stats {
+	u64 acquired;
+	u64 contended;
+	u64 waited;
+	u64 timeouts;
+	u64 remote_busy;
+	u64 spin_ns;
+	u64 max_spin_ns;
+	u64 wait_ns;
+};
+
 /**
  * struct hwspinlock - this struct represents a single hwspinlock instance
  * @bank: the hwspinlock_device structure which owns this lock
  * @lock: initialized and used by hwspinlock core
  * @priv: private data, owned by the underlying platform-specific hwspinlock drv
+ * @stats: contention statistics, shown in debugfs
+ * @backoff: spin with an adaptive backoff, rather than with @relax (set
+ *	     through debugfs, or by the backoff module parameter)
+ * @spin_avg_ns: moving average of the time spent spinning on the lock, which
+ *		 the backoff starts from
+ * @releases: bumped whenever the lock is released (or the remote processor
+ *	      says it released it), so sleeping waiters try again
+ * @waitq: sleeping waiters (see __hwspin_lock_wait()) wait here
+ * @dbg_dir: debugfs directory of the lock
  */
 struct hwspinlock {
 	struct hwspinlock_device *bank;
 	spinlock_t lock;
 	void *priv;
+	struct hwspinlock_stats stats;
+	u32 backoff;
+	u32 spin_avg_ns;
+	atomic_t releases;
+	wait_queue_head_t waitq;
+	struct dentry *dbg_dir;
 };
 
 /**
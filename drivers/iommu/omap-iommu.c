@@ -89,6 +89,8 @@ void omap_uninstall_iommu_arch(const struct iommu_functions *ops)
 }
 EXPORT_SYMBOL_GPL(omap_uninstall_iommu_arch);
 
+static void flush_iotlb_all(struct omap_iommu *obj);
+
 /**
  * omap_iommu_save_ctx - Save registers for pm off-mode support
  * @dev:	client device
@@ -97,19 +99,34 @@ void omap_iommu_save_ctx(struct device *dev)
 {
 	struct omap_iommu *obj = dev_to_omap_iommu(dev);
 
+	clk_enable(obj->clk);
 	arch_iommu->save_ctx(obj);
+	clk_disable(obj->clk);
+
+	obj->ctx_saved = true;
 }
 EXPORT_SYMBOL_GPL(omap_iommu_save_ctx);
 
 /**
  * omap_iommu_restore_ctx - Restore registers for pm off-mode support
  * @dev:	client device
+ *
+ * Nothing is restored unless the context was saved since the iommu was
+ * last attached. The TLB isn't part of the context, so the entries that
+ * were locked before are lost, and refilled by the table walk as missed.
  **/
 void omap_iommu_restore_ctx(struct device *dev)
 {
 	struct omap_iommu *obj = dev_to_omap_iommu(dev);
 
+	if (!obj->ctx_saved)
+		return;
+
+	clk_enable(obj->clk);
 	arch_iommu->restore_ctx(obj);
+	clk_disable(obj->clk);
+
+	flush_iotlb_all(obj);
 }
 EXPORT_SYMBOL_GPL(omap_iommu_restore_ctx);
 
@@ -261,8 +278,10 @@ static struct cr_regs __iotlb_read_cr(struct omap_iommu *obj, int n)
  * load_iotlb_entry - Set an iommu tlb entry
  * @obj:	target iommu
  * @e:		an iommu tlb entry info
+ *
+ * If @e is preserved, it's locked in the tlb (below the lock base), where
+ * it's never evicted until the whole tlb is flushed.
  **/
-#ifdef PREFETCH_IOTLB
 static int load_iotlb_entry(struct omap_iommu *obj, struct iotlb_entry *e)
 {
 	int err = 0;
@@ -320,32 +339,38 @@ out:
 	return err;
 }
 
-#else /* !PREFETCH_IOTLB */
-
-static int load_iotlb_entry(struct omap_iommu *obj, struct iotlb_entry *e)
-{
-	return 0;
-}
-
-#endif /* !PREFETCH_IOTLB */
-
+/*
+ * Preserved entries are always loaded, so the accesses to them never miss
+ * the tlb; the others only are with PREFETCH_IOTLB.
+ */
 static int prefetch_iotlb_entry(struct omap_iommu *obj, struct iotlb_entry *e)
 {
+#ifndef PREFETCH_IOTLB
+	if (!e->prsvd)
+		return 0;
+#endif
+
 	return load_iotlb_entry(obj, e);
 }
 
 /**
- * flush_iotlb_page - Clear an iommu tlb entry
+ * flush_iotlb_range - Clear the iommu tlb entries of a range
  * @obj:	target iommu
  * @da:		iommu device virtual address
+ * @len:	length of the range, in bytes
  *
- * Clear an iommu tlb entry which includes 'da' address.
+ * Clear the iommu tlb entries which overlap [da, da + len), with a single
+ * walk of the tlb.
  **/
-static void flush_iotlb_page(struct omap_iommu *obj, u32 da)
+static void flush_iotlb_range(struct omap_iommu *obj, u32 da, size_t len)
 {
+	u32 last = da + len - 1;
 	int i;
 	struct cr_regs cr;
 
+	if (!len)
+		return;
+
 	clk_enable(obj->clk);
 
 	for_each_iotlb_cr(obj, obj->nr_tlb_entries, i, cr) {
@@ -358,7 +383,7 @@ static void flush_iotlb_page(struct omap_iommu *obj, u32 da)
 		start = iotlb_cr_to_virt(&cr);
 		bytes = iopgsz_to_bytes(cr.cam & 3);
 
-		if ((start <= da) && (da < start + bytes)) {
+		if ((start <= last) && (da <= start + bytes - 1)) {
 			dev_dbg(obj->dev, "%s: %08x<=%08x(%x)\n",
 				__func__, start, da, bytes);
 			iotlb_load_cr(obj, &cr);
@@ -366,9 +391,18 @@ static void flush_iotlb_page(struct omap_iommu *obj, u32 da)
 		}
 	}
 	clk_disable(obj->clk);
+}
 
-	if (i == obj->nr_tlb_entries)
-		dev_dbg(obj->dev, "%s: no page for %08x\n", __func__, da);
+/**
+ * flush_iotlb_page - Clear an iommu tlb entry
+ * @obj:	target iommu
+ * @da:		iommu device virtual address
+ *
+ * Clear an iommu tlb entry which includes 'da' address.
+ **/
+static void flush_iotlb_page(struct omap_iommu *obj, u32 da)
+{
+	flush_iotlb_range(obj, da, 1);
 }
 
 /**
@@ -857,6 +891,7 @@ static struct omap_iommu *omap_iommu_attach(const char *name, u32 *iopgd)
 	}
 
 	obj->iopgd = iopgd;
+	obj->ctx_saved = false;
 	err = iommu_enable(obj);
 	if (err)
 		goto err_enable;
@@ -896,6 +931,7 @@ static void omap_iommu_detach(struct omap_iommu *obj)
 	module_put(obj->owner);
 
 	obj->iopgd = NULL;
+	obj->ctx_saved = false;
 
 	spin_unlock(&obj->iommu_lock);
 
@@ -935,6 +971,7 @@ static int __devinit omap_iommu_probe(struct platform_device *pdev)
 	mutex_init(&obj->mmap_lock);
 	spin_lock_init(&obj->page_table_lock);
 	INIT_LIST_HEAD(&obj->mmap);
+	obj->mmap_tree = RB_ROOT;
 
 	res = platform_get_resource(pdev, IORESOURCE_MEM, 0);
 	if (!res) {
@@ -1015,11 +1052,10 @@ static void iopte_cachep_ctor(void *iopte)
 	clean_dcache_area(iopte, IOPTE_TABLE_SIZE);
 }
 
-static int omap_iommu_map(struct iommu_domain *domain, unsigned long da,
-			 phys_addr_t pa, size_t bytes, int prot)
+/* map a single iommu page, leaving the tlb alone if !flush */
+static int __omap_iommu_map(struct omap_iommu *oiommu, unsigned long da,
+			    phys_addr_t pa, size_t bytes, int prot, bool flush)
 {
-	struct omap_iommu_domain *omap_domain = domain->priv;
-	struct omap_iommu *oiommu = omap_domain->iommu_dev;
 	struct device *dev = oiommu->dev;
 	struct iotlb_entry e;
 	int omap_pgsz;
@@ -1038,13 +1074,31 @@ static int omap_iommu_map(struct iommu_domain *domain, unsigned long da,
 
 	iotlb_init_entry(&e, da, pa, flags);
 
-	ret = omap_iopgtable_store_entry(oiommu, &e);
+	/* have the tlb entry locked, if asked to */
+	e.prsvd = prot & MMU_CAM_P;
+
+	if (flush) {
+		ret = omap_iopgtable_store_entry(oiommu, &e);
+	} else {
+		ret = iopgtable_store_entry_core(oiommu, &e);
+		if (!ret)
+			prefetch_iotlb_entry(oiommu, &e);
+	}
 	if (ret)
 		dev_err(dev, "omap_iopgtable_store_entry failed: %d\n", ret);
 
 	return ret;
 }
 
+static int omap_iommu_map(struct iommu_domain *domain, unsigned long da,
+			 phys_addr_t pa, size_t bytes, int prot)
+{
+	struct omap_iommu_domain *omap_domain = domain->priv;
+
+	return __omap_iommu_map(omap_domain->iommu_dev, da, pa, bytes, prot,
+									true);
+}
+
 static size_t omap_iommu_unmap(struct iommu_domain *domain, unsigned long da,
 			    size_t size)
 {
@@ -1057,6 +1111,69 @@ static size_t omap_iommu_unmap(struct iommu_domain *domain, unsigned long da,
 	return iopgtable_clear_entry(oiommu, da);
 }
 
+/*
+ * unmap a whole range, page by page, and then clear its tlb entries with
+ * a single walk of the tlb, rather than one per page.
+ */
+static size_t omap_iommu_unmap_range(struct iommu_domain *domain,
+					unsigned long da, size_t size)
+{
+	struct omap_iommu_domain *omap_domain = domain->priv;
+	struct omap_iommu *oiommu = omap_domain->iommu_dev;
+	size_t bytes, unmapped = 0;
+
+	dev_dbg(oiommu->dev, "unmapping da 0x%lx size %u\n", da, size);
+
+	spin_lock(&oiommu->page_table_lock);
+
+	while (unmapped < size) {
+		bytes = iopgtable_clear_entry_core(oiommu, da + unmapped);
+		if (!bytes)
+			break;
+
+		unmapped += bytes;
+	}
+
+	flush_iotlb_range(oiommu, da, unmapped);
+
+	spin_unlock(&oiommu->page_table_lock);
+
+	return unmapped;
+}
+
+/*
+ * map a whole range: its stale tlb entries, if any, are cleared with a
+ * single walk of the tlb, before its pages are all stored.
+ */
+static int omap_iommu_map_range(struct iommu_domain *domain, unsigned long da,
+				phys_addr_t pa, size_t size, int prot)
+{
+	struct omap_iommu_domain *omap_domain = domain->priv;
+	struct omap_iommu *oiommu = omap_domain->iommu_dev;
+	size_t pgsize, mapped = 0;
+	int ret = 0;
+
+	flush_iotlb_range(oiommu, da, size);
+
+	while (mapped < size) {
+		pgsize = iommu_pgsize(domain, (da + mapped) | (pa + mapped),
+							size - mapped);
+
+		ret = __omap_iommu_map(oiommu, da + mapped, pa + mapped,
+							pgsize, prot, false);
+		if (ret)
+			break;
+
+		mapped += pgsize;
+	}
+
+	/* unroll mapping in case something went wrong */
+	if (ret)
+		omap_iommu_unmap_range(domain, da, mapped);
+
+	return ret;
+}
+
 static int
 omap_iommu_attach_dev(struct iommu_domain *domain, struct device *dev)
 {
@@ -1220,6 +1337,8 @@ static struct iommu_ops omap_iommu_ops = {
 	.detach_dev	= omap_iommu_detach_dev,
 	.map		= omap_iommu_map,
 	.unmap		= omap_iommu_unmap,
+	.map_range	= omap_iommu_map_range,
+	.unmap_range	= omap_iommu_unmap_range,
 	.iova_to_phys	= omap_iommu_iova_to_phys,
 	.domain_has_cap	= omap_iommu_domain_has_cap,
 	.pgsize_bitmap	= OMAP_IOMMU_PGSIZES,
@@ -17,6 +17,7 @@
 #include <linux/device.h>
 #include <linux/scatterlist.h>
 #include <linux/iommu.h>
+#include <linux/rbtree_augmented.h>
 
 #include <asm/cacheflush.h>
 #include <asm/mach/map.h>
@@ -207,13 +208,185 @@ static inline void vunmap_sg(const void *va)
 	vunmap(va);
 }
 
+/*
+ * The iovmas are kept both in a list, in ascending order, and in an rbtree
+ * (obj->mmap_tree), keyed by address: each of them also tracks the free
+ * space right below it (from the page after the previous one, since they
+ * are kept a page apart), and the largest such gap in its subtree, so the
+ * holes big enough for a new iovma are found without visiting the others.
+ */
+static inline struct iovm_struct *to_iovm(struct rb_node *node)
+{
+	return rb_entry(node, struct iovm_struct, node);
+}
+
+#define iovm_prev(area)	list_entry((area)->list.prev, struct iovm_struct, list)
+#define iovm_next(area)	list_entry((area)->list.next, struct iovm_struct, list)
+
+static inline u32 iovm_subtree_gap(struct rb_node *node)
+{
+	return node ? to_iovm(node)->subtree_gap : 0;
+}
+
+static u32 iovm_compute_subtree_gap(struct iovm_struct *area)
+{
+	return max3(area->gap, iovm_subtree_gap(area->node.rb_left),
+				iovm_subtree_gap(area->node.rb_right));
+}
+
+RB_DECLARE_CALLBACKS(static, iovm_gap_callbacks, struct iovm_struct, node,
+			u32, subtree_gap, iovm_compute_subtree_gap)
+
+/* the lowest address a new iovma may start at, above @prev */
+static inline u32 iovm_hole_start(struct omap_iommu *obj,
+						struct iovm_struct *prev)
+{
+	if (&prev->list == &obj->mmap)
+		return 0;
+
+	return prev->da_end + 1;
+}
+
+/* the gap of @area changed, as its predecessor did: let the tree know */
+static void iovm_update_gap(struct omap_iommu *obj, struct iovm_struct *area)
+{
+	u32 start;
+
+	if (&area->list == &obj->mmap)
+		return;
+
+	start = iovm_hole_start(obj, iovm_prev(area));
+	area->gap = area->da_start > start ? area->da_start - start : 0;
+	iovm_gap_callbacks_propagate(&area->node, NULL);
+}
+
+/* can @bytes, at @alignment and at @lo or above, fit right below @next? */
+static bool iovm_hole_fits(struct omap_iommu *obj, struct iovm_struct *next,
+			u32 lo, size_t bytes, u32 alignment, u32 *start)
+{
+	u32 end = obj->da_end;
+	u32 s;
+
+	s = max(lo, iovm_hole_start(obj, iovm_prev(next)));
+	s = roundup(s, alignment);
+
+	if (&next->list != &obj->mmap)
+		end = next->da_start;
+
+	/* roundup() may have wrapped around */
+	if (s < lo || s >= end || end - s < bytes)
+		return false;
+
+	*start = s;
+	return true;
+}
+
+/*
+ * find the lowest hole for @bytes, at @alignment, from @lo on: the iovma
+ * right above it is returned (or the list head, for the hole above the
+ * last iovma), and where the new iovma starts is put in @start
+ */
+static struct iovm_struct *find_iovm_hole(struct omap_iommu *obj, u32 lo,
+				size_t bytes, u32 alignment, u32 *start)
+{
+	struct rb_node *node = obj->mmap_tree.rb_node, *prev;
+	struct iovm_struct *area;
+
+	if (iovm_subtree_gap(node) < bytes)
+		goto check_highest;
+
+	area = to_iovm(node);
+	while (true) {
+		/* lower holes are first, if they may be big and high enough */
+		node = area->node.rb_left;
+		if (area->da_start > lo && iovm_subtree_gap(node) >= bytes) {
+			area = to_iovm(node);
+			continue;
+		}
+check_current:
+		if (area->gap >= bytes && area->da_start > lo &&
+			iovm_hole_fits(obj, area, lo, bytes, alignment, start))
+			return area;
+
+		node = area->node.rb_right;
+		if (iovm_subtree_gap(node) >= bytes) {
+			area = to_iovm(node);
+			continue;
+		}
+
+		/* back up, to the first ancestor it's on the left of */
+		while (true) {
+			prev = &area->node;
+			node = rb_parent(prev);
+			if (!node)
+				goto check_highest;
+			area = to_iovm(node);
+			if (prev == node->rb_left)
+				goto check_current;
+		}
+	}
+
+check_highest:
+	area = list_entry(&obj->mmap, struct iovm_struct, list);
+	if (iovm_hole_fits(obj, area, lo, bytes, alignment, start))
+		return area;
+
+	return NULL;
+}
+
+/* is [@start, @start + @bytes) clear of all the iovmas? */
+static bool iovm_range_free(struct omap_iommu *obj, u32 start, size_t bytes)
+{
+	struct rb_node *node = obj->mmap_tree.rb_node;
+	struct iovm_struct *area, *above = NULL;
+
+	/* look for the lowest iovma which ends above @start */
+	while (node) {
+		area = to_iovm(node);
+		if (area->da_end > start) {
+			above = area;
+			node = node->rb_left;
+		} else {
+			node = node->rb_right;
+		}
+	}
+
+	return !above || above->da_start >= start + bytes;
+}
+
+/* the iovma right above @start, or the list head if there's none */
+static struct iovm_struct *iovm_next_area(struct omap_iommu *obj, u32 start)
+{
+	struct rb_node *node = obj->mmap_tree.rb_node;
+	struct iovm_struct *area, *next = NULL;
+
+	while (node) {
+		area = to_iovm(node);
+		if (area->da_start > start) {
+			next = area;
+			node = node->rb_left;
+		} else {
+			node = node->rb_right;
+		}
+	}
+
+	return next ? : list_entry(&obj->mmap, struct iovm_struct, list);
+}
+
 static struct iovm_struct *__find_iovm_area(struct omap_iommu *obj,
 							const u32 da)
 {
+	struct rb_node *node = obj->mmap_tree.rb_node;
 	struct iovm_struct *tmp;
 
-	list_for_each_entry(tmp, &obj->mmap, list) {
-		if ((da >= tmp->da_start) && (da < tmp->da_end)) {
+	while (node) {
+		tmp = to_iovm(node);
+
+		if (da < tmp->da_start) {
+			node = node->rb_left;
+		} else if (da >= tmp->da_end) {
+			node = node->rb_right;
+		} else {
 			size_t len;
 
 			len = tmp->da_end - tmp->da_start;
@@ -256,8 +429,9 @@ EXPORT_SYMBOL_GPL(omap_find_iovm_area);
 static struct iovm_struct *alloc_iovm_area(struct omap_iommu *obj, u32 da,
 					   size_t bytes, u32 flags)
 {
-	struct iovm_struct *new, *tmp;
-	u32 start, prev_end, alignment;
+	struct iovm_struct *new, *next;
+	struct rb_node **link, *parent = NULL;
+	u32 start, alignment;
 
 	if (!obj || !bytes)
 		return ERR_PTR(-EINVAL);
@@ -277,34 +451,20 @@ static struct iovm_struct *alloc_iovm_area(struct omap_iommu *obj, u32 da,
 		return ERR_PTR(-EINVAL);
 	}
 
-	tmp = NULL;
-	if (list_empty(&obj->mmap))
-		goto found;
-
-	prev_end = 0;
-	list_for_each_entry(tmp, &obj->mmap, list) {
-
-		if (prev_end > start)
-			break;
-
-		if (tmp->da_start > start && (tmp->da_start - start) >= bytes)
-			goto found;
-
-		if (tmp->da_end >= start && ~flags & IOVMF_DA_FIXED)
-			start = roundup(tmp->da_end + 1, alignment);
-
-		prev_end = tmp->da_end;
+	if (flags & IOVMF_DA_FIXED) {
+		next = NULL;
+		if (iovm_range_free(obj, start, bytes))
+			next = iovm_next_area(obj, start);
+	} else {
+		next = find_iovm_hole(obj, start, bytes, alignment, &start);
 	}
 
-	if ((start >= prev_end) && (obj->da_end - start >= bytes))
-		goto found;
-
-	dev_dbg(obj->dev, "%s: no space to fit %08x(%x) flags: %08x\n",
-		__func__, da, bytes, flags);
-
-	return ERR_PTR(-EINVAL);
+	if (!next) {
+		dev_dbg(obj->dev, "%s: no space to fit %08x(%x) flags: %08x\n",
+			__func__, da, bytes, flags);
+		return ERR_PTR(-EINVAL);
+	}
 
-found:
 	new = kmem_cache_zalloc(iovm_area_cachep, GFP_KERNEL);
 	if (!new)
 		return ERR_PTR(-ENOMEM);
@@ -317,10 +477,27 @@ found:
 	/*
 	 * keep ascending order of iovmas
 	 */
-	if (tmp)
-		list_add_tail(&new->list, &tmp->list);
-	else
-		list_add(&new->list, &obj->mmap);
+	list_add_tail(&new->list, &next->list);
+
+	link = &obj->mmap_tree.rb_node;
+	while (*link) {
+		parent = *link;
+		if (start < to_iovm(parent)->da_start)
+			link = &parent->rb_left;
+		else
+			link = &parent->rb_right;
+	}
+
+	start = iovm_hole_start(obj, iovm_prev(new));
+	new->gap = new->da_start > start ? new->da_start - start : 0;
+	new->subtree_gap = new->gap;
+
+	rb_link_node(&new->node, parent, link);
+	iovm_gap_callbacks_propagate(parent, NULL);
+	rb_insert_augmented(&new->node, &obj->mmap_tree, &iovm_gap_callbacks);
+
+	/* the next iovma's gap got smaller */
+	iovm_update_gap(obj, iovm_next(new));
 
 	dev_dbg(obj->dev, "%s: found %08x-%08x-%08x(%x) %08x\n",
 		__func__, new->da_start, start, new->da_end, bytes, flags);
@@ -330,6 +507,7 @@ found:
 
 static void free_iovm_area(struct omap_iommu *obj, struct iovm_struct *area)
 {
+	struct iovm_struct *next;
 	size_t bytes;
 
 	BUG_ON(!obj || !area);
@@ -339,8 +517,14 @@ static void free_iovm_area(struct omap_iommu *obj, struct iovm_struct *area)
 	dev_dbg(obj->dev, "%s: %08x-%08x(%x) %08x\n",
 		__func__, area->da_start, area->da_end, bytes, area->flags);
 
+	next = iovm_next(area);
+
+	rb_erase_augmented(&area->node, &obj->mmap_tree, &iovm_gap_callbacks);
 	list_del(&area->list);
 	kmem_cache_free(iovm_area_cachep, area);
+
+	/* the next iovma's gap now spans the freed one */
+	iovm_update_gap(obj, next);
 }
 
 /**
@@ -0,0 +1,519 @@
+/*
+ * Mailbox framework
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#define pr_fmt(fmt)    "%s: " fmt, __func__
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/err.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/sched.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/mailbox_client.h>
+#include <linux/mailbox_controller.h>
+
+/* how a channel is told its message was sent */
+#define TXDONE_BY_IRQ	(1 << 0) /* the controller reports it */
+#define TXDONE_BY_POLL	(1 << 1) /* the controller is polled for it */
+#define TXDONE_BY_ACK	(1 << 2) /* the client reports it */
+
+static LIST_HEAD(mbox_cons);
+static DEFINE_MUTEX(con_mutex);
+
+static struct dentry *mbox_dbg_root;
+
+/* queue a message, returns its slot in the tx queue, or -ENOBUFS if full */
+static int add_to_rbuf(struct mbox_chan *chan, void *mssg)
+{
+	unsigned long flags;
+	int idx;
+
+	spin_lock_irqsave(&chan->lock, flags);
+
+	if (chan->msg_count == MBOX_TX_QUEUE_LEN) {
+		chan->stats.tx_full++;
+		spin_unlock_irqrestore(&chan->lock, flags);
+		return -ENOBUFS;
+	}
+
+	idx = chan->msg_free;
+	chan->msg_data[idx] = mssg;
+	chan->msg_count++;
+
+	if (idx == MBOX_TX_QUEUE_LEN - 1)
+		chan->msg_free = 0;
+	else
+		chan->msg_free++;
+
+	spin_unlock_irqrestore(&chan->lock, flags);
+
+	return idx;
+}
+
+static ktime_t mbox_txpoll_period(struct mbox_controller *mbox)
+{
+	return ns_to_ktime((u64)mbox->txpoll_period * NSEC_PER_MSEC);
+}
+
+/* hand the oldest queued message over to the hardware, if it's idle */
+static void msg_submit(struct mbox_chan *chan)
+{
+	struct mbox_controller *mbox = chan->mbox;
+	unsigned long flags;
+	unsigned count, idx;
+	void *data;
+	int err = -EBUSY;
+
+	spin_lock_irqsave(&chan->lock, flags);
+
+	if (!chan->msg_count || chan->active_req)
+		goto exit;
+
+	count = chan->msg_count;
+	idx = chan->msg_free;
+	if (idx >= count)
+		idx -= count;
+	else
+		idx += MBOX_TX_QUEUE_LEN - count;
+
+	data = chan->msg_data[idx];
+
+	err = mbox->ops->send_data(chan, data);
+	if (!err) {
+		chan->active_req = data;
+		chan->msg_count--;
+		chan->stats.tx++;
+	}
+
+exit:
+	spin_unlock_irqrestore(&chan->lock, flags);
+
+	if (!err && (chan->txdone_method & TXDONE_BY_POLL) &&
+					!hrtimer_active(&mbox->poll_hrt))
+		hrtimer_start(&mbox->poll_hrt, mbox_txpoll_period(mbox),
+							HRTIMER_MODE_REL);
+}
+
+/* the active message of @chan is done with: move on to the next one */
+static void tx_tick(struct mbox_chan *chan, int r)
+{
+	unsigned long flags;
+	void *mssg;
+
+	spin_lock_irqsave(&chan->lock, flags);
+	mssg = chan->active_req;
+	chan->active_req = NULL;
+	if (mssg && r)
+		chan->stats.tx_errors++;
+	spin_unlock_irqrestore(&chan->lock, flags);
+
+	/* submit the next message in the queue, if any */
+	msg_submit(chan);
+
+	if (!mssg)
+		return;
+
+	if (chan->cl->tx_done)
+		chan->cl->tx_done(chan->cl, mssg, r);
+
+	if (r != -ETIME && chan->cl->tx_block)
+		complete(&chan->tx_complete);
+}
+
+static enum hrtimer_restart txdone_hrtimer(struct hrtimer *hrtimer)
+{
+	struct mbox_controller *mbox =
+		container_of(hrtimer, struct mbox_controller, poll_hrt);
+	bool resched = false;
+	int i;
+
+	for (i = 0; i < mbox->num_chans; i++) {
+		struct mbox_chan *chan = &mbox->chans[i];
+
+		if (!chan->active_req || !chan->cl)
+			continue;
+
+		if (mbox->ops->last_tx_done(chan))
+			tx_tick(chan, 0);
+		else
+			resched = true;
+	}
+
+	if (!resched)
+		return HRTIMER_NORESTART;
+
+	hrtimer_forward_now(hrtimer, mbox_txpoll_period(mbox));
+	return HRTIMER_RESTART;
+}
+
+/**
+ * mbox_chan_received_data() - a message was received on a channel
+ * @chan: the mailbox channel
+ * @mssg: the message
+ *
+ * This function is called by the controller drivers, usually from their
+ * interrupt handler, and hands @mssg over to the client of @chan, if any,
+ * right away.
+ */
+void mbox_chan_received_data(struct mbox_chan *chan, void *mssg)
+{
+	chan->stats.rx++;
+
+	if (chan->cl && chan->cl->rx_callback)
+		chan->cl->rx_callback(chan->cl, mssg);
+}
+EXPORT_SYMBOL(mbox_chan_received_data);
+
+/**
+ * mbox_chan_txdone() - the last message of a channel was sent
+ * @chan: the mailbox channel
+ * @r: status of the transmission (0 on success)
+ *
+ * This function is called by the controller drivers which report their
+ * tx done (see mbox_controller->txdone_irq), usually from their tx
+ * interrupt handler. The next queued message, if any, is then sent.
+ */
+void mbox_chan_txdone(struct mbox_chan *chan, int r)
+{
+	if (unlikely(!(chan->txdone_method & TXDONE_BY_IRQ))) {
+		dev_err(chan->mbox->dev,
+			"controller can't report tx done (%s)\n", chan->name);
+		return;
+	}
+
+	tx_tick(chan, r);
+}
+EXPORT_SYMBOL(mbox_chan_txdone);
+
+/**
+ * mbox_client_txdone() - the client's last message was sent
+ * @chan: the mailbox channel
+ * @r: status of the transmission (0 on success)
+ *
+ * This function is called by the clients which know when their messages are
+ * sent (see mbox_client->knows_txdone), on channels whose controller can't
+ * tell it. The next queued message, if any, is then sent.
+ */
+void mbox_client_txdone(struct mbox_chan *chan, int r)
+{
+	if (unlikely(!(chan->txdone_method & TXDONE_BY_ACK))) {
+		dev_err(chan->mbox->dev, "client can't report tx done (%s)\n",
+								chan->name);
+		return;
+	}
+
+	tx_tick(chan, r);
+}
+EXPORT_SYMBOL(mbox_client_txdone);
+
+/**
+ * mbox_send_message() - send a message over a mailbox channel
+ * @chan: the mailbox channel, as returned by mbox_request_channel()
+ * @mssg: the message, whose format is only known to the controller driver
+ *	  and the client, and which must stay valid until it's sent
+ *
+ * The message is queued, and handed over to the hardware as soon as the
+ * messages that were queued before it are sent, i.e. possibly right away.
+ * Once it's sent, the client is told so by its ->tx_done() handler, if any.
+ *
+ * If the client has ->tx_block set, this function sleeps until the message
+ * is sent, or until ->tx_tout msecs have passed. Otherwise, it can be called
+ * from atomic context.
+ *
+ * Returns a non-negative token (the slot of the message in the tx queue)
+ * on success, -ENOBUFS if the tx queue is full, -ETIME if a blocking send
+ * timed out, or -EINVAL if @chan isn't a requested channel.
+ */
+int mbox_send_message(struct mbox_chan *chan, void *mssg)
+{
+	int t;
+
+	if (!chan || !chan->cl)
+		return -EINVAL;
+
+	t = add_to_rbuf(chan, mssg);
+	if (t < 0) {
+		dev_dbg(chan->mbox->dev, "tx queue of %s is full\n",
+								chan->name);
+		return t;
+	}
+
+	msg_submit(chan);
+
+	if (chan->cl->tx_block) {
+		unsigned long wait;
+		int ret;
+
+		if (!chan->cl->tx_tout)
+			wait = MAX_SCHEDULE_TIMEOUT;
+		else
+			wait = msecs_to_jiffies(chan->cl->tx_tout);
+
+		ret = wait_for_completion_timeout(&chan->tx_complete, wait);
+		if (ret == 0) {
+			t = -ETIME;
+			tx_tick(chan, t);
+		}
+	}
+
+	return t;
+}
+EXPORT_SYMBOL(mbox_send_message);
+
+/* look for a channel by its name; must be called with con_mutex held */
+static struct mbox_chan *mbox_find_channel(const char *name)
+{
+	struct mbox_controller *mbox;
+	int i;
+
+	list_for_each_entry(mbox, &mbox_cons, node)
+		for (i = 0; i < mbox->num_chans; i++)
+			if (mbox->chans[i].name &&
+					!strcmp(mbox->chans[i].name, name))
+				return &mbox->chans[i];
+
+	return NULL;
+}
+
+static struct module *mbox_owner(struct mbox_controller *mbox)
+{
+	return mbox->dev->driver ? mbox->dev->driver->owner : NULL;
+}
+
+/* release a channel, whether or not it was started up */
+static void __mbox_free_channel(struct mbox_chan *chan, bool shutdown)
+{
+	unsigned long flags;
+
+	if (shutdown && chan->mbox->ops->shutdown)
+		chan->mbox->ops->shutdown(chan);
+
+	spin_lock_irqsave(&chan->lock, flags);
+	chan->cl = NULL;
+	chan->active_req = NULL;
+	if (chan->txdone_method == (TXDONE_BY_POLL | TXDONE_BY_ACK))
+		chan->txdone_method = TXDONE_BY_POLL;
+	spin_unlock_irqrestore(&chan->lock, flags);
+
+	module_put(mbox_owner(chan->mbox));
+}
+
+/**
+ * mbox_request_channel() - request a mailbox channel
+ * @cl: the client of the channel
+ * @name: name of the channel
+ *
+ * Each channel can only have one client at a time. It's released with
+ * mbox_free_channel().
+ *
+ * Returns the channel on success, or an ERR_PTR() value otherwise: -ENODEV
+ * if there's no such channel, -EBUSY if it already has a client.
+ */
+struct mbox_chan *mbox_request_channel(struct mbox_client *cl,
+							const char *name)
+{
+	struct mbox_chan *chan;
+	unsigned long flags;
+	int ret;
+
+	mutex_lock(&con_mutex);
+
+	chan = mbox_find_channel(name);
+	if (!chan) {
+		pr_debug("no %s mailbox channel\n", name);
+		chan = ERR_PTR(-ENODEV);
+		goto unlock;
+	}
+
+	if (chan->cl || !try_module_get(mbox_owner(chan->mbox))) {
+		dev_dbg(chan->mbox->dev, "%s is busy\n", name);
+		chan = ERR_PTR(-EBUSY);
+		goto unlock;
+	}
+
+	spin_lock_irqsave(&chan->lock, flags);
+	chan->msg_free = 0;
+	chan->msg_count = 0;
+	chan->active_req = NULL;
+	chan->cl = cl;
+	init_completion(&chan->tx_complete);
+
+	if (chan->txdone_method == TXDONE_BY_POLL && cl->knows_txdone)
+		chan->txdone_method |= TXDONE_BY_ACK;
+	spin_unlock_irqrestore(&chan->lock, flags);
+
+	if (chan->mbox->ops->startup) {
+		ret = chan->mbox->ops->startup(chan);
+		if (ret) {
+			dev_err(chan->mbox->dev, "can't start %s: %d\n",
+								name, ret);
+			__mbox_free_channel(chan, false);
+			chan = ERR_PTR(ret);
+		}
+	}
+
+unlock:
+	mutex_unlock(&con_mutex);
+	return chan;
+}
+EXPORT_SYMBOL(mbox_request_channel);
+
+/**
+ * mbox_free_channel() - release a mailbox channel
+ * @chan: the channel, as returned by mbox_request_channel()
+ *
+ * The messages which are still queued are dropped.
+ */
+void mbox_free_channel(struct mbox_chan *chan)
+{
+	if (!chan || !chan->cl)
+		return;
+
+	__mbox_free_channel(chan, true);
+}
+EXPORT_SYMBOL(mbox_free_channel);
+
+static int mbox_stats_show(struct seq_file *s, void *unused)
+{
+	struct mbox_controller *mbox = s->private;
+	unsigned long flags;
+	int i;
+
+	for (i = 0; i < mbox->num_chans; i++) {
+		struct mbox_chan *chan = &mbox->chans[i];
+		struct mbox_chan_stats stats;
+		unsigned queued;
+
+		spin_lock_irqsave(&chan->lock, flags);
+		stats = chan->stats;
+		queued = chan->msg_count;
+		spin_unlock_irqrestore(&chan->lock, flags);
+
+		seq_printf(s,
+			"%s: tx %lu queued %u full %lu errors %lu rx %lu\n",
+				chan->name ? chan->name : "-", stats.tx, queued,
+				stats.tx_full, stats.tx_errors, stats.rx);
+	}
+
+	return 0;
+}
+
+static int mbox_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, mbox_stats_show, inode->i_private);
+}
+
+static const struct file_operations mbox_stats_ops = {
+	.open = mbox_stats_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+/**
+ * mbox_controller_register() - register a mailbox controller
+ * @mbox: the controller
+ *
+ * This function is called by the controller drivers, once they've filled
+ * in @mbox (and named its channels). The channels can be requested as soon
+ * as it returns, and their statistics are shown in debugfs, under
+ * mailbox/<name of the controller device>.
+ *
+ * Returns 0 on success, or -EINVAL if @mbox is incomplete.
+ */
+int mbox_controller_register(struct mbox_controller *mbox)
+{
+	unsigned txdone;
+	int i;
+
+	if (!mbox || !mbox->dev || !mbox->ops || !mbox->ops->send_data ||
+						mbox->num_chans <= 0)
+		return -EINVAL;
+
+	if (mbox->txdone_irq) {
+		txdone = TXDONE_BY_IRQ;
+	} else if (mbox->txdone_poll) {
+		if (!mbox->ops->last_tx_done || !mbox->txpoll_period)
+			return -EINVAL;
+		txdone = TXDONE_BY_POLL;
+	} else {
+		txdone = TXDONE_BY_ACK;
+	}
+
+	if (txdone == TXDONE_BY_POLL) {
+		hrtimer_init(&mbox->poll_hrt, CLOCK_MONOTONIC,
+							HRTIMER_MODE_REL);
+		mbox->poll_hrt.function = txdone_hrtimer;
+	}
+
+	for (i = 0; i < mbox->num_chans; i++) {
+		struct mbox_chan *chan = &mbox->chans[i];
+
+		chan->cl = NULL;
+		chan->mbox = mbox;
+		chan->txdone_method = txdone;
+		memset(&chan->stats, 0, sizeof(chan->stats));
+		spin_lock_init(&chan->lock);
+	}
+
+	mutex_lock(&con_mutex);
+	list_add_tail(&mbox->node, &mbox_cons);
+	mutex_unlock(&con_mutex);
+
+	if (mbox_dbg_root)
+		mbox->dbg = debugfs_create_file(dev_name(mbox->dev), 0400,
+					mbox_dbg_root, mbox, &mbox_stats_ops);
+
+	return 0;
+}
+EXPORT_SYMBOL(mbox_controller_register);
+
+/**
+ * mbox_controller_unregister() - unregister a mailbox controller
+ * @mbox: the controller
+ *
+ * Its channels are released (their clients must be done with them by then).
+ */
+void mbox_controller_unregister(struct mbox_controller *mbox)
+{
+	int i;
+
+	if (!mbox)
+		return;
+
+	debugfs_remove(mbox->dbg);
+
+	mutex_lock(&con_mutex);
+
+	list_del(&mbox->node);
+
+	for (i = 0; i < mbox->num_chans; i++)
+		mbox_free_channel(&mbox->chans[i]);
+
+	if (mbox->txdone_poll)
+		hrtimer_cancel(&mbox->poll_hrt);
+
+	mutex_unlock(&con_mutex);
+}
+EXPORT_SYMBOL(mbox_controller_unregister);
+
+static int __init mbox_init(void)
+{
+	if (debugfs_initialized())
+		mbox_dbg_root = debugfs_create_dir("mailbox", NULL);
+
+	return 0;
+}
+subsys_initcall(mbox_init);
@@ -0,0 +1,1127 @@
+/*
+ * Video encode/decode offload to the OMAP IPU, over rpmsg
+ *
+ * The IPU, which remoteproc boots, announces an "omap-ipu-codec" rpmsg
+ * channel, which this driver exposes as a V4L2 mem2mem device: frames
+ * queued on its OUTPUT queue are encoded (resp. decoded) by the IPU into
+ * the buffers queued on its CAPTURE queue. Encoding is from raw NV12
+ * frames into H.264 or MPEG-4; decoding the other way around.
+ *
+ * The buffers are allocated (by videobuf2-dma-contig) from the device the
+ * rpmsg buffers come from (see rpmsg_get_dma_dev()), so the IPU reads and
+ * writes them in place, at their dma address: nothing is ever copied.
+ *
+ * An instance is set up as an IPU session with an rpc call (see
+ * <linux/rpmsg_rpc.h>), the first time one of its jobs runs. Jobs are then
+ * submitted with one-way messages, and the IPU reports each of them done
+ * with a message on the channel. Up to 'max_in_flight' jobs (of all the
+ * instances) are handed to the IPU at once: the mem2mem job of an instance
+ * is finished as soon as its frame is submitted, so the next one can be,
+ * and only waits for a previous frame to be done when that many are in
+ * flight.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <linux/module.h>
+#include <linux/fs.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+#include <linux/rpmsg.h>
+#include <linux/rpmsg_rpc.h>
+
+#include <media/v4l2-mem2mem.h>
+#include <media/v4l2-device.h>
+#include <media/v4l2-ioctl.h>
+#include <media/v4l2-fh.h>
+#include <media/videobuf2-dma-contig.h>
+
+#define IPU_CODEC_NAME		"omap-ipu-codec"
+
+#define IPU_MIN_W		64
+#define IPU_MIN_H		64
+#define IPU_MAX_W		1920
+#define IPU_MAX_H		1088
+#define IPU_ALIGN_MASK		15
+
+/* the most jobs the IPU may ever get at once */
+#define IPU_MAX_JOBS		16
+
+/* how long the IPU may take to answer a call, or to finish its jobs */
+#define IPU_TIMEOUT		msecs_to_jiffies(1000)
+
+static unsigned int max_in_flight = 4;
+module_param(max_in_flight, uint, 0644);
+MODULE_PARM_DESC(max_in_flight, "Max number of frames the IPU gets at once");
+
+/* the calls of the host, and its one-way messages (IPU_CODEC_PROCESS) */
+enum ipu_codec_cmd {
+	IPU_CODEC_CREATE	= 0,
+	IPU_CODEC_DESTROY	= 1,
+	IPU_CODEC_PROCESS	= 2,
+};
+
+/* ipu_codec_done flags */
+#define IPU_CODEC_KEYFRAME	(1 << 0)
+
+/**
+ * struct ipu_codec_session - how a session is set up (IPU_CODEC_CREATE)
+ * @src_fourcc: the V4L2_PIX_FMT_* of the frames handed to the IPU
+ * @dst_fourcc: the V4L2_PIX_FMT_* of the frames it produces
+ * @width: width of the (raw) frames, in pixels
+ * @height: height of the (raw) frames, in pixels
+ * @stride: bytes per line of the raw frames
+ */
+struct ipu_codec_session {
+	u32 src_fourcc;
+	u32 dst_fourcc;
+	u32 width;
+	u32 height;
+	u32 stride;
+} __packed;
+
+/**
+ * struct ipu_codec_job - a frame to process (IPU_CODEC_PROCESS)
+ * @id: the number of the job, echoed back when it's done
+ * @src_da: address of the source frame
+ * @src_len: length of the source frame, in bytes
+ * @dst_da: address of the buffer the result goes to
+ * @dst_size: size of that buffer, in bytes
+ */
+struct ipu_codec_job {
+	u32 id;
+	u32 src_da;
+	u32 src_len;
+	u32 dst_da;
+	u32 dst_size;
+} __packed;
+
+/**
+ * struct ipu_codec_req - a request of the host
+ * @cmd: the IPU_CODEC_* command
+ * @session: the session, as numbered by the IPU when it was created
+ * @params: the setup of the session (IPU_CODEC_CREATE)
+ * @job: the frame to process (IPU_CODEC_PROCESS)
+ */
+struct ipu_codec_req {
+	u32 cmd;
+	u32 session;
+	union {
+		struct ipu_codec_session params;
+		struct ipu_codec_job job;
+	};
+} __packed;
+
+/**
+ * struct ipu_codec_reply - the reply of the IPU to a call
+ * @status: 0 on success, or a negative error code
+ * @session: the number of the session that was created (IPU_CODEC_CREATE)
+ */
+struct ipu_codec_reply {
+	s32 status;
+	u32 session;
+} __packed;
+
+/**
+ * struct ipu_codec_done - a job is done (sent by the IPU on the channel)
+ * @id: the number of the job
+ * @status: 0 on success, or a negative error code
+ * @bytesused: how many bytes of the destination buffer were filled
+ * @flags: IPU_CODEC_* bits
+ */
+struct ipu_codec_done {
+	u32 id;
+	s32 status;
+	u32 bytesused;
+	u32 flags;
+} __packed;
+
+struct ipu_fmt {
+	char *name;
+	u32 fourcc;
+	bool coded;
+};
+
+static struct ipu_fmt ipu_formats[] = {
+	{
+		.name	= "4:2:0, 2 planes, Y/CbCr",
+		.fourcc	= V4L2_PIX_FMT_NV12,
+	},
+	{
+		.name	= "H.264",
+		.fourcc	= V4L2_PIX_FMT_H264,
+		.coded	= true,
+	},
+	{
+		.name	= "MPEG-4",
+		.fourcc	= V4L2_PIX_FMT_MPEG4,
+		.coded	= true,
+	},
+};
+
+enum ipu_q_index {
+	IPU_SRC,
+	IPU_DST,
+};
+
+struct ipu_q_data {
+	struct ipu_fmt *fmt;
+	unsigned int width;
+	unsigned int height;
+	unsigned int bytesperline;
+	unsigned int sizeimage;
+};
+
+struct ipu_ctx;
+
+/**
+ * struct ipu_job - a frame the IPU was handed
+ * @ctx: the instance it belongs to, NULL if the slot is free
+ * @src: the source buffer
+ * @dst: the destination buffer
+ * @id: the number of the job: its slot, and a sequence number above it
+ */
+struct ipu_job {
+	struct ipu_ctx *ctx;
+	struct vb2_buffer *src;
+	struct vb2_buffer *dst;
+	u32 id;
+};
+
+/**
+ * struct ipu_dev - the IPU
+ * @v4l2_dev: the v4l2 device
+ * @vfd: the video device
+ * @dev_mutex: serializes the ioctls
+ * @rpdev: the rpmsg channel of the IPU
+ * @rpc: the rpc endpoint the sessions are set up with
+ * @alloc_ctx: videobuf2-dma-contig context, for memory the IPU reaches
+ * @m2m_dev: the mem2mem device
+ * @run_work: submits the job of the current instance
+ * @lock: protects @jobs, @in_flight and @seq, and ctx->in_flight
+ * @jobs: the frames the IPU was handed
+ * @in_flight: how many of @jobs are in use
+ * @seq: sequence number of the next job
+ * @done_wq: where instances wait for their jobs to be done
+ */
+struct ipu_dev {
+	struct v4l2_device v4l2_dev;
+	struct video_device *vfd;
+	struct mutex dev_mutex;
+	struct rpmsg_channel *rpdev;
+	struct rpmsg_rpc *rpc;
+	void *alloc_ctx;
+	struct v4l2_m2m_dev *m2m_dev;
+	struct work_struct run_work;
+	spinlock_t lock;
+	struct ipu_job jobs[IPU_MAX_JOBS];
+	unsigned int in_flight;
+	u32 seq;
+	wait_queue_head_t done_wq;
+};
+
+/**
+ * struct ipu_ctx - an instance
+ * @fh: the v4l2 file handle
+ * @dev: the IPU
+ * @m2m_ctx: the mem2mem context
+ * @q_data: the formats of the OUTPUT (IPU_SRC) and CAPTURE queues
+ * @session_lock: protects @session and @has_session, and the submission
+ *		  of jobs
+ * @session: the IPU session of the instance, if @has_session
+ * @has_session: the IPU session was created
+ * @in_flight: how many jobs of the instance the IPU has
+ * @aborting: the instance is going away, so its jobs aren't run anymore
+ */
+struct ipu_ctx {
+	struct v4l2_fh fh;
+	struct ipu_dev *dev;
+	struct v4l2_m2m_ctx *m2m_ctx;
+	struct ipu_q_data q_data[2];
+	struct mutex session_lock;
+	u32 session;
+	bool has_session;
+	unsigned int in_flight;
+	bool aborting;
+};
+
+static inline struct ipu_ctx *file2ctx(struct file *file)
+{
+	return container_of(file->private_data, struct ipu_ctx, fh);
+}
+
+static struct ipu_q_data *get_q_data(struct ipu_ctx *ctx,
+					enum v4l2_buf_type type)
+{
+	if (V4L2_TYPE_IS_OUTPUT(type))
+		return &ctx->q_data[IPU_SRC];
+
+	return &ctx->q_data[IPU_DST];
+}
+
+static struct ipu_fmt *find_format(u32 fourcc)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(ipu_formats); i++)
+		if (ipu_formats[i].fourcc == fourcc)
+			return &ipu_formats[i];
+
+	return NULL;
+}
+
+/* call the IPU, and turn its reply into an error code */
+static int ipu_call(struct ipu_dev *dev, struct ipu_codec_req *req, int len,
+								u32 *session)
+{
+	struct ipu_codec_reply reply;
+	int ret;
+
+	ret = rpmsg_rpc_call(dev->rpc, req, len, &reply, sizeof(reply),
+								IPU_TIMEOUT);
+	if (ret < 0)
+		return ret;
+
+	if (ret < sizeof(reply))
+		return -EPROTO;
+
+	if (session)
+		*session = reply.session;
+
+	return reply.status;
+}
+
+/* set the instance up on the IPU, with ctx->session_lock held */
+static int ipu_create_session(struct ipu_ctx *ctx)
+{
+	struct ipu_q_data *src = &ctx->q_data[IPU_SRC];
+	struct ipu_q_data *dst = &ctx->q_data[IPU_DST];
+	struct ipu_q_data *raw = src->fmt->coded ? dst : src;
+	struct ipu_codec_req req = {
+		.cmd = IPU_CODEC_CREATE,
+		.params = {
+			.src_fourcc = src->fmt->fourcc,
+			.dst_fourcc = dst->fmt->fourcc,
+			.width = raw->width,
+			.height = raw->height,
+			.stride = raw->bytesperline,
+		},
+	};
+	int len = offsetof(struct ipu_codec_req, params) + sizeof(req.params);
+	int ret;
+
+	if (src->fmt->coded == dst->fmt->coded) {
+		v4l2_err(&ctx->dev->v4l2_dev, "can't convert %s to %s\n",
+					src->fmt->name, dst->fmt->name);
+		return -EINVAL;
+	}
+
+	ret = ipu_call(ctx->dev, &req, len, &ctx->session);
+	if (ret) {
+		v4l2_err(&ctx->dev->v4l2_dev, "can't create session: %d\n",
+									ret);
+		return ret;
+	}
+
+	ctx->has_session = true;
+
+	return 0;
+}
+
+/* with ctx->session_lock held */
+static void ipu_destroy_session(struct ipu_ctx *ctx)
+{
+	struct ipu_codec_req req = {
+		.cmd = IPU_CODEC_DESTROY,
+		.session = ctx->session,
+	};
+	int ret;
+
+	if (!ctx->has_session)
+		return;
+
+	ret = ipu_call(ctx->dev, &req, offsetof(struct ipu_codec_req, params),
+									NULL);
+	if (ret)
+		v4l2_err(&ctx->dev->v4l2_dev, "can't destroy session %u: %d\n",
+							ctx->session, ret);
+
+	ctx->has_session = false;
+}
+
+/* grab a free job slot, if the IPU may get another frame */
+static struct ipu_job *ipu_get_job(struct ipu_dev *dev, struct ipu_ctx *ctx)
+{
+	struct ipu_job *job = NULL;
+	int i;
+
+	spin_lock_irq(&dev->lock);
+
+	if (dev->in_flight >= clamp_t(unsigned int, max_in_flight, 1,
+							IPU_MAX_JOBS))
+		goto unlock;
+
+	for (i = 0; i < IPU_MAX_JOBS; i++) {
+		if (dev->jobs[i].ctx)
+			continue;
+
+		job = &dev->jobs[i];
+		job->ctx = ctx;
+		job->id = (dev->seq++ * IPU_MAX_JOBS) + i;
+		dev->in_flight++;
+		ctx->in_flight++;
+		break;
+	}
+
+unlock:
+	spin_unlock_irq(&dev->lock);
+	return job;
+}
+
+/* the job is over: give its buffers back, and its slot */
+static void ipu_put_job(struct ipu_dev *dev, struct ipu_job *job,
+					enum vb2_buffer_state state)
+{
+	struct ipu_ctx *ctx = job->ctx;
+
+	v4l2_m2m_buf_done(job->src, state);
+	v4l2_m2m_buf_done(job->dst, state);
+
+	job->ctx = NULL;
+	dev->in_flight--;
+	ctx->in_flight--;
+}
+
+/*
+ * hand the next frame of the current instance to the IPU, and finish the
+ * mem2mem job right away, so the next frame can follow. If there are too
+ * many frames in flight, the job waits until one of them is done.
+ */
+static void ipu_run_work(struct work_struct *work)
+{
+	struct ipu_dev *dev = container_of(work, struct ipu_dev, run_work);
+	struct ipu_codec_req req = { .cmd = IPU_CODEC_PROCESS };
+	int len = offsetof(struct ipu_codec_req, job) + sizeof(req.job);
+	struct ipu_ctx *ctx;
+	struct ipu_job *job;
+	int ret;
+
+	ctx = v4l2_m2m_get_curr_priv(dev->m2m_dev);
+	if (!ctx)
+		return;
+
+	mutex_lock(&ctx->session_lock);
+
+	if (ctx->aborting)
+		goto finish;
+
+	if (!ctx->has_session && ipu_create_session(ctx))
+		goto finish;
+
+	job = ipu_get_job(dev, ctx);
+	if (!job) {
+		/* a frame that's done will bring us back */
+		mutex_unlock(&ctx->session_lock);
+		return;
+	}
+
+	job->src = v4l2_m2m_src_buf_remove(ctx->m2m_ctx);
+	job->dst = v4l2_m2m_dst_buf_remove(ctx->m2m_ctx);
+	if (!job->src || !job->dst) {
+		/* the buffers were taken back by streamoff meanwhile */
+		if (job->src)
+			v4l2_m2m_buf_done(job->src, VB2_BUF_STATE_ERROR);
+		if (job->dst)
+			v4l2_m2m_buf_done(job->dst, VB2_BUF_STATE_ERROR);
+		spin_lock_irq(&dev->lock);
+		job->ctx = NULL;
+		dev->in_flight--;
+		ctx->in_flight--;
+		spin_unlock_irq(&dev->lock);
+		goto finish;
+	}
+
+	req.session = ctx->session;
+	req.job.id = job->id;
+	req.job.src_da = vb2_dma_contig_plane_dma_addr(job->src, 0);
+	req.job.src_len = vb2_get_plane_payload(job->src, 0);
+	req.job.dst_da = vb2_dma_contig_plane_dma_addr(job->dst, 0);
+	req.job.dst_size = vb2_plane_size(job->dst, 0);
+
+	ret = rpmsg_send(dev->rpdev, &req, len);
+	if (ret) {
+		v4l2_err(&dev->v4l2_dev, "can't submit job: %d\n", ret);
+		spin_lock_irq(&dev->lock);
+		ipu_put_job(dev, job, VB2_BUF_STATE_ERROR);
+		spin_unlock_irq(&dev->lock);
+		wake_up(&dev->done_wq);
+	}
+
+finish:
+	mutex_unlock(&ctx->session_lock);
+	v4l2_m2m_job_finish(dev->m2m_dev, ctx->m2m_ctx);
+}
+
+/* a frame is done */
+static void ipu_codec_cb(struct rpmsg_channel *rpdev, void *data, int len,
+							void *priv, u32 src)
+{
+	struct ipu_dev *dev = dev_get_drvdata(&rpdev->dev);
+	struct ipu_codec_done *done = data;
+	struct ipu_job *job;
+	unsigned long flags;
+
+	if (!dev || len < sizeof(*done)) {
+		dev_warn(&rpdev->dev, "unexpected message, len %d\n", len);
+		return;
+	}
+
+	spin_lock_irqsave(&dev->lock, flags);
+
+	job = &dev->jobs[done->id % IPU_MAX_JOBS];
+	if (!job->ctx || job->id != done->id) {
+		spin_unlock_irqrestore(&dev->lock, flags);
+		dev_warn(&rpdev->dev, "unexpected job %u\n", done->id);
+		return;
+	}
+
+	if (!done->status) {
+		vb2_set_plane_payload(job->dst, 0,
+				min_t(unsigned long, done->bytesused,
+					vb2_plane_size(job->dst, 0)));
+		job->dst->v4l2_buf.timestamp = job->src->v4l2_buf.timestamp;
+		job->dst->v4l2_buf.timecode = job->src->v4l2_buf.timecode;
+		job->dst->v4l2_buf.flags &= ~V4L2_BUF_FLAG_KEYFRAME;
+		if (done->flags & IPU_CODEC_KEYFRAME)
+			job->dst->v4l2_buf.flags |= V4L2_BUF_FLAG_KEYFRAME;
+	}
+
+	ipu_put_job(dev, job, done->status ? VB2_BUF_STATE_ERROR :
+							VB2_BUF_STATE_DONE);
+
+	spin_unlock_irqrestore(&dev->lock, flags);
+
+	wake_up(&dev->done_wq);
+
+	/* a job may be waiting for its frame to be handed over */
+	schedule_work(&dev->run_work);
+}
+
+static void ipu_device_run(void *priv)
+{
+	struct ipu_ctx *ctx = priv;
+
+	/* submitting may sleep, and we may be called atomically */
+	schedule_work(&ctx->dev->run_work);
+}
+
+static int ipu_job_ready(void *priv)
+{
+	struct ipu_ctx *ctx = priv;
+
+	return !ctx->aborting;
+}
+
+static void ipu_job_abort(void *priv)
+{
+	struct ipu_ctx *ctx = priv;
+
+	/* finish the job, even if it waits for a frame to be done */
+	ctx->aborting = true;
+	schedule_work(&ctx->dev->run_work);
+}
+
+static void ipu_lock(void *priv)
+{
+	struct ipu_ctx *ctx = priv;
+
+	mutex_lock(&ctx->dev->dev_mutex);
+}
+
+static void ipu_unlock(void *priv)
+{
+	struct ipu_ctx *ctx = priv;
+
+	mutex_unlock(&ctx->dev->dev_mutex);
+}
+
+static struct v4l2_m2m_ops ipu_m2m_ops = {
+	.device_run	= ipu_device_run,
+	.job_ready	= ipu_job_ready,
+	.job_abort	= ipu_job_abort,
+	.lock		= ipu_lock,
+	.unlock		= ipu_unlock,
+};
+
+/*
+ * video ioctls
+ */
+static int vidioc_querycap(struct file *file, void *priv,
+			   struct v4l2_capability *cap)
+{
+	struct ipu_ctx *ctx = file2ctx(file);
+
+	strlcpy(cap->driver, IPU_CODEC_NAME, sizeof(cap->driver));
+	strlcpy(cap->card, IPU_CODEC_NAME, sizeof(cap->card));
+	snprintf(cap->bus_info, sizeof(cap->bus_info), "rpmsg:%s",
+					dev_name(&ctx->dev->rpdev->dev));
+	cap->device_caps = V4L2_CAP_VIDEO_M2M | V4L2_CAP_STREAMING;
+	cap->capabilities = cap->device_caps | V4L2_CAP_DEVICE_CAPS;
+
+	return 0;
+}
+
+static int vidioc_enum_fmt(struct file *file, void *priv,
+			   struct v4l2_fmtdesc *f)
+{
+	struct ipu_fmt *fmt;
+
+	if (f->index >= ARRAY_SIZE(ipu_formats))
+		return -EINVAL;
+
+	fmt = &ipu_formats[f->index];
+	strlcpy(f->description, fmt->name, sizeof(f->description));
+	f->pixelformat = fmt->fourcc;
+	f->flags = fmt->coded ? V4L2_FMT_FLAG_COMPRESSED : 0;
+
+	return 0;
+}
+
+static int vidioc_g_fmt(struct file *file, void *priv, struct v4l2_format *f)
+{
+	struct ipu_ctx *ctx = file2ctx(file);
+	struct ipu_q_data *q_data;
+
+	if (!v4l2_m2m_get_vq(ctx->m2m_ctx, f->type))
+		return -EINVAL;
+
+	q_data = get_q_data(ctx, f->type);
+
+	f->fmt.pix.width	= q_data->width;
+	f->fmt.pix.height	= q_data->height;
+	f->fmt.pix.field	= V4L2_FIELD_NONE;
+	f->fmt.pix.pixelformat	= q_data->fmt->fourcc;
+	f->fmt.pix.bytesperline	= q_data->bytesperline;
+	f->fmt.pix.sizeimage	= q_data->sizeimage;
+	f->fmt.pix.colorspace	= V4L2_COLORSPACE_REC709;
+
+	return 0;
+}
+
+static int vidioc_try_fmt(struct file *file, void *priv,
+			  struct v4l2_format *f)
+{
+	struct ipu_ctx *ctx = file2ctx(file);
+	struct ipu_fmt *fmt;
+
+	fmt = find_format(f->fmt.pix.pixelformat);
+	if (!fmt) {
+		v4l2_err(&ctx->dev->v4l2_dev, "unsupported fourcc 0x%08x\n",
+						f->fmt.pix.pixelformat);
+		return -EINVAL;
+	}
+
+	if (f->fmt.pix.field != V4L2_FIELD_ANY &&
+				f->fmt.pix.field != V4L2_FIELD_NONE)
+		return -EINVAL;
+
+	f->fmt.pix.field = V4L2_FIELD_NONE;
+	f->fmt.pix.width = clamp_t(u32, f->fmt.pix.width, IPU_MIN_W,
+					IPU_MAX_W) & ~IPU_ALIGN_MASK;
+	f->fmt.pix.height = clamp_t(u32, f->fmt.pix.height, IPU_MIN_H,
+					IPU_MAX_H) & ~IPU_ALIGN_MASK;
+	f->fmt.pix.colorspace = V4L2_COLORSPACE_REC709;
+
+	if (fmt->coded) {
+		/* room for the worst frame the IPU may produce */
+		f->fmt.pix.bytesperline = 0;
+		f->fmt.pix.sizeimage = max_t(u32, f->fmt.pix.sizeimage,
+				f->fmt.pix.width * f->fmt.pix.height / 2);
+	} else {
+		f->fmt.pix.bytesperline = f->fmt.pix.width;
+		f->fmt.pix.sizeimage = f->fmt.pix.width *
+						f->fmt.pix.height * 3 / 2;
+	}
+
+	return 0;
+}
+
+static int vidioc_s_fmt(struct file *file, void *priv, struct v4l2_format *f)
+{
+	struct ipu_ctx *ctx = file2ctx(file);
+	struct ipu_q_data *q_data;
+	struct vb2_queue *vq;
+	int ret;
+
+	vq = v4l2_m2m_get_vq(ctx->m2m_ctx, f->type);
+	if (!vq)
+		return -EINVAL;
+
+	ret = vidioc_try_fmt(file, priv, f);
+	if (ret)
+		return ret;
+
+	if (vb2_is_busy(vq)) {
+		v4l2_err(&ctx->dev->v4l2_dev, "%s queue busy\n", __func__);
+		return -EBUSY;
+	}
+
+	q_data = get_q_data(ctx, f->type);
+	q_data->fmt = find_format(f->fmt.pix.pixelformat);
+	q_data->width = f->fmt.pix.width;
+	q_data->height = f->fmt.pix.height;
+	q_data->bytesperline = f->fmt.pix.bytesperline;
+	q_data->sizeimage = f->fmt.pix.sizeimage;
+
+	return 0;
+}
+
+static int vidioc_reqbufs(struct file *file, void *priv,
+			  struct v4l2_requestbuffers *reqbufs)
+{
+	return v4l2_m2m_reqbufs(file, file2ctx(file)->m2m_ctx, reqbufs);
+}
+
+static int vidioc_querybuf(struct file *file, void *priv,
+			   struct v4l2_buffer *buf)
+{
+	return v4l2_m2m_querybuf(file, file2ctx(file)->m2m_ctx, buf);
+}
+
+static int vidioc_qbuf(struct file *file, void *priv, struct v4l2_buffer *buf)
+{
+	return v4l2_m2m_qbuf(file, file2ctx(file)->m2m_ctx, buf);
+}
+
+static int vidioc_dqbuf(struct file *file, void *priv, struct v4l2_buffer *buf)
+{
+	return v4l2_m2m_dqbuf(file, file2ctx(file)->m2m_ctx, buf);
+}
+
+static int vidioc_streamon(struct file *file, void *priv,
+			   enum v4l2_buf_type type)
+{
+	return v4l2_m2m_streamon(file, file2ctx(file)->m2m_ctx, type);
+}
+
+static int vidioc_streamoff(struct file *file, void *priv,
+			    enum v4l2_buf_type type)
+{
+	return v4l2_m2m_streamoff(file, file2ctx(file)->m2m_ctx, type);
+}
+
+static const struct v4l2_ioctl_ops ipu_ioctl_ops = {
+	.vidioc_querycap	= vidioc_querycap,
+
+	.vidioc_enum_fmt_vid_cap = vidioc_enum_fmt,
+	.vidioc_g_fmt_vid_cap	= vidioc_g_fmt,
+	.vidioc_try_fmt_vid_cap	= vidioc_try_fmt,
+	.vidioc_s_fmt_vid_cap	= vidioc_s_fmt,
+
+	.vidioc_enum_fmt_vid_out = vidioc_enum_fmt,
+	.vidioc_g_fmt_vid_out	= vidioc_g_fmt,
+	.vidioc_try_fmt_vid_out	= vidioc_try_fmt,
+	.vidioc_s_fmt_vid_out	= vidioc_s_fmt,
+
+	.vidioc_reqbufs		= vidioc_reqbufs,
+	.vidioc_querybuf	= vidioc_querybuf,
+
+	.vidioc_qbuf		= vidioc_qbuf,
+	.vidioc_dqbuf		= vidioc_dqbuf,
+
+	.vidioc_streamon	= vidioc_streamon,
+	.vidioc_streamoff	= vidioc_streamoff,
+};
+
+/*
+ * Queue operations
+ */
+static int ipu_queue_setup(struct vb2_queue *vq,
+			   const struct v4l2_format *fmt,
+			   unsigned int *nbuffers, unsigned int *nplanes,
+			   unsigned int sizes[], void *alloc_ctxs[])
+{
+	struct ipu_ctx *ctx = vb2_get_drv_priv(vq);
+	struct ipu_q_data *q_data = get_q_data(ctx, vq->type);
+
+	*nplanes = 1;
+	sizes[0] = q_data->sizeimage;
+	alloc_ctxs[0] = ctx->dev->alloc_ctx;
+
+	return 0;
+}
+
+static int ipu_buf_prepare(struct vb2_buffer *vb)
+{
+	struct ipu_ctx *ctx = vb2_get_drv_priv(vb->vb2_queue);
+	struct ipu_q_data *q_data = get_q_data(ctx, vb->vb2_queue->type);
+
+	if (vb2_plane_size(vb, 0) < q_data->sizeimage) {
+		v4l2_err(&ctx->dev->v4l2_dev, "buffer too small (%lu < %u)\n",
+				vb2_plane_size(vb, 0), q_data->sizeimage);
+		return -EINVAL;
+	}
+
+	/* coded frames come with their length */
+	if (!V4L2_TYPE_IS_OUTPUT(vb->vb2_queue->type) ||
+					!q_data->fmt->coded)
+		vb2_set_plane_payload(vb, 0, q_data->sizeimage);
+
+	return 0;
+}
+
+static void ipu_buf_queue(struct vb2_buffer *vb)
+{
+	struct ipu_ctx *ctx = vb2_get_drv_priv(vb->vb2_queue);
+
+	v4l2_m2m_buf_queue(ctx->m2m_ctx, vb);
+}
+
+static void ipu_wait_prepare(struct vb2_queue *q)
+{
+	ipu_unlock(vb2_get_drv_priv(q));
+}
+
+static void ipu_wait_finish(struct vb2_queue *q)
+{
+	ipu_lock(vb2_get_drv_priv(q));
+}
+
+static int ipu_start_streaming(struct vb2_queue *q, unsigned int count)
+{
+	struct ipu_ctx *ctx = vb2_get_drv_priv(q);
+
+	ctx->aborting = false;
+
+	return 0;
+}
+
+/*
+ * give back the buffers the IPU wasn't handed yet, wait for the frames it
+ * has to be done, and end the session, whose formats may change now
+ */
+static int ipu_stop_streaming(struct vb2_queue *q)
+{
+	struct ipu_ctx *ctx = vb2_get_drv_priv(q);
+	struct ipu_dev *dev = ctx->dev;
+	struct vb2_buffer *vb;
+	long left;
+	int i;
+
+	mutex_lock(&ctx->session_lock);
+
+	for (;;) {
+		if (V4L2_TYPE_IS_OUTPUT(q->type))
+			vb = v4l2_m2m_src_buf_remove(ctx->m2m_ctx);
+		else
+			vb = v4l2_m2m_dst_buf_remove(ctx->m2m_ctx);
+		if (!vb)
+			break;
+		v4l2_m2m_buf_done(vb, VB2_BUF_STATE_ERROR);
+	}
+
+	left = wait_event_timeout(dev->done_wq, !ACCESS_ONCE(ctx->in_flight),
+								IPU_TIMEOUT);
+	if (!left) {
+		v4l2_err(&dev->v4l2_dev, "IPU didn't finish its frames\n");
+
+		spin_lock_irq(&dev->lock);
+		for (i = 0; i < IPU_MAX_JOBS; i++)
+			if (dev->jobs[i].ctx == ctx)
+				ipu_put_job(dev, &dev->jobs[i],
+						VB2_BUF_STATE_ERROR);
+		spin_unlock_irq(&dev->lock);
+	}
+
+	ipu_destroy_session(ctx);
+
+	mutex_unlock(&ctx->session_lock);
+
+	return 0;
+}
+
+static struct vb2_ops ipu_qops = {
+	.queue_setup	 = ipu_queue_setup,
+	.buf_prepare	 = ipu_buf_prepare,
+	.buf_queue	 = ipu_buf_queue,
+	.wait_prepare	 = ipu_wait_prepare,
+	.wait_finish	 = ipu_wait_finish,
+	.start_streaming = ipu_start_streaming,
+	.stop_streaming	 = ipu_stop_streaming,
+};
+
+static int queue_init(void *priv, struct vb2_queue *src_vq,
+						struct vb2_queue *dst_vq)
+{
+	struct ipu_ctx *ctx = priv;
+	int ret;
+
+	src_vq->type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+	src_vq->io_modes = VB2_MMAP | VB2_USERPTR;
+	src_vq->drv_priv = ctx;
+	src_vq->buf_struct_size = sizeof(struct v4l2_m2m_buffer);
+	src_vq->ops = &ipu_qops;
+	src_vq->mem_ops = &vb2_dma_contig_memops;
+
+	ret = vb2_queue_init(src_vq);
+	if (ret)
+		return ret;
+
+	dst_vq->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	dst_vq->io_modes = VB2_MMAP | VB2_USERPTR;
+	dst_vq->drv_priv = ctx;
+	dst_vq->buf_struct_size = sizeof(struct v4l2_m2m_buffer);
+	dst_vq->ops = &ipu_qops;
+	dst_vq->mem_ops = &vb2_dma_contig_memops;
+
+	return vb2_queue_init(dst_vq);
+}
+
+/*
+ * File operations
+ */
+static int ipu_open(struct file *file)
+{
+	struct ipu_dev *dev = video_drvdata(file);
+	struct ipu_q_data *src, *dst;
+	struct ipu_ctx *ctx;
+	int ret = 0;
+
+	if (mutex_lock_interruptible(&dev->dev_mutex))
+		return -ERESTARTSYS;
+
+	ctx = kzalloc(sizeof(*ctx), GFP_KERNEL);
+	if (!ctx) {
+		ret = -ENOMEM;
+		goto unlock;
+	}
+
+	v4l2_fh_init(&ctx->fh, video_devdata(file));
+	file->private_data = &ctx->fh;
+	ctx->dev = dev;
+	mutex_init(&ctx->session_lock);
+
+	/* encode 1080p NV12 into H.264, until told otherwise */
+	src = &ctx->q_data[IPU_SRC];
+	src->fmt = &ipu_formats[0];
+	src->width = IPU_MAX_W;
+	src->height = IPU_MAX_H;
+	src->bytesperline = src->width;
+	src->sizeimage = src->width * src->height * 3 / 2;
+	dst = &ctx->q_data[IPU_DST];
+	*dst = *src;
+	dst->fmt = &ipu_formats[1];
+	dst->bytesperline = 0;
+	dst->sizeimage = dst->width * dst->height / 2;
+
+	ctx->m2m_ctx = v4l2_m2m_ctx_init(dev->m2m_dev, ctx, &queue_init);
+	if (IS_ERR(ctx->m2m_ctx)) {
+		ret = PTR_ERR(ctx->m2m_ctx);
+		v4l2_fh_exit(&ctx->fh);
+		kfree(ctx);
+		goto unlock;
+	}
+
+	v4l2_fh_add(&ctx->fh);
+
+unlock:
+	mutex_unlock(&dev->dev_mutex);
+	return ret;
+}
+
+static int ipu_release(struct file *file)
+{
+	struct ipu_dev *dev = video_drvdata(file);
+	struct ipu_ctx *ctx = file2ctx(file);
+
+	v4l2_fh_del(&ctx->fh);
+	v4l2_fh_exit(&ctx->fh);
+	mutex_lock(&dev->dev_mutex);
+	v4l2_m2m_ctx_release(ctx->m2m_ctx);
+	mutex_unlock(&dev->dev_mutex);
+	kfree(ctx);
+
+	return 0;
+}
+
+static unsigned int ipu_poll(struct file *file,
+			     struct poll_table_struct *wait)
+{
+	struct ipu_ctx *ctx = file2ctx(file);
+
+	return v4l2_m2m_poll(file, ctx->m2m_ctx, wait);
+}
+
+static int ipu_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct ipu_dev *dev = video_drvdata(file);
+	struct ipu_ctx *ctx = file2ctx(file);
+	int ret;
+
+	if (mutex_lock_interruptible(&dev->dev_mutex))
+		return -ERESTARTSYS;
+	ret = v4l2_m2m_mmap(file, ctx->m2m_ctx, vma);
+	mutex_unlock(&dev->dev_mutex);
+
+	return ret;
+}
+
+static const struct v4l2_file_operations ipu_fops = {
+	.owner		= THIS_MODULE,
+	.open		= ipu_open,
+	.release	= ipu_release,
+	.poll		= ipu_poll,
+	.unlocked_ioctl	= video_ioctl2,
+	.mmap		= ipu_mmap,
+};
+
+static struct video_device ipu_videodev = {
+	.name		= IPU_CODEC_NAME,
+	.vfl_dir	= VFL_DIR_M2M,
+	.fops		= &ipu_fops,
+	.ioctl_ops	= &ipu_ioctl_ops,
+	.minor		= -1,
+	.release	= video_device_release,
+};
+
+static int ipu_probe(struct rpmsg_channel *rpdev)
+{
+	struct ipu_dev *dev;
+	struct video_device *vfd;
+	int ret;
+
+	dev = devm_kzalloc(&rpdev->dev, sizeof(*dev), GFP_KERNEL);
+	if (!dev)
+		return -ENOMEM;
+
+	dev->rpdev = rpdev;
+	mutex_init(&dev->dev_mutex);
+	spin_lock_init(&dev->lock);
+	init_waitqueue_head(&dev->done_wq);
+	INIT_WORK(&dev->run_work, ipu_run_work);
+
+	ret = v4l2_device_register(&rpdev->dev, &dev->v4l2_dev);
+	if (ret)
+		return ret;
+
+	/* the frames go where the IPU can reach them */
+	dev->alloc_ctx = vb2_dma_contig_init_ctx(rpmsg_get_dma_dev(rpdev));
+	if (IS_ERR(dev->alloc_ctx)) {
+		ret = PTR_ERR(dev->alloc_ctx);
+		goto unreg_dev;
+	}
+
+	dev->rpc = rpmsg_rpc_create(rpdev, rpdev->dst, 4, NULL, NULL);
+	if (IS_ERR(dev->rpc)) {
+		ret = PTR_ERR(dev->rpc);
+		v4l2_err(&dev->v4l2_dev, "can't create rpc endpoint: %d\n",
+									ret);
+		goto cleanup_ctx;
+	}
+
+	dev->m2m_dev = v4l2_m2m_init(&ipu_m2m_ops);
+	if (IS_ERR(dev->m2m_dev)) {
+		ret = PTR_ERR(dev->m2m_dev);
+		v4l2_err(&dev->v4l2_dev, "can't init mem2mem device: %d\n",
+									ret);
+		goto destroy_rpc;
+	}
+
+	/* the callback may fire as soon as jobs are submitted */
+	dev_set_drvdata(&rpdev->dev, dev);
+
+	vfd = video_device_alloc();
+	if (!vfd) {
+		ret = -ENOMEM;
+		goto release_m2m;
+	}
+
+	*vfd = ipu_videodev;
+	vfd->lock = &dev->dev_mutex;
+	vfd->v4l2_dev = &dev->v4l2_dev;
+	video_set_drvdata(vfd, dev);
+
+	ret = video_register_device(vfd, VFL_TYPE_GRABBER, -1);
+	if (ret) {
+		v4l2_err(&dev->v4l2_dev, "can't register video device: %d\n",
+									ret);
+		video_device_release(vfd);
+		goto release_m2m;
+	}
+
+	dev->vfd = vfd;
+	v4l2_info(&dev->v4l2_dev, "IPU codec registered as /dev/video%d\n",
+								vfd->num);
+
+	return 0;
+
+release_m2m:
+	dev_set_drvdata(&rpdev->dev, NULL);
+	v4l2_m2m_release(dev->m2m_dev);
+destroy_rpc:
+	rpmsg_rpc_destroy(dev->rpc);
+cleanup_ctx:
+	vb2_dma_contig_cleanup_ctx(dev->alloc_ctx);
+unreg_dev:
+	v4l2_device_unregister(&dev->v4l2_dev);
+	return ret;
+}
+
+static void __devexit ipu_remove(struct rpmsg_channel *rpdev)
+{
+	struct ipu_dev *dev = dev_get_drvdata(&rpdev->dev);
+
+	video_unregister_device(dev->vfd);
+
+	/* the callback must not touch the IPU anymore (see rpmsg_char) */
+	mutex_lock(&rpdev->ept->cb_lock);
+	dev_set_drvdata(&rpdev->dev, NULL);
+	mutex_unlock(&rpdev->ept->cb_lock);
+
+	cancel_work_sync(&dev->run_work);
+	v4l2_m2m_release(dev->m2m_dev);
+	rpmsg_rpc_destroy(dev->rpc);
+	vb2_dma_contig_cleanup_ctx(dev->alloc_ctx);
+	v4l2_device_unregister(&dev->v4l2_dev);
+}
+
+static struct rpmsg_device_id ipu_id_table[] = {
+	{ .name	= IPU_CODEC_NAME },
+	{ },
+};
+MODULE_DEVICE_TABLE(rpmsg, ipu_id_table);
+
+static struct rpmsg_driver ipu_driver = {
+	.drv.name	= KBUILD_MODNAME,
+	.drv.owner	= THIS_MODULE,
+	.id_table	= ipu_id_table,
+	.probe		= ipu_probe,
+	.callback	= ipu_codec_cb,
+	.remove		= __devexit_p(ipu_remove),
+};
+
+static int __init ipu_codec_init(void)
+{
+	return register_rpmsg_driver(&ipu_driver);
+}
+module_init(ipu_codec_init);
+
+static void __exit ipu_codec_exit(void)
+{
+	unregister_rpmsg_driver(&ipu_driver);
+}
+module_exit(ipu_codec_exit);
+
+MODULE_DESCRIPTION("Video codec offload to the OMAP IPU");
+MODULE_LICENSE("GPL v2");
@@ -35,6 +35,10 @@ MODULE_PARM_DESC(shm_total_size, "Start of SHM shared memory");
 module_param(shm_start, uint  , 0440);
 MODULE_PARM_DESC(shm_total_start, "Total Size of SHM shared memory");
 
+static bool shm_tx_wc;
+module_param(shm_tx_wc, bool, 0440);
+MODULE_PARM_DESC(shm_tx_wc, "Map the TX buffers write-combined");
+
 static int shmdev_send_msg(u32 dev_id, u32 mbx_msg)
 {
 	/* Always block until msg is written successfully */
@@ -66,6 +70,7 @@ static int __init caif_shmdev_init(void)
 
 		shmdev_lyr[i].shm_base_addr = shm_start;
 		shmdev_lyr[i].shm_total_sz = shm_size;
+		shmdev_lyr[i].shm_tx_wc = shm_tx_wc;
 
 		if (((char *)shmdev_lyr[i].shm_base_addr == NULL)
 			       || (shmdev_lyr[i].shm_total_sz <= 0))	{
@@ -0,0 +1,561 @@
+/*
+ * CAIF link layer over virtio rings
+ *
+ * License terms: GNU General Public License (GPL) version 2.
+ *
+ * The modem side of a remote processor exposes a virtio device with two
+ * virtqueues: one carrying CAIF frames from the modem to us (rx) and one
+ * carrying frames from us to the modem (tx). Frames are never copied:
+ * the skb head and fragments are handed to the modem as scatterlist
+ * entries, and received frames land directly in preallocated skbs.
+ */
+
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/module.h>
+#include <linux/netdevice.h>
+#include <linux/rtnetlink.h>
+#include <linux/if_arp.h>
+#include <linux/skbuff.h>
+#include <linux/spinlock.h>
+#include <linux/scatterlist.h>
+#include <linux/virtio.h>
+#include <linux/virtio_ids.h>
+#include <linux/virtio_config.h>
+#include <net/caif/caif_dev.h>
+#include <net/caif/caif_layer.h>
+
+/* Largest CAIF frame we exchange with the modem */
+#define CFV_DEF_MTU_SIZE	4096
+
+/* Max number of scatterlist entries one outgoing frame may need */
+#define CFV_TX_MAX_SG		(MAX_SKB_FRAGS + 1)
+
+#define CFV_NAPI_WEIGHT		64
+
+#define ON 1
+#define OFF 0
+
+/**
+ * struct cfv_info - state of a CAIF virtio link
+ * @cfdev: CAIF device, must be first (the CAIF core casts the priv area)
+ * @ndev: the CAIF network interface
+ * @vdev: the underlying virtio device
+ * @vq_rx: frames from the modem
+ * @vq_tx: frames to the modem
+ * @napi: polls both rings, from softirq context
+ * @tx_lock: serializes the tx virtqueue
+ * @tx_pending: number of skbs the modem hasn't consumed yet
+ * @tx_flow_on: tx_pending at which flow is turned back on, if it's off
+ * @flow_off: we asked the CAIF stack to stop sending
+ * @frozen: the virtqueues are gone, until the device is restored (the
+ *	modem is restarting); protected by the rtnl lock and @tx_lock
+ * @mru: size of the buffers posted on the rx ring
+ * @sg: scatterlist used to map outgoing frames, protected by @tx_lock
+ */
+struct cfv_info {
+	struct caif_dev_common cfdev;
+	struct net_device *ndev;
+	struct virtio_device *vdev;
+	struct virtqueue *vq_rx;
+	struct virtqueue *vq_tx;
+	struct napi_struct napi;
+	spinlock_t tx_lock;
+	unsigned int tx_pending;
+	unsigned int tx_flow_on;
+	bool flow_off;
+	bool frozen;
+	unsigned int mru;
+	struct scatterlist sg[CFV_TX_MAX_SG];
+};
+
+/* reclaim the frames the modem is done with; called with tx_lock held */
+static unsigned int cfv_release_used_buf(struct cfv_info *cfv)
+{
+	struct sk_buff *skb;
+	unsigned int len, freed = 0;
+
+	while ((skb = virtqueue_get_buf(cfv->vq_tx, &len)) != NULL) {
+		cfv->ndev->stats.tx_packets++;
+		cfv->ndev->stats.tx_bytes += skb->len;
+		dev_kfree_skb_any(skb);
+		freed++;
+	}
+
+	cfv->tx_pending -= freed;
+	return freed;
+}
+
+/* post one empty buffer on the rx ring; doesn't kick */
+static int cfv_add_rx_buf(struct cfv_info *cfv, gfp_t gfp)
+{
+	struct scatterlist sg;
+	struct sk_buff *skb;
+	int err;
+
+	skb = __netdev_alloc_skb(cfv->ndev, cfv->mru, gfp);
+	if (!skb)
+		return -ENOMEM;
+
+	sg_init_one(&sg, skb->data, cfv->mru);
+
+	err = virtqueue_add_buf(cfv->vq_rx, &sg, 0, 1, skb, gfp);
+	if (err < 0)
+		dev_kfree_skb_any(skb);
+
+	return err;
+}
+
+/*
+ * Fill the rx ring with as many buffers as it takes, and let the modem
+ * know about all of them with a single notification (if it wants one).
+ * Returns the number of buffers posted.
+ */
+static int cfv_refill_rx(struct cfv_info *cfv, gfp_t gfp)
+{
+	int added = 0;
+
+	while (cfv_add_rx_buf(cfv, gfp) > 0)
+		added++;
+
+	if (added && virtqueue_kick_prepare(cfv->vq_rx))
+		virtqueue_notify(cfv->vq_rx);
+
+	return added;
+}
+
+static void cfv_rx_frame(struct cfv_info *cfv, struct sk_buff *skb,
+			 unsigned int len, struct sk_buff_head *frames)
+{
+	struct net_device *ndev = cfv->ndev;
+
+	if (unlikely(len > cfv->mru)) {
+		netdev_dbg(ndev, "bad rx frame length %u\n", len);
+		ndev->stats.rx_length_errors++;
+		dev_kfree_skb(skb);
+		return;
+	}
+
+	skb_put(skb, len);
+	skb->protocol = htons(ETH_P_CAIF);
+	skb_reset_mac_header(skb);
+
+	ndev->stats.rx_packets++;
+	ndev->stats.rx_bytes += len;
+
+	__skb_queue_tail(frames, skb);
+}
+
+/* turn flow back on once the modem has drained enough of the tx ring */
+static void cfv_tx_reclaim(struct cfv_info *cfv)
+{
+	bool flow_on = false;
+
+	spin_lock_bh(&cfv->tx_lock);
+
+	cfv_release_used_buf(cfv);
+
+	if (cfv->flow_off && cfv->tx_pending <= cfv->tx_flow_on) {
+		cfv->flow_off = false;
+		virtqueue_disable_cb(cfv->vq_tx);
+		flow_on = true;
+	}
+
+	spin_unlock_bh(&cfv->tx_lock);
+
+	if (flow_on && cfv->cfdev.flowctrl)
+		cfv->cfdev.flowctrl(cfv->ndev, ON);
+}
+
+static int cfv_poll(struct napi_struct *napi, int budget)
+{
+	struct cfv_info *cfv = container_of(napi, struct cfv_info, napi);
+	struct sk_buff_head frames;
+	struct sk_buff *skb;
+	unsigned int len;
+	int received = 0;
+
+	cfv_tx_reclaim(cfv);
+
+	__skb_queue_head_init(&frames);
+
+again:
+	while (received < budget &&
+	       (skb = virtqueue_get_buf(cfv->vq_rx, &len)) != NULL) {
+		cfv_rx_frame(cfv, skb, len, &frames);
+		received++;
+	}
+
+	/* hand the whole batch back to the modem at once */
+	if (received)
+		cfv_refill_rx(cfv, GFP_ATOMIC);
+
+	/* and the frames up the CAIF stack at once, too */
+	if (!skb_queue_empty(&frames))
+		caif_receive_list(cfv->ndev, &frames);
+
+	if (received < budget) {
+		napi_complete(napi);
+		if (unlikely(!virtqueue_enable_cb(cfv->vq_rx)) &&
+		    napi_schedule_prep(napi)) {
+			virtqueue_disable_cb(cfv->vq_rx);
+			__napi_schedule(napi);
+			goto again;
+		}
+	}
+
+	return received;
+}
+
+/*
+ * Both rings are serviced by NAPI: the virtqueue callbacks may run in
+ * hard irq context, where neither the CAIF stack nor the rx path can be
+ * entered.
+ */
+static void cfv_recv_done(struct virtqueue *vq)
+{
+	struct cfv_info *cfv = vq->vdev->priv;
+
+	if (napi_schedule_prep(&cfv->napi)) {
+		virtqueue_disable_cb(vq);
+		__napi_schedule(&cfv->napi);
+	}
+}
+
+static void cfv_tx_done(struct virtqueue *vq)
+{
+	struct cfv_info *cfv = vq->vdev->priv;
+
+	virtqueue_disable_cb(vq);
+	napi_schedule(&cfv->napi);
+}
+
+static int cfv_netdev_open(struct net_device *ndev)
+{
+	struct cfv_info *cfv = netdev_priv(ndev);
+
+	/* the modem is restarting; we're brought up once it's restored */
+	if (cfv->frozen)
+		return 0;
+
+	napi_enable(&cfv->napi);
+
+	/* pick up anything the modem sent while we were down */
+	napi_schedule(&cfv->napi);
+
+	netif_carrier_on(ndev);
+	return 0;
+}
+
+static int cfv_netdev_close(struct net_device *ndev)
+{
+	struct cfv_info *cfv = netdev_priv(ndev);
+
+	netif_carrier_off(ndev);
+	if (!cfv->frozen)
+		napi_disable(&cfv->napi);
+	return 0;
+}
+
+static int cfv_netdev_tx(struct sk_buff *skb, struct net_device *ndev)
+{
+	struct cfv_info *cfv = netdev_priv(ndev);
+	bool flow_off = false;
+	bool notify;
+	int nents, err;
+
+	/* the modem holds the skb from now on; don't hold up its socket */
+	skb_orphan(skb);
+
+	spin_lock_bh(&cfv->tx_lock);
+
+	if (unlikely(cfv->frozen)) {
+		spin_unlock_bh(&cfv->tx_lock);
+		goto drop;
+	}
+
+	/* free whatever the modem already consumed, without an interrupt */
+	cfv_release_used_buf(cfv);
+
+	sg_init_table(cfv->sg, CFV_TX_MAX_SG);
+	nents = skb_to_sgvec(skb, cfv->sg, 0, skb->len);
+
+	err = virtqueue_add_buf(cfv->vq_tx, cfv->sg, nents, 0, skb,
+								GFP_ATOMIC);
+	if (unlikely(err < 0)) {
+		spin_unlock_bh(&cfv->tx_lock);
+		netdev_dbg(ndev, "tx ring full: %d\n", err);
+		goto drop;
+	}
+
+	cfv->tx_pending++;
+
+	/*
+	 * Stop the CAIF stack before the ring overflows, and ask the modem
+	 * for a callback once it has drained a good part of what's queued.
+	 */
+	if (err < CFV_TX_MAX_SG && !cfv->flow_off) {
+		cfv->flow_off = true;
+		cfv->tx_flow_on = cfv->tx_pending / 2;
+		flow_off = true;
+		if (!virtqueue_enable_cb_delayed(cfv->vq_tx))
+			napi_schedule(&cfv->napi);
+	}
+
+	notify = virtqueue_kick_prepare(cfv->vq_tx);
+
+	spin_unlock_bh(&cfv->tx_lock);
+
+	if (flow_off && cfv->cfdev.flowctrl)
+		cfv->cfdev.flowctrl(ndev, OFF);
+
+	/* event index suppression: only notify if the modem asked for it */
+	if (notify)
+		virtqueue_notify(cfv->vq_tx);
+
+	return NETDEV_TX_OK;
+
+drop:
+	ndev->stats.tx_dropped++;
+	dev_kfree_skb(skb);
+	return NETDEV_TX_OK;
+}
+
+static const struct net_device_ops cfv_netdev_ops = {
+	.ndo_open = cfv_netdev_open,
+	.ndo_stop = cfv_netdev_close,
+	.ndo_start_xmit = cfv_netdev_tx,
+};
+
+static void cfv_netdev_setup(struct net_device *ndev)
+{
+	struct cfv_info *cfv = netdev_priv(ndev);
+
+	ndev->netdev_ops = &cfv_netdev_ops;
+	/*
+	 * Frames are handed over as they are, page fragments included. CAIF
+	 * carries no checksum the stack could offload, but the core won't
+	 * keep NETIF_F_SG without a checksum feature. No NETIF_F_FRAGLIST:
+	 * the scatterlist is sized for the head and the page fragments.
+	 */
+	ndev->features = NETIF_F_SG | NETIF_F_HW_CSUM;
+	ndev->hw_features = ndev->features;
+	ndev->type = ARPHRD_CAIF;
+	ndev->flags = IFF_POINTOPOINT | IFF_NOARP;
+	ndev->mtu = CFV_DEF_MTU_SIZE;
+	ndev->tx_queue_len = 0;
+
+	cfv->cfdev.link_select = CAIF_LINK_HIGH_BANDW;
+	cfv->cfdev.use_frag = false;
+	cfv->cfdev.use_stx = false;
+	cfv->cfdev.use_fcs = false;
+	cfv->mru = CFV_DEF_MTU_SIZE;
+	cfv->ndev = ndev;
+	spin_lock_init(&cfv->tx_lock);
+}
+
+static void cfv_free_unused_bufs(struct cfv_info *cfv)
+{
+	struct sk_buff *skb;
+
+	while ((skb = virtqueue_detach_unused_buf(cfv->vq_rx)) != NULL)
+		dev_kfree_skb(skb);
+
+	while ((skb = virtqueue_detach_unused_buf(cfv->vq_tx)) != NULL)
+		dev_kfree_skb(skb);
+}
+
+static int cfv_init_vqs(struct cfv_info *cfv)
+{
+	vq_callback_t *callbacks[] = { cfv_recv_done, cfv_tx_done };
+	const char *names[] = { "input", "output" };
+	struct virtio_device *vdev = cfv->vdev;
+	struct virtqueue *vqs[2];
+	int err;
+
+	err = vdev->config->find_vqs(vdev, 2, vqs, callbacks, names);
+	if (err) {
+		dev_err(&vdev->dev, "failed to find virtqueues: %d\n", err);
+		return err;
+	}
+
+	cfv->vq_rx = vqs[0];
+	cfv->vq_tx = vqs[1];
+
+	/* tx buffers are reclaimed on the next transmit, not on interrupt */
+	virtqueue_disable_cb(cfv->vq_tx);
+
+	return 0;
+}
+
+static int cfv_probe(struct virtio_device *vdev)
+{
+	struct net_device *ndev;
+	struct cfv_info *cfv;
+	int err;
+
+	ndev = alloc_netdev(sizeof(struct cfv_info), "cfvrt%d",
+							cfv_netdev_setup);
+	if (!ndev)
+		return -ENOMEM;
+
+	cfv = netdev_priv(ndev);
+	cfv->vdev = vdev;
+	vdev->priv = cfv;
+	SET_NETDEV_DEV(ndev, &vdev->dev);
+
+	err = cfv_init_vqs(cfv);
+	if (err)
+		goto free_ndev;
+
+	netif_napi_add(ndev, &cfv->napi, cfv_poll, CFV_NAPI_WEIGHT);
+
+	if (!cfv_refill_rx(cfv, GFP_KERNEL)) {
+		dev_err(&vdev->dev, "failed to post rx buffers\n");
+		err = -ENOMEM;
+		goto free_bufs;
+	}
+
+	netif_carrier_off(ndev);
+
+	err = register_netdev(ndev);
+	if (err) {
+		dev_err(&vdev->dev, "failed to register netdev: %d\n", err);
+		goto free_bufs;
+	}
+
+	return 0;
+
+free_bufs:
+	vdev->config->reset(vdev);
+	cfv_free_unused_bufs(cfv);
+	vdev->config->del_vqs(vdev);
+free_ndev:
+	free_netdev(ndev);
+	return err;
+}
+
+static void __devexit cfv_remove(struct virtio_device *vdev)
+{
+	struct cfv_info *cfv = vdev->priv;
+	struct net_device *ndev = cfv->ndev;
+
+	unregister_netdev(ndev);
+
+	/* unless the virtqueues are gone already, because we were frozen */
+	if (!cfv->frozen) {
+		vdev->config->reset(vdev);
+		cfv_free_unused_bufs(cfv);
+		vdev->config->del_vqs(vdev);
+	}
+
+	free_netdev(ndev);
+}
+
+#ifdef CONFIG_PM
+/*
+ * The modem is being restarted underneath us (see the fast_recovery flag
+ * of remoteproc): the netdev stays registered, without carrier, which
+ * shuts the CAIF channels using it down, and is used again as soon as the
+ * modem is back, with no need to configure networking again.
+ */
+static int cfv_freeze(struct virtio_device *vdev)
+{
+	struct cfv_info *cfv = vdev->priv;
+	struct net_device *ndev = cfv->ndev;
+
+	rtnl_lock();
+
+	netif_carrier_off(ndev);
+	if (netif_running(ndev))
+		napi_disable(&cfv->napi);
+
+	spin_lock_bh(&cfv->tx_lock);
+	cfv->frozen = true;
+	spin_unlock_bh(&cfv->tx_lock);
+
+	rtnl_unlock();
+
+	vdev->config->reset(vdev);
+	cfv_free_unused_bufs(cfv);
+	vdev->config->del_vqs(vdev);
+
+	cfv->tx_pending = 0;
+
+	return 0;
+}
+
+static int cfv_restore(struct virtio_device *vdev)
+{
+	struct cfv_info *cfv = vdev->priv;
+	struct net_device *ndev = cfv->ndev;
+	bool flow_on;
+	int err;
+
+	err = cfv_init_vqs(cfv);
+	if (err)
+		return err;
+
+	if (!cfv_refill_rx(cfv, GFP_KERNEL)) {
+		dev_err(&vdev->dev, "failed to post rx buffers\n");
+		vdev->config->reset(vdev);
+		cfv_free_unused_bufs(cfv);
+		vdev->config->del_vqs(vdev);
+		return -ENOMEM;
+	}
+
+	rtnl_lock();
+
+	spin_lock_bh(&cfv->tx_lock);
+	cfv->frozen = false;
+	flow_on = cfv->flow_off;
+	cfv->flow_off = false;
+	spin_unlock_bh(&cfv->tx_lock);
+
+	if (netif_running(ndev)) {
+		napi_enable(&cfv->napi);
+		napi_schedule(&cfv->napi);
+		netif_carrier_on(ndev);
+	}
+
+	rtnl_unlock();
+
+	if (flow_on && cfv->cfdev.flowctrl)
+		cfv->cfdev.flowctrl(ndev, ON);
+
+	return 0;
+}
+#endif
+
+static struct virtio_device_id id_table[] = {
+	{ VIRTIO_ID_CAIF, VIRTIO_DEV_ANY_ID },
+	{ 0 },
+};
+
+static struct virtio_driver caif_virtio_driver = {
+	.driver.name	= KBUILD_MODNAME,
+	.driver.owner	= THIS_MODULE,
+	.id_table	= id_table,
+	.probe		= cfv_probe,
+	.remove		= __devexit_p(cfv_remove),
+#ifdef CONFIG_PM
+	.freeze		= cfv_freeze,
+	.restore	= cfv_restore,
+#endif
+};
+
+static int __init cfv_init(void)
+{
+	return register_virtio_driver(&caif_virtio_driver);
+}
+module_init(cfv_init);
+
+static void __exit cfv_exit(void)
+{
+	unregister_virtio_driver(&caif_virtio_driver);
+}
+module_exit(cfv_exit);
+
+MODULE_DEVICE_TABLE(virtio, id_table);
+MODULE_DESCRIPTION("CAIF link layer over virtio rings");
+MODULE_LICENSE("GPL v2");
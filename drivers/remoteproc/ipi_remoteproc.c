@@ -0,0 +1,233 @@
+/*
+ * Remote processors signalled with inter-processor interrupts
+ *
+ * An RTOS (or any other firmware) may run on a core of the very cluster
+ * Linux runs on, with Linux kept off that core. There's no mailbox in
+ * between then, but there's no need for one: the cluster shares its
+ * interrupt controller, so the vrings are kicked with a spare IPI (an SGI
+ * of the GIC) raised on the core of the remote processor, and it notifies
+ * us with another one raised on ours. A notification then costs no more
+ * than an IPI does.
+ *
+ * SGIs carry no payload, so each one stands for all the vrings, which are
+ * few. The cluster is cache coherent too: the vrings, buffers and
+ * carveouts are allocated cacheable, and only take SMP barriers.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/err.h>
+#include <linux/platform_device.h>
+#include <linux/dma-mapping.h>
+#include <linux/remoteproc.h>
+#include <linux/cpu.h>
+#include <linux/notifier.h>
+#include <linux/platform_data/remoteproc-ipi.h>
+
+#include <asm/smp.h>
+
+#include "remoteproc_internal.h"
+
+/**
+ * struct ipi_rproc - remote processor signalled with IPIs
+ * @rproc: rproc handle
+ * @pdata: the platform data of the remote processor
+ * @cpu_nb: keeps @pdata->cpu from being brought online while it's running
+ *	    the remote processor
+ * @running: whether @pdata->cpu is running the remote processor
+ *	     (protected by the cpu hotplug lock)
+ */
+struct ipi_rproc {
+	struct rproc *rproc;
+	struct ipi_rproc_pdata *pdata;
+	struct notifier_block cpu_nb;
+	bool running;
+};
+
+/* the remote processor raised its IPI: have a look at all the vrings */
+static void ipi_rproc_notify(void *data)
+{
+	struct rproc *rproc = data;
+
+	rproc_vq_interrupt(rproc, RPROC_ALL_VQS);
+}
+
+/*
+ * kick the remote processor: it has a look at all of its vrings, too.
+ * There's no ->kick_vqs(), as an IPI is cheap enough to be raised right
+ * away rather than being coalesced in softirq context.
+ */
+static void ipi_rproc_kick(struct rproc *rproc, int vqid)
+{
+	struct ipi_rproc *iproc = rproc->priv;
+
+	smp_send_ipi(cpumask_of(iproc->pdata->cpu), iproc->pdata->kick_ipi);
+}
+
+static int ipi_rproc_cpu_callback(struct notifier_block *nb,
+					unsigned long action, void *hcpu)
+{
+	struct ipi_rproc *iproc = container_of(nb, struct ipi_rproc, cpu_nb);
+	unsigned int cpu = (unsigned long)hcpu;
+
+	if ((action & ~CPU_TASKS_FROZEN) != CPU_UP_PREPARE ||
+				cpu != iproc->pdata->cpu || !iproc->running)
+		return NOTIFY_OK;
+
+	dev_err(iproc->rproc->dev.parent, "cpu%u runs %s\n", cpu,
+							iproc->rproc->name);
+	return notifier_from_errno(-EBUSY);
+}
+
+/*
+ * Boot the remote processor on its cpu, after making sure Linux is
+ * kept off it.
+ */
+static int ipi_rproc_start(struct rproc *rproc)
+{
+	struct ipi_rproc *iproc = rproc->priv;
+	struct ipi_rproc_pdata *pdata = iproc->pdata;
+	struct device *dev = rproc->dev.parent;
+	int ret;
+
+	get_online_cpus();
+
+	if (cpu_online(pdata->cpu)) {
+		dev_err(dev, "cpu%u is running Linux\n", pdata->cpu);
+		ret = -EBUSY;
+		goto out;
+	}
+
+	ret = pdata->boot(pdata->cpu, rproc->bootaddr);
+	if (ret) {
+		dev_err(dev, "can't boot cpu%u: %d\n", pdata->cpu, ret);
+		goto out;
+	}
+
+	iproc->running = true;
+
+out:
+	put_online_cpus();
+	return ret;
+}
+
+/* stop the remote processor, which lets its cpu be brought online again */
+static int ipi_rproc_stop(struct rproc *rproc)
+{
+	struct ipi_rproc *iproc = rproc->priv;
+	int ret;
+
+	get_online_cpus();
+
+	ret = iproc->pdata->shutdown(iproc->pdata->cpu);
+	if (!ret)
+		iproc->running = false;
+
+	put_online_cpus();
+	return ret;
+}
+
+static struct rproc_ops ipi_rproc_ops = {
+	.start		= ipi_rproc_start,
+	.stop		= ipi_rproc_stop,
+	.kick		= ipi_rproc_kick,
+};
+
+static int __devinit ipi_rproc_probe(struct platform_device *pdev)
+{
+	struct ipi_rproc_pdata *pdata = pdev->dev.platform_data;
+	struct ipi_rproc *iproc;
+	struct rproc *rproc;
+	int ret;
+
+	if (!pdata || !pdata->boot || !pdata->shutdown ||
+					!cpu_possible(pdata->cpu)) {
+		dev_err(&pdev->dev, "invalid platform data\n");
+		return -EINVAL;
+	}
+
+	/* the remote processor is on our coherent cluster: no uncached maps */
+	set_dma_ops(&pdev->dev, &arm_coherent_dma_ops);
+
+	ret = dma_set_coherent_mask(&pdev->dev, DMA_BIT_MASK(32));
+	if (ret) {
+		dev_err(&pdev->dev, "dma_set_coherent_mask: %d\n", ret);
+		return ret;
+	}
+
+	rproc = rproc_alloc(&pdev->dev, pdata->name, &ipi_rproc_ops,
+				pdata->firmware, sizeof(*iproc));
+	if (!rproc)
+		return -ENOMEM;
+
+	iproc = rproc->priv;
+	iproc->rproc = rproc;
+	iproc->pdata = pdata;
+	iproc->cpu_nb.notifier_call = ipi_rproc_cpu_callback;
+
+	/* the vrings only take SMP barriers */
+	rproc->coherent = true;
+
+	platform_set_drvdata(pdev, rproc);
+
+	ret = set_ipi_handler(pdata->notify_ipi, ipi_rproc_notify, rproc);
+	if (ret) {
+		dev_err(&pdev->dev, "can't claim IPI %d: %d\n",
+						pdata->notify_ipi, ret);
+		goto free_rproc;
+	}
+
+	ret = register_cpu_notifier(&iproc->cpu_nb);
+	if (ret)
+		goto clear_ipi;
+
+	ret = rproc_add(rproc);
+	if (ret)
+		goto unregister_nb;
+
+	return 0;
+
+unregister_nb:
+	unregister_cpu_notifier(&iproc->cpu_nb);
+clear_ipi:
+	clear_ipi_handler(pdata->notify_ipi);
+free_rproc:
+	rproc_put(rproc);
+	return ret;
+}
+
+static int __devexit ipi_rproc_remove(struct platform_device *pdev)
+{
+	struct rproc *rproc = platform_get_drvdata(pdev);
+	struct ipi_rproc *iproc = rproc->priv;
+
+	rproc_del(rproc);
+	unregister_cpu_notifier(&iproc->cpu_nb);
+	clear_ipi_handler(iproc->pdata->notify_ipi);
+	rproc_put(rproc);
+
+	return 0;
+}
+
+static struct platform_driver ipi_rproc_driver = {
+	.probe = ipi_rproc_probe,
+	.remove = __devexit_p(ipi_rproc_remove),
+	.driver = {
+		.name = "ipi-rproc",
+		.owner = THIS_MODULE,
+	},
+};
+
+module_platform_driver(ipi_rproc_driver);
+
+MODULE_LICENSE("GPL v2");
+MODULE_DESCRIPTION("Remote Processor driver for cores signalled with IPIs");
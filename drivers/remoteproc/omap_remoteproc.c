@@ -27,23 +27,85 @@
 #include <linux/platform_device.h>
 #include <linux/dma-mapping.h>
 #include <linux/remoteproc.h>
+#include <linux/interrupt.h>
+#include <linux/clk.h>
+#include <linux/devfreq.h>
+#include <linux/debugfs.h>
+#include <linux/uaccess.h>
+#include <linux/slab.h>
+#include <linux/sched.h>
+#include <linux/sort.h>
+#include <linux/pm_runtime.h>
 
 #include <plat/mailbox.h>
+#include <plat/dmtimer.h>
+#include <plat/iommu.h>
 #include <linux/platform_data/remoteproc-omap.h>
 
 #include "omap_remoteproc.h"
 #include "remoteproc_internal.h"
 
+/* how long (in msecs) an idle remote processor is left on, if it can idle */
+#define OMAP_RPROC_AUTOSUSPEND_DELAY	10000
+
+/* how often (in msecs) the load of a remote processor is sampled, for dvfs */
+#define OMAP_RPROC_DVFS_POLL_MS		100
+
+/* most echo round trips a latency probe may make, and how long each waits */
+#define OMAP_RPROC_ECHO_MAX		10000
+#define OMAP_RPROC_ECHO_TIMEOUT_MS	100
+
+/* mailbox messages queued on top of a kick of each vring: echoes, events */
+#define OMAP_RPROC_MBOX_EXTRA		8
+
+/**
+ * struct omap_rproc_echo_stats - what the last echo latency probe measured
+ * @rounds: number of round trips that were made
+ * @min_ns: latency of the fastest round trip, in nsecs
+ * @avg_ns: average latency of the round trips, in nsecs
+ * @p99_ns: 99th percentile of the latencies, in nsecs
+ * @max_ns: latency of the slowest round trip, in nsecs
+ */
+struct omap_rproc_echo_stats {
+	unsigned int rounds;
+	u32 min_ns;
+	u32 avg_ns;
+	u32 p99_ns;
+	u32 max_ns;
+};
+
 /**
  * struct omap_rproc - omap remote processor state
  * @mbox: omap mailbox handle
  * @nb: notifier block that will be invoked on inbound mailbox messages
  * @rproc: rproc handle
+ * @wdt: the dmtimer the remote processor uses as its watchdog, if any
+ * @doorbell: the doorbell the remote processor shares with us, if any
+ * @doorbell_lock: serializes the kicks that are posted to @doorbell
+ * @clk: the functional clock of the remote processor, if it's scaled
+ * @devfreq: scales @clk with the load of the remote processor
+ * @devfreq_profile: the devfreq profile of the remote processor
+ * @echo_probing: an echo latency probe is waiting for @echo_reply
+ * @echo_reply: completed when an awaited echo reply is received
+ * @echo_stamp: when the awaited echo reply was received
+ * @echo_stats: what the last echo latency probe measured
+ * @dbg_echo: the 'echo_latency' debugfs entry
  */
 struct omap_rproc {
 	struct omap_mbox *mbox;
 	struct notifier_block nb;
 	struct rproc *rproc;
+	struct omap_dm_timer *wdt;
+	struct omap_rproc_doorbell *doorbell;
+	spinlock_t doorbell_lock;
+	struct clk *clk;
+	struct devfreq *devfreq;
+	struct devfreq_dev_profile devfreq_profile;
+	bool echo_probing;
+	struct completion echo_reply;
+	ktime_t echo_stamp;
+	struct omap_rproc_echo_stats echo_stats;
+	struct dentry *dbg_echo;
 };
 
 /**
@@ -53,13 +115,17 @@ struct omap_rproc {
  * @data: mailbox payload
  *
  * This handler is invoked by omap's mailbox driver whenever a mailbox
- * message is received. Usually, the mailbox payload simply contains
+ * message is received, right from its interrupt handler (so the vring
+ * notifications are handled with no scheduling latency, and it must not
+ * sleep). Usually, the mailbox payload simply contains
  * the index of the virtqueue that is kicked by the remote processor,
  * and we let remoteproc core handle it.
  *
  * In addition to virtqueue indices, we also have some out-of-band values
  * that indicates different events. Those values are deliberately very
- * big so they don't coincide with virtqueue indices.
+ * big so they don't coincide with virtqueue indices. Messages in the
+ * RP_MBOX_EVENT range carry inline events, which are handed to remoteproc
+ * core as they are.
  */
 static int omap_rproc_mbox_callback(struct notifier_block *this,
 					unsigned long index, void *data)
@@ -71,14 +137,30 @@ static int omap_rproc_mbox_callback(struct notifier_block *this,
 
 	dev_dbg(dev, "mbox msg: 0x%x\n", msg);
 
+	if ((msg & ~RP_MBOX_EVENT_MASK) == RP_MBOX_EVENT) {
+		rproc_event_interrupt(oproc->rproc, msg & RP_MBOX_EVENT_MASK);
+		return NOTIFY_DONE;
+	}
+
 	switch (msg) {
 	case RP_MBOX_CRASH:
-		/* just log this for now. later, we'll also do recovery */
 		dev_err(dev, "omap rproc %s crashed\n", name);
+		rproc_report_crash(oproc->rproc, RPROC_FATAL_ERROR);
 		break;
 	case RP_MBOX_ECHO_REPLY:
+		if (ACCESS_ONCE(oproc->echo_probing)) {
+			oproc->echo_stamp = ktime_get();
+			complete(&oproc->echo_reply);
+			break;
+		}
 		dev_info(dev, "received echo reply from %s\n", name);
 		break;
+	case RP_MBOX_PENDING_MSG:
+		/* some vrings were triggered: look at all of them */
+		if (rproc_vq_interrupt(oproc->rproc, RPROC_ALL_VQS) ==
+								IRQ_NONE)
+			dev_dbg(dev, "no message was found in any vq\n");
+		break;
 	default:
 		/* msg contains the index of the triggered vring */
 		if (rproc_vq_interrupt(oproc->rproc, msg) == IRQ_NONE)
@@ -88,41 +170,178 @@ static int omap_rproc_mbox_callback(struct notifier_block *this,
 	return NOTIFY_DONE;
 }
 
-/* kick a virtqueue */
+/*
+ * post kicks to the shared doorbell (see struct omap_rproc_doorbell), and
+ * return the virtqueues that still need a mailbox message: those whose
+ * previous kick the remote processor had caught up with, and those the
+ * doorbell can't be rung for.
+ */
+static unsigned long omap_rproc_ring_doorbell(struct omap_rproc *oproc,
+						unsigned long vqids)
+{
+	struct omap_rproc_doorbell *db = oproc->doorbell;
+	unsigned long flags, notify;
+	int vq;
+
+	notify = vqids & ~((1UL << OMAP_RPROC_DOORBELL_VQS) - 1);
+
+	spin_lock_irqsave(&oproc->doorbell_lock, flags);
+
+	for_each_set_bit(vq, &vqids, OMAP_RPROC_DOORBELL_VQS)
+		ACCESS_ONCE(db->kicked[vq]) = db->kicked[vq] + 1;
+
+	/* post the kicks before looking at what the remote caught up with */
+	mb();
+
+	for_each_set_bit(vq, &vqids, OMAP_RPROC_DOORBELL_VQS)
+		if (ACCESS_ONCE(db->seen[vq]) == db->kicked[vq] - 1)
+			notify |= 1UL << vq;
+
+	spin_unlock_irqrestore(&oproc->doorbell_lock, flags);
+
+	return notify;
+}
+
+/*
+ * kick several virtqueues with a single mailbox message: the index of the
+ * triggered virtqueue if there is only one, or RP_MBOX_PENDING_MSG, which
+ * has the remote processor look at all of them, otherwise.
+ */
+static void omap_rproc_kick_vqs(struct rproc *rproc, unsigned long vqids)
+{
+	struct omap_rproc *oproc = rproc->priv;
+	mbox_msg_t msg;
+
+	if (oproc->doorbell) {
+		vqids = omap_rproc_ring_doorbell(oproc, vqids);
+		if (!vqids)
+			return;
+	}
+
+	if (hweight_long(vqids) == 1)
+		msg = __ffs(vqids);
+	else
+		msg = RP_MBOX_PENDING_MSG;
+
+	omap_mbox_doorbell(oproc->mbox, msg, RP_MBOX_PENDING_MSG);
+}
+
+/*
+ * kick a virtqueue. The mailbox doorbell is used, so the kick is never
+ * lost, even with a full mailbox: it's then turned into an
+ * RP_MBOX_PENDING_MSG, which covers any vq kicked before it's sent.
+ */
 static void omap_rproc_kick(struct rproc *rproc, int vqid)
+{
+	struct omap_rproc *oproc = rproc->priv;
+
+	if (vqid < BITS_PER_LONG) {
+		omap_rproc_kick_vqs(rproc, 1UL << vqid);
+		return;
+	}
+
+	/* send the index of the triggered virtqueue in the mailbox payload */
+	omap_mbox_doorbell(oproc->mbox, vqid, RP_MBOX_PENDING_MSG);
+}
+
+/* send an inline event in the mailbox message itself */
+static int omap_rproc_send_event(struct rproc *rproc, u32 event)
+{
+	struct omap_rproc *oproc = rproc->priv;
+
+	if (event & ~RP_MBOX_EVENT_MASK)
+		return -EINVAL;
+
+	return omap_mbox_msg_send(oproc->mbox, RP_MBOX_EVENT | event);
+}
+
+/* the watchdog timer of the remote processor overflowed: it hung */
+static irqreturn_t omap_rproc_watchdog_isr(int irq, void *data)
+{
+	struct rproc *rproc = data;
+	struct omap_rproc *oproc = rproc->priv;
+
+	omap_dm_timer_write_status(oproc->wdt, OMAP_TIMER_INT_OVERFLOW);
+
+	rproc_report_crash(rproc, RPROC_WATCHDOG);
+
+	return IRQ_HANDLED;
+}
+
+/*
+ * grab the dmtimer the remote processor uses as its watchdog, if any: the
+ * remote processor programs, starts and reloads it itself, and we only
+ * take its overflow interrupt.
+ */
+static int omap_rproc_enable_watchdog(struct rproc *rproc)
 {
 	struct omap_rproc *oproc = rproc->priv;
 	struct device *dev = rproc->dev.parent;
+	struct omap_rproc_pdata *pdata = dev->platform_data;
 	int ret;
 
-	/* send the index of the triggered virtqueue in the mailbox payload */
-	ret = omap_mbox_msg_send(oproc->mbox, vqid);
-	if (ret)
-		dev_err(dev, "omap_mbox_msg_send failed: %d\n", ret);
+	if (!pdata->watchdog_timer)
+		return 0;
+
+	oproc->wdt = omap_dm_timer_request_specific(pdata->watchdog_timer);
+	if (!oproc->wdt) {
+		dev_err(dev, "can't get watchdog timer %d\n",
+						pdata->watchdog_timer);
+		return -EBUSY;
+	}
+
+	ret = request_irq(omap_dm_timer_get_irq(oproc->wdt),
+				omap_rproc_watchdog_isr, 0, "rproc-wdt", rproc);
+	if (ret) {
+		dev_err(dev, "can't request watchdog irq: %d\n", ret);
+		omap_dm_timer_free(oproc->wdt);
+		oproc->wdt = NULL;
+		return ret;
+	}
+
+	omap_dm_timer_set_int_enable(oproc->wdt, OMAP_TIMER_INT_OVERFLOW);
+
+	return 0;
+}
+
+static void omap_rproc_disable_watchdog(struct rproc *rproc)
+{
+	struct omap_rproc *oproc = rproc->priv;
+
+	if (!oproc->wdt)
+		return;
+
+	omap_dm_timer_set_int_enable(oproc->wdt, 0);
+	free_irq(omap_dm_timer_get_irq(oproc->wdt), rproc);
+	omap_dm_timer_free(oproc->wdt);
+	oproc->wdt = NULL;
 }
 
 /*
- * Power up the remote processor.
+ * Get the mailbox and the watchdog of the remote processor ready.
  *
- * This function will be invoked only after the firmware for this rproc
- * was loaded, parsed successfully, and all of its resource requirements
- * were met.
+ * This function is invoked while the firmware for this rproc is being
+ * loaded, so it mustn't touch its memory: that's for omap_rproc_start().
  */
-static int omap_rproc_start(struct rproc *rproc)
+static int omap_rproc_prepare(struct rproc *rproc)
 {
 	struct omap_rproc *oproc = rproc->priv;
 	struct device *dev = rproc->dev.parent;
 	struct platform_device *pdev = to_platform_device(dev);
 	struct omap_rproc_pdata *pdata = pdev->dev.platform_data;
+	struct rproc_vdev *rvdev;
+	unsigned int depth = OMAP_RPROC_MBOX_EXTRA;
 	int ret;
 
-	if (pdata->set_bootaddr)
-		pdata->set_bootaddr(rproc->bootaddr);
-
 	oproc->nb.notifier_call = omap_rproc_mbox_callback;
 
+	/* size the mailbox queues for the vrings of the firmware */
+	list_for_each_entry(rvdev, &rproc->rvdevs, node)
+		depth += rvdev->num_vrings;
+	omap_mbox_request_depth(pdata->mbox_name, depth);
+
 	/* every omap rproc is assigned a mailbox instance for messaging */
-	oproc->mbox = omap_mbox_get(pdata->mbox_name, &oproc->nb);
+	oproc->mbox = omap_mbox_get_atomic(pdata->mbox_name, &oproc->nb);
 	if (IS_ERR(oproc->mbox)) {
 		ret = PTR_ERR(oproc->mbox);
 		dev_err(dev, "omap_mbox_get failed: %d\n", ret);
@@ -142,19 +361,83 @@ static int omap_rproc_start(struct rproc *rproc)
 		goto put_mbox;
 	}
 
-	ret = pdata->device_enable(pdev);
-	if (ret) {
-		dev_err(dev, "omap_device_enable failed: %d\n", ret);
+	/* let the mailbox interrupt follow the vring notifications, if bound */
+	if (!cpumask_empty(rproc->ipc_cpus))
+		irq_set_affinity_hint(oproc->mbox->irq, rproc->ipc_cpus);
+
+	ret = omap_rproc_enable_watchdog(rproc);
+	if (ret)
 		goto put_mbox;
-	}
 
 	return 0;
 
 put_mbox:
+	irq_set_affinity_hint(oproc->mbox->irq, NULL);
 	omap_mbox_put(oproc->mbox, &oproc->nb);
 	return ret;
 }
 
+/* release what omap_rproc_prepare() set up */
+static void omap_rproc_unprepare(struct rproc *rproc)
+{
+	struct omap_rproc *oproc = rproc->priv;
+
+	omap_rproc_disable_watchdog(rproc);
+	irq_set_affinity_hint(oproc->mbox->irq, NULL);
+	omap_mbox_put(oproc->mbox, &oproc->nb);
+}
+
+/*
+ * Power up the remote processor.
+ *
+ * This function will be invoked only after the firmware for this rproc
+ * was loaded, parsed successfully, all of its resource requirements
+ * were met, and omap_rproc_prepare() completed.
+ */
+static int omap_rproc_start(struct rproc *rproc)
+{
+	struct omap_rproc *oproc = rproc->priv;
+	struct device *dev = rproc->dev.parent;
+	struct platform_device *pdev = to_platform_device(dev);
+	struct omap_rproc_pdata *pdata = pdev->dev.platform_data;
+	unsigned int core;
+	int ret;
+
+	if (pdata->set_bootaddr)
+		pdata->set_bootaddr(rproc->bootaddr);
+
+	/* the other cores may boot elsewhere (see fw_rsc_core) */
+	for (core = 1; pdata->set_core_bootaddr && core < rproc->num_cores;
+								core++)
+		pdata->set_core_bootaddr(core, rproc->core_bootaddr[core]);
+
+	if (pdata->doorbell_da) {
+		oproc->doorbell = rproc_da_to_va(rproc, pdata->doorbell_da,
+						sizeof(*oproc->doorbell));
+		if (!oproc->doorbell) {
+			dev_err(dev, "no doorbell at da 0x%x\n",
+						pdata->doorbell_da);
+			return -EINVAL;
+		}
+
+		/* nothing was kicked, nor seen, yet */
+		memset(oproc->doorbell, 0, sizeof(*oproc->doorbell));
+	}
+
+	/* the iommu domain outlived the last power cycle: reprogram the mmu */
+	if (rproc->domain)
+		omap_iommu_restore_ctx(dev);
+
+	ret = pdata->device_enable(pdev);
+	if (ret) {
+		dev_err(dev, "omap_device_enable failed: %d\n", ret);
+		oproc->doorbell = NULL;
+		return ret;
+	}
+
+	return 0;
+}
+
 /* power off the remote processor */
 static int omap_rproc_stop(struct rproc *rproc)
 {
@@ -164,19 +447,315 @@ static int omap_rproc_stop(struct rproc *rproc)
 	struct omap_rproc *oproc = rproc->priv;
 	int ret;
 
+	/* the mmu loses its registers, but not its page tables, when off */
+	if (rproc->domain)
+		omap_iommu_save_ctx(dev);
+
 	ret = pdata->device_shutdown(pdev);
 	if (ret)
 		return ret;
 
-	omap_mbox_put(oproc->mbox, &oproc->nb);
+	oproc->doorbell = NULL;
+
+	return 0;
+}
+
+/* gate the clocks of an idle remote processor */
+static int omap_rproc_suspend(struct rproc *rproc)
+{
+	struct device *dev = rproc->dev.parent;
+	struct platform_device *pdev = to_platform_device(dev);
+	struct omap_rproc_pdata *pdata = pdev->dev.platform_data;
+
+	if (!pdata->device_idle)
+		return -EOPNOTSUPP;
+
+	if (rproc->domain)
+		omap_iommu_save_ctx(dev);
+
+	return pdata->device_idle(pdev);
+}
+
+/*
+ * ungate the clocks of an idle remote processor: the mailbox messages that
+ * were sent meanwhile are waiting for it in the mailbox fifo
+ */
+static int omap_rproc_resume(struct rproc *rproc)
+{
+	struct device *dev = rproc->dev.parent;
+	struct platform_device *pdev = to_platform_device(dev);
+	struct omap_rproc_pdata *pdata = pdev->dev.platform_data;
+
+	if (rproc->domain)
+		omap_iommu_restore_ctx(dev);
+
+	return pdata->device_enable(pdev);
+}
+
+#ifdef CONFIG_OMAP_REMOTEPROC_DVFS
+/* move the remote processor to the OPP devfreq picked */
+static int omap_rproc_devfreq_target(struct device *dev, unsigned long *freq,
+								u32 flags)
+{
+	struct rproc *rproc = platform_get_drvdata(to_platform_device(dev));
+	struct omap_rproc *oproc = rproc->priv;
+	struct opp *opp;
+	unsigned long rate;
+	int ret;
+
+	rcu_read_lock();
+	opp = devfreq_recommended_opp(dev, freq, flags);
+	if (IS_ERR(opp)) {
+		rcu_read_unlock();
+		return PTR_ERR(opp);
+	}
+	rate = opp_get_freq(opp);
+	rcu_read_unlock();
+
+	if (rate != clk_get_rate(oproc->clk)) {
+		ret = clk_set_rate(oproc->clk, rate);
+		if (ret) {
+			dev_err(dev, "can't set rate %lu: %d\n", rate, ret);
+			return ret;
+		}
+	}
+
+	*freq = clk_get_rate(oproc->clk);
 
 	return 0;
 }
 
+/* tell devfreq how busy the vrings kept the remote processor */
+static int omap_rproc_devfreq_status(struct device *dev,
+					struct devfreq_dev_status *stat)
+{
+	struct rproc *rproc = platform_get_drvdata(to_platform_device(dev));
+	struct omap_rproc *oproc = rproc->priv;
+	struct rproc_load load;
+
+	rproc_get_load(rproc, &load);
+
+	stat->total_time = load.period_us;
+	stat->busy_time = load.busy_us;
+	stat->current_frequency = clk_get_rate(oproc->clk);
+
+	return 0;
+}
+
+/*
+ * scale the remote processor's clock with its load, using the
+ * simple_ondemand governor, if its platform registered OPPs for it.
+ * This isn't fatal: the remote processor then runs at whatever rate it
+ * was set to.
+ */
+static void omap_rproc_devfreq_init(struct rproc *rproc)
+{
+	struct omap_rproc *oproc = rproc->priv;
+	struct device *dev = rproc->dev.parent;
+	struct devfreq_dev_profile *profile = &oproc->devfreq_profile;
+
+	if (opp_get_opp_count(dev) <= 0) {
+		dev_dbg(dev, "no OPPs, not scaling\n");
+		return;
+	}
+
+	oproc->clk = clk_get(dev, "fck");
+	if (IS_ERR(oproc->clk)) {
+		dev_warn(dev, "no fck, not scaling: %ld\n",
+						PTR_ERR(oproc->clk));
+		goto out;
+	}
+
+	profile->initial_freq = clk_get_rate(oproc->clk);
+	profile->polling_ms = OMAP_RPROC_DVFS_POLL_MS;
+	profile->target = omap_rproc_devfreq_target;
+	profile->get_dev_status = omap_rproc_devfreq_status;
+
+	oproc->devfreq = devfreq_add_device(dev, profile,
+					&devfreq_simple_ondemand, NULL);
+	if (IS_ERR(oproc->devfreq)) {
+		dev_warn(dev, "devfreq_add_device failed, not scaling: %ld\n",
+						PTR_ERR(oproc->devfreq));
+		clk_put(oproc->clk);
+		goto out;
+	}
+
+	return;
+
+out:
+	oproc->clk = NULL;
+	oproc->devfreq = NULL;
+}
+
+static void omap_rproc_devfreq_exit(struct rproc *rproc)
+{
+	struct omap_rproc *oproc = rproc->priv;
+
+	if (!oproc->devfreq)
+		return;
+
+	devfreq_remove_device(oproc->devfreq);
+	clk_put(oproc->clk);
+}
+#else
+static inline void omap_rproc_devfreq_init(struct rproc *rproc) { }
+static inline void omap_rproc_devfreq_exit(struct rproc *rproc) { }
+#endif
+
+static int omap_rproc_cmp_u32(const void *a, const void *b)
+{
+	u32 x = *(const u32 *)a, y = *(const u32 *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * make @rounds echo round trips with the running remote processor, one at
+ * a time, and sum up their mailbox latencies into oproc->echo_stats
+ */
+static int omap_rproc_echo_probe(struct rproc *rproc, unsigned int rounds)
+{
+	struct omap_rproc *oproc = rproc->priv;
+	struct omap_rproc_echo_stats *stats = &oproc->echo_stats;
+	struct device *dev = rproc->dev.parent;
+	unsigned long timeout = msecs_to_jiffies(OMAP_RPROC_ECHO_TIMEOUT_MS);
+	unsigned int i;
+	ktime_t sent;
+	u64 sum = 0;
+	u32 *lat;
+	int ret = 0;
+
+	lat = kmalloc(rounds * sizeof(*lat), GFP_KERNEL);
+	if (!lat)
+		return -ENOMEM;
+
+	ACCESS_ONCE(oproc->echo_probing) = true;
+
+	for (i = 0; i < rounds; i++) {
+		if (signal_pending(current)) {
+			ret = -EINTR;
+			break;
+		}
+
+		INIT_COMPLETION(oproc->echo_reply);
+
+		sent = ktime_get();
+		ret = omap_mbox_msg_send(oproc->mbox, RP_MBOX_ECHO_REQUEST);
+		if (ret) {
+			dev_err(dev, "omap_mbox_msg_send failed: %d\n", ret);
+			break;
+		}
+
+		if (!wait_for_completion_timeout(&oproc->echo_reply, timeout)) {
+			dev_err(dev, "no echo reply from %s\n", rproc->name);
+			ret = -ETIMEDOUT;
+			break;
+		}
+
+		lat[i] = ktime_to_ns(ktime_sub(oproc->echo_stamp, sent));
+		sum += lat[i];
+	}
+
+	ACCESS_ONCE(oproc->echo_probing) = false;
+
+	if (ret)
+		goto out;
+
+	sort(lat, rounds, sizeof(*lat), omap_rproc_cmp_u32, NULL);
+
+	stats->rounds = rounds;
+	stats->min_ns = lat[0];
+	stats->avg_ns = div_u64(sum, rounds);
+	stats->p99_ns = lat[DIV_ROUND_UP(rounds * 99, 100) - 1];
+	stats->max_ns = lat[rounds - 1];
+
+out:
+	kfree(lat);
+	return ret;
+}
+
+/* show what the last echo latency probe measured, via debugfs */
+static ssize_t omap_rproc_echo_read(struct file *filp, char __user *userbuf,
+						size_t count, loff_t *ppos)
+{
+	struct rproc *rproc = filp->private_data;
+	struct omap_rproc *oproc = rproc->priv;
+	struct omap_rproc_echo_stats stats;
+	char buf[160];
+	int i, ret;
+
+	ret = mutex_lock_interruptible(&rproc->lock);
+	if (ret)
+		return ret;
+	stats = oproc->echo_stats;
+	mutex_unlock(&rproc->lock);
+
+	i = scnprintf(buf, sizeof(buf),
+			"rounds: %u\nmin: %u ns\navg: %u ns\np99: %u ns\n"
+			"max: %u ns\n", stats.rounds, stats.min_ns,
+			stats.avg_ns, stats.p99_ns, stats.max_ns);
+
+	return simple_read_from_buffer(userbuf, count, ppos, buf, i);
+}
+
+/*
+ * By writing a number of round trips (e.g. "1000") to the 'echo_latency'
+ * debugfs entry, the running remote processor is pinged that many times,
+ * with mailbox-level echo requests, and the latencies of the round trips
+ * are then shown by reading the entry. Nothing but the mailbox is
+ * involved, which tells mailbox latencies apart from vring or rpmsg ones.
+ */
+static ssize_t omap_rproc_echo_write(struct file *filp,
+			const char __user *user_buf, size_t count, loff_t *ppos)
+{
+	struct rproc *rproc = filp->private_data;
+	unsigned int rounds;
+	int ret;
+
+	ret = kstrtouint_from_user(user_buf, count, 0, &rounds);
+	if (ret)
+		return ret;
+
+	if (!rounds || rounds > OMAP_RPROC_ECHO_MAX)
+		return -EINVAL;
+
+	/* wake it up if it was suspended as it idled */
+	pm_runtime_get_sync(&rproc->dev);
+
+	ret = mutex_lock_interruptible(&rproc->lock);
+	if (ret)
+		goto put_runtime;
+
+	if (rproc->state == RPROC_RUNNING)
+		ret = omap_rproc_echo_probe(rproc, rounds);
+	else
+		ret = -ENODEV;
+
+	mutex_unlock(&rproc->lock);
+
+put_runtime:
+	pm_runtime_mark_last_busy(&rproc->dev);
+	pm_runtime_put_autosuspend(&rproc->dev);
+	return ret ? ret : count;
+}
+
+static const struct file_operations omap_rproc_echo_ops = {
+	.read = omap_rproc_echo_read,
+	.write = omap_rproc_echo_write,
+	.open = simple_open,
+	.llseek = generic_file_llseek,
+};
+
 static struct rproc_ops omap_rproc_ops = {
+	.prepare	= omap_rproc_prepare,
+	.unprepare	= omap_rproc_unprepare,
 	.start		= omap_rproc_start,
 	.stop		= omap_rproc_stop,
 	.kick		= omap_rproc_kick,
+	.kick_vqs	= omap_rproc_kick_vqs,
+	.suspend	= omap_rproc_suspend,
+	.resume		= omap_rproc_resume,
+	.send_event	= omap_rproc_send_event,
 };
 
 static int __devinit omap_rproc_probe(struct platform_device *pdev)
@@ -199,6 +778,14 @@ static int __devinit omap_rproc_probe(struct platform_device *pdev)
 
 	oproc = rproc->priv;
 	oproc->rproc = rproc;
+	spin_lock_init(&oproc->doorbell_lock);
+	init_completion(&oproc->echo_reply);
+
+	if (pdata->device_idle)
+		rproc->autosuspend_delay = OMAP_RPROC_AUTOSUSPEND_DELAY;
+
+	if (pdata->num_cores)
+		rproc->num_cores = pdata->num_cores;
 
 	platform_set_drvdata(pdev, rproc);
 
@@ -206,6 +793,12 @@ static int __devinit omap_rproc_probe(struct platform_device *pdev)
 	if (ret)
 		goto free_rproc;
 
+	omap_rproc_devfreq_init(rproc);
+
+	if (rproc->dbg_dir)
+		oproc->dbg_echo = debugfs_create_file("echo_latency", 0600,
+				rproc->dbg_dir, rproc, &omap_rproc_echo_ops);
+
 	return 0;
 
 free_rproc:
@@ -216,7 +809,10 @@ free_rproc:
 static int __devexit omap_rproc_remove(struct platform_device *pdev)
 {
 	struct rproc *rproc = platform_get_drvdata(pdev);
+	struct omap_rproc *oproc = rproc->priv;
 
+	debugfs_remove(oproc->dbg_echo);
+	omap_rproc_devfreq_exit(rproc);
 	rproc_del(rproc);
 	rproc_put(rproc);
 
@@ -66,4 +66,36 @@ enum omap_rp_mbox_messages {
 	RP_MBOX_ABORT_REQUEST	= 0xFFFFFF05,
 };
 
+/*
+ * Mailbox messages from RP_MBOX_EVENT to RP_MBOX_EVENT | RP_MBOX_EVENT_MASK
+ * are inline events (see rproc_send_event()): the low 24 bits of the
+ * message are the event itself, which never goes through a vring. Neither
+ * virtqueue indices nor the predefined messages above fall in that range.
+ */
+#define RP_MBOX_EVENT		0x80000000
+#define RP_MBOX_EVENT_MASK	0x00FFFFFF
+
+/* number of virtqueues a doorbell can be rung for */
+#define OMAP_RPROC_DOORBELL_VQS	8
+
+/**
+ * struct omap_rproc_doorbell - kicks posted in memory shared with the remote
+ * @kicked: how many times each virtqueue was kicked; only written by us
+ * @seen: the value of @kicked the remote processor last caught up with, for
+ *	  each virtqueue; only written by the remote processor
+ *
+ * A virtqueue is pending as long as its @kicked and @seen counters differ.
+ * The remote processor sets @seen to @kicked before it looks at the
+ * virtqueue, and looks again for as long as they differ; and we only
+ * interrupt it (with a mailbox message) when a kick finds it had caught up
+ * with the previous one, since it's otherwise bound to see the new one.
+ *
+ * Neither side ever does a read-modify-write of a counter the other side
+ * writes, so no atomic operation is needed across the processors.
+ */
+struct omap_rproc_doorbell {
+	u32 kicked[OMAP_RPROC_DOORBELL_VQS];
+	u32 seen[OMAP_RPROC_DOORBELL_VQS];
+} __packed;
+
 #endif /* _OMAP_RPMSG_H */
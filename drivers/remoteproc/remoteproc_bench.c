@@ -0,0 +1,491 @@
+/*
+ * Remote Processor Framework ELF loader benchmark
+ *
+ * Measures how fast firmware images are loaded, without any remote
+ * processor: an ELF image is synthesized in memory, and is then run
+ * through the very code a boot runs it through (the sanity check, the
+ * lookup of its resource table, the resource handlers and the loading of
+ * its segments) against a fake remote processor, whose carveouts are
+ * plain dma_alloc_coherent() memory. How long each phase took, and at
+ * what speed the image was loaded, are then reported.
+ *
+ * A benchmark is run by writing its parameters to the "elf_bench" debugfs
+ * entry (in remoteproc/, under debugfs):
+ *
+ *   <size> <segments> <bss> [<runs> [cold|warm]]
+ *
+ * where <size> is the size of the image in memory (e.g. "16M"), split in
+ * <segments> PT_LOAD segments, the last <bss> percent of each of which
+ * aren't in the file and are zeroed out instead. Every one of the <runs>
+ * runs either does it all as a first boot does ("cold", the default: the
+ * carveouts are allocated anew, zeroed out already, and freed afterwards),
+ * or only loads the segments again, into the carveouts the first run
+ * allocated ("warm", as rebooting with rproc->keep_resources does). The
+ * write returns once all runs are over, and their results are then shown
+ * by reading the entry.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#define pr_fmt(fmt)    "%s: " fmt, __func__
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/remoteproc.h>
+#include <linux/platform_device.h>
+#include <linux/dma-mapping.h>
+#include <linux/debugfs.h>
+#include <linux/firmware.h>
+#include <linux/elf.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/mutex.h>
+#include <linux/ktime.h>
+#include <linux/uaccess.h>
+
+#include "remoteproc_internal.h"
+
+#define RPROC_BENCH_NAME	"rproc-elf-bench"
+
+/* where the segments of the synthesized images are loaded */
+#define RPROC_BENCH_DA		0x20000000
+
+#define RPROC_BENCH_MAX_SIZE	(256 * 1024 * 1024)
+#define RPROC_BENCH_MAX_SEGS	256
+#define RPROC_BENCH_MAX_RUNS	1000
+
+enum rproc_bench_phase {
+	RPROC_BENCH_SANITY,
+	RPROC_BENCH_FIND_RSC,
+	RPROC_BENCH_RESOURCES,
+	RPROC_BENCH_LOAD,
+	RPROC_BENCH_CLEANUP,
+	RPROC_BENCH_PHASES,
+};
+
+static const char * const rproc_bench_phases[RPROC_BENCH_PHASES] = {
+	[RPROC_BENCH_SANITY]	= "sanity_check",
+	[RPROC_BENCH_FIND_RSC]	= "find_rsc_table",
+	[RPROC_BENCH_RESOURCES]	= "resources",
+	[RPROC_BENCH_LOAD]	= "load_segments",
+	[RPROC_BENCH_CLEANUP]	= "cleanup",
+};
+
+/**
+ * struct rproc_bench_stat - how long a phase took, over all the runs
+ * @count: how many times the phase was run
+ * @total: how long it took, all in all, in ns
+ * @min: the quickest it took, in ns
+ * @max: the longest it took, in ns
+ */
+struct rproc_bench_stat {
+	unsigned int count;
+	u64 total;
+	u64 min;
+	u64 max;
+};
+
+/*
+ * the resource table of the synthesized images: a single carveout, which
+ * all the segments are loaded in
+ */
+struct rproc_bench_table {
+	struct resource_table table;
+	u32 offset[1];
+	struct fw_rsc_hdr hdr;
+	struct fw_rsc_carveout carveout;
+} __packed;
+
+static const char rproc_bench_names[] = "\0.resource_table\0.shstrtab";
+
+/* the section headers of the synthesized images */
+enum {
+	RPROC_BENCH_SEC_NULL,
+	RPROC_BENCH_SEC_RSC,
+	RPROC_BENCH_SEC_NAMES,
+	RPROC_BENCH_SECS,
+};
+
+static struct platform_device *rproc_bench_pdev;
+static struct dentry *rproc_bench_dentry;
+
+/* serializes the runs, and protects their results */
+static DEFINE_MUTEX(rproc_bench_lock);
+static char rproc_bench_results[1024];
+
+static struct rproc_ops rproc_bench_ops;
+
+/*
+ * synthesize an ELF image of @size bytes in memory, in @segs segments,
+ * whose last @bss percent aren't part of the file. Returns the image, which
+ * is vfree()'d along with its data, or NULL if it can't be allocated.
+ */
+static struct firmware *rproc_bench_image(size_t size, unsigned int segs,
+							unsigned int bss)
+{
+	u32 memsz = (size / segs) & ~3;
+	u32 filesz = memsz - ((u64)memsz * bss / 100 & ~3);
+	struct rproc_bench_table *table;
+	struct elf32_phdr *phdr;
+	struct elf32_shdr *shdr;
+	struct elf32_hdr *ehdr;
+	struct firmware *fw;
+	size_t table_off, data_off, names_off, shoff, len;
+	u8 *data;
+	int i;
+
+	table_off = ALIGN(sizeof(*ehdr) + segs * sizeof(*phdr), 8);
+	data_off = ALIGN(table_off + sizeof(*table), 8);
+	names_off = data_off + (size_t)segs * filesz;
+	shoff = ALIGN(names_off + sizeof(rproc_bench_names), 8);
+	len = shoff + RPROC_BENCH_SECS * sizeof(*shdr);
+
+	fw = kzalloc(sizeof(*fw), GFP_KERNEL);
+	if (!fw)
+		return NULL;
+
+	data = vzalloc(len);
+	if (!data) {
+		kfree(fw);
+		return NULL;
+	}
+
+	ehdr = (struct elf32_hdr *)data;
+	memcpy(ehdr->e_ident, ELFMAG, SELFMAG);
+	ehdr->e_ident[EI_CLASS] = ELFCLASS32;
+#ifdef __LITTLE_ENDIAN
+	ehdr->e_ident[EI_DATA] = ELFDATA2LSB;
+#else
+	ehdr->e_ident[EI_DATA] = ELFDATA2MSB;
+#endif
+	ehdr->e_ident[EI_VERSION] = EV_CURRENT;
+	ehdr->e_type = ET_EXEC;
+	ehdr->e_version = EV_CURRENT;
+	ehdr->e_entry = RPROC_BENCH_DA;
+	ehdr->e_phoff = sizeof(*ehdr);
+	ehdr->e_shoff = shoff;
+	ehdr->e_ehsize = sizeof(*ehdr);
+	ehdr->e_phentsize = sizeof(*phdr);
+	ehdr->e_phnum = segs;
+	ehdr->e_shentsize = sizeof(*shdr);
+	ehdr->e_shnum = RPROC_BENCH_SECS;
+	ehdr->e_shstrndx = RPROC_BENCH_SEC_NAMES;
+
+	phdr = (struct elf32_phdr *)(data + ehdr->e_phoff);
+	for (i = 0; i < segs; i++) {
+		phdr[i].p_type = PT_LOAD;
+		phdr[i].p_offset = data_off + i * filesz;
+		phdr[i].p_vaddr = RPROC_BENCH_DA + i * memsz;
+		phdr[i].p_paddr = phdr[i].p_vaddr;
+		phdr[i].p_filesz = filesz;
+		phdr[i].p_memsz = memsz;
+		phdr[i].p_flags = PF_R | PF_W | PF_X;
+		phdr[i].p_align = 4;
+	}
+
+	/* something else than zeroes, for the copies to be real ones */
+	memset(data + data_off, 0xa5, (size_t)segs * filesz);
+
+	table = (struct rproc_bench_table *)(data + table_off);
+	table->table.ver = 1;
+	table->table.num = 1;
+	table->offset[0] = offsetof(struct rproc_bench_table, hdr);
+	table->hdr.type = RSC_CARVEOUT;
+	table->carveout.da = RPROC_BENCH_DA;
+	table->carveout.len = PAGE_ALIGN(segs * memsz);
+	strlcpy((char *)table->carveout.name, "bench",
+					sizeof(table->carveout.name));
+
+	memcpy(data + names_off, rproc_bench_names, sizeof(rproc_bench_names));
+
+	shdr = (struct elf32_shdr *)(data + shoff);
+	shdr[RPROC_BENCH_SEC_RSC].sh_name = 1;
+	shdr[RPROC_BENCH_SEC_RSC].sh_type = SHT_PROGBITS;
+	shdr[RPROC_BENCH_SEC_RSC].sh_offset = table_off;
+	shdr[RPROC_BENCH_SEC_RSC].sh_size = sizeof(*table);
+	shdr[RPROC_BENCH_SEC_NAMES].sh_name = sizeof(".resource_table") + 1;
+	shdr[RPROC_BENCH_SEC_NAMES].sh_type = SHT_STRTAB;
+	shdr[RPROC_BENCH_SEC_NAMES].sh_offset = names_off;
+	shdr[RPROC_BENCH_SEC_NAMES].sh_size = sizeof(rproc_bench_names);
+
+	fw->data = data;
+	fw->size = len;
+
+	return fw;
+}
+
+static void rproc_bench_free_image(struct firmware *fw)
+{
+	vfree(fw->data);
+	kfree(fw);
+}
+
+static void rproc_bench_account(struct rproc_bench_stat *stat, ktime_t start)
+{
+	u64 ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	if (!stat->count || ns < stat->min)
+		stat->min = ns;
+	if (ns > stat->max)
+		stat->max = ns;
+	stat->total += ns;
+	stat->count++;
+}
+
+/*
+ * run @fw through the loader once, as a boot of @rproc would. Unless
+ * @cold, the resources are only handled by the first run, and are left
+ * around for the next ones, which @last tells to clean them up.
+ */
+static int rproc_bench_run(struct rproc *rproc, const struct firmware *fw,
+			bool cold, bool first, bool last,
+			struct rproc_bench_stat *stats)
+{
+	struct rproc_rsc_index *index;
+	struct resource_table *table;
+	struct rproc_mem_entry *entry;
+	int tablesz, ret;
+	ktime_t start;
+
+	start = ktime_get();
+	ret = rproc_fw_sanity_check(rproc, fw);
+	if (ret)
+		goto clean_up;
+	rproc_bench_account(&stats[RPROC_BENCH_SANITY], start);
+
+	start = ktime_get();
+	table = rproc_find_rsc_table(rproc, fw, &tablesz);
+	if (!table) {
+		ret = -EINVAL;
+		goto clean_up;
+	}
+	rproc_bench_account(&stats[RPROC_BENCH_FIND_RSC], start);
+
+	/* the table is parsed along with the image, which is then cached */
+	if (cold || first) {
+		start = ktime_get();
+		index = rproc_index_rsc_table(rproc, table, tablesz);
+		if (IS_ERR(index)) {
+			ret = PTR_ERR(index);
+			goto clean_up;
+		}
+		ret = rproc_handle_boot_rsc(rproc, table, index);
+		kfree(index);
+		if (ret)
+			goto clean_up;
+		rproc_bench_account(&stats[RPROC_BENCH_RESOURCES], start);
+	}
+
+	start = ktime_get();
+	ret = rproc_load_segments(rproc, fw);
+	if (ret)
+		goto clean_up;
+	rproc_bench_account(&stats[RPROC_BENCH_LOAD], start);
+
+	/* as rproc_fw_boot() leaves them */
+	list_for_each_entry(entry, &rproc->carveouts, node)
+		entry->fresh = false;
+
+	if (!cold && !last)
+		return 0;
+
+	start = ktime_get();
+	rproc_resource_cleanup(rproc);
+	rproc_bench_account(&stats[RPROC_BENCH_CLEANUP], start);
+
+	return 0;
+
+clean_up:
+	rproc_resource_cleanup(rproc);
+	return ret;
+}
+
+/* MB/s at which @bytes were handled @count times, in @ns */
+static u64 rproc_bench_mbps(u64 bytes, unsigned int count, u64 ns)
+{
+	return ns ? div64_u64(bytes * count * NSEC_PER_USEC, ns) : 0;
+}
+
+static void rproc_bench_report(size_t size, size_t filesz, unsigned int segs,
+			unsigned int bss, bool cold, unsigned int runs,
+			struct rproc_bench_stat *stats)
+{
+	char *buf = rproc_bench_results;
+	size_t len = sizeof(rproc_bench_results);
+	int i, n;
+	u64 total = 0;
+
+	n = scnprintf(buf, len,
+		"image %zu bytes (%zu in the file), %u segments, %u%% bss\n"
+		"%s, %u runs\n\n%-16s %6s %10s %10s %10s\n", size, filesz,
+		segs, bss, cold ? "cold" : "warm", runs, "phase", "runs",
+		"avg (us)", "min (us)", "max (us)");
+
+	for (i = 0; i < RPROC_BENCH_PHASES; i++) {
+		struct rproc_bench_stat *stat = &stats[i];
+
+		n += scnprintf(buf + n, len - n,
+				"%-16s %6u %10llu %10llu %10llu\n",
+				rproc_bench_phases[i], stat->count,
+				stat->count ? div_u64(stat->total, stat->count *
+							NSEC_PER_USEC) : 0,
+				div_u64(stat->min, NSEC_PER_USEC),
+				div_u64(stat->max, NSEC_PER_USEC));
+		total += stat->total;
+	}
+
+	scnprintf(buf + n, len - n, "\nload: %llu MB/s\ntotal: %llu MB/s\n",
+			rproc_bench_mbps(size, stats[RPROC_BENCH_LOAD].count,
+					stats[RPROC_BENCH_LOAD].total),
+			rproc_bench_mbps(size, runs, total));
+}
+
+static int rproc_bench(size_t size, unsigned int segs, unsigned int bss,
+					unsigned int runs, bool cold)
+{
+	struct rproc_bench_stat stats[RPROC_BENCH_PHASES] = { { 0 } };
+	struct device *dev = &rproc_bench_pdev->dev;
+	struct firmware *fw;
+	struct rproc *rproc;
+	unsigned int i;
+	int ret = 0;
+
+	fw = rproc_bench_image(size, segs, bss);
+	if (!fw) {
+		dev_err(dev, "can't allocate a %zu bytes image\n", size);
+		return -ENOMEM;
+	}
+
+	rproc = rproc_alloc(dev, RPROC_BENCH_NAME, &rproc_bench_ops,
+						RPROC_BENCH_NAME, 0);
+	if (!rproc) {
+		ret = -ENOMEM;
+		goto free_image;
+	}
+
+	mutex_lock(&rproc->lock);
+
+	for (i = 0; i < runs; i++) {
+		ret = rproc_bench_run(rproc, fw, cold, i == 0, i == runs - 1,
+									stats);
+		if (ret) {
+			dev_err(dev, "run %u failed: %d\n", i, ret);
+			break;
+		}
+	}
+
+	mutex_unlock(&rproc->lock);
+
+	if (!ret)
+		rproc_bench_report(segs * ((size / segs) & ~3),
+				fw->size, segs, bss, cold, runs, stats);
+
+	rproc_put(rproc);
+free_image:
+	rproc_bench_free_image(fw);
+	return ret;
+}
+
+static ssize_t rproc_bench_read(struct file *filp, char __user *userbuf,
+						size_t count, loff_t *ppos)
+{
+	ssize_t ret;
+
+	mutex_lock(&rproc_bench_lock);
+	ret = simple_read_from_buffer(userbuf, count, ppos, rproc_bench_results,
+					strlen(rproc_bench_results));
+	mutex_unlock(&rproc_bench_lock);
+
+	return ret;
+}
+
+static ssize_t rproc_bench_write(struct file *filp, const char __user *userbuf,
+						size_t count, loff_t *ppos)
+{
+	unsigned int segs, bss, runs = 1;
+	char buf[64], size_str[32], mode[8] = "cold";
+	unsigned long long size;
+	char *end;
+	int ret;
+
+	if (count >= sizeof(buf))
+		return -EINVAL;
+
+	if (copy_from_user(buf, userbuf, count))
+		return -EFAULT;
+	buf[count] = '\0';
+
+	ret = sscanf(buf, "%31s %u %u %u %7s", size_str, &segs, &bss, &runs,
+									mode);
+	if (ret < 3)
+		return -EINVAL;
+
+	size = memparse(size_str, &end);
+	if (*end || !size || size > RPROC_BENCH_MAX_SIZE || !segs ||
+			segs > RPROC_BENCH_MAX_SEGS || size / segs < 4 ||
+			bss > 100 || !runs || runs > RPROC_BENCH_MAX_RUNS)
+		return -EINVAL;
+
+	if (strcmp(mode, "cold") && strcmp(mode, "warm"))
+		return -EINVAL;
+
+	ret = mutex_lock_interruptible(&rproc_bench_lock);
+	if (ret)
+		return ret;
+
+	rproc_bench_results[0] = '\0';
+	ret = rproc_bench(size, segs, bss, runs, !strcmp(mode, "cold"));
+
+	mutex_unlock(&rproc_bench_lock);
+
+	return ret ? ret : count;
+}
+
+static const struct file_operations rproc_bench_fops = {
+	.read = rproc_bench_read,
+	.write = rproc_bench_write,
+	.open = simple_open,
+	.llseek = generic_file_llseek,
+};
+
+/**
+ * rproc_init_bench() - add the loader benchmark
+ * @dir: the debugfs directory of remoteproc
+ */
+void __init rproc_init_bench(struct dentry *dir)
+{
+	struct platform_device *pdev;
+
+	if (!dir)
+		return;
+
+	pdev = platform_device_register_simple(RPROC_BENCH_NAME, -1, NULL, 0);
+	if (IS_ERR(pdev)) {
+		pr_err("can't register the bench device: %ld\n", PTR_ERR(pdev));
+		return;
+	}
+
+	/* the carveouts come from it */
+	pdev->dev.coherent_dma_mask = DMA_BIT_MASK(32);
+	pdev->dev.dma_mask = &pdev->dev.coherent_dma_mask;
+
+	rproc_bench_pdev = pdev;
+	rproc_bench_dentry = debugfs_create_file("elf_bench", 0600, dir, NULL,
+							&rproc_bench_fops);
+}
+
+void __exit rproc_exit_bench(void)
+{
+	if (!rproc_bench_pdev)
+		return;
+
+	debugfs_remove(rproc_bench_dentry);
+	platform_device_unregister(rproc_bench_pdev);
+}
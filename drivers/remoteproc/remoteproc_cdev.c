@@ -0,0 +1,267 @@
+/*
+ * Remote Processor Framework character device
+ *
+ * Each remote processor gets a /dev/remoteprocN node, through which user
+ * space can mmap() the carveouts its firmware marked with FW_CARVEOUT_USER
+ * (e.g. the frame buffers of a media pipeline), and then place its data
+ * right where the remote processor reads it, passing only offsets over
+ * rpmsg. The offset of a mapping is the device address of what it maps.
+ *
+ * A mapping keeps the memory of its carveout, but not the remote processor,
+ * around: once the remote processor is shut down, what user space still
+ * has mapped is only freed when it's unmapped.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#define pr_fmt(fmt)    "%s: " fmt, __func__
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/remoteproc.h>
+#include <linux/cdev.h>
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/kref.h>
+#include <linux/dma-mapping.h>
+
+#include "remoteproc_internal.h"
+
+#define RPROC_CDEV_MAX_MINORS	256
+
+static dev_t rproc_cdev_devt;
+
+/**
+ * struct rproc_user_mem - the memory of a carveout user space may map
+ * @refcount: held by the carveout, and by each mapping of it
+ * @dev: the device the memory was allocated with
+ * @va: kernel address of the memory
+ * @dma: dma address of the memory
+ * @len: size of the memory, in bytes
+ *
+ * This is the whole dma_alloc_coherent() allocation, which is larger than
+ * the carveout when it's padded for alignment (see carveout->priv).
+ */
+struct rproc_user_mem {
+	struct kref refcount;
+	struct device *dev;
+	void *va;
+	dma_addr_t dma;
+	size_t len;
+};
+
+static void rproc_user_mem_release(struct kref *kref)
+{
+	struct rproc_user_mem *mem = container_of(kref, struct rproc_user_mem,
+								refcount);
+
+	dma_free_coherent(mem->dev, mem->len, mem->va, mem->dma);
+	put_device(mem->dev);
+	kfree(mem);
+}
+
+/**
+ * rproc_user_carveout() - let user space map a carveout
+ * @rproc: the remote processor
+ * @carveout: the carveout, as just allocated by rproc_alloc_carveout()
+ *
+ * From now on, the memory of @carveout is freed by the last of
+ * rproc_free_carveout() and the munmap() of its mappings.
+ *
+ * Returns 0 on success, or an appropriate error code otherwise.
+ */
+int rproc_user_carveout(struct rproc *rproc, struct rproc_mem_entry *carveout)
+{
+	struct rproc_mem_entry *alloc = carveout->priv ? : carveout;
+	struct rproc_user_mem *mem;
+
+	if (carveout->da & ~PAGE_MASK) {
+		dev_err(&rproc->dev, "user carveout da 0x%x isn't aligned\n",
+								carveout->da);
+		return -EINVAL;
+	}
+
+	mem = kzalloc(sizeof(*mem), GFP_KERNEL);
+	if (!mem)
+		return -ENOMEM;
+
+	kref_init(&mem->refcount);
+	mem->dev = get_device(carveout->dev);
+	mem->va = alloc->va;
+	mem->dma = alloc->dma;
+	mem->len = alloc->len;
+
+	carveout->user = mem;
+
+	return 0;
+}
+
+/**
+ * rproc_put_user_carveout() - drop the carveout's hold on its user memory
+ * @carveout: the carveout, which is being freed
+ */
+void rproc_put_user_carveout(struct rproc_mem_entry *carveout)
+{
+	kref_put(&carveout->user->refcount, rproc_user_mem_release);
+	carveout->user = NULL;
+}
+
+static void rproc_cdev_vm_open(struct vm_area_struct *vma)
+{
+	struct rproc_user_mem *mem = vma->vm_private_data;
+
+	kref_get(&mem->refcount);
+}
+
+static void rproc_cdev_vm_close(struct vm_area_struct *vma)
+{
+	struct rproc_user_mem *mem = vma->vm_private_data;
+
+	kref_put(&mem->refcount, rproc_user_mem_release);
+}
+
+static const struct vm_operations_struct rproc_cdev_vm_ops = {
+	.open = rproc_cdev_vm_open,
+	.close = rproc_cdev_vm_close,
+};
+
+static int rproc_cdev_open(struct inode *inode, struct file *filp)
+{
+	filp->private_data = container_of(inode->i_cdev, struct rproc, cdev);
+
+	return nonseekable_open(inode, filp);
+}
+
+/*
+ * map (part of) a user carveout: the offset is its device address. The
+ * mapping gets the same cache attributes as the kernel's own mapping of
+ * the carveout, as dma_mmap_coherent() sees to.
+ */
+static int rproc_cdev_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct rproc *rproc = filp->private_data;
+	u64 da = (u64)vma->vm_pgoff << PAGE_SHIFT;
+	u64 len = vma->vm_end - vma->vm_start;
+	struct rproc_mem_entry *carveout;
+	struct rproc_user_mem *mem = NULL;
+	unsigned long pgoff = 0;
+	int ret;
+
+	ret = mutex_lock_interruptible(&rproc->lock);
+	if (ret)
+		return ret;
+
+	list_for_each_entry(carveout, &rproc->carveouts, node) {
+		if (!carveout->user || da < carveout->da ||
+				len > carveout->len ||
+				da - carveout->da > carveout->len - len)
+			continue;
+
+		mem = carveout->user;
+		pgoff = (carveout->dma - mem->dma + da - carveout->da) >>
+								PAGE_SHIFT;
+		kref_get(&mem->refcount);
+		break;
+	}
+
+	mutex_unlock(&rproc->lock);
+
+	if (!mem) {
+		dev_dbg(&rproc->dev, "no user carveout: da 0x%llx len 0x%llx\n",
+								da, len);
+		return -EINVAL;
+	}
+
+	vma->vm_pgoff = pgoff;
+	ret = dma_mmap_coherent(mem->dev, vma, mem->va, mem->dma, mem->len);
+	if (ret) {
+		kref_put(&mem->refcount, rproc_user_mem_release);
+		return ret;
+	}
+
+	vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+	vma->vm_private_data = mem;
+	vma->vm_ops = &rproc_cdev_vm_ops;
+
+	return 0;
+}
+
+static const struct file_operations rproc_cdev_fops = {
+	.owner = THIS_MODULE,
+	.open = rproc_cdev_open,
+	.mmap = rproc_cdev_mmap,
+	.llseek = no_llseek,
+};
+
+/**
+ * rproc_cdev_add() - add the character device of a remote processor
+ * @rproc: the remote processor, which is about to be added
+ *
+ * The node is named after @rproc->dev, which it's the devt of, and ends up
+ * as /dev/remoteprocN. Remote processors past the first
+ * RPROC_CDEV_MAX_MINORS ones don't get one.
+ *
+ * Returns 0 on success, or an appropriate error code otherwise.
+ */
+int rproc_cdev_add(struct rproc *rproc)
+{
+	int ret;
+
+	if (!rproc_cdev_devt || rproc->index >= RPROC_CDEV_MAX_MINORS)
+		return 0;
+
+	cdev_init(&rproc->cdev, &rproc_cdev_fops);
+	rproc->cdev.owner = THIS_MODULE;
+	/* an open node keeps the rproc around */
+	rproc->cdev.kobj.parent = &rproc->dev.kobj;
+
+	ret = cdev_add(&rproc->cdev, MKDEV(MAJOR(rproc_cdev_devt),
+							rproc->index), 1);
+	if (ret) {
+		dev_err(&rproc->dev, "cdev_add failed: %d\n", ret);
+		return ret;
+	}
+
+	rproc->dev.devt = rproc->cdev.dev;
+
+	return 0;
+}
+
+/**
+ * rproc_cdev_del() - remove the character device of a remote processor
+ * @rproc: the remote processor, which is being removed
+ *
+ * The mappings user space already has stay valid.
+ */
+void rproc_cdev_del(struct rproc *rproc)
+{
+	if (rproc->dev.devt)
+		cdev_del(&rproc->cdev);
+}
+
+void __init rproc_init_cdev(void)
+{
+	int ret;
+
+	ret = alloc_chrdev_region(&rproc_cdev_devt, 0, RPROC_CDEV_MAX_MINORS,
+								"remoteproc");
+	if (ret) {
+		pr_err("alloc_chrdev_region failed: %d\n", ret);
+		rproc_cdev_devt = 0;
+	}
+}
+
+void __exit rproc_exit_cdev(void)
+{
+	if (rproc_cdev_devt)
+		unregister_chrdev_region(rproc_cdev_devt,
+						RPROC_CDEV_MAX_MINORS);
+}
@@ -0,0 +1,274 @@
+/*
+ * Remote Processor Framework cgroup controller
+ *
+ * The "rproc" cgroup controller gives each cgroup a tag, which the rpmsg
+ * bus stamps on the messages its tasks send (see VIRTIO_RPMSG_F_ACCT), and
+ * a weight. Remote processors which account for their cycles per tag
+ * report them in their telemetry page (see remoteproc_telemetry.c): they
+ * are charged to the cgroups, which show them in rproc.usage, and, while
+ * a remote processor is busy, tasks whose cgroup used more than its
+ * weight's share of it are held back (see rproc_acct_admit()).
+ *
+ * The root cgroup has tag 0, which is never held back.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#define pr_fmt(fmt)    "%s: " fmt, __func__
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/remoteproc.h>
+#include <linux/cgroup.h>
+#include <linux/rcupdate.h>
+#include <linux/hardirq.h>
+#include <linux/slab.h>
+#include <linux/idr.h>
+#include <linux/spinlock.h>
+#include <linux/atomic.h>
+
+#include "remoteproc_internal.h"
+
+/* the weight of a new cgroup, and the range it may be set to */
+#define RPROC_CGROUP_WEIGHT_DEFAULT	100
+#define RPROC_CGROUP_WEIGHT_MIN		1
+#define RPROC_CGROUP_WEIGHT_MAX		10000
+
+/* tags are 16 bits wide, to fit in rpmsg_hdr's flags */
+#define RPROC_CGROUP_TAG_MAX		0xffff
+
+/**
+ * struct rproc_cgroup - the rproc state of a cgroup
+ * @css: the cgroup's state, as the cgroup core knows it
+ * @tag: the tag of the cgroup's messages
+ * @weight: how much of a contended remote processor the cgroup is entitled
+ *	    to, relative to the other cgroups using it
+ * @usage: the remote processor cycles spent on the cgroup's messages
+ * @rcu: for freeing the state once the tag lookups are done with it
+ */
+struct rproc_cgroup {
+	struct cgroup_subsys_state css;
+	u16 tag;
+	unsigned int weight;
+	atomic64_t usage;
+	struct rcu_head rcu;
+};
+
+/* maps the tags to their rproc_cgroup, protected by rproc_cgroup_lock */
+static DEFINE_IDR(rproc_cgroup_idr);
+static DEFINE_SPINLOCK(rproc_cgroup_lock);
+
+static inline struct rproc_cgroup *cgroup_to_rcg(struct cgroup *cgrp)
+{
+	return container_of(cgroup_subsys_state(cgrp, rproc_subsys_id),
+						struct rproc_cgroup, css);
+}
+
+static inline struct rproc_cgroup *task_to_rcg(struct task_struct *task)
+{
+	return container_of(task_subsys_state(task, rproc_subsys_id),
+						struct rproc_cgroup, css);
+}
+
+static struct cgroup_subsys_state *rproc_cgroup_create(struct cgroup *cgrp)
+{
+	struct rproc_cgroup *rcg;
+	int ret, tag;
+
+	rcg = kzalloc(sizeof(*rcg), GFP_KERNEL);
+	if (!rcg)
+		return ERR_PTR(-ENOMEM);
+
+	rcg->weight = RPROC_CGROUP_WEIGHT_DEFAULT;
+	atomic64_set(&rcg->usage, 0);
+
+	/* the root cgroup has tag 0: its tasks are never held back */
+	if (!cgrp->parent)
+		return &rcg->css;
+
+	do {
+		if (!idr_pre_get(&rproc_cgroup_idr, GFP_KERNEL)) {
+			ret = -ENOMEM;
+			goto free_rcg;
+		}
+
+		spin_lock(&rproc_cgroup_lock);
+		ret = idr_get_new_above(&rproc_cgroup_idr, rcg, 1, &tag);
+		spin_unlock(&rproc_cgroup_lock);
+	} while (ret == -EAGAIN);
+
+	if (ret)
+		goto free_rcg;
+
+	if (tag > RPROC_CGROUP_TAG_MAX) {
+		pr_err("out of rproc cgroup tags\n");
+		ret = -ENOSPC;
+		goto remove_idr;
+	}
+
+	rcg->tag = tag;
+
+	return &rcg->css;
+
+remove_idr:
+	spin_lock(&rproc_cgroup_lock);
+	idr_remove(&rproc_cgroup_idr, tag);
+	spin_unlock(&rproc_cgroup_lock);
+free_rcg:
+	kfree(rcg);
+	return ERR_PTR(ret);
+}
+
+static void rproc_cgroup_destroy(struct cgroup *cgrp)
+{
+	struct rproc_cgroup *rcg = cgroup_to_rcg(cgrp);
+
+	if (rcg->tag) {
+		spin_lock(&rproc_cgroup_lock);
+		idr_remove(&rproc_cgroup_idr, rcg->tag);
+		spin_unlock(&rproc_cgroup_lock);
+	}
+
+	/* the telemetry sampling may still be looking at it */
+	kfree_rcu(rcg, rcu);
+}
+
+static u64 rproc_cgroup_read_weight(struct cgroup *cgrp, struct cftype *cft)
+{
+	return cgroup_to_rcg(cgrp)->weight;
+}
+
+static int rproc_cgroup_write_weight(struct cgroup *cgrp, struct cftype *cft,
+								u64 val)
+{
+	if (val < RPROC_CGROUP_WEIGHT_MIN || val > RPROC_CGROUP_WEIGHT_MAX)
+		return -EINVAL;
+
+	cgroup_to_rcg(cgrp)->weight = val;
+
+	return 0;
+}
+
+static u64 rproc_cgroup_read_usage(struct cgroup *cgrp, struct cftype *cft)
+{
+	return atomic64_read(&cgroup_to_rcg(cgrp)->usage);
+}
+
+static int rproc_cgroup_reset_usage(struct cgroup *cgrp, struct cftype *cft,
+								u64 val)
+{
+	if (val)
+		return -EINVAL;
+
+	atomic64_set(&cgroup_to_rcg(cgrp)->usage, 0);
+
+	return 0;
+}
+
+static u64 rproc_cgroup_read_tag(struct cgroup *cgrp, struct cftype *cft)
+{
+	return cgroup_to_rcg(cgrp)->tag;
+}
+
+static struct cftype rproc_cgroup_files[] = {
+	{
+		.name = "weight",
+		.read_u64 = rproc_cgroup_read_weight,
+		.write_u64 = rproc_cgroup_write_weight,
+	},
+	{
+		.name = "usage",
+		.read_u64 = rproc_cgroup_read_usage,
+		.write_u64 = rproc_cgroup_reset_usage,
+	},
+	{
+		.name = "tag",
+		.read_u64 = rproc_cgroup_read_tag,
+	},
+	{ }	/* terminate */
+};
+
+struct cgroup_subsys rproc_subsys = {
+	.name		= "rproc",
+	.create		= rproc_cgroup_create,
+	.destroy	= rproc_cgroup_destroy,
+	.subsys_id	= rproc_subsys_id,
+	.base_cftypes	= rproc_cgroup_files,
+
+	/* each cgroup is accounted for, and weighted, on its own */
+	.broken_hierarchy = true,
+};
+
+/**
+ * rproc_cgroup_tag() - the tag of the current task's rproc cgroup
+ *
+ * Returns the tag to stamp on the messages the current task sends, or 0
+ * when called in interrupt context (where current is whoever happened to
+ * be interrupted).
+ */
+u16 rproc_cgroup_tag(void)
+{
+	u16 tag;
+
+	if (in_interrupt())
+		return 0;
+
+	rcu_read_lock();
+	tag = task_to_rcg(current)->tag;
+	rcu_read_unlock();
+
+	return tag;
+}
+EXPORT_SYMBOL(rproc_cgroup_tag);
+
+/**
+ * rproc_cgroup_weight() - the weight of the cgroup of a tag
+ * @tag: the tag
+ *
+ * Returns the weight of @tag's cgroup, or the default weight if there's no
+ * such cgroup (anymore), e.g. for the root cgroup.
+ */
+unsigned int rproc_cgroup_weight(u16 tag)
+{
+	unsigned int weight = RPROC_CGROUP_WEIGHT_DEFAULT;
+	struct rproc_cgroup *rcg;
+
+	rcu_read_lock();
+	rcg = tag ? idr_find(&rproc_cgroup_idr, tag) : NULL;
+	if (rcg)
+		weight = ACCESS_ONCE(rcg->weight);
+	rcu_read_unlock();
+
+	return weight;
+}
+EXPORT_SYMBOL(rproc_cgroup_weight);
+
+/**
+ * rproc_cgroup_charge() - charge remote processor cycles to a tag's cgroup
+ * @tag: the tag
+ * @cycles: what the remote processor spent on @tag's messages
+ *
+ * The cycles of the root cgroup (tag 0), and those of cgroups which are
+ * gone, aren't accounted for.
+ */
+void rproc_cgroup_charge(u16 tag, u64 cycles)
+{
+	struct rproc_cgroup *rcg;
+
+	if (!tag || !cycles)
+		return;
+
+	rcu_read_lock();
+	rcg = idr_find(&rproc_cgroup_idr, tag);
+	if (rcg)
+		atomic64_add(cycles, &rcg->usage);
+	rcu_read_unlock();
+}
+EXPORT_SYMBOL(rproc_cgroup_charge);
@@ -0,0 +1,565 @@
+/*
+ * Remote Processor Framework command queues
+ *
+ * A remote processor may declare pairs of submission and completion rings
+ * in its memory (see struct fw_rsc_cmdq), for offload work made of many
+ * small commands: the host copies a command into the submission ring and
+ * only rings the doorbell once per batch, and the remote processor writes
+ * back a tag and a status per completed command, whose phase bit tells
+ * the host it's new. Neither side reads an index the other publishes as
+ * it goes, as no more commands are in flight than there are tags.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#define pr_fmt(fmt)    "%s: " fmt, __func__
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/remoteproc.h>
+#include <linux/rculist.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/string.h>
+#include <linux/bitops.h>
+#include <linux/err.h>
+
+#include "remoteproc_internal.h"
+
+/* how many completions are picked up at once, before their callbacks run */
+#define RPROC_CMDQ_BATCH	16
+
+/**
+ * struct rproc_cmdq - a command queue of a remote processor
+ * @node: node in rproc->cmdqs
+ * @rproc: the remote processor
+ * @name: name of the queue, as its resource entry has it
+ * @lock: protects the rings, the tags and @hdr
+ * @cb_lock: protects @cb and @priv, and serializes the callbacks
+ * @hdr: the queue, or NULL while the remote processor is off
+ * @cq: the completion ring, right after the submission ring
+ * @depth: number of entries of each ring, and number of tags
+ * @sqe_size: size of each submission entry, in bytes
+ * @sq_notifyid: the notifyid the doorbell is rung with
+ * @cq_notifyid: the notifyid completions are signalled with
+ * @sq_tail: index of the next submission entry we write
+ * @sq_db: the index we last published in hdr->sq_tail
+ * @cq_head: index of the next completion entry we read
+ * @phase: FW_CMDQ_CQE_PHASE when new completion entries have it set
+ * @free_tags: stack of the tags that aren't in flight
+ * @nr_free: number of entries of @free_tags
+ * @busy: bitmap of the tags that are in flight
+ * @ctx: the ctx each tag in flight was submitted with
+ * @cb: handles the completions of the commands
+ * @priv: private data of @cb
+ * @open: whether the queue is used by someone (see rproc_cmdq_open())
+ */
+struct rproc_cmdq {
+	struct list_head node;
+	struct rproc *rproc;
+	char name[sizeof(((struct fw_rsc_cmdq *)0)->name) + 1];
+	spinlock_t lock;
+	spinlock_t cb_lock;
+	struct fw_cmdq *hdr;
+	struct fw_cmdq_cqe *cq;
+	u32 depth;
+	u32 sqe_size;
+	u32 sq_notifyid;
+	u32 cq_notifyid;
+	u32 sq_tail;
+	u32 sq_db;
+	u32 cq_head;
+	u16 phase;
+	u16 *free_tags;
+	u32 nr_free;
+	unsigned long *busy;
+	void **ctx;
+	rproc_cmdq_cb_t cb;
+	void *priv;
+	bool open;
+};
+
+static struct rproc_cmdq *rproc_find_cmdq(struct rproc *rproc,
+							const char *name)
+{
+	struct rproc_cmdq *q;
+
+	list_for_each_entry(q, &rproc->cmdqs, node)
+		if (!strcmp(q->name, name))
+			return q;
+
+	return NULL;
+}
+
+static struct fw_cmdq_sqe *rproc_cmdq_sqe(struct rproc_cmdq *q, u32 idx)
+{
+	return (void *)q->hdr->rings + (idx & (q->depth - 1)) * q->sqe_size;
+}
+
+/* the tags of a queue, and what their commands were submitted with */
+static void rproc_cmdq_free_tags(u16 *free_tags, unsigned long *busy,
+								void **ctx)
+{
+	kfree(free_tags);
+	kfree(busy);
+	kfree(ctx);
+}
+
+/**
+ * rproc_cmdq_attach() - handle a command queue resource
+ * @rproc: the remote processor
+ * @rsc: the command queue resource descriptor
+ *
+ * The queue keeps its struct rproc_cmdq (and thus its user) across the
+ * boots of @rproc: it's only bound to its memory again, with all its tags
+ * free.
+ *
+ * Must be called with rproc->lock held.
+ *
+ * Returns 0 on success, or an appropriate error code otherwise
+ */
+int rproc_cmdq_attach(struct rproc *rproc, struct fw_rsc_cmdq *rsc)
+{
+	struct device *dev = &rproc->dev;
+	struct rproc_cmdq *q;
+	struct fw_cmdq *hdr;
+	char name[sizeof(q->name)];
+	unsigned long *busy;
+	u16 *free_tags;
+	void **ctx;
+	unsigned long flags;
+	int len, i;
+
+	if (!rsc->depth || !is_power_of_2(rsc->depth) ||
+			rsc->depth > FW_CMDQ_DEPTH_MAX ||
+			rsc->sqe_size <= sizeof(struct fw_cmdq_sqe) ||
+			rsc->sqe_size > FW_CMDQ_SQE_MAX ||
+			rsc->sqe_size % sizeof(u32) ||
+			rsc->sq_notifyid == FW_RSC_NOTIFY_ID_ANY ||
+			rsc->cq_notifyid == FW_RSC_NOTIFY_ID_ANY ||
+			rsc->sq_notifyid == rsc->cq_notifyid || rsc->reserved) {
+		dev_err(dev, "bad cmdq: depth %u, sqe size %u, notifyids %u/%u\n",
+				rsc->depth, rsc->sqe_size, rsc->sq_notifyid,
+				rsc->cq_notifyid);
+		return -EINVAL;
+	}
+
+	len = sizeof(*hdr) + rsc->depth * (rsc->sqe_size +
+					sizeof(struct fw_cmdq_cqe));
+	hdr = rproc_da_to_va(rproc, rsc->da, len);
+	if (!hdr) {
+		dev_err(dev, "erroneous cmdq resource entry\n");
+		return -EINVAL;
+	}
+
+	memcpy(name, rsc->name, sizeof(rsc->name));
+	name[sizeof(rsc->name)] = '\0';
+
+	q = rproc_find_cmdq(rproc, name);
+	if (q && q->hdr) {
+		dev_err(dev, "duplicate cmdq %s\n", name);
+		return -EINVAL;
+	}
+
+	free_tags = kcalloc(rsc->depth, sizeof(*free_tags), GFP_KERNEL);
+	busy = kcalloc(BITS_TO_LONGS(rsc->depth), sizeof(*busy), GFP_KERNEL);
+	ctx = kcalloc(rsc->depth, sizeof(*ctx), GFP_KERNEL);
+	if (!free_tags || !busy || !ctx)
+		goto free_tags;
+
+	for (i = 0; i < rsc->depth; i++)
+		free_tags[i] = rsc->depth - 1 - i;
+
+	if (!q) {
+		q = kzalloc(sizeof(*q), GFP_KERNEL);
+		if (!q)
+			goto free_tags;
+
+		q->rproc = rproc;
+		strcpy(q->name, name);
+		spin_lock_init(&q->lock);
+		spin_lock_init(&q->cb_lock);
+		list_add_tail_rcu(&q->node, &rproc->cmdqs);
+	}
+
+	/* the remote processor isn't running yet: the rings start empty */
+	memset(hdr, 0, len);
+
+	spin_lock_irqsave(&q->lock, flags);
+	q->depth = rsc->depth;
+	q->sqe_size = rsc->sqe_size;
+	q->sq_notifyid = rsc->sq_notifyid;
+	q->cq_notifyid = rsc->cq_notifyid;
+	q->cq = (void *)hdr->rings + rsc->depth * rsc->sqe_size;
+	q->sq_tail = 0;
+	q->sq_db = 0;
+	q->cq_head = 0;
+	q->phase = FW_CMDQ_CQE_PHASE;
+	swap(q->free_tags, free_tags);
+	swap(q->busy, busy);
+	swap(q->ctx, ctx);
+	q->nr_free = rsc->depth;
+	q->hdr = hdr;
+	spin_unlock_irqrestore(&q->lock, flags);
+
+	/* those of the previous boot, if any */
+	rproc_cmdq_free_tags(free_tags, busy, ctx);
+
+	dev_dbg(dev, "cmdq %s: da 0x%x, depth %u, sqe size %u, notifyids %u/%u\n",
+			name, rsc->da, rsc->depth, rsc->sqe_size,
+			rsc->sq_notifyid, rsc->cq_notifyid);
+
+	return 0;
+
+free_tags:
+	dev_err(dev, "can't allocate the tags of cmdq %s\n", name);
+	rproc_cmdq_free_tags(free_tags, busy, ctx);
+	return -ENOMEM;
+}
+
+/**
+ * rproc_cmdq_detach() - unbind the command queues of a remote processor
+ * @rproc: the remote processor
+ *
+ * Called as the resources of @rproc are cleaned up: its command queues
+ * stay around, but submitting on them fails until @rproc is booted again.
+ * The commands that were still in flight are completed with -ENODEV.
+ */
+void rproc_cmdq_detach(struct rproc *rproc)
+{
+	struct rproc_cmdq *q;
+	unsigned long flags;
+	int tag;
+
+	list_for_each_entry(q, &rproc->cmdqs, node) {
+		spin_lock_irqsave(&q->cb_lock, flags);
+
+		spin_lock(&q->lock);
+		q->hdr = NULL;
+		spin_unlock(&q->lock);
+
+		/*
+		 * no one touches the tags anymore, now that @hdr is gone; the
+		 * callbacks may even try to submit again (and fail)
+		 */
+		for_each_set_bit(tag, q->busy, q->depth) {
+			__clear_bit(tag, q->busy);
+			q->free_tags[q->nr_free++] = tag;
+			if (q->cb)
+				q->cb(q, q->ctx[tag], -ENODEV, q->priv);
+		}
+
+		spin_unlock_irqrestore(&q->cb_lock, flags);
+	}
+}
+
+/**
+ * rproc_cmdq_free() - free the command queues of a remote processor
+ * @rproc: the remote processor, which is being released
+ */
+void rproc_cmdq_free(struct rproc *rproc)
+{
+	struct rproc_cmdq *q, *tmp;
+
+	list_for_each_entry_safe(q, tmp, &rproc->cmdqs, node) {
+		list_del(&q->node);
+		rproc_cmdq_free_tags(q->free_tags, q->busy, q->ctx);
+		kfree(q);
+	}
+}
+
+/* publish the commands written so far; tells whether to kick */
+static bool rproc_cmdq_publish(struct rproc_cmdq *q)
+{
+	if (q->sq_db == q->sq_tail)
+		return false;
+
+	/* publish the entries only once they're written */
+	wmb();
+	q->hdr->sq_tail = q->sq_tail;
+	q->sq_db = q->sq_tail;
+
+	return true;
+}
+
+/*
+ * pick the next completions up, and free their tags: returns how many
+ * were found (up to RPROC_CMDQ_BATCH), whose ctx and status are stored
+ * in @ctx and @status
+ */
+static int rproc_cmdq_reap(struct rproc_cmdq *q, void **ctx, int *status)
+{
+	struct fw_cmdq_cqe *cqe;
+	unsigned long flags;
+	u16 tag, st;
+	int n = 0;
+
+	spin_lock_irqsave(&q->lock, flags);
+
+	if (!q->hdr)
+		goto unlock;
+
+	while (n < RPROC_CMDQ_BATCH) {
+		cqe = &q->cq[q->cq_head & (q->depth - 1)];
+		st = ACCESS_ONCE(cqe->status);
+		if ((st & FW_CMDQ_CQE_PHASE) != q->phase)
+			break;
+
+		/* read the tag only after the phase that published it */
+		rmb();
+		tag = cqe->tag;
+
+		if (!(++q->cq_head & (q->depth - 1)))
+			q->phase ^= FW_CMDQ_CQE_PHASE;
+
+		if (tag >= q->depth || !__test_and_clear_bit(tag, q->busy)) {
+			dev_err(&q->rproc->dev, "cmdq %s: bogus tag %u\n",
+								q->name, tag);
+			continue;
+		}
+
+		q->free_tags[q->nr_free++] = tag;
+		ctx[n] = q->ctx[tag];
+		status[n] = st & ~FW_CMDQ_CQE_PHASE;
+		n++;
+	}
+
+unlock:
+	spin_unlock_irqrestore(&q->lock, flags);
+	return n;
+}
+
+/* hand the completions the remote processor wrote on @q to its user */
+static irqreturn_t rproc_cmdq_drain(struct rproc_cmdq *q)
+{
+	void *ctx[RPROC_CMDQ_BATCH];
+	int status[RPROC_CMDQ_BATCH];
+	irqreturn_t ret = IRQ_NONE;
+	unsigned long flags;
+	int i, n;
+
+	spin_lock_irqsave(&q->cb_lock, flags);
+
+	do {
+		n = rproc_cmdq_reap(q, ctx, status);
+		if (n)
+			ret = IRQ_HANDLED;
+
+		/* the callbacks may submit further commands */
+		for (i = 0; i < n; i++)
+			if (q->cb)
+				q->cb(q, ctx[i], status[i], q->priv);
+	} while (n == RPROC_CMDQ_BATCH);
+
+	spin_unlock_irqrestore(&q->cb_lock, flags);
+
+	return ret;
+}
+
+/**
+ * rproc_cmdq_interrupt() - look at the command queues a notification is
+ * about
+ * @rproc: the remote processor
+ * @notifyid: the notifyid the remote processor signalled, or RPROC_ALL_VQS
+ *
+ * Called from rproc_vq_interrupt() and the likes, possibly in interrupt
+ * context, before the vrings are looked at.
+ *
+ * Returns IRQ_HANDLED if any completion was found, and IRQ_NONE otherwise.
+ */
+irqreturn_t rproc_cmdq_interrupt(struct rproc *rproc, int notifyid)
+{
+	struct rproc_cmdq *q;
+	irqreturn_t ret = IRQ_NONE;
+
+	rcu_read_lock();
+	list_for_each_entry_rcu(q, &rproc->cmdqs, node) {
+		if (notifyid != RPROC_ALL_VQS && q->cq_notifyid != notifyid)
+			continue;
+		if (rproc_cmdq_drain(q) == IRQ_HANDLED)
+			ret = IRQ_HANDLED;
+	}
+	rcu_read_unlock();
+
+	return ret;
+}
+
+/**
+ * rproc_cmdq_open() - start using a command queue
+ * @rproc: the remote processor the queue belongs to
+ * @name: the name of the queue, as its resource entry has it
+ * @cb: handles the completions of the commands submitted on the queue
+ * @priv: private data of @cb
+ *
+ * The command queues of @rproc are only known once it was booted, and
+ * must be closed before it's deleted. @cb is called in atomic (e.g.
+ * interrupt) context, once per completed command, with the ctx it was
+ * submitted with, and either the status the remote processor completed
+ * it with (which is never negative), or -ENODEV if the remote processor
+ * went down before it did. @cb may submit further commands, but mustn't
+ * close the queue.
+ *
+ * Returns the queue on success, or an ERR_PTR() otherwise.
+ */
+struct rproc_cmdq *rproc_cmdq_open(struct rproc *rproc, const char *name,
+					rproc_cmdq_cb_t cb, void *priv)
+{
+	struct rproc_cmdq *q;
+	unsigned long flags;
+
+	mutex_lock(&rproc->lock);
+
+	q = rproc_find_cmdq(rproc, name);
+	if (!q) {
+		q = ERR_PTR(-ENOENT);
+		goto unlock;
+	}
+
+	if (q->open) {
+		q = ERR_PTR(-EBUSY);
+		goto unlock;
+	}
+
+	spin_lock_irqsave(&q->cb_lock, flags);
+	q->cb = cb;
+	q->priv = priv;
+	spin_unlock_irqrestore(&q->cb_lock, flags);
+	q->open = true;
+
+unlock:
+	mutex_unlock(&rproc->lock);
+	return q;
+}
+EXPORT_SYMBOL(rproc_cmdq_open);
+
+/**
+ * rproc_cmdq_close() - stop using a command queue
+ * @q: the queue, as rproc_cmdq_open() returned it
+ *
+ * Once this returns, the callback of @q isn't running, and won't be
+ * called anymore: the commands still in flight are completed silently,
+ * so their ctx shouldn't be freed before they are, or the remote
+ * processor is shut down.
+ */
+void rproc_cmdq_close(struct rproc_cmdq *q)
+{
+	struct rproc *rproc = q->rproc;
+	unsigned long flags;
+
+	mutex_lock(&rproc->lock);
+
+	spin_lock_irqsave(&q->cb_lock, flags);
+	q->cb = NULL;
+	q->priv = NULL;
+	spin_unlock_irqrestore(&q->cb_lock, flags);
+	q->open = false;
+
+	mutex_unlock(&rproc->lock);
+}
+EXPORT_SYMBOL(rproc_cmdq_close);
+
+/**
+ * rproc_cmdq_submit() - submit a command on a command queue
+ * @q: the queue, as rproc_cmdq_open() returned it
+ * @cmd: the command
+ * @len: length of @cmd, in bytes
+ * @ctx: what the callback of @q is handed once the command is completed
+ * @flags: RPROC_CMDQ_MORE if more commands follow right away
+ *
+ * The command is copied into the next entry of the submission ring of @q,
+ * along with a free tag. Unless @flags has RPROC_CMDQ_MORE, the doorbell
+ * is then rung: the commands submitted so far are published to the remote
+ * processor, which is kicked with the sq_notifyid of @q. Otherwise, that's
+ * up to the next submission, or rproc_cmdq_kick(). This never sleeps, so
+ * it can be used from any context.
+ *
+ * Returns the tag of the command on success, -EAGAIN if all the tags of
+ * @q are in flight (in which case the doorbell is rung anyway),
+ * -EMSGSIZE if @cmd doesn't fit in an entry, -ENODEV if the remote
+ * processor is off, or another appropriate error value otherwise.
+ */
+int rproc_cmdq_submit(struct rproc_cmdq *q, const void *cmd, int len,
+					void *ctx, unsigned int flags)
+{
+	struct fw_cmdq_sqe *sqe;
+	unsigned long irqflags;
+	bool kick = false;
+	int tag;
+
+	spin_lock_irqsave(&q->lock, irqflags);
+
+	if (!q->hdr) {
+		tag = -ENODEV;
+		goto unlock;
+	}
+
+	if (len < 0 || len > q->sqe_size - sizeof(*sqe)) {
+		tag = -EMSGSIZE;
+		goto unlock;
+	}
+
+	/* the commands held back would never complete, otherwise */
+	if (!q->nr_free) {
+		kick = rproc_cmdq_publish(q);
+		tag = -EAGAIN;
+		goto unlock;
+	}
+
+	tag = q->free_tags[--q->nr_free];
+	__set_bit(tag, q->busy);
+	q->ctx[tag] = ctx;
+
+	/*
+	 * a free tag means the remote processor consumed the entry we're
+	 * about to overwrite: it must be done reading it before we do
+	 */
+	mb();
+
+	sqe = rproc_cmdq_sqe(q, q->sq_tail++);
+	sqe->tag = tag;
+	sqe->len = len;
+	memcpy(sqe->data, cmd, len);
+
+	if (!(flags & RPROC_CMDQ_MORE))
+		kick = rproc_cmdq_publish(q);
+
+unlock:
+	spin_unlock_irqrestore(&q->lock, irqflags);
+
+	if (kick)
+		q->rproc->ops->kick(q->rproc, q->sq_notifyid);
+
+	return tag;
+}
+EXPORT_SYMBOL(rproc_cmdq_submit);
+
+/**
+ * rproc_cmdq_kick() - ring the doorbell of a command queue
+ * @q: the queue, as rproc_cmdq_open() returned it
+ *
+ * Publishes the commands that were submitted with RPROC_CMDQ_MORE, if
+ * any, and kicks the remote processor about them. This never sleeps.
+ */
+void rproc_cmdq_kick(struct rproc_cmdq *q)
+{
+	unsigned long flags;
+	bool kick = false;
+
+	spin_lock_irqsave(&q->lock, flags);
+
+	if (q->hdr)
+		kick = rproc_cmdq_publish(q);
+
+	spin_unlock_irqrestore(&q->lock, flags);
+
+	if (kick)
+		q->rproc->ops->kick(q->rproc, q->sq_notifyid);
+}
+EXPORT_SYMBOL(rproc_cmdq_kick);
@@ -0,0 +1,399 @@
+/*
+ * Remote Processor Framework notification moderation
+ *
+ * Every notification of a remote processor about its vrings costs the host
+ * an interrupt. A remote processor which can hold them back declares it
+ * with a struct fw_rsc_coalesce, and then notifies the host as the struct
+ * fw_coalesce hint tells it to: like a NIC coalescing its interrupts, it
+ * notifies the host once a few buffers went through its vrings, or once the
+ * first of them waited for long enough, so the host handles a batch of them
+ * per interrupt. The host periodically measures how many buffers the vrings
+ * go through, and tunes the hint to it: notifications come right away when
+ * the remote processor is quiet (so latency doesn't suffer), and are held
+ * back as it gets busy.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#define pr_fmt(fmt)    "%s: " fmt, __func__
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/remoteproc.h>
+#include <linux/virtio_ring.h>
+#include <linux/rcupdate.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/string.h>
+#include <linux/workqueue.h>
+#include <linux/math64.h>
+
+#include "remoteproc_internal.h"
+
+/* defaults of rproc->coalesce_params */
+#define RPROC_COALESCE_RATE_LOW		1000
+#define RPROC_COALESCE_RATE_HIGH	100000
+#define RPROC_COALESCE_USECS_HIGH	100
+#define RPROC_COALESCE_FRAMES_HIGH	32
+#define RPROC_COALESCE_SAMPLE_MS	250
+
+/* bounds of rproc->coalesce_params */
+#define RPROC_COALESCE_MAX_USECS	USEC_PER_SEC
+#define RPROC_COALESCE_MIN_SAMPLE_MS	10
+
+/**
+ * struct rproc_coalesce - the notification moderation of a remote processor
+ * @rproc: the remote processor
+ * @shm: the hint, as published in the memory of the remote processor
+ * @work: measures the rates, and tunes @shm to them, periodically
+ * @stamp: when the rates were last measured
+ * @notifications: rproc->notifications, when the rates were last measured
+ * @rate: buffers per second the vrings went through, as last measured
+ * @irq_rate: notifications per second of the remote processor, as last
+ *	      measured
+ *
+ * All but @work and @stamp are protected by the rproc's coalesce_lock.
+ */
+struct rproc_coalesce {
+	struct rproc *rproc;
+	struct fw_coalesce *shm;
+	struct delayed_work work;
+	ktime_t stamp;
+	unsigned long notifications;
+	u32 rate;
+	u32 irq_rate;
+};
+
+/* the u32 tunables, by the names the 'coalesce' debugfs entry knows them */
+static const struct {
+	const char *name;
+	size_t offset;
+} rproc_coalesce_fields[] = {
+	{ "usecs", offsetof(struct rproc_coalesce_params, usecs) },
+	{ "frames", offsetof(struct rproc_coalesce_params, frames) },
+	{ "rate-low", offsetof(struct rproc_coalesce_params, rate_low) },
+	{ "usecs-low", offsetof(struct rproc_coalesce_params, usecs_low) },
+	{ "frames-low", offsetof(struct rproc_coalesce_params, frames_low) },
+	{ "rate-high", offsetof(struct rproc_coalesce_params, rate_high) },
+	{ "usecs-high", offsetof(struct rproc_coalesce_params, usecs_high) },
+	{ "frames-high", offsetof(struct rproc_coalesce_params, frames_high) },
+	{ "sample-ms", offsetof(struct rproc_coalesce_params, sample_ms) },
+};
+
+#define rproc_coalesce_field(p, i) \
+	((u32 *)((char *)(p) + rproc_coalesce_fields[i].offset))
+
+/**
+ * rproc_coalesce_init() - set the default notification moderation of an rproc
+ * @rproc: the remote processor, which is being allocated
+ *
+ * By default, the moderation is adaptive, and the remote processor notifies
+ * the host about each buffer while it goes through less than 1000 of them
+ * per second.
+ */
+void rproc_coalesce_init(struct rproc *rproc)
+{
+	struct rproc_coalesce_params *p = &rproc->coalesce_params;
+
+	spin_lock_init(&rproc->coalesce_lock);
+
+	p->adaptive = true;
+	p->frames = 1;
+	p->rate_low = RPROC_COALESCE_RATE_LOW;
+	p->frames_low = 1;
+	p->rate_high = RPROC_COALESCE_RATE_HIGH;
+	p->usecs_high = RPROC_COALESCE_USECS_HIGH;
+	p->frames_high = RPROC_COALESCE_FRAMES_HIGH;
+	p->sample_ms = RPROC_COALESCE_SAMPLE_MS;
+}
+
+/* @low, at or under @rate_low, @high, at or over @rate_high, and a mix */
+static u32 rproc_coalesce_mix(u32 rate, u32 rate_low, u32 rate_high,
+							u32 low, u32 high)
+{
+	if (rate <= rate_low)
+		return low;
+	if (rate >= rate_high)
+		return high;
+
+	return low + div_s64(((s64)high - low) * (rate - rate_low),
+							rate_high - rate_low);
+}
+
+/*
+ * tell the remote processor how to notify the host from now on, as told
+ * by @p, and by the last measured rate. Called with coalesce_lock held
+ */
+static void rproc_coalesce_publish(struct rproc_coalesce *c,
+				const struct rproc_coalesce_params *p)
+{
+	u32 usecs = p->usecs, frames = p->frames;
+
+	if (p->adaptive) {
+		usecs = rproc_coalesce_mix(c->rate, p->rate_low, p->rate_high,
+						p->usecs_low, p->usecs_high);
+		frames = rproc_coalesce_mix(c->rate, p->rate_low, p->rate_high,
+						p->frames_low, p->frames_high);
+	}
+
+	/* either may be looked at first: each is valid on its own */
+	ACCESS_ONCE(c->shm->usecs) = usecs;
+	ACCESS_ONCE(c->shm->frames) = frames;
+}
+
+/* buffers the vrings of @rproc went through since this was last called */
+static u32 rproc_coalesce_count(struct rproc *rproc)
+{
+	struct rproc_vring_map *map;
+	struct rproc_vring *rvring;
+	struct vring vring;
+	u32 count = 0;
+	u16 used;
+	int notifyid;
+
+	rcu_read_lock();
+	map = rcu_dereference(rproc->vring_map);
+	for (notifyid = 0; map && notifyid < map->size; notifyid++) {
+		rvring = rcu_dereference(map->vrings[notifyid]);
+		if (!rvring || !rvring->vq)
+			continue;
+
+		vring_init(&vring, rvring->len, rvring->va, rvring->align);
+		used = ACCESS_ONCE(vring.used->idx);
+		count += (u16)(used - rvring->coalesce_used);
+		rvring->coalesce_used = used;
+	}
+	rcu_read_unlock();
+
+	return count;
+}
+
+/* measure the rates, and tune the hint to them */
+static void rproc_coalesce_work(struct work_struct *work)
+{
+	struct rproc_coalesce *c = container_of(to_delayed_work(work),
+					struct rproc_coalesce, work);
+	struct rproc *rproc = c->rproc;
+	struct rproc_coalesce_params *p = &rproc->coalesce_params;
+	unsigned long notifications = ACCESS_ONCE(rproc->notifications);
+	ktime_t now = ktime_get();
+	u64 period_us;
+	unsigned long period;
+	u32 count;
+
+	count = rproc_coalesce_count(rproc);
+	period_us = max_t(s64, ktime_us_delta(now, c->stamp), 1);
+	c->stamp = now;
+
+	spin_lock_irq(&rproc->coalesce_lock);
+
+	c->rate = min_t(u64, div64_u64((u64)count * USEC_PER_SEC, period_us),
+								UINT_MAX);
+	c->irq_rate = min_t(u64, div64_u64((u64)(notifications -
+			c->notifications) * USEC_PER_SEC, period_us), UINT_MAX);
+	c->notifications = notifications;
+
+	if (p->adaptive)
+		rproc_coalesce_publish(c, p);
+
+	period = msecs_to_jiffies(p->sample_ms);
+
+	spin_unlock_irq(&rproc->coalesce_lock);
+
+	schedule_delayed_work(&c->work, period);
+}
+
+/**
+ * rproc_coalesce_attach() - start moderating the notifications of an rproc
+ * @rproc: the remote processor, which is about to be booted
+ * @rsc: the coalesce resource entry
+ *
+ * Publishes the hint right away, so it's there by the time the remote
+ * processor starts: it's the one of the lowest rate, when adaptive.
+ *
+ * Returns 0 on success, or an appropriate error otherwise.
+ */
+int rproc_coalesce_attach(struct rproc *rproc, struct fw_rsc_coalesce *rsc)
+{
+	struct device *dev = &rproc->dev;
+	struct rproc_coalesce *c;
+	unsigned long period;
+
+	if (rproc->coalesce) {
+		dev_err(dev, "only one coalesce rsc is supported\n");
+		return -EINVAL;
+	}
+
+	c = kzalloc(sizeof(*c), GFP_KERNEL);
+	if (!c)
+		return -ENOMEM;
+
+	c->shm = rproc_da_to_va(rproc, rsc->da, sizeof(*c->shm));
+	if (!c->shm) {
+		dev_err(dev, "erroneous coalesce resource entry\n");
+		kfree(c);
+		return -EINVAL;
+	}
+
+	c->rproc = rproc;
+	INIT_DELAYED_WORK(&c->work, rproc_coalesce_work);
+	memset(c->shm, 0, sizeof(*c->shm));
+
+	rproc_coalesce_count(rproc);
+	c->stamp = ktime_get();
+
+	spin_lock_irq(&rproc->coalesce_lock);
+	c->notifications = rproc->notifications;
+	rproc_coalesce_publish(c, &rproc->coalesce_params);
+	period = msecs_to_jiffies(rproc->coalesce_params.sample_ms);
+	rproc->coalesce = c;
+	spin_unlock_irq(&rproc->coalesce_lock);
+
+	schedule_delayed_work(&c->work, period);
+
+	dev_dbg(dev, "coalesce rsc: da 0x%x\n", rsc->da);
+
+	return 0;
+}
+
+/**
+ * rproc_coalesce_detach() - stop moderating the notifications of an rproc
+ * @rproc: the remote processor, whose resources are being released
+ */
+void rproc_coalesce_detach(struct rproc *rproc)
+{
+	struct rproc_coalesce *c = rproc->coalesce;
+
+	if (!c)
+		return;
+
+	cancel_delayed_work_sync(&c->work);
+
+	spin_lock_irq(&rproc->coalesce_lock);
+	rproc->coalesce = NULL;
+	spin_unlock_irq(&rproc->coalesce_lock);
+
+	kfree(c);
+}
+
+/**
+ * rproc_coalesce_print() - print the notification moderation of an rproc
+ * @rproc: the remote processor
+ * @buf: where to print it
+ * @size: size of @buf
+ *
+ * Prints the tunables (see rproc_coalesce_set()), and, while the remote
+ * processor is running with them, the last measured rates and the current
+ * hint. Returns the number of characters printed into @buf.
+ */
+int rproc_coalesce_print(struct rproc *rproc, char *buf, size_t size)
+{
+	struct rproc_coalesce_params *p = &rproc->coalesce_params;
+	struct rproc_coalesce *c;
+	int i, n;
+
+	spin_lock_irq(&rproc->coalesce_lock);
+
+	n = scnprintf(buf, size, "adaptive: %s\n", p->adaptive ? "on" : "off");
+	for (i = 0; i < ARRAY_SIZE(rproc_coalesce_fields); i++)
+		n += scnprintf(buf + n, size - n, "%s: %u\n",
+					rproc_coalesce_fields[i].name,
+					*rproc_coalesce_field(p, i));
+
+	c = rproc->coalesce;
+	if (c)
+		n += scnprintf(buf + n, size - n, "\nrate: %u\n"
+				"irq-rate: %u\ncurrent usecs: %u\n"
+				"current frames: %u\n", c->rate, c->irq_rate,
+				c->shm->usecs, c->shm->frames);
+	else
+		n += scnprintf(buf + n, size - n,
+				"\nnot requested by the firmware\n");
+
+	spin_unlock_irq(&rproc->coalesce_lock);
+
+	return n;
+}
+
+/**
+ * rproc_coalesce_set() - tune the notification moderation of an rproc
+ * @rproc: the remote processor
+ * @cmd: a list of "<name> <value>" pairs, like the arguments of 'ethtool -C'
+ *
+ * The names are "adaptive" ("on" or "off"), and those of the u32 fields of
+ * struct rproc_coalesce_params, with '-' instead of '_' (e.g. "usecs-high
+ * 50"). They're applied at once, or not at all if any is invalid, and
+ * published to the remote processor right away if it's running. @cmd is
+ * modified.
+ *
+ * Returns 0 on success, or -EINVAL if @cmd is invalid.
+ */
+int rproc_coalesce_set(struct rproc *rproc, char *cmd)
+{
+	struct rproc_coalesce_params p;
+	char *name, *value;
+	u32 val;
+	int i;
+
+	spin_lock_irq(&rproc->coalesce_lock);
+	p = rproc->coalesce_params;
+	spin_unlock_irq(&rproc->coalesce_lock);
+
+	while ((name = strsep(&cmd, " \t\n"))) {
+		if (!*name)
+			continue;
+
+		do {
+			value = strsep(&cmd, " \t\n");
+		} while (value && !*value);
+		if (!value)
+			return -EINVAL;
+
+		if (!strcmp(name, "adaptive")) {
+			if (!strcmp(value, "on"))
+				p.adaptive = true;
+			else if (!strcmp(value, "off"))
+				p.adaptive = false;
+			else
+				return -EINVAL;
+			continue;
+		}
+
+		for (i = 0; i < ARRAY_SIZE(rproc_coalesce_fields); i++)
+			if (!strcmp(name, rproc_coalesce_fields[i].name))
+				break;
+
+		if (i == ARRAY_SIZE(rproc_coalesce_fields) ||
+						kstrtou32(value, 0, &val))
+			return -EINVAL;
+
+		*rproc_coalesce_field(&p, i) = val;
+	}
+
+	if (p.usecs > RPROC_COALESCE_MAX_USECS ||
+			p.usecs_low > RPROC_COALESCE_MAX_USECS ||
+			p.usecs_high > RPROC_COALESCE_MAX_USECS ||
+			p.rate_low >= p.rate_high ||
+			p.sample_ms < RPROC_COALESCE_MIN_SAMPLE_MS)
+		return -EINVAL;
+
+	/* notifying for each buffer is the least that can be asked for */
+	p.frames = max_t(u32, p.frames, 1);
+	p.frames_low = max_t(u32, p.frames_low, 1);
+	p.frames_high = max_t(u32, p.frames_high, 1);
+
+	spin_lock_irq(&rproc->coalesce_lock);
+	rproc->coalesce_params = p;
+	if (rproc->coalesce)
+		rproc_coalesce_publish(rproc->coalesce, &p);
+	spin_unlock_irq(&rproc->coalesce_lock);
+
+	return 0;
+}
@@ -30,6 +30,7 @@
 #include <linux/slab.h>
 #include <linux/mutex.h>
 #include <linux/dma-mapping.h>
+#include <linux/dma-buf.h>
 #include <linux/firmware.h>
 #include <linux/string.h>
 #include <linux/debugfs.h>
@@ -39,10 +40,29 @@
 #include <linux/elf.h>
 #include <linux/virtio_ids.h>
 #include <linux/virtio_ring.h>
+#include <linux/fs.h>
+#include <linux/file.h>
+#include <linux/io.h>
+#include <linux/pm_runtime.h>
+#include <linux/pfn.h>
+#include <linux/kthread.h>
+#include <linux/sort.h>
+#include <linux/genalloc.h>
+#include <linux/crc32.h>
+#include <linux/async.h>
+#include <generated/utsrelease.h>
 #include <asm/byteorder.h>
 
+#include <trace/events/remoteproc.h>
+
 #include "remoteproc_internal.h"
 
+/* default for rproc->poll_idle_usecs */
+#define RPROC_POLL_IDLE_USECS	1000
+
+/* default for rproc->msg_cost_us */
+#define RPROC_MSG_COST_US	100
+
 typedef int (*rproc_handle_resources_t)(struct rproc *rproc,
 				struct resource_table *table, int len);
 typedef int (*rproc_handle_resource_t)(struct rproc *rproc, void *, int avail);
@@ -50,8 +70,13 @@ typedef int (*rproc_handle_resource_t)(struct rproc *rproc, void *, int avail);
 /* Unique indices for remoteproc devices */
 static DEFINE_IDA(rproc_dev_index);
 
+/* protects the failover pairs, and their roles (see rproc_set_failover()) */
+static DEFINE_MUTEX(rproc_failover_lock);
+
 static const char * const rproc_crash_names[] = {
 	[RPROC_MMUFAULT]	= "mmufault",
+	[RPROC_WATCHDOG]	= "watchdog",
+	[RPROC_FATAL_ERROR]	= "fatal error",
 };
 
 /* translate rproc_crash_type to string */
@@ -62,6 +87,223 @@ static const char *rproc_crash_to_string(enum rproc_crash_type type)
 	return "unkown";
 }
 
+/* a running remote processor missed its deadline: deem it hung */
+static enum hrtimer_restart rproc_watchdog_expired(struct hrtimer *timer)
+{
+	struct rproc *rproc = container_of(timer, struct rproc, watchdog);
+
+	rproc_report_crash(rproc, RPROC_WATCHDOG);
+
+	return HRTIMER_NORESTART;
+}
+
+/* start enforcing the watchdog deadline, if any, of a running rproc */
+static void rproc_watchdog_start(struct rproc *rproc)
+{
+	unsigned long flags;
+
+	if (!rproc->watchdog_timeout)
+		return;
+
+	spin_lock_irqsave(&rproc->watchdog_lock, flags);
+	rproc->watchdog_armed = true;
+	hrtimer_start(&rproc->watchdog,
+		ns_to_ktime((u64)rproc->watchdog_timeout * NSEC_PER_USEC),
+		HRTIMER_MODE_REL);
+	spin_unlock_irqrestore(&rproc->watchdog_lock, flags);
+}
+
+/* stop enforcing the watchdog deadline, as the rproc stops running */
+static void rproc_watchdog_stop(struct rproc *rproc)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&rproc->watchdog_lock, flags);
+	rproc->watchdog_armed = false;
+	spin_unlock_irqrestore(&rproc->watchdog_lock, flags);
+
+	hrtimer_cancel(&rproc->watchdog);
+}
+
+/**
+ * rproc_watchdog_pet() - a remote processor showed signs of life
+ * @rproc: the remote processor
+ *
+ * This function pushes the watchdog deadline of a running @rproc (see
+ * rproc->watchdog_timeout) back. It's called whenever the remote processor
+ * interrupts with a virtqueue index (which includes the heartbeats it may
+ * send over rpmsg), and may also be called by rproc implementations, e.g.
+ * when the remote processor otherwise tells it's alive.
+ *
+ * This function can be called from atomic/interrupt context.
+ */
+void rproc_watchdog_pet(struct rproc *rproc)
+{
+	unsigned long flags;
+
+	if (!rproc->watchdog_timeout)
+		return;
+
+	spin_lock_irqsave(&rproc->watchdog_lock, flags);
+	if (rproc->watchdog_armed)
+		hrtimer_start(&rproc->watchdog,
+			ns_to_ktime((u64)rproc->watchdog_timeout * NSEC_PER_USEC),
+			HRTIMER_MODE_REL);
+	spin_unlock_irqrestore(&rproc->watchdog_lock, flags);
+}
+EXPORT_SYMBOL(rproc_watchdog_pet);
+
+/**
+ * rproc_register_event_cb() - handle the inline events of a remote processor
+ * @rproc: the remote processor
+ * @cb: the handler of the events
+ * @priv: private data handed to @cb
+ *
+ * Inline events are single words the remote processor sends in the
+ * notification itself (e.g. the mailbox message) rather than through a
+ * vring, such as "frame N is done": they cost neither buffers nor rpmsg
+ * headers, and are handed to @cb right from the interrupt handler which
+ * received them. Only rproc implementations providing a range of
+ * notifications for them (see rproc_event_interrupt()) support them.
+ *
+ * A remote processor has a single event handler at a time.
+ *
+ * Returns 0 on success, or -EBUSY if @rproc has an event handler already.
+ */
+int rproc_register_event_cb(struct rproc *rproc, rproc_event_cb_t cb,
+								void *priv)
+{
+	unsigned long flags;
+	int ret = 0;
+
+	spin_lock_irqsave(&rproc->event_lock, flags);
+	if (rproc->event_cb) {
+		ret = -EBUSY;
+	} else {
+		rproc->event_cb = cb;
+		rproc->event_priv = priv;
+	}
+	spin_unlock_irqrestore(&rproc->event_lock, flags);
+
+	return ret;
+}
+EXPORT_SYMBOL(rproc_register_event_cb);
+
+/**
+ * rproc_unregister_event_cb() - stop handling the inline events of an rproc
+ * @rproc: the remote processor
+ *
+ * Once this returns, the handler registered by rproc_register_event_cb()
+ * isn't running anymore, and won't be called again. Events sent in the
+ * meantime are dropped.
+ */
+void rproc_unregister_event_cb(struct rproc *rproc)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&rproc->event_lock, flags);
+	rproc->event_cb = NULL;
+	rproc->event_priv = NULL;
+	spin_unlock_irqrestore(&rproc->event_lock, flags);
+}
+EXPORT_SYMBOL(rproc_unregister_event_cb);
+
+/**
+ * rproc_send_event() - send an inline event to a remote processor
+ * @rproc: the remote processor
+ * @event: the event
+ *
+ * The event is carried by the notification itself (see the ->send_event()
+ * handler), so the remote processor gets it without looking at any vring.
+ * How many bits of @event fit is up to the rproc implementation.
+ *
+ * This function never sleeps, so it can be called from any context.
+ *
+ * Returns 0 on success, -EOPNOTSUPP if the rproc implementation doesn't
+ * support inline events, -EINVAL if @event doesn't fit, -ENODEV if the
+ * remote processor is off, or another appropriate error value otherwise.
+ */
+int rproc_send_event(struct rproc *rproc, u32 event)
+{
+	if (!rproc->ops->send_event)
+		return -EOPNOTSUPP;
+
+	if (ACCESS_ONCE(rproc->state) == RPROC_OFFLINE)
+		return -ENODEV;
+
+	return rproc->ops->send_event(rproc, event);
+}
+EXPORT_SYMBOL(rproc_send_event);
+
+/**
+ * rproc_event_interrupt() - an inline event was received
+ * @rproc: the remote processor which sent it
+ * @event: the event
+ *
+ * This function should be called by rproc implementations, whenever the
+ * notification they receive carries an inline event rather than a
+ * virtqueue index. The event is handed to the handler registered with
+ * rproc_register_event_cb(), if any, or dropped otherwise.
+ *
+ * This function can be called from atomic/interrupt context.
+ */
+void rproc_event_interrupt(struct rproc *rproc, u32 event)
+{
+	unsigned long flags;
+
+	rproc_watchdog_pet(rproc);
+
+	spin_lock_irqsave(&rproc->event_lock, flags);
+	if (rproc->event_cb)
+		rproc->event_cb(rproc, event, rproc->event_priv);
+	else
+		dev_dbg_ratelimited(&rproc->dev, "dropped event 0x%x\n",
+									event);
+	spin_unlock_irqrestore(&rproc->event_lock, flags);
+}
+EXPORT_SYMBOL(rproc_event_interrupt);
+
+/*
+ * zero out (if needed) and map the page of a hole @iova belongs to (see
+ * rproc_da_zero_lazily()).
+ *
+ * This is called from the iommu fault handler, which is why the iommu driver
+ * must be able to map memory from there. The holes only change while the
+ * remote processor is powered off, so this doesn't need to lock them.
+ */
+static int rproc_fault_in(struct rproc *rproc, unsigned long iova)
+{
+	struct rproc_hole *hole;
+	unsigned long page;
+	int ret;
+
+	list_for_each_entry(hole, &rproc->holes, node) {
+		if (iova < hole->da || iova - hole->da >= hole->len)
+			continue;
+
+		page = (iova - hole->da) >> PAGE_SHIFT;
+
+		/* the page is mapped already: this is a genuine fault */
+		if (test_bit(page, hole->faulted))
+			return -EFAULT;
+
+		if (hole->dirty)
+			memset(hole->va + (page << PAGE_SHIFT), 0, PAGE_SIZE);
+
+		ret = iommu_map(rproc->domain, hole->da + (page << PAGE_SHIFT),
+				hole->dma + (page << PAGE_SHIFT), PAGE_SIZE,
+								hole->flags);
+		if (ret)
+			return ret;
+
+		set_bit(page, hole->faulted);
+
+		return 0;
+	}
+
+	return -ENOENT;
+}
+
 /*
  * This is the IOMMU fault handler we register with the IOMMU API
  * (when relevant; not all remote processors access memory through
@@ -75,6 +317,10 @@ static int rproc_iommu_fault(struct iommu_domain *domain, struct device *dev,
 {
 	struct rproc *rproc = token;
 
+	/* sparsely loaded memory is expected to fault: just fill it in */
+	if (!rproc_fault_in(rproc, iova))
+		return 0;
+
 	dev_err(dev, "iommu fault: da 0x%lx flags 0x%x\n", iova, flags);
 
 	rproc_report_crash(rproc, RPROC_MMUFAULT);
@@ -92,6 +338,15 @@ static int rproc_enable_iommu(struct rproc *rproc)
 	struct device *dev = rproc->dev.parent;
 	int ret;
 
+	/*
+	 * The domain, and its page tables, are kept across power cycles:
+	 * only the mappings come and go, and the MMU context is saved and
+	 * restored by the platform driver as the remote is powered off and
+	 * on again.
+	 */
+	if (rproc->domain)
+		return 0;
+
 	/*
 	 * We currently use iommu_present() to decide if an IOMMU
 	 * setup is needed.
@@ -142,7 +397,144 @@ static void rproc_disable_iommu(struct rproc *rproc)
 	iommu_detach_device(domain, dev);
 	iommu_domain_free(domain);
 
-	return;
+	rproc->domain = NULL;
+}
+
+static u64 rproc_carveout_key(struct rproc_mem_entry *carveout, int key)
+{
+	switch (key) {
+	case RPROC_KEY_VA:
+		return (unsigned long)carveout->va;
+	case RPROC_KEY_DMA:
+		return carveout->dma;
+	default:
+		return carveout->da;
+	}
+}
+
+static int rproc_cmp_carveouts(const void *a, const void *b, int key)
+{
+	u64 ka = rproc_carveout_key(*(struct rproc_mem_entry **)a, key);
+	u64 kb = rproc_carveout_key(*(struct rproc_mem_entry **)b, key);
+
+	return ka < kb ? -1 : ka > kb;
+}
+
+static int rproc_cmp_da(const void *a, const void *b)
+{
+	return rproc_cmp_carveouts(a, b, RPROC_KEY_DA);
+}
+
+static int rproc_cmp_va(const void *a, const void *b)
+{
+	return rproc_cmp_carveouts(a, b, RPROC_KEY_VA);
+}
+
+static int rproc_cmp_dma(const void *a, const void *b)
+{
+	return rproc_cmp_carveouts(a, b, RPROC_KEY_DMA);
+}
+
+static int (*rproc_carveout_cmp[RPROC_KEYS])(const void *, const void *) = {
+	[RPROC_KEY_DA] = rproc_cmp_da,
+	[RPROC_KEY_VA] = rproc_cmp_va,
+	[RPROC_KEY_DMA] = rproc_cmp_dma,
+};
+
+/**
+ * rproc_index_carveouts() - sort the carveouts of a remote processor
+ * @rproc: the remote processor
+ *
+ * Rebuild rproc->carveout_index, which has the carveouts sorted by their
+ * device, kernel and dma addresses, for the address translations to
+ * binary search them. Must be called whenever rproc->carveouts changes
+ * (they only do as the resources of the remote processor are set up and
+ * cleaned up, so that's cheap enough), with rproc->lock held.
+ *
+ * If the index can't be allocated, there's none, and the translations walk
+ * rproc->carveouts instead.
+ */
+static void rproc_index_carveouts(struct rproc *rproc)
+{
+	struct rproc_carveout_index *old = rproc->carveout_index, *index = NULL;
+	struct rproc_mem_entry *carveout;
+	int num = 0, key, i;
+
+	list_for_each_entry(carveout, &rproc->carveouts, node)
+		num++;
+
+	if (num)
+		index = kmalloc(sizeof(*index) + RPROC_KEYS * num *
+					sizeof(index->entries[0]), GFP_KERNEL);
+
+	if (index) {
+		index->num = num;
+		for (key = 0; key < RPROC_KEYS; key++) {
+			index->sorted[key] = &index->entries[key * num];
+
+			i = 0;
+			list_for_each_entry(carveout, &rproc->carveouts, node)
+				index->sorted[key][i++] = carveout;
+
+			sort(index->sorted[key], num, sizeof(carveout),
+					rproc_carveout_cmp[key], NULL);
+		}
+	} else if (num) {
+		dev_warn(&rproc->dev, "can't index %d carveouts\n", num);
+	}
+
+	rcu_assign_pointer(rproc->carveout_index, index);
+	if (old)
+		kfree_rcu(old, rcu);
+}
+
+static bool rproc_carveout_has(struct rproc_mem_entry *carveout, int key,
+							u64 addr, int len)
+{
+	u64 start = rproc_carveout_key(carveout, key);
+
+	return addr >= start && addr - start + len <= carveout->len;
+}
+
+/*
+ * find the carveout [@addr, @addr + @len) is within, @addr being a @key
+ * (i.e. a device, kernel or dma address), by binary searching the last
+ * carveout starting at or before it. Carveouts don't overlap.
+ */
+static struct rproc_mem_entry *rproc_find_carveout(struct rproc *rproc,
+						int key, u64 addr, int len)
+{
+	struct rproc_carveout_index *index;
+	struct rproc_mem_entry *carveout = NULL, **sorted;
+	int lo = 0, hi, mid;
+
+	rcu_read_lock();
+
+	index = rcu_dereference(rproc->carveout_index);
+	if (!index) {
+		list_for_each_entry(carveout, &rproc->carveouts, node)
+			if (rproc_carveout_has(carveout, key, addr, len))
+				goto out;
+		carveout = NULL;
+		goto out;
+	}
+
+	sorted = index->sorted[key];
+	hi = index->num;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (rproc_carveout_key(sorted[mid], key) <= addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (lo && rproc_carveout_has(sorted[lo - 1], key, addr, len))
+		carveout = sorted[lo - 1];
+
+out:
+	rcu_read_unlock();
+	return carveout;
 }
 
 /*
@@ -161,660 +553,3842 @@ static void rproc_disable_iommu(struct rproc *rproc)
  * Note: phys_to_virt(iommu_iova_to_phys(rproc->domain, da)) will work too,
  * but only on kernel direct mapped RAM memory. Instead, we're just using
  * here the output of the DMA API, which should be more correct.
+ *
+ * The carveouts are looked up in rproc->carveout_index, so the translation
+ * takes O(log n), and can be used in hot paths (e.g. on the addresses rpmsg
+ * messages carry) while the remote processor is running.
  */
 void *rproc_da_to_va(struct rproc *rproc, u64 da, int len)
 {
 	struct rproc_mem_entry *carveout;
-	void *ptr = NULL;
 
-	list_for_each_entry(carveout, &rproc->carveouts, node) {
-		int offset = da - carveout->da;
-
-		/* try next carveout if da is too small */
-		if (offset < 0)
-			continue;
-
-		/* try next carveout if da is too large */
-		if (offset + len > carveout->len)
-			continue;
-
-		ptr = carveout->va + offset;
-
-		break;
-	}
+	carveout = rproc_find_carveout(rproc, RPROC_KEY_DA, da, len);
+	if (!carveout)
+		return NULL;
 
-	return ptr;
+	return carveout->va + (da - carveout->da);
 }
 EXPORT_SYMBOL(rproc_da_to_va);
 
-int rproc_alloc_vring(struct rproc_vdev *rvdev, int i)
+/**
+ * rproc_va_to_da() - translate a kernel address into a device address
+ * @rproc: handle of a remote processor
+ * @va: kernel address, within one of the carveouts of @rproc
+ * @len: length of the memory region @va is pointing to
+ * @da: where to put the device address of @va
+ *
+ * This is the reverse of rproc_da_to_va(), e.g. for the addresses of the
+ * buffers the host hands to the remote processor inside its messages.
+ *
+ * Returns 0 on success, or -EINVAL if [@va, @va + @len) isn't within a
+ * single carveout.
+ */
+int rproc_va_to_da(struct rproc *rproc, void *va, int len, u64 *da)
 {
-	struct rproc *rproc = rvdev->rproc;
-	struct device *dev = &rproc->dev;
-	struct rproc_vring *rvring = &rvdev->vring[i];
-	dma_addr_t dma;
-	void *va;
-	int ret, size, notifyid;
-
-	/* actual size of vring (in bytes) */
-	size = PAGE_ALIGN(vring_size(rvring->len, rvring->align));
-
-	if (!idr_pre_get(&rproc->notifyids, GFP_KERNEL)) {
-		dev_err(dev, "idr_pre_get failed\n");
-		return -ENOMEM;
-	}
+	struct rproc_mem_entry *carveout;
 
-	/*
-	 * Allocate non-cacheable memory for the vring. In the future
-	 * this call will also configure the IOMMU for us
-	 * TODO: let the rproc know the da of this vring
-	 */
-	va = dma_alloc_coherent(dev->parent, size, &dma, GFP_KERNEL);
-	if (!va) {
-		dev_err(dev->parent, "dma_alloc_coherent failed\n");
+	carveout = rproc_find_carveout(rproc, RPROC_KEY_VA, (unsigned long)va,
+									len);
+	if (!carveout)
 		return -EINVAL;
-	}
-
-	/*
-	 * Assign an rproc-wide unique index for this vring
-	 * TODO: assign a notifyid for rvdev updates as well
-	 * TODO: let the rproc know the notifyid of this vring
-	 * TODO: support predefined notifyids (via resource table)
-	 */
-	ret = idr_get_new(&rproc->notifyids, rvring, &notifyid);
-	if (ret) {
-		dev_err(dev, "idr_get_new failed: %d\n", ret);
-		dma_free_coherent(dev->parent, size, va, dma);
-		return ret;
-	}
-
-	/* Store largest notifyid */
-	rproc->max_notifyid = max(rproc->max_notifyid, notifyid);
-
-	dev_dbg(dev, "vring%d: va %p dma %llx size %x idr %d\n", i, va,
-				(unsigned long long)dma, size, notifyid);
-
-	rvring->va = va;
-	rvring->dma = dma;
-	rvring->notifyid = notifyid;
 
+	*da = carveout->da + (va - carveout->va);
 	return 0;
 }
+EXPORT_SYMBOL(rproc_va_to_da);
 
-static int
-rproc_parse_vring(struct rproc_vdev *rvdev, struct fw_rsc_vdev *rsc, int i)
+/**
+ * rproc_dma_to_da() - translate a dma address into a device address
+ * @rproc: handle of a remote processor
+ * @dma: dma address, within one of the carveouts of @rproc
+ * @len: length of the memory region @dma is pointing to
+ * @da: where to put the device address of @dma
+ *
+ * Just like rproc_va_to_da(), but for the dma (i.e. physical, if @rproc
+ * sits behind an iommu) address of the memory.
+ *
+ * Returns 0 on success, or -EINVAL if [@dma, @dma + @len) isn't within a
+ * single carveout.
+ */
+int rproc_dma_to_da(struct rproc *rproc, dma_addr_t dma, int len, u64 *da)
 {
-	struct rproc *rproc = rvdev->rproc;
-	struct device *dev = &rproc->dev;
-	struct fw_rsc_vdev_vring *vring = &rsc->vring[i];
-	struct rproc_vring *rvring = &rvdev->vring[i];
-
-	dev_dbg(dev, "vdev rsc: vring%d: da %x, qsz %d, align %d\n",
-				i, vring->da, vring->num, vring->align);
-
-	/* make sure reserved bytes are zeroes */
-	if (vring->reserved) {
-		dev_err(dev, "vring rsc has non zero reserved bytes\n");
-		return -EINVAL;
-	}
+	struct rproc_mem_entry *carveout;
 
-	/* verify queue size and vring alignment are sane */
-	if (!vring->num || !vring->align) {
-		dev_err(dev, "invalid qsz (%d) or alignment (%d)\n",
-						vring->num, vring->align);
+	carveout = rproc_find_carveout(rproc, RPROC_KEY_DMA, dma, len);
+	if (!carveout)
 		return -EINVAL;
-	}
-
-	rvring->len = vring->num;
-	rvring->align = vring->align;
-	rvring->rvdev = rvdev;
-
-	return 0;
-}
 
-static int rproc_max_notifyid(int id, void *p, void *data)
-{
-	int *maxid = data;
-	*maxid = max(*maxid, id);
+	*da = carveout->da + (dma - carveout->dma);
 	return 0;
 }
+EXPORT_SYMBOL(rproc_dma_to_da);
 
-void rproc_free_vring(struct rproc_vring *rvring)
+/**
+ * rproc_da_is_fresh() - is a device address range still zeroed out ?
+ * @rproc: handle of a remote processor
+ * @da: remoteproc device address
+ * @len: length of the memory region @da is pointing to
+ *
+ * Carveouts are zeroed out by dma_alloc_coherent(), so as long as the
+ * remote processor wasn't booted with them, only the firmware segments
+ * were written to them: a segment's zero-initialized tail (i.e. its bss)
+ * doesn't have to be cleared again, which saves a memset() of potentially
+ * megabytes of uncached memory on every boot.
+ *
+ * Returns true if [@da, @da + @len) is within such a fresh carveout.
+ */
+bool rproc_da_is_fresh(struct rproc *rproc, u64 da, int len)
 {
-	int size = PAGE_ALIGN(vring_size(rvring->len, rvring->align));
-	struct rproc *rproc = rvring->rvdev->rproc;
-	int maxid = 0;
+	struct rproc_mem_entry *carveout;
 
-	dma_free_coherent(rproc->dev.parent, size, rvring->va, rvring->dma);
-	idr_remove(&rproc->notifyids, rvring->notifyid);
+	carveout = rproc_find_carveout(rproc, RPROC_KEY_DA, da, len);
 
-	/* Find the largest remaining notifyid */
-	idr_for_each(&rproc->notifyids, rproc_max_notifyid, &maxid);
-	rproc->max_notifyid = maxid;
+	return carveout && carveout->fresh;
 }
 
 /**
- * rproc_handle_vdev() - handle a vdev fw resource
- * @rproc: the remote processor
- * @rsc: the vring resource descriptor
- * @avail: size of available data (for sanity checking the image)
+ * struct rproc_shared_carveout - a read-only carveout, shared by the remote
+ * processors which are booted with the same firmware image
+ * @node: list node, in rproc_shared_carveouts
+ * @users: the carveouts of remote processors which share it
+ * @firmware: name of the firmware image
+ * @crc: crc32 of the firmware image
+ * @mem: the memory of the carveout
+ * @loaded: the firmware segments were loaded into @mem already
  *
- * This resource entry requests the host to statically register a virtio
- * device (vdev), and setup everything needed to support it. It contains
- * everything needed to make it possible: the virtio device id, virtio
- * device features, vrings information, virtio config space, etc...
+ * All of it is protected by rproc_shared_lock.
+ */
+struct rproc_shared_carveout {
+	struct list_head node;
+	int users;
+	char *firmware;
+	u32 crc;
+	struct rproc_mem_entry mem;
+	bool loaded;
+};
+
+/* the carveouts shared by remote processors (see FW_CARVEOUT_SHARED) */
+static LIST_HEAD(rproc_shared_carveouts);
+static DEFINE_MUTEX(rproc_shared_lock);
+
+/**
+ * rproc_da_is_shared() - is a device address range in a shared carveout ?
+ * @rproc: handle of a remote processor
+ * @da: remoteproc device address
+ * @len: length of the memory region @da is pointing to
+ * @loaded: where to tell whether the firmware segments were loaded there
+ *	    already (e.g. by another remote processor)
  *
- * Before registering the vdev, the vrings are allocated from non-cacheable
- * physically contiguous memory. Currently we only support two vrings per
- * remote processor (temporary limitation). We might also want to consider
- * doing the vring allocation only later when ->find_vqs() is invoked, and
- * then release them upon ->del_vqs().
+ * The segments placed in a shared carveout (see FW_CARVEOUT_SHARED) only
+ * have to be loaded by the first remote processor booted with it, and must
+ * be read-only.
  *
- * Note: @da is currently not really handled correctly: we dynamically
- * allocate it using the DMA API, ignoring requested hard coded addresses,
- * and we don't take care of any required IOMMU programming. This is all
- * going to be taken care of when the generic iommu-based DMA API will be
- * merged. Meanwhile, statically-addressed iommu-based firmware images should
- * use RSC_DEVMEM resource entries to map their required @da to the physical
- * address of their base CMA region (ouch, hacky!).
+ * This is meant to be called by the firmware loaders, as they load the
+ * segments.
  *
- * Returns 0 on success, or an appropriate error code otherwise
+ * Returns true if [@da, @da + @len) is within a shared carveout.
  */
-static int rproc_handle_vdev(struct rproc *rproc, struct fw_rsc_vdev *rsc,
-								int avail)
+bool rproc_da_is_shared(struct rproc *rproc, u64 da, int len, bool *loaded)
 {
-	struct device *dev = &rproc->dev;
-	struct rproc_vdev *rvdev;
-	int i, ret;
-
-	/* make sure resource isn't truncated */
-	if (sizeof(*rsc) + rsc->num_of_vrings * sizeof(struct fw_rsc_vdev_vring)
-			+ rsc->config_len > avail) {
-		dev_err(dev, "vdev rsc is truncated\n");
-		return -EINVAL;
-	}
-
-	/* make sure reserved bytes are zeroes */
-	if (rsc->reserved[0] || rsc->reserved[1]) {
-		dev_err(dev, "vdev rsc has non zero reserved bytes\n");
-		return -EINVAL;
-	}
-
-	dev_dbg(dev, "vdev rsc: id %d, dfeatures %x, cfg len %d, %d vrings\n",
-		rsc->id, rsc->dfeatures, rsc->config_len, rsc->num_of_vrings);
+	struct rproc_mem_entry *carveout;
 
-	/* we currently support only two vrings per rvdev */
-	if (rsc->num_of_vrings > ARRAY_SIZE(rvdev->vring)) {
-		dev_err(dev, "too many vrings: %d\n", rsc->num_of_vrings);
-		return -EINVAL;
-	}
+	carveout = rproc_find_carveout(rproc, RPROC_KEY_DA, da, len);
+	if (!carveout || !carveout->shared)
+		return false;
 
-	rvdev = kzalloc(sizeof(struct rproc_vdev), GFP_KERNEL);
-	if (!rvdev)
-		return -ENOMEM;
+	mutex_lock(&rproc_shared_lock);
+	*loaded = carveout->shared->loaded;
+	mutex_unlock(&rproc_shared_lock);
 
-	rvdev->rproc = rproc;
+	return true;
+}
 
-	/* parse the vrings */
-	for (i = 0; i < rsc->num_of_vrings; i++) {
-		ret = rproc_parse_vring(rvdev, rsc, i);
-		if (ret)
-			goto free_rvdev;
-	}
+/* the firmware segments of @rproc were loaded into its shared carveouts */
+static void rproc_shared_carveouts_loaded(struct rproc *rproc)
+{
+	struct rproc_mem_entry *carveout;
 
-	/* remember the device features */
-	rvdev->dfeatures = rsc->dfeatures;
+	mutex_lock(&rproc_shared_lock);
+	list_for_each_entry(carveout, &rproc->carveouts, node)
+		if (carveout->shared)
+			carveout->shared->loaded = true;
+	mutex_unlock(&rproc_shared_lock);
+}
 
-	list_add_tail(&rvdev->node, &rproc->rvdevs);
+/*
+ * unmap the pages of @hole which were faulted in, so they fault again. Each
+ * run of adjacent pages is unmapped at once, so the iommu driver can flush
+ * its iotlb once per run, rather than once per page.
+ */
+static void rproc_rearm_hole(struct rproc *rproc, struct rproc_hole *hole)
+{
+	int pages = hole->len >> PAGE_SHIFT;
+	int page, end;
 
-	/* it is now safe to add the virtio device */
-	ret = rproc_add_virtio_dev(rvdev, rsc->id);
-	if (ret)
-		goto free_rvdev;
+	for (page = find_first_bit(hole->faulted, pages); page < pages;
+			page = find_next_bit(hole->faulted, pages, end)) {
+		end = find_next_zero_bit(hole->faulted, pages, page);
 
-	return 0;
+		iommu_unmap(rproc->domain, hole->da + (page << PAGE_SHIFT),
+						(end - page) << PAGE_SHIFT);
+		bitmap_clear(hole->faulted, page, end - page);
+	}
 
-free_rvdev:
-	kfree(rvdev);
-	return ret;
+	hole->dirty = true;
 }
 
 /**
- * rproc_handle_trace() - handle a shared trace buffer resource
- * @rproc: the remote processor
- * @rsc: the trace resource descriptor
- * @avail: size of available data (for sanity checking the image)
+ * rproc_da_zero_lazily() - zero out a device address range on demand
+ * @rproc: handle of a remote processor
+ * @da: remoteproc device address
+ * @len: length of the memory region @da is pointing to
  *
- * In case the remote processor dumps trace logs into memory,
- * export it via debugfs.
+ * With rproc->sparse_load, the zero-initialized tails of the firmware
+ * segments (i.e. their bss) are neither cleared nor mapped onto the iommu
+ * when the remote processor is booted: the whole pages of such a range
+ * are left out of their carveout's mapping (see rproc_map_carveouts()),
+ * and are only zeroed out and mapped once the remote processor accesses
+ * them (see rproc_fault_in()). Big heaps thus cost nothing on boot until
+ * they're actually used. The partial pages at both ends of the range are
+ * zeroed out right away, if needed.
  *
- * Currently, the 'da' member of @rsc should contain the device address
- * where the remote processor is dumping the traces. Later we could also
- * support dynamically allocating this address using the generic
- * DMA API (but currently there isn't a use case for that).
+ * This is meant to be called by the firmware loaders, as they load the
+ * segments.
  *
- * Returns 0 on success, or an appropriate error code otherwise
+ * Returns true if the range is taken care of, or false if the caller should
+ * zero it out (unless it's still fresh, see rproc_da_is_fresh()).
  */
-static int rproc_handle_trace(struct rproc *rproc, struct fw_rsc_trace *rsc,
-								int avail)
+bool rproc_da_zero_lazily(struct rproc *rproc, u64 da, int len)
 {
-	struct rproc_mem_entry *trace;
-	struct device *dev = &rproc->dev;
-	void *ptr;
-	char name[15];
+	struct rproc_mem_entry *carveout;
+	struct rproc_hole *hole;
+	u64 start = PAGE_ALIGN(da);
+	u64 end = (da + len) & PAGE_MASK;
+	int offset, pages;
 
-	if (sizeof(*rsc) > avail) {
-		dev_err(dev, "trace rsc is truncated\n");
-		return -EINVAL;
-	}
+	if (!rproc->sparse_load || !rproc->domain || start >= end)
+		return false;
 
-	/* make sure reserved bytes are zeroes */
-	if (rsc->reserved) {
-		dev_err(dev, "trace rsc has non zero reserved bytes\n");
-		return -EINVAL;
-	}
+	list_for_each_entry(carveout, &rproc->carveouts, node) {
+		offset = da - carveout->da;
 
-	/* what's the kernel address of this resource ? */
-	ptr = rproc_da_to_va(rproc, rsc->da, rsc->len);
-	if (!ptr) {
-		dev_err(dev, "erroneous trace resource entry\n");
-		return -EINVAL;
+		if (offset >= 0 && offset + len <= carveout->len)
+			goto found;
 	}
 
-	trace = kzalloc(sizeof(*trace), GFP_KERNEL);
-	if (!trace) {
-		dev_err(dev, "kzalloc trace failed\n");
-		return -ENOMEM;
-	}
+	return false;
 
-	/* set the trace buffer dma properties */
-	trace->len = rsc->len;
-	trace->va = ptr;
+found:
+	/* pages of the hole must map to pages of the carveout */
+	if ((carveout->da ^ carveout->dma) & ~PAGE_MASK)
+		return false;
 
-	/* make sure snprintf always null terminates, even if truncating */
-	snprintf(name, sizeof(name), "trace%d", rproc->num_traces);
+	/* the carveout is resident: just re-arm the hole it already has */
+	list_for_each_entry(hole, &rproc->holes, node) {
+		if (hole->da == start && hole->len == end - start) {
+			rproc_rearm_hole(rproc, hole);
+			goto zero_ends;
+		}
+	}
 
-	/* create the debugfs entry */
-	trace->priv = rproc_create_trace_file(name, rproc, trace);
-	if (!trace->priv) {
-		trace->va = NULL;
-		kfree(trace);
-		return -EINVAL;
+	/* too late, the carveout is mapped in its entirety by now */
+	if (!carveout->deferred)
+		return false;
+
+	pages = (end - start) >> PAGE_SHIFT;
+	hole = kzalloc(sizeof(*hole) + BITS_TO_LONGS(pages) * sizeof(long),
+								GFP_KERNEL);
+	if (!hole)
+		return false;
+
+	offset = start - carveout->da;
+	hole->da = start;
+	hole->dma = carveout->dma + offset;
+	hole->va = carveout->va + offset;
+	hole->len = end - start;
+	hole->flags = carveout->flags;
+	hole->dirty = !carveout->fresh;
+
+	list_add_tail(&hole->node, &rproc->holes);
+
+zero_ends:
+	if (hole->dirty) {
+		memset(hole->va - (start - da), 0, start - da);
+		memset(hole->va + hole->len, 0, da + len - end);
 	}
 
-	list_add_tail(&trace->node, &rproc->traces);
+	return true;
+}
 
-	rproc->num_traces++;
+/* map @len bytes of @carveout at @da onto the iommu */
+static int rproc_map_carveout(struct rproc *rproc,
+			struct rproc_mem_entry *carveout, u32 da, int len)
+{
+	struct rproc_mem_entry *mapping;
+	int ret;
 
-	dev_dbg(dev, "%s added: va %p, da 0x%x, len 0x%x\n", name, ptr,
-						rsc->da, rsc->len);
+	mapping = kzalloc(sizeof(*mapping), GFP_KERNEL);
+	if (!mapping)
+		return -ENOMEM;
+
+	ret = iommu_map(rproc->domain, da, carveout->dma + da - carveout->da,
+							len, carveout->flags);
+	if (ret) {
+		kfree(mapping);
+		return ret;
+	}
+
+	mapping->da = da;
+	mapping->dma = carveout->dma + da - carveout->da;
+	mapping->len = len;
+	list_add_tail(&mapping->node, &rproc->mappings);
 
 	return 0;
 }
 
-/**
- * rproc_handle_devmem() - handle devmem resource entry
- * @rproc: remote processor handle
- * @rsc: the devmem resource entry
- * @avail: size of available data (for sanity checking the image)
- *
- * Remote processors commonly need to access certain on-chip peripherals.
- *
- * Some of these remote processors access memory via an iommu device,
- * and might require us to configure their iommu before they can access
- * the on-chip peripherals they need.
- *
- * This resource entry is a request to map such a peripheral device.
- *
- * These devmem entries will contain the physical address of the device in
- * the 'pa' member. If a specific device address is expected, then 'da' will
- * contain it (currently this is the only use case supported). 'len' will
- * contain the size of the physical region we need to map.
- *
- * Currently we just "trust" those devmem entries to contain valid physical
- * addresses, but this is going to change: we want the implementations to
- * tell us ranges of physical addresses the firmware is allowed to request,
- * and not allow firmwares to request access to physical addresses that
- * are outside those ranges.
+/*
+ * map the carveouts whose iommu mapping was deferred until the firmware
+ * segments were loaded (see rproc->sparse_load), leaving out the holes that
+ * are faulted in on demand.
  */
-static int rproc_handle_devmem(struct rproc *rproc, struct fw_rsc_devmem *rsc,
-								int avail)
+static int rproc_map_carveouts(struct rproc *rproc)
 {
-	struct rproc_mem_entry *mapping;
+	struct rproc_mem_entry *carveout;
+	struct rproc_hole *hole, *next;
 	struct device *dev = &rproc->dev;
+	u32 da, end;
 	int ret;
 
-	/* no point in handling this resource without a valid iommu domain */
-	if (!rproc->domain)
-		return -EINVAL;
+	list_for_each_entry(carveout, &rproc->carveouts, node) {
+		if (!carveout->deferred)
+			continue;
 
-	if (sizeof(*rsc) > avail) {
-		dev_err(dev, "devmem rsc is truncated\n");
-		return -EINVAL;
-	}
+		da = carveout->da;
+		end = da + carveout->len;
+
+		/* map everything in between the holes, in ascending order */
+		while (da < end) {
+			next = NULL;
+			list_for_each_entry(hole, &rproc->holes, node) {
+				if (hole->da >= da && hole->da < end &&
+						(!next || hole->da < next->da))
+					next = hole;
+			}
+
+			if (!next || next->da > da) {
+				ret = rproc_map_carveout(rproc, carveout, da,
+						(next ? next->da : end) - da);
+				if (ret) {
+					dev_err(dev, "iommu_map failed: %d\n",
+									ret);
+					return ret;
+				}
+			}
+
+			da = next ? next->da + next->len : end;
+		}
 
-	/* make sure reserved bytes are zeroes */
-	if (rsc->reserved) {
-		dev_err(dev, "devmem rsc has non zero reserved bytes\n");
-		return -EINVAL;
+		carveout->deferred = false;
+
+		dev_dbg(dev, "carveout mapped 0x%x to 0x%llx\n", carveout->da,
+					(unsigned long long)carveout->dma);
 	}
 
-	mapping = kzalloc(sizeof(*mapping), GFP_KERNEL);
-	if (!mapping) {
-		dev_err(dev, "kzalloc mapping failed\n");
-		return -ENOMEM;
+	return 0;
+}
+
+/*
+ * make @rvring the one the vring notifications with its notifyid look up.
+ * The map only ever grows, and notifyids are handed out densely, so it stays
+ * about as big as the number of vrings.
+ */
+static int rproc_map_vring(struct rproc *rproc, struct rproc_vring *rvring)
+{
+	struct rproc_vring_map *old = rproc->vring_map, *map;
+	int id = rvring->notifyid, size;
+
+	if (old && id < old->size) {
+		rcu_assign_pointer(old->vrings[id], rvring);
+		return 0;
 	}
 
-	ret = iommu_map(rproc->domain, rsc->da, rsc->pa, rsc->len, rsc->flags);
-	if (ret) {
-		dev_err(dev, "failed to map devmem: %d\n", ret);
-		goto out;
+	size = roundup_pow_of_two(id + 1);
+	map = kzalloc(sizeof(*map) + size * sizeof(map->vrings[0]), GFP_KERNEL);
+	if (!map) {
+		dev_err(&rproc->dev, "kzalloc vring map failed\n");
+		return -ENOMEM;
 	}
 
-	/*
-	 * We'll need this info later when we'll want to unmap everything
-	 * (e.g. on shutdown).
-	 *
-	 * We can't trust the remote processor not to change the resource
-	 * table, so we must maintain this info independently.
-	 */
-	mapping->da = rsc->da;
-	mapping->len = rsc->len;
-	list_add_tail(&mapping->node, &rproc->mappings);
+	map->size = size;
+	if (old)
+		memcpy(map->vrings, old->vrings,
+					old->size * sizeof(old->vrings[0]));
+	map->vrings[id] = rvring;
 
-	dev_dbg(dev, "mapped devmem pa 0x%x, da 0x%x, len 0x%x\n",
-					rsc->pa, rsc->da, rsc->len);
+	rcu_assign_pointer(rproc->vring_map, map);
+	if (old)
+		kfree_rcu(old, rcu);
 
 	return 0;
-
-out:
-	kfree(mapping);
-	return ret;
 }
 
-/**
- * rproc_handle_carveout() - handle phys contig memory allocation requests
- * @rproc: rproc handle
- * @rsc: the resource entry
- * @avail: size of available data (for image validation)
- *
- * This function will handle firmware requests for allocation of physically
- * contiguous memory regions.
- *
- * These request entries should come first in the firmware's resource table,
- * as other firmware entries might request placing other data objects inside
- * these memory regions (e.g. data/code segments, trace resource entries, ...).
- *
- * Allocating memory this way helps utilizing the reserved physical memory
- * (e.g. CMA) more efficiently, and also minimizes the number of TLB entries
- * needed to map it (in case @rproc is using an IOMMU). Reducing the TLB
- * pressure is important; it may have a substantial impact on performance.
- */
-static int rproc_handle_carveout(struct rproc *rproc,
-				struct fw_rsc_carveout *rsc, int avail)
+/* grab the notifyid the firmware asked for @rvring, unless it's taken */
+static int rproc_claim_notifyid(struct rproc *rproc, struct rproc_vring *rvring,
+								int *notifyid)
 {
-	struct rproc_mem_entry *carveout, *mapping;
-	struct device *dev = &rproc->dev;
-	dma_addr_t dma;
-	void *va;
 	int ret;
 
-	if (sizeof(*rsc) > avail) {
-		dev_err(dev, "carveout rsc is truncated\n");
+	if (rvring->notifyid < 0)
 		return -EINVAL;
-	}
 
-	/* make sure reserved bytes are zeroes */
-	if (rsc->reserved) {
-		dev_err(dev, "carveout rsc has non zero reserved bytes\n");
-		return -EINVAL;
+	ret = idr_get_new_above(&rproc->notifyids, rvring, rvring->notifyid,
+								notifyid);
+	if (!ret && *notifyid != rvring->notifyid) {
+		idr_remove(&rproc->notifyids, *notifyid);
+		ret = -EBUSY;
 	}
 
-	dev_dbg(dev, "carveout rsc: da %x, pa %x, len %x, flags %x\n",
-			rsc->da, rsc->pa, rsc->len, rsc->flags);
+	return ret;
+}
 
-	carveout = kzalloc(sizeof(*carveout), GFP_KERNEL);
-	if (!carveout) {
-		dev_err(dev, "kzalloc carveout failed\n");
+/*
+ * take over a @size bytes vring that a detached remote processor uses
+ * already. Without an iommu set up by us, its device address is its
+ * physical address.
+ */
+static int rproc_adopt_vring(struct rproc *rproc, struct rproc_vring *rvring,
+								int size)
+{
+	struct device *dev = &rproc->dev;
+	void __iomem *va;
+	int ret, notifyid;
+
+	va = ioremap_nocache(rvring->da, size);
+	if (!va) {
+		dev_err(dev, "can't map vring da 0x%x\n", rvring->da);
 		return -ENOMEM;
 	}
 
-	va = dma_alloc_coherent(dev->parent, rsc->len, &dma, GFP_KERNEL);
-	if (!va) {
-		dev_err(dev->parent, "dma_alloc_coherent err: %d\n", rsc->len);
-		ret = -ENOMEM;
-		goto free_carv;
+	ret = rproc_claim_notifyid(rproc, rvring, &notifyid);
+	if (ret) {
+		dev_err(dev, "can't adopt notifyid %d: %d\n", rvring->notifyid,
+									ret);
+		goto unmap;
 	}
 
-	dev_dbg(dev, "carveout va %p, dma %llx, len 0x%x\n", va,
-					(unsigned long long)dma, rsc->len);
+	ret = rproc_map_vring(rproc, rvring);
+	if (ret) {
+		idr_remove(&rproc->notifyids, notifyid);
+		goto unmap;
+	}
 
-	/*
-	 * Ok, this is non-standard.
-	 *
-	 * Sometimes we can't rely on the generic iommu-based DMA API
-	 * to dynamically allocate the device address and then set the IOMMU
-	 * tables accordingly, because some remote processors might
-	 * _require_ us to use hard coded device addresses that their
-	 * firmware was compiled with.
-	 *
-	 * In this case, we must use the IOMMU API directly and map
-	 * the memory to the device address as expected by the remote
-	 * processor.
-	 *
-	 * Obviously such remote processor devices should not be configured
-	 * to use the iommu-based DMA API: we expect 'dma' to contain the
-	 * physical address in this case.
-	 */
-	if (rproc->domain) {
-		mapping = kzalloc(sizeof(*mapping), GFP_KERNEL);
-		if (!mapping) {
-			dev_err(dev, "kzalloc mapping failed\n");
-			ret = -ENOMEM;
-			goto dma_free;
-		}
+	rproc->max_notifyid = max(rproc->max_notifyid, notifyid);
 
-		ret = iommu_map(rproc->domain, rsc->da, dma, rsc->len,
-								rsc->flags);
-		if (ret) {
-			dev_err(dev, "iommu_map failed: %d\n", ret);
-			goto free_mapping;
-		}
+	dev_dbg(dev, "adopted vring: da 0x%x size %x idr %d\n", rvring->da,
+							size, notifyid);
 
-		/*
-		 * We'll need this info later when we'll want to unmap
-		 * everything (e.g. on shutdown).
-		 *
-		 * We can't trust the remote processor not to change the
-		 * resource table, so we must maintain this info independently.
-		 */
-		mapping->da = rsc->da;
-		mapping->len = rsc->len;
-		list_add_tail(&mapping->node, &rproc->mappings);
+	rvring->va = (void __force *)va;
+	rvring->dma = rvring->da;
+	rvring->adopted = true;
 
-		dev_dbg(dev, "carveout mapped 0x%x to 0x%llx\n",
-					rsc->da, (unsigned long long)dma);
+	return 0;
+
+unmap:
+	iounmap(va);
+	return ret;
+}
+
+/*
+ * carve @size bytes out of the IPC region of @rvdev (see fw_rsc_ipcmem).
+ * Returns NULL if @rvdev has no such region, or if it's full.
+ */
+void *rproc_ipc_alloc(struct rproc_vdev *rvdev, size_t size, dma_addr_t *dma)
+{
+	unsigned long va;
+
+	if (!rvdev->ipc_pool)
+		return NULL;
+
+	va = gen_pool_alloc(rvdev->ipc_pool, size);
+	if (!va)
+		return NULL;
+
+	*dma = gen_pool_virt_to_phys(rvdev->ipc_pool, va);
+	memset((void *)va, 0, size);
+
+	return (void *)va;
+}
+
+/* give back what rproc_ipc_alloc() carved out */
+void rproc_ipc_free(struct rproc_vdev *rvdev, void *va, size_t size)
+{
+	gen_pool_free(rvdev->ipc_pool, (unsigned long)va, size);
+}
+
+/*
+ * allocate the IPC region the firmware asked for with @rsc: one physically
+ * contiguous chunk, aligned to its own (power of two) size, so the remote
+ * processor can map all of it at once
+ */
+static int rproc_alloc_ipc(struct rproc_vdev *rvdev, struct fw_rsc_ipcmem *rsc)
+{
+	struct rproc *rproc = rvdev->rproc;
+	struct device *dev = &rproc->dev;
+	struct gen_pool *pool;
+	dma_addr_t dma;
+	size_t len;
+	void *va;
+	int ret;
+
+	if (rsc->reserved) {
+		dev_err(dev, "ipcmem rsc has non zero reserved bytes\n");
+		return -EINVAL;
 	}
 
-	/*
-	 * Some remote processors might need to know the pa
-	 * even though they are behind an IOMMU. E.g., OMAP4's
-	 * remote M3 processor needs this so it can control
-	 * on-chip hardware accelerators that are not behind
-	 * the IOMMU, and therefor must know the pa.
-	 *
-	 * Generally we don't want to expose physical addresses
-	 * if we don't have to (remote processors are generally
-	 * _not_ trusted), so we might want to do this only for
-	 * remote processor that _must_ have this (e.g. OMAP4's
-	 * dual M3 subsystem).
-	 *
-	 * Non-IOMMU processors might also want to have this info.
-	 * In this case, the device address and the physical address
-	 * are the same.
-	 */
-	rsc->pa = dma;
+	if (!rsc->len || rsc->len > INT_MAX) {
+		dev_err(dev, "unsupported ipcmem len 0x%x\n", rsc->len);
+		return -EINVAL;
+	}
 
-	carveout->va = va;
-	carveout->len = rsc->len;
-	carveout->dma = dma;
-	carveout->da = rsc->da;
+	len = roundup_pow_of_two(PAGE_ALIGN(rsc->len));
 
-	list_add_tail(&carveout->node, &rproc->carveouts);
+	pool = gen_pool_create(PAGE_SHIFT, -1);
+	if (!pool)
+		return -ENOMEM;
+
+	va = dma_alloc_coherent(dev->parent, len, &dma, GFP_KERNEL);
+	if (!va) {
+		dev_err(dev->parent, "can't get 0x%zx bytes for ipcmem\n", len);
+		ret = -ENOMEM;
+		goto destroy_pool;
+	}
+
+	ret = gen_pool_add_virt(pool, (unsigned long)va, dma, len, -1);
+	if (ret) {
+		dev_err(dev, "gen_pool_add_virt failed: %d\n", ret);
+		goto free_region;
+	}
+
+	dev_dbg(dev, "ipcmem of vdev %d: va %p dma %llx len 0x%zx\n",
+			rvdev->notifyid, va, (unsigned long long)dma, len);
+
+	rvdev->ipc_va = va;
+	rvdev->ipc_dma = dma;
+	rvdev->ipc_len = len;
+	rvdev->ipc_pool = pool;
 
 	return 0;
 
-free_mapping:
-	kfree(mapping);
-dma_free:
-	dma_free_coherent(dev->parent, rsc->len, va, dma);
-free_carv:
-	kfree(carveout);
+free_region:
+	dma_free_coherent(dev->parent, len, va, dma);
+destroy_pool:
+	gen_pool_destroy(pool);
 	return ret;
 }
 
 /*
- * A lookup table for resource handlers. The indices are defined in
- * enum fw_resource_type.
+ * free the IPC region of @rvdev, if it has one: everything that was carved
+ * out of it must have been given back already
  */
-static rproc_handle_resource_t rproc_handle_rsc[] = {
-	[RSC_CARVEOUT] = (rproc_handle_resource_t)rproc_handle_carveout,
-	[RSC_DEVMEM] = (rproc_handle_resource_t)rproc_handle_devmem,
-	[RSC_TRACE] = (rproc_handle_resource_t)rproc_handle_trace,
-	[RSC_VDEV] = NULL, /* VDEVs were handled upon registrarion */
-};
+void rproc_free_ipc(struct rproc_vdev *rvdev)
+{
+	struct rproc *rproc = rvdev->rproc;
+
+	if (!rvdev->ipc_pool)
+		return;
+
+	gen_pool_destroy(rvdev->ipc_pool);
+	dma_free_coherent(rproc->dev.parent, rvdev->ipc_len, rvdev->ipc_va,
+							rvdev->ipc_dma);
+	rvdev->ipc_pool = NULL;
+	rvdev->ipc_va = NULL;
+}
+
+/* find the RSC_IPCMEM entry of the vdev whose notify index is @notifyid */
+static struct fw_rsc_ipcmem *rproc_find_ipcmem(struct resource_table *table,
+				struct rproc_rsc_index *index, u32 notifyid)
+{
+	struct rproc_rsc_entry *ent;
+	struct fw_rsc_ipcmem *rsc;
+
+	rproc_for_each_rsc(index, ent, RSC_IPCMEM) {
+		rsc = rproc_rsc_data(table, ent);
+
+		if (ent->avail >= (int)sizeof(*rsc) &&
+						rsc->notifyid == notifyid)
+			return rsc;
+	}
+
+	return NULL;
+}
+
+int rproc_alloc_vring(struct rproc_vdev *rvdev, int i)
+{
+	struct rproc *rproc = rvdev->rproc;
+	struct device *dev = &rproc->dev;
+	struct rproc_vring *rvring = &rvdev->vring[i];
+	dma_addr_t dma;
+	void *va;
+	int ret, size, notifyid;
+
+	/* actual size of vring (in bytes) */
+	size = PAGE_ALIGN(vring_size(rvring->len, rvring->align));
+
+	if (!idr_pre_get(&rproc->notifyids, GFP_KERNEL)) {
+		dev_err(dev, "idr_pre_get failed\n");
+		return -ENOMEM;
+	}
+
+	/*
+	 * a detached remote processor uses its vrings already: keep them
+	 * where they are, along with their notifyids
+	 */
+	if (rproc->state == RPROC_DETACHED)
+		return rproc_adopt_vring(rproc, rvring, size);
+
+	/*
+	 * Map the vring where the firmware placed it (see
+	 * rproc_locate_vring()), or allocate non-cacheable memory for it,
+	 * out of the IPC region of its vdev if it has one (see
+	 * fw_rsc_ipcmem). In the future this will also configure the IOMMU.
+	 * The remote processor is told about dynamically allocated ones before
+	 * it's booted (see rproc_publish_vdevs()).
+	 */
+	rvring->ipc = false;
+	if (rvring->fixed) {
+		va = (void __force *)ioremap_nocache(rvring->pa, size);
+		dma = rvring->pa;
+	} else {
+		va = rproc_ipc_alloc(rvdev, size, &dma);
+		rvring->ipc = !!va;
+		if (!va)
+			va = dma_alloc_coherent(dev->parent, size, &dma,
+								GFP_KERNEL);
+	}
+	if (!va) {
+		dev_err(dev->parent, "can't get %d bytes for vring%d\n", size,
+									i);
+		return -ENOMEM;
+	}
+
+	/*
+	 * Assign an rproc-wide unique index for this vring, unless the
+	 * firmware asked for a specific one
+	 * TODO: assign a notifyid for rvdev updates as well
+	 */
+	if (rvring->notifyid == FW_RSC_NOTIFY_ID_ANY)
+		ret = idr_get_new(&rproc->notifyids, rvring, &notifyid);
+	else
+		ret = rproc_claim_notifyid(rproc, rvring, &notifyid);
+	if (ret) {
+		dev_err(dev, "can't get notifyid %d: %d\n", rvring->notifyid,
+									ret);
+		goto free_vring;
+	}
+
+	rvring->notifyid = notifyid;
+	ret = rproc_map_vring(rproc, rvring);
+	if (ret) {
+		idr_remove(&rproc->notifyids, notifyid);
+		goto free_vring;
+	}
+
+	/* Store largest notifyid */
+	rproc->max_notifyid = max(rproc->max_notifyid, notifyid);
+
+	dev_dbg(dev, "vring%d: va %p dma %llx size %x idr %d\n", i, va,
+				(unsigned long long)dma, size, notifyid);
+
+	rvring->va = va;
+	rvring->dma = dma;
+	rvring->adopted = false;
+
+	/* let a vdev which was added on the fly know where its vring is */
+	if (rvdev->rsc) {
+		rvdev->rsc->vring[i].da = dma;
+		rvdev->rsc->vring[i].notifyid = notifyid;
+	}
+
+	return 0;
+
+free_vring:
+	if (rvring->fixed)
+		iounmap((void __iomem __force *)va);
+	else if (rvring->ipc)
+		rproc_ipc_free(rvdev, va, size);
+	else
+		dma_free_coherent(dev->parent, size, va, dma);
+	return ret;
+}
 
-/* handle firmware resource entries before booting the remote processor */
 static int
-rproc_handle_boot_rsc(struct rproc *rproc, struct resource_table *table, int len)
+rproc_parse_vring(struct rproc_vdev *rvdev, struct fw_rsc_vdev *rsc, int i)
 {
+	struct rproc *rproc = rvdev->rproc;
 	struct device *dev = &rproc->dev;
-	rproc_handle_resource_t handler;
-	int ret = 0, i;
+	struct fw_rsc_vdev_vring *vring = &rsc->vring[i];
+	struct rproc_vring *rvring = &rvdev->vring[i];
 
-	for (i = 0; i < table->num; i++) {
-		int offset = table->offset[i];
-		struct fw_rsc_hdr *hdr = (void *)table + offset;
-		int avail = len - offset - sizeof(*hdr);
-		void *rsc = (void *)hdr + sizeof(*hdr);
+	dev_dbg(dev, "vdev rsc: vring%d: da %x, qsz %d, align %d\n",
+				i, vring->da, vring->num, vring->align);
 
-		/* make sure table isn't truncated */
-		if (avail < 0) {
-			dev_err(dev, "rsc table is truncated\n");
-			return -EINVAL;
+	/* its kicks go to the core that serves its vdev */
+	rvring->core = rsc->core;
+
+	/* make sure reserved bytes are zeroes */
+	if (vring->reserved) {
+		dev_err(dev, "vring rsc has non zero reserved bytes\n");
+		return -EINVAL;
+	}
+
+	/* verify queue size and vring alignment are sane */
+	if (!vring->num || !vring->align) {
+		dev_err(dev, "invalid qsz (%d) or alignment (%d)\n",
+						vring->num, vring->align);
+		return -EINVAL;
+	}
+
+	/* vring indices are 16 bits wide: that's as big as vrings get */
+	if (!is_power_of_2(vring->num) || vring->num > 32768) {
+		dev_err(dev, "unsupported qsz (%d)\n", vring->num);
+		return -EINVAL;
+	}
+
+	rvring->len = vring->num;
+	rvring->align = vring->align;
+	rvring->rvdev = rvdev;
+	/* only used as is by a detached remote processor (see RPROC_DETACHED) */
+	rvring->da = vring->da;
+	rvring->notifyid = vring->notifyid;
+
+	return 0;
+}
+
+static int rproc_max_notifyid(int id, void *p, void *data)
+{
+	int *maxid = data;
+	*maxid = max(*maxid, id);
+	return 0;
+}
+
+void rproc_free_vring(struct rproc_vring *rvring)
+{
+	int size = PAGE_ALIGN(vring_size(rvring->len, rvring->align));
+	struct rproc *rproc = rvring->rvdev->rproc;
+	int maxid = 0;
+
+	if (rvring->adopted || rvring->fixed)
+		iounmap((void __iomem __force *)rvring->va);
+	else if (rvring->ipc)
+		rproc_ipc_free(rvring->rvdev, rvring->va, size);
+	else
+		dma_free_coherent(rproc->dev.parent, size, rvring->va,
+								rvring->dma);
+	idr_remove(&rproc->notifyids, rvring->notifyid);
+	rcu_assign_pointer(rproc->vring_map->vrings[rvring->notifyid], NULL);
+
+	/* Find the largest remaining notifyid */
+	idr_for_each(&rproc->notifyids, rproc_max_notifyid, &maxid);
+	rproc->max_notifyid = maxid;
+}
+
+/* find the physical address an RSC_DEVMEM entry of @table maps @da to */
+static bool rproc_devmem_to_pa(struct resource_table *table,
+				struct rproc_rsc_index *index, u32 da,
+				int size, phys_addr_t *pa)
+{
+	struct fw_rsc_devmem64 *rsc64;
+	struct fw_rsc_devmem *rsc;
+	struct rproc_rsc_entry *ent;
+
+	rproc_for_each_rsc(index, ent, RSC_DEVMEM) {
+		rsc = rproc_rsc_data(table, ent);
+
+		if (ent->avail >= (int)sizeof(*rsc) &&
+				da >= rsc->da && size <= rsc->len &&
+				da - rsc->da <= rsc->len - size) {
+			*pa = rsc->pa + (da - rsc->da);
+			return true;
 		}
+	}
 
-		dev_dbg(dev, "rsc: type %d\n", hdr->type);
+	rproc_for_each_rsc(index, ent, RSC_DEVMEM64) {
+		rsc64 = rproc_rsc_data(table, ent);
 
-		if (hdr->type >= RSC_LAST) {
-			dev_warn(dev, "unsupported resource %d\n", hdr->type);
-			continue;
+		if (ent->avail >= (int)sizeof(*rsc64) &&
+				da >= rsc64->da && size <= rsc64->len &&
+				da - rsc64->da <= rsc64->len - size) {
+			*pa = rsc64->pa + (da - rsc64->da);
+			return true;
 		}
+	}
+
+	return false;
+}
+
+/*
+ * find where the firmware placed a vring it expects at a given device
+ * address: through the RSC_DEVMEM entry of @table which maps it, if the
+ * remote processor is behind an iommu, or at that very physical address
+ * otherwise. Only memory that isn't regular memory (e.g. on-chip SRAM) can
+ * be used this way; the vring is allocated dynamically otherwise.
+ */
+static void rproc_locate_vring(struct rproc *rproc,
+		struct resource_table *table, struct rproc_rsc_index *index,
+		struct rproc_vring *rvring)
+{
+	struct device *dev = &rproc->dev;
+	int size = PAGE_ALIGN(vring_size(rvring->len, rvring->align));
+	bool found = !iommu_present(dev->parent->bus);
+	phys_addr_t pa = rvring->da;
+	u32 da = rvring->da;
+
+	rvring->fixed = false;
+
+	if (da == (u32)FW_RSC_ADDR_ANY)
+		return;
+
+	if (!found)
+		found = rproc_devmem_to_pa(table, index, da, size, &pa);
+
+	if (!found || pfn_valid(PFN_DOWN(pa))) {
+		dev_dbg(dev, "can't place vring at da 0x%x, allocating it\n", da);
+		return;
+	}
+
+	rvring->pa = pa;
+	rvring->fixed = true;
+}
+
+/* free a vdev that never got registered */
+static void rproc_free_vdev(struct rproc_vdev *rvdev)
+{
+	rproc_free_ipc(rvdev);
+	kfree(rvdev->config);
+	kfree(rvdev);
+}
+
+/* register a vdev rproc_handle_vdev() set up, along with the others */
+static void rproc_add_virtio_dev_async(void *data, async_cookie_t cookie)
+{
+	struct rproc_vdev *rvdev = data;
+
+	if (rproc_add_virtio_dev(rvdev, rvdev->vdev.id.device)) {
+		rproc_unlist_vdev(rvdev);
+		rproc_free_vdev(rvdev);
+	}
+}
+
+/**
+ * rproc_handle_vdev() - handle a vdev fw resource
+ * @rproc: the remote processor
+ * @table: the resource table @rsc is in
+ * @index: @table, as it was parsed (see rproc_index_rsc_table())
+ * @rsc: the vring resource descriptor
+ * @avail: size of available data (for sanity checking the image)
+ * @live: @rsc is in the resource table the remote processor uses, rather
+ *	  than in its firmware image, and is kept updated as the vdev is
+ *	  set up (see rproc_report_rsc_update())
+ * @domain: if not NULL, the vdev is registered asynchronously, in @domain,
+ *	    along with the other vdevs of @rproc
+ *
+ * This resource entry requests the host to statically register a virtio
+ * device (vdev), and setup everything needed to support it. It contains
+ * everything needed to make it possible: the virtio device id, virtio
+ * device features, vrings information, virtio config space, etc...
+ *
+ * Before registering the vdev, the vrings are allocated from non-cacheable
+ * physically contiguous memory. Currently we only support two vrings per
+ * remote processor (temporary limitation). We might also want to consider
+ * doing the vring allocation only later when ->find_vqs() is invoked, and
+ * then release them upon ->del_vqs().
+ *
+ * If the firmware asked for an IPC region for the vdev (see fw_rsc_ipcmem),
+ * it's allocated here too, and the vrings and buffers of the vdev are then
+ * carved out of it.
+ *
+ * Note: @da is currently not fully handled: unless it's outside regular
+ * memory (see rproc_locate_vring()), we dynamically allocate it using the
+ * DMA API, and we don't take care of any required IOMMU programming. This is
+ * all going to be taken care of when the generic iommu-based DMA API will be
+ * merged. Meanwhile, statically-addressed iommu-based firmware images should
+ * use RSC_DEVMEM resource entries to map their required @da to the physical
+ * address of their base CMA region (ouch, hacky!).
+ *
+ * Returns 0 on success, or an appropriate error code otherwise (a vdev
+ * registered in @domain, which fails to, is only told about, and dropped)
+ */
+static int rproc_handle_vdev(struct rproc *rproc, struct resource_table *table,
+		struct rproc_rsc_index *index, struct fw_rsc_vdev *rsc,
+		int avail, bool live, struct async_domain *domain)
+{
+	struct device *dev = &rproc->dev;
+	struct fw_rsc_ipcmem *ipc;
+	struct rproc_vdev *rvdev;
+	int i, ret;
+
+	/* make sure resource isn't truncated */
+	if (sizeof(*rsc) + rsc->num_of_vrings * sizeof(struct fw_rsc_vdev_vring)
+			+ rsc->config_len > avail) {
+		dev_err(dev, "vdev rsc is truncated\n");
+		return -EINVAL;
+	}
+
+	/* make sure reserved bytes are zeroes */
+	if (rsc->reserved) {
+		dev_err(dev, "vdev rsc has non zero reserved bytes\n");
+		return -EINVAL;
+	}
+
+	if (rsc->core >= rproc->num_cores) {
+		dev_err(dev, "vdev rsc is served by core %u, out of %u\n",
+						rsc->core, rproc->num_cores);
+		return -EINVAL;
+	}
+
+	dev_dbg(dev, "vdev rsc: id %d, dfeatures %x, cfg len %d, %d vrings\n",
+		rsc->id, rsc->dfeatures, rsc->config_len, rsc->num_of_vrings);
+
+	rvdev = kzalloc(sizeof(*rvdev) +
+			rsc->num_of_vrings * sizeof(rvdev->vring[0]), GFP_KERNEL);
+	if (!rvdev)
+		return -ENOMEM;
+
+	rvdev->rproc = rproc;
+	rvdev->notifyid = rsc->notifyid;
+	rvdev->core = rsc->core;
+	rvdev->listed = true;
+	if (live)
+		rvdev->rsc = rsc;
+
+	/* parse the vrings */
+	for (i = 0; i < rsc->num_of_vrings; i++) {
+		ret = rproc_parse_vring(rvdev, rsc, i);
+		if (ret)
+			goto free_rvdev;
+
+		/* a detached remote processor's vrings are adopted as is */
+		if (rproc->state != RPROC_DETACHED)
+			rproc_locate_vring(rproc, table, index,
+							&rvdev->vring[i]);
+	}
+	rvdev->num_vrings = rsc->num_of_vrings;
+
+	/* remember the device features */
+	rvdev->dfeatures = rsc->dfeatures;
+
+	/*
+	 * the firmware image goes away after registration, so keep a copy
+	 * of the config space, which immediately follows the vrings
+	 */
+	if (rsc->config_len) {
+		rvdev->config = kmemdup(&rsc->vring[rsc->num_of_vrings],
+						rsc->config_len, GFP_KERNEL);
+		if (!rvdev->config) {
+			ret = -ENOMEM;
+			goto free_rvdev;
+		}
+		rvdev->config_len = rsc->config_len;
+	}
+
+	/* a detached remote processor has its vrings in place already */
+	ipc = rproc_find_ipcmem(table, index, rsc->notifyid);
+	if (ipc && rproc->state != RPROC_DETACHED) {
+		ret = rproc_alloc_ipc(rvdev, ipc);
+		if (ret)
+			goto free_rvdev;
+		if (live)
+			ipc->da = rvdev->ipc_dma;
+	}
+
+	rproc_list_vdev(rvdev);
+
+	/* it is now safe to add the virtio device, along with the others */
+	if (domain) {
+		rvdev->vdev.id.device = rsc->id;
+		async_schedule_domain(rproc_add_virtio_dev_async, rvdev,
+								domain);
+		return 0;
+	}
+
+	ret = rproc_add_virtio_dev(rvdev, rsc->id);
+	if (ret)
+		goto unlist_rvdev;
+
+	return 0;
+
+unlist_rvdev:
+	rproc_unlist_vdev(rvdev);
+free_rvdev:
+	rproc_free_vdev(rvdev);
+	return ret;
+}
+
+/**
+ * rproc_handle_trace() - handle a shared trace buffer resource
+ * @rproc: the remote processor
+ * @rsc: the trace resource descriptor
+ * @avail: size of available data (for sanity checking the image)
+ *
+ * In case the remote processor dumps trace logs into memory,
+ * export it via debugfs.
+ *
+ * Currently, the 'da' member of @rsc should contain the device address
+ * where the remote processor is dumping the traces. Later we could also
+ * support dynamically allocating this address using the generic
+ * DMA API (but currently there isn't a use case for that).
+ *
+ * Returns 0 on success, or an appropriate error code otherwise
+ */
+static int rproc_handle_trace(struct rproc *rproc, struct fw_rsc_trace *rsc,
+								int avail)
+{
+	struct rproc_mem_entry *trace;
+	struct device *dev = &rproc->dev;
+	void *ptr;
+	char name[15];
+
+	if (sizeof(*rsc) > avail) {
+		dev_err(dev, "trace rsc is truncated\n");
+		return -EINVAL;
+	}
+
+	if (rsc->flags & ~(FW_TRACE_RING | FW_TRACE_STAMPED |
+							FW_TRACE_BINARY) ||
+			(rsc->flags & (FW_TRACE_STAMPED | FW_TRACE_BINARY) &&
+			 !(rsc->flags & FW_TRACE_RING)) ||
+			(rsc->flags & FW_TRACE_STAMPED &&
+			 rsc->flags & FW_TRACE_BINARY)) {
+		dev_err(dev, "trace rsc has unsupported flags 0x%x\n",
+								rsc->flags);
+		return -EINVAL;
+	}
+
+	if (rsc->flags & FW_TRACE_RING &&
+			rsc->len <= sizeof(struct fw_trace_ring)) {
+		dev_err(dev, "trace ring is too small: 0x%x\n", rsc->len);
+		return -EINVAL;
+	}
+
+	/* what's the kernel address of this resource ? */
+	ptr = rproc_da_to_va(rproc, rsc->da, rsc->len);
+	if (!ptr) {
+		dev_err(dev, "erroneous trace resource entry\n");
+		return -EINVAL;
+	}
+
+	trace = kzalloc(sizeof(*trace), GFP_KERNEL);
+	if (!trace) {
+		dev_err(dev, "kzalloc trace failed\n");
+		return -ENOMEM;
+	}
+
+	/* set the trace buffer dma properties */
+	trace->len = rsc->len;
+	trace->va = ptr;
+	trace->flags = rsc->flags;
+
+	/* make sure snprintf always null terminates, even if truncating */
+	snprintf(name, sizeof(name), "trace%d", rproc->num_traces);
+
+	/* create the debugfs entry */
+	trace->priv = rproc_create_trace_file(name, rproc, trace);
+	if (!trace->priv) {
+		trace->va = NULL;
+		kfree(trace);
+		return -EINVAL;
+	}
+
+	/* its lines are logged as ftrace events, whenever those are enabled */
+	if (trace->flags & FW_TRACE_STAMPED &&
+			rproc_trace_pull_add(rproc, trace, rproc->num_traces)) {
+		rproc_remove_trace_file(trace->priv);
+		kfree(trace);
+		return -ENOMEM;
+	}
+
+	list_add_tail(&trace->node, &rproc->traces);
+
+	rproc->num_traces++;
+
+	dev_dbg(dev, "%s added: va %p, da 0x%x, len 0x%x\n", name, ptr,
+						rsc->da, rsc->len);
+
+	return 0;
+}
+
+/* map a devmem region, as told by a (possibly widened) devmem entry */
+static int __rproc_handle_devmem(struct rproc *rproc,
+						struct fw_rsc_devmem64 *rsc)
+{
+	struct rproc_mem_entry *mapping;
+	struct device *dev = &rproc->dev;
+	int ret;
+
+	/* whoever booted a detached remote processor mapped this already */
+	if (rproc->state == RPROC_DETACHED)
+		return 0;
+
+	/* no point in handling this resource without a valid iommu domain */
+	if (!rproc->domain)
+		return -EINVAL;
+
+	/* make sure reserved bytes are zeroes */
+	if (rsc->reserved) {
+		dev_err(dev, "devmem rsc has non zero reserved bytes\n");
+		return -EINVAL;
+	}
+
+	mapping = kzalloc(sizeof(*mapping), GFP_KERNEL);
+	if (!mapping) {
+		dev_err(dev, "kzalloc mapping failed\n");
+		return -ENOMEM;
+	}
+
+	ret = iommu_map(rproc->domain, rsc->da, rsc->pa, rsc->len, rsc->flags);
+	if (ret) {
+		dev_err(dev, "failed to map devmem: %d\n", ret);
+		goto out;
+	}
+
+	/*
+	 * We'll need this info later when we'll want to unmap everything
+	 * (e.g. on shutdown).
+	 *
+	 * We can't trust the remote processor not to change the resource
+	 * table, so we must maintain this info independently.
+	 */
+	mapping->da = rsc->da;
+	mapping->dma = rsc->pa;
+	mapping->len = rsc->len;
+	list_add_tail(&mapping->node, &rproc->mappings);
+
+	dev_dbg(dev, "mapped devmem pa 0x%llx, da 0x%llx, len 0x%llx\n",
+					rsc->pa, rsc->da, rsc->len);
+
+	return 0;
+
+out:
+	kfree(mapping);
+	return ret;
+}
+
+/**
+ * rproc_handle_devmem() - handle devmem resource entry
+ * @rproc: remote processor handle
+ * @rsc: the devmem resource entry
+ * @avail: size of available data (for sanity checking the image)
+ *
+ * Remote processors commonly need to access certain on-chip peripherals.
+ *
+ * Some of these remote processors access memory via an iommu device,
+ * and might require us to configure their iommu before they can access
+ * the on-chip peripherals they need.
+ *
+ * This resource entry is a request to map such a peripheral device.
+ *
+ * These devmem entries will contain the physical address of the device in
+ * the 'pa' member. If a specific device address is expected, then 'da' will
+ * contain it (currently this is the only use case supported). 'len' will
+ * contain the size of the physical region we need to map.
+ *
+ * Currently we just "trust" those devmem entries to contain valid physical
+ * addresses, but this is going to change: we want the implementations to
+ * tell us ranges of physical addresses the firmware is allowed to request,
+ * and not allow firmwares to request access to physical addresses that
+ * are outside those ranges.
+ *
+ * Version 1 entries are handled as version 2 ones (see
+ * rproc_handle_devmem64()), whose fields are just wider.
+ */
+static int rproc_handle_devmem(struct rproc *rproc, struct fw_rsc_devmem *rsc,
+								int avail)
+{
+	struct fw_rsc_devmem64 rsc64;
+
+	if (sizeof(*rsc) > avail) {
+		dev_err(&rproc->dev, "devmem rsc is truncated\n");
+		return -EINVAL;
+	}
+
+	rsc64.da = rsc->da;
+	rsc64.pa = rsc->pa;
+	rsc64.len = rsc->len;
+	rsc64.flags = rsc->flags;
+	rsc64.reserved = rsc->reserved;
+
+	return __rproc_handle_devmem(rproc, &rsc64);
+}
+
+/*
+ * do [@da, @da + @len), as told by a 64-bit entry, fit in the device address
+ * space of the remote processor, and in the kernel's idea of a length ?
+ */
+static bool rproc_rsc64_fits(struct rproc *rproc, u64 da, u64 len)
+{
+	if (da > 0xffffffffULL || len > 0x100000000ULL - da ||
+							len > SIZE_MAX) {
+		dev_err(&rproc->dev, "rsc da 0x%llx len 0x%llx out of range\n",
+								da, len);
+		return false;
+	}
+
+	return true;
+}
+
+/**
+ * rproc_handle_devmem64() - handle a 64-bit devmem resource entry
+ * @rproc: remote processor handle
+ * @rsc: the devmem resource entry
+ * @avail: size of available data (for sanity checking the image)
+ *
+ * This is the same as rproc_handle_devmem(), except the physical address
+ * of the region mapped, and its length, are 64 bits wide.
+ */
+static int rproc_handle_devmem64(struct rproc *rproc,
+				struct fw_rsc_devmem64 *rsc, int avail)
+{
+	if (sizeof(*rsc) > avail) {
+		dev_err(&rproc->dev, "devmem rsc is truncated\n");
+		return -EINVAL;
+	}
+
+	if (!rproc_rsc64_fits(rproc, rsc->da, rsc->len))
+		return -EINVAL;
+
+	return __rproc_handle_devmem(rproc, rsc);
+}
+
+/*
+ * the largest iommu page size worth aligning a @len bytes carveout for:
+ * aligning may waste up to a page worth of memory, so only page sizes of
+ * at most an eighth of the carveout are considered.
+ */
+static unsigned long rproc_carveout_align(struct rproc *rproc, size_t len)
+{
+	unsigned long pgsizes, align;
+
+	if (!rproc->domain)
+		return PAGE_SIZE;
+
+	pgsizes = rproc->domain->ops->pgsize_bitmap;
+	while (pgsizes) {
+		align = 1UL << __fls(pgsizes);
+		if (align <= len / 8)
+			return max(align, PAGE_SIZE);
+		pgsizes &= ~align;
+	}
+
+	return PAGE_SIZE;
+}
+
+/*
+ * allocate the memory of @carveout, so that its physical address is aligned
+ * just like its device address is, modulo the largest iommu page size worth
+ * it (see rproc_carveout_align()). Otherwise, iommu_map() has to fall back
+ * to small pages (e.g. 4KB ptes instead of 1MB sections or 16MB
+ * supersections on OMAP), and the remote processor takes that many more
+ * TLB misses.
+ *
+ * When the memory dma_alloc_coherent() hands out isn't aligned that way
+ * already, a padded area is allocated instead, and kept in @carveout->priv
+ * so it can be freed by rproc_free_carveout(). If that fails, the carveout
+ * is just left unaligned.
+ *
+ * The memory comes from @carveout->dev, i.e. from its CMA area, if the
+ * platform declared one for it.
+ */
+static int __rproc_alloc_carveout(struct rproc *rproc,
+					struct rproc_mem_entry *carveout)
+{
+	struct device *dev = carveout->dev;
+	unsigned long align = rproc_carveout_align(rproc, carveout->len);
+	struct rproc_mem_entry *alloc;
+	unsigned long pad;
+
+	carveout->va = dma_alloc_coherent(dev, carveout->len, &carveout->dma,
+								GFP_KERNEL);
+	if (!carveout->va)
+		return -ENOMEM;
+
+	if (align == PAGE_SIZE || carveout->da & ~PAGE_MASK ||
+				!((carveout->dma ^ carveout->da) & (align - 1)))
+		return 0;
+
+	alloc = kzalloc(sizeof(*alloc), GFP_KERNEL);
+	if (!alloc)
+		return 0;
+
+	alloc->len = carveout->len + align - PAGE_SIZE;
+	alloc->va = dma_alloc_coherent(dev, alloc->len, &alloc->dma,
+								GFP_KERNEL);
+	if (!alloc->va) {
+		dev_dbg(dev, "can't align carveout da 0x%x to 0x%lx\n",
+						carveout->da, align);
+		kfree(alloc);
+		return 0;
+	}
+
+	dma_free_coherent(dev, carveout->len, carveout->va, carveout->dma);
+
+	pad = (carveout->da - alloc->dma) & (align - 1);
+	carveout->va = alloc->va + pad;
+	carveout->dma = alloc->dma + pad;
+	carveout->priv = alloc;
+
+	return 0;
+}
+
+/*
+ * allocate the memory of @carveout, from the memory bank its firmware asked
+ * for in the @flags of its resource entry (see FW_CARVEOUT_BANK()), if the
+ * rproc implementation provided a device for it in rproc->banks. Platforms
+ * are expected to have declared a CMA area (see dma_declare_contiguous())
+ * for each of those devices at boot, sized for the carveouts placed in it,
+ * so large carveouts can still be allocated after a long uptime.
+ *
+ * If the bank can't be used, the memory comes from the parent device of
+ * @rproc instead.
+ */
+static int rproc_alloc_carveout(struct rproc *rproc,
+				struct rproc_mem_entry *carveout, u32 flags)
+{
+	struct device *dev = &rproc->dev;
+	int bank = ((flags & FW_CARVEOUT_BANK_MASK) >> FW_CARVEOUT_BANK_SHIFT);
+
+	carveout->dev = rproc->dev.parent;
+
+	if (!bank)
+		return __rproc_alloc_carveout(rproc, carveout);
+
+	if (bank > rproc->num_banks || !rproc->banks[bank - 1]) {
+		dev_warn(dev, "no memory bank %d for carveout da 0x%x\n",
+							bank - 1, carveout->da);
+		return __rproc_alloc_carveout(rproc, carveout);
+	}
+
+	carveout->dev = rproc->banks[bank - 1];
+	if (!__rproc_alloc_carveout(rproc, carveout))
+		return 0;
+
+	dev_warn(dev, "memory bank %d can't fit carveout da 0x%x (len 0x%zx)\n",
+					bank - 1, carveout->da, carveout->len);
+
+	carveout->dev = rproc->dev.parent;
+	return __rproc_alloc_carveout(rproc, carveout);
+}
+
+/*
+ * set @carveout up with the copy of it that is shared by the remote
+ * processors booted with the same firmware image as @rproc, which is
+ * allocated (from the memory bank asked for in @flags) for the first of
+ * them (see FW_CARVEOUT_SHARED)
+ */
+static int rproc_get_shared_carveout(struct rproc *rproc,
+				struct rproc_mem_entry *carveout, u32 flags)
+{
+	struct rproc_shared_carveout *shared;
+	int ret = 0;
+
+	mutex_lock(&rproc_shared_lock);
+
+	list_for_each_entry(shared, &rproc_shared_carveouts, node)
+		if (shared->crc == rproc->fw_crc &&
+				shared->mem.da == carveout->da &&
+				shared->mem.len == carveout->len &&
+				shared->mem.flags == flags &&
+				!strcmp(shared->firmware, rproc->firmware))
+			goto found;
+
+	shared = kzalloc(sizeof(*shared), GFP_KERNEL);
+	if (!shared) {
+		ret = -ENOMEM;
+		goto unlock;
+	}
+
+	shared->firmware = kstrdup(rproc->firmware, GFP_KERNEL);
+	if (!shared->firmware) {
+		ret = -ENOMEM;
+		goto free_shared;
+	}
+
+	shared->mem.da = carveout->da;
+	shared->mem.len = carveout->len;
+	shared->mem.flags = flags;
+	ret = rproc_alloc_carveout(rproc, &shared->mem, flags);
+	if (ret)
+		goto free_name;
+
+	/* the memory may outlive the remote processor it was allocated for */
+	get_device(shared->mem.dev);
+	shared->crc = rproc->fw_crc;
+	list_add_tail(&shared->node, &rproc_shared_carveouts);
+
+found:
+	shared->users++;
+	carveout->va = shared->mem.va;
+	carveout->dma = shared->mem.dma;
+	carveout->dev = shared->mem.dev;
+	carveout->shared = shared;
+	goto unlock;
+
+free_name:
+	kfree(shared->firmware);
+free_shared:
+	kfree(shared);
+unlock:
+	mutex_unlock(&rproc_shared_lock);
+	return ret;
+}
+
+/* stop sharing a carveout, and free it along with its last user */
+static void rproc_put_shared_carveout(struct rproc *rproc,
+					struct rproc_shared_carveout *shared)
+{
+	struct device *dev = shared->mem.dev;
+
+	mutex_lock(&rproc_shared_lock);
+	if (--shared->users) {
+		mutex_unlock(&rproc_shared_lock);
+		return;
+	}
+	list_del(&shared->node);
+	mutex_unlock(&rproc_shared_lock);
+
+	rproc_free_carveout(rproc, &shared->mem);
+	put_device(dev);
+	kfree(shared->firmware);
+	kfree(shared);
+}
+
+/* free what rproc_alloc_carveout() allocated */
+void rproc_free_carveout(struct rproc *rproc, struct rproc_mem_entry *carveout)
+{
+	struct device *dev = carveout->dev ? : rproc->dev.parent;
+	struct rproc_mem_entry *alloc = carveout->priv;
+
+	if (carveout->shared) {
+		rproc_put_shared_carveout(rproc, carveout->shared);
+	} else if (carveout->adopted) {
+		iounmap((void __iomem __force *)carveout->va);
+	} else if (carveout->user) {
+		/* the memory goes once user space unmapped it, too */
+		rproc_put_user_carveout(carveout);
+		kfree(alloc);
+	} else if (alloc) {
+		dma_free_coherent(dev, alloc->len, alloc->va, alloc->dma);
+		kfree(alloc);
+	} else {
+		dma_free_coherent(dev, carveout->len, carveout->va,
+								carveout->dma);
+	}
+}
+
+/*
+ * take over a carveout that whoever booted a detached remote processor set
+ * up already (see RPROC_DETACHED): its memory is at @rsc->pa, and it's
+ * mapped onto the iommu already, if needed.
+ */
+static int rproc_adopt_carveout(struct rproc *rproc,
+						struct fw_rsc_carveout64 *rsc)
+{
+	struct rproc_mem_entry *carveout;
+	struct device *dev = &rproc->dev;
+	void __iomem *va;
+
+	carveout = kzalloc(sizeof(*carveout), GFP_KERNEL);
+	if (!carveout) {
+		dev_err(dev, "kzalloc carveout failed\n");
+		return -ENOMEM;
+	}
+
+	va = ioremap_nocache(rsc->pa, rsc->len);
+	if (!va) {
+		dev_err(dev, "can't map carveout pa 0x%llx\n", rsc->pa);
+		kfree(carveout);
+		return -ENOMEM;
+	}
+
+	carveout->va = (void __force *)va;
+	carveout->dma = rsc->pa;
+	carveout->len = rsc->len;
+	carveout->da = rsc->da;
+	carveout->flags = rsc->flags & ~FW_CARVEOUT_BANK_MASK;
+	carveout->adopted = true;
+
+	list_add_tail(&carveout->node, &rproc->carveouts);
+	rproc_index_carveouts(rproc);
+
+	dev_dbg(dev, "adopted carveout: da 0x%llx pa 0x%llx len 0x%llx\n",
+						rsc->da, rsc->pa, rsc->len);
+
+	return 0;
+}
+
+/* allocate a carveout, as told by a (possibly widened) carveout entry */
+static int __rproc_handle_carveout(struct rproc *rproc,
+					struct fw_rsc_carveout64 *rsc)
+{
+	struct rproc_mem_entry *carveout, *mapping;
+	struct device *dev = &rproc->dev;
+	u32 flags = rsc->flags & ~(FW_CARVEOUT_BANK_MASK | FW_CARVEOUT_SHARED |
+							FW_CARVEOUT_USER);
+	dma_addr_t dma;
+	void *va;
+	int ret;
+
+	/* make sure reserved bytes are zeroes */
+	if (rsc->reserved) {
+		dev_err(dev, "carveout rsc has non zero reserved bytes\n");
+		return -EINVAL;
+	}
+
+	dev_dbg(dev, "carveout rsc: da %llx, pa %llx, len %llx, flags %x\n",
+			rsc->da, rsc->pa, rsc->len, rsc->flags);
+
+	if (rproc->state == RPROC_DETACHED)
+		return rproc_adopt_carveout(rproc, rsc);
+
+	carveout = kzalloc(sizeof(*carveout), GFP_KERNEL);
+	if (!carveout) {
+		dev_err(dev, "kzalloc carveout failed\n");
+		return -ENOMEM;
+	}
+
+	carveout->len = rsc->len;
+	carveout->da = rsc->da;
+
+	/*
+	 * a read-only carveout may be shared with the remote processors
+	 * booted with the same image, as long as the iommu keeps them from
+	 * writing to it
+	 */
+	if (rsc->flags & FW_CARVEOUT_SHARED && rproc->share_carveouts &&
+			rproc->fw_crc && rproc->domain && !rproc->sparse_load) {
+		flags &= ~IOMMU_WRITE;
+		ret = rproc_get_shared_carveout(rproc, carveout, rsc->flags &
+							~FW_CARVEOUT_SHARED);
+	} else {
+		ret = rproc_alloc_carveout(rproc, carveout, rsc->flags);
+	}
+	if (ret) {
+		dev_err(dev->parent, "dma_alloc_coherent err: %llu\n",
+								rsc->len);
+		goto free_carv;
+	}
+
+	if (rsc->flags & FW_CARVEOUT_USER && !carveout->shared) {
+		ret = rproc_user_carveout(rproc, carveout);
+		if (ret)
+			goto dma_free;
+	}
+
+	va = carveout->va;
+	dma = carveout->dma;
+
+	dev_dbg(dev, "carveout va %p, dma %llx, len 0x%llx\n", va,
+					(unsigned long long)dma, rsc->len);
+
+	/*
+	 * Ok, this is non-standard.
+	 *
+	 * Sometimes we can't rely on the generic iommu-based DMA API
+	 * to dynamically allocate the device address and then set the IOMMU
+	 * tables accordingly, because some remote processors might
+	 * _require_ us to use hard coded device addresses that their
+	 * firmware was compiled with.
+	 *
+	 * In this case, we must use the IOMMU API directly and map
+	 * the memory to the device address as expected by the remote
+	 * processor.
+	 *
+	 * Obviously such remote processor devices should not be configured
+	 * to use the iommu-based DMA API: we expect 'dma' to contain the
+	 * physical address in this case.
+	 */
+	if (rproc->domain && !rproc->sparse_load) {
+		mapping = kzalloc(sizeof(*mapping), GFP_KERNEL);
+		if (!mapping) {
+			dev_err(dev, "kzalloc mapping failed\n");
+			ret = -ENOMEM;
+			goto dma_free;
+		}
+
+		ret = iommu_map(rproc->domain, rsc->da, dma, rsc->len, flags);
+		if (ret) {
+			dev_err(dev, "iommu_map failed: %d\n", ret);
+			goto free_mapping;
+		}
+
+		/*
+		 * We'll need this info later when we'll want to unmap
+		 * everything (e.g. on shutdown).
+		 *
+		 * We can't trust the remote processor not to change the
+		 * resource table, so we must maintain this info independently.
+		 */
+		mapping->da = rsc->da;
+		mapping->dma = dma;
+		mapping->len = rsc->len;
+		list_add_tail(&mapping->node, &rproc->mappings);
+
+		dev_dbg(dev, "carveout mapped 0x%llx to 0x%llx\n",
+					rsc->da, (unsigned long long)dma);
+	}
+
+	/*
+	 * Some remote processors might need to know the pa
+	 * even though they are behind an IOMMU. E.g., OMAP4's
+	 * remote M3 processor needs this so it can control
+	 * on-chip hardware accelerators that are not behind
+	 * the IOMMU, and therefor must know the pa.
+	 *
+	 * Generally we don't want to expose physical addresses
+	 * if we don't have to (remote processors are generally
+	 * _not_ trusted), so we might want to do this only for
+	 * remote processor that _must_ have this (e.g. OMAP4's
+	 * dual M3 subsystem).
+	 *
+	 * Non-IOMMU processors might also want to have this info.
+	 * In this case, the device address and the physical address
+	 * are the same.
+	 */
+	rsc->pa = dma;
+
+	/* dma_alloc_coherent() hands out zeroed memory, unless it's shared */
+	carveout->fresh = !carveout->shared;
+	carveout->flags = flags;
+	/* with sparse loading, the holes are punched before mapping */
+	carveout->deferred = rproc->domain && rproc->sparse_load;
+
+	list_add_tail(&carveout->node, &rproc->carveouts);
+	rproc_index_carveouts(rproc);
+
+	return 0;
+
+free_mapping:
+	kfree(mapping);
+dma_free:
+	rproc_free_carveout(rproc, carveout);
+free_carv:
+	kfree(carveout);
+	return ret;
+}
+
+/**
+ * rproc_handle_carveout() - handle phys contig memory allocation requests
+ * @rproc: rproc handle
+ * @rsc: the resource entry
+ * @avail: size of available data (for image validation)
+ *
+ * This function will handle firmware requests for allocation of physically
+ * contiguous memory regions.
+ *
+ * These request entries should come first in the firmware's resource table,
+ * as other firmware entries might request placing other data objects inside
+ * these memory regions (e.g. data/code segments, trace resource entries, ...).
+ *
+ * Allocating memory this way helps utilizing the reserved physical memory
+ * (e.g. CMA) more efficiently, and also minimizes the number of TLB entries
+ * needed to map it (in case @rproc is using an IOMMU). Reducing the TLB
+ * pressure is important; it may have a substantial impact on performance,
+ * which is why carveouts are aligned for the largest iommu pages possible
+ * (see rproc_alloc_carveout()).
+ *
+ * Version 1 entries are handled as version 2 ones (see
+ * rproc_handle_carveout64()), whose fields are just wider.
+ */
+static int rproc_handle_carveout(struct rproc *rproc,
+				struct fw_rsc_carveout *rsc, int avail)
+{
+	struct fw_rsc_carveout64 rsc64;
+	int ret;
+
+	if (sizeof(*rsc) > avail) {
+		dev_err(&rproc->dev, "carveout rsc is truncated\n");
+		return -EINVAL;
+	}
+
+	rsc64.da = rsc->da;
+	rsc64.pa = rsc->pa;
+	rsc64.len = rsc->len;
+	rsc64.flags = rsc->flags;
+	rsc64.reserved = rsc->reserved;
+
+	ret = __rproc_handle_carveout(rproc, &rsc64);
+	if (ret)
+		return ret;
+
+	/* platforms placing carveouts above 4GB need version 2 tables */
+	if (rsc64.pa > 0xffffffffULL)
+		dev_warn(&rproc->dev, "carveout pa 0x%llx doesn't fit v1\n",
+								rsc64.pa);
+	rsc->pa = rsc64.pa;
+
+	return 0;
+}
+
+/**
+ * rproc_handle_carveout64() - handle a 64-bit carveout resource entry
+ * @rproc: rproc handle
+ * @rsc: the resource entry
+ * @avail: size of available data (for image validation)
+ *
+ * This is the same as rproc_handle_carveout(), except the length of the
+ * region is 64 bits wide, and so is the physical address written back,
+ * which lets the platform place it anywhere in memory (e.g. with a 64-bit
+ * coherent DMA mask on LPAE systems).
+ */
+static int rproc_handle_carveout64(struct rproc *rproc,
+				struct fw_rsc_carveout64 *rsc, int avail)
+{
+	if (sizeof(*rsc) > avail) {
+		dev_err(&rproc->dev, "carveout rsc is truncated\n");
+		return -EINVAL;
+	}
+
+	if (!rproc_rsc64_fits(rproc, rsc->da, rsc->len))
+		return -EINVAL;
+
+	return __rproc_handle_carveout(rproc, rsc);
+}
+
+/**
+ * rproc_handle_perf() - handle a performance counters resource
+ * @rproc: the remote processor
+ * @rsc: the perf resource descriptor
+ * @avail: size of available data (for sanity checking the image)
+ *
+ * The remote processor keeps its counters up to date in its own memory,
+ * where they're read from whenever perf counts them: unlike a message,
+ * that works from the atomic context perf reads its PMUs in.
+ *
+ * Returns 0 on success, or an appropriate error code otherwise
+ */
+static int rproc_handle_perf(struct rproc *rproc, struct fw_rsc_perf *rsc,
+								int avail)
+{
+	struct fw_perf_counters *counters;
+	struct device *dev = &rproc->dev;
+	int len;
+
+	if (sizeof(*rsc) > avail) {
+		dev_err(dev, "perf rsc is truncated\n");
+		return -EINVAL;
+	}
+
+	if (!rsc->num || rsc->num > FW_PERF_MAX_COUNTERS) {
+		dev_err(dev, "perf rsc has %u counters\n", rsc->num);
+		return -EINVAL;
+	}
+
+	if (sizeof(*rsc) + rsc->num * FW_PERF_NAME_LEN > avail) {
+		dev_err(dev, "perf rsc names are truncated\n");
+		return -EINVAL;
+	}
+
+	len = sizeof(*counters) + rsc->num * sizeof(counters->values[0]);
+
+	/* what's the kernel address of the counters ? */
+	counters = rproc_da_to_va(rproc, rsc->da, len);
+	if (!counters) {
+		dev_err(dev, "erroneous perf resource entry\n");
+		return -EINVAL;
+	}
+
+	dev_dbg(dev, "perf rsc: da 0x%x, %u counters\n", rsc->da, rsc->num);
+
+	return rproc_perf_attach(rproc, rsc, counters);
+}
+
+/**
+ * rproc_handle_peer() - handle a peer link resource
+ * @rproc: the remote processor
+ * @rsc: the peer link resource descriptor
+ * @avail: size of available data (for sanity checking the image)
+ *
+ * Set up the vrings shared with another remote processor (see
+ * struct fw_rsc_peer), and write their device addresses back to @rsc.
+ *
+ * Returns 0 on success, or an appropriate error code otherwise
+ */
+static int rproc_handle_peer(struct rproc *rproc, struct fw_rsc_peer *rsc,
+								int avail)
+{
+	struct device *dev = &rproc->dev;
+
+	if (sizeof(*rsc) > avail) {
+		dev_err(dev, "peer rsc is truncated\n");
+		return -EINVAL;
+	}
+
+	/* make sure reserved bytes are zeroes */
+	if (rsc->tx.reserved || rsc->rx.reserved) {
+		dev_err(dev, "peer rsc has non zero reserved bytes\n");
+		return -EINVAL;
+	}
+
+	dev_dbg(dev, "peer rsc: %.*s, tx da 0x%x, rx da 0x%x\n",
+		(int)sizeof(rsc->name), rsc->name, rsc->tx.da, rsc->rx.da);
+
+	return rproc_peer_attach(rproc, rsc);
+}
+
+/**
+ * rproc_handle_queue() - handle a shared-memory queue resource
+ * @rproc: the remote processor
+ * @rsc: the queue resource descriptor
+ * @avail: size of available data (for sanity checking the image)
+ *
+ * Returns 0 on success, or an appropriate error code otherwise
+ */
+static int rproc_handle_queue(struct rproc *rproc, struct fw_rsc_queue *rsc,
+								int avail)
+{
+	if (sizeof(*rsc) > avail) {
+		dev_err(&rproc->dev, "queue rsc is truncated\n");
+		return -EINVAL;
+	}
+
+	return rproc_queue_attach(rproc, rsc);
+}
+
+/**
+ * rproc_handle_cmdq() - handle a command queue resource
+ * @rproc: the remote processor
+ * @rsc: the command queue resource descriptor
+ * @avail: size of available data (for sanity checking the image)
+ *
+ * Returns 0 on success, or an appropriate error code otherwise
+ */
+static int rproc_handle_cmdq(struct rproc *rproc, struct fw_rsc_cmdq *rsc,
+								int avail)
+{
+	if (sizeof(*rsc) > avail) {
+		dev_err(&rproc->dev, "cmdq rsc is truncated\n");
+		return -EINVAL;
+	}
+
+	return rproc_cmdq_attach(rproc, rsc);
+}
+
+/**
+ * rproc_handle_minidump() - handle a minidump resource
+ * @rproc: the remote processor
+ * @rsc: the minidump resource descriptor
+ * @avail: size of available data (for sanity checking the image)
+ *
+ * The core dumps of @rproc are then limited to the regions of the table
+ * @rsc declares (see fw_rsc_minidump).
+ *
+ * Returns 0 on success, or an appropriate error code otherwise
+ */
+static int rproc_handle_minidump(struct rproc *rproc,
+				struct fw_rsc_minidump *rsc, int avail)
+{
+	struct device *dev = &rproc->dev;
+
+	if (sizeof(*rsc) > avail) {
+		dev_err(dev, "minidump rsc is truncated\n");
+		return -EINVAL;
+	}
+
+	/* make sure reserved bytes are zeroes */
+	if (rsc->reserved) {
+		dev_err(dev, "minidump rsc has non zero reserved bytes\n");
+		return -EINVAL;
+	}
+
+	if (!rsc->num || rsc->num > FW_MINIDUMP_MAX_REGIONS) {
+		dev_err(dev, "minidump rsc: %u regions\n", rsc->num);
+		return -EINVAL;
+	}
+
+	dev_dbg(dev, "minidump rsc: %u regions at da 0x%x\n", rsc->num,
+								rsc->da);
+
+	rproc->minidump_da = rsc->da;
+	rproc->minidump_num = rsc->num;
+
+	return 0;
+}
+
+/**
+ * rproc_handle_timesync() - handle a clock synchronization resource
+ * @rproc: the remote processor
+ * @rsc: the timesync resource descriptor
+ * @avail: size of available data (for sanity checking the image)
+ *
+ * Returns 0 on success, or an appropriate error code otherwise
+ */
+static int rproc_handle_timesync(struct rproc *rproc,
+				struct fw_rsc_timesync *rsc, int avail)
+{
+	struct device *dev = &rproc->dev;
+
+	if (sizeof(*rsc) > avail) {
+		dev_err(dev, "timesync rsc is truncated\n");
+		return -EINVAL;
+	}
+
+	/* make sure reserved bytes are zeroes */
+	if (rsc->reserved) {
+		dev_err(dev, "timesync rsc has non zero reserved bytes\n");
+		return -EINVAL;
+	}
+
+	return rproc_timesync_attach(rproc, rsc);
+}
+
+/**
+ * rproc_handle_coalesce() - handle a notification moderation resource
+ * @rproc: the remote processor
+ * @rsc: the coalesce resource descriptor
+ * @avail: size of available data (for sanity checking the image)
+ *
+ * Returns 0 on success, or an appropriate error code otherwise
+ */
+static int rproc_handle_coalesce(struct rproc *rproc,
+				struct fw_rsc_coalesce *rsc, int avail)
+{
+	struct device *dev = &rproc->dev;
+
+	if (sizeof(*rsc) > avail) {
+		dev_err(dev, "coalesce rsc is truncated\n");
+		return -EINVAL;
+	}
+
+	/* make sure reserved bytes are zeroes */
+	if (rsc->reserved) {
+		dev_err(dev, "coalesce rsc has non zero reserved bytes\n");
+		return -EINVAL;
+	}
+
+	return rproc_coalesce_attach(rproc, rsc);
+}
+
+/**
+ * rproc_handle_snapshot() - handle a memory snapshot request
+ * @rproc: the remote processor
+ * @rsc: the snapshot resource entry
+ * @avail: size of available data (for image validation)
+ *
+ * The contents of the memory region @rsc declares are saved when @rproc is
+ * shut down, and restored when it's booted again (see fw_rsc_snapshot).
+ *
+ * Returns 0 on success, or an appropriate error code otherwise.
+ */
+static int rproc_handle_snapshot(struct rproc *rproc,
+				struct fw_rsc_snapshot *rsc, int avail)
+{
+	struct device *dev = &rproc->dev;
+
+	if (sizeof(*rsc) > avail) {
+		dev_err(dev, "snapshot rsc is truncated\n");
+		return -EINVAL;
+	}
+
+	/* make sure reserved bytes are zeroes */
+	if (rsc->reserved) {
+		dev_err(dev, "snapshot rsc has non zero reserved bytes\n");
+		return -EINVAL;
+	}
+
+	return rproc_snapshot_attach(rproc, rsc);
+}
+
+/**
+ * rproc_handle_overlay() - handle an overlay region resource
+ * @rproc: the remote processor
+ * @rsc: the overlay resource entry
+ * @avail: size of available data (for image validation)
+ *
+ * The overlays of the firmware are copied into the region @rsc declares as
+ * @rproc asks for them (see fw_rsc_overlay).
+ *
+ * Returns 0 on success, or an appropriate error code otherwise.
+ */
+static int rproc_handle_overlay(struct rproc *rproc,
+				struct fw_rsc_overlay *rsc, int avail)
+{
+	struct device *dev = &rproc->dev;
+
+	if (sizeof(*rsc) > avail) {
+		dev_err(dev, "overlay rsc is truncated\n");
+		return -EINVAL;
+	}
+
+	/* make sure reserved bytes are zeroes */
+	if (rsc->reserved) {
+		dev_err(dev, "overlay rsc has non zero reserved bytes\n");
+		return -EINVAL;
+	}
+
+	return rproc_overlay_attach(rproc, rsc);
+}
+
+/**
+ * rproc_handle_dynmem() - handle a runtime memory window resource
+ * @rproc: the remote processor
+ * @rsc: the runtime memory resource entry
+ * @avail: size of available data (for image validation)
+ *
+ * Regions of memory are mapped into the window @rsc declares, and unmapped
+ * from it, as @rproc asks for them (see fw_rsc_dynmem).
+ *
+ * Returns 0 on success, or an appropriate error code otherwise.
+ */
+static int rproc_handle_dynmem(struct rproc *rproc,
+				struct fw_rsc_dynmem *rsc, int avail)
+{
+	struct device *dev = &rproc->dev;
+
+	if (sizeof(*rsc) > avail) {
+		dev_err(dev, "dynmem rsc is truncated\n");
+		return -EINVAL;
+	}
+
+	/* make sure reserved bytes are zeroes */
+	if (rsc->reserved) {
+		dev_err(dev, "dynmem rsc has non zero reserved bytes\n");
+		return -EINVAL;
+	}
+
+	return rproc_dynmem_attach(rproc, rsc);
+}
+
+/**
+ * rproc_handle_telemetry() - handle a telemetry page resource
+ * @rproc: the remote processor
+ * @rsc: the telemetry resource entry
+ * @avail: size of available data (for image validation)
+ *
+ * @rproc publishes how it's doing in the page @rsc declares, for host
+ * drivers to read with rproc_get_telemetry() (see fw_rsc_telemetry).
+ *
+ * Returns 0 on success, or an appropriate error code otherwise.
+ */
+static int rproc_handle_telemetry(struct rproc *rproc,
+				struct fw_rsc_telemetry *rsc, int avail)
+{
+	struct device *dev = &rproc->dev;
+
+	if (sizeof(*rsc) > avail) {
+		dev_err(dev, "telemetry rsc is truncated\n");
+		return -EINVAL;
+	}
+
+	/* @reserved was never checked, so it may hold anything */
+	return rproc_telemetry_attach(rproc, rsc->da, rsc->num_epts, 0);
+}
+
+/**
+ * rproc_handle_telemetry_tags() - handle a telemetry page resource, with tags
+ * @rproc: the remote processor
+ * @rsc: the telemetry resource entry
+ * @avail: size of available data (for image validation)
+ *
+ * This is the same as rproc_handle_telemetry(), except the page also has
+ * room for the cycles @rproc spent on each sender tag (see
+ * fw_rsc_telemetry_tags).
+ *
+ * Returns 0 on success, or an appropriate error code otherwise.
+ */
+static int rproc_handle_telemetry_tags(struct rproc *rproc,
+				struct fw_rsc_telemetry_tags *rsc, int avail)
+{
+	struct device *dev = &rproc->dev;
+
+	if (sizeof(*rsc) > avail) {
+		dev_err(dev, "telemetry rsc is truncated\n");
+		return -EINVAL;
+	}
+
+	/* keep @reserved free to tell a later layout of the page apart */
+	if (rsc->reserved) {
+		dev_err(dev, "unsupported telemetry rsc layout %u\n",
+							rsc->reserved);
+		return -EINVAL;
+	}
+
+	return rproc_telemetry_attach(rproc, rsc->da, rsc->num_epts,
+							rsc->num_tags);
+}
+
+/**
+ * rproc_handle_core() - handle a core resource
+ * @rproc: the remote processor
+ * @rsc: the core resource entry
+ * @avail: size of available data (for image validation)
+ *
+ * The core @rsc declares, of a multi-core @rproc, boots at the address it
+ * asks for, rather than at the entry point of the image (see fw_rsc_core).
+ *
+ * Returns 0 on success, or an appropriate error code otherwise.
+ */
+static int rproc_handle_core(struct rproc *rproc, struct fw_rsc_core *rsc,
+								int avail)
+{
+	struct device *dev = &rproc->dev;
+
+	if (sizeof(*rsc) > avail) {
+		dev_err(dev, "core rsc is truncated\n");
+		return -EINVAL;
+	}
+
+	/* make sure reserved bytes are zeroes */
+	if (rsc->reserved) {
+		dev_err(dev, "core rsc has non zero reserved bytes\n");
+		return -EINVAL;
+	}
+
+	if (rsc->core >= rproc->num_cores) {
+		dev_err(dev, "core rsc: core %u, out of %u\n", rsc->core,
+							rproc->num_cores);
+		return -EINVAL;
+	}
+
+	dev_dbg(dev, "core rsc: core %u boots at 0x%x\n", rsc->core,
+								rsc->bootaddr);
+
+	rproc->core_bootaddr[rsc->core] = rsc->bootaddr;
+	if (!rsc->core)
+		rproc->bootaddr = rsc->bootaddr;
+
+	return 0;
+}
+
+/**
+ * rproc_handle_trace_fmt() - handle a trace format strings resource
+ * @rproc: the remote processor
+ * @rsc: the trace format strings resource entry
+ * @avail: size of available data (for image validation)
+ *
+ * The records of the binary trace buffer @rsc names are expanded with the
+ * format strings @rsc points at (see fw_rsc_trace_fmt), which are read
+ * right from where the image was loaded.
+ *
+ * Returns 0 on success, or an appropriate error code otherwise.
+ */
+static int rproc_handle_trace_fmt(struct rproc *rproc,
+				struct fw_rsc_trace_fmt *rsc, int avail)
+{
+	struct rproc_mem_entry *trace;
+	struct device *dev = &rproc->dev;
+	u32 i = 0;
+	void *ptr;
+
+	if (sizeof(*rsc) > avail) {
+		dev_err(dev, "trace fmt rsc is truncated\n");
+		return -EINVAL;
+	}
+
+	/* make sure reserved bytes are zeroes */
+	if (rsc->reserved) {
+		dev_err(dev, "trace fmt rsc has non zero reserved bytes\n");
+		return -EINVAL;
+	}
+
+	if (rsc->trace >= rproc->num_traces) {
+		dev_err(dev, "trace fmt rsc: no trace%u\n", rsc->trace);
+		return -EINVAL;
+	}
+
+	/* the traces are listed in the order they're indexed */
+	list_for_each_entry(trace, &rproc->traces, node)
+		if (i++ == rsc->trace)
+			break;
+
+	if (!(trace->flags & FW_TRACE_BINARY) || trace->formats) {
+		dev_err(dev, "trace fmt rsc: trace%u isn't binary, or taken\n",
+								rsc->trace);
+		return -EINVAL;
+	}
+
+	ptr = rproc_da_to_va(rproc, rsc->da, rsc->len);
+	if (!ptr || !rsc->len) {
+		dev_err(dev, "erroneous trace fmt resource entry\n");
+		return -EINVAL;
+	}
+
+	trace->formats = ptr;
+	trace->formats_len = rsc->len;
+
+	dev_dbg(dev, "trace fmt rsc: da 0x%x, len 0x%x\n", rsc->da, rsc->len);
+
+	return 0;
+}
+
+/*
+ * A lookup table for resource handlers. The indices are defined in
+ * enum fw_resource_type.
+ */
+static rproc_handle_resource_t rproc_handle_rsc[] = {
+	[RSC_CARVEOUT] = (rproc_handle_resource_t)rproc_handle_carveout,
+	[RSC_DEVMEM] = (rproc_handle_resource_t)rproc_handle_devmem,
+	[RSC_TRACE] = (rproc_handle_resource_t)rproc_handle_trace,
+	[RSC_VDEV] = NULL, /* VDEVs were handled upon registrarion */
+	[RSC_PERF] = (rproc_handle_resource_t)rproc_handle_perf,
+	[RSC_PEER] = (rproc_handle_resource_t)rproc_handle_peer,
+	[RSC_QUEUE] = (rproc_handle_resource_t)rproc_handle_queue,
+	[RSC_TIMESYNC] = (rproc_handle_resource_t)rproc_handle_timesync,
+	[RSC_COALESCE] = (rproc_handle_resource_t)rproc_handle_coalesce,
+	[RSC_IPCMEM] = NULL, /* handled along with their VDEVs */
+	[RSC_SNAPSHOT] = (rproc_handle_resource_t)rproc_handle_snapshot,
+	[RSC_OVERLAY] = (rproc_handle_resource_t)rproc_handle_overlay,
+	[RSC_TELEMETRY] = (rproc_handle_resource_t)rproc_handle_telemetry,
+	[RSC_CORE] = (rproc_handle_resource_t)rproc_handle_core,
+	[RSC_TRACE_FMT] = (rproc_handle_resource_t)rproc_handle_trace_fmt,
+	[RSC_CMDQ] = (rproc_handle_resource_t)rproc_handle_cmdq,
+	[RSC_MINIDUMP] = (rproc_handle_resource_t)rproc_handle_minidump,
+	[RSC_CARVEOUT64] = (rproc_handle_resource_t)rproc_handle_carveout64,
+	[RSC_DEVMEM64] = (rproc_handle_resource_t)rproc_handle_devmem64,
+	[RSC_DYNMEM] = (rproc_handle_resource_t)rproc_handle_dynmem,
+	[RSC_TELEMETRY_TAGS] =
+		(rproc_handle_resource_t)rproc_handle_telemetry_tags,
+};
+
+/**
+ * rproc_index_rsc_table() - parse a resource table, once and for all
+ * @rproc: the remote processor
+ * @table: the resource table, whose header was sanity checked already
+ *	   (see rproc_check_rsc_table())
+ * @len: size of @table, in bytes
+ *
+ * The entries of @table are checked not to be truncated, and are indexed
+ * by type, so each phase only walks those it's interested in (see
+ * rproc_handle_boot_rsc() and rproc_handle_virtio_rsc()). Entries of an
+ * unsupported type are told about, and left out.
+ *
+ * The index only refers to the entries by their offsets, so it applies to
+ * any copy of @table too, e.g. the one a remote processor is loaded with.
+ * It's kept along with the firmware image @table comes from (see
+ * rproc_fw_image), so booting it again, e.g. to recover from a crash,
+ * doesn't parse its table all over again.
+ *
+ * Returns the index, which is to be kfree()d, or an ERR_PTR() otherwise.
+ */
+struct rproc_rsc_index *rproc_index_rsc_table(struct rproc *rproc,
+				struct resource_table *table, int len)
+{
+	struct device *dev = &rproc->dev;
+	struct rproc_rsc_index *index;
+	struct rproc_rsc_entry *ent;
+	int last[RSC_LAST];
+	int i;
+
+	index = kzalloc(sizeof(*index) + table->num * sizeof(index->ents[0]),
+								GFP_KERNEL);
+	if (!index) {
+		dev_err(dev, "kzalloc rsc index failed\n");
+		return ERR_PTR(-ENOMEM);
+	}
+
+	for (i = 0; i < RSC_LAST; i++)
+		index->first[i] = last[i] = -1;
+
+	for (i = 0; i < table->num; i++) {
+		u32 offset = table->offset[i];
+		struct fw_rsc_hdr *hdr = (void *)table + offset;
+
+		/* make sure table isn't truncated */
+		if (offset > len || len - offset < sizeof(*hdr)) {
+			dev_err(dev, "rsc table is truncated\n");
+			goto free_index;
+		}
+
+		dev_dbg(dev, "rsc: type %d\n", hdr->type);
+
+		if (hdr->type >= RSC_LAST) {
+			dev_warn(dev, "unsupported resource %d\n", hdr->type);
+			continue;
+		}
+
+		/* 64-bit entries only come in version 2 tables */
+		if (table->ver < 2 && (hdr->type == RSC_CARVEOUT64 ||
+					hdr->type == RSC_DEVMEM64)) {
+			dev_err(dev, "resource %d in a v1 table\n", hdr->type);
+			goto free_index;
+		}
+
+		ent = &index->ents[index->num];
+		ent->type = hdr->type;
+		ent->offset = offset;
+		ent->avail = len - offset - sizeof(*hdr);
+		ent->next = -1;
+
+		if (last[ent->type] < 0)
+			index->first[ent->type] = index->num;
+		else
+			index->ents[last[ent->type]].next = index->num;
+		last[ent->type] = index->num++;
+	}
+
+	return index;
+
+free_index:
+	kfree(index);
+	return ERR_PTR(-EINVAL);
+}
+
+/* handle firmware resource entries before booting the remote processor */
+int rproc_handle_boot_rsc(struct rproc *rproc, struct resource_table *table,
+					struct rproc_rsc_index *index)
+{
+	rproc_handle_resource_t handler;
+	struct rproc_rsc_entry *ent;
+	int ret, i;
+
+	for (i = 0; i < index->num; i++) {
+		ent = &index->ents[i];
+
+		handler = rproc_handle_rsc[ent->type];
+		if (!handler)
+			continue;
+
+		ret = handler(rproc, rproc_rsc_data(table, ent), ent->avail);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+/*
+ * handle firmware resource entries while registering the remote processor:
+ * the vdevs are registered in parallel (their drivers' probes, e.g. that of
+ * rpmsg, may take a while), and this returns once they all are
+ */
+static int rproc_handle_virtio_rsc(struct rproc *rproc,
+		struct resource_table *table, struct rproc_rsc_index *index)
+{
+	ASYNC_DOMAIN_EXCLUSIVE(domain);
+	struct rproc_rsc_entry *ent;
+	int ret = 0;
+
+	rproc_for_each_rsc(index, ent, RSC_VDEV) {
+		ret = rproc_handle_vdev(rproc, table, index,
+					rproc_rsc_data(table, ent), ent->avail,
+					false, &domain);
+		if (ret)
+			break;
+	}
+
+	async_synchronize_full_domain(&domain);
+
+	return ret;
+}
+
+/* find an unlisted vdev matching an entry of a rescanned resource table */
+static struct rproc_vdev *
+rproc_find_unlisted_vdev(struct rproc *rproc, struct fw_rsc_vdev *vrsc)
+{
+	struct rproc_vdev *rvdev;
+
+	list_for_each_entry(rvdev, &rproc->rvdevs, node)
+		if (!rvdev->listed && rvdev->vdev.id.device == vrsc->id &&
+					rvdev->notifyid == vrsc->notifyid)
+			return rvdev;
+
+	return NULL;
+}
+
+/*
+ * rescan the resource table of a running remote processor for vdevs, and
+ * make ours match it: the vdev entries which weren't there before are added
+ * (and their vdevs registered), and the vdevs whose entries are gone are
+ * removed. A vdev is identified by its virtio device id and its notifyid.
+ *
+ * The remote processor changed @table, so it's parsed again.
+ */
+static void
+rproc_rescan_vdevs(struct rproc *rproc, struct resource_table *table, int len)
+{
+	struct device *dev = &rproc->dev;
+	struct rproc_vdev *rvdev, *tmp;
+	struct rproc_rsc_index *index;
+	struct rproc_rsc_entry *ent;
+	struct fw_rsc_vdev *vrsc;
+	int ret;
+
+	index = rproc_index_rsc_table(rproc, table, len);
+	if (IS_ERR(index))
+		return;
+
+	list_for_each_entry(rvdev, &rproc->rvdevs, node)
+		rvdev->listed = false;
+
+	rproc_for_each_rsc(index, ent, RSC_VDEV) {
+		vrsc = rproc_rsc_data(table, ent);
+
+		rvdev = rproc_find_unlisted_vdev(rproc, vrsc);
+		if (rvdev) {
+			rvdev->listed = true;
+			continue;
+		}
+
+		ret = rproc_handle_vdev(rproc, table, index, vrsc, ent->avail,
+								true, NULL);
+		if (ret)
+			dev_err(dev, "can't add vdev %d: %d\n", vrsc->id, ret);
+	}
+
+	kfree(index);
+
+	list_for_each_entry_safe(rvdev, tmp, &rproc->rvdevs, node) {
+		if (rvdev->listed)
+			continue;
+
+		dev_info(dev, "removing %s\n", dev_name(&rvdev->vdev.dev));
+		rproc_remove_virtio_dev(rvdev);
+	}
+}
+
+/*
+ * rescan the resource table of the running remote processor for vdevs, and
+ * let the drivers of the vdevs know their config space may have changed
+ */
+static void rproc_rsc_update_work(struct work_struct *work)
+{
+	struct rproc *rproc = container_of(work, struct rproc, rsc_update);
+	struct device *dev = &rproc->dev;
+	struct rproc_vdev *rvdev;
+	struct resource_table *table;
+	int tablesz;
+
+	/* the vdevs which were announced by the firmware come first */
+	wait_for_completion(&rproc->firmware_loading_complete);
+
+	mutex_lock(&rproc->lock);
+	if (rproc->state != RPROC_RUNNING) {
+		mutex_unlock(&rproc->lock);
+		dev_warn(dev, "ignoring rsc update: %s isn't running\n",
+								rproc->name);
+		return;
+	}
+	mutex_unlock(&rproc->lock);
+
+	if (rproc->ops->find_loaded_rsc_table) {
+		table = rproc->ops->find_loaded_rsc_table(rproc, &tablesz);
+		if (table)
+			rproc_rescan_vdevs(rproc, table, tablesz);
+		else
+			dev_err(dev, "can't find the rsc table of %s\n",
+								rproc->name);
+	}
+
+	/* the config space of the vdevs may have changed, too */
+	list_for_each_entry(rvdev, &rproc->rvdevs, node)
+		rproc_virtio_config_changed(rvdev);
+}
+
+/*
+ * share the entries of the vdevs in @table, the resource table in the memory
+ * of the remote processor that was just loaded, with the vdevs: their config
+ * space and status are then accessed right there (see remoteproc_virtio.c)
+ * until it's shut down, so both sides see the changes the other one makes.
+ *
+ * @table is a copy of the table @index was parsed out of.
+ */
+static void rproc_share_vdevs(struct rproc *rproc,
+		struct resource_table *table, struct rproc_rsc_index *index)
+{
+	struct rproc_rsc_entry *ent;
+	struct rproc_vdev *rvdev;
+	struct fw_rsc_vdev *vrsc;
+
+	rproc_for_each_rsc(index, ent, RSC_VDEV) {
+		vrsc = rproc_rsc_data(table, ent);
+
+		spin_lock_irq(&rproc->shared_lock);
+		list_for_each_entry(rvdev, &rproc->rvdevs, node)
+			if (rvdev->vdev.id.device == vrsc->id &&
+					rvdev->notifyid == vrsc->notifyid &&
+					rvdev->num_vrings == vrsc->num_of_vrings &&
+					rvdev->config_len == vrsc->config_len)
+				rvdev->shared = vrsc;
+		spin_unlock_irq(&rproc->shared_lock);
+	}
+}
+
+/*
+ * make sure the vdevs of @table, the resource table of the firmware image
+ * which is about to be booted, are those which were registered out of a
+ * copy of it (see rproc->rsc_table_fw), which may be stale
+ */
+static int rproc_match_vdevs(struct rproc *rproc,
+		struct resource_table *table, struct rproc_rsc_index *index)
+{
+	struct rproc_rsc_entry *ent;
+	struct rproc_vdev *rvdev;
+	struct fw_rsc_vdev *vrsc;
+
+	rproc_for_each_rsc(index, ent, RSC_VDEV) {
+		bool found = false;
+
+		vrsc = rproc_rsc_data(table, ent);
+		if (ent->avail < (int)sizeof(*vrsc))
+			continue;
+
+		list_for_each_entry(rvdev, &rproc->rvdevs, node)
+			if (rvdev->vdev.id.device == vrsc->id &&
+				rvdev->notifyid == vrsc->notifyid &&
+				rvdev->num_vrings == vrsc->num_of_vrings &&
+				rvdev->config_len == vrsc->config_len)
+				found = true;
+
+		if (!found) {
+			dev_err(&rproc->dev, "%s doesn't match %s (vdev %u)\n",
+				rproc->rsc_table_fw, rproc->firmware, vrsc->id);
+			return -EINVAL;
+		}
+	}
+
+	return 0;
+}
+
+/* stop sharing the resource table entries of the vdevs, as it goes away */
+static void rproc_unshare_vdevs(struct rproc *rproc)
+{
+	struct rproc_vdev *rvdev;
+
+	spin_lock_irq(&rproc->shared_lock);
+	list_for_each_entry(rvdev, &rproc->rvdevs, node)
+		rvdev->shared = NULL;
+	spin_unlock_irq(&rproc->shared_lock);
+}
+
+/**
+ * struct rproc_dmabuf - a dma-buf mapped into the iommu domain of an rproc
+ * @dmabuf: the dma-buf (a reference to which we hold)
+ * @attach: its attachment to the rproc's device
+ * @sgt: its pages, as mapped for the rproc's device
+ * @chunks: number of rproc->mappings entries its pages are mapped with
+ *
+ * Each physically contiguous chunk of the dma-buf is an entry of its own in
+ * rproc->mappings (so it's accounted for, and shown in debugfs, like any
+ * other mapping), whose @priv points back here.
+ */
+struct rproc_dmabuf {
+	struct dma_buf *dmabuf;
+	struct dma_buf_attachment *attach;
+	struct sg_table *sgt;
+	int chunks;
+};
+
+/* a chunk of @rdb was unmapped: release the dma-buf with the last one */
+static void rproc_dmabuf_put(struct rproc_dmabuf *rdb)
+{
+	if (--rdb->chunks)
+		return;
+
+	dma_buf_unmap_attachment(rdb->attach, rdb->sgt, DMA_BIDIRECTIONAL);
+	dma_buf_detach(rdb->dmabuf, rdb->attach);
+	dma_buf_put(rdb->dmabuf);
+	kfree(rdb);
+}
+
+/* unmap an entry of rproc->mappings, and free it */
+static void rproc_unmap_entry(struct rproc *rproc,
+					struct rproc_mem_entry *entry)
+{
+	size_t unmapped;
+
+	unmapped = iommu_unmap(rproc->domain, entry->da, entry->len);
+	if (unmapped != entry->len) {
+		/* nothing much to do besides complaining */
+		dev_err(&rproc->dev, "failed to unmap %zu/%zu\n", entry->len,
+								unmapped);
+	}
+
+	list_del(&entry->node);
+	if (entry->priv)
+		rproc_dmabuf_put(entry->priv);
+	kfree(entry);
+}
+
+/**
+ * rproc_resource_cleanup() - clean up and free all acquired resources
+ * @rproc: rproc handle
+ *
+ * This function will free all resources acquired for @rproc, and it
+ * is called whenever @rproc either shuts down or fails to boot.
+ */
+void rproc_resource_cleanup(struct rproc *rproc)
+{
+	struct rproc_mem_entry *entry, *tmp;
+	struct rproc_hole *hole, *htmp;
+
+	/* the resource table may go away along with the carveouts */
+	rproc_unshare_vdevs(rproc);
+
+	/* and so may the performance counters */
+	rproc_perf_detach(rproc);
+
+	/* the peers may keep using the vrings we share with them */
+	rproc_peer_detach(rproc);
+
+	/* the queues are in the carveouts */
+	rproc_queue_detach(rproc);
+	rproc_cmdq_detach(rproc);
+
+	/* and so are the clock estimate and the moderation hint */
+	rproc_timesync_detach(rproc);
+	rproc_coalesce_detach(rproc);
+
+	/* the memory snapshots may be accessed through the carveouts, too */
+	rproc_snapshot_detach(rproc);
+
+	/* and so may the overlay region, whose control block is in them */
+	rproc_overlay_detach(rproc);
+	rproc_dynmem_detach(rproc);
+
+	/* the telemetry page is in a carveout, too */
+	rproc_telemetry_detach(rproc);
+
+	/* clean up debugfs trace entries */
+	list_for_each_entry_safe(entry, tmp, &rproc->traces, node) {
+		if (entry->flags & FW_TRACE_STAMPED)
+			rproc_trace_pull_del(entry);
+		rproc_remove_trace_file(entry->priv);
+		rproc->num_traces--;
+		list_del(&entry->node);
+		kfree(entry);
+	}
+
+	/* a dump of the carveouts may keep them (see rproc_coredump_keep()) */
+	rproc_coredump_keep(rproc);
+
+	/* the next firmware may not ask for minidumps */
+	rproc->minidump_num = 0;
+
+	/* clean up carveout allocations */
+	list_for_each_entry_safe(entry, tmp, &rproc->carveouts, node) {
+		rproc_free_carveout(rproc, entry);
+		list_del(&entry->node);
+		kfree(entry);
+	}
+	rproc_index_carveouts(rproc);
+
+	/* clean up the holes, and the pages that were faulted into them */
+	list_for_each_entry_safe(hole, htmp, &rproc->holes, node) {
+		rproc_rearm_hole(rproc, hole);
+		list_del(&hole->node);
+		kfree(hole);
+	}
+
+	/* clean up iommu mapping entries, including those of dma-bufs */
+	list_for_each_entry_safe(entry, tmp, &rproc->mappings, node)
+		rproc_unmap_entry(rproc, entry);
+}
+
+/* does [@da, @da + @len) overlap any of the iommu mappings of @rproc ? */
+static bool rproc_da_mapped(struct rproc *rproc, u32 da, size_t len)
+{
+	struct rproc_mem_entry *entry;
+
+	list_for_each_entry(entry, &rproc->mappings, node)
+		if (da < entry->da + entry->len && entry->da < da + len)
+			return true;
+
+	return false;
+}
+
+/*
+ * find room for a @len bytes mapping in the dma-buf window of @rproc (see
+ * rproc->dmabuf_da), first fit. Returns FW_RSC_ADDR_ANY if there's none.
+ */
+static u32 rproc_find_dmabuf_da(struct rproc *rproc, size_t len)
+{
+	struct rproc_mem_entry *entry;
+	u64 da = rproc->dmabuf_da;
+	u64 end = da + rproc->dmabuf_len;
+
+again:
+	if (da + len > end)
+		return (u32)FW_RSC_ADDR_ANY;
+
+	list_for_each_entry(entry, &rproc->mappings, node) {
+		if (da < entry->da + entry->len && entry->da < da + len) {
+			da = PAGE_ALIGN(entry->da + entry->len);
+			goto again;
+		}
+	}
+
+	return da;
+}
+
+/**
+ * rproc_map_dmabuf() - map a dma-buf into the memory of a remote processor
+ * @rproc: the remote processor
+ * @dmabuf: the dma-buf to map
+ * @da: the device address to map @dmabuf at, or FW_RSC_ADDR_ANY to have
+ *	one picked in the rproc's dma-buf window; set to where @dmabuf was
+ *	mapped on success
+ * @flags: iommu mapping flags (IOMMU_READ, IOMMU_WRITE)
+ *
+ * Lets buffers of other host drivers (e.g. camera frames) be handed to the
+ * remote processor as they are, instead of being copied into memory it can
+ * reach: @dmabuf is attached to the rproc's device, and its pages are
+ * mapped into the iommu domain of @rproc, whose device address can then be
+ * passed along in, e.g., rpmsg messages. A reference to @dmabuf is held
+ * until it's unmapped again, with rproc_unmap_dmabuf(), or along with all
+ * the other resources of @rproc (e.g. when it's shut down).
+ *
+ * The pages of @dmabuf must be page aligned, and @rproc must have an iommu
+ * domain, i.e. be behind an iommu and be (or have been, see
+ * rproc->keep_resources) booted.
+ *
+ * Returns 0 on success, and an appropriate error value otherwise.
+ */
+int rproc_map_dmabuf(struct rproc *rproc, struct dma_buf *dmabuf, u32 *da,
+								int flags)
+{
+	struct device *dev = &rproc->dev;
+	struct rproc_mem_entry *mapping, *tmp;
+	struct rproc_dmabuf *rdb;
+	struct scatterlist *sg;
+	LIST_HEAD(chunks);
+	size_t len = 0;
+	u32 start;
+	int i, ret;
+
+	rdb = kzalloc(sizeof(*rdb), GFP_KERNEL);
+	if (!rdb)
+		return -ENOMEM;
+
+	rdb->attach = dma_buf_attach(dmabuf, dev->parent);
+	if (IS_ERR(rdb->attach)) {
+		ret = PTR_ERR(rdb->attach);
+		dev_err(dev, "can't attach dma-buf: %d\n", ret);
+		goto free_rdb;
+	}
+
+	rdb->sgt = dma_buf_map_attachment(rdb->attach, DMA_BIDIRECTIONAL);
+	if (IS_ERR(rdb->sgt)) {
+		ret = PTR_ERR(rdb->sgt);
+		dev_err(dev, "can't map dma-buf: %d\n", ret);
+		goto detach;
+	}
+
+	for_each_sg(rdb->sgt->sgl, sg, rdb->sgt->nents, i) {
+		if ((sg->offset | sg->length) & ~PAGE_MASK) {
+			dev_err(dev, "dma-buf isn't page aligned\n");
+			ret = -EINVAL;
+			goto unmap_attachment;
+		}
+		len += sg->length;
+	}
+
+	ret = mutex_lock_interruptible(&rproc->lock);
+	if (ret)
+		goto unmap_attachment;
+
+	if (!rproc->domain) {
+		ret = -ENODEV;
+		goto unlock;
+	}
+
+	start = *da;
+	if (start == (u32)FW_RSC_ADDR_ANY)
+		start = rproc_find_dmabuf_da(rproc, len);
+	else if ((start & ~PAGE_MASK) || rproc_da_mapped(rproc, start, len))
+		start = (u32)FW_RSC_ADDR_ANY;
+	if (start == (u32)FW_RSC_ADDR_ANY) {
+		dev_err(dev, "no room for a 0x%zx bytes dma-buf at 0x%x\n",
+								len, *da);
+		ret = -EBUSY;
+		goto unlock;
+	}
+
+	*da = start;
+	for_each_sg(rdb->sgt->sgl, sg, rdb->sgt->nents, i) {
+		mapping = kzalloc(sizeof(*mapping), GFP_KERNEL);
+		if (!mapping) {
+			ret = -ENOMEM;
+			goto unmap_chunks;
+		}
+
+		ret = iommu_map(rproc->domain, start, sg_phys(sg), sg->length,
+									flags);
+		if (ret) {
+			dev_err(dev, "failed to map dma-buf: %d\n", ret);
+			kfree(mapping);
+			goto unmap_chunks;
+		}
+
+		mapping->da = start;
+		mapping->dma = sg_phys(sg);
+		mapping->len = sg->length;
+		mapping->priv = rdb;
+		list_add_tail(&mapping->node, &chunks);
+		rdb->chunks++;
+
+		start += sg->length;
+	}
+
+	/* the dma-buf is ours until its last chunk is unmapped */
+	get_dma_buf(dmabuf);
+	rdb->dmabuf = dmabuf;
+	list_splice_tail(&chunks, &rproc->mappings);
+
+	mutex_unlock(&rproc->lock);
+
+	dev_dbg(dev, "mapped dma-buf at da 0x%x, len 0x%zx\n", *da, len);
+
+	return 0;
+
+unmap_chunks:
+	list_for_each_entry_safe(mapping, tmp, &chunks, node) {
+		iommu_unmap(rproc->domain, mapping->da, mapping->len);
+		list_del(&mapping->node);
+		kfree(mapping);
+	}
+unlock:
+	mutex_unlock(&rproc->lock);
+unmap_attachment:
+	dma_buf_unmap_attachment(rdb->attach, rdb->sgt, DMA_BIDIRECTIONAL);
+detach:
+	dma_buf_detach(dmabuf, rdb->attach);
+free_rdb:
+	kfree(rdb);
+	return ret;
+}
+EXPORT_SYMBOL(rproc_map_dmabuf);
+
+/**
+ * rproc_unmap_dmabuf() - unmap a dma-buf from the memory of an rproc
+ * @rproc: the remote processor
+ * @da: the device address the dma-buf was mapped at (see rproc_map_dmabuf())
+ *
+ * Unmaps the dma-buf mapped at @da from the iommu domain of @rproc, and
+ * drops the reference that was held to it. The remote processor must be
+ * done with it by then.
+ *
+ * Returns 0 on success, or -ENOENT if no dma-buf is mapped at @da (e.g.
+ * because it was unmapped along with the other resources of @rproc when it
+ * was shut down).
+ */
+int rproc_unmap_dmabuf(struct rproc *rproc, u32 da)
+{
+	struct rproc_mem_entry *entry, *tmp;
+	struct rproc_dmabuf *rdb = NULL;
+
+	mutex_lock(&rproc->lock);
+
+	list_for_each_entry(entry, &rproc->mappings, node) {
+		if (entry->priv && entry->da == da) {
+			rdb = entry->priv;
+			break;
+		}
+	}
+
+	/* unmap all of its chunks; the dma-buf goes with the last one */
+	if (rdb)
+		list_for_each_entry_safe(entry, tmp, &rproc->mappings, node)
+			if (entry->priv == rdb)
+				rproc_unmap_entry(rproc, entry);
+
+	mutex_unlock(&rproc->lock);
+
+	return rdb ? 0 : -ENOENT;
+}
+EXPORT_SYMBOL(rproc_unmap_dmabuf);
+
+/*
+ * count the pages of each size a @size bytes mapping of @paddr at @iova is
+ * made of: iommu_map() always picks the largest page size that the
+ * alignment of the addresses, and the size left to map, allow for.
+ */
+void rproc_count_pgsizes(unsigned long pgsize_bitmap, unsigned long iova,
+			phys_addr_t paddr, size_t size, unsigned long *count)
+{
+	while (size) {
+		unsigned long addr_merge = iova | (unsigned long)paddr;
+		unsigned int idx = __fls(size);
+		unsigned long pgsizes;
+
+		if (addr_merge)
+			idx = min_t(unsigned int, idx, __ffs(addr_merge));
+
+		pgsizes = ((2UL << idx) - 1) & pgsize_bitmap;
+		if (!pgsizes)
+			break;
+
+		idx = __fls(pgsizes);
+		count[idx]++;
+
+		iova += 1UL << idx;
+		paddr += 1UL << idx;
+		size -= 1UL << idx;
+	}
+}
+
+/**
+ * rproc_mem_usage() - account for the host memory a remote processor pins
+ * @rproc: the remote processor
+ * @usage: where to account for it
+ *
+ * Must be called with rproc->lock held.
+ */
+void rproc_mem_usage(struct rproc *rproc, struct rproc_mem_usage *usage)
+{
+	unsigned long pages[BITS_PER_LONG] = { 0 };
+	struct rproc_mem_entry *entry;
+	struct rproc_vring *rvring;
+	struct rproc_vdev *rvdev;
+	struct rproc_hole *hole;
+	int i, faulted;
+
+	memset(usage, 0, sizeof(*usage));
+
+	list_for_each_entry(entry, &rproc->carveouts, node) {
+		if (entry->adopted)
+			continue;
+
+		if (entry->shared) {
+			usage->shared += entry->len;
+			continue;
+		}
+
+		usage->carveouts += entry->len;
+		usage->carveout_pad += rproc_carveout_size(entry) - entry->len;
+	}
+
+	list_for_each_entry(entry, &rproc->mappings, node) {
+		usage->iommu_mapped += entry->len;
+		if (rproc->domain)
+			rproc_count_pgsizes(rproc->domain->ops->pgsize_bitmap,
+				entry->da, entry->dma, entry->len, pages);
+	}
+
+	/* pages faulted into the holes are mapped one by one */
+	list_for_each_entry(hole, &rproc->holes, node) {
+		faulted = bitmap_weight(hole->faulted, hole->len >> PAGE_SHIFT);
+		usage->holes += (size_t)faulted << PAGE_SHIFT;
+		usage->iommu_mapped += (size_t)faulted << PAGE_SHIFT;
+		usage->iommu_ptes += faulted;
+	}
+
+	for (i = 0; i < BITS_PER_LONG; i++)
+		usage->iommu_ptes += pages[i];
+
+	list_for_each_entry(rvdev, &rproc->rvdevs, node) {
+		for (i = 0; i < rvdev->num_vrings; i++) {
+			rvring = &rvdev->vring[i];
+			if (rvring->va && !rvring->fixed && !rvring->adopted)
+				usage->vrings += PAGE_ALIGN(vring_size(
+						rvring->len, rvring->align));
+		}
+
+		usage->vdev_bufs += atomic_long_read(&rvdev->bufs_len);
+	}
+
+	usage->dump = rproc_coredump_size(rproc);
+
+	if (rproc->fw_image)
+		usage->fw_cache = rproc->fw_image->size;
+	if (rproc->standby_image)
+		usage->fw_cache += rproc->standby_image->size;
+
+	usage->total = usage->carveouts + usage->carveout_pad + usage->holes +
+			usage->vrings + usage->vdev_bufs + usage->dump +
+			usage->fw_cache;
+}
+
+/* names of the boot phases, as they're traced and shown in debugfs */
+const char * const rproc_boot_phases[RPROC_BOOT_PHASES] = {
+	[RPROC_BOOT_REQUEST_FW]	= "request_fw",
+	[RPROC_BOOT_CHECK_FW]	= "check_fw",
+	[RPROC_BOOT_RESOURCES]	= "resources",
+	[RPROC_BOOT_LOAD]	= "load",
+	[RPROC_BOOT_START]	= "start",
+	[RPROC_BOOT_READY]	= "ready",
+};
+
+/*
+ * start accounting for the phases of a boot of @rproc.
+ *
+ * Must be called with rproc->lock held, or while booting @rproc (see
+ * RPROC_BOOTING).
+ */
+static void rproc_boot_begin(struct rproc *rproc)
+{
+	memset(rproc->boot_ns, 0, sizeof(rproc->boot_ns));
+	atomic_set(&rproc->boot_ready_pending, 0);
+	rproc->boot_mark = ktime_get();
+	rproc->boot_profiling = true;
+}
+
+/*
+ * account for the time since the last boot phase of @rproc ended, to
+ * @phase, which just ended. Only done while @rproc is being booted.
+ *
+ * Must be called with rproc->lock held, or while booting @rproc (see
+ * RPROC_BOOTING).
+ */
+static void rproc_boot_mark(struct rproc *rproc, enum rproc_boot_phase phase)
+{
+	ktime_t now;
+	s64 ns;
+
+	if (!rproc->boot_profiling)
+		return;
+
+	now = ktime_get();
+	ns = ktime_to_ns(ktime_sub(now, rproc->boot_mark));
+	rproc->boot_mark = now;
+	rproc->boot_ns[phase] += ns;
+
+	trace_rproc_boot_phase(&rproc->dev, rproc_boot_phases[phase], ns);
+}
+
+/* stop accounting for the boot phases, but for the remote's first notice */
+static void rproc_boot_end(struct rproc *rproc, int ret)
+{
+	rproc->boot_profiling = false;
+
+	if (!ret && rproc->state == RPROC_RUNNING)
+		atomic_set(&rproc->boot_ready_pending, 1);
+}
+
+/*
+ * the remote processor notified us for the first time since it was
+ * started: account for the time that took. Called from the vring
+ * notification path, so it may be from atomic context.
+ */
+void rproc_boot_ready(struct rproc *rproc)
+{
+	s64 ns;
+
+	if (!atomic_xchg(&rproc->boot_ready_pending, 0))
+		return;
+
+	ns = ktime_to_ns(ktime_sub(ktime_get(), rproc->boot_mark));
+	rproc->boot_ns[RPROC_BOOT_READY] = ns;
+
+	trace_rproc_boot_phase(&rproc->dev,
+				rproc_boot_phases[RPROC_BOOT_READY], ns);
+}
+
+/*
+ * validate a firmware image: sanity check its format, and then let the rproc
+ * implementation perform its own checks (e.g. of the image's signature),
+ * if any. Images are cached across boots, so this is done once per image.
+ */
+static int rproc_validate_fw(struct rproc *rproc, const struct firmware *fw)
+{
+	int ret;
+
+	ret = rproc_fw_sanity_check(rproc, fw);
+	if (ret < 0)
+		return ret;
+
+	if (!rproc->ops->validate)
+		return 0;
+
+	ret = rproc->ops->validate(rproc, fw);
+	if (ret)
+		dev_err(&rproc->dev, "firmware %s is invalid: %d\n",
+						rproc->firmware, ret);
+
+	return ret;
+}
+
+/* release a firmware image, unless it's the preloaded one, which we keep */
+static void rproc_release_fw(struct rproc *rproc, const struct firmware *fw)
+{
+	if (fw != rproc->preloaded_fw)
+		release_firmware(fw);
+}
+
+/* parse the resource table of @image, which was just found */
+static int rproc_index_fw_image(struct rproc *rproc,
+					struct rproc_fw_image *image)
+{
+	struct rproc_rsc_index *index;
+
+	index = rproc_index_rsc_table(rproc, image->table, image->tablesz);
+	if (IS_ERR(index))
+		return PTR_ERR(index);
+
+	image->rsc_index = index;
+	return 0;
+}
+
+/*
+ * validate a firmware image, and parse out of it what we need in order
+ * to boot its remote processor.
+ *
+ * Packed images can't be used in place: they're parsed, and later on
+ * loaded, by unpacking them on the fly with the streaming fw ops.
+ *
+ * The returned image takes over @fw, which is released on failure.
+ */
+static struct rproc_fw_image *
+rproc_parse_fw(struct rproc *rproc, const struct firmware *fw)
+{
+	struct rproc_fw_image *image;
+
+	if (rproc_validate_fw(rproc, fw))
+		goto release_fw;
+
+	image = kzalloc(sizeof(*image), GFP_KERNEL);
+	if (!image) {
+		dev_err(&rproc->dev, "kzalloc fw image failed\n");
+		goto release_fw;
+	}
+
+	kref_init(&image->refcount);
+	image->rproc = rproc;
+	image->fw = fw;
+	image->size = fw->size;
+
+	/* how its shared carveouts are told apart from those of other images */
+	if (rproc->share_carveouts)
+		image->crc = crc32_le(~0, fw->data, fw->size);
+
+	if (rproc_fw_is_packed(rproc, fw)) {
+		image->packed = true;
+
+		if (!rproc->fw_ops->parse_stream ||
+				rproc->fw_ops->parse_stream(rproc, NULL, image))
+			goto free_image;
+	} else {
+		/* look for the resource table */
+		image->table = rproc_find_rsc_table(rproc, fw,
+							&image->tablesz);
+		if (!image->table)
+			goto free_image;
+
+		image->bootaddr = rproc_get_boot_addr(rproc, fw);
+	}
+
+	/* along with the table, for all the boots of the image */
+	if (rproc_index_fw_image(rproc, image)) {
+		rproc_put_fw_image(image);
+		return NULL;
+	}
+
+	return image;
+
+free_image:
+	kfree(image);
+release_fw:
+	rproc_release_fw(rproc, fw);
+	return NULL;
+}
+
+static void rproc_release_fw_image(struct kref *kref)
+{
+	struct rproc_fw_image *image = container_of(kref,
+					struct rproc_fw_image, refcount);
+	struct rproc *rproc = image->rproc;
+
+	if (!image->fw || image->packed)
+		rproc->fw_ops->free_stream(rproc, image);
+
+	if (image->fw)
+		rproc_release_fw(rproc, image->fw);
+
+	kfree(image->rsc_index);
+	kfree(image);
+}
+
+void rproc_put_fw_image(struct rproc_fw_image *image)
+{
+	kref_put(&image->refcount, rproc_release_fw_image);
+}
+
+/*
+ * hold the firmware file of @rproc in firmware_class' cache, so whenever
+ * it's requested again (e.g. to recover from a crash after the rootfs is
+ * gone, or while the system resumes) it's served from memory. The cache
+ * shares the pages of the image that was just requested, so this doesn't
+ * take another copy of it.
+ *
+ * Must be called with rproc->lock held.
+ */
+static void rproc_pin_fw(struct rproc *rproc)
+{
+	int ret;
+
+	if (rproc->fw_pinned)
+		return;
+
+	ret = cache_firmware(rproc->firmware);
+	if (ret) {
+		dev_warn(&rproc->dev, "can't cache firmware %s: %d\n",
+						rproc->firmware, ret);
+		return;
+	}
+
+	rproc->fw_pinned = true;
+}
+
+/*
+ * make @image, of the @name firmware, the standby image of @rproc, i.e. the
+ * one it's switched to quickly, by rproc_set_firmware(). @image may be NULL
+ * to drop the standby image. A reference to @image is taken.
+ *
+ * Must be called with rproc->lock held.
+ */
+static void rproc_set_standby(struct rproc *rproc,
+				struct rproc_fw_image *image, const char *name)
+{
+	if (rproc->standby_image)
+		rproc_put_fw_image(rproc->standby_image);
+
+	if (image)
+		kref_get(&image->refcount);
+
+	rproc->standby_image = image;
+	rproc->standby_fw = image ? name : NULL;
+}
+
+/* drop @rproc's firmware from firmware_class' cache. Called with the lock */
+static void rproc_unpin_fw(struct rproc *rproc)
+{
+	if (!rproc->fw_pinned)
+		return;
+
+	uncache_firmware(rproc->firmware);
+	rproc->fw_pinned = false;
+}
+
+/*
+ * make @image the cached firmware image of @rproc (@image may be NULL, to
+ * just flush the cache). Images which were requested from firmware_class
+ * are pinned in its cache as well (see rproc_pin_fw()).
+ *
+ * Must be called with rproc->lock held.
+ */
+static void rproc_cache_fw_image(struct rproc *rproc,
+					struct rproc_fw_image *image)
+{
+	if (rproc->fw_image)
+		rproc_put_fw_image(rproc->fw_image);
+
+	if (image)
+		kref_get(&image->refcount);
+
+	rproc->fw_image = image;
+
+	if (image && image->fw && image->fw != rproc->preloaded_fw)
+		rproc_pin_fw(rproc);
+}
+
+/* where firmware files are looked for, just like firmware_class does */
+static const char * const rproc_fw_path[] = {
+	"/lib/firmware/updates/" UTS_RELEASE,
+	"/lib/firmware/updates",
+	"/lib/firmware/" UTS_RELEASE,
+	"/lib/firmware"
+};
+
+/* open the firmware file of @rproc, for streaming it */
+static struct file *rproc_open_fw(struct rproc *rproc)
+{
+	struct file *file = ERR_PTR(-ENOENT);
+	char *path;
+	int i;
+
+	path = __getname();
+	if (!path)
+		return ERR_PTR(-ENOMEM);
+
+	for (i = 0; i < ARRAY_SIZE(rproc_fw_path); i++) {
+		snprintf(path, PATH_MAX, "%s/%s", rproc_fw_path[i],
+							rproc->firmware);
+
+		file = filp_open(path, O_RDONLY, 0);
+		if (!IS_ERR(file))
+			break;
+	}
+
+	__putname(path);
+
+	if (IS_ERR(file))
+		dev_err(&rproc->dev, "can't open %s: %ld\n", rproc->firmware,
+							PTR_ERR(file));
+
+	return file;
+}
+
+/*
+ * parse the firmware file of @rproc, without loading it all: its segments
+ * will be read straight to their destination, upon boot.
+ */
+static struct rproc_fw_image *rproc_parse_fw_stream(struct rproc *rproc)
+{
+	struct rproc_fw_image *image;
+	struct file *file;
+	int ret;
+
+	if (!rproc->fw_ops->parse_stream) {
+		dev_err(&rproc->dev, "fw format can't be streamed\n");
+		return ERR_PTR(-EINVAL);
+	}
+
+	/* we never get to see the whole image */
+	if (rproc->ops->validate) {
+		dev_err(&rproc->dev, "streamed fw can't be validated\n");
+		return ERR_PTR(-EINVAL);
+	}
+
+	image = kzalloc(sizeof(*image), GFP_KERNEL);
+	if (!image) {
+		dev_err(&rproc->dev, "kzalloc fw image failed\n");
+		return ERR_PTR(-ENOMEM);
+	}
+
+	file = rproc_open_fw(rproc);
+	if (IS_ERR(file)) {
+		ret = PTR_ERR(file);
+		goto free_image;
+	}
+
+	ret = rproc->fw_ops->parse_stream(rproc, file, image);
+
+	fput(file);
+
+	if (ret)
+		goto free_image;
+
+	kref_init(&image->refcount);
+	image->rproc = rproc;
+
+	ret = rproc_index_fw_image(rproc, image);
+	if (ret) {
+		rproc_put_fw_image(image);
+		return ERR_PTR(ret);
+	}
+
+	return image;
+
+free_image:
+	kfree(image);
+	return ERR_PTR(ret);
+}
+
+/*
+ * stream the segments of @image straight from the firmware file, or unpack
+ * them straight out of @image if it's packed
+ */
+static int rproc_stream_segments(struct rproc *rproc,
+					struct rproc_fw_image *image)
+{
+	struct file *file;
+	int ret;
+
+	if (image->packed)
+		return rproc->fw_ops->load_stream(rproc, NULL, image);
+
+	file = rproc_open_fw(rproc);
+	if (IS_ERR(file))
+		return PTR_ERR(file);
+
+	ret = rproc->fw_ops->load_stream(rproc, file, image);
+
+	fput(file);
+
+	return ret;
+}
+
+/* make @image the cached firmware image of @rproc, taking rproc->lock */
+static void rproc_cache_fw_image_locked(struct rproc *rproc,
+					struct rproc_fw_image *image)
+{
+	mutex_lock(&rproc->lock);
+	rproc_cache_fw_image(rproc, image);
+	mutex_unlock(&rproc->lock);
+}
+
+/*
+ * get the firmware image of @rproc: the cached one, if any, or otherwise
+ * a freshly loaded one, which is then cached for subsequent boots.
+ *
+ * Must be called with rproc->fw_lock held, but without rproc->lock: the
+ * firmware is read (and parsed) without the latter, which is only taken as
+ * the cache is looked at and updated. The returned image must be put with
+ * rproc_put_fw_image(). Returns an ERR_PTR value on failure.
+ */
+static struct rproc_fw_image *rproc_get_fw_image(struct rproc *rproc)
+{
+	struct rproc_fw_image *image;
+	const struct firmware *fw;
+	size_t size;
+	void *dst;
+	int ret;
+
+	mutex_lock(&rproc->lock);
+	image = rproc->fw_image;
+	if (image)
+		kref_get(&image->refcount);
+	mutex_unlock(&rproc->lock);
+
+	if (image)
+		return image;
+
+	/* a preloaded image is always there: parse it again */
+	if (rproc->preloaded_fw) {
+		image = rproc_parse_fw(rproc, rproc->preloaded_fw);
+		if (!image)
+			return ERR_PTR(-EINVAL);
+
+		rproc_boot_mark(rproc, RPROC_BOOT_CHECK_FW);
+		rproc_cache_fw_image_locked(rproc, image);
+		return image;
+	}
+
+	/* a streamed image is read as it's parsed, and then as it's loaded */
+	if (rproc->stream_fw) {
+		image = rproc_parse_fw_stream(rproc);
+		if (!IS_ERR(image)) {
+			rproc_boot_mark(rproc, RPROC_BOOT_CHECK_FW);
+			rproc_cache_fw_image_locked(rproc, image);
+		}
+		return image;
+	}
+
+	/* a raw image may be read right where the remote processor runs it */
+	dst = rproc_fw_load_buf(rproc, &size);
+	if (dst)
+		ret = request_firmware_into_buf(&fw, rproc->firmware,
+						&rproc->dev, dst, size);
+	else
+		ret = request_firmware(&fw, rproc->firmware, &rproc->dev);
+	if (ret < 0) {
+		dev_err(&rproc->dev, "request_firmware failed: %d\n", ret);
+		return ERR_PTR(ret);
+	}
+
+	rproc_boot_mark(rproc, RPROC_BOOT_REQUEST_FW);
+
+	image = rproc_parse_fw(rproc, fw);
+	if (!image)
+		return ERR_PTR(-EINVAL);
+
+	rproc_boot_mark(rproc, RPROC_BOOT_CHECK_FW);
+
+	/*
+	 * an image that's loaded in place is overwritten as it runs, so it
+	 * can't be cached; nor can it be unpacked onto itself
+	 */
+	if (dst) {
+		if (image->packed) {
+			dev_err(&rproc->dev, "can't unpack fw in place\n");
+			rproc_put_fw_image(image);
+			return ERR_PTR(-EINVAL);
+		}
+		return image;
+	}
+
+	rproc_cache_fw_image_locked(rproc, image);
+
+	return image;
+}
+
+/**
+ * rproc_flush_fw_cache() - forget about the cached firmware image
+ * @rproc: the remote processor
+ *
+ * The firmware image of a remote processor is only loaded (and parsed) once,
+ * and then cached, so subsequent boots don't have to go through all that
+ * again.
+ *
+ * This function drops the cached image, so the firmware is loaded anew upon
+ * the next boot of @rproc (e.g. because it was updated in the meantime).
+ * @rproc keeps on running its current firmware until then.
+ */
+void rproc_flush_fw_cache(struct rproc *rproc)
+{
+	/* an image that's being read would be cached right after */
+	mutex_lock(&rproc->fw_lock);
+	mutex_lock(&rproc->lock);
+	rproc_cache_fw_image(rproc, NULL);
+	rproc_unpin_fw(rproc);
+	rproc_set_standby(rproc, NULL, NULL);
+	mutex_unlock(&rproc->lock);
+	mutex_unlock(&rproc->fw_lock);
+}
+EXPORT_SYMBOL(rproc_flush_fw_cache);
+
+/**
+ * rproc_preload_fw() - load the firmware image of a remote processor now
+ * @rproc: the remote processor
+ *
+ * Loads, validates and caches the firmware image of @rproc right away,
+ * instead of upon its next boot, and pins its file in firmware_class'
+ * cache. Boots that come later (e.g. resuming the system, or recovering
+ * from a crash) then never touch the filesystem, until the image is
+ * dropped with rproc_flush_fw_cache(). Calling it again after a flush
+ * picks up the current firmware file.
+ *
+ * The segments of streamed firmware (see rproc->stream_fw) are still read
+ * straight from its file on every boot: only its headers are preloaded.
+ *
+ * Returns 0 on success, and an appropriate error value otherwise.
+ */
+int rproc_preload_fw(struct rproc *rproc)
+{
+	struct rproc_fw_image *image;
+	int ret;
+
+	ret = mutex_lock_interruptible(&rproc->fw_lock);
+	if (ret)
+		return ret;
+
+	if (!rproc->firmware) {
+		ret = -EINVAL;
+		goto unlock;
+	}
+
+	image = rproc_get_fw_image(rproc);
+	if (IS_ERR(image)) {
+		ret = PTR_ERR(image);
+		goto unlock;
+	}
+
+	rproc_put_fw_image(image);
+
+unlock:
+	mutex_unlock(&rproc->fw_lock);
+	return ret;
+}
+EXPORT_SYMBOL(rproc_preload_fw);
+
+/* load and validate the image rproc_prefetch_fw() asked for, as standby */
+static void rproc_prefetch_work(struct work_struct *work)
+{
+	struct rproc *rproc = container_of(work, struct rproc, prefetch_work);
+	struct rproc_fw_image *image;
+	const struct firmware *fw;
+	const char *name;
+	int ret;
+
+	mutex_lock(&rproc->lock);
+	name = rproc->prefetch_fw;
+	rproc->prefetch_fw = NULL;
+	/* nothing to do if it's the current or the standby image already */
+	if (name && rproc->fw_image && !strcmp(name, rproc->firmware))
+		name = NULL;
+	if (name && rproc->standby_fw && !strcmp(name, rproc->standby_fw))
+		name = NULL;
+	mutex_unlock(&rproc->lock);
+
+	if (!name)
+		return;
+
+	ret = request_firmware(&fw, name, &rproc->dev);
+	if (ret < 0) {
+		dev_err(&rproc->dev, "can't prefetch %s: %d\n", name, ret);
+		return;
+	}
+
+	/* this releases @fw on failure */
+	image = rproc_parse_fw(rproc, fw);
+	if (!image)
+		return;
+
+	mutex_lock(&rproc->lock);
+	rproc_set_standby(rproc, image, name);
+	mutex_unlock(&rproc->lock);
+
+	rproc_put_fw_image(image);
+
+	dev_dbg(&rproc->dev, "prefetched %s\n", name);
+}
+
+/**
+ * rproc_prefetch_fw() - load an alternate firmware image in the background
+ * @rproc: the remote processor
+ * @firmware: name of the firmware file to prefetch
+ *
+ * Remote processors that switch between firmwares at runtime (e.g. a DSP
+ * running either voice or music codecs) would pay for loading and
+ * validating the image upon every switch. This function has @firmware
+ * loaded and validated in the background instead, and kept as the standby
+ * image of @rproc, which rproc_set_firmware() then switches to without
+ * going through all that again.
+ *
+ * There is a single standby image: prefetching another firmware replaces
+ * it. @firmware must stay valid for as long as @rproc may use it.
+ *
+ * Streamed firmware, and images which are loaded in place, aren't kept in
+ * memory, so they can't be prefetched.
+ *
+ * Returns 0 if the image is being prefetched (or is already there), and an
+ * appropriate error value otherwise. Failures to load or validate the image
+ * are only logged: the next boot then loads it as usual.
+ */
+int rproc_prefetch_fw(struct rproc *rproc, const char *firmware)
+{
+	if (!firmware || rproc->preloaded_fw || rproc->stream_fw ||
+						rproc->fw_ops->load_buf)
+		return -EINVAL;
+
+	mutex_lock(&rproc->lock);
+	rproc->prefetch_fw = firmware;
+	mutex_unlock(&rproc->lock);
+
+	schedule_work(&rproc->prefetch_work);
+
+	return 0;
+}
+EXPORT_SYMBOL(rproc_prefetch_fw);
+
+/**
+ * rproc_set_firmware() - switch the firmware a remote processor boots with
+ * @rproc: the remote processor
+ * @firmware: name of the firmware file to boot @rproc with from now on
+ *
+ * The new firmware is used upon the next boot of @rproc, which must be
+ * powered off (i.e. shut down by all its users) in the meantime.
+ *
+ * If @firmware was prefetched (see rproc_prefetch_fw()), its image becomes
+ * the cached one right away, so the next boot only has to copy it into place
+ * (and, with 'keep_resources', not even to set up its resources again if it
+ * was booted last). A prefetch that is still in flight is waited for. The
+ * image that was cached until then becomes the standby one instead, so
+ * switching back is just as quick.
+ *
+ * @firmware must stay valid for as long as @rproc may use it.
+ *
+ * Returns 0 on success, -EBUSY if @rproc is powered on, and an appropriate
+ * error value otherwise.
+ */
+int rproc_set_firmware(struct rproc *rproc, const char *firmware)
+{
+	struct rproc_fw_image *image, *standby;
+	const char *name;
+	int ret;
+
+	if (!firmware || rproc->preloaded_fw)
+		return -EINVAL;
+
+	flush_work(&rproc->prefetch_work);
+
+	/* an image of the current firmware may be being read */
+	ret = mutex_lock_interruptible(&rproc->fw_lock);
+	if (ret)
+		return ret;
+
+	mutex_lock(&rproc->lock);
+
+	if (atomic_read(&rproc->power) || rproc->state == RPROC_BOOTING) {
+		ret = -EBUSY;
+		goto unlock;
+	}
+
+	if (rproc->firmware && !strcmp(firmware, rproc->firmware)) {
+		rproc->firmware = firmware;
+		goto unlock;
+	}
+
+	/* take the cached and standby images (and their references) over */
+	image = rproc->fw_image;
+	name = rproc->firmware;
+	standby = rproc->standby_image;
+	if (standby && strcmp(firmware, rproc->standby_fw)) {
+		rproc_put_fw_image(standby);
+		standby = NULL;
+	}
+
+	rproc_unpin_fw(rproc);
+	rproc->fw_image = NULL;
+	rproc->standby_image = NULL;
+	rproc->standby_fw = NULL;
+
+	rproc->firmware = firmware;
 
-		handler = rproc_handle_rsc[hdr->type];
-		if (!handler)
-			continue;
+	if (standby) {
+		rproc_cache_fw_image(rproc, standby);
+		rproc_put_fw_image(standby);
+	}
 
-		ret = handler(rproc, rsc, avail);
-		if (ret)
-			break;
+	/* keep the image we switched away from warm, to switch back to it */
+	if (image) {
+		rproc_set_standby(rproc, image, name);
+		rproc_put_fw_image(image);
 	}
 
+	dev_info(&rproc->dev, "switched to firmware %s%s\n", firmware,
+					standby ? " (prefetched)" : "");
+
+unlock:
+	mutex_unlock(&rproc->lock);
+	mutex_unlock(&rproc->fw_lock);
 	return ret;
 }
+EXPORT_SYMBOL(rproc_set_firmware);
 
-/* handle firmware resource entries while registering the remote processor */
-static int
-rproc_handle_virtio_rsc(struct rproc *rproc, struct resource_table *table, int len)
+/*
+ * release the resources that were kept resident across power cycles (see
+ * rproc->keep_resources), if any.
+ *
+ * Must be called with rproc->lock held, while @rproc is powered off.
+ */
+static void rproc_release_resident(struct rproc *rproc)
 {
-	struct device *dev = &rproc->dev;
-	int ret = 0, i;
+	if (!rproc->resident_image)
+		return;
 
-	for (i = 0; i < table->num; i++) {
-		int offset = table->offset[i];
-		struct fw_rsc_hdr *hdr = (void *)table + offset;
-		int avail = len - offset - sizeof(*hdr);
-		struct fw_rsc_vdev *vrsc;
+	rproc_resource_cleanup(rproc);
 
-		/* make sure table isn't truncated */
-		if (avail < 0) {
-			dev_err(dev, "rsc table is truncated\n");
-			return -EINVAL;
-		}
+	rproc_put_fw_image(rproc->resident_image);
+	rproc->resident_image = NULL;
+}
 
-		dev_dbg(dev, "%s: rsc type %d\n", __func__, hdr->type);
+/* write back what was set up for a vdev to its entry in a resource table */
+static void rproc_publish_vdev(struct rproc_vdev *rvdev,
+						struct fw_rsc_vdev *vrsc)
+{
+	int i;
 
-		if (hdr->type != RSC_VDEV)
-			continue;
+	vrsc->gfeatures = rvdev->gfeatures;
 
-		vrsc = (struct fw_rsc_vdev *)hdr->data;
+	for (i = 0; i < vrsc->num_of_vrings && i < rvdev->num_vrings; i++) {
+		struct fw_rsc_vdev_vring *vring = &vrsc->vring[i];
+		struct rproc_vring *rvring = &rvdev->vring[i];
 
-		ret = rproc_handle_vdev(rproc, vrsc, avail);
-		if (ret)
-			break;
+		/* only the vrings whose virtqueue is set up have a place */
+		if (!rvring->vq)
+			continue;
+
+		if (vring->da == (u32)FW_RSC_ADDR_ANY)
+			vring->da = rvring->dma;
+		if (vring->notifyid == FW_RSC_NOTIFY_ID_ANY)
+			vring->notifyid = rvring->notifyid;
 	}
 
-	return ret;
+	/* what the driver wrote to the config space, and its status */
+	if (vrsc->num_of_vrings == rvdev->num_vrings &&
+				vrsc->config_len == rvdev->config_len)
+		memcpy(&vrsc->vring[vrsc->num_of_vrings], rvdev->config,
+							rvdev->config_len);
+	vrsc->status = rvdev->status;
 }
 
-/**
- * rproc_resource_cleanup() - clean up and free all acquired resources
- * @rproc: rproc handle
+/*
+ * let the remote processor know what was set up for its vdevs, by writing
+ * it back to their entries in @table, which it's booted with: the features
+ * which were negotiated (e.g. whether to use event indices on their
+ * vrings), and the device addresses and notifyids which were dynamically
+ * allocated for their vrings and IPC regions
  *
- * This function will free all resources acquired for @rproc, and it
- * is called whenever @rproc either shuts down or fails to boot.
+ * @table is the table @index was parsed out of, or a copy of it.
  */
-static void rproc_resource_cleanup(struct rproc *rproc)
+static void rproc_publish_vdevs(struct rproc *rproc,
+		struct resource_table *table, struct rproc_rsc_index *index)
 {
-	struct rproc_mem_entry *entry, *tmp;
-	struct device *dev = &rproc->dev;
+	struct rproc_rsc_entry *ent;
+	struct fw_rsc_ipcmem *ipc;
+	struct fw_rsc_vdev *vrsc;
+	struct rproc_vdev *rvdev;
 
-	/* clean up debugfs trace entries */
-	list_for_each_entry_safe(entry, tmp, &rproc->traces, node) {
-		rproc_remove_trace_file(entry->priv);
-		rproc->num_traces--;
-		list_del(&entry->node);
-		kfree(entry);
+	rproc_for_each_rsc(index, ent, RSC_IPCMEM) {
+		ipc = rproc_rsc_data(table, ent);
+		if (ent->avail < (int)sizeof(*ipc))
+			continue;
+
+		list_for_each_entry(rvdev, &rproc->rvdevs, node)
+			if (rvdev->notifyid == ipc->notifyid && rvdev->ipc_va)
+				ipc->da = rvdev->ipc_dma;
 	}
 
-	/* clean up carveout allocations */
-	list_for_each_entry_safe(entry, tmp, &rproc->carveouts, node) {
-		dma_free_coherent(dev->parent, entry->len, entry->va, entry->dma);
-		list_del(&entry->node);
-		kfree(entry);
+	rproc_for_each_rsc(index, ent, RSC_VDEV) {
+		vrsc = rproc_rsc_data(table, ent);
+
+		list_for_each_entry(rvdev, &rproc->rvdevs, node)
+			if (rvdev->vdev.id.device == vrsc->id &&
+					rvdev->notifyid == vrsc->notifyid)
+				rproc_publish_vdev(rvdev, vrsc);
 	}
+}
 
-	/* clean up iommu mapping entries */
-	list_for_each_entry_safe(entry, tmp, &rproc->mappings, node) {
-		size_t unmapped;
+/* run the ->prepare() handler, in the background of a boot */
+static void rproc_prepare_work(struct work_struct *work)
+{
+	struct rproc *rproc = container_of(work, struct rproc, prepare_work);
 
-		unmapped = iommu_unmap(rproc->domain, entry->da, entry->len);
-		if (unmapped != entry->len) {
-			/* nothing much to do besides complaining */
-			dev_err(dev, "failed to unmap %u/%zu\n", entry->len,
-								unmapped);
-		}
+	rproc->prepare_ret = rproc->ops->prepare(rproc);
+	rproc->prepared = !rproc->prepare_ret;
+}
 
-		list_del(&entry->node);
-		kfree(entry);
-	}
+/*
+ * start powering up what @rproc needs to be booted, while its firmware
+ * image is read and loaded.
+ *
+ * Must be called with rproc->lock held.
+ */
+static void rproc_prepare(struct rproc *rproc)
+{
+	rproc->prepare_ret = 0;
+
+	if (rproc->ops->prepare)
+		queue_work(system_unbound_wq, &rproc->prepare_work);
+}
+
+/* wait for what rproc_prepare() started, and tell how it went */
+static int rproc_prepare_wait(struct rproc *rproc)
+{
+	flush_work(&rproc->prepare_work);
+
+	return rproc->prepare_ret;
+}
+
+/*
+ * undo rproc_prepare(), once @rproc is powered off (or not booted after all)
+ *
+ * Must be called with rproc->lock held.
+ */
+static void rproc_unprepare(struct rproc *rproc)
+{
+	rproc_prepare_wait(rproc);
+
+	if (!rproc->prepared)
+		return;
+
+	if (rproc->ops->unprepare)
+		rproc->ops->unprepare(rproc);
+	rproc->prepared = false;
+}
+
+/* undo rproc_fw_load(), unless the resources should stay resident */
+static void rproc_fw_unload(struct rproc *rproc)
+{
+	if (rproc->resident_image)
+		rproc_release_resident(rproc);
+	else
+		rproc_resource_cleanup(rproc);
 }
 
 /*
- * take a firmware and boot a remote processor with it.
+ * set up the resources of @image, load it, and wait until the remote
+ * processor is prepared: all that's left to do then is to start it (see
+ * rproc_fw_start()).
+ *
+ * If the resources of @image are still resident from a previous boot, they
+ * are reused as is: only the segments are loaded again.
  */
-static int rproc_fw_boot(struct rproc *rproc, const struct firmware *fw)
+static int rproc_fw_load(struct rproc *rproc, struct rproc_fw_image *image)
 {
+	struct rproc_mem_entry *entry;
 	struct device *dev = &rproc->dev;
-	const char *name = rproc->firmware;
-	struct resource_table *table;
-	int ret, tablesz;
+	int ret, i;
 
-	ret = rproc_fw_sanity_check(rproc, fw);
-	if (ret)
-		return ret;
+	if (rproc->resident_image == image)
+		goto load;
+
+	/* the firmware image changed: its resources must be set up anew */
+	rproc_release_resident(rproc);
 
-	dev_info(dev, "Booting fw image %s, size %zd\n", name, fw->size);
+	if (rproc->rsc_table_fw) {
+		ret = rproc_match_vdevs(rproc, image->table, image->rsc_index);
+		if (ret)
+			return ret;
+	}
 
 	/*
 	 * if enabling an IOMMU isn't relevant for this rproc, this is
@@ -826,29 +4400,94 @@ static int rproc_fw_boot(struct rproc *rproc, const struct firmware *fw)
 		return ret;
 	}
 
-	rproc->bootaddr = rproc_get_boot_addr(rproc, fw);
-
-	/* look for the resource table */
-	table = rproc_find_rsc_table(rproc, fw, &tablesz);
-	if (!table) {
-		ret = -EINVAL;
-		goto clean_up;
-	}
+	/* all the cores boot at the entry point, unless told otherwise */
+	rproc->bootaddr = image->bootaddr;
+	for (i = 0; i < rproc->num_cores; i++)
+		rproc->core_bootaddr[i] = image->bootaddr;
+	rproc->fw_crc = image->crc;
 
 	/* handle fw resources which are required to boot rproc */
-	ret = rproc_handle_boot_rsc(rproc, table, tablesz);
+	ret = rproc_handle_boot_rsc(rproc, image->table, image->rsc_index);
 	if (ret) {
 		dev_err(dev, "Failed to process resources: %d\n", ret);
 		goto clean_up;
 	}
 
-	/* load the ELF segments to memory */
-	ret = rproc_load_segments(rproc, fw);
+	if (rproc->keep_resources) {
+		kref_get(&image->refcount);
+		rproc->resident_image = image;
+	}
+
+	rproc_boot_mark(rproc, RPROC_BOOT_RESOURCES);
+
+load:
+	rproc_publish_vdevs(rproc, image->table, image->rsc_index);
+
+	/*
+	 * load the ELF segments to memory, unless the memory is restored as
+	 * it was left instead (see rproc_snapshot_restore() below)
+	 */
+	if (rproc->snapshot_valid)
+		ret = 0;
+	else if (image->fw && !image->packed)
+		ret = rproc_load_segments(rproc, image->fw);
+	else
+		ret = rproc_stream_segments(rproc, image);
 	if (ret) {
 		dev_err(dev, "Failed to load program segments: %d\n", ret);
 		goto clean_up;
 	}
 
+	rproc_boot_mark(rproc, RPROC_BOOT_LOAD);
+
+	/* the other remote processors needn't load their shared carveouts */
+	rproc_shared_carveouts_loaded(rproc);
+
+	ret = rproc_map_carveouts(rproc);
+	if (ret)
+		goto clean_up;
+
+	rproc_boot_mark(rproc, RPROC_BOOT_RESOURCES);
+
+	/* the carveouts are now going to be used */
+	list_for_each_entry(entry, &rproc->carveouts, node)
+		entry->fresh = false;
+
+	/* whatever it needs was powered up while the image was loaded */
+	ret = rproc_prepare_wait(rproc);
+	if (ret) {
+		dev_err(dev, "can't prepare rproc %s: %d\n", rproc->name, ret);
+		goto clean_up;
+	}
+
+	return 0;
+
+clean_up:
+	rproc_fw_unload(rproc);
+	return ret;
+}
+
+/* start a remote processor, once rproc_fw_load() loaded @image into it */
+static int rproc_fw_start(struct rproc *rproc, struct rproc_fw_image *image)
+{
+	struct resource_table *table;
+	struct device *dev = &rproc->dev;
+	int ret;
+
+	table = rproc_locate_rsc_table(rproc, image);
+	if (table)
+		rproc_share_vdevs(rproc, table, image->rsc_index);
+
+	/* its memories are powered up again, and can be restored */
+	if (rproc->snapshot_valid)
+		rproc_snapshot_restore(rproc, table, image);
+
+	/* it may ask for its overlays as soon as it starts */
+	rproc_overlay_start(rproc, image);
+
+	/* and for more memory, starting over from its carveouts */
+	rproc_dynmem_start(rproc);
+
 	/* power up the remote processor */
 	ret = rproc->ops->start(rproc);
 	if (ret) {
@@ -856,18 +4495,247 @@ static int rproc_fw_boot(struct rproc *rproc, const struct firmware *fw)
 		goto clean_up;
 	}
 
+	rproc_boot_mark(rproc, RPROC_BOOT_START);
+
 	rproc->state = RPROC_RUNNING;
+	rproc_watchdog_start(rproc);
 
 	dev_info(dev, "remote processor %s is now up\n", rproc->name);
 
 	return 0;
 
+clean_up:
+	rproc_fw_unload(rproc);
+	return ret;
+}
+
+/* take a firmware image and boot a remote processor with it */
+static int rproc_fw_boot(struct rproc *rproc, struct rproc_fw_image *image)
+{
+	int ret;
+
+	dev_info(&rproc->dev, "Booting fw image %s, size %zd\n",
+					rproc->firmware, image->size);
+
+	ret = rproc_fw_load(rproc, image);
+	if (ret)
+		return ret;
+
+	return rproc_fw_start(rproc, image);
+}
+
+/*
+ * have @rproc booted (or armed) by the caller, which may then drop
+ * rproc->lock while it reads the firmware: meanwhile, other rproc_boot()
+ * callers wait for it (see RPROC_BOOTING), and crashes are ignored.
+ *
+ * Must be called with rproc->lock held.
+ */
+static void rproc_begin_booting(struct rproc *rproc)
+{
+	INIT_COMPLETION(rproc->boot_done);
+	rproc->state = RPROC_BOOTING;
+}
+
+/*
+ * undo rproc_begin_booting(): @rproc goes back to @state, unless it was
+ * booted (or armed) in the meantime, and those waiting for it are woken.
+ *
+ * Must be called with rproc->lock held.
+ */
+static void rproc_end_booting(struct rproc *rproc, enum rproc_state state)
+{
+	if (rproc->state == RPROC_BOOTING)
+		rproc->state = state;
+
+	complete_all(&rproc->boot_done);
+}
+
+/*
+ * take over a remote processor that is running already (see
+ * RPROC_DETACHED): it's neither reset nor loaded, and its resources are
+ * adopted as they are, straight out of the resource table it uses.
+ *
+ * Must be called with rproc->lock held.
+ */
+static int rproc_attach(struct rproc *rproc)
+{
+	struct device *dev = &rproc->dev;
+	struct rproc_rsc_index *index;
+	struct resource_table *table;
+	int tablesz, ret;
+
+	table = rproc->ops->find_loaded_rsc_table(rproc, &tablesz);
+	if (!table) {
+		dev_err(dev, "can't find the rsc table of %s\n", rproc->name);
+		return -EINVAL;
+	}
+
+	index = rproc_index_rsc_table(rproc, table, tablesz);
+	if (IS_ERR(index))
+		return PTR_ERR(index);
+
+	ret = rproc_handle_boot_rsc(rproc, table, index);
+	if (ret) {
+		dev_err(dev, "Failed to adopt resources: %d\n", ret);
+		goto clean_up;
+	}
+
+	rproc_share_vdevs(rproc, table, index);
+
+	ret = rproc->ops->attach(rproc);
+	if (ret) {
+		dev_err(dev, "can't attach to %s: %d\n", rproc->name, ret);
+		goto clean_up;
+	}
+
+	rproc->state = RPROC_RUNNING;
+	rproc_watchdog_start(rproc);
+
+	dev_info(dev, "attached to remote processor %s\n", rproc->name);
+
+	kfree(index);
+	return 0;
+
 clean_up:
 	rproc_resource_cleanup(rproc);
-	rproc_disable_iommu(rproc);
+	kfree(index);
+	return ret;
+}
+
+/*
+ * undo rproc_arm_work(), if @rproc is an armed hot spare
+ *
+ * Must be called with rproc->lock held.
+ */
+static void rproc_disarm(struct rproc *rproc)
+{
+	if (rproc->state != RPROC_ARMED)
+		return;
+
+	rproc_unprepare(rproc);
+	rproc_fw_unload(rproc);
+
+	rproc_put_fw_image(rproc->armed_image);
+	rproc->armed_image = NULL;
+	rproc->state = RPROC_OFFLINE;
+
+	dev_info(&rproc->dev, "hot spare %s disarmed\n", rproc->name);
+}
+
+/*
+ * start an armed hot spare, which takes over: it's loaded already, so only
+ * what was set up for its vdevs since (they're registered as it takes over)
+ * is left to let it know about, in the resource table it's started with.
+ *
+ * Must be called with rproc->lock held.
+ */
+static int rproc_spare_start(struct rproc *rproc)
+{
+	struct rproc_fw_image *image = rproc->armed_image;
+	struct resource_table *table;
+	int ret;
+
+	dev_info(&rproc->dev, "hot spare %s takes over\n", rproc->name);
+
+	rproc->armed_image = NULL;
+	rproc->state = RPROC_OFFLINE;
+
+	rproc_publish_vdevs(rproc, image->table, image->rsc_index);
+
+	table = rproc_locate_rsc_table(rproc, image);
+	if (table)
+		rproc_publish_vdevs(rproc, table, image->rsc_index);
+
+	ret = rproc_fw_start(rproc, image);
+	if (ret)
+		rproc_unprepare(rproc);
+
+	rproc_put_fw_image(image);
 	return ret;
 }
 
+/*
+ * arm the hot spare of a failover pair: load it with its firmware, and
+ * leave it in reset, so it can take over as soon as the active one of the
+ * pair crashes (see RPROC_ARMED). This is done in the background, once
+ * the active one is booted, or once it's the crashed one that's the spare.
+ */
+static void rproc_arm_work(struct work_struct *work)
+{
+	struct rproc *rproc = container_of(work, struct rproc, arm_work);
+	struct rproc_fw_image *image;
+	struct device *dev = &rproc->dev;
+	bool spare;
+	int ret;
+
+	mutex_lock(&rproc_failover_lock);
+	spare = rproc->spare;
+	mutex_unlock(&rproc_failover_lock);
+
+	mutex_lock(&rproc->fw_lock);
+	mutex_lock(&rproc->lock);
+
+	/* it may have been booted (or armed) in the meantime */
+	if (!spare || rproc->state != RPROC_OFFLINE ||
+				atomic_read(&rproc->power) || !rproc->firmware)
+		goto unlock;
+
+	/* its firmware is read without the lock, which rproc_boot() waits */
+	rproc_begin_booting(rproc);
+	rproc_prepare(rproc);
+
+	mutex_unlock(&rproc->lock);
+	image = rproc_get_fw_image(rproc);
+	mutex_lock(&rproc->lock);
+
+	if (IS_ERR(image)) {
+		ret = PTR_ERR(image);
+		goto unprepare;
+	}
+
+	ret = rproc_fw_load(rproc, image);
+	if (ret)
+		goto put_image;
+
+	/* that's where it learns about its vdevs, as it takes over */
+	if (!rproc_locate_rsc_table(rproc, image)) {
+		dev_err(dev, "can't find the loaded rsc table of %s\n",
+								rproc->name);
+		ret = -EINVAL;
+		rproc_fw_unload(rproc);
+		goto put_image;
+	}
+
+	rproc->armed_image = image;
+	rproc_end_booting(rproc, RPROC_ARMED);
+
+	dev_info(dev, "hot spare %s is armed\n", rproc->name);
+
+	mutex_unlock(&rproc->lock);
+	mutex_unlock(&rproc->fw_lock);
+	return;
+
+put_image:
+	rproc_put_fw_image(image);
+unprepare:
+	rproc_unprepare(rproc);
+	rproc_end_booting(rproc, RPROC_OFFLINE);
+	dev_err(dev, "can't arm hot spare %s: %d\n", rproc->name, ret);
+unlock:
+	mutex_unlock(&rproc->lock);
+	mutex_unlock(&rproc->fw_lock);
+}
+
+/* arm the hot spare of @rproc, if it's the active one of a failover pair */
+static void rproc_arm_spare(struct rproc *rproc)
+{
+	mutex_lock(&rproc_failover_lock);
+	if (rproc->failover && !rproc->spare)
+		schedule_work(&rproc->failover->arm_work);
+	mutex_unlock(&rproc_failover_lock);
+}
+
 /*
  * take a firmware and look for virtio devices to register.
  *
@@ -876,49 +4744,177 @@ clean_up:
  * to unregister the device. one other option is just to use kref here,
  * that might be cleaner).
  */
-static void rproc_fw_config_virtio(const struct firmware *fw, void *context)
+static void rproc_fw_config_virtio(const struct firmware *fw, void *context)
+{
+	struct rproc *rproc = context;
+	struct rproc_fw_image *image;
+
+	image = rproc_parse_fw(rproc, fw);
+	if (!image)
+		goto out;
+
+	/*
+	 * keep the image around, so booting the remote processor (which
+	 * registering its virtio devices is likely to trigger) doesn't have
+	 * to load it again. This isn't done if the firmware is streamed, or
+	 * read in place (see rproc_fw_load_buf()), since we don't want to
+	 * keep a whole copy of it in those cases.
+	 */
+	mutex_lock(&rproc->lock);
+	rproc_cache_fw_image(rproc, rproc->stream_fw ||
+				rproc->fw_ops->load_buf ? NULL : image);
+	mutex_unlock(&rproc->lock);
+
+	/* look for virtio devices and register them */
+	rproc_handle_virtio_rsc(rproc, image->table, image->rsc_index);
+
+	rproc_put_fw_image(image);
+out:
+	/* allow rproc_del() contexts, if any, to proceed */
+	complete_all(&rproc->firmware_loading_complete);
+}
+
+/*
+ * take a copy of the resource table of the firmware (see rproc->rsc_table_fw)
+ * and look for virtio devices to register: the image itself is only read
+ * once the remote processor is booted. If there's no such copy, the image
+ * is read right away instead, as usual.
+ */
+static void rproc_rsc_fw_config_virtio(const struct firmware *fw,
+							void *context)
 {
 	struct rproc *rproc = context;
+	struct device *dev = &rproc->dev;
+	struct rproc_rsc_index *index;
 	struct resource_table *table;
-	int ret, tablesz;
+	int ret;
 
-	if (rproc_fw_sanity_check(rproc, fw) < 0)
-		goto out;
+	if (!fw) {
+		dev_warn(dev, "no %s, looking for vdevs in %s\n",
+					rproc->rsc_table_fw, rproc->firmware);
 
-	/* look for the resource table */
-	table = rproc_find_rsc_table(rproc, fw,  &tablesz);
-	if (!table)
-		goto out;
+		ret = request_firmware_nowait(THIS_MODULE, FW_ACTION_HOTPLUG,
+					rproc->firmware, dev, GFP_KERNEL,
+					rproc, rproc_fw_config_virtio);
+		if (ret < 0) {
+			dev_err(dev, "request_firmware_nowait err: %d\n", ret);
+			complete_all(&rproc->firmware_loading_complete);
+		}
+		return;
+	}
 
-	/* look for virtio devices and register them */
-	ret = rproc_handle_virtio_rsc(rproc, table, tablesz);
-	if (ret)
-		goto out;
+	/* it's only read from: the vdevs keep copies of what they need */
+	table = (struct resource_table *)fw->data;
+	if (fw->size <= INT_MAX && !rproc_check_rsc_table(rproc, table,
+								fw->size)) {
+		index = rproc_index_rsc_table(rproc, table, fw->size);
+		if (!IS_ERR(index)) {
+			rproc_handle_virtio_rsc(rproc, table, index);
+			kfree(index);
+		}
+	}
 
-out:
 	release_firmware(fw);
+
 	/* allow rproc_del() contexts, if any, to proceed */
 	complete_all(&rproc->firmware_loading_complete);
 }
 
+/* look for the virtio devices of a detached remote processor */
+static int rproc_detached_config_virtio(struct rproc *rproc)
+{
+	struct rproc_rsc_index *index;
+	struct resource_table *table;
+	int tablesz;
+
+	table = rproc->ops->find_loaded_rsc_table(rproc, &tablesz);
+	if (!table) {
+		dev_err(&rproc->dev, "can't find the rsc table of %s\n",
+								rproc->name);
+		return -EINVAL;
+	}
+
+	index = rproc_index_rsc_table(rproc, table, tablesz);
+	if (IS_ERR(index))
+		return PTR_ERR(index);
+
+	rproc_handle_virtio_rsc(rproc, table, index);
+
+	kfree(index);
+	return 0;
+}
+
 static int rproc_add_virtio_devices(struct rproc *rproc)
 {
+	struct rproc_fw_image *image;
+	const char *name = rproc->firmware;
+	void (*cont)(const struct firmware *fw, void *context);
 	int ret;
 
 	/* rproc_del() calls must wait until async loader completes */
 	init_completion(&rproc->firmware_loading_complete);
 
+	/* a hot spare only gets its virtio devices as it takes over */
+	if (rproc->spare) {
+		complete_all(&rproc->firmware_loading_complete);
+		return 0;
+	}
+
+	/*
+	 * a detached remote processor has no firmware for us to load: its
+	 * virtio devices are in the resource table it uses already
+	 */
+	if (rproc->state == RPROC_DETACHED) {
+		ret = rproc_detached_config_virtio(rproc);
+		complete_all(&rproc->firmware_loading_complete);
+		return ret;
+	}
+
+	/*
+	 * if the image is already cached (e.g. we're recovering from a crash),
+	 * there's no need to load (and validate) it all over again
+	 */
+	mutex_lock(&rproc->lock);
+	image = rproc->fw_image;
+	if (image)
+		kref_get(&image->refcount);
+	mutex_unlock(&rproc->lock);
+
+	if (image) {
+		rproc_handle_virtio_rsc(rproc, image->table, image->rsc_index);
+		rproc_put_fw_image(image);
+		complete_all(&rproc->firmware_loading_complete);
+		return 0;
+	}
+
+	/*
+	 * a preloaded image is right there: no need to wait for user space,
+	 * or even for the rootfs, so register the virtio devices right away
+	 * (which lets their drivers boot the remote processor early on).
+	 */
+	if (rproc->preloaded_fw) {
+		rproc_fw_config_virtio(rproc->preloaded_fw, rproc);
+		return 0;
+	}
+
 	/*
 	 * We must retrieve early virtio configuration info from
 	 * the firmware (e.g. whether to register a virtio device,
-	 * what virtio features does it support, ...).
+	 * what virtio features does it support, ...), or from a copy
+	 * of its resource table, if there's one.
 	 *
 	 * We're initiating an asynchronous firmware loading, so we can
 	 * be built-in kernel code, without hanging the boot process.
 	 */
+	cont = rproc_fw_config_virtio;
+	if (rproc->rsc_table_fw) {
+		name = rproc->rsc_table_fw;
+		cont = rproc_rsc_fw_config_virtio;
+	}
+
 	ret = request_firmware_nowait(THIS_MODULE, FW_ACTION_HOTPLUG,
-				      rproc->firmware, &rproc->dev, GFP_KERNEL,
-				      rproc, rproc_fw_config_virtio);
+				      name, &rproc->dev, GFP_KERNEL,
+				      rproc, cont);
 	if (ret < 0) {
 		dev_err(&rproc->dev, "request_firmware_nowait err: %d\n", ret);
 		complete_all(&rproc->firmware_loading_complete);
@@ -927,6 +4923,51 @@ static int rproc_add_virtio_devices(struct rproc *rproc)
 	return ret;
 }
 
+/*
+ * freeze the virtio devices of @rproc (see rproc_freeze_virtio_dev()): either
+ * all of them, or none at all.
+ */
+static int rproc_freeze_virtio_devices(struct rproc *rproc)
+{
+	struct rproc_vdev *rvdev;
+	int ret;
+
+	list_for_each_entry(rvdev, &rproc->rvdevs, node) {
+		ret = rproc_freeze_virtio_dev(rvdev);
+		if (ret)
+			goto restore;
+	}
+
+	return 0;
+
+restore:
+	dev_warn(&rproc->dev, "can't freeze %s: %d\n",
+					dev_name(&rvdev->vdev.dev), ret);
+
+	list_for_each_entry_continue_reverse(rvdev, &rproc->rvdevs, node)
+		rproc_restore_virtio_dev(rvdev);
+
+	return ret;
+}
+
+/* restore the virtio devices of @rproc, once it's been powered off */
+static int rproc_restore_virtio_devices(struct rproc *rproc)
+{
+	struct rproc_vdev *rvdev;
+	int ret, err = 0;
+
+	list_for_each_entry(rvdev, &rproc->rvdevs, node) {
+		ret = rproc_restore_virtio_dev(rvdev);
+		if (ret) {
+			dev_err(&rproc->dev, "can't restore %s: %d\n",
+					dev_name(&rvdev->vdev.dev), ret);
+			err = err ? : ret;
+		}
+	}
+
+	return err;
+}
+
 /**
  * rproc_trigger_recovery() - recover a remoteproc
  * @rproc: the remote processor
@@ -935,19 +4976,33 @@ static int rproc_add_virtio_devices(struct rproc *rproc)
  * rpmsg drivers will be reseted along with the remote processor making the
  * remoteproc functional again.
  *
+ * If @rproc->fast_recovery is set, and the drivers of all the virtio devices
+ * support it, the virtio devices are only frozen (so the remote processor
+ * gets powered off), and then restored (so it's booted again, usually from
+ * the cached firmware image), which only resets their virtqueues: the
+ * devices themselves, and those their drivers created, stay around.
+ * Otherwise, the virtio devices are removed, and then added back.
+ *
  * This function can sleep, so it cannot be called from atomic context.
  */
 int rproc_trigger_recovery(struct rproc *rproc)
 {
-	struct rproc_vdev *rvdev, *rvtmp;
-
 	dev_err(&rproc->dev, "recovering %s\n", rproc->name);
 
+	/* the vdevs are set up anew, out of the firmware */
+	cancel_work_sync(&rproc->rsc_update);
+
 	init_completion(&rproc->crash_comp);
 
+	if (rproc->fast_recovery && !rproc_freeze_virtio_devices(rproc)) {
+		/* wait until there is no more rproc users */
+		wait_for_completion(&rproc->crash_comp);
+
+		return rproc_restore_virtio_devices(rproc);
+	}
+
 	/* clean up remote vdev entries */
-	list_for_each_entry_safe(rvdev, rvtmp, &rproc->rvdevs, node)
-		rproc_remove_virtio_dev(rvdev);
+	rproc_remove_virtio_devices(rproc);
 
 	/* wait until there is no more rproc users */
 	wait_for_completion(&rproc->crash_comp);
@@ -955,35 +5010,156 @@ int rproc_trigger_recovery(struct rproc *rproc)
 	return rproc_add_virtio_devices(rproc);
 }
 
+/*
+ * fail a crashed remote processor over to its armed hot spare (see
+ * rproc_set_failover()): the virtio devices of the spare are added, which
+ * lets their drivers start it right away, and re-create their channels on
+ * top of its vrings, and those of the crashed one are removed. The crashed
+ * one is then loaded again, in the background, as the new hot spare.
+ */
+static int rproc_failover_to(struct rproc *rproc, struct rproc *spare)
+{
+	int ret;
+
+	dev_err(&rproc->dev, "failing %s over to %s\n", rproc->name,
+								spare->name);
+
+	/* the vdevs are going away */
+	cancel_work_sync(&rproc->rsc_update);
+
+	init_completion(&rproc->crash_comp);
+
+	mutex_lock(&rproc_failover_lock);
+	rproc->spare = true;
+	spare->spare = false;
+	mutex_unlock(&rproc_failover_lock);
+
+	ret = rproc_add_virtio_devices(spare);
+
+	rproc_remove_virtio_devices(rproc);
+
+	/* wait until there is no more rproc users */
+	wait_for_completion(&rproc->crash_comp);
+
+	schedule_work(&rproc->arm_work);
+
+	return ret;
+}
+
+/* get the hot spare of @rproc, if it's armed and ready to take over */
+static struct rproc *rproc_get_armed_spare(struct rproc *rproc)
+{
+	struct rproc *spare = NULL, *other;
+
+	mutex_lock(&rproc_failover_lock);
+
+	other = rproc->spare ? NULL : rproc->failover;
+	if (other) {
+		mutex_lock(&other->lock);
+		if (other->state == RPROC_ARMED) {
+			get_device(&other->dev);
+			spare = other;
+		}
+		mutex_unlock(&other->lock);
+	}
+
+	mutex_unlock(&rproc_failover_lock);
+
+	return spare;
+}
+
 /**
  * rproc_crash_handler_work() - handle a crash
  *
  * This function needs to handle everything related to a crash, like cpu
  * registers and stack dump, information to help to debug the fatal error, etc.
+ * For now, the memory of the remote processor is dumped (see
+ * rproc_coredump_capture()), the crash is logged to pstore (see
+ * rproc_pstore_log_crash()), and it's then recovered, if asked to: its
+ * armed hot spare takes over, if it has one, or it's booted again.
  */
 static void rproc_crash_handler_work(struct work_struct *work)
 {
 	struct rproc *rproc = container_of(work, struct rproc, crash_handler);
 	struct device *dev = &rproc->dev;
+	struct rproc *spare;
+	unsigned long start;
+	int ret;
 
 	dev_dbg(dev, "enter %s\n", __func__);
 
 	mutex_lock(&rproc->lock);
 
-	if (rproc->state == RPROC_CRASHED || rproc->state == RPROC_OFFLINE) {
-		/* handle only the first crash detected */
+	/*
+	 * handle only the first crash detected, of a remote processor that
+	 * runs: one that's being booted isn't started yet
+	 */
+	if (rproc->state == RPROC_CRASHED || rproc->state == RPROC_OFFLINE ||
+					rproc->state == RPROC_BOOTING) {
 		mutex_unlock(&rproc->lock);
 		return;
 	}
 
 	rproc->state = RPROC_CRASHED;
+	rproc_watchdog_stop(rproc);
 	dev_err(dev, "handling crash #%u in %s\n", ++rproc->crash_cnt,
 		rproc->name);
 
+	rproc_coredump_capture(rproc);
+	rproc_pstore_log_crash(rproc, rproc_crash_to_string(rproc->crash_type));
+
 	mutex_unlock(&rproc->lock);
 
-	if (!rproc->recovery_disabled)
-		rproc_trigger_recovery(rproc);
+	if (rproc->recovery_disabled)
+		return;
+
+	start = jiffies;
+
+	/* its hot spare takes over, if it's ready to */
+	spare = rproc_get_armed_spare(rproc);
+	if (spare) {
+		ret = rproc_failover_to(rproc, spare);
+		put_device(&spare->dev);
+		rproc_pstore_log_recovery(rproc, "failed over", ret,
+					jiffies_to_msecs(jiffies - start));
+		return;
+	}
+
+	ret = rproc_trigger_recovery(rproc);
+	rproc_pstore_log_recovery(rproc, "recovered", ret,
+					jiffies_to_msecs(jiffies - start));
+}
+
+/*
+ * power off the remote processors @rproc depends on, in reverse order: all
+ * of them, or, if @last isn't NULL, only the ones declared before it.
+ */
+static void rproc_shutdown_deps(struct rproc *rproc, struct rproc_dep *last)
+{
+	struct rproc_dep *dep = last ? last :
+			list_entry(&rproc->deps, struct rproc_dep, node);
+
+	list_for_each_entry_continue_reverse(dep, &rproc->deps, node)
+		rproc_shutdown(dep->rproc);
+}
+
+/* boot the remote processors @rproc depends on, in the order declared */
+static int rproc_boot_deps(struct rproc *rproc)
+{
+	struct rproc_dep *dep;
+	int ret;
+
+	list_for_each_entry(dep, &rproc->deps, node) {
+		ret = rproc_boot(dep->rproc);
+		if (ret) {
+			dev_err(&rproc->dev, "can't boot %s: %d\n",
+						dep->rproc->name, ret);
+			rproc_shutdown_deps(rproc, dep);
+			return ret;
+		}
+	}
+
+	return 0;
 }
 
 /**
@@ -992,15 +5168,24 @@ static void rproc_crash_handler_work(struct work_struct *work)
  *
  * Boot a remote processor (i.e. load its firmware, power it on, ...).
  *
+ * The remote processors @rproc depends on (see rproc_add_dep()) are booted
+ * first, and stay powered on until @rproc is shut down.
+ *
  * If the remote processor is already powered on, this function immediately
- * returns (successfully).
+ * returns (successfully). If it's being booted by another caller, this
+ * function waits for that boot, and then does the same.
+ *
+ * rproc->lock isn't held while the firmware is read, which may take
+ * seconds: crashes, other callers and debugfs aren't held up meanwhile.
  *
  * Returns 0 on success, and an appropriate error value otherwise.
  */
 int rproc_boot(struct rproc *rproc)
 {
-	const struct firmware *firmware_p;
+	struct rproc_fw_image *image;
+	enum rproc_state state;
 	struct device *dev;
+	bool booted = false;
 	int ret;
 
 	if (!rproc) {
@@ -1010,10 +5195,27 @@ int rproc_boot(struct rproc *rproc)
 
 	dev = &rproc->dev;
 
+	/* bring the remote processor back, if it was suspended as it idled */
+	pm_runtime_get_sync(dev);
+
+	ret = rproc_boot_deps(rproc);
+	if (ret)
+		goto put_runtime;
+
+lock:
 	ret = mutex_lock_interruptible(&rproc->lock);
 	if (ret) {
 		dev_err(dev, "can't lock rproc %s: %d\n", rproc->name, ret);
-		return ret;
+		goto shutdown_deps;
+	}
+
+	/* another caller is booting it: see how that goes, without the lock */
+	if (rproc->state == RPROC_BOOTING) {
+		mutex_unlock(&rproc->lock);
+		ret = wait_for_completion_interruptible(&rproc->boot_done);
+		if (ret)
+			goto shutdown_deps;
+		goto lock;
 	}
 
 	/* loading a firmware is required */
@@ -1023,42 +5225,291 @@ int rproc_boot(struct rproc *rproc)
 		goto unlock_mutex;
 	}
 
-	/* prevent underlying implementation from being removed */
-	if (!try_module_get(dev->parent->driver->owner)) {
-		dev_err(dev, "%s: can't get owner\n", __func__);
-		ret = -EINVAL;
-		goto unlock_mutex;
+	/* prevent underlying implementation from being removed */
+	if (!try_module_get(dev->parent->driver->owner)) {
+		dev_err(dev, "%s: can't get owner\n", __func__);
+		ret = -EINVAL;
+		goto unlock_mutex;
+	}
+
+	/* skip the boot process if rproc is already powered up */
+	if (atomic_inc_return(&rproc->power) > 1) {
+		ret = 0;
+		goto unlock_mutex;
+	}
+
+	/* a detached remote processor is running already: just attach */
+	if (rproc->state == RPROC_DETACHED) {
+		ret = rproc_attach(rproc);
+		goto downref_rproc;
+	}
+
+	dev_info(dev, "powering up %s\n", rproc->name);
+
+	rproc_boot_begin(rproc);
+
+	/* an armed hot spare is loaded already: it only needs to be started */
+	if (rproc->state == RPROC_ARMED) {
+		if (rproc->armed_image == rproc->fw_image) {
+			ret = rproc_spare_start(rproc);
+			rproc_boot_end(rproc, ret);
+			booted = !ret;
+			goto downref_rproc;
+		}
+
+		/* its firmware changed since it was armed */
+		rproc_disarm(rproc);
+	}
+
+	/* the firmware is read and loaded while the rproc is powered up */
+	state = rproc->state;
+	rproc_begin_booting(rproc);
+	rproc_prepare(rproc);
+
+	/* load firmware, unless it's already cached, without the lock */
+	mutex_unlock(&rproc->lock);
+	mutex_lock(&rproc->fw_lock);
+	image = rproc_get_fw_image(rproc);
+	mutex_unlock(&rproc->fw_lock);
+	mutex_lock(&rproc->lock);
+
+	if (IS_ERR(image)) {
+		ret = PTR_ERR(image);
+		rproc_unprepare(rproc);
+		rproc_boot_end(rproc, ret);
+		rproc_end_booting(rproc, state);
+		goto downref_rproc;
+	}
+
+	ret = rproc_fw_boot(rproc, image);
+	if (ret)
+		rproc_unprepare(rproc);
+
+	rproc_put_fw_image(image);
+	rproc_boot_end(rproc, ret);
+	rproc_end_booting(rproc, state);
+	booted = !ret;
+
+downref_rproc:
+	if (ret) {
+		module_put(dev->parent->driver->owner);
+		atomic_dec(&rproc->power);
+	}
+unlock_mutex:
+	mutex_unlock(&rproc->lock);
+	/* get its hot spare ready, should it crash */
+	if (booted)
+		rproc_arm_spare(rproc);
+shutdown_deps:
+	if (ret)
+		rproc_shutdown_deps(rproc, NULL);
+put_runtime:
+	pm_runtime_mark_last_busy(dev);
+	pm_runtime_put_autosuspend(dev);
+	return ret;
+}
+EXPORT_SYMBOL(rproc_boot);
+
+static void rproc_boot_work(struct work_struct *work)
+{
+	struct rproc *rproc = container_of(work, struct rproc, boot_work);
+
+	/*
+	 * Get the firmware image before booting the remote processors we
+	 * depend on, which may take a while: this way, it is loaded in
+	 * parallel with theirs.
+	 */
+	rproc_preload_fw(rproc);
+
+	rproc->boot_ret = rproc_boot(rproc);
+
+	complete_all(&rproc->boot_comp);
+	atomic_set(&rproc->boot_pending, 0);
+
+	put_device(&rproc->dev);
+}
+
+/**
+ * rproc_boot_async() - boot a remote processor in the background
+ * @rproc: handle of a remote processor
+ *
+ * Just like rproc_boot(), but the remote processor is booted from the
+ * unbound workqueue, and this function returns right away. This way,
+ * several remote processors can be booted in parallel, which is much
+ * faster than booting them one after the other, since each of them mostly
+ * waits for its firmware to be loaded (and copied).
+ *
+ * Declared dependencies (see rproc_add_dep()) are honored: the firmware
+ * of @rproc is loaded right away, but it's only started once the remote
+ * processors it depends on are up.
+ *
+ * Once the returned completion is completed, the outcome of the boot can be
+ * retrieved with rproc_boot_wait(). A successful boot must eventually be
+ * accompanied by a call to rproc_shutdown(), just like rproc_boot().
+ *
+ * Returns the completion on success, ERR_PTR(-EBUSY) if an asynchronous
+ * boot of @rproc is already in flight, or another ERR_PTR value otherwise.
+ */
+struct completion *rproc_boot_async(struct rproc *rproc)
+{
+	if (!rproc) {
+		pr_err("invalid rproc handle\n");
+		return ERR_PTR(-EINVAL);
+	}
+
+	if (atomic_cmpxchg(&rproc->boot_pending, 0, 1))
+		return ERR_PTR(-EBUSY);
+
+	INIT_COMPLETION(rproc->boot_comp);
+
+	/* the handle must stay around until the boot is over */
+	get_device(&rproc->dev);
+	queue_work(system_unbound_wq, &rproc->boot_work);
+
+	return &rproc->boot_comp;
+}
+EXPORT_SYMBOL(rproc_boot_async);
+
+/**
+ * rproc_boot_wait() - wait for an asynchronous boot of a remote processor
+ * @rproc: handle of a remote processor
+ *
+ * Wait until the last asynchronous boot of @rproc (see rproc_boot_async())
+ * is over.
+ *
+ * Returns what rproc_boot() returned for that boot, or -EINVAL if @rproc
+ * was never booted asynchronously.
+ */
+int rproc_boot_wait(struct rproc *rproc)
+{
+	if (!rproc) {
+		pr_err("invalid rproc handle\n");
+		return -EINVAL;
+	}
+
+	wait_for_completion(&rproc->boot_comp);
+
+	return rproc->boot_ret;
+}
+EXPORT_SYMBOL(rproc_boot_wait);
+
+/* does @rproc depend on @dep, directly or not ? */
+static bool rproc_depends_on(struct rproc *rproc, struct rproc *dep)
+{
+	struct rproc_dep *entry;
+
+	if (rproc == dep)
+		return true;
+
+	list_for_each_entry(entry, &rproc->deps, node)
+		if (rproc_depends_on(entry->rproc, dep))
+			return true;
+
+	return false;
+}
+
+/**
+ * rproc_add_dep() - declare that a remote processor depends on another one
+ * @rproc: handle of the dependent remote processor
+ * @dep: handle of the remote processor @rproc depends on
+ *
+ * From now on, booting @rproc first boots @dep, which then stays powered on
+ * until @rproc is shut down. Independent remote processors can be booted
+ * in parallel with rproc_boot_async(), while dependent ones are only
+ * started once the remote processors they depend on are up.
+ *
+ * Dependencies must be declared before @rproc is booted (typically, by
+ * platform code, right after the remote processors are added), and can't
+ * be circular. @dep stays referenced until @rproc is released.
+ *
+ * Returns 0 on success, -EINVAL if @dep already depends on @rproc, or
+ * another appropriate error value otherwise.
+ */
+int rproc_add_dep(struct rproc *rproc, struct rproc *dep)
+{
+	struct rproc_dep *entry;
+
+	if (!rproc || !dep) {
+		pr_err("invalid rproc handle\n");
+		return -EINVAL;
+	}
+
+	if (rproc_depends_on(dep, rproc)) {
+		dev_err(&rproc->dev, "circular dependency on %s\n", dep->name);
+		return -EINVAL;
 	}
 
-	/* skip the boot process if rproc is already powered up */
-	if (atomic_inc_return(&rproc->power) > 1) {
-		ret = 0;
-		goto unlock_mutex;
+	entry = kzalloc(sizeof(*entry), GFP_KERNEL);
+	if (!entry) {
+		dev_err(&rproc->dev, "kzalloc dep failed\n");
+		return -ENOMEM;
 	}
 
-	dev_info(dev, "powering up %s\n", rproc->name);
+	get_device(&dep->dev);
+	entry->rproc = dep;
+	list_add_tail(&entry->node, &rproc->deps);
 
-	/* load firmware */
-	ret = request_firmware(&firmware_p, rproc->firmware, dev);
-	if (ret < 0) {
-		dev_err(dev, "request_firmware failed: %d\n", ret);
-		goto downref_rproc;
+	return 0;
+}
+EXPORT_SYMBOL(rproc_add_dep);
+
+/**
+ * rproc_set_failover() - pair a remote processor with a hot spare
+ * @rproc: handle of the remote processor
+ * @spare: handle of another remote processor, which can run its firmware
+ *
+ * From now on, whenever @rproc is booted, @spare is loaded with the same
+ * firmware in the background, and held in reset (see RPROC_ARMED). If
+ * @rproc then crashes (and recovery isn't disabled), @spare takes over:
+ * the virtio devices of @spare are added, so their drivers start it right
+ * away (there's nothing left to load) and re-create their channels on top
+ * of its vrings, and those of @rproc are removed. @rproc is then loaded
+ * again, and is the hot spare of @spare from then on.
+ *
+ * Both remote processors must be given the same firmware, and be paired
+ * before they're added: the hot spare doesn't register virtio devices of
+ * its own until it takes over. An armed hot spare stays loaded even when
+ * the active one is shut down, until it's booted or deleted. The pair is
+ * split when either of them is deleted.
+ *
+ * Returns 0 on success, -EBUSY if either of them is paired already, or
+ * -EINVAL if they can't be paired.
+ */
+int rproc_set_failover(struct rproc *rproc, struct rproc *spare)
+{
+	int ret = 0;
+
+	if (!rproc || !spare || rproc == spare) {
+		pr_err("invalid rproc handle\n");
+		return -EINVAL;
 	}
 
-	ret = rproc_fw_boot(rproc, firmware_p);
+	if (!rproc->firmware || !spare->firmware ||
+				strcmp(rproc->firmware, spare->firmware)) {
+		dev_err(&rproc->dev, "%s doesn't have the firmware of %s\n",
+						spare->name, rproc->name);
+		return -EINVAL;
+	}
 
-	release_firmware(firmware_p);
+	mutex_lock(&rproc_failover_lock);
 
-downref_rproc:
-	if (ret) {
-		module_put(dev->parent->driver->owner);
-		atomic_dec(&rproc->power);
+	if (rproc->failover || spare->failover) {
+		ret = -EBUSY;
+		goto unlock;
 	}
-unlock_mutex:
-	mutex_unlock(&rproc->lock);
+
+	/* each of them stays referenced until the pair is split */
+	get_device(&rproc->dev);
+	get_device(&spare->dev);
+	rproc->failover = spare;
+	spare->failover = rproc;
+	spare->spare = true;
+
+unlock:
+	mutex_unlock(&rproc_failover_lock);
 	return ret;
 }
-EXPORT_SYMBOL(rproc_boot);
+EXPORT_SYMBOL(rproc_set_failover);
 
 /**
  * rproc_shutdown() - power off the remote processor
@@ -1084,10 +5535,13 @@ void rproc_shutdown(struct rproc *rproc)
 	struct device *dev = &rproc->dev;
 	int ret;
 
+	/* ->stop() is always called on a running remote processor */
+	pm_runtime_get_sync(dev);
+
 	ret = mutex_lock_interruptible(&rproc->lock);
 	if (ret) {
 		dev_err(dev, "can't lock rproc %s: %d\n", rproc->name, ret);
-		return;
+		goto put_runtime;
 	}
 
 	/* if the remote proc is still needed, bail out */
@@ -1095,17 +5549,28 @@ void rproc_shutdown(struct rproc *rproc)
 		goto out;
 
 	/* power off the remote processor */
+	rproc_watchdog_stop(rproc);
 	ret = rproc->ops->stop(rproc);
 	if (ret) {
 		atomic_inc(&rproc->power);
 		dev_err(dev, "can't stop rproc: %d\n", ret);
+		if (rproc->state == RPROC_RUNNING)
+			rproc_watchdog_start(rproc);
 		goto out;
 	}
 
-	/* clean up all acquired resources */
-	rproc_resource_cleanup(rproc);
+	/* it's not going to get ready anymore */
+	atomic_set(&rproc->boot_ready_pending, 0);
 
-	rproc_disable_iommu(rproc);
+	/* save its memories while still powered, if it went down cleanly */
+	if (rproc->resident_image && rproc->state == RPROC_RUNNING)
+		rproc_snapshot_save(rproc);
+
+	rproc_unprepare(rproc);
+
+	/* clean up all acquired resources, unless they should stay resident */
+	if (!rproc->resident_image)
+		rproc_resource_cleanup(rproc);
 
 	/* if in crash state, unlock crash handler */
 	if (rproc->state == RPROC_CRASHED)
@@ -1117,11 +5582,183 @@ void rproc_shutdown(struct rproc *rproc)
 
 out:
 	mutex_unlock(&rproc->lock);
-	if (!ret)
+	if (!ret) {
 		module_put(dev->parent->driver->owner);
+		rproc_shutdown_deps(rproc, NULL);
+	}
+put_runtime:
+	pm_runtime_put_autosuspend(dev);
 }
 EXPORT_SYMBOL(rproc_shutdown);
 
+/**
+ * rproc_suspend() - suspend a running remote processor
+ * @rproc: the remote processor
+ *
+ * Put a running remote processor in a low power state, without shutting it
+ * down: its firmware, its resources and its virtio devices stay intact, so
+ * it can quickly be brought back with rproc_resume(), rather than being
+ * booted all over again.
+ *
+ * This requires the rproc implementation to support it (see the ->suspend()
+ * and ->resume() handlers of struct rproc_ops).
+ *
+ * Messages sent to a suspended remote processor are kept in its vrings,
+ * and will be processed once it is resumed.
+ *
+ * Returns 0 on success, -EOPNOTSUPP if suspending isn't supported, -EINVAL
+ * if @rproc isn't running, or another appropriate error value otherwise.
+ */
+int rproc_suspend(struct rproc *rproc)
+{
+	struct device *dev = &rproc->dev;
+	int ret;
+
+	if (!rproc->ops->suspend || !rproc->ops->resume)
+		return -EOPNOTSUPP;
+
+	ret = mutex_lock_interruptible(&rproc->lock);
+	if (ret) {
+		dev_err(dev, "can't lock rproc %s: %d\n", rproc->name, ret);
+		return ret;
+	}
+
+	if (rproc->state != RPROC_RUNNING) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	rproc_watchdog_stop(rproc);
+	ret = rproc->ops->suspend(rproc);
+	if (ret) {
+		dev_err(dev, "can't suspend rproc %s: %d\n", rproc->name, ret);
+		rproc_watchdog_start(rproc);
+		goto out;
+	}
+
+	rproc->state = RPROC_SUSPENDED;
+
+	dev_dbg(dev, "suspended remote processor %s\n", rproc->name);
+
+out:
+	mutex_unlock(&rproc->lock);
+	return ret;
+}
+EXPORT_SYMBOL(rproc_suspend);
+
+/**
+ * rproc_resume() - resume a suspended remote processor
+ * @rproc: the remote processor
+ *
+ * Bring a remote processor that was suspended with rproc_suspend() back to
+ * the running state.
+ *
+ * Returns 0 on success, -EINVAL if @rproc isn't suspended, or another
+ * appropriate error value otherwise.
+ */
+int rproc_resume(struct rproc *rproc)
+{
+	struct device *dev = &rproc->dev;
+	int ret;
+
+	ret = mutex_lock_interruptible(&rproc->lock);
+	if (ret) {
+		dev_err(dev, "can't lock rproc %s: %d\n", rproc->name, ret);
+		return ret;
+	}
+
+	if (rproc->state != RPROC_SUSPENDED) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	ret = rproc->ops->resume(rproc);
+	if (ret) {
+		dev_err(dev, "can't resume rproc %s: %d\n", rproc->name, ret);
+		goto out;
+	}
+
+	rproc->state = RPROC_RUNNING;
+	rproc_watchdog_start(rproc);
+
+	dev_dbg(dev, "resumed remote processor %s\n", rproc->name);
+
+out:
+	mutex_unlock(&rproc->lock);
+	return ret;
+}
+EXPORT_SYMBOL(rproc_resume);
+
+/**
+ * rproc_set_preloaded_fw() - provide the firmware image of an rproc in memory
+ * @rproc: the remote processor handle
+ * @data: the firmware image
+ * @size: size of the firmware image, in bytes
+ *
+ * Some remote processors must be up very early on, way before user space
+ * (or even the rootfs) is there to provide their firmware: this function
+ * lets rproc implementations hand remoteproc a firmware image that already
+ * sits in memory instead, e.g. in a reserved memory region the bootloader
+ * loaded it to, or linked into the kernel. The image is then used instead
+ * of rproc->firmware, and the virtio devices it declares are registered
+ * synchronously by rproc_add(), so their drivers (e.g. rpmsg) can boot the
+ * remote processor right away.
+ *
+ * This must be called before rproc_add(), and @data must stay valid (and
+ * intact) until @rproc is released.
+ *
+ * Returns 0 on success, or -ENOMEM if the image descriptor can't be
+ * allocated.
+ */
+int rproc_set_preloaded_fw(struct rproc *rproc, const void *data, size_t size)
+{
+	struct firmware *fw;
+
+	fw = kzalloc(sizeof(*fw), GFP_KERNEL);
+	if (!fw) {
+		dev_err(&rproc->dev, "kzalloc preloaded fw failed\n");
+		return -ENOMEM;
+	}
+
+	fw->data = data;
+	fw->size = size;
+
+	kfree(rproc->preloaded_fw);
+	rproc->preloaded_fw = fw;
+
+	return 0;
+}
+EXPORT_SYMBOL(rproc_set_preloaded_fw);
+
+/*
+ * start the thread that busy-polls the vrings on rproc->poll_cpu. It's
+ * only an optimization, so the vring notifications are handled as usual
+ * if that fails.
+ */
+static void rproc_start_polling(struct rproc *rproc)
+{
+	struct device *dev = &rproc->dev;
+	struct task_struct *thread;
+	int cpu = rproc->poll_cpu;
+
+	if (cpu >= nr_cpu_ids || !cpu_online(cpu)) {
+		dev_warn(dev, "can't poll on offline cpu %d\n", cpu);
+		return;
+	}
+
+	thread = kthread_create_on_node(rproc_poll_thread, rproc,
+				cpu_to_node(cpu), "rproc_poll/%d", rproc->index);
+	if (IS_ERR(thread)) {
+		dev_warn(dev, "can't create poll thread: %ld\n",
+							PTR_ERR(thread));
+		return;
+	}
+
+	kthread_bind(thread, cpu);
+	rproc->poll_thread = thread;
+	wake_up_process(thread);
+}
+
 /**
  * rproc_add() - register a remote processor
  * @rproc: the remote processor handle to register
@@ -1147,9 +5784,27 @@ int rproc_add(struct rproc *rproc)
 	struct device *dev = &rproc->dev;
 	int ret;
 
+	if (rproc->state == RPROC_DETACHED &&
+		(!rproc->ops->attach || !rproc->ops->find_loaded_rsc_table)) {
+		dev_err(dev, "can't attach to %s\n", rproc->name);
+		return -EINVAL;
+	}
+
+	if (!rproc->num_cores || rproc->num_cores > RPROC_MAX_CORES) {
+		dev_err(dev, "%s can't have %u cores\n", rproc->name,
+							rproc->num_cores);
+		return -EINVAL;
+	}
+
+	ret = rproc_cdev_add(rproc);
+	if (ret)
+		return ret;
+
 	ret = device_add(dev);
-	if (ret < 0)
+	if (ret < 0) {
+		rproc_cdev_del(rproc);
 		return ret;
+	}
 
 	dev_info(dev, "%s is available\n", rproc->name);
 
@@ -1159,6 +5814,18 @@ int rproc_add(struct rproc *rproc)
 	/* create debugfs entries */
 	rproc_create_debug_dir(rproc);
 
+	/* busy-poll the vrings under load, if asked to */
+	if (rproc->poll_cpu >= 0)
+		rproc_start_polling(rproc);
+
+	/* suspend the remote processor whenever it idles, if asked to */
+	if (rproc->autosuspend_delay && rproc->ops->suspend &&
+							rproc->ops->resume) {
+		pm_runtime_set_autosuspend_delay(dev, rproc->autosuspend_delay);
+		pm_runtime_use_autosuspend(dev);
+		pm_runtime_enable(dev);
+	}
+
 	return rproc_add_virtio_devices(rproc);
 }
 EXPORT_SYMBOL(rproc_add);
@@ -1175,13 +5842,33 @@ EXPORT_SYMBOL(rproc_add);
 static void rproc_type_release(struct device *dev)
 {
 	struct rproc *rproc = container_of(dev, struct rproc, dev);
+	struct rproc_dep *dep, *tmp;
 
 	dev_info(&rproc->dev, "releasing %s\n", rproc->name);
 
+	list_for_each_entry_safe(dep, tmp, &rproc->deps, node) {
+		put_device(&dep->rproc->dev);
+		kfree(dep);
+	}
+
+	kfree(rproc->preloaded_fw);
+	rproc_perf_free(rproc);
+	rproc_queue_free(rproc);
+	rproc_cmdq_free(rproc);
+
+	if (rproc->poll_thread)
+		kthread_stop(rproc->poll_thread);
+
+	if (rproc->ipc_wq)
+		destroy_workqueue(rproc->ipc_wq);
+	free_cpumask_var(rproc->ipc_cpus);
+
 	rproc_delete_debug_dir(rproc);
 
 	idr_remove_all(&rproc->notifyids);
 	idr_destroy(&rproc->notifyids);
+	kfree(rproc->vring_map);
+	kfree(rproc->carveout_index);
 
 	if (rproc->index >= 0)
 		ida_simple_remove(&rproc_dev_index, rproc->index);
@@ -1189,9 +5876,141 @@ static void rproc_type_release(struct device *dev)
 	kfree(rproc);
 }
 
+#ifdef CONFIG_PM_RUNTIME
+/*
+ * suspend a running remote processor that idled (see rproc->autosuspend_delay),
+ * and resume it once it's needed again. There's nothing to do if it isn't
+ * running, but for the next boot (or shutdown) to come along.
+ */
+static int rproc_runtime_suspend(struct device *dev)
+{
+	struct rproc *rproc = container_of(dev, struct rproc, dev);
+	int ret = 0;
+
+	mutex_lock(&rproc->lock);
+
+	if (rproc->state != RPROC_RUNNING)
+		goto out;
+
+	rproc_watchdog_stop(rproc);
+	ret = rproc->ops->suspend(rproc);
+	if (ret) {
+		dev_err(dev, "can't suspend rproc %s: %d\n", rproc->name, ret);
+		rproc_watchdog_start(rproc);
+		/* try again the next time it idles */
+		ret = -EBUSY;
+		goto out;
+	}
+
+	rproc->state = RPROC_SUSPENDED;
+	rproc->runtime_suspended = true;
+
+	dev_dbg(dev, "idle remote processor %s suspended\n", rproc->name);
+
+out:
+	mutex_unlock(&rproc->lock);
+	return ret;
+}
+
+static int rproc_runtime_resume(struct device *dev)
+{
+	struct rproc *rproc = container_of(dev, struct rproc, dev);
+	int ret = 0;
+
+	mutex_lock(&rproc->lock);
+
+	/* leave it alone if it's been suspended by rproc_suspend() */
+	if (rproc->state != RPROC_SUSPENDED || !rproc->runtime_suspended)
+		goto out;
+
+	ret = rproc->ops->resume(rproc);
+	if (ret) {
+		dev_err(dev, "can't resume rproc %s: %d\n", rproc->name, ret);
+		goto out;
+	}
+
+	rproc->state = RPROC_RUNNING;
+	rproc_watchdog_start(rproc);
+
+	dev_dbg(dev, "idle remote processor %s resumed\n", rproc->name);
+
+out:
+	rproc->runtime_suspended = false;
+	mutex_unlock(&rproc->lock);
+	return ret;
+}
+#endif
+
+static const struct dev_pm_ops rproc_pm_ops = {
+	SET_RUNTIME_PM_OPS(rproc_runtime_suspend, rproc_runtime_resume, NULL)
+};
+
+/*
+ * expose how much host memory a remote processor pins down, in bytes, in
+ * its memory/ sysfs directory (see struct rproc_mem_usage)
+ */
+#define RPROC_MEM_ATTR(field, fmt)					\
+static ssize_t rproc_mem_##field##_show(struct device *dev,		\
+				struct device_attribute *attr, char *buf) \
+{									\
+	struct rproc *rproc = container_of(dev, struct rproc, dev);	\
+	struct rproc_mem_usage usage;					\
+	int ret;							\
+									\
+	ret = mutex_lock_interruptible(&rproc->lock);			\
+	if (ret)							\
+		return ret;						\
+									\
+	rproc_mem_usage(rproc, &usage);					\
+	mutex_unlock(&rproc->lock);					\
+									\
+	return sprintf(buf, fmt "\n", usage.field);			\
+}									\
+static struct device_attribute rproc_mem_attr_##field =			\
+	__ATTR(field, S_IRUGO, rproc_mem_##field##_show, NULL)
+
+RPROC_MEM_ATTR(carveouts, "%zu");
+RPROC_MEM_ATTR(carveout_pad, "%zu");
+RPROC_MEM_ATTR(holes, "%zu");
+RPROC_MEM_ATTR(vrings, "%zu");
+RPROC_MEM_ATTR(vdev_bufs, "%zu");
+RPROC_MEM_ATTR(dump, "%zu");
+RPROC_MEM_ATTR(fw_cache, "%zu");
+RPROC_MEM_ATTR(total, "%zu");
+RPROC_MEM_ATTR(shared, "%zu");
+RPROC_MEM_ATTR(iommu_mapped, "%zu");
+RPROC_MEM_ATTR(iommu_ptes, "%lu");
+
+static struct attribute *rproc_mem_attrs[] = {
+	&rproc_mem_attr_carveouts.attr,
+	&rproc_mem_attr_carveout_pad.attr,
+	&rproc_mem_attr_holes.attr,
+	&rproc_mem_attr_vrings.attr,
+	&rproc_mem_attr_vdev_bufs.attr,
+	&rproc_mem_attr_dump.attr,
+	&rproc_mem_attr_fw_cache.attr,
+	&rproc_mem_attr_total.attr,
+	&rproc_mem_attr_shared.attr,
+	&rproc_mem_attr_iommu_mapped.attr,
+	&rproc_mem_attr_iommu_ptes.attr,
+	NULL,
+};
+
+static struct attribute_group rproc_mem_group = {
+	.name = "memory",
+	.attrs = rproc_mem_attrs,
+};
+
+static const struct attribute_group *rproc_groups[] = {
+	&rproc_mem_group,
+	NULL,
+};
+
 static struct device_type rproc_type = {
 	.name		= "remoteproc",
+	.groups		= rproc_groups,
 	.release	= rproc_type_release,
+	.pm		= &rproc_pm_ops,
 };
 
 /**
@@ -1251,23 +6070,76 @@ struct rproc *rproc_alloc(struct device *dev, const char *name,
 
 	dev_set_name(&rproc->dev, "remoteproc%d", rproc->index);
 
+	if (!zalloc_cpumask_var(&rproc->ipc_cpus, GFP_KERNEL)) {
+		dev_err(dev, "zalloc_cpumask_var failed\n");
+		put_device(&rproc->dev);
+		return NULL;
+	}
+
+	rproc->ipc_wq = alloc_workqueue("rproc_ipc/%s",
+				WQ_HIGHPRI | WQ_CPU_INTENSIVE, 0,
+				dev_name(&rproc->dev));
+	if (!rproc->ipc_wq) {
+		dev_err(dev, "alloc_workqueue failed\n");
+		put_device(&rproc->dev);
+		return NULL;
+	}
+
+	INIT_WORK(&rproc->ipc_work, rproc_ipc_work);
+	tasklet_init(&rproc->kick_tasklet, rproc_kick_tasklet,
+						(unsigned long)rproc);
+
+	rproc->poll_cpu = -1;
+	rproc->poll_idle_usecs = RPROC_POLL_IDLE_USECS;
+	rproc->msg_cost_us = RPROC_MSG_COST_US;
+	rproc->load_stamp = ktime_get();
+
 	atomic_set(&rproc->power, 0);
 
+	rproc->num_cores = 1;
+
 	/* Set ELF as the default fw_ops handler */
 	rproc->fw_ops = &rproc_elf_fw_ops;
 
 	mutex_init(&rproc->lock);
+	mutex_init(&rproc->fw_lock);
+	init_completion(&rproc->boot_done);
+	spin_lock_init(&rproc->shared_lock);
 
 	idr_init(&rproc->notifyids);
 
 	INIT_LIST_HEAD(&rproc->carveouts);
 	INIT_LIST_HEAD(&rproc->mappings);
+	INIT_LIST_HEAD(&rproc->holes);
 	INIT_LIST_HEAD(&rproc->traces);
 	INIT_LIST_HEAD(&rproc->rvdevs);
+	INIT_LIST_HEAD(&rproc->snapshots);
+	INIT_LIST_HEAD(&rproc->deps);
+	INIT_LIST_HEAD(&rproc->peers);
+	INIT_LIST_HEAD(&rproc->queues);
+	INIT_LIST_HEAD(&rproc->cmdqs);
 
 	INIT_WORK(&rproc->crash_handler, rproc_crash_handler_work);
 	init_completion(&rproc->crash_comp);
 
+	INIT_WORK(&rproc->boot_work, rproc_boot_work);
+	INIT_WORK(&rproc->rsc_update, rproc_rsc_update_work);
+	INIT_WORK(&rproc->prefetch_work, rproc_prefetch_work);
+	INIT_WORK(&rproc->prepare_work, rproc_prepare_work);
+	INIT_WORK(&rproc->arm_work, rproc_arm_work);
+
+	hrtimer_init(&rproc->watchdog, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	rproc->watchdog.function = rproc_watchdog_expired;
+	spin_lock_init(&rproc->watchdog_lock);
+	spin_lock_init(&rproc->event_lock);
+	spin_lock_init(&rproc->timesync_lock);
+	spin_lock_init(&rproc->telemetry_lock);
+	rproc_coalesce_init(rproc);
+	/* as if an asynchronous boot failed already, until there's one */
+	init_completion(&rproc->boot_comp);
+	complete_all(&rproc->boot_comp);
+	rproc->boot_ret = -EINVAL;
+
 	rproc->state = RPROC_OFFLINE;
 
 	return rproc;
@@ -1289,6 +6161,42 @@ void rproc_put(struct rproc *rproc)
 }
 EXPORT_SYMBOL(rproc_put);
 
+/*
+ * split the failover pair @rproc is part of, as it's being deleted: if the
+ * one left behind was its hot spare, it's on its own now, and its virtio
+ * devices are added.
+ */
+static void rproc_failover_del(struct rproc *rproc)
+{
+	struct rproc *other;
+	bool orphan;
+
+	mutex_lock(&rproc_failover_lock);
+
+	other = rproc->failover;
+	if (!other) {
+		mutex_unlock(&rproc_failover_lock);
+		return;
+	}
+
+	orphan = other->spare;
+	other->failover = NULL;
+	other->spare = false;
+	rproc->failover = NULL;
+	rproc->spare = false;
+
+	mutex_unlock(&rproc_failover_lock);
+
+	cancel_work_sync(&rproc->arm_work);
+
+	if (orphan)
+		rproc_add_virtio_devices(other);
+
+	/* the references rproc_set_failover() took */
+	put_device(&other->dev);
+	put_device(&rproc->dev);
+}
+
 /**
  * rproc_del() - unregister a remote processor
  * @rproc: rproc handle to unregister
@@ -1306,18 +6214,35 @@ EXPORT_SYMBOL(rproc_put);
  */
 int rproc_del(struct rproc *rproc)
 {
-	struct rproc_vdev *rvdev, *tmp;
-
 	if (!rproc)
 		return -EINVAL;
 
-	/* if rproc is just being registered, wait */
+	/* if rproc is just being registered, or booted, wait */
 	wait_for_completion(&rproc->firmware_loading_complete);
+	flush_work(&rproc->boot_work);
+	cancel_work_sync(&rproc->rsc_update);
+	cancel_work_sync(&rproc->prefetch_work);
+
+	rproc_failover_del(rproc);
 
 	/* clean up remote vdev entries */
-	list_for_each_entry_safe(rvdev, tmp, &rproc->rvdevs, node)
-		rproc_remove_virtio_dev(rvdev);
+	rproc_remove_virtio_devices(rproc);
+
+	/* no one is using the remote processor anymore */
+	pm_runtime_disable(&rproc->dev);
+
+	mutex_lock(&rproc->lock);
+	rproc_disarm(rproc);
+	rproc_release_resident(rproc);
+	rproc_coredump_free(rproc);
+	rproc_disable_iommu(rproc);
+	mutex_unlock(&rproc->lock);
+
+	rproc_perf_del(rproc);
+	rproc_peer_del(rproc);
+	rproc_flush_fw_cache(rproc);
 
+	rproc_cdev_del(rproc);
 	device_del(&rproc->dev);
 
 	return 0;
@@ -1345,14 +6270,47 @@ void rproc_report_crash(struct rproc *rproc, enum rproc_crash_type type)
 	dev_err(&rproc->dev, "crash detected in %s: type %s\n",
 		rproc->name, rproc_crash_to_string(type));
 
+	/* the crash handler logs it */
+	rproc->crash_type = type;
+
 	/* create a new task to handle the error */
 	schedule_work(&rproc->crash_handler);
 }
 EXPORT_SYMBOL(rproc_report_crash);
 
+/**
+ * rproc_report_rsc_update() - the resource table of a remote processor changed
+ * @rproc: remote processor
+ *
+ * This function should be called by the low-level drivers implementing a
+ * specific remoteproc whenever their running remote processor signals that
+ * it added vdev entries to, or removed them from, the resource table it
+ * uses (which the driver's ->find_loaded_rsc_table() handler is then
+ * required to find). The new vdevs are then registered, which lets their
+ * drivers set them up, and the vdevs that are gone are removed, on the fly
+ * and without restarting the remote processor.
+ *
+ * It should also be called when the remote processor signals that it
+ * changed the config space of some vdevs (e.g. the link status of a
+ * virtio-net device): the drivers of all the vdevs are notified.
+ *
+ * A new vdev entry must only be added to the table once it's complete, and
+ * the vrings and config space of an entry must be left alone once it's in
+ * the table: the host writes back the vrings' da and notifyid, and the
+ * vdev's gfeatures and status, as it sets the vdev up.
+ *
+ * This function can be called from atomic/interrupt context.
+ */
+void rproc_report_rsc_update(struct rproc *rproc)
+{
+	schedule_work(&rproc->rsc_update);
+}
+EXPORT_SYMBOL(rproc_report_rsc_update);
+
 static int __init remoteproc_init(void)
 {
 	rproc_init_debugfs();
+	rproc_init_cdev();
 
 	return 0;
 }
@@ -1360,6 +6318,7 @@ module_init(remoteproc_init);
 
 static void __exit remoteproc_exit(void)
 {
+	rproc_exit_cdev();
 	rproc_exit_debugfs();
 }
 module_exit(remoteproc_exit);
@@ -0,0 +1,451 @@
+/*
+ * Remote Processor Framework core dumps
+ *
+ * Copyright (C) 2011 Texas Instruments, Inc.
+ * Copyright (C) 2011 Google, Inc.
+ *
+ * Ohad Ben-Cohen <ohad@wizery.com>
+ * Brian Swetland <swetland@google.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#define pr_fmt(fmt)    "%s: " fmt, __func__
+
+#include <linux/kernel.h>
+#include <linux/remoteproc.h>
+#include <linux/elf.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/uaccess.h>
+#include <linux/sizes.h>
+
+#include "remoteproc_internal.h"
+
+/* how big a minidump may get, all its regions included */
+#define RPROC_MINIDUMP_MAX_SIZE	SZ_4M
+
+/**
+ * struct rproc_dump_seg - a segment of a core dump
+ * @va: kernel address of the segment's contents
+ * @da: device address the segment was at
+ * @len: length of the segment, in bytes
+ */
+struct rproc_dump_seg {
+	void *va;
+	u32 da;
+	u32 len;
+};
+
+/**
+ * struct rproc_dump - a core dump of a crashed remote processor
+ * @hdr: the dump's ELF header, followed by its program headers
+ * @hdr_len: size of @hdr, in bytes
+ * @size: size of the whole dump, in bytes
+ * @zero_copy: the segments are the carveouts themselves, rather than copies
+ * @copy: the copies of the carveouts, if the dump isn't zero-copy
+ * @carveouts: the carveouts a zero-copy dump took over once the remote
+ *	       processor was shut down (see rproc_coredump_keep())
+ * @nsegs: number of segments in the dump
+ * @segs: the dump's segments, one per carveout
+ */
+struct rproc_dump {
+	void *hdr;
+	size_t hdr_len;
+	size_t size;
+	bool zero_copy;
+	void *copy;
+	struct list_head carveouts;
+	int nsegs;
+	struct rproc_dump_seg segs[0];
+};
+
+/* put together the ELF header and program headers of a core dump */
+static int rproc_coredump_build_hdr(struct rproc *rproc,
+						struct rproc_dump *dump)
+{
+	struct elf32_hdr *ehdr;
+	struct elf32_phdr *phdr;
+	size_t offset;
+	int i;
+
+	dump->hdr_len = sizeof(*ehdr) + dump->nsegs * sizeof(*phdr);
+	dump->hdr = kzalloc(dump->hdr_len, GFP_KERNEL);
+	if (!dump->hdr)
+		return -ENOMEM;
+
+	ehdr = dump->hdr;
+	memcpy(ehdr->e_ident, ELFMAG, SELFMAG);
+	ehdr->e_ident[EI_CLASS] = ELFCLASS32;
+#ifdef __LITTLE_ENDIAN
+	ehdr->e_ident[EI_DATA] = ELFDATA2LSB;
+#else
+	ehdr->e_ident[EI_DATA] = ELFDATA2MSB;
+#endif
+	ehdr->e_ident[EI_VERSION] = EV_CURRENT;
+	ehdr->e_type = ET_CORE;
+	ehdr->e_machine = EM_NONE;
+	ehdr->e_version = EV_CURRENT;
+	ehdr->e_entry = rproc->bootaddr;
+	ehdr->e_phoff = sizeof(*ehdr);
+	ehdr->e_ehsize = sizeof(*ehdr);
+	ehdr->e_phentsize = sizeof(*phdr);
+	ehdr->e_phnum = dump->nsegs;
+
+	phdr = dump->hdr + sizeof(*ehdr);
+	offset = dump->hdr_len;
+
+	for (i = 0; i < dump->nsegs; i++) {
+		phdr[i].p_type = PT_LOAD;
+		phdr[i].p_offset = offset;
+		phdr[i].p_vaddr = dump->segs[i].da;
+		phdr[i].p_paddr = dump->segs[i].da;
+		phdr[i].p_filesz = dump->segs[i].len;
+		phdr[i].p_memsz = dump->segs[i].len;
+		phdr[i].p_flags = PF_R | PF_W | PF_X;
+
+		offset += dump->segs[i].len;
+	}
+
+	dump->size = offset;
+
+	return 0;
+}
+
+/*
+ * take a minidump of a crashed remote processor: copy the regions of the
+ * table the firmware declared (see fw_rsc_minidump) into a core dump, one
+ * PT_LOAD segment per region. Regions that aren't in the memory of @rproc
+ * are left out.
+ *
+ * Must be called with rproc->lock held.
+ */
+static int rproc_minidump_capture(struct rproc *rproc)
+{
+	struct device *dev = &rproc->dev;
+	struct fw_minidump_region *table, *regions;
+	size_t tablesz = rproc->minidump_num * sizeof(*table);
+	struct rproc_dump *dump;
+	size_t len = 0;
+	int nsegs = 0, i, j = 0, ret;
+	void *copy;
+
+	table = rproc_da_to_va(rproc, rproc->minidump_da, tablesz);
+	if (!table) {
+		dev_err(dev, "no minidump table at da 0x%x\n",
+						rproc->minidump_da);
+		return -EINVAL;
+	}
+
+	/* the firmware may still be scribbling: go by a copy of the table */
+	regions = kmemdup(table, tablesz, GFP_KERNEL);
+	if (!regions)
+		return -ENOMEM;
+
+	for (i = 0; i < rproc->minidump_num; i++) {
+		if (!regions[i].len)
+			continue;
+
+		if (regions[i].len > RPROC_MINIDUMP_MAX_SIZE - len) {
+			dev_err(dev, "minidump is bigger than %u bytes\n",
+						RPROC_MINIDUMP_MAX_SIZE);
+			ret = -EFBIG;
+			goto free_regions;
+		}
+
+		if (!rproc_da_to_va(rproc, regions[i].da, regions[i].len)) {
+			dev_warn(dev, "minidump region %d (da 0x%x) is out of range\n",
+							i, regions[i].da);
+			regions[i].len = 0;
+			continue;
+		}
+
+		len += regions[i].len;
+		nsegs++;
+	}
+
+	if (!nsegs) {
+		ret = -ENOENT;
+		goto free_regions;
+	}
+
+	dump = kzalloc(sizeof(*dump) + nsegs * sizeof(dump->segs[0]),
+								GFP_KERNEL);
+	if (!dump) {
+		ret = -ENOMEM;
+		goto free_regions;
+	}
+
+	INIT_LIST_HEAD(&dump->carveouts);
+	dump->nsegs = nsegs;
+
+	dump->copy = vmalloc(len);
+	if (!dump->copy) {
+		ret = -ENOMEM;
+		goto free_dump;
+	}
+
+	copy = dump->copy;
+	for (i = 0; i < rproc->minidump_num; i++) {
+		if (!regions[i].len)
+			continue;
+
+		memcpy(copy, rproc_da_to_va(rproc, regions[i].da,
+					regions[i].len), regions[i].len);
+		dump->segs[j].da = regions[i].da;
+		dump->segs[j].len = regions[i].len;
+		dump->segs[j].va = copy;
+		copy += regions[i].len;
+		j++;
+	}
+
+	ret = rproc_coredump_build_hdr(rproc, dump);
+	if (ret)
+		goto free_copy;
+
+	rproc->dump = dump;
+	kfree(regions);
+
+	dev_info(dev, "minidumped %d regions (%zu bytes) of %s\n", nsegs,
+						dump->size, rproc->name);
+
+	return 0;
+
+free_copy:
+	vfree(dump->copy);
+free_dump:
+	kfree(dump);
+free_regions:
+	kfree(regions);
+	return ret;
+}
+
+/**
+ * rproc_coredump_capture() - take a core dump of a crashed remote processor
+ * @rproc: the remote processor
+ *
+ * This function snapshots the carveouts of @rproc into an ELF core dump
+ * (one PT_LOAD segment per carveout), which then replaces the previous one,
+ * if any, and is exposed via debugfs until it's dismissed.
+ *
+ * If the firmware declared a minidump (see fw_rsc_minidump), only the
+ * regions it lists are copied instead, which is quick enough not to hold
+ * the recovery up. The whole carveouts are only dumped if that fails.
+ *
+ * If the crashed remote processor isn't going to be recovered, its
+ * carveouts stay as they are until it's shut down, and are then taken over
+ * by the dump (see rproc_coredump_keep()): nothing is copied, so the host
+ * isn't held up by big carveouts, but their memory is only freed once the
+ * dump is dismissed. Otherwise, they're copied.
+ *
+ * Must be called with rproc->lock held.
+ */
+void rproc_coredump_capture(struct rproc *rproc)
+{
+	struct device *dev = &rproc->dev;
+	struct rproc_mem_entry *carveout;
+	struct rproc_dump *dump;
+	size_t len = 0;
+	int nsegs = 0, i = 0;
+	void *copy;
+
+	rproc_coredump_free(rproc);
+
+	if (rproc->minidump_num && !rproc_minidump_capture(rproc))
+		return;
+
+	list_for_each_entry(carveout, &rproc->carveouts, node) {
+		len += carveout->len;
+		nsegs++;
+	}
+
+	if (!nsegs)
+		return;
+
+	dump = kzalloc(sizeof(*dump) + nsegs * sizeof(dump->segs[0]),
+								GFP_KERNEL);
+	if (!dump) {
+		dev_err(dev, "kzalloc dump failed\n");
+		return;
+	}
+
+	INIT_LIST_HEAD(&dump->carveouts);
+	dump->nsegs = nsegs;
+
+	/* carveouts which stay resident are reused once it's booted again */
+	dump->zero_copy = rproc->recovery_disabled && !rproc->resident_image;
+	if (!dump->zero_copy) {
+		dump->copy = vmalloc(len);
+		if (!dump->copy) {
+			dev_err(dev, "can't copy %zu bytes for a dump\n", len);
+			goto free_dump;
+		}
+	}
+
+	copy = dump->copy;
+	list_for_each_entry(carveout, &rproc->carveouts, node) {
+		dump->segs[i].da = carveout->da;
+		dump->segs[i].len = carveout->len;
+
+		if (dump->zero_copy) {
+			dump->segs[i].va = carveout->va;
+		} else {
+			memcpy(copy, carveout->va, carveout->len);
+			dump->segs[i].va = copy;
+			copy += carveout->len;
+		}
+
+		i++;
+	}
+
+	if (rproc_coredump_build_hdr(rproc, dump))
+		goto free_copy;
+
+	rproc->dump = dump;
+
+	dev_info(dev, "dumped %d segments (%zu bytes) of %s%s\n", nsegs,
+			dump->size, rproc->name,
+			dump->zero_copy ? " in place" : "");
+
+	return;
+
+free_copy:
+	vfree(dump->copy);
+free_dump:
+	kfree(dump);
+}
+
+/**
+ * rproc_coredump_keep() - hand the carveouts over to a zero-copy dump
+ * @rproc: the remote processor
+ *
+ * This function is called as the resources of @rproc are cleaned up: if
+ * its core dump is a zero-copy one, the dump takes the carveouts over,
+ * and they're only freed along with it.
+ *
+ * Must be called with rproc->lock held.
+ */
+void rproc_coredump_keep(struct rproc *rproc)
+{
+	struct rproc_dump *dump = rproc->dump;
+
+	if (dump && dump->zero_copy)
+		list_splice_tail_init(&rproc->carveouts, &dump->carveouts);
+}
+
+/**
+ * rproc_coredump_free() - dismiss the core dump of a remote processor
+ * @rproc: the remote processor
+ *
+ * Must be called with rproc->lock held.
+ */
+void rproc_coredump_free(struct rproc *rproc)
+{
+	struct rproc_dump *dump = rproc->dump;
+	struct rproc_mem_entry *entry, *tmp;
+
+	if (!dump)
+		return;
+
+	list_for_each_entry_safe(entry, tmp, &dump->carveouts, node) {
+		rproc_free_carveout(rproc, entry);
+		list_del(&entry->node);
+		kfree(entry);
+	}
+
+	vfree(dump->copy);
+	kfree(dump->hdr);
+	kfree(dump);
+
+	rproc->dump = NULL;
+}
+
+/**
+ * rproc_coredump_size() - how much memory the core dump of a remote
+ * processor holds
+ * @rproc: the remote processor
+ *
+ * Must be called with rproc->lock held.
+ */
+size_t rproc_coredump_size(struct rproc *rproc)
+{
+	struct rproc_dump *dump = rproc->dump;
+	struct rproc_mem_entry *entry;
+	size_t size;
+
+	if (!dump)
+		return 0;
+
+	/* a zero-copy dump holds on to the carveouts instead of copies */
+	size = dump->zero_copy ? dump->hdr_len : dump->size;
+
+	list_for_each_entry(entry, &dump->carveouts, node)
+		size += rproc_carveout_size(entry);
+
+	return size;
+}
+
+/**
+ * rproc_coredump_read() - read the core dump of a remote processor
+ * @rproc: the remote processor
+ * @userbuf: user buffer to read into
+ * @count: number of bytes to read
+ * @ppos: offset in the dump to read from, which gets updated
+ *
+ * Returns the number of bytes read (0 past the end of the dump, or if there
+ * isn't one), or an appropriate error value otherwise.
+ */
+ssize_t rproc_coredump_read(struct rproc *rproc, char __user *userbuf,
+						size_t count, loff_t *ppos)
+{
+	struct rproc_dump *dump;
+	size_t pos, done = 0;
+	ssize_t ret;
+	int i;
+
+	ret = mutex_lock_interruptible(&rproc->lock);
+	if (ret)
+		return ret;
+
+	dump = rproc->dump;
+	if (!dump || *ppos < 0 || *ppos >= dump->size)
+		goto unlock;
+
+	pos = *ppos;
+	count = min(count, dump->size - pos);
+
+	/* the segments follow the headers, in order */
+	for (i = -1; i < dump->nsegs && done < count; i++) {
+		const void *va = i < 0 ? dump->hdr : dump->segs[i].va;
+		size_t len = i < 0 ? dump->hdr_len : dump->segs[i].len;
+		size_t n;
+
+		if (pos >= len) {
+			pos -= len;
+			continue;
+		}
+
+		n = min(len - pos, count - done);
+		if (copy_to_user(userbuf + done, va + pos, n)) {
+			ret = -EFAULT;
+			goto unlock;
+		}
+
+		done += n;
+		pos = 0;
+	}
+
+	*ppos += done;
+	ret = done;
+
+unlock:
+	mutex_unlock(&rproc->lock);
+	return ret;
+}
@@ -29,6 +29,14 @@
 #include <linux/remoteproc.h>
 #include <linux/device.h>
 #include <linux/uaccess.h>
+#include <linux/iommu.h>
+#include <linux/slab.h>
+#include <linux/poll.h>
+#include <linux/wait.h>
+#include <linux/timer.h>
+#include <linux/virtio.h>
+#include <linux/virtio_ring.h>
+#include <linux/sched.h>
 
 #include "remoteproc_internal.h"
 
@@ -59,6 +67,367 @@ static const struct file_operations trace_rproc_ops = {
 	.llseek	= generic_file_llseek,
 };
 
+/* how often (in msecs) the trace rings are looked at, while being waited on */
+#define RPROC_TRACE_POLL_MS	50
+
+/*
+ * The remote processor doesn't notify us as it writes to its trace rings,
+ * so those which are being waited on are looked at periodically, as long
+ * as someone waits.
+ */
+static DECLARE_WAIT_QUEUE_HEAD(rproc_trace_wq);
+
+static void rproc_trace_tick(unsigned long data);
+static DEFINE_TIMER(rproc_trace_timer, rproc_trace_tick, 0, 0);
+
+static void rproc_trace_wait_soon(void)
+{
+	if (!timer_pending(&rproc_trace_timer))
+		mod_timer(&rproc_trace_timer,
+			jiffies + msecs_to_jiffies(RPROC_TRACE_POLL_MS));
+}
+
+static void rproc_trace_tick(unsigned long data)
+{
+	wake_up_interruptible(&rproc_trace_wq);
+
+	if (waitqueue_active(&rproc_trace_wq))
+		rproc_trace_wait_soon();
+}
+
+/*
+ * get the size of a trace ring, and the span of the logs it holds: returns
+ * false if the remote processor hasn't set it up (yet)
+ */
+bool rproc_trace_ring_span(struct rproc_mem_entry *trace,
+						u32 *head, u32 *tail, u32 *size)
+{
+	struct fw_trace_ring *ring = trace->va;
+
+	if (ACCESS_ONCE(ring->magic) != FW_TRACE_RING_MAGIC)
+		return false;
+
+	*size = ACCESS_ONCE(ring->size);
+	if (!*size || *size > trace->len - sizeof(*ring))
+		return false;
+
+	*head = ACCESS_ONCE(ring->head);
+	*tail = ACCESS_ONCE(ring->tail);
+
+	/* read the header before the logs it tells about */
+	rmb();
+
+	return true;
+}
+
+/* is there anything past @pos in a trace ring ? */
+static bool rproc_trace_ring_ready(struct rproc_mem_entry *trace, u32 pos)
+{
+	u32 head, tail, size;
+
+	return rproc_trace_ring_span(trace, &head, &tail, &size) && head != pos;
+}
+
+/* a trace ring is first read from the oldest logs it holds */
+static int rproc_trace_ring_open(struct inode *inode, struct file *filp)
+{
+	struct rproc_mem_entry *trace = inode->i_private;
+	u32 head, tail, size;
+
+	filp->private_data = trace;
+
+	if (!rproc_trace_ring_span(trace, &head, &tail, &size))
+		tail = 0;
+
+	/* the file position is that of the reader in the ring */
+	filp->f_pos = tail;
+
+	return nonseekable_open(inode, filp);
+}
+
+/**
+ * rproc_trace_ring_copy() - copy logs out of a trace ring
+ * @trace: the trace buffer, which is a ring
+ * @pos: position of the reader in the ring, which gets updated
+ * @buf: where to copy the logs to
+ * @count: most bytes to copy
+ *
+ * This function copies the logs that are past *@pos in the ring, and moves
+ * *@pos past them. Logs that were overwritten before the reader got to
+ * them are skipped, and so are those the remote processor overwrote while
+ * they were being copied, rather than being handed over garbled.
+ *
+ * Returns the number of bytes copied, which is 0 if there's nothing past
+ * *@pos (yet).
+ */
+u32 rproc_trace_ring_copy(struct rproc_mem_entry *trace, u32 *pos, char *buf,
+								u32 count)
+{
+	struct fw_trace_ring *ring = trace->va;
+	u32 head, tail, size, off, len, first;
+
+again:
+	if (!rproc_trace_ring_span(trace, &head, &tail, &size) || head == *pos)
+		return 0;
+
+	/* skip what was overwritten before we got to it */
+	if ((s32)(tail - *pos) > 0 || head - *pos > size)
+		*pos = head - tail > size ? head - size : tail;
+
+	len = min(head - *pos, count);
+	off = *pos % size;
+	first = min(len, size - off);
+
+	memcpy(buf, ring->data + off, first);
+	memcpy(buf + first, ring->data, len - first);
+
+	/* drop what was overwritten while we were copying it */
+	rmb();
+	tail = ACCESS_ONCE(ring->tail);
+	if ((s32)(tail - *pos) > 0) {
+		off = tail - *pos;
+		if (off >= len) {
+			*pos = tail;
+			goto again;
+		}
+
+		memmove(buf, buf + off, len - off);
+		*pos += off;
+		len -= off;
+	}
+
+	*pos += len;
+
+	return len;
+}
+
+/*
+ * Consume the logs of a trace ring, past the position of the reader. This
+ * blocks until there are some, unless the file is non-blocking.
+ */
+static ssize_t rproc_trace_ring_read(struct file *filp, char __user *userbuf,
+						size_t count, loff_t *ppos)
+{
+	struct rproc_mem_entry *trace = filp->private_data;
+	u32 pos = *ppos, len;
+	char *buf;
+	ssize_t ret;
+
+	if (!count)
+		return 0;
+
+	count = min_t(size_t, count, PAGE_SIZE);
+	buf = kmalloc(count, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	while (!(len = rproc_trace_ring_copy(trace, &pos, buf, count))) {
+		if (filp->f_flags & O_NONBLOCK) {
+			ret = -EAGAIN;
+			goto out;
+		}
+
+		rproc_trace_wait_soon();
+		ret = wait_event_interruptible(rproc_trace_wq,
+					rproc_trace_ring_ready(trace, pos));
+		if (ret)
+			goto out;
+	}
+
+	if (copy_to_user(userbuf, buf, len)) {
+		ret = -EFAULT;
+		goto out;
+	}
+
+	*ppos = pos;
+	ret = len;
+
+out:
+	kfree(buf);
+	return ret;
+}
+
+static unsigned int rproc_trace_ring_poll(struct file *filp, poll_table *wait)
+{
+	struct rproc_mem_entry *trace = filp->private_data;
+
+	poll_wait(filp, &rproc_trace_wq, wait);
+	rproc_trace_wait_soon();
+
+	if (rproc_trace_ring_ready(trace, filp->f_pos))
+		return POLLIN | POLLRDNORM;
+
+	return 0;
+}
+
+static const struct file_operations trace_ring_rproc_ops = {
+	.read = rproc_trace_ring_read,
+	.poll = rproc_trace_ring_poll,
+	.open = rproc_trace_ring_open,
+	.llseek	= no_llseek,
+};
+
+/* longest line a binary trace record is expanded to; longer ones are cut */
+#define RPROC_TRACE_BIN_LINE_MAX	256
+
+/*
+ * expand the binary trace record @rec (see fw_trace_rec) into @buf, which
+ * is @size bytes long: returns the length of the line
+ */
+static int rproc_trace_bin_expand(struct rproc_mem_entry *trace,
+				const u32 *rec, char *buf, int size)
+{
+	u32 fmt = FW_TRACE_REC_FMT(rec[0]);
+	u32 nargs = FW_TRACE_REC_NARGS(rec[0]);
+	const char *p, *end;
+	char spec[16], c;
+	int len = 0, n;
+	u32 arg = 0;
+
+	if (fmt >= trace->formats_len)
+		return scnprintf(buf, size, "<unknown format 0x%x>\n", fmt);
+
+	p = trace->formats + fmt;
+	end = trace->formats + trace->formats_len;
+
+	while (p < end && *p && len < size - 1) {
+		if (*p != '%') {
+			buf[len++] = *p++;
+			continue;
+		}
+
+		/* grab the flags, width and precision of the conversion */
+		n = 0;
+		spec[n++] = *p++;
+		while (p < end && *p && strchr("-+ #0123456789.", *p) &&
+						n < sizeof(spec) - 2)
+			spec[n++] = *p++;
+
+		/* the arguments are 32-bit, whatever their length modifiers */
+		while (p < end && *p && strchr("hljzt", *p))
+			p++;
+
+		if (p == end || !*p)
+			break;
+
+		c = *p++;
+		if (c == '%') {
+			buf[len++] = c;
+			continue;
+		}
+
+		/* every other conversion takes an argument, expanded or not */
+		if (arg >= nargs || !strchr("diouxXc", c)) {
+			buf[len++] = '?';
+			arg++;
+			continue;
+		}
+
+		spec[n++] = c;
+		spec[n] = '\0';
+
+		if (c == 'd' || c == 'i')
+			len += scnprintf(buf + len, size - len, spec,
+							(s32)rec[1 + arg++]);
+		else
+			len += scnprintf(buf + len, size - len, spec,
+							rec[1 + arg++]);
+	}
+
+	buf[len] = '\0';
+
+	return len;
+}
+
+/*
+ * Consume the records of a binary trace ring, past the position of the
+ * reader, expanding them into lines. Only whole lines are read (unless a
+ * single one doesn't fit @count), and only whole records are consumed.
+ */
+static ssize_t rproc_trace_bin_read(struct file *filp, char __user *userbuf,
+						size_t count, loff_t *ppos)
+{
+	struct rproc_mem_entry *trace = filp->private_data;
+	char line[RPROC_TRACE_BIN_LINE_MAX];
+	u32 pos = *ppos, start, len, off, recsz;
+	size_t out = 0;
+	char *text;
+	u32 *raw;
+	ssize_t ret;
+	int n;
+
+	if (!count)
+		return 0;
+
+	count = min_t(size_t, count, PAGE_SIZE);
+	text = kmalloc(count, GFP_KERNEL);
+	raw = kmalloc(PAGE_SIZE, GFP_KERNEL);
+	if (!text || !raw) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	while (!out) {
+		len = rproc_trace_ring_copy(trace, &pos, (char *)raw,
+								PAGE_SIZE);
+		if (!len) {
+			if (filp->f_flags & O_NONBLOCK) {
+				ret = -EAGAIN;
+				goto out;
+			}
+
+			rproc_trace_wait_soon();
+			ret = wait_event_interruptible(rproc_trace_wq,
+					rproc_trace_ring_ready(trace, pos));
+			if (ret)
+				goto out;
+			continue;
+		}
+
+		start = pos - len;
+
+		for (off = 0; len - off >= sizeof(*raw); off += recsz) {
+			recsz = (1 + FW_TRACE_REC_NARGS(raw[off / 4])) * 4;
+			if (recsz > len - off)
+				break;
+
+			n = rproc_trace_bin_expand(trace, raw + off / 4, line,
+								sizeof(line));
+			if (n > count - out) {
+				if (out)
+					break;
+				n = count;
+			}
+
+			memcpy(text + out, line, n);
+			out += n;
+		}
+
+		/* a record that can't be whole is garbage: skip it all */
+		pos = off ? start + off : start + len;
+	}
+
+	if (copy_to_user(userbuf, text, out)) {
+		ret = -EFAULT;
+		goto out;
+	}
+
+	*ppos = pos;
+	ret = out;
+
+out:
+	kfree(raw);
+	kfree(text);
+	return ret;
+}
+
+static const struct file_operations trace_bin_rproc_ops = {
+	.read = rproc_trace_bin_read,
+	.poll = rproc_trace_ring_poll,
+	.open = rproc_trace_ring_open,
+	.llseek	= no_llseek,
+};
+
 /*
  * A state-to-string lookup table, for exposing a human readable state
  * via debugfs. Always keep in sync with enum rproc_state
@@ -68,6 +437,9 @@ static const char * const rproc_state_string[] = {
 	"suspended",
 	"running",
 	"crashed",
+	"detached",
+	"armed",
+	"booting",
 	"invalid",
 };
 
@@ -190,6 +562,395 @@ static const struct file_operations rproc_recovery_ops = {
 	.llseek = generic_file_llseek,
 };
 
+/*
+ * expose the iommu mappings of the remote processor via debugfs, along with
+ * the mix of page sizes they're made of, which tells how much TLB pressure
+ * the remote processor is under.
+ */
+static ssize_t rproc_mappings_read(struct file *filp, char __user *userbuf,
+						size_t count, loff_t *ppos)
+{
+	struct rproc *rproc = filp->private_data;
+	unsigned long pages[BITS_PER_LONG] = { 0 };
+	const size_t size = PAGE_SIZE;
+	struct rproc_mem_entry *mapping;
+	struct rproc_hole *hole;
+	ssize_t ret;
+	char *buf;
+	int i = 0, idx;
+
+	buf = kmalloc(size, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	ret = mutex_lock_interruptible(&rproc->lock);
+	if (ret)
+		goto free_buf;
+
+	if (!rproc->domain) {
+		i = scnprintf(buf, size, "no iommu\n");
+		goto unlock;
+	}
+
+	list_for_each_entry(mapping, &rproc->mappings, node) {
+		i += scnprintf(buf + i, size - i,
+				"da 0x%08x pa 0x%08llx len 0x%08zx\n",
+				mapping->da, (unsigned long long)mapping->dma,
+				mapping->len);
+
+		rproc_count_pgsizes(rproc->domain->ops->pgsize_bitmap,
+				mapping->da, mapping->dma, mapping->len, pages);
+	}
+
+	/* pages faulted in on demand are mapped one by one */
+	list_for_each_entry(hole, &rproc->holes, node) {
+		idx = bitmap_weight(hole->faulted, hole->len >> PAGE_SHIFT);
+		i += scnprintf(buf + i, size - i,
+			"da 0x%08x pa 0x%08llx len 0x%08x (hole, %d pages in)\n",
+			hole->da, (unsigned long long)hole->dma, hole->len, idx);
+
+		pages[PAGE_SHIFT] += idx;
+	}
+
+	for (idx = BITS_PER_LONG - 1; idx >= 0; idx--) {
+		if (pages[idx])
+			i += scnprintf(buf + i, size - i, "%luK pages: %lu\n",
+						(1UL << idx) >> 10, pages[idx]);
+	}
+
+unlock:
+	mutex_unlock(&rproc->lock);
+	ret = simple_read_from_buffer(userbuf, count, ppos, buf, i);
+free_buf:
+	kfree(buf);
+	return ret;
+}
+
+static const struct file_operations rproc_mappings_ops = {
+	.read = rproc_mappings_read,
+	.open = simple_open,
+	.llseek	= generic_file_llseek,
+};
+
+/*
+ * expose what went through each vring (see struct rproc_vring_stats), and
+ * how many buffers the remote processor is yet to use on each of them
+ */
+static ssize_t rproc_vrings_read(struct file *filp, char __user *userbuf,
+						size_t count, loff_t *ppos)
+{
+	struct rproc *rproc = filp->private_data;
+	const size_t size = PAGE_SIZE;
+	struct rproc_vdev *rvdev;
+	struct rproc_vring *rvring;
+	struct rproc_vring_stats *stats;
+	struct vring vring;
+	ssize_t ret;
+	char *buf;
+	int i = 0, j;
+	u16 inflight;
+
+	buf = kmalloc(size, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	ret = mutex_lock_interruptible(&rproc->lock);
+	if (ret)
+		goto free_buf;
+
+	list_for_each_entry(rvdev, &rproc->rvdevs, node) {
+		for (j = 0; j < rvdev->num_vrings; j++) {
+			rvring = &rvdev->vring[j];
+			stats = &rvring->stats;
+
+			/* only the vrings whose virtqueue is set up are used */
+			if (!rvring->vq)
+				continue;
+
+			vring_init(&vring, rvring->len, rvring->va,
+							rvring->align);
+			inflight = ACCESS_ONCE(vring.avail->idx) -
+					ACCESS_ONCE(vring.used->idx);
+
+			i += scnprintf(buf + i, size - i,
+				"%s vring%d (notifyid %d, %d entries): "
+				"kicks %lu interrupts %lu spurious %lu "
+				"inflight %u inflight_max %u batch_max %u\n",
+				dev_name(&rvdev->vdev.dev), j,
+				rvring->notifyid, rvring->len, stats->kicks,
+				stats->interrupts, stats->spurious, inflight,
+				stats->inflight_max, stats->batch_max);
+		}
+	}
+
+	mutex_unlock(&rproc->lock);
+	ret = simple_read_from_buffer(userbuf, count, ppos, buf, i);
+free_buf:
+	kfree(buf);
+	return ret;
+}
+
+/* writing anything to the 'vrings' debugfs entry resets the statistics */
+static ssize_t rproc_vrings_write(struct file *filp,
+			const char __user *user_buf, size_t count, loff_t *ppos)
+{
+	struct rproc *rproc = filp->private_data;
+	struct rproc_vdev *rvdev;
+	int ret, j;
+
+	ret = mutex_lock_interruptible(&rproc->lock);
+	if (ret)
+		return ret;
+
+	list_for_each_entry(rvdev, &rproc->rvdevs, node)
+		for (j = 0; j < rvdev->num_vrings; j++)
+			memset(&rvdev->vring[j].stats, 0,
+					sizeof(rvdev->vring[j].stats));
+
+	mutex_unlock(&rproc->lock);
+
+	return count;
+}
+
+static const struct file_operations rproc_vrings_ops = {
+	.read = rproc_vrings_read,
+	.write = rproc_vrings_write,
+	.open = simple_open,
+	.llseek = generic_file_llseek,
+};
+
+/* expose how long each phase of the last boot took, in usecs */
+static ssize_t rproc_boot_profile_read(struct file *filp, char __user *userbuf,
+						size_t count, loff_t *ppos)
+{
+	struct rproc *rproc = filp->private_data;
+	char buf[256];
+	u64 ns, total = 0;
+	int i, len = 0;
+	ssize_t ret;
+
+	ret = mutex_lock_interruptible(&rproc->lock);
+	if (ret)
+		return ret;
+
+	for (i = 0; i < RPROC_BOOT_PHASES; i++) {
+		ns = ACCESS_ONCE(rproc->boot_ns[i]);
+		total += ns;
+		len += scnprintf(buf + len, sizeof(buf) - len, "%-12s %llu\n",
+					rproc_boot_phases[i],
+					div_u64(ns, NSEC_PER_USEC));
+	}
+
+	len += scnprintf(buf + len, sizeof(buf) - len, "%-12s %llu\n", "total",
+					div_u64(total, NSEC_PER_USEC));
+
+	mutex_unlock(&rproc->lock);
+
+	return simple_read_from_buffer(userbuf, count, ppos, buf, len);
+}
+
+static const struct file_operations rproc_boot_profile_ops = {
+	.read = rproc_boot_profile_read,
+	.open = simple_open,
+	.llseek	= generic_file_llseek,
+};
+
+/* expose how much host memory the remote processor pins down, and where */
+static ssize_t rproc_memory_read(struct file *filp, char __user *userbuf,
+						size_t count, loff_t *ppos)
+{
+	struct rproc *rproc = filp->private_data;
+	struct rproc_mem_usage usage;
+	struct rproc_mem_entry *entry;
+	const size_t size = PAGE_SIZE;
+	ssize_t ret;
+	char *buf;
+	int i = 0;
+
+	buf = kmalloc(size, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	ret = mutex_lock_interruptible(&rproc->lock);
+	if (ret)
+		goto free_buf;
+
+	list_for_each_entry(entry, &rproc->carveouts, node)
+		i += scnprintf(buf + i, size - i,
+			"carveout da 0x%08x pa 0x%08llx len 0x%08zx%s\n",
+			entry->da, (unsigned long long)entry->dma, entry->len,
+			entry->adopted ? " (adopted)" :
+			entry->shared ? " (shared)" :
+			entry->user ? " (user)" : "");
+
+	rproc_mem_usage(rproc, &usage);
+
+	mutex_unlock(&rproc->lock);
+
+	i += scnprintf(buf + i, size - i,
+			"%-13s %zu\n%-13s %zu\n%-13s %zu\n%-13s %zu\n"
+			"%-13s %zu\n%-13s %zu\n%-13s %zu\n%-13s %zu\n"
+			"%-13s %zu\n%-13s %zu\n%-13s %lu\n",
+			"carveouts", usage.carveouts,
+			"carveout_pad", usage.carveout_pad,
+			"holes", usage.holes,
+			"vrings", usage.vrings,
+			"vdev_bufs", usage.vdev_bufs,
+			"dump", usage.dump,
+			"fw_cache", usage.fw_cache,
+			"total", usage.total,
+			"shared", usage.shared,
+			"iommu_mapped", usage.iommu_mapped,
+			"iommu_ptes", usage.iommu_ptes);
+
+	ret = simple_read_from_buffer(userbuf, count, ppos, buf, i);
+free_buf:
+	kfree(buf);
+	return ret;
+}
+
+static const struct file_operations rproc_memory_ops = {
+	.read = rproc_memory_read,
+	.open = simple_open,
+	.llseek	= generic_file_llseek,
+};
+
+/*
+ * expose the core dump of the last crash via debugfs, as an ELF core file
+ * (see rproc_coredump_capture()). Writing to the 'coredump' debugfs entry
+ * dismisses the dump, which frees the memory it holds.
+ */
+static ssize_t rproc_coredump_dbg_read(struct file *filp, char __user *userbuf,
+						size_t count, loff_t *ppos)
+{
+	struct rproc *rproc = filp->private_data;
+
+	return rproc_coredump_read(rproc, userbuf, count, ppos);
+}
+
+static ssize_t
+rproc_coredump_dbg_write(struct file *filp, const char __user *user_buf,
+						size_t count, loff_t *ppos)
+{
+	struct rproc *rproc = filp->private_data;
+	int ret;
+
+	ret = mutex_lock_interruptible(&rproc->lock);
+	if (ret)
+		return ret;
+
+	rproc_coredump_free(rproc);
+
+	mutex_unlock(&rproc->lock);
+
+	return count;
+}
+
+static const struct file_operations rproc_coredump_ops = {
+	.read = rproc_coredump_dbg_read,
+	.write = rproc_coredump_dbg_write,
+	.open = simple_open,
+	.llseek = default_llseek,
+};
+
+/* expose the cpus the vring notifications are handled on via debugfs */
+static ssize_t rproc_ipc_cpus_read(struct file *filp, char __user *userbuf,
+						size_t count, loff_t *ppos)
+{
+	struct rproc *rproc = filp->private_data;
+	char *buf;
+	ssize_t ret;
+	int i;
+
+	buf = kmalloc(PAGE_SIZE, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	i = cpulist_scnprintf(buf, PAGE_SIZE - 1, rproc->ipc_cpus);
+	buf[i++] = '\n';
+
+	ret = simple_read_from_buffer(userbuf, count, ppos, buf, i);
+	kfree(buf);
+	return ret;
+}
+
+/*
+ * By writing a cpu list (e.g. "2" or "2-3") to the 'ipc_cpus' debugfs
+ * entry, the vring notifications of the remote processor are handed over
+ * to those cpus. An empty list has them handled wherever they're reported.
+ */
+static ssize_t
+rproc_ipc_cpus_write(struct file *filp, const char __user *user_buf,
+						size_t count, loff_t *ppos)
+{
+	struct rproc *rproc = filp->private_data;
+	cpumask_var_t mask;
+	int ret;
+
+	if (!alloc_cpumask_var(&mask, GFP_KERNEL))
+		return -ENOMEM;
+
+	ret = cpumask_parselist_user(user_buf, count, mask);
+	if (!ret)
+		cpumask_copy(rproc->ipc_cpus, mask);
+
+	free_cpumask_var(mask);
+	return ret ? ret : count;
+}
+
+static const struct file_operations rproc_ipc_cpus_ops = {
+	.read = rproc_ipc_cpus_read,
+	.write = rproc_ipc_cpus_write,
+	.open = simple_open,
+	.llseek = generic_file_llseek,
+};
+
+/* expose the notification moderation of the remote processor via debugfs */
+static ssize_t rproc_coalesce_read(struct file *filp, char __user *userbuf,
+						size_t count, loff_t *ppos)
+{
+	struct rproc *rproc = filp->private_data;
+	char buf[512];
+	int i;
+
+	i = rproc_coalesce_print(rproc, buf, sizeof(buf));
+
+	return simple_read_from_buffer(userbuf, count, ppos, buf, i);
+}
+
+/*
+ * Writing "<name> <value>" pairs to the 'coalesce' debugfs entry tunes the
+ * notification moderation of the remote processor, the way 'ethtool -C'
+ * does for a NIC, e.g. "adaptive off usecs 50 frames 16" (see
+ * rproc_coalesce_set()).
+ */
+static ssize_t
+rproc_coalesce_write(struct file *filp, const char __user *user_buf,
+						size_t count, loff_t *ppos)
+{
+	struct rproc *rproc = filp->private_data;
+	char buf[256];
+	int ret;
+
+	if (count >= sizeof(buf))
+		return -EINVAL;
+
+	if (copy_from_user(buf, user_buf, count))
+		return -EFAULT;
+	buf[count] = '\0';
+
+	ret = rproc_coalesce_set(rproc, buf);
+
+	return ret ? ret : count;
+}
+
+static const struct file_operations rproc_coalesce_ops = {
+	.read = rproc_coalesce_read,
+	.write = rproc_coalesce_write,
+	.open = simple_open,
+	.llseek = generic_file_llseek,
+};
+
 void rproc_remove_trace_file(struct dentry *tfile)
 {
 	debugfs_remove(tfile);
@@ -198,10 +959,15 @@ void rproc_remove_trace_file(struct dentry *tfile)
 struct dentry *rproc_create_trace_file(const char *name, struct rproc *rproc,
 					struct rproc_mem_entry *trace)
 {
+	const struct file_operations *fops = &trace_rproc_ops;
 	struct dentry *tfile;
 
-	tfile = debugfs_create_file(name, 0400, rproc->dbg_dir,
-						trace, &trace_rproc_ops);
+	if (trace->flags & FW_TRACE_BINARY)
+		fops = &trace_bin_rproc_ops;
+	else if (trace->flags & FW_TRACE_RING)
+		fops = &trace_ring_rproc_ops;
+
+	tfile = debugfs_create_file(name, 0400, rproc->dbg_dir, trace, fops);
 	if (!tfile) {
 		dev_err(&rproc->dev, "failed to create debugfs trace entry\n");
 		return NULL;
@@ -235,6 +1001,20 @@ void rproc_create_debug_dir(struct rproc *rproc)
 					rproc, &rproc_state_ops);
 	debugfs_create_file("recovery", 0400, rproc->dbg_dir,
 					rproc, &rproc_recovery_ops);
+	debugfs_create_file("mappings", 0400, rproc->dbg_dir,
+					rproc, &rproc_mappings_ops);
+	debugfs_create_file("boot_profile", 0400, rproc->dbg_dir,
+					rproc, &rproc_boot_profile_ops);
+	debugfs_create_file("memory", 0400, rproc->dbg_dir,
+					rproc, &rproc_memory_ops);
+	debugfs_create_file("vrings", 0600, rproc->dbg_dir,
+					rproc, &rproc_vrings_ops);
+	debugfs_create_file("coredump", 0600, rproc->dbg_dir,
+					rproc, &rproc_coredump_ops);
+	debugfs_create_file("ipc_cpus", 0600, rproc->dbg_dir,
+					rproc, &rproc_ipc_cpus_ops);
+	debugfs_create_file("coalesce", 0600, rproc->dbg_dir,
+					rproc, &rproc_coalesce_ops);
 }
 
 void __init rproc_init_debugfs(void)
@@ -244,10 +1024,14 @@ void __init rproc_init_debugfs(void)
 		if (!rproc_dbg)
 			pr_err("can't create debugfs dir\n");
 	}
+
+	rproc_init_bench(rproc_dbg);
 }
 
 void __exit rproc_exit_debugfs(void)
 {
+	rproc_exit_bench();
+
 	if (rproc_dbg)
 		debugfs_remove(rproc_dbg);
 }
@@ -0,0 +1,355 @@
+/*
+ * Remote Processor Framework runtime memory
+ *
+ * The carveouts of a firmware are sized for its worst case, at build time.
+ * A remote processor may rather declare a window of its device address
+ * space (see struct fw_rsc_dynmem), and ask the host, as it runs, for
+ * regions of memory mapped into it, and give them back once its load
+ * drops. It asks through a struct fw_dynmem, and kicks the host with the
+ * notifyid of the window; the host allocates (or frees) the region, maps
+ * it onto the iommu (or unmaps it), and kicks it back.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#define pr_fmt(fmt)    "%s: " fmt, __func__
+
+#include <linux/kernel.h>
+#include <linux/remoteproc.h>
+#include <linux/rcupdate.h>
+#include <linux/slab.h>
+#include <linux/iommu.h>
+#include <linux/dma-mapping.h>
+#include <linux/workqueue.h>
+#include <linux/mutex.h>
+
+#include "remoteproc_internal.h"
+
+/**
+ * struct rproc_dynmem - the runtime memory window of a remote processor
+ * @rproc: the remote processor
+ * @da: device address of the window
+ * @len: size of the window, in bytes
+ * @flags: iommu protection flags of the regions mapped into the window
+ * @ctrl: the control block the remote processor asks for memory with
+ * @notifyid: the notifyid requests are kicked with, both ways
+ * @lock: protects @regions and @used
+ * @regions: the regions mapped into the window, sorted by device address
+ * @used: how much of the window is mapped, in bytes
+ * @work: serves the requests of the remote processor
+ */
+struct rproc_dynmem {
+	struct rproc *rproc;
+	u32 da;
+	u32 len;
+	u32 flags;
+	struct fw_dynmem *ctrl;
+	u32 notifyid;
+	struct mutex lock;
+	struct list_head regions;
+	u32 used;
+	struct work_struct work;
+};
+
+/* is [@da, @da + @len) within the window of @dm ? */
+static bool rproc_dynmem_fits(struct rproc_dynmem *dm, u64 da, u64 len)
+{
+	return da >= dm->da && len <= dm->len && da - dm->da <= dm->len - len;
+}
+
+/* unmap a region from the window, and free it. Called with dm->lock held */
+static void rproc_dynmem_free(struct rproc_dynmem *dm,
+					struct rproc_mem_entry *region)
+{
+	struct rproc *rproc = dm->rproc;
+	size_t unmapped;
+
+	unmapped = iommu_unmap(rproc->domain, region->da, region->len);
+	if (unmapped != region->len)
+		dev_err(&rproc->dev, "failed to unmap %zu/%zu\n", region->len,
+								unmapped);
+
+	dma_free_coherent(rproc->dev.parent, region->len, region->va,
+								region->dma);
+
+	dm->used -= region->len;
+	list_del(&region->node);
+	kfree(region);
+}
+
+/*
+ * allocate a region of @len bytes, and map it at the lowest device address
+ * of the window it fits at. Called with dm->lock held.
+ *
+ * Returns the device address of the region, or a negative error code.
+ */
+static s64 rproc_dynmem_alloc(struct rproc_dynmem *dm, u32 len)
+{
+	struct rproc *rproc = dm->rproc;
+	struct device *dev = &rproc->dev;
+	struct rproc_mem_entry *region, *next;
+	struct list_head *pos = &dm->regions;
+	u32 da = dm->da;
+	int ret;
+
+	len = PAGE_ALIGN(len);
+	if (!len || len > dm->len - dm->used)
+		return -ENOMEM;
+
+	/* first fit, between the regions that are mapped already */
+	list_for_each_entry(next, &dm->regions, node) {
+		if (next->da - da >= len)
+			break;
+		da = next->da + next->len;
+		pos = &next->node;
+	}
+	if (!rproc_dynmem_fits(dm, da, len))
+		return -ENOSPC;
+
+	region = kzalloc(sizeof(*region), GFP_KERNEL);
+	if (!region)
+		return -ENOMEM;
+
+	region->va = dma_alloc_coherent(dev->parent, len, &region->dma,
+								GFP_KERNEL);
+	if (!region->va) {
+		ret = -ENOMEM;
+		goto free_region;
+	}
+
+	ret = iommu_map(rproc->domain, da, region->dma, len, dm->flags);
+	if (ret) {
+		dev_err(dev, "iommu_map failed: %d\n", ret);
+		goto free_dma;
+	}
+
+	region->da = da;
+	region->len = len;
+	list_add(&region->node, pos);
+	dm->used += len;
+
+	return da;
+
+free_dma:
+	dma_free_coherent(dev->parent, len, region->va, region->dma);
+free_region:
+	kfree(region);
+	return ret;
+}
+
+/* serve the request of the remote processor, and kick it back */
+static void rproc_dynmem_work(struct work_struct *work)
+{
+	struct rproc_dynmem *dm = container_of(work, struct rproc_dynmem,
+									work);
+	struct fw_dynmem *ctrl = dm->ctrl;
+	struct rproc *rproc = dm->rproc;
+	struct rproc_mem_entry *region;
+	u32 seq, op, da, len;
+	s64 ret;
+
+	seq = ACCESS_ONCE(ctrl->seq);
+	if (seq == ctrl->done)
+		return;
+
+	/* read the request only after the sequence number that published it */
+	rmb();
+	op = ctrl->op;
+	da = ctrl->da;
+	len = ctrl->len;
+
+	mutex_lock(&dm->lock);
+
+	if (op == FW_DYNMEM_ALLOC) {
+		ret = rproc_dynmem_alloc(dm, len);
+		if (ret >= 0) {
+			ctrl->da = ret;
+			ret = 0;
+		}
+	} else if (op == FW_DYNMEM_FREE) {
+		ret = -ENOENT;
+		list_for_each_entry(region, &dm->regions, node) {
+			if (region->da == da) {
+				rproc_dynmem_free(dm, region);
+				ret = 0;
+				break;
+			}
+		}
+	} else {
+		ret = -EINVAL;
+	}
+
+	dev_dbg(&rproc->dev, "dynmem op %u da 0x%x len 0x%x: %lld, 0x%x used\n",
+					op, da, len, ret, dm->used);
+
+	mutex_unlock(&dm->lock);
+
+	/* the region and its status before the number that tells they're set */
+	ctrl->status = ret;
+	wmb();
+	ctrl->done = seq;
+
+	rproc->ops->kick(rproc, dm->notifyid);
+}
+
+/* give back all the regions mapped into the window of @dm */
+static void rproc_dynmem_free_all(struct rproc_dynmem *dm)
+{
+	struct rproc_mem_entry *region, *tmp;
+
+	mutex_lock(&dm->lock);
+	list_for_each_entry_safe(region, tmp, &dm->regions, node)
+		rproc_dynmem_free(dm, region);
+	mutex_unlock(&dm->lock);
+}
+
+/**
+ * rproc_dynmem_attach() - handle a runtime memory window resource
+ * @rproc: the remote processor
+ * @rsc: the runtime memory resource entry
+ *
+ * Must be called with rproc->lock held.
+ *
+ * Returns 0 on success, or an appropriate error code otherwise.
+ */
+int rproc_dynmem_attach(struct rproc *rproc, struct fw_rsc_dynmem *rsc)
+{
+	struct device *dev = &rproc->dev;
+	struct rproc_dynmem *dm;
+
+	if (rproc->dynmem) {
+		dev_err(dev, "only one runtime memory window is supported\n");
+		return -EINVAL;
+	}
+
+	/* the regions are mapped into the window, which needs an iommu */
+	if (!rproc->domain) {
+		dev_err(dev, "runtime memory needs an iommu\n");
+		return -EINVAL;
+	}
+
+	if (!rsc->len || rsc->da & ~PAGE_MASK ||
+			rsc->len > 0xffffffffU - rsc->da + 1 ||
+			rsc->notifyid == FW_RSC_NOTIFY_ID_ANY) {
+		dev_err(dev, "bad dynmem window 0x%x+0x%x, notifyid %u\n",
+					rsc->da, rsc->len, rsc->notifyid);
+		return -EINVAL;
+	}
+
+	dm = kzalloc(sizeof(*dm), GFP_KERNEL);
+	if (!dm) {
+		dev_err(dev, "kzalloc dynmem failed\n");
+		return -ENOMEM;
+	}
+
+	dm->ctrl = rproc_da_to_va(rproc, rsc->ctrl, sizeof(*dm->ctrl));
+	if (!dm->ctrl) {
+		dev_err(dev, "bad dynmem control block da 0x%x\n", rsc->ctrl);
+		kfree(dm);
+		return -EINVAL;
+	}
+
+	dm->rproc = rproc;
+	dm->da = rsc->da;
+	dm->len = rsc->len & PAGE_MASK;
+	dm->flags = rsc->flags;
+	dm->notifyid = rsc->notifyid;
+	mutex_init(&dm->lock);
+	INIT_LIST_HEAD(&dm->regions);
+	INIT_WORK(&dm->work, rproc_dynmem_work);
+
+	rcu_assign_pointer(rproc->dynmem, dm);
+
+	dev_dbg(dev, "dynmem window: da 0x%x len 0x%x, notifyid %u\n",
+					rsc->da, rsc->len, rsc->notifyid);
+
+	return 0;
+}
+
+/**
+ * rproc_dynmem_detach() - forget about the runtime memory window
+ * @rproc: the remote processor
+ *
+ * The regions still mapped into the window are all unmapped, and freed.
+ * Called as the resources of @rproc are cleaned up, with rproc->lock held.
+ */
+void rproc_dynmem_detach(struct rproc *rproc)
+{
+	struct rproc_dynmem *dm = rproc->dynmem;
+
+	if (!dm)
+		return;
+
+	rcu_assign_pointer(rproc->dynmem, NULL);
+	synchronize_rcu();
+	cancel_work_sync(&dm->work);
+
+	rproc_dynmem_free_all(dm);
+	kfree(dm);
+}
+
+/**
+ * rproc_dynmem_start() - serve runtime memory to a remote processor
+ * @rproc: the remote processor, which is about to be started
+ *
+ * The regions a previous run of @rproc asked for (if its resources were
+ * kept around since) are given back: it starts over from its carveouts.
+ *
+ * Must be called with rproc->lock held.
+ */
+void rproc_dynmem_start(struct rproc *rproc)
+{
+	struct rproc_dynmem *dm = rproc->dynmem;
+
+	if (!dm)
+		return;
+
+	/* no request may be left over from a previous run */
+	cancel_work_sync(&dm->work);
+	dm->ctrl->seq = 0;
+	dm->ctrl->done = 0;
+
+	rproc_dynmem_free_all(dm);
+}
+
+/**
+ * rproc_dynmem_interrupt() - look at the memory request of a notification
+ * @rproc: the remote processor
+ * @notifyid: the notifyid the remote processor signalled, or RPROC_ALL_VQS
+ *
+ * Called from rproc_vq_interrupt() and the likes, possibly in interrupt
+ * context, before the vrings are looked at. The request is then served
+ * from a work.
+ *
+ * Returns IRQ_HANDLED if the notification was about a memory request, and
+ * IRQ_NONE otherwise.
+ */
+irqreturn_t rproc_dynmem_interrupt(struct rproc *rproc, int notifyid)
+{
+	struct rproc_dynmem *dm;
+	irqreturn_t ret = IRQ_NONE;
+
+	rcu_read_lock();
+
+	dm = rcu_dereference(rproc->dynmem);
+	if (!dm || (notifyid != RPROC_ALL_VQS && notifyid != dm->notifyid))
+		goto unlock;
+
+	if (ACCESS_ONCE(dm->ctrl->seq) != ACCESS_ONCE(dm->ctrl->done)) {
+		queue_work(system_unbound_wq, &dm->work);
+		ret = IRQ_HANDLED;
+	} else if (notifyid == dm->notifyid) {
+		ret = IRQ_HANDLED;
+	}
+
+unlock:
+	rcu_read_unlock();
+	return ret;
+}
@@ -29,76 +29,389 @@
 #include <linux/firmware.h>
 #include <linux/remoteproc.h>
 #include <linux/elf.h>
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/workqueue.h>
+#include <linux/completion.h>
+#include <linux/cpumask.h>
+#include <linux/xz.h>
 
 #include "remoteproc_internal.h"
 
+/* big segments are copied in chunks of this size, by several cpus at once */
+#define RPROC_ELF_COPY_CHUNK	(1024 * 1024)
+
+/* largest LZMA2 dictionary we're willing to allocate for a packed image */
+#define RPROC_ELF_XZ_DICT_MAX	(64 * 1024 * 1024)
+
 /**
- * rproc_elf_sanity_check() - Sanity Check ELF firmware image
- * @rproc: the remote processor handle
- * @fw: the ELF firmware image
- *
- * Make sure this fw image is sane.
+ * struct rproc_elf_copier - tracks the segment copies that are in flight
+ * @pending: number of chunks still being copied, plus one for the submitter
+ * @done: completed when all chunks have been copied
  */
-static int
-rproc_elf_sanity_check(struct rproc *rproc, const struct firmware *fw)
+struct rproc_elf_copier {
+	atomic_t pending;
+	struct completion done;
+};
+
+/**
+ * struct rproc_elf_chunk - a chunk of segment to copy (or zero out)
+ * @work: queued on the unbound system workqueue
+ * @copier: the copier this chunk belongs to
+ * @dst: where the chunk goes
+ * @src: where it comes from, or NULL if it should be zeroed out
+ * @len: size of the chunk, in bytes
+ */
+struct rproc_elf_chunk {
+	struct work_struct work;
+	struct rproc_elf_copier *copier;
+	void *dst;
+	const void *src;
+	size_t len;
+};
+
+/**
+ * struct rproc_elf_info - the ELF header fields we care about
+ * @class: ELFCLASS32 or ELFCLASS64
+ * @entry: the image's entry point
+ * @phoff: file offset of the program headers
+ * @shoff: file offset of the section headers
+ * @phnum: number of program headers
+ * @shnum: number of section headers
+ * @shstrndx: index of the section holding the section names
+ */
+struct rproc_elf_info {
+	u8 class;
+	u64 entry;
+	u64 phoff;
+	u64 shoff;
+	u16 phnum;
+	u16 shnum;
+	u16 shstrndx;
+};
+
+/**
+ * struct rproc_elf_seg - a program header, whatever the class of the image
+ * @type: type of the segment
+ * @da: device address the segment should be loaded at (its p_paddr)
+ * @offset: file offset of the segment
+ * @filesz: size of the segment in the file
+ * @memsz: size of the segment in memory
+ * @flags: permissions of the segment (PF_* bits)
+ */
+struct rproc_elf_seg {
+	u32 type;
+	u64 da;
+	u64 offset;
+	u64 filesz;
+	u64 memsz;
+	u32 flags;
+};
+
+/**
+ * struct rproc_elf_sec - a section header, whatever the class of the image
+ * @name: offset of the section's name in the section names table
+ * @offset: file offset of the section
+ * @size: size of the section
+ * @addr: address the section runs at
+ */
+struct rproc_elf_sec {
+	u32 name;
+	u64 offset;
+	u64 size;
+	u64 addr;
+};
+
+/**
+ * struct rproc_elf_src - an image that is read piece by piece
+ * @file: the firmware file it's read from, or NULL if it's a packed image
+ * @size: size of the image, or SIZE_MAX if it's packed (and thus unknown)
+ * @xz: decoder of the packed image
+ * @buf: input (the whole packed image) and output of @xz
+ * @pos: offset, in the unpacked image, of the next byte @xz outputs
+ * @scratch: where @xz outputs the bytes we skip over
+ */
+struct rproc_elf_src {
+	struct file *file;
+	size_t size;
+#ifdef CONFIG_REMOTEPROC_XZ
+	struct xz_dec *xz;
+	struct xz_buf buf;
+	u64 pos;
+	void *scratch;
+#endif
+};
+
+/**
+ * struct rproc_elf_stream - what's needed to stream an ELF image's segments
+ * @info: the image's ELF header
+ * @phdrs: the image's program headers
+ * @size: size of the image, or SIZE_MAX if it's unknown
+ * @table_offset: file offset of the image's resource table, so the copy we
+ *		  handled (and possibly updated) can be put back over the one
+ *		  that is loaded along with the segments
+ */
+struct rproc_elf_stream {
+	struct rproc_elf_info info;
+	void *phdrs;
+	size_t size;
+	u64 table_offset;
+};
+
+static size_t rproc_elf_ehdr_size(u8 class)
 {
-	const char *name = rproc->firmware;
+	return class == ELFCLASS64 ? sizeof(struct elf64_hdr) :
+						sizeof(struct elf32_hdr);
+}
+
+static size_t rproc_elf_phdr_size(u8 class)
+{
+	return class == ELFCLASS64 ? sizeof(struct elf64_phdr) :
+						sizeof(struct elf32_phdr);
+}
+
+static size_t rproc_elf_shdr_size(u8 class)
+{
+	return class == ELFCLASS64 ? sizeof(struct elf64_shdr) :
+						sizeof(struct elf32_shdr);
+}
+
+/* is [@offset, @offset + @len) within a @size bytes image ? */
+static bool rproc_elf_in_range(u64 offset, u64 len, size_t size)
+{
+	return offset <= size && len <= size - offset;
+}
+
+/*
+ * grab the ELF header of an image, whose first @len bytes are at @data,
+ * and make sure it's one we can handle.
+ */
+static int rproc_elf_get_info(struct rproc *rproc, const void *data,
+				size_t len, struct rproc_elf_info *info)
+{
+	const unsigned char *ident = data;
 	struct device *dev = &rproc->dev;
-	struct elf32_hdr *ehdr;
-	char class;
 
-	if (!fw) {
-		dev_err(dev, "failed to load %s\n", name);
+	if (len < EI_NIDENT) {
+		dev_err(dev, "Image is too small\n");
 		return -EINVAL;
 	}
 
-	if (fw->size < sizeof(struct elf32_hdr)) {
-		dev_err(dev, "Image is too small\n");
+	if (memcmp(ident, ELFMAG, SELFMAG)) {
+		dev_err(dev, "Image is corrupted (bad magic)\n");
 		return -EINVAL;
 	}
 
-	ehdr = (struct elf32_hdr *)fw->data;
-
-	/* We only support ELF32 at this point */
-	class = ehdr->e_ident[EI_CLASS];
-	if (class != ELFCLASS32) {
-		dev_err(dev, "Unsupported class: %d\n", class);
+	info->class = ident[EI_CLASS];
+	if (info->class != ELFCLASS32 && info->class != ELFCLASS64) {
+		dev_err(dev, "Unsupported class: %d\n", info->class);
 		return -EINVAL;
 	}
 
 	/* We assume the firmware has the same endianess as the host */
 # ifdef __LITTLE_ENDIAN
-	if (ehdr->e_ident[EI_DATA] != ELFDATA2LSB) {
+	if (ident[EI_DATA] != ELFDATA2LSB) {
 # else /* BIG ENDIAN */
-	if (ehdr->e_ident[EI_DATA] != ELFDATA2MSB) {
+	if (ident[EI_DATA] != ELFDATA2MSB) {
 # endif
 		dev_err(dev, "Unsupported firmware endianess\n");
 		return -EINVAL;
 	}
 
-	if (fw->size < ehdr->e_shoff + sizeof(struct elf32_shdr)) {
+	if (len < rproc_elf_ehdr_size(info->class)) {
 		dev_err(dev, "Image is too small\n");
 		return -EINVAL;
 	}
 
-	if (memcmp(ehdr->e_ident, ELFMAG, SELFMAG)) {
-		dev_err(dev, "Image is corrupted (bad magic)\n");
+	if (info->class == ELFCLASS64) {
+		const struct elf64_hdr *ehdr = data;
+
+		info->entry = ehdr->e_entry;
+		info->phoff = ehdr->e_phoff;
+		info->shoff = ehdr->e_shoff;
+		info->phnum = ehdr->e_phnum;
+		info->shnum = ehdr->e_shnum;
+		info->shstrndx = ehdr->e_shstrndx;
+	} else {
+		const struct elf32_hdr *ehdr = data;
+
+		info->entry = ehdr->e_entry;
+		info->phoff = ehdr->e_phoff;
+		info->shoff = ehdr->e_shoff;
+		info->phnum = ehdr->e_phnum;
+		info->shnum = ehdr->e_shnum;
+		info->shstrndx = ehdr->e_shstrndx;
+	}
+
+	return 0;
+}
+
+/* make sure the headers of a @size bytes image are where they should be */
+static int rproc_elf_check_info(struct rproc *rproc,
+				struct rproc_elf_info *info, size_t size)
+{
+	struct device *dev = &rproc->dev;
+
+	if (!rproc_elf_in_range(info->shoff, rproc_elf_shdr_size(info->class),
+									size)) {
+		dev_err(dev, "Image is too small\n");
 		return -EINVAL;
 	}
 
-	if (ehdr->e_phnum == 0) {
+	if (info->phnum == 0) {
 		dev_err(dev, "No loadable segments\n");
 		return -EINVAL;
 	}
 
-	if (ehdr->e_phoff > fw->size) {
+	if (!rproc_elf_in_range(info->phoff,
+			info->phnum * rproc_elf_phdr_size(info->class), size)) {
 		dev_err(dev, "Firmware size is too small\n");
 		return -EINVAL;
 	}
 
+	/* rproc->bootaddr is only 32 bits wide */
+	if ((u32)info->entry != info->entry) {
+		dev_err(dev, "Unsupported boot address 0x%llx\n", info->entry);
+		return -EINVAL;
+	}
+
 	return 0;
 }
 
+/* grab the @i'th program header out of @phdrs */
+static void rproc_elf_get_seg(const struct rproc_elf_info *info,
+			const void *phdrs, int i, struct rproc_elf_seg *seg)
+{
+	if (info->class == ELFCLASS64) {
+		const struct elf64_phdr *phdr = phdrs;
+
+		seg->type = phdr[i].p_type;
+		seg->da = phdr[i].p_paddr;
+		seg->offset = phdr[i].p_offset;
+		seg->filesz = phdr[i].p_filesz;
+		seg->memsz = phdr[i].p_memsz;
+		seg->flags = phdr[i].p_flags;
+	} else {
+		const struct elf32_phdr *phdr = phdrs;
+
+		seg->type = phdr[i].p_type;
+		seg->da = phdr[i].p_paddr;
+		seg->offset = phdr[i].p_offset;
+		seg->filesz = phdr[i].p_filesz;
+		seg->memsz = phdr[i].p_memsz;
+		seg->flags = phdr[i].p_flags;
+	}
+}
+
+/* grab the @i'th section header out of @shdrs */
+static void rproc_elf_get_sec(const struct rproc_elf_info *info,
+			const void *shdrs, int i, struct rproc_elf_sec *sec)
+{
+	if (info->class == ELFCLASS64) {
+		const struct elf64_shdr *shdr = shdrs;
+
+		sec->name = shdr[i].sh_name;
+		sec->offset = shdr[i].sh_offset;
+		sec->size = shdr[i].sh_size;
+		sec->addr = shdr[i].sh_addr;
+	} else {
+		const struct elf32_shdr *shdr = shdrs;
+
+		sec->name = shdr[i].sh_name;
+		sec->offset = shdr[i].sh_offset;
+		sec->size = shdr[i].sh_size;
+		sec->addr = shdr[i].sh_addr;
+	}
+}
+
+/*
+ * is @name the resource table's ? @names is a @namesz bytes section names
+ * table, which we don't trust for null terminating its entries.
+ */
+static bool rproc_elf_is_rsc_table(const char *names, u64 namesz, u32 name)
+{
+	static const char rsc_table[] = ".resource_table";
+
+	return name < namesz && namesz - name >= sizeof(rsc_table) &&
+			!memcmp(names + name, rsc_table, sizeof(rsc_table));
+}
+
+/*
+ * look for a PT_RPROC_RSC_TABLE program header in @phdrs, and if there's
+ * one, put where it says the resource table is in @sec. This only takes a
+ * look at a handful of program headers, instead of the (possibly
+ * thousands of) section headers and their names.
+ */
+static bool rproc_elf_find_rsc_phdr(const struct rproc_elf_info *info,
+				const void *phdrs, struct rproc_elf_sec *sec)
+{
+	struct rproc_elf_seg seg;
+	int i;
+
+	for (i = 0; i < info->phnum; i++) {
+		rproc_elf_get_seg(info, phdrs, i, &seg);
+		if (seg.type != PT_RPROC_RSC_TABLE)
+			continue;
+
+		sec->offset = seg.offset;
+		sec->size = seg.filesz;
+		return true;
+	}
+
+	return false;
+}
+
+/**
+ * rproc_elf_is_packed() - is this a packed firmware image ?
+ * @rproc: the remote processor handle
+ * @fw: the firmware image
+ *
+ * Packed (i.e. XZ compressed) images can't be used in place, and are
+ * unpacked straight to their destination by the streaming ops instead.
+ */
+static bool rproc_elf_is_packed(struct rproc *rproc, const struct firmware *fw)
+{
+#ifdef CONFIG_REMOTEPROC_XZ
+	static const u8 xz_magic[] = { 0xfd, '7', 'z', 'X', 'Z', 0x00 };
+
+	return fw->size >= sizeof(xz_magic) &&
+				!memcmp(fw->data, xz_magic, sizeof(xz_magic));
+#else
+	return false;
+#endif
+}
+
+/**
+ * rproc_elf_sanity_check() - Sanity Check ELF firmware image
+ * @rproc: the remote processor handle
+ * @fw: the ELF firmware image
+ *
+ * Make sure this fw image is sane. Packed images are only checked once
+ * they're unpacked, when they're parsed.
+ */
+static int
+rproc_elf_sanity_check(struct rproc *rproc, const struct firmware *fw)
+{
+	const char *name = rproc->firmware;
+	struct device *dev = &rproc->dev;
+	struct rproc_elf_info info;
+	int ret;
+
+	if (!fw) {
+		dev_err(dev, "failed to load %s\n", name);
+		return -EINVAL;
+	}
+
+	if (rproc_elf_is_packed(rproc, fw))
+		return 0;
+
+	ret = rproc_elf_get_info(rproc, fw->data, fw->size, &info);
+	if (ret)
+		return ret;
+
+	return rproc_elf_check_info(rproc, &info, fw->size);
+}
+
 /**
  * rproc_elf_get_boot_addr() - Get rproc's boot address.
  * @rproc: the remote processor handle
@@ -113,9 +426,148 @@ rproc_elf_sanity_check(struct rproc *rproc, const struct firmware *fw)
 static
 u32 rproc_elf_get_boot_addr(struct rproc *rproc, const struct firmware *fw)
 {
-	struct elf32_hdr *ehdr  = (struct elf32_hdr *)fw->data;
+	struct rproc_elf_info info;
+
+	/* the image was sanity checked already, so this can't fail */
+	if (rproc_elf_get_info(rproc, fw->data, fw->size, &info))
+		return 0;
+
+	return info.entry;
+}
+
+static void rproc_elf_copier_init(struct rproc_elf_copier *copier)
+{
+	atomic_set(&copier->pending, 1);
+	init_completion(&copier->done);
+}
+
+static void rproc_elf_copy_chunk(void *dst, const void *src, size_t len)
+{
+	if (src)
+		memcpy(dst, src, len);
+	else
+		memset(dst, 0, len);
+}
+
+static void rproc_elf_copy_work(struct work_struct *work)
+{
+	struct rproc_elf_chunk *chunk = container_of(work,
+					struct rproc_elf_chunk, work);
+	struct rproc_elf_copier *copier = chunk->copier;
+
+	rproc_elf_copy_chunk(chunk->dst, chunk->src, chunk->len);
+	kfree(chunk);
+
+	if (atomic_dec_and_test(&copier->pending))
+		complete(&copier->done);
+}
+
+/*
+ * copy (or zero out, if @src is NULL) @len bytes of segment to @dst.
+ *
+ * Big segments are split into chunks, which are copied in parallel on the
+ * unbound workqueue, so they can spread over all the online cpus. Small
+ * ones, or chunks we can't allocate the tracking memory for, are simply
+ * copied right away.
+ */
+static void rproc_elf_copy(struct rproc_elf_copier *copier, void *dst,
+						const void *src, size_t len)
+{
+	struct rproc_elf_chunk *chunk;
+	size_t chunk_len;
+
+	if (num_online_cpus() == 1 || len < 2 * RPROC_ELF_COPY_CHUNK) {
+		rproc_elf_copy_chunk(dst, src, len);
+		return;
+	}
+
+	while (len) {
+		chunk_len = min_t(size_t, len, RPROC_ELF_COPY_CHUNK);
+
+		chunk = kmalloc(sizeof(*chunk), GFP_KERNEL);
+		if (chunk) {
+			INIT_WORK(&chunk->work, rproc_elf_copy_work);
+			chunk->copier = copier;
+			chunk->dst = dst;
+			chunk->src = src;
+			chunk->len = chunk_len;
+
+			atomic_inc(&copier->pending);
+			queue_work(system_unbound_wq, &chunk->work);
+		} else {
+			rproc_elf_copy_chunk(dst, src, chunk_len);
+		}
+
+		dst += chunk_len;
+		if (src)
+			src += chunk_len;
+		len -= chunk_len;
+	}
+}
+
+/* wait until all the copies that were submitted to @copier are done */
+static void rproc_elf_copier_wait(struct rproc_elf_copier *copier)
+{
+	if (!atomic_dec_and_test(&copier->pending))
+		wait_for_completion(&copier->done);
+}
+
+/*
+ * make sure a segment of a @size bytes image is sane, and fits in the
+ * memory of the remote processor. Returns the kernel address the segment
+ * should be loaded at, or NULL if it can't be loaded.
+ */
+static void *rproc_elf_seg_va(struct rproc *rproc, struct rproc_elf_seg *seg,
+								size_t size)
+{
+	struct device *dev = &rproc->dev;
+	void *ptr = NULL;
+
+	dev_dbg(dev, "phdr: type %d da 0x%llx memsz 0x%llx filesz 0x%llx\n",
+				seg->type, seg->da, seg->memsz, seg->filesz);
+
+	if (seg->filesz > seg->memsz) {
+		dev_err(dev, "bad phdr filesz 0x%llx memsz 0x%llx\n",
+						seg->filesz, seg->memsz);
+		return NULL;
+	}
+
+	if (!rproc_elf_in_range(seg->offset, seg->filesz, size)) {
+		dev_err(dev, "truncated fw: need 0x%llx avail 0x%zx\n",
+				seg->offset + seg->filesz, size);
+		return NULL;
+	}
+
+	/* grab the kernel address for this device address */
+	if (seg->memsz <= INT_MAX)
+		ptr = rproc_da_to_va(rproc, seg->da, seg->memsz);
+	if (!ptr)
+		dev_err(dev, "bad phdr da 0x%llx mem 0x%llx\n",
+						seg->da, seg->memsz);
+
+	return ptr;
+}
+
+/*
+ * tell whether a segment is to be loaded into a carveout that other remote
+ * processors share (see FW_CARVEOUT_SHARED), and which has it already.
+ * Only read-only segments may be shared. Returns 1 if the segment doesn't
+ * have to be loaded, 0 if it does, or -EINVAL if it can't be.
+ */
+static int rproc_elf_seg_loaded(struct rproc *rproc, struct rproc_elf_seg *seg)
+{
+	bool loaded;
 
-	return ehdr->e_entry;
+	if (!rproc_da_is_shared(rproc, seg->da, seg->memsz, &loaded))
+		return 0;
+
+	if (seg->flags & PF_W) {
+		dev_err(&rproc->dev, "writable phdr da 0x%llx is shared\n",
+								seg->da);
+		return -EINVAL;
+	}
+
+	return loaded;
 }
 
 /**
@@ -141,73 +593,110 @@ u32 rproc_elf_get_boot_addr(struct rproc *rproc, const struct firmware *fw)
  * might be different: they might not have iommus, and would prefer to
  * directly allocate memory for every segment/resource. This is not yet
  * supported, though.
+ *
+ * Big segments are copied by several cpus in parallel (see rproc_elf_copy()),
+ * and this function only returns once all of them are in place.
  */
 static int
 rproc_elf_load_segments(struct rproc *rproc, const struct firmware *fw)
 {
-	struct device *dev = &rproc->dev;
-	struct elf32_hdr *ehdr;
-	struct elf32_phdr *phdr;
-	int i, ret = 0;
+	struct rproc_elf_copier copier;
+	struct rproc_elf_info info;
+	struct rproc_elf_seg seg;
+	int i, ret;
 	const u8 *elf_data = fw->data;
 
-	ehdr = (struct elf32_hdr *)elf_data;
-	phdr = (struct elf32_phdr *)(elf_data + ehdr->e_phoff);
+	ret = rproc_elf_get_info(rproc, elf_data, fw->size, &info);
+	if (ret)
+		return ret;
+
+	rproc_elf_copier_init(&copier);
 
 	/* go through the available ELF segments */
-	for (i = 0; i < ehdr->e_phnum; i++, phdr++) {
-		u32 da = phdr->p_paddr;
-		u32 memsz = phdr->p_memsz;
-		u32 filesz = phdr->p_filesz;
-		u32 offset = phdr->p_offset;
+	for (i = 0; i < info.phnum; i++) {
 		void *ptr;
 
-		if (phdr->p_type != PT_LOAD)
+		rproc_elf_get_seg(&info, elf_data + info.phoff, i, &seg);
+		if (seg.type != PT_LOAD)
 			continue;
 
-		dev_dbg(dev, "phdr: type %d da 0x%x memsz 0x%x filesz 0x%x\n",
-					phdr->p_type, da, memsz, filesz);
+		/* overlays are only copied in as they're asked for */
+		if (rproc_da_is_overlay(rproc, seg.da, seg.memsz))
+			continue;
 
-		if (filesz > memsz) {
-			dev_err(dev, "bad phdr filesz 0x%x memsz 0x%x\n",
-							filesz, memsz);
+		ptr = rproc_elf_seg_va(rproc, &seg, fw->size);
+		if (!ptr) {
 			ret = -EINVAL;
 			break;
 		}
 
-		if (offset + filesz > fw->size) {
-			dev_err(dev, "truncated fw: need 0x%x avail 0x%zx\n",
-					offset + filesz, fw->size);
-			ret = -EINVAL;
-			break;
-		}
-
-		/* grab the kernel address for this device address */
-		ptr = rproc_da_to_va(rproc, da, memsz);
-		if (!ptr) {
-			dev_err(dev, "bad phdr da 0x%x mem 0x%x\n", da, memsz);
-			ret = -EINVAL;
+		/* another remote processor may have loaded it already */
+		ret = rproc_elf_seg_loaded(rproc, &seg);
+		if (ret < 0)
 			break;
+		if (ret) {
+			ret = 0;
+			continue;
 		}
 
 		/* put the segment where the remote processor expects it */
-		if (phdr->p_filesz)
-			memcpy(ptr, elf_data + phdr->p_offset, filesz);
+		if (seg.filesz)
+			rproc_elf_copy(&copier, ptr, elf_data + seg.offset,
+								seg.filesz);
 
 		/*
-		 * Zero out remaining memory for this segment.
-		 *
-		 * This isn't strictly required since dma_alloc_coherent already
-		 * did this for us. albeit harmless, we may consider removing
-		 * this.
+		 * Zero out remaining memory for this segment, unless it's
+		 * zeroed out on demand, or still the way dma_alloc_coherent
+		 * handed it out.
 		 */
-		if (memsz > filesz)
-			memset(ptr + filesz, 0, memsz - filesz);
+		if (seg.memsz > seg.filesz && !rproc_da_zero_lazily(rproc,
+				seg.da + seg.filesz, seg.memsz - seg.filesz) &&
+			!rproc_da_is_fresh(rproc, seg.da + seg.filesz,
+						seg.memsz - seg.filesz))
+			rproc_elf_copy(&copier, ptr + seg.filesz, NULL,
+							seg.memsz - seg.filesz);
 	}
 
+	/* even on failure: the memory might be freed once we return */
+	rproc_elf_copier_wait(&copier);
+
 	return ret;
 }
 
+/* make sure a @size bytes resource table is sane */
+int rproc_check_rsc_table(struct rproc *rproc, struct resource_table *table,
+								int size)
+{
+	struct device *dev = &rproc->dev;
+
+	/* make sure table has at least the header */
+	if (sizeof(struct resource_table) > size) {
+		dev_err(dev, "header-less resource table\n");
+		return -EINVAL;
+	}
+
+	/* version 2 only adds 64-bit entries to the first one */
+	if (table->ver != 1 && table->ver != 2) {
+		dev_err(dev, "unsupported fw ver: %d\n", table->ver);
+		return -EINVAL;
+	}
+
+	/* make sure reserved bytes are zeroes */
+	if (table->reserved[0] || table->reserved[1]) {
+		dev_err(dev, "non zero reserved bytes\n");
+		return -EINVAL;
+	}
+
+	/* make sure the offsets array isn't truncated */
+	if (table->num * sizeof(table->offset[0]) +
+			sizeof(struct resource_table) > size) {
+		dev_err(dev, "resource table incomplete\n");
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
 /**
  * rproc_elf_find_rsc_table() - find the resource table
  * @rproc: the rproc handle
@@ -217,7 +706,11 @@ rproc_elf_load_segments(struct rproc *rproc, const struct firmware *fw)
  * This function finds the resource table inside the remote processor's
  * firmware. It is used both upon the registration of @rproc (in order
  * to look for and register the supported virito devices), and when the
- * @rproc is booted.
+ * @rproc is booted (unless the image was cached since, along with its
+ * table).
+ *
+ * The table is where the PT_RPROC_RSC_TABLE program header says, if the
+ * image has one, or else in its ".resource_table" section.
  *
  * Returns the pointer to the resource table if it is found, and write its
  * size into @tablesz. If a valid table isn't found, NULL is returned
@@ -227,69 +720,601 @@ static struct resource_table *
 rproc_elf_find_rsc_table(struct rproc *rproc, const struct firmware *fw,
 							int *tablesz)
 {
-	struct elf32_hdr *ehdr;
-	struct elf32_shdr *shdr;
-	const char *name_table;
+	struct rproc_elf_info info;
+	struct rproc_elf_sec names, sec;
 	struct device *dev = &rproc->dev;
-	struct resource_table *table = NULL;
+	struct resource_table *table;
+	const void *shdrs;
+	size_t phsize;
 	int i;
 	const u8 *elf_data = fw->data;
 
-	ehdr = (struct elf32_hdr *)elf_data;
-	shdr = (struct elf32_shdr *)(elf_data + ehdr->e_shoff);
-	name_table = elf_data + shdr[ehdr->e_shstrndx].sh_offset;
+	if (rproc_elf_get_info(rproc, elf_data, fw->size, &info))
+		return NULL;
+
+	phsize = info.phnum * rproc_elf_phdr_size(info.class);
+	if (rproc_elf_in_range(info.phoff, phsize, fw->size) &&
+		rproc_elf_find_rsc_phdr(&info, elf_data + info.phoff, &sec))
+		goto found;
+
+	if (info.shstrndx >= info.shnum || !rproc_elf_in_range(info.shoff,
+			info.shnum * rproc_elf_shdr_size(info.class), fw->size)) {
+		dev_err(dev, "Image is too small\n");
+		return NULL;
+	}
+
+	shdrs = elf_data + info.shoff;
+
+	rproc_elf_get_sec(&info, shdrs, info.shstrndx, &names);
+	if (!rproc_elf_in_range(names.offset, names.size, fw->size)) {
+		dev_err(dev, "section names truncated\n");
+		return NULL;
+	}
 
 	/* look for the resource table and handle it */
-	for (i = 0; i < ehdr->e_shnum; i++, shdr++) {
-		int size = shdr->sh_size;
-		int offset = shdr->sh_offset;
+	for (i = 0; i < info.shnum; i++) {
+		rproc_elf_get_sec(&info, shdrs, i, &sec);
+
+		if (rproc_elf_is_rsc_table((const char *)elf_data +
+					names.offset, names.size, sec.name))
+			goto found;
+	}
+
+	return NULL;
+
+found:
+	/* make sure we have the entire table */
+	if (sec.size > INT_MAX ||
+		!rproc_elf_in_range(sec.offset, sec.size, fw->size)) {
+		dev_err(dev, "resource table truncated\n");
+		return NULL;
+	}
+
+	table = (struct resource_table *)(elf_data + sec.offset);
+
+	if (rproc_check_rsc_table(rproc, table, sec.size))
+		return NULL;
+
+	*tablesz = sec.size;
+	return table;
+}
+
+/*
+ * get ready to read an image piece by piece: either out of @file, or, if
+ * it's NULL, by unpacking the packed image of @image.
+ */
+static int rproc_elf_src_init(struct rproc_elf_src *src, struct file *file,
+						struct rproc_fw_image *image)
+{
+	memset(src, 0, sizeof(*src));
+
+	if (file) {
+		src->file = file;
+		src->size = i_size_read(file->f_path.dentry->d_inode);
+		return 0;
+	}
+
+#ifdef CONFIG_REMOTEPROC_XZ
+	src->size = SIZE_MAX;
+
+	src->scratch = kmalloc(PAGE_SIZE, GFP_KERNEL);
+	if (!src->scratch)
+		return -ENOMEM;
+
+	src->xz = xz_dec_init(XZ_DYNALLOC, RPROC_ELF_XZ_DICT_MAX);
+	if (!src->xz) {
+		kfree(src->scratch);
+		return -ENOMEM;
+	}
+
+	src->buf.in = image->fw->data;
+	src->buf.in_size = image->fw->size;
+
+	return 0;
+#else
+	return -EINVAL;
+#endif
+}
+
+/* release what rproc_elf_src_init() allocated */
+static void rproc_elf_src_fini(struct rproc_elf_src *src)
+{
+#ifdef CONFIG_REMOTEPROC_XZ
+	xz_dec_end(src->xz);
+	kfree(src->scratch);
+#endif
+}
+
+#ifdef CONFIG_REMOTEPROC_XZ
+/* unpack the next @len bytes of a packed image into @buf */
+static int rproc_elf_unpack(struct rproc_elf_src *src, void *buf, size_t len)
+{
+	enum xz_ret ret;
+
+	src->buf.out = buf;
+	src->buf.out_pos = 0;
+	src->buf.out_size = len;
 
-		if (strcmp(name_table + shdr->sh_name, ".resource_table"))
+	while (src->buf.out_pos < len) {
+		ret = xz_dec_run(src->xz, &src->buf);
+		if (ret == XZ_OK ||
+			(ret == XZ_STREAM_END && src->buf.out_pos == len))
 			continue;
 
-		table = (struct resource_table *)(elf_data + offset);
+		if (ret == XZ_MEM_ERROR || ret == XZ_MEMLIMIT_ERROR)
+			return -ENOMEM;
 
-		/* make sure we have the entire table */
-		if (offset + size > fw->size) {
-			dev_err(dev, "resource table truncated\n");
-			return NULL;
+		/* a stream that ends too early is a truncated image */
+		return -EINVAL;
+	}
+
+	src->pos += len;
+
+	return 0;
+}
+
+/*
+ * read @len bytes at @offset of a packed image. The decoder can only go
+ * forward, so it's started over whenever we need to go back.
+ */
+static int rproc_elf_unpack_at(struct rproc_elf_src *src, u64 offset,
+						void *buf, size_t len)
+{
+	int ret;
+
+	if (offset < src->pos) {
+		xz_dec_reset(src->xz);
+		src->buf.in_pos = 0;
+		src->pos = 0;
+	}
+
+	while (src->pos < offset) {
+		ret = rproc_elf_unpack(src, src->scratch,
+				min_t(u64, offset - src->pos, PAGE_SIZE));
+		if (ret)
+			return ret;
+	}
+
+	return rproc_elf_unpack(src, buf, len);
+}
+#endif
+
+/* read @len bytes at @offset of an image, exactly */
+static int rproc_elf_read(struct rproc_elf_src *src, u64 offset, void *buf,
+								size_t len)
+{
+#ifdef CONFIG_REMOTEPROC_XZ
+	if (!src->file)
+		return rproc_elf_unpack_at(src, offset, buf, len);
+#endif
+
+	while (len) {
+		int ret;
+
+		ret = kernel_read(src->file, offset, buf, len);
+		if (ret <= 0)
+			return ret ? ret : -EIO;
+
+		offset += ret;
+		buf += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+/* read a whole @len bytes piece of an image into a new buffer */
+static void *rproc_elf_read_alloc(struct rproc_elf_src *src, u64 offset,
+								size_t len)
+{
+	void *buf;
+	int ret;
+
+	buf = kmalloc(len, GFP_KERNEL);
+	if (!buf)
+		return ERR_PTR(-ENOMEM);
+
+	ret = rproc_elf_read(src, offset, buf, len);
+	if (ret) {
+		kfree(buf);
+		return ERR_PTR(ret);
+	}
+
+	return buf;
+}
+
+/* read the resource table @sec says is in an ELF image into @image */
+static int rproc_elf_stream_read_table(struct rproc *rproc,
+			struct rproc_elf_src *src, struct rproc_fw_image *image,
+			struct rproc_elf_sec *sec, u64 *table_offset)
+{
+	struct device *dev = &rproc->dev;
+	int ret;
+
+	/* make sure we have the entire table */
+	if (sec->size > INT_MAX ||
+		!rproc_elf_in_range(sec->offset, sec->size, src->size)) {
+		dev_err(dev, "resource table truncated\n");
+		return -EINVAL;
+	}
+
+	image->table = rproc_elf_read_alloc(src, sec->offset, sec->size);
+	if (IS_ERR(image->table)) {
+		ret = PTR_ERR(image->table);
+		image->table = NULL;
+		return ret;
+	}
+
+	ret = rproc_check_rsc_table(rproc, image->table, sec->size);
+	if (ret) {
+		kfree(image->table);
+		image->table = NULL;
+		return ret;
+	}
+
+	image->tablesz = sec->size;
+	*table_offset = sec->offset;
+
+	return 0;
+}
+
+/*
+ * look for the resource table of an ELF image, through its program headers
+ * (@phdrs) or else its section headers
+ */
+static int rproc_elf_stream_rsc_table(struct rproc *rproc,
+			struct rproc_elf_src *src, struct rproc_elf_info *info,
+			const void *phdrs, struct rproc_fw_image *image,
+			u64 *table_offset)
+{
+	struct device *dev = &rproc->dev;
+	size_t shsize = rproc_elf_shdr_size(info->class);
+	struct rproc_elf_sec names, sec;
+	char *name_table = NULL;
+	void *shdrs;
+	int i, ret = -EINVAL;
+
+	if (rproc_elf_find_rsc_phdr(info, phdrs, &sec))
+		return rproc_elf_stream_read_table(rproc, src, image, &sec,
+								table_offset);
+
+	if (info->shstrndx >= info->shnum ||
+		!rproc_elf_in_range(info->shoff, info->shnum * shsize,
+								src->size)) {
+		dev_err(dev, "Image is too small\n");
+		return -EINVAL;
+	}
+
+	shdrs = rproc_elf_read_alloc(src, info->shoff, info->shnum * shsize);
+	if (IS_ERR(shdrs))
+		return PTR_ERR(shdrs);
+
+	rproc_elf_get_sec(info, shdrs, info->shstrndx, &names);
+	if (!names.size ||
+		!rproc_elf_in_range(names.offset, names.size, src->size)) {
+		dev_err(dev, "section names truncated\n");
+		goto free_shdrs;
+	}
+
+	name_table = rproc_elf_read_alloc(src, names.offset, names.size);
+	if (IS_ERR(name_table)) {
+		ret = PTR_ERR(name_table);
+		name_table = NULL;
+		goto free_shdrs;
+	}
+
+	for (i = 0; i < info->shnum; i++) {
+		rproc_elf_get_sec(info, shdrs, i, &sec);
+
+		if (!rproc_elf_is_rsc_table(name_table, names.size, sec.name))
+			continue;
+
+		ret = rproc_elf_stream_read_table(rproc, src, image, &sec,
+								table_offset);
+		break;
+	}
+
+	kfree(name_table);
+free_shdrs:
+	kfree(shdrs);
+	return ret;
+}
+
+/**
+ * rproc_elf_parse_stream() - parse an ELF firmware image, without loading it
+ * @rproc: the remote processor handle
+ * @file: the ELF firmware file, or NULL to parse the packed @image->fw
+ * @image: the firmware image descriptor to fill in
+ *
+ * Only the headers and the resource table are read from @file (or unpacked
+ * out of @image->fw): the segments are streamed straight to their
+ * destination upon boot (see rproc_elf_load_stream()).
+ *
+ * The resource table is copied into a kmalloc'ed buffer, and the program
+ * headers are kept in @image's loader-specific data; both are freed by
+ * rproc_elf_free_stream().
+ */
+static int rproc_elf_parse_stream(struct rproc *rproc, struct file *file,
+					struct rproc_fw_image *image)
+{
+	struct rproc_elf_stream *stream;
+	struct rproc_elf_src src;
+	struct rproc_elf_info *info;
+	u8 ehdr[sizeof(struct elf64_hdr)];
+	size_t len;
+	int ret;
+
+	ret = rproc_elf_src_init(&src, file, image);
+	if (ret)
+		return ret;
+
+	stream = kzalloc(sizeof(*stream), GFP_KERNEL);
+	if (!stream) {
+		ret = -ENOMEM;
+		goto fini_src;
+	}
+	info = &stream->info;
+
+	/* ELF32 headers are smaller: don't read past the end of those images */
+	len = min(src.size, sizeof(ehdr));
+	ret = rproc_elf_read(&src, 0, ehdr, len);
+	if (ret)
+		goto free_stream;
+
+	ret = rproc_elf_get_info(rproc, ehdr, len, info);
+	if (ret)
+		goto free_stream;
+
+	ret = rproc_elf_check_info(rproc, info, src.size);
+	if (ret)
+		goto free_stream;
+
+	stream->phdrs = rproc_elf_read_alloc(&src, info->phoff,
+				info->phnum * rproc_elf_phdr_size(info->class));
+	if (IS_ERR(stream->phdrs)) {
+		ret = PTR_ERR(stream->phdrs);
+		goto free_stream;
+	}
+
+	ret = rproc_elf_stream_rsc_table(rproc, &src, info, stream->phdrs,
+						image, &stream->table_offset);
+	if (ret)
+		goto free_phdrs;
+
+	stream->size = src.size;
+
+	/* a packed image keeps the size of its packed form */
+	if (file)
+		image->size = src.size;
+	image->bootaddr = info->entry;
+	image->priv = stream;
+
+	rproc_elf_src_fini(&src);
+
+	return 0;
+
+free_phdrs:
+	kfree(stream->phdrs);
+free_stream:
+	kfree(stream);
+fini_src:
+	rproc_elf_src_fini(&src);
+	return ret;
+}
+
+/**
+ * rproc_elf_load_stream() - stream firmware segments to memory
+ * @rproc: remote processor which will be booted using these fw segments
+ * @file: the ELF firmware file, or NULL to unpack the packed @image->fw
+ * @image: the firmware image descriptor, as parsed by rproc_elf_parse_stream()
+ *
+ * Just like rproc_elf_load_segments(), but the segments are read (or
+ * unpacked) straight into their destination, so no staging copy of the
+ * whole image is needed.
+ *
+ * The resource table that was handled (and possibly updated) before boot
+ * is then written over the one that was loaded along with the segments
+ * (if it's part of one), so the remote processor sees it, just like it
+ * would when loading from a whole in-memory image.
+ */
+static int rproc_elf_load_stream(struct rproc *rproc, struct file *file,
+					struct rproc_fw_image *image)
+{
+	struct rproc_elf_stream *stream = image->priv;
+	struct device *dev = &rproc->dev;
+	u64 table_offset = stream->table_offset;
+	struct rproc_elf_src src;
+	struct rproc_elf_seg seg;
+	int i, ret;
+
+	ret = rproc_elf_src_init(&src, file, image);
+	if (ret)
+		return ret;
+
+	for (i = 0; i < stream->info.phnum; i++) {
+		void *ptr;
+
+		rproc_elf_get_seg(&stream->info, stream->phdrs, i, &seg);
+		if (seg.type != PT_LOAD)
+			continue;
+
+		/* overlays are only copied in as they're asked for */
+		if (rproc_da_is_overlay(rproc, seg.da, seg.memsz))
+			continue;
+
+		ptr = rproc_elf_seg_va(rproc, &seg, stream->size);
+		if (!ptr) {
+			ret = -EINVAL;
+			break;
 		}
 
-		/* make sure table has at least the header */
-		if (sizeof(struct resource_table) > size) {
-			dev_err(dev, "header-less resource table\n");
-			return NULL;
+		/* another remote processor may have loaded it already */
+		ret = rproc_elf_seg_loaded(rproc, &seg);
+		if (ret < 0)
+			break;
+		if (ret) {
+			ret = 0;
+			continue;
 		}
 
-		/* we don't support any version beyond the first */
-		if (table->ver != 1) {
-			dev_err(dev, "unsupported fw ver: %d\n", table->ver);
-			return NULL;
+		/* read the segment right where the remote processor expects it */
+		ret = rproc_elf_read(&src, seg.offset, ptr, seg.filesz);
+		if (ret) {
+			dev_err(dev, "failed to read segment: %d\n", ret);
+			break;
 		}
 
-		/* make sure reserved bytes are zeroes */
-		if (table->reserved[0] || table->reserved[1]) {
-			dev_err(dev, "non zero reserved bytes\n");
+		/* zero out remaining memory for this segment, if needed */
+		if (seg.memsz > seg.filesz && !rproc_da_zero_lazily(rproc,
+				seg.da + seg.filesz, seg.memsz - seg.filesz) &&
+			!rproc_da_is_fresh(rproc, seg.da + seg.filesz,
+						seg.memsz - seg.filesz))
+			memset(ptr + seg.filesz, 0, seg.memsz - seg.filesz);
+
+		/* does this segment carry the resource table ? */
+		if (table_offset >= seg.offset &&
+			table_offset + image->tablesz <= seg.offset + seg.filesz)
+			memcpy(ptr + (table_offset - seg.offset), image->table,
+								image->tablesz);
+	}
+
+	rproc_elf_src_fini(&src);
+
+	return ret;
+}
+
+/* free what rproc_elf_parse_stream() allocated */
+static void rproc_elf_free_stream(struct rproc *rproc,
+					struct rproc_fw_image *image)
+{
+	struct rproc_elf_stream *stream = image->priv;
+
+	kfree(image->table);
+	kfree(stream->phdrs);
+	kfree(stream);
+}
+
+/**
+ * rproc_elf_locate_rsc_table() - find the resource table of a loaded image
+ * @rproc: the rproc handle
+ * @image: the firmware image, which was loaded already
+ *
+ * The resource table is loaded along with the segment that carries it, if
+ * any: this function returns where that is in the memory of the remote
+ * processor, or NULL if the resource table isn't part of any segment.
+ */
+static struct resource_table *
+rproc_elf_locate_rsc_table(struct rproc *rproc, struct rproc_fw_image *image)
+{
+	struct rproc_elf_stream *stream = image->priv;
+	struct rproc_elf_info info;
+	struct rproc_elf_seg seg;
+	const void *phdrs;
+	u64 table_offset;
+	int i;
+
+	if (image->fw && !image->packed) {
+		const u8 *elf_data = image->fw->data;
+
+		if (rproc_elf_get_info(rproc, elf_data, image->fw->size, &info))
 			return NULL;
-		}
 
-		/* make sure the offsets array isn't truncated */
-		if (table->num * sizeof(table->offset[0]) +
-				sizeof(struct resource_table) > size) {
-			dev_err(dev, "resource table incomplete\n");
+		phdrs = elf_data + info.phoff;
+		table_offset = (const u8 *)image->table - elf_data;
+	} else {
+		info = stream->info;
+		phdrs = stream->phdrs;
+		table_offset = stream->table_offset;
+	}
+
+	for (i = 0; i < info.phnum; i++) {
+		rproc_elf_get_seg(&info, phdrs, i, &seg);
+		if (seg.type != PT_LOAD)
+			continue;
+
+		if (table_offset >= seg.offset &&
+			table_offset + image->tablesz <= seg.offset + seg.filesz)
+			return rproc_da_to_va(rproc,
+				seg.da + (table_offset - seg.offset),
+				image->tablesz);
+	}
+
+	return NULL;
+}
+
+/**
+ * rproc_elf_find_overlay() - find an overlay of an ELF image
+ * @rproc: the rproc handle
+ * @image: the firmware image
+ * @name: the name of the section of the overlay
+ * @da: where to put the device address the overlay runs at
+ * @len: where to put the size of the overlay
+ *
+ * Overlays can only be found in images that are kept in memory in their
+ * entirety, unpacked: not in streamed or packed ones.
+ *
+ * Returns the contents of the overlay, or NULL if it can't be found.
+ */
+static const void *
+rproc_elf_find_overlay(struct rproc *rproc, struct rproc_fw_image *image,
+				const char *name, u32 *da, size_t *len)
+{
+	size_t namesz = strlen(name) + 1;
+	struct rproc_elf_sec names, sec;
+	struct rproc_elf_info info;
+	const u8 *elf_data;
+	const void *shdrs;
+	size_t size;
+	int i;
+
+	if (!image->fw || image->packed)
+		return NULL;
+
+	elf_data = image->fw->data;
+	size = image->fw->size;
+
+	if (rproc_elf_get_info(rproc, elf_data, size, &info) ||
+			info.shstrndx >= info.shnum ||
+			!rproc_elf_in_range(info.shoff,
+			info.shnum * rproc_elf_shdr_size(info.class), size))
+		return NULL;
+
+	shdrs = elf_data + info.shoff;
+
+	rproc_elf_get_sec(&info, shdrs, info.shstrndx, &names);
+	if (!rproc_elf_in_range(names.offset, names.size, size))
+		return NULL;
+
+	for (i = 0; i < info.shnum; i++) {
+		rproc_elf_get_sec(&info, shdrs, i, &sec);
+
+		/* the names table isn't trusted for null terminating them */
+		if (sec.name >= names.size || names.size - sec.name < namesz ||
+				memcmp(elf_data + names.offset + sec.name, name,
+								namesz))
+			continue;
+
+		if (sec.size > UINT_MAX || sec.addr > UINT_MAX - sec.size ||
+				!rproc_elf_in_range(sec.offset, sec.size, size))
 			return NULL;
-		}
 
-		*tablesz = shdr->sh_size;
-		break;
+		*da = sec.addr;
+		*len = sec.size;
+		return elf_data + sec.offset;
 	}
 
-	return table;
+	return NULL;
 }
 
 const struct rproc_fw_ops rproc_elf_fw_ops = {
 	.load = rproc_elf_load_segments,
 	.find_rsc_table = rproc_elf_find_rsc_table,
 	.sanity_check = rproc_elf_sanity_check,
-	.get_boot_addr = rproc_elf_get_boot_addr
+	.get_boot_addr = rproc_elf_get_boot_addr,
+	.is_packed = rproc_elf_is_packed,
+	.parse_stream = rproc_elf_parse_stream,
+	.load_stream = rproc_elf_load_stream,
+	.free_stream = rproc_elf_free_stream,
+	.locate_rsc_table = rproc_elf_locate_rsc_table,
+	.find_overlay = rproc_elf_find_overlay,
 };
@@ -22,8 +22,11 @@
 
 #include <linux/irqreturn.h>
 #include <linux/firmware.h>
+#include <linux/kref.h>
+#include <linux/rcupdate.h>
 
 struct rproc;
+struct rproc_fw_image;
 
 /**
  * struct rproc_fw_ops - firmware format specific operations.
@@ -32,6 +35,25 @@ struct rproc;
  *			expects to find it
  * @sanity_check:	sanity check the fw image
  * @get_boot_addr:	get boot address to entry point specified in firmware
+ * @is_packed:		is the fw image packed (e.g. compressed) ? packed images
+ *			are unpacked on the fly by @parse_stream and
+ *			@load_stream, instead of being used in place (optional)
+ * @parse_stream:	fill in a firmware image descriptor (resource table,
+ *			boot address and whatever @load_stream needs) out of a
+ *			firmware file, without reading it all, or out of a
+ *			packed fw image if the file is NULL (optional)
+ * @load_stream:	load firmware to memory straight from the firmware file,
+ *			or from the packed fw image if it is NULL (optional)
+ * @free_stream:	free what @parse_stream allocated
+ * @locate_rsc_table:	find the resource table of a fw image that was loaded,
+ *			in the memory of the remote processor, if it's loaded
+ *			along with the segments (optional)
+ * @load_buf:		where the remote processor runs a raw image from, if
+ *			it can be read straight in there, or NULL (optional).
+ *			Such images are neither copied nor cached: they're
+ *			read in place anew for every boot.
+ * @find_overlay:	find an overlay of a fw image by name, along with the
+ *			device address and size it's copied in at (optional)
  */
 struct rproc_fw_ops {
 	struct resource_table *(*find_rsc_table) (struct rproc *rproc,
@@ -40,30 +62,437 @@ struct rproc_fw_ops {
 	int (*load)(struct rproc *rproc, const struct firmware *fw);
 	int (*sanity_check)(struct rproc *rproc, const struct firmware *fw);
 	u32 (*get_boot_addr)(struct rproc *rproc, const struct firmware *fw);
+	bool (*is_packed)(struct rproc *rproc, const struct firmware *fw);
+	int (*parse_stream)(struct rproc *rproc, struct file *file,
+					struct rproc_fw_image *image);
+	int (*load_stream)(struct rproc *rproc, struct file *file,
+					struct rproc_fw_image *image);
+	void (*free_stream)(struct rproc *rproc, struct rproc_fw_image *image);
+	struct resource_table *(*locate_rsc_table)(struct rproc *rproc,
+					struct rproc_fw_image *image);
+	void *(*load_buf)(struct rproc *rproc, size_t *size);
+	const void *(*find_overlay)(struct rproc *rproc,
+					struct rproc_fw_image *image,
+					const char *name, u32 *da, size_t *len);
+};
+
+/**
+ * struct rproc_fw_image - a sanity checked firmware image, along with what
+ * was parsed out of it, cached across boots of its remote processor
+ * @refcount: users of the image (the rproc's cache being one of them)
+ * @rproc: the remote processor this image belongs to
+ * @fw: the firmware image itself, or NULL if it is streamed from the
+ *	firmware file (see rproc->stream_fw)
+ * @size: size of the firmware image, in bytes
+ * @table: the image's resource table
+ * @tablesz: size of @table, in bytes
+ * @rsc_index: @table, as it was parsed (see rproc_index_rsc_table())
+ * @bootaddr: the image's boot address
+ * @packed: whether @fw is a packed image, which is loaded by unpacking it
+ *	    with the streaming ops
+ * @crc: crc32 of @fw, if the carveouts of @rproc may be shared (see
+ *	 rproc->share_carveouts), or 0
+ * @priv: data of the firmware format specific streaming loader
+ */
+struct rproc_fw_image {
+	struct kref refcount;
+	struct rproc *rproc;
+	const struct firmware *fw;
+	size_t size;
+	struct resource_table *table;
+	int tablesz;
+	struct rproc_rsc_index *rsc_index;
+	u32 bootaddr;
+	bool packed;
+	u32 crc;
+	void *priv;
+};
+
+/**
+ * struct rproc_rsc_entry - an entry of a resource table, as it was parsed
+ * @type: type of the entry (see enum fw_resource_type)
+ * @offset: offset of the entry (of its struct fw_rsc_hdr) in the table
+ * @avail: size of the data following the header, up to the end of the table
+ * @next: index of the next entry of the same type, or -1
+ */
+struct rproc_rsc_entry {
+	u32 type;
+	u32 offset;
+	int avail;
+	int next;
+};
+
+/**
+ * struct rproc_rsc_index - a resource table, parsed once and for all
+ * @num: number of entries in @ents
+ * @first: index of the first entry of each type in @ents, or -1
+ * @ents: the entries of a supported type, in the order of the table
+ */
+struct rproc_rsc_index {
+	int num;
+	int first[RSC_LAST];
+	struct rproc_rsc_entry ents[0];
+};
+
+/* the entry at @i in @index, or NULL if @i is -1 */
+static inline struct rproc_rsc_entry *
+rproc_rsc_entry(struct rproc_rsc_index *index, int i)
+{
+	return i < 0 ? NULL : &index->ents[i];
+}
+
+/* walk the entries of @index of type @type, in the order of the table */
+#define rproc_for_each_rsc(index, ent, type)				\
+	for (ent = rproc_rsc_entry(index, (index)->first[type]); ent;	\
+				ent = rproc_rsc_entry(index, (ent)->next))
+
+/* the resource @ent stands for, in @table, or in any copy of it */
+static inline void *
+rproc_rsc_data(struct resource_table *table, struct rproc_rsc_entry *ent)
+{
+	return (void *)table + ent->offset + sizeof(struct fw_rsc_hdr);
+}
+
+/**
+ * struct rproc_vring_map - the vrings of a remote processor, by notifyid
+ * @rcu: frees the map once it's replaced by a bigger one
+ * @size: number of entries in @vrings
+ * @vrings: the vrings, indexed by their notifyid (NULL for unused ones)
+ */
+struct rproc_vring_map {
+	struct rcu_head rcu;
+	int size;
+	struct rproc_vring *vrings[0];
+};
+
+/* the keys the carveouts are indexed by (see rproc_index_carveouts()) */
+enum rproc_carveout_key {
+	RPROC_KEY_DA,
+	RPROC_KEY_VA,
+	RPROC_KEY_DMA,
+	RPROC_KEYS,
+};
+
+/**
+ * struct rproc_carveout_index - the carveouts of a remote processor, sorted
+ * @rcu: frees the index once it's replaced
+ * @num: number of carveouts
+ * @sorted: the carveouts, sorted by each of the rproc_carveout_key keys
+ * @entries: where @sorted points into
+ */
+struct rproc_carveout_index {
+	struct rcu_head rcu;
+	int num;
+	struct rproc_mem_entry **sorted[RPROC_KEYS];
+	struct rproc_mem_entry *entries[0];
+};
+
+/**
+ * struct rproc_hole - a part of a carveout that is faulted in on demand
+ * @node: list node
+ * @da: device address of the hole
+ * @dma: dma address of the hole
+ * @va: kernel address of the hole
+ * @len: length of the hole, in bytes
+ * @flags: iommu mapping flags of the hole's carveout
+ * @dirty: the hole's pages must be zeroed out before they're mapped
+ * @faulted: bitmap of the hole's pages which were faulted in already
+ */
+struct rproc_hole {
+	struct list_head node;
+	u32 da;
+	dma_addr_t dma;
+	void *va;
+	int len;
+	u32 flags;
+	bool dirty;
+	unsigned long faulted[0];
+};
+
+/**
+ * struct rproc_mem_usage - the host memory a remote processor pins down
+ * @carveouts: carveouts allocated for the remote processor
+ * @carveout_pad: extra memory allocated to align those carveouts (see
+ *		  rproc_alloc_carveout())
+ * @holes: pages faulted into the holes of the remote processor
+ * @vrings: vrings allocated for the remote processor
+ * @vdev_bufs: buffers the virtio drivers of the remote processor allocated
+ *	       (e.g. the rpmsg buffer pool)
+ * @dump: the core dump of the last crash, if it's still around
+ * @fw_cache: the cached firmware image
+ * @total: all of the above
+ * @shared: carveouts shared with the other remote processors booted with
+ *	    the same firmware image (see FW_CARVEOUT_SHARED), which aren't
+ *	    part of @total
+ * @iommu_mapped: how much of the iommu domain of the remote processor is
+ *		  mapped (which may well overlap the carveouts)
+ * @iommu_ptes: the iommu page table entries those mappings take
+ *
+ * Memory the remote processor uses but the host didn't allocate for it
+ * (e.g. carveouts adopted from a detached remote processor, or vrings and
+ * devmem mapped where they are) isn't accounted for.
+ */
+struct rproc_mem_usage {
+	size_t carveouts;
+	size_t carveout_pad;
+	size_t holes;
+	size_t vrings;
+	size_t vdev_bufs;
+	size_t dump;
+	size_t fw_cache;
+	size_t total;
+	size_t shared;
+	size_t iommu_mapped;
+	unsigned long iommu_ptes;
+};
+
+/*
+ * how much host memory a carveout takes (along with what was allocated to
+ * align it), if the host allocated it in the first place
+ */
+static inline size_t rproc_carveout_size(struct rproc_mem_entry *carveout)
+{
+	struct rproc_mem_entry *alloc = carveout->priv;
+
+	if (carveout->adopted)
+		return 0;
+
+	return alloc ? alloc->len : carveout->len;
+}
+
+/**
+ * struct rproc_dep - a remote processor another one depends on
+ * @node: list node
+ * @rproc: the remote processor depended on
+ */
+struct rproc_dep {
+	struct list_head node;
+	struct rproc *rproc;
 };
 
 /* from remoteproc_core.c */
 void rproc_release(struct kref *kref);
+/* have rproc_vq_interrupt() look at all the vrings */
+#define RPROC_ALL_VQS	(-1)
+
 irqreturn_t rproc_vq_interrupt(struct rproc *rproc, int vq_id);
+irqreturn_t rproc_vqs_interrupt(struct rproc *rproc, unsigned long pending);
+void rproc_free_carveout(struct rproc *rproc, struct rproc_mem_entry *carveout);
+struct rproc_rsc_index *rproc_index_rsc_table(struct rproc *rproc,
+				struct resource_table *table, int len);
+int rproc_handle_boot_rsc(struct rproc *rproc, struct resource_table *table,
+					struct rproc_rsc_index *index);
+void rproc_resource_cleanup(struct rproc *rproc);
+void rproc_put_fw_image(struct rproc_fw_image *image);
+extern const char * const rproc_boot_phases[RPROC_BOOT_PHASES];
+void rproc_boot_ready(struct rproc *rproc);
 
 /* from remoteproc_virtio.c */
 int rproc_add_virtio_dev(struct rproc_vdev *rvdev, int id);
 void rproc_remove_virtio_dev(struct rproc_vdev *rvdev);
+void rproc_remove_virtio_devices(struct rproc *rproc);
+void rproc_list_vdev(struct rproc_vdev *rvdev);
+void rproc_unlist_vdev(struct rproc_vdev *rvdev);
+void rproc_virtio_config_changed(struct rproc_vdev *rvdev);
+void rproc_ipc_work(struct work_struct *work);
+void rproc_kick_tasklet(unsigned long data);
+int rproc_poll_thread(void *data);
+#ifdef CONFIG_PM
+int rproc_freeze_virtio_dev(struct rproc_vdev *rvdev);
+int rproc_restore_virtio_dev(struct rproc_vdev *rvdev);
+#else
+static inline int rproc_freeze_virtio_dev(struct rproc_vdev *rvdev)
+{
+	return -EOPNOTSUPP;
+}
+
+static inline int rproc_restore_virtio_dev(struct rproc_vdev *rvdev)
+{
+	return -EOPNOTSUPP;
+}
+#endif
 
 /* from remoteproc_debugfs.c */
 void rproc_remove_trace_file(struct dentry *tfile);
 struct dentry *rproc_create_trace_file(const char *name, struct rproc *rproc,
 					struct rproc_mem_entry *trace);
 void rproc_delete_debug_dir(struct rproc *rproc);
+bool rproc_trace_ring_span(struct rproc_mem_entry *trace,
+					u32 *head, u32 *tail, u32 *size);
+u32 rproc_trace_ring_copy(struct rproc_mem_entry *trace, u32 *pos, char *buf,
+								u32 count);
 void rproc_create_debug_dir(struct rproc *rproc);
 void rproc_init_debugfs(void);
 void rproc_exit_debugfs(void);
 
+/* from remoteproc_coredump.c */
+/* from remoteproc_trace.c */
+int rproc_trace_pull_add(struct rproc *rproc, struct rproc_mem_entry *trace,
+								int index);
+void rproc_trace_pull_del(struct rproc_mem_entry *trace);
+
+/* from remoteproc_timesync.c */
+int rproc_timesync_attach(struct rproc *rproc, struct fw_rsc_timesync *rsc);
+void rproc_timesync_detach(struct rproc *rproc);
+
+/* from remoteproc_coalesce.c */
+void rproc_coalesce_init(struct rproc *rproc);
+int rproc_coalesce_attach(struct rproc *rproc, struct fw_rsc_coalesce *rsc);
+void rproc_coalesce_detach(struct rproc *rproc);
+int rproc_coalesce_print(struct rproc *rproc, char *buf, size_t size);
+int rproc_coalesce_set(struct rproc *rproc, char *cmd);
+
+/* from remoteproc_overlay.c */
+int rproc_overlay_attach(struct rproc *rproc, struct fw_rsc_overlay *rsc);
+void rproc_overlay_detach(struct rproc *rproc);
+void rproc_overlay_start(struct rproc *rproc, struct rproc_fw_image *image);
+bool rproc_da_is_overlay(struct rproc *rproc, u64 da, u64 len);
+irqreturn_t rproc_overlay_interrupt(struct rproc *rproc, int notifyid);
+
+/* from remoteproc_dynmem.c */
+int rproc_dynmem_attach(struct rproc *rproc, struct fw_rsc_dynmem *rsc);
+void rproc_dynmem_detach(struct rproc *rproc);
+void rproc_dynmem_start(struct rproc *rproc);
+irqreturn_t rproc_dynmem_interrupt(struct rproc *rproc, int notifyid);
+
+/* from remoteproc_telemetry.c */
+int rproc_telemetry_attach(struct rproc *rproc, u32 da, u32 num_epts,
+							u32 num_tags);
+void rproc_telemetry_detach(struct rproc *rproc);
+
+/* from remoteproc_cdev.c */
+int rproc_user_carveout(struct rproc *rproc, struct rproc_mem_entry *carveout);
+void rproc_put_user_carveout(struct rproc_mem_entry *carveout);
+int rproc_cdev_add(struct rproc *rproc);
+void rproc_cdev_del(struct rproc *rproc);
+void rproc_init_cdev(void);
+void rproc_exit_cdev(void);
+
+/* from remoteproc_snapshot.c */
+int rproc_snapshot_attach(struct rproc *rproc, struct fw_rsc_snapshot *rsc);
+void rproc_snapshot_detach(struct rproc *rproc);
+void rproc_snapshot_save(struct rproc *rproc);
+void rproc_snapshot_restore(struct rproc *rproc, struct resource_table *table,
+						struct rproc_fw_image *image);
+
+/* from remoteproc_peer.c */
+int rproc_peer_attach(struct rproc *rproc, struct fw_rsc_peer *rsc);
+void rproc_peer_detach(struct rproc *rproc);
+void rproc_peer_del(struct rproc *rproc);
+
+/* from remoteproc_queue.c */
+#ifdef CONFIG_REMOTEPROC_QUEUE
+int rproc_queue_attach(struct rproc *rproc, struct fw_rsc_queue *rsc);
+void rproc_queue_detach(struct rproc *rproc);
+void rproc_queue_free(struct rproc *rproc);
+irqreturn_t rproc_queue_interrupt(struct rproc *rproc, int notifyid);
+#else
+static inline int rproc_queue_attach(struct rproc *rproc,
+						struct fw_rsc_queue *rsc)
+{
+	dev_warn(&rproc->dev, "shared-memory queues aren't supported\n");
+	return 0;
+}
+
+static inline void rproc_queue_detach(struct rproc *rproc) { }
+static inline void rproc_queue_free(struct rproc *rproc) { }
+
+static inline
+irqreturn_t rproc_queue_interrupt(struct rproc *rproc, int notifyid)
+{
+	return IRQ_NONE;
+}
+#endif
+
+/* from remoteproc_cmdq.c */
+#ifdef CONFIG_REMOTEPROC_CMDQ
+int rproc_cmdq_attach(struct rproc *rproc, struct fw_rsc_cmdq *rsc);
+void rproc_cmdq_detach(struct rproc *rproc);
+void rproc_cmdq_free(struct rproc *rproc);
+irqreturn_t rproc_cmdq_interrupt(struct rproc *rproc, int notifyid);
+#else
+static inline int rproc_cmdq_attach(struct rproc *rproc,
+						struct fw_rsc_cmdq *rsc)
+{
+	dev_warn(&rproc->dev, "command queues aren't supported\n");
+	return 0;
+}
+
+static inline void rproc_cmdq_detach(struct rproc *rproc) { }
+static inline void rproc_cmdq_free(struct rproc *rproc) { }
+
+static inline
+irqreturn_t rproc_cmdq_interrupt(struct rproc *rproc, int notifyid)
+{
+	return IRQ_NONE;
+}
+#endif
+
+/* from remoteproc_bench.c */
+#ifdef CONFIG_REMOTEPROC_ELF_BENCH
+void rproc_init_bench(struct dentry *dir);
+void rproc_exit_bench(void);
+#else
+static inline void rproc_init_bench(struct dentry *dir) { }
+static inline void rproc_exit_bench(void) { }
+#endif
+
+/* from remoteproc_perf.c */
+#ifdef CONFIG_REMOTEPROC_PERF
+int rproc_perf_attach(struct rproc *rproc, struct fw_rsc_perf *rsc,
+					struct fw_perf_counters *counters);
+void rproc_perf_detach(struct rproc *rproc);
+void rproc_perf_del(struct rproc *rproc);
+void rproc_perf_free(struct rproc *rproc);
+#else
+static inline int rproc_perf_attach(struct rproc *rproc,
+		struct fw_rsc_perf *rsc, struct fw_perf_counters *counters)
+{
+	dev_warn(&rproc->dev, "perf counters aren't supported, ignoring\n");
+	return 0;
+}
+
+static inline void rproc_perf_detach(struct rproc *rproc) { }
+static inline void rproc_perf_del(struct rproc *rproc) { }
+static inline void rproc_perf_free(struct rproc *rproc) { }
+#endif
+
+/* from remoteproc_pstore.c */
+#ifdef CONFIG_REMOTEPROC_PSTORE
+void rproc_pstore_log_crash(struct rproc *rproc, const char *type);
+void rproc_pstore_log_recovery(struct rproc *rproc, const char *how, int ret,
+							unsigned int ms);
+#else
+static inline
+void rproc_pstore_log_crash(struct rproc *rproc, const char *type) { }
+static inline
+void rproc_pstore_log_recovery(struct rproc *rproc, const char *how, int ret,
+							unsigned int ms) { }
+#endif
+
+void rproc_coredump_capture(struct rproc *rproc);
+void rproc_coredump_keep(struct rproc *rproc);
+void rproc_coredump_free(struct rproc *rproc);
+ssize_t rproc_coredump_read(struct rproc *rproc, char __user *userbuf,
+						size_t count, loff_t *ppos);
+size_t rproc_coredump_size(struct rproc *rproc);
+
 void rproc_free_vring(struct rproc_vring *rvring);
 int rproc_alloc_vring(struct rproc_vdev *rvdev, int i);
+void *rproc_ipc_alloc(struct rproc_vdev *rvdev, size_t size, dma_addr_t *dma);
+void rproc_ipc_free(struct rproc_vdev *rvdev, void *va, size_t size);
+void rproc_free_ipc(struct rproc_vdev *rvdev);
 
 void *rproc_da_to_va(struct rproc *rproc, u64 da, int len);
+int rproc_va_to_da(struct rproc *rproc, void *va, int len, u64 *da);
+int rproc_dma_to_da(struct rproc *rproc, dma_addr_t dma, int len, u64 *da);
+bool rproc_da_is_fresh(struct rproc *rproc, u64 da, int len);
+bool rproc_da_zero_lazily(struct rproc *rproc, u64 da, int len);
+bool rproc_da_is_shared(struct rproc *rproc, u64 da, int len, bool *loaded);
 int rproc_trigger_recovery(struct rproc *rproc);
+void rproc_count_pgsizes(unsigned long pgsize_bitmap, unsigned long iova,
+			phys_addr_t paddr, size_t size, unsigned long *count);
+void rproc_mem_usage(struct rproc *rproc, struct rproc_mem_usage *usage);
 
 static inline
 int rproc_fw_sanity_check(struct rproc *rproc, const struct firmware *fw)
@@ -83,6 +512,23 @@ u32 rproc_get_boot_addr(struct rproc *rproc, const struct firmware *fw)
 	return 0;
 }
 
+static inline void *rproc_fw_load_buf(struct rproc *rproc, size_t *size)
+{
+	if (rproc->fw_ops->load_buf)
+		return rproc->fw_ops->load_buf(rproc, size);
+
+	return NULL;
+}
+
+static inline
+bool rproc_fw_is_packed(struct rproc *rproc, const struct firmware *fw)
+{
+	if (rproc->fw_ops->is_packed)
+		return rproc->fw_ops->is_packed(rproc, fw);
+
+	return false;
+}
+
 static inline
 int rproc_load_segments(struct rproc *rproc, const struct firmware *fw)
 {
@@ -102,6 +548,43 @@ struct resource_table *rproc_find_rsc_table(struct rproc *rproc,
 	return NULL;
 }
 
+static inline
+const void *rproc_find_overlay(struct rproc *rproc,
+				struct rproc_fw_image *image, const char *name,
+				u32 *da, size_t *len)
+{
+	if (rproc->fw_ops->find_overlay)
+		return rproc->fw_ops->find_overlay(rproc, image, name, da, len);
+
+	return NULL;
+}
+
+static inline
+struct resource_table *rproc_locate_rsc_table(struct rproc *rproc,
+					struct rproc_fw_image *image)
+{
+	if (rproc->fw_ops->locate_rsc_table)
+		return rproc->fw_ops->locate_rsc_table(rproc, image);
+
+	return NULL;
+}
+
+/* from remoteproc_cgroup.c */
+#ifdef CONFIG_CGROUP_RPROC
+unsigned int rproc_cgroup_weight(u16 tag);
+void rproc_cgroup_charge(u16 tag, u64 cycles);
+#else
+static inline unsigned int rproc_cgroup_weight(u16 tag)
+{
+	return 1;
+}
+
+static inline void rproc_cgroup_charge(u16 tag, u64 cycles) { }
+#endif
+
+/* from remoteproc_elf_loader.c */
 extern const struct rproc_fw_ops rproc_elf_fw_ops;
+int rproc_check_rsc_table(struct rproc *rproc, struct resource_table *table,
+								int size);
 
 #endif /* REMOTEPROC_INTERNAL_H */
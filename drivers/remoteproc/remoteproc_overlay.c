@@ -0,0 +1,287 @@
+/*
+ * Remote Processor Framework overlays
+ *
+ * A remote processor with little fast memory may run a firmware with more
+ * code than fits into it, split into overlays: sections that are all linked
+ * to run from the same region of that memory (see struct fw_rsc_overlay),
+ * and are only copied there as the remote processor needs them. It asks the
+ * host for an overlay by name through a struct fw_overlay, and kicks it
+ * with the notifyid of the region; the host copies the overlay out of the
+ * firmware image, which it keeps around while the remote processor runs,
+ * and kicks it back.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#define pr_fmt(fmt)    "%s: " fmt, __func__
+
+#include <linux/kernel.h>
+#include <linux/remoteproc.h>
+#include <linux/rcupdate.h>
+#include <linux/slab.h>
+#include <linux/io.h>
+#include <linux/string.h>
+#include <linux/workqueue.h>
+#include <linux/kref.h>
+
+#include "remoteproc_internal.h"
+
+/**
+ * struct rproc_overlay - the overlay region of a remote processor
+ * @rproc: the remote processor
+ * @da: device address of the region
+ * @len: size of the region, in bytes
+ * @va: kernel address of the region
+ * @mapped: whether @va was ioremapped for the overlays (rather than being
+ *	    part of a carveout)
+ * @ctrl: the control block the remote processor requests overlays with
+ * @notifyid: the notifyid requests are kicked with, both ways
+ * @image: the firmware image the overlays are copied out of, once the
+ *	   remote processor was loaded with it
+ * @work: serves the requests of the remote processor
+ */
+struct rproc_overlay {
+	struct rproc *rproc;
+	u32 da;
+	u32 len;
+	void __iomem *va;
+	bool mapped;
+	struct fw_overlay *ctrl;
+	u32 notifyid;
+	struct rproc_fw_image *image;
+	struct work_struct work;
+};
+
+/* is [@da, @da + @len) within the overlay region @ov ? */
+static bool rproc_overlay_fits(struct rproc_overlay *ov, u64 da, u64 len)
+{
+	return da >= ov->da && len <= ov->len && da - ov->da <= ov->len - len;
+}
+
+/* copy the overlay the remote processor asked for into its region */
+static void rproc_overlay_work(struct work_struct *work)
+{
+	struct rproc_overlay *ov = container_of(work, struct rproc_overlay,
+									work);
+	struct fw_overlay *ctrl = ov->ctrl;
+	struct rproc *rproc = ov->rproc;
+	char name[sizeof(ctrl->name) + 1];
+	const void *data;
+	size_t len;
+	u32 seq, da;
+	int ret;
+
+	seq = ACCESS_ONCE(ctrl->seq);
+	if (seq == ctrl->done || !ov->image)
+		return;
+
+	/* read the request only after the sequence number that published it */
+	rmb();
+	memcpy(name, ctrl->name, sizeof(ctrl->name));
+	name[sizeof(ctrl->name)] = '\0';
+
+	data = rproc_find_overlay(rproc, ov->image, name, &da, &len);
+	if (!data) {
+		dev_err(&rproc->dev, "no overlay %s\n", name);
+		ret = -ENOENT;
+	} else if (!rproc_overlay_fits(ov, da, len)) {
+		dev_err(&rproc->dev, "overlay %s is off: da 0x%x len 0x%zx\n",
+							name, da, len);
+		ret = -ERANGE;
+	} else {
+		memcpy_toio(ov->va + (da - ov->da), data, len);
+		dev_dbg(&rproc->dev, "overlay %s: da 0x%x len 0x%zx\n", name,
+								da, len);
+		ret = 0;
+	}
+
+	/* the overlay and its status before the number that tells they're in */
+	ctrl->status = ret;
+	wmb();
+	ctrl->done = seq;
+
+	rproc->ops->kick(rproc, ov->notifyid);
+}
+
+/**
+ * rproc_overlay_attach() - handle an overlay region resource
+ * @rproc: the remote processor
+ * @rsc: the overlay resource entry
+ *
+ * Must be called with rproc->lock held.
+ *
+ * Returns 0 on success, or an appropriate error code otherwise.
+ */
+int rproc_overlay_attach(struct rproc *rproc, struct fw_rsc_overlay *rsc)
+{
+	struct device *dev = &rproc->dev;
+	struct rproc_overlay *ov;
+
+	if (rproc->overlay) {
+		dev_err(dev, "only one overlay region is supported\n");
+		return -EINVAL;
+	}
+
+	if (!rsc->len || rsc->notifyid == FW_RSC_NOTIFY_ID_ANY) {
+		dev_err(dev, "bad overlay region: len 0x%x, notifyid %u\n",
+						rsc->len, rsc->notifyid);
+		return -EINVAL;
+	}
+
+	ov = kzalloc(sizeof(*ov), GFP_KERNEL);
+	if (!ov) {
+		dev_err(dev, "kzalloc overlay failed\n");
+		return -ENOMEM;
+	}
+
+	ov->ctrl = rproc_da_to_va(rproc, rsc->ctrl, sizeof(*ov->ctrl));
+	if (!ov->ctrl) {
+		dev_err(dev, "bad overlay control block da 0x%x\n", rsc->ctrl);
+		goto free_ov;
+	}
+
+	ov->va = (void __force __iomem *)rproc_da_to_va(rproc, rsc->da,
+								rsc->len);
+	if (!ov->va) {
+		ov->va = ioremap_nocache(rsc->pa, rsc->len);
+		if (!ov->va) {
+			dev_err(dev, "can't map overlay pa 0x%x\n", rsc->pa);
+			goto free_ov;
+		}
+		ov->mapped = true;
+	}
+
+	ov->rproc = rproc;
+	ov->da = rsc->da;
+	ov->len = rsc->len;
+	ov->notifyid = rsc->notifyid;
+	INIT_WORK(&ov->work, rproc_overlay_work);
+
+	rcu_assign_pointer(rproc->overlay, ov);
+
+	dev_dbg(dev, "overlay region: da 0x%x len 0x%x, notifyid %u\n",
+					rsc->da, rsc->len, rsc->notifyid);
+
+	return 0;
+
+free_ov:
+	kfree(ov);
+	return -EINVAL;
+}
+
+/**
+ * rproc_overlay_detach() - forget about the overlay region
+ * @rproc: the remote processor
+ *
+ * Called as the resources of @rproc are cleaned up, with rproc->lock held.
+ */
+void rproc_overlay_detach(struct rproc *rproc)
+{
+	struct rproc_overlay *ov = rproc->overlay;
+
+	if (!ov)
+		return;
+
+	rcu_assign_pointer(rproc->overlay, NULL);
+	synchronize_rcu();
+	cancel_work_sync(&ov->work);
+
+	if (ov->image)
+		rproc_put_fw_image(ov->image);
+	if (ov->mapped)
+		iounmap(ov->va);
+	kfree(ov);
+}
+
+/**
+ * rproc_overlay_start() - serve overlays to a remote processor
+ * @rproc: the remote processor, which is about to be started
+ * @image: the firmware image it was loaded with
+ *
+ * @image is kept around until the resources of @rproc are cleaned up, or
+ * it's loaded with another image.
+ *
+ * Must be called with rproc->lock held.
+ */
+void rproc_overlay_start(struct rproc *rproc, struct rproc_fw_image *image)
+{
+	struct rproc_overlay *ov = rproc->overlay;
+
+	if (!ov)
+		return;
+
+	/* no request may be left over from a previous run */
+	cancel_work_sync(&ov->work);
+	ov->ctrl->seq = 0;
+	ov->ctrl->done = 0;
+
+	if (ov->image == image)
+		return;
+
+	if (ov->image)
+		rproc_put_fw_image(ov->image);
+	kref_get(&image->refcount);
+	ov->image = image;
+}
+
+/**
+ * rproc_da_is_overlay() - is a device address range in the overlay region ?
+ * @rproc: handle of a remote processor
+ * @da: remoteproc device address
+ * @len: length of the memory region @da is pointing to
+ *
+ * The segments that are linked to run from the overlay region aren't
+ * loaded when the remote processor is booted, but copied in as it asks for
+ * them. This is meant to be called by the firmware loaders, as they load
+ * the segments, with rproc->lock held.
+ *
+ * Returns true if [@da, @da + @len) is within the overlay region.
+ */
+bool rproc_da_is_overlay(struct rproc *rproc, u64 da, u64 len)
+{
+	struct rproc_overlay *ov = rproc->overlay;
+
+	return ov && rproc_overlay_fits(ov, da, len);
+}
+
+/**
+ * rproc_overlay_interrupt() - look at the overlay request of a notification
+ * @rproc: the remote processor
+ * @notifyid: the notifyid the remote processor signalled, or RPROC_ALL_VQS
+ *
+ * Called from rproc_vq_interrupt() and the likes, possibly in interrupt
+ * context, before the vrings are looked at. The overlay is then copied
+ * from a work.
+ *
+ * Returns IRQ_HANDLED if the notification was about an overlay request,
+ * and IRQ_NONE otherwise.
+ */
+irqreturn_t rproc_overlay_interrupt(struct rproc *rproc, int notifyid)
+{
+	struct rproc_overlay *ov;
+	irqreturn_t ret = IRQ_NONE;
+
+	rcu_read_lock();
+
+	ov = rcu_dereference(rproc->overlay);
+	if (!ov || (notifyid != RPROC_ALL_VQS && notifyid != ov->notifyid))
+		goto unlock;
+
+	if (ACCESS_ONCE(ov->ctrl->seq) != ACCESS_ONCE(ov->ctrl->done)) {
+		queue_work(system_unbound_wq, &ov->work);
+		ret = IRQ_HANDLED;
+	} else if (notifyid == ov->notifyid) {
+		ret = IRQ_HANDLED;
+	}
+
+unlock:
+	rcu_read_unlock();
+	return ret;
+}
@@ -0,0 +1,430 @@
+/*
+ * Remote Processor Framework peer links
+ *
+ * Two remote processors which talk to each other (e.g. a DSP and an IPU)
+ * can do so over a pair of vrings they share, without the host relaying
+ * their messages: the host only allocates the vrings, maps them into
+ * both remote processors, and has their notifications routed straight
+ * from one to the other (see rproc_ops->route_peer). Each of them then
+ * runs rpmsg over the link, name service included, on its own.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#define pr_fmt(fmt)    "%s: " fmt, __func__
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/remoteproc.h>
+#include <linux/dma-mapping.h>
+#include <linux/iommu.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/virtio_ring.h>
+
+#include "remoteproc_internal.h"
+
+/* protects the peer links, which span two remote processors (and locks) */
+static DEFINE_MUTEX(rproc_peer_lock);
+
+/**
+ * struct rproc_peer_vring - a vring shared by two remote processors
+ * @va: kernel address of the vring
+ * @dma: dma address of the vring
+ * @len: length of the vring, in bytes
+ * @num: number of buffers of the vring
+ * @align: alignment of the used ring of the vring
+ * @notifyid: the notifyid both remote processors kick each other with,
+ *	      about this vring
+ */
+struct rproc_peer_vring {
+	void *va;
+	dma_addr_t dma;
+	int len;
+	u32 num;
+	u32 align;
+	u32 notifyid;
+};
+
+/**
+ * struct rproc_peer_link - the vrings two remote processors share
+ * @refcount: the rproc_peer entries of the link
+ * @dev: the device the vrings were allocated with
+ * @vrings: the vrings; @vrings[n] carries the buffers which side n of the
+ *	    link sends to the other side
+ * @users: how many of the two remote processors have the vrings mapped
+ */
+struct rproc_peer_link {
+	struct kref refcount;
+	struct device *dev;
+	struct rproc_peer_vring vrings[2];
+	int users;
+};
+
+/**
+ * struct rproc_peer - a peer of a remote processor
+ * @node: node in rproc->peers
+ * @rproc: the peer, or NULL once it's deleted
+ * @link: the link shared with @rproc
+ * @side: which side of @link we are
+ * @attached: the vrings of @link are mapped into us
+ */
+struct rproc_peer {
+	struct list_head node;
+	struct rproc *rproc;
+	struct rproc_peer_link *link;
+	int side;
+	bool attached;
+};
+
+static void rproc_peer_link_release(struct kref *kref)
+{
+	kfree(container_of(kref, struct rproc_peer_link, refcount));
+}
+
+static int rproc_peer_alloc_vring(struct rproc *rproc, struct device *dev,
+		struct fw_rsc_vdev_vring *vring, struct rproc_peer_vring *pv)
+{
+	if (!vring->num || !is_power_of_2(vring->num) ||
+			!vring->align || !is_power_of_2(vring->align)) {
+		dev_err(&rproc->dev, "bad peer vring: num %u, align %u\n",
+						vring->num, vring->align);
+		return -EINVAL;
+	}
+
+	if (vring->notifyid == FW_RSC_NOTIFY_ID_ANY) {
+		dev_err(&rproc->dev, "peer vrings need a notifyid\n");
+		return -EINVAL;
+	}
+
+	pv->len = PAGE_ALIGN(vring_size(vring->num, vring->align));
+	pv->va = dma_alloc_coherent(dev, pv->len, &pv->dma, GFP_KERNEL);
+	if (!pv->va) {
+		dev_err(&rproc->dev, "dma_alloc_coherent failed\n");
+		return -ENOMEM;
+	}
+
+	/* the rings must start out empty for both sides */
+	memset(pv->va, 0, pv->len);
+
+	pv->num = vring->num;
+	pv->align = vring->align;
+	pv->notifyid = vring->notifyid;
+
+	return 0;
+}
+
+static void rproc_peer_free_vrings(struct rproc_peer_link *link)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(link->vrings); i++) {
+		struct rproc_peer_vring *pv = &link->vrings[i];
+
+		if (pv->va)
+			dma_free_coherent(link->dev, pv->len, pv->va, pv->dma);
+		memset(pv, 0, sizeof(*pv));
+	}
+
+	put_device(link->dev);
+	link->dev = NULL;
+}
+
+/* does the firmware of the other side agree with ours on @pv ? */
+static bool rproc_peer_vring_matches(struct fw_rsc_vdev_vring *vring,
+						struct rproc_peer_vring *pv)
+{
+	return vring->num == pv->num && vring->align == pv->align &&
+					vring->notifyid == pv->notifyid;
+}
+
+/*
+ * map @pv into @rproc at the device address @vring asks for, and tell it
+ * where that is if it's behind no iommu.
+ */
+static int rproc_peer_map_vring(struct rproc *rproc,
+		struct fw_rsc_vdev_vring *vring, struct rproc_peer_vring *pv)
+{
+	struct device *dev = &rproc->dev;
+	struct rproc_mem_entry *mapping;
+	int ret;
+
+	if (!rproc->domain) {
+		if (vring->da != (u32)FW_RSC_ADDR_ANY && vring->da != pv->dma) {
+			dev_err(dev, "peer vring can't be at da 0x%x\n",
+								vring->da);
+			return -EINVAL;
+		}
+
+		vring->da = pv->dma;
+		return 0;
+	}
+
+	if (vring->da == (u32)FW_RSC_ADDR_ANY) {
+		dev_err(dev, "peer vrings need a da behind an iommu\n");
+		return -EINVAL;
+	}
+
+	mapping = kzalloc(sizeof(*mapping), GFP_KERNEL);
+	if (!mapping) {
+		dev_err(dev, "kzalloc mapping failed\n");
+		return -ENOMEM;
+	}
+
+	ret = iommu_map(rproc->domain, vring->da, pv->dma, pv->len,
+						IOMMU_READ | IOMMU_WRITE);
+	if (ret) {
+		dev_err(dev, "failed to map peer vring: %d\n", ret);
+		kfree(mapping);
+		return ret;
+	}
+
+	/* it's unmapped along with the other iommu mappings of @rproc */
+	mapping->da = vring->da;
+	mapping->dma = pv->dma;
+	mapping->len = pv->len;
+	list_add_tail(&mapping->node, &rproc->mappings);
+
+	return 0;
+}
+
+/*
+ * have the notifications about the vrings of @link go straight between
+ * @rproc and @peer (or stop them), through whichever of the two can route
+ * them.
+ */
+static void rproc_peer_route(struct rproc *rproc, struct rproc *peer,
+				struct rproc_peer_link *link, bool enable)
+{
+	struct rproc *router = rproc, *other = peer;
+	int i, ret;
+
+	if (!router->ops->route_peer) {
+		router = peer;
+		other = rproc;
+	}
+
+	if (!router->ops->route_peer) {
+		dev_warn(&rproc->dev, "can't route notifications to %s\n",
+								peer->name);
+		return;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(link->vrings); i++) {
+		ret = router->ops->route_peer(router, other,
+					link->vrings[i].notifyid, enable);
+		if (ret)
+			dev_err(&rproc->dev, "can't route notifyid %u: %d\n",
+					link->vrings[i].notifyid, ret);
+	}
+}
+
+/**
+ * rproc_peer_attach() - handle a peer link resource
+ * @rproc: the remote processor
+ * @rsc: the peer link resource descriptor
+ *
+ * The first of the two remote processors which is booted allocates the
+ * vrings of the link, as its entry describes them; the other one only
+ * maps them, after making sure its entry describes them the same way.
+ * Once both have them mapped, their notifications are routed.
+ *
+ * Must be called with rproc->lock held.
+ *
+ * Returns 0 on success, or an appropriate error code otherwise
+ */
+int rproc_peer_attach(struct rproc *rproc, struct fw_rsc_peer *rsc)
+{
+	struct device *dev = &rproc->dev;
+	struct rproc_peer_link *link;
+	struct rproc_peer *p;
+	struct fw_rsc_vdev_vring *vrings[2];
+	int side, ret = -ENODEV;
+
+	mutex_lock(&rproc_peer_lock);
+
+	list_for_each_entry(p, &rproc->peers, node)
+		if (p->rproc && !strncmp(p->rproc->name,
+				(const char *)rsc->name, sizeof(rsc->name)))
+			break;
+
+	if (&p->node == &rproc->peers) {
+		dev_err(dev, "unknown peer %.*s\n", (int)sizeof(rsc->name),
+								rsc->name);
+		goto unlock;
+	}
+
+	if (p->attached) {
+		dev_err(dev, "duplicate link to peer %s\n", p->rproc->name);
+		ret = -EINVAL;
+		goto unlock;
+	}
+
+	link = p->link;
+	side = p->side;
+	vrings[side] = &rsc->tx;
+	vrings[!side] = &rsc->rx;
+
+	if (!link->users) {
+		link->dev = get_device(rproc->dev.parent);
+
+		ret = rproc_peer_alloc_vring(rproc, link->dev, vrings[0],
+							&link->vrings[0]);
+		if (!ret)
+			ret = rproc_peer_alloc_vring(rproc, link->dev,
+						vrings[1], &link->vrings[1]);
+		if (ret)
+			goto free_vrings;
+	} else if (!rproc_peer_vring_matches(vrings[0], &link->vrings[0]) ||
+		   !rproc_peer_vring_matches(vrings[1], &link->vrings[1])) {
+		dev_err(dev, "peer %s disagrees on the vrings\n",
+							p->rproc->name);
+		ret = -EINVAL;
+		goto unlock;
+	}
+
+	/* on failure, the mapped vrings are unmapped by the resource cleanup */
+	ret = rproc_peer_map_vring(rproc, vrings[0], &link->vrings[0]);
+	if (!ret)
+		ret = rproc_peer_map_vring(rproc, vrings[1], &link->vrings[1]);
+	if (ret)
+		goto free_vrings;
+
+	p->attached = true;
+	if (++link->users == 2)
+		rproc_peer_route(rproc, p->rproc, link, true);
+
+	dev_dbg(dev, "linked to %s: notifyids %u, %u\n", p->rproc->name,
+			link->vrings[0].notifyid, link->vrings[1].notifyid);
+
+	mutex_unlock(&rproc_peer_lock);
+	return 0;
+
+free_vrings:
+	if (!link->users)
+		rproc_peer_free_vrings(link);
+unlock:
+	mutex_unlock(&rproc_peer_lock);
+	return ret;
+}
+
+/**
+ * rproc_peer_detach() - let go of the peer links of a remote processor
+ * @rproc: the remote processor
+ *
+ * Called as the resources of @rproc are cleaned up: the notifications of
+ * its links stop being routed, and the vrings of a link are freed once
+ * neither of its sides uses them anymore. Their iommu mappings are
+ * removed along with the others of @rproc.
+ */
+void rproc_peer_detach(struct rproc *rproc)
+{
+	struct rproc_peer *p;
+
+	mutex_lock(&rproc_peer_lock);
+
+	list_for_each_entry(p, &rproc->peers, node) {
+		if (!p->attached)
+			continue;
+
+		if (p->link->users == 2)
+			rproc_peer_route(rproc, p->rproc, p->link, false);
+
+		p->attached = false;
+		if (!--p->link->users)
+			rproc_peer_free_vrings(p->link);
+	}
+
+	mutex_unlock(&rproc_peer_lock);
+}
+
+/**
+ * rproc_peer_del() - unlink a remote processor from its peers
+ * @rproc: the remote processor, which is being deleted
+ *
+ * The peers of @rproc keep their end of the links, so they may let go of
+ * the vrings they still use, but can't link to @rproc anymore.
+ */
+void rproc_peer_del(struct rproc *rproc)
+{
+	struct rproc_peer *p, *tmp, *q;
+
+	mutex_lock(&rproc_peer_lock);
+
+	list_for_each_entry_safe(p, tmp, &rproc->peers, node) {
+		if (p->rproc)
+			list_for_each_entry(q, &p->rproc->peers, node)
+				if (q->link == p->link)
+					q->rproc = NULL;
+
+		list_del(&p->node);
+		kref_put(&p->link->refcount, rproc_peer_link_release);
+		kfree(p);
+	}
+
+	mutex_unlock(&rproc_peer_lock);
+}
+
+/**
+ * rproc_add_peer() - declare that two remote processors share vrings
+ * @rproc: handle of a remote processor
+ * @peer: handle of the remote processor @rproc talks to
+ *
+ * From now on, the RSC_PEER entries in the resource tables of @rproc and
+ * @peer which name each other (see struct fw_rsc_peer) share their vrings.
+ * Peers must be declared before either of them is booted (typically, by
+ * platform code, right after the remote processors are added), and the
+ * link goes away when either of them is deleted.
+ *
+ * Returns 0 on success, or an appropriate error value otherwise.
+ */
+int rproc_add_peer(struct rproc *rproc, struct rproc *peer)
+{
+	struct rproc_peer_link *link;
+	struct rproc_peer *p[2];
+	int i;
+
+	if (!rproc || !peer || rproc == peer) {
+		pr_err("invalid rproc handle\n");
+		return -EINVAL;
+	}
+
+	link = kzalloc(sizeof(*link), GFP_KERNEL);
+	p[0] = kzalloc(sizeof(*p[0]), GFP_KERNEL);
+	p[1] = kzalloc(sizeof(*p[1]), GFP_KERNEL);
+	if (!link || !p[0] || !p[1]) {
+		dev_err(&rproc->dev, "kzalloc peer link failed\n");
+		kfree(p[1]);
+		kfree(p[0]);
+		kfree(link);
+		return -ENOMEM;
+	}
+
+	/* each side holds a reference to the link */
+	kref_init(&link->refcount);
+	kref_get(&link->refcount);
+
+	p[0]->rproc = peer;
+	p[1]->rproc = rproc;
+
+	mutex_lock(&rproc_peer_lock);
+
+	for (i = 0; i < 2; i++) {
+		p[i]->link = link;
+		p[i]->side = i;
+		list_add_tail(&p[i]->node, &p[!i]->rproc->peers);
+	}
+
+	mutex_unlock(&rproc_peer_lock);
+
+	return 0;
+}
+EXPORT_SYMBOL(rproc_add_peer);
@@ -0,0 +1,515 @@
+/*
+ * Remote Processor Framework perf PMU
+ *
+ * Exports the performance counters, which a remote processor declares
+ * in its resource table (see struct fw_rsc_perf), as the events of a perf
+ * PMU named after it, e.g.:
+ *
+ * # perf stat -a -e rproc0/cycles/,rproc0/counter=1/ sleep 1
+ *
+ * The counters live in the memory of the remote processor, so, unlike
+ * the host's hardware counters, they can't interrupt, nor tell which task
+ * they counted for: only counting, cpu-wide events are supported.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#define pr_fmt(fmt)    "%s: " fmt, __func__
+
+#include <linux/kernel.h>
+#include <linux/remoteproc.h>
+#include <linux/perf_event.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+#include <linux/ctype.h>
+
+#include "remoteproc_internal.h"
+
+/* how many times a read is retried, while it races with the remote's update */
+#define RPROC_PERF_READ_TRIES	16
+
+/**
+ * struct rproc_perf_event_attr - a counter, as it shows in the events group
+ * @attr: the sysfs attribute, named after the counter
+ * @index: the index of the counter
+ * @name: the name of the counter
+ */
+struct rproc_perf_event_attr {
+	struct device_attribute attr;
+	int index;
+	char name[FW_PERF_NAME_LEN + 4];
+};
+
+/**
+ * struct rproc_perf - the perf PMU of a remote processor
+ * @pmu: the PMU
+ * @rproc: the remote processor
+ * @name: the name of the PMU, e.g. "rproc0"
+ * @num: the number of counters
+ * @lock: protects @counters, @gen, @users and @deleted
+ * @counters: the counters, or NULL while the remote processor is off
+ * @gen: incremented whenever the counters are attached, since they may
+ *	 have been reset by the boot
+ * @users: the number of events of this PMU
+ * @deleted: the remote processor was deleted, and the PMU is to be
+ *	     unregistered once @users drops to zero
+ * @unregister_work: unregisters the PMU, out of the context of the event
+ *	     that was last destroyed
+ * @events: the counters, as they show in @events_group
+ * @event_attrs: NULL-terminated pointers to the attributes of @events
+ * @events_group: the "events" attribute group of the PMU
+ * @groups: NULL-terminated attribute groups of the PMU
+ */
+struct rproc_perf {
+	struct pmu pmu;
+	struct rproc *rproc;
+	char name[16];
+	u32 num;
+	spinlock_t lock;
+	struct fw_perf_counters *counters;
+	u64 gen;
+	int users;
+	bool deleted;
+	struct work_struct unregister_work;
+	struct rproc_perf_event_attr *events;
+	struct attribute **event_attrs;
+	struct attribute_group events_group;
+	const struct attribute_group *groups[4];
+};
+
+#define to_rproc_perf(p) container_of(p, struct rproc_perf, pmu)
+
+PMU_FORMAT_ATTR(counter, "config:0-7");
+
+static struct attribute *rproc_perf_format_attrs[] = {
+	&format_attr_counter.attr,
+	NULL,
+};
+
+static struct attribute_group rproc_perf_format_group = {
+	.name = "format",
+	.attrs = rproc_perf_format_attrs,
+};
+
+/* the counters are read from a single cpu; which one doesn't matter */
+static ssize_t rproc_perf_cpumask_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "0\n");
+}
+
+static DEVICE_ATTR(cpumask, S_IRUGO, rproc_perf_cpumask_show, NULL);
+
+static struct attribute *rproc_perf_cpumask_attrs[] = {
+	&dev_attr_cpumask.attr,
+	NULL,
+};
+
+static struct attribute_group rproc_perf_cpumask_group = {
+	.attrs = rproc_perf_cpumask_attrs,
+};
+
+static ssize_t rproc_perf_event_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct rproc_perf_event_attr *event =
+		container_of(attr, struct rproc_perf_event_attr, attr);
+
+	return sprintf(buf, "counter=%d\n", event->index);
+}
+
+/*
+ * Read a counter, and the generation of the counters it was read from.
+ *
+ * Returns false if the remote processor is off, in which case the counter
+ * can't be read (but @gen still is).
+ */
+static bool rproc_perf_read(struct rproc_perf *perf, int index, u64 *val,
+								u64 *gen)
+{
+	struct fw_perf_counters *counters;
+	unsigned long flags;
+	int tries = RPROC_PERF_READ_TRIES;
+	u32 seq;
+
+	spin_lock_irqsave(&perf->lock, flags);
+
+	*gen = perf->gen;
+
+	counters = perf->counters;
+	if (!counters) {
+		spin_unlock_irqrestore(&perf->lock, flags);
+		return false;
+	}
+
+	/*
+	 * A remote processor that stopped in the middle of an update would
+	 * keep us retrying forever, so eventually settle for a torn value.
+	 */
+	do {
+		seq = ACCESS_ONCE(counters->seq);
+		rmb();
+		*val = ACCESS_ONCE(counters->values[index]);
+		rmb();
+	} while ((seq & 1 || seq != ACCESS_ONCE(counters->seq)) && --tries);
+
+	spin_unlock_irqrestore(&perf->lock, flags);
+
+	return true;
+}
+
+static void rproc_perf_event_update(struct perf_event *event)
+{
+	struct rproc_perf *perf = to_rproc_perf(event->pmu);
+	struct hw_perf_event *hwc = &event->hw;
+	u64 prev, now, gen;
+
+	/* the remote processor is off, so its counters didn't move */
+	if (!rproc_perf_read(perf, hwc->config, &now, &gen))
+		return;
+
+	/* it was booted since, and its counters (may have) started over */
+	prev = local64_read(&hwc->prev_count);
+	if (gen != hwc->last_tag) {
+		prev = 0;
+		hwc->last_tag = gen;
+	}
+
+	local64_set(&hwc->prev_count, now);
+	local64_add(now - prev, &event->count);
+}
+
+static void rproc_perf_event_start(struct perf_event *event, int flags)
+{
+	struct rproc_perf *perf = to_rproc_perf(event->pmu);
+	struct hw_perf_event *hwc = &event->hw;
+	u64 now = 0, gen;
+
+	rproc_perf_read(perf, hwc->config, &now, &gen);
+
+	local64_set(&hwc->prev_count, now);
+	hwc->last_tag = gen;
+	hwc->state = 0;
+}
+
+static void rproc_perf_event_stop(struct perf_event *event, int flags)
+{
+	struct hw_perf_event *hwc = &event->hw;
+
+	if (hwc->state & PERF_HES_STOPPED)
+		return;
+
+	rproc_perf_event_update(event);
+	hwc->state |= PERF_HES_STOPPED | PERF_HES_UPTODATE;
+}
+
+static int rproc_perf_event_add(struct perf_event *event, int flags)
+{
+	event->hw.state = PERF_HES_STOPPED | PERF_HES_UPTODATE;
+
+	if (flags & PERF_EF_START)
+		rproc_perf_event_start(event, flags);
+
+	return 0;
+}
+
+static void rproc_perf_event_del(struct perf_event *event, int flags)
+{
+	rproc_perf_event_stop(event, PERF_EF_UPDATE);
+}
+
+static void rproc_perf_event_read(struct perf_event *event)
+{
+	rproc_perf_event_update(event);
+}
+
+static void rproc_perf_event_destroy(struct perf_event *event)
+{
+	struct rproc_perf *perf = to_rproc_perf(event->pmu);
+	struct rproc *rproc = perf->rproc;
+	unsigned long flags;
+
+	spin_lock_irqsave(&perf->lock, flags);
+	if (!--perf->users && perf->deleted) {
+		get_device(&rproc->dev);
+		schedule_work(&perf->unregister_work);
+	}
+	spin_unlock_irqrestore(&perf->lock, flags);
+
+	put_device(&rproc->dev);
+}
+
+static int rproc_perf_event_init(struct perf_event *event)
+{
+	struct rproc_perf *perf = to_rproc_perf(event->pmu);
+	struct perf_event_attr *attr = &event->attr;
+	unsigned long flags;
+	int ret = 0;
+
+	if (attr->type != event->pmu->type)
+		return -ENOENT;
+
+	/* the counters can neither interrupt, nor tell tasks apart */
+	if (is_sampling_event(event) || event->attach_state & PERF_ATTACH_TASK)
+		return -EOPNOTSUPP;
+
+	if (event->cpu < 0)
+		return -EINVAL;
+
+	if (attr->exclude_user || attr->exclude_kernel || attr->exclude_hv ||
+			attr->exclude_idle)
+		return -EINVAL;
+
+	if (attr->config >= perf->num)
+		return -EINVAL;
+
+	spin_lock_irqsave(&perf->lock, flags);
+	if (perf->deleted)
+		ret = -ENODEV;
+	else
+		perf->users++;
+	spin_unlock_irqrestore(&perf->lock, flags);
+
+	if (ret)
+		return ret;
+
+	/* the PMU (and its remote processor) must outlive the event */
+	get_device(&perf->rproc->dev);
+
+	event->hw.config = attr->config;
+	event->destroy = rproc_perf_event_destroy;
+
+	return 0;
+}
+
+static void rproc_perf_unregister_work(struct work_struct *work)
+{
+	struct rproc_perf *perf = container_of(work, struct rproc_perf,
+							unregister_work);
+
+	perf_pmu_unregister(&perf->pmu);
+	put_device(&perf->rproc->dev);
+}
+
+/* perf's event parser, and sysfs, take names like these */
+static bool rproc_perf_name_ok(const char *name)
+{
+	if (!*name || !isalpha(*name))
+		return false;
+
+	for (; *name; name++)
+		if (!isalnum(*name) && *name != '_' && *name != '-' &&
+								*name != '.')
+			return false;
+
+	return true;
+}
+
+static int rproc_perf_create_events(struct rproc_perf *perf,
+						struct fw_rsc_perf *rsc)
+{
+	struct rproc_perf_event_attr *event;
+	int i, j;
+
+	perf->events = kcalloc(perf->num, sizeof(*perf->events), GFP_KERNEL);
+	perf->event_attrs = kcalloc(perf->num + 1, sizeof(*perf->event_attrs),
+								GFP_KERNEL);
+	if (!perf->events || !perf->event_attrs)
+		return -ENOMEM;
+
+	for (i = 0; i < perf->num; i++) {
+		event = &perf->events[i];
+
+		memcpy(event->name, rsc->names[i], FW_PERF_NAME_LEN);
+
+		/* badly named counters are still counted, by their index */
+		for (j = 0; j < i; j++)
+			if (!strcmp(event->name, perf->events[j].name))
+				break;
+		if (j < i || !rproc_perf_name_ok(event->name))
+			snprintf(event->name, sizeof(event->name), "counter%d",
+									i);
+
+		sysfs_attr_init(&event->attr.attr);
+		event->attr.attr.name = event->name;
+		event->attr.attr.mode = S_IRUGO;
+		event->attr.show = rproc_perf_event_show;
+		event->index = i;
+
+		perf->event_attrs[i] = &event->attr.attr;
+	}
+
+	perf->events_group.name = "events";
+	perf->events_group.attrs = perf->event_attrs;
+
+	return 0;
+}
+
+static struct rproc_perf *rproc_perf_register(struct rproc *rproc,
+						struct fw_rsc_perf *rsc)
+{
+	struct device *dev = &rproc->dev;
+	struct rproc_perf *perf;
+	int ret;
+
+	perf = kzalloc(sizeof(*perf), GFP_KERNEL);
+	if (!perf) {
+		dev_err(dev, "kzalloc perf failed\n");
+		return NULL;
+	}
+
+	perf->rproc = rproc;
+	perf->num = rsc->num;
+	spin_lock_init(&perf->lock);
+	INIT_WORK(&perf->unregister_work, rproc_perf_unregister_work);
+	snprintf(perf->name, sizeof(perf->name), "rproc%d", rproc->index);
+
+	ret = rproc_perf_create_events(perf, rsc);
+	if (ret) {
+		dev_err(dev, "failed to create the perf events\n");
+		goto free_perf;
+	}
+
+	perf->groups[0] = &rproc_perf_format_group;
+	perf->groups[1] = &perf->events_group;
+	perf->groups[2] = &rproc_perf_cpumask_group;
+
+	perf->pmu.task_ctx_nr = perf_invalid_context;
+	perf->pmu.attr_groups = perf->groups;
+	perf->pmu.event_init = rproc_perf_event_init;
+	perf->pmu.add = rproc_perf_event_add;
+	perf->pmu.del = rproc_perf_event_del;
+	perf->pmu.start = rproc_perf_event_start;
+	perf->pmu.stop = rproc_perf_event_stop;
+	perf->pmu.read = rproc_perf_event_read;
+
+	ret = perf_pmu_register(&perf->pmu, perf->name, -1);
+	if (ret) {
+		dev_err(dev, "failed to register the %s pmu: %d\n", perf->name,
+									ret);
+		goto free_perf;
+	}
+
+	dev_info(dev, "%s pmu registered with %u counters\n", perf->name,
+								perf->num);
+
+	return perf;
+
+free_perf:
+	kfree(perf->event_attrs);
+	kfree(perf->events);
+	kfree(perf);
+	return NULL;
+}
+
+/**
+ * rproc_perf_attach() - attach the counters of a booting remote processor
+ * @rproc: the remote processor
+ * @rsc: its perf resource entry
+ * @counters: the kernel mapping of its counters
+ *
+ * Registers the PMU of @rproc the first time it's booted, and lets its
+ * events count @counters from now on, until rproc_perf_detach() is called.
+ *
+ * Returns 0 on success, or an appropriate error code otherwise.
+ */
+int rproc_perf_attach(struct rproc *rproc, struct fw_rsc_perf *rsc,
+					struct fw_perf_counters *counters)
+{
+	struct rproc_perf *perf = rproc->perf;
+	unsigned long flags;
+
+	if (!perf) {
+		perf = rproc_perf_register(rproc, rsc);
+		if (!perf)
+			return -ENOMEM;
+		rproc->perf = perf;
+	}
+
+	/* the events are already out there, described as they were */
+	if (rsc->num != perf->num) {
+		dev_err(&rproc->dev, "perf counters changed: %u, not %u\n",
+							rsc->num, perf->num);
+		return -EINVAL;
+	}
+
+	spin_lock_irqsave(&perf->lock, flags);
+	perf->counters = counters;
+	perf->gen++;
+	spin_unlock_irqrestore(&perf->lock, flags);
+
+	return 0;
+}
+
+/**
+ * rproc_perf_detach() - detach the counters of a remote processor
+ * @rproc: the remote processor, which is shutting down
+ *
+ * The events of @rproc keep their counts from here on, without reading
+ * the memory of @rproc anymore, until it's booted again.
+ */
+void rproc_perf_detach(struct rproc *rproc)
+{
+	struct rproc_perf *perf = rproc->perf;
+	unsigned long flags;
+
+	if (!perf)
+		return;
+
+	spin_lock_irqsave(&perf->lock, flags);
+	perf->counters = NULL;
+	spin_unlock_irqrestore(&perf->lock, flags);
+}
+
+/**
+ * rproc_perf_del() - unregister the PMU of a remote processor
+ * @rproc: the remote processor, which is being deleted
+ *
+ * The PMU is unregistered once its last event is destroyed.
+ */
+void rproc_perf_del(struct rproc *rproc)
+{
+	struct rproc_perf *perf = rproc->perf;
+	unsigned long flags;
+
+	if (!perf)
+		return;
+
+	rproc_perf_detach(rproc);
+
+	spin_lock_irqsave(&perf->lock, flags);
+	perf->deleted = true;
+	if (!perf->users) {
+		get_device(&rproc->dev);
+		schedule_work(&perf->unregister_work);
+	}
+	spin_unlock_irqrestore(&perf->lock, flags);
+}
+
+/**
+ * rproc_perf_free() - free the PMU of a remote processor
+ * @rproc: the remote processor, which is being released
+ *
+ * The PMU was unregistered already, as the work doing so holds a
+ * reference to @rproc.
+ */
+void rproc_perf_free(struct rproc *rproc)
+{
+	struct rproc_perf *perf = rproc->perf;
+
+	if (!perf)
+		return;
+
+	kfree(perf->event_attrs);
+	kfree(perf->events);
+	kfree(perf);
+	rproc->perf = NULL;
+}
@@ -0,0 +1,167 @@
+/*
+ * Remote Processor Framework persistent crash log
+ *
+ * The crashes of remote processors, along with the tail of their trace
+ * buffers, and their recoveries, are appended to a ring that pstore keeps
+ * (in RAM, with ramoops), so they can still be told about after the host
+ * itself resets, e.g. when the crash of a remote processor took it down.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#define pr_fmt(fmt)    "%s: " fmt, __func__
+
+#include <linux/kernel.h>
+#include <linux/remoteproc.h>
+#include <linux/pstore.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/time.h>
+
+#include "remoteproc_internal.h"
+
+/* how much of the tail of each trace buffer is logged along with a crash */
+#define RPROC_PSTORE_TRACE_TAIL	512
+
+/* append the header of an event of @rproc to @buf, which is @size long */
+static int rproc_pstore_header(struct rproc *rproc, char *buf, size_t size)
+{
+	struct timespec now;
+
+	getnstimeofday(&now);
+
+	return scnprintf(buf, size, "[%lu.%06lu] %s: ",
+				(unsigned long)now.tv_sec,
+				now.tv_nsec / NSEC_PER_USEC, rproc->name);
+}
+
+/* copy the tail of the logs of a trace ring to @buf */
+static u32 rproc_pstore_ring_tail(struct rproc_mem_entry *trace, char *buf,
+								u32 count)
+{
+	u32 head, tail, size, pos;
+
+	if (!rproc_trace_ring_span(trace, &head, &tail, &size))
+		return 0;
+
+	pos = head - min3(head - tail, size, count);
+
+	return rproc_trace_ring_copy(trace, &pos, buf, count);
+}
+
+/* copy the tail of the logs of a flat trace buffer to @buf */
+static u32 rproc_pstore_flat_tail(struct rproc_mem_entry *trace, char *buf,
+								u32 count)
+{
+	u32 len = strnlen(trace->va, trace->len);
+	u32 first = len > count ? len - count : 0;
+
+	memcpy(buf, trace->va + first, len - first);
+
+	return len - first;
+}
+
+/* append the tails of the (text) trace buffers of @rproc to @buf */
+static int rproc_pstore_traces(struct rproc *rproc, char *buf, size_t size)
+{
+	struct rproc_mem_entry *trace;
+	int i = 0, len = 0;
+	u32 count;
+
+	list_for_each_entry(trace, &rproc->traces, node) {
+		if (trace->flags & FW_TRACE_BINARY) {
+			i++;
+			continue;
+		}
+
+		len += scnprintf(buf + len, size - len, "--- trace%d ---\n",
+									i++);
+
+		/* leave room for the newline, and the terminating null */
+		if (size - len <= 2)
+			break;
+		count = min_t(size_t, RPROC_PSTORE_TRACE_TAIL, size - len - 2);
+
+		if (trace->flags & FW_TRACE_RING)
+			count = rproc_pstore_ring_tail(trace, buf + len, count);
+		else
+			count = rproc_pstore_flat_tail(trace, buf + len, count);
+
+		len += count;
+		if (count && buf[len - 1] != '\n')
+			buf[len++] = '\n';
+		buf[len] = '\0';
+	}
+
+	return len;
+}
+
+/**
+ * rproc_pstore_log_crash() - log a crash of a remote processor
+ * @rproc: the remote processor, which crashed
+ * @type: what kind of crash it was
+ *
+ * The crash, its type, and the tail of each (text) trace buffer of @rproc
+ * are appended, as a single record, to the pstore ring of remote processor
+ * events. Memory is only copied around: none of it touches slow storage,
+ * with ramoops, so it's fine to call from the crash path.
+ *
+ * Must be called with @rproc->lock held, before its resources are gone.
+ */
+void rproc_pstore_log_crash(struct rproc *rproc, const char *type)
+{
+	size_t size = PAGE_SIZE;
+	char *buf;
+	int len, ret;
+
+	buf = kmalloc(size, GFP_KERNEL);
+	if (!buf)
+		return;
+
+	len = rproc_pstore_header(rproc, buf, size);
+	len += scnprintf(buf + len, size - len, "crash #%u (%s), firmware %s\n",
+				rproc->crash_cnt, type, rproc->firmware);
+	len += rproc_pstore_traces(rproc, buf + len, size - len);
+
+	ret = pstore_write_rproc(buf, len);
+	if (ret && ret != -ENODEV)
+		dev_warn(&rproc->dev, "can't log crash to pstore: %d\n", ret);
+
+	kfree(buf);
+}
+
+/**
+ * rproc_pstore_log_recovery() - log how a crashed remote processor recovered
+ * @rproc: the remote processor, which crashed
+ * @how: how it recovered, e.g. "recovered" or "failed over"
+ * @ret: outcome of the recovery: 0 on success, or an error value
+ * @ms: how long the recovery took, in milliseconds
+ *
+ * Appends a record to the pstore ring of remote processor events, right
+ * after that of the crash (see rproc_pstore_log_crash()).
+ */
+void rproc_pstore_log_recovery(struct rproc *rproc, const char *how, int ret,
+							unsigned int ms)
+{
+	char buf[128];
+	int len;
+
+	len = rproc_pstore_header(rproc, buf, sizeof(buf));
+	if (ret)
+		len += scnprintf(buf + len, sizeof(buf) - len,
+					"crash #%u: not %s: %d\n",
+					rproc->crash_cnt, how, ret);
+	else
+		len += scnprintf(buf + len, sizeof(buf) - len,
+					"crash #%u: %s in %u ms\n",
+					rproc->crash_cnt, how, ms);
+
+	pstore_write_rproc(buf, len);
+}
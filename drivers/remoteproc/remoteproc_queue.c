@@ -0,0 +1,429 @@
+/*
+ * Remote Processor Framework shared-memory queues
+ *
+ * A remote processor may declare queues of small, fixed-size slots in its
+ * memory (see struct fw_rsc_queue), for control words too tiny to be worth
+ * a vring descriptor, a buffer and an rpmsg header each: a message only
+ * touches its slot and the cache line of the index it publishes.
+ *
+ * Each queue has a single consumer, and a single producer too, unless its
+ * producers (e.g. several cores of the remote processor, and the host)
+ * serialize with a hwspinlock.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#define pr_fmt(fmt)    "%s: " fmt, __func__
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/remoteproc.h>
+#include <linux/hwspinlock.h>
+#include <linux/rculist.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/string.h>
+#include <linux/err.h>
+
+#include "remoteproc_internal.h"
+
+/* how long (in msecs) a sender spins on the hwspinlock of a queue */
+#define RPROC_QUEUE_HWLOCK_TIMEOUT	10
+
+/**
+ * struct rproc_queue - a shared-memory queue of a remote processor
+ * @node: node in rproc->queues
+ * @rproc: the remote processor
+ * @name: name of the queue, as its resource entry has it
+ * @lock: protects @hdr, @cb and @priv, and serializes the host's accesses
+ *	  to the queue
+ * @hdr: the queue, or NULL while the remote processor is off
+ * @num: number of slots of the queue
+ * @slot_size: size of each slot, in bytes
+ * @notifyid: the notifyid the queue is kicked with
+ * @flags: the fw_rsc_queue flags of the queue
+ * @hwlock: serializes the producers of the queue, if it has several
+ * @cb: handles the messages the remote processor sends on the queue
+ * @priv: private data of @cb
+ * @open: whether the queue is used by someone (see rproc_queue_open())
+ */
+struct rproc_queue {
+	struct list_head node;
+	struct rproc *rproc;
+	char name[sizeof(((struct fw_rsc_queue *)0)->name) + 1];
+	spinlock_t lock;
+	struct fw_queue *hdr;
+	u32 num;
+	u32 slot_size;
+	u32 notifyid;
+	u32 flags;
+	struct hwspinlock *hwlock;
+	rproc_queue_cb_t cb;
+	void *priv;
+	bool open;
+};
+
+static struct rproc_queue *rproc_find_queue(struct rproc *rproc,
+							const char *name)
+{
+	struct rproc_queue *q;
+
+	list_for_each_entry(q, &rproc->queues, node)
+		if (!strcmp(q->name, name))
+			return q;
+
+	return NULL;
+}
+
+static struct fw_queue_slot *rproc_queue_slot(struct rproc_queue *q, u32 idx)
+{
+	return (void *)q->hdr->slots + (idx & (q->num - 1)) * q->slot_size;
+}
+
+/**
+ * rproc_queue_attach() - handle a shared-memory queue resource
+ * @rproc: the remote processor
+ * @rsc: the queue resource descriptor
+ *
+ * The queue keeps its struct rproc_queue (and thus its user) across the
+ * boots of @rproc: it's only bound to its memory again.
+ *
+ * Must be called with rproc->lock held.
+ *
+ * Returns 0 on success, or an appropriate error code otherwise
+ */
+int rproc_queue_attach(struct rproc *rproc, struct fw_rsc_queue *rsc)
+{
+	struct device *dev = &rproc->dev;
+	struct hwspinlock *hwlock = NULL;
+	struct rproc_queue *q;
+	struct fw_queue *hdr;
+	char name[sizeof(q->name)];
+	unsigned long flags;
+	int len;
+
+	if (!rsc->num || !is_power_of_2(rsc->num) ||
+			rsc->slot_size <= sizeof(struct fw_queue_slot) ||
+			rsc->slot_size > FW_QUEUE_SLOT_MAX ||
+			rsc->slot_size % sizeof(u32) ||
+			rsc->notifyid == FW_RSC_NOTIFY_ID_ANY ||
+			rsc->flags & ~FW_QUEUE_TO_HOST) {
+		dev_err(dev, "bad queue: num %u, slot size %u, flags 0x%x\n",
+					rsc->num, rsc->slot_size, rsc->flags);
+		return -EINVAL;
+	}
+
+	len = sizeof(*hdr) + rsc->num * rsc->slot_size;
+	hdr = rproc_da_to_va(rproc, rsc->da, len);
+	if (!hdr) {
+		dev_err(dev, "erroneous queue resource entry\n");
+		return -EINVAL;
+	}
+
+	memcpy(name, rsc->name, sizeof(rsc->name));
+	name[sizeof(rsc->name)] = '\0';
+
+	q = rproc_find_queue(rproc, name);
+	if (q && q->hdr) {
+		dev_err(dev, "duplicate queue %s\n", name);
+		return -EINVAL;
+	}
+
+	if (rsc->hwlock != FW_QUEUE_NO_HWLOCK) {
+		hwlock = hwspin_lock_request_specific(rsc->hwlock);
+		if (IS_ERR_OR_NULL(hwlock)) {
+			dev_err(dev, "can't get hwspinlock %u of queue %s\n",
+							rsc->hwlock, name);
+			return -EBUSY;
+		}
+	}
+
+	if (!q) {
+		q = kzalloc(sizeof(*q), GFP_KERNEL);
+		if (!q) {
+			dev_err(dev, "kzalloc queue failed\n");
+			if (hwlock)
+				hwspin_lock_free(hwlock);
+			return -ENOMEM;
+		}
+
+		q->rproc = rproc;
+		strcpy(q->name, name);
+		spin_lock_init(&q->lock);
+		list_add_tail_rcu(&q->node, &rproc->queues);
+	}
+
+	/* the remote processor isn't running yet: the queue starts empty */
+	hdr->head = 0;
+	hdr->tail = 0;
+
+	spin_lock_irqsave(&q->lock, flags);
+	q->num = rsc->num;
+	q->slot_size = rsc->slot_size;
+	q->notifyid = rsc->notifyid;
+	q->flags = rsc->flags;
+	q->hwlock = hwlock;
+	q->hdr = hdr;
+	spin_unlock_irqrestore(&q->lock, flags);
+
+	dev_dbg(dev, "queue %s: da 0x%x, %u slots of %u bytes, notifyid %u\n",
+			name, rsc->da, rsc->num, rsc->slot_size, rsc->notifyid);
+
+	return 0;
+}
+
+/**
+ * rproc_queue_detach() - unbind the queues of a remote processor
+ * @rproc: the remote processor
+ *
+ * Called as the resources of @rproc are cleaned up: its queues stay
+ * around, but sending on them fails until @rproc is booted again.
+ */
+void rproc_queue_detach(struct rproc *rproc)
+{
+	struct hwspinlock *hwlock;
+	struct rproc_queue *q;
+	unsigned long flags;
+
+	list_for_each_entry(q, &rproc->queues, node) {
+		spin_lock_irqsave(&q->lock, flags);
+		q->hdr = NULL;
+		hwlock = q->hwlock;
+		q->hwlock = NULL;
+		spin_unlock_irqrestore(&q->lock, flags);
+
+		if (hwlock)
+			hwspin_lock_free(hwlock);
+	}
+}
+
+/**
+ * rproc_queue_free() - free the queues of a remote processor
+ * @rproc: the remote processor, which is being released
+ */
+void rproc_queue_free(struct rproc *rproc)
+{
+	struct rproc_queue *q, *tmp;
+
+	list_for_each_entry_safe(q, tmp, &rproc->queues, node) {
+		list_del(&q->node);
+		kfree(q);
+	}
+}
+
+/* hand the messages the remote processor sent on @q to its user */
+static irqreturn_t rproc_queue_drain(struct rproc_queue *q)
+{
+	struct fw_queue_slot *slot;
+	irqreturn_t ret = IRQ_NONE;
+	unsigned long flags;
+	u32 head, tail, len;
+
+	spin_lock_irqsave(&q->lock, flags);
+
+	if (!q->hdr)
+		goto unlock;
+
+	tail = q->hdr->tail;
+	while (tail != (head = ACCESS_ONCE(q->hdr->head))) {
+		/* read the slots only after the index that published them */
+		rmb();
+
+		for (; tail != head; tail++) {
+			slot = rproc_queue_slot(q, tail);
+			len = min_t(u32, slot->len,
+					q->slot_size - sizeof(*slot));
+			if (q->cb)
+				q->cb(q, slot->data, len, q->priv);
+		}
+
+		/* done with the slots before the producer may reuse them */
+		mb();
+		q->hdr->tail = tail;
+		ret = IRQ_HANDLED;
+	}
+
+unlock:
+	spin_unlock_irqrestore(&q->lock, flags);
+	return ret;
+}
+
+/**
+ * rproc_queue_interrupt() - look at the queues a notification is about
+ * @rproc: the remote processor
+ * @notifyid: the notifyid the remote processor signalled, or RPROC_ALL_VQS
+ *
+ * Called from rproc_vq_interrupt() and the likes, possibly in interrupt
+ * context, before the vrings are looked at.
+ *
+ * Returns IRQ_HANDLED if any message was found, and IRQ_NONE otherwise.
+ */
+irqreturn_t rproc_queue_interrupt(struct rproc *rproc, int notifyid)
+{
+	struct rproc_queue *q;
+	irqreturn_t ret = IRQ_NONE;
+
+	rcu_read_lock();
+	list_for_each_entry_rcu(q, &rproc->queues, node) {
+		if (!(q->flags & FW_QUEUE_TO_HOST))
+			continue;
+		if (notifyid != RPROC_ALL_VQS && q->notifyid != notifyid)
+			continue;
+		if (rproc_queue_drain(q) == IRQ_HANDLED)
+			ret = IRQ_HANDLED;
+	}
+	rcu_read_unlock();
+
+	return ret;
+}
+
+/**
+ * rproc_queue_open() - start using a shared-memory queue
+ * @rproc: the remote processor the queue belongs to
+ * @name: the name of the queue, as its resource entry has it
+ * @cb: handles the messages the remote processor sends on the queue (only
+ *	for FW_QUEUE_TO_HOST queues)
+ * @priv: private data of @cb
+ *
+ * The queues of @rproc are only known once it was booted, and must be
+ * closed before it's deleted. @cb is called in atomic (e.g. interrupt)
+ * context, once per message, with @data only valid for the duration of
+ * the call.
+ *
+ * Returns the queue on success, or an ERR_PTR() otherwise.
+ */
+struct rproc_queue *rproc_queue_open(struct rproc *rproc, const char *name,
+					rproc_queue_cb_t cb, void *priv)
+{
+	struct rproc_queue *q;
+	unsigned long flags;
+
+	mutex_lock(&rproc->lock);
+
+	q = rproc_find_queue(rproc, name);
+	if (!q) {
+		q = ERR_PTR(-ENOENT);
+		goto unlock;
+	}
+
+	if (q->open) {
+		q = ERR_PTR(-EBUSY);
+		goto unlock;
+	}
+
+	spin_lock_irqsave(&q->lock, flags);
+	q->cb = cb;
+	q->priv = priv;
+	spin_unlock_irqrestore(&q->lock, flags);
+	q->open = true;
+
+unlock:
+	mutex_unlock(&rproc->lock);
+	return q;
+}
+EXPORT_SYMBOL(rproc_queue_open);
+
+/**
+ * rproc_queue_close() - stop using a shared-memory queue
+ * @q: the queue, as rproc_queue_open() returned it
+ *
+ * Once this returns, the callback of @q isn't running, and won't be
+ * called anymore.
+ */
+void rproc_queue_close(struct rproc_queue *q)
+{
+	struct rproc *rproc = q->rproc;
+	unsigned long flags;
+
+	mutex_lock(&rproc->lock);
+
+	spin_lock_irqsave(&q->lock, flags);
+	q->cb = NULL;
+	q->priv = NULL;
+	spin_unlock_irqrestore(&q->lock, flags);
+	q->open = false;
+
+	mutex_unlock(&rproc->lock);
+}
+EXPORT_SYMBOL(rproc_queue_close);
+
+/**
+ * rproc_queue_send() - send a message on a shared-memory queue
+ * @q: the queue, as rproc_queue_open() returned it
+ * @data: the message
+ * @len: length of @data, in bytes
+ *
+ * The message is copied into the next slot of @q, which is then published
+ * to the remote processor, and kicked with the notifyid of @q. This never
+ * sleeps, so it can be used from any context.
+ *
+ * Returns 0 on success, -EAGAIN if @q is full, -EMSGSIZE if @data doesn't
+ * fit in a slot, -ENODEV if the remote processor is off, or another
+ * appropriate error value otherwise.
+ */
+int rproc_queue_send(struct rproc_queue *q, const void *data, int len)
+{
+	struct fw_queue_slot *slot;
+	unsigned long flags;
+	u32 head, tail;
+	int ret = 0;
+
+	if (q->flags & FW_QUEUE_TO_HOST)
+		return -EINVAL;
+
+	spin_lock_irqsave(&q->lock, flags);
+
+	if (!q->hdr) {
+		ret = -ENODEV;
+		goto unlock;
+	}
+
+	if (len < 0 || len > q->slot_size - sizeof(*slot)) {
+		ret = -EMSGSIZE;
+		goto unlock;
+	}
+
+	if (q->hwlock) {
+		ret = hwspin_lock_timeout(q->hwlock,
+						RPROC_QUEUE_HWLOCK_TIMEOUT);
+		if (ret)
+			goto unlock;
+	}
+
+	head = q->hdr->head;
+	tail = ACCESS_ONCE(q->hdr->tail);
+	if (head - tail >= q->num) {
+		ret = -EAGAIN;
+		goto hwunlock;
+	}
+
+	/* the consumer must be done with the slot before we overwrite it */
+	mb();
+
+	slot = rproc_queue_slot(q, head);
+	slot->len = len;
+	memcpy(slot->data, data, len);
+
+	/* publish the slot only once it's written */
+	wmb();
+	q->hdr->head = head + 1;
+
+hwunlock:
+	if (q->hwlock)
+		hwspin_unlock(q->hwlock);
+unlock:
+	spin_unlock_irqrestore(&q->lock, flags);
+
+	if (!ret)
+		q->rproc->ops->kick(q->rproc, q->notifyid);
+
+	return ret;
+}
+EXPORT_SYMBOL(rproc_queue_send);
@@ -0,0 +1,211 @@
+/*
+ * Remote Processor Framework memory snapshots
+ *
+ * Some remote processors run out of on-chip memories which lose their
+ * contents whenever their power domain goes off, so each time they're
+ * powered up again they'd have to be booted from scratch. A firmware may
+ * declare such memories with struct fw_rsc_snapshot entries: when the
+ * remote processor is shut down cleanly, their contents are then saved to
+ * host memory, and when it's booted again they're restored instead of
+ * loading the firmware segments all over again, much like hibernation.
+ *
+ * This only makes sense when the resources of the remote processor stay
+ * resident across power cycles (see rproc->keep_resources): its carveouts
+ * then keep their contents, too, so the remote processor finds its whole
+ * memory as it left it.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#define pr_fmt(fmt)    "%s: " fmt, __func__
+
+#include <linux/kernel.h>
+#include <linux/remoteproc.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/io.h>
+#include <linux/string.h>
+#include <linux/ktime.h>
+
+#include "remoteproc_internal.h"
+
+/**
+ * struct rproc_snapshot - a memory region of a remote processor to snapshot
+ * @node: list node, in rproc->snapshots
+ * @name: the name of the region, as given by the firmware
+ * @da: device address of the region
+ * @len: size of the region, in bytes
+ * @va: kernel address of the region
+ * @mapped: whether @va was ioremapped for the snapshot (rather than being
+ *	    part of a carveout)
+ * @copy: where the contents of the region are saved to
+ */
+struct rproc_snapshot {
+	struct list_head node;
+	char name[32];
+	u32 da;
+	u32 len;
+	void __iomem *va;
+	bool mapped;
+	void *copy;
+};
+
+/**
+ * rproc_snapshot_attach() - set up a memory region to snapshot
+ * @rproc: the remote processor
+ * @rsc: the snapshot resource entry
+ *
+ * The region is accessed through the carveout it's part of, if any, or at
+ * its physical address otherwise.
+ *
+ * Returns 0 on success, or an appropriate error code otherwise.
+ */
+int rproc_snapshot_attach(struct rproc *rproc, struct fw_rsc_snapshot *rsc)
+{
+	struct device *dev = &rproc->dev;
+	struct rproc_snapshot *snap;
+
+	if (!rproc->keep_resources) {
+		dev_info(dev, "ignoring snapshot of %.*s: not resident\n",
+				(int)sizeof(rsc->name), rsc->name);
+		return 0;
+	}
+
+	if (!rsc->len) {
+		dev_err(dev, "snapshot of %.*s is empty\n",
+				(int)sizeof(rsc->name), rsc->name);
+		return -EINVAL;
+	}
+
+	snap = kzalloc(sizeof(*snap), GFP_KERNEL);
+	if (!snap) {
+		dev_err(dev, "kzalloc snapshot failed\n");
+		return -ENOMEM;
+	}
+
+	snap->va = (void __force __iomem *)rproc_da_to_va(rproc, rsc->da,
+								rsc->len);
+	if (!snap->va) {
+		snap->va = ioremap_nocache(rsc->pa, rsc->len);
+		if (!snap->va) {
+			dev_err(dev, "can't map snapshot pa 0x%x\n", rsc->pa);
+			goto free_snap;
+		}
+		snap->mapped = true;
+	}
+
+	snap->copy = vmalloc(rsc->len);
+	if (!snap->copy) {
+		dev_err(dev, "can't allocate snapshot of %.*s\n",
+				(int)sizeof(rsc->name), rsc->name);
+		goto unmap;
+	}
+
+	snprintf(snap->name, sizeof(snap->name), "%.*s",
+				(int)sizeof(rsc->name), rsc->name);
+	snap->da = rsc->da;
+	snap->len = rsc->len;
+
+	list_add_tail(&snap->node, &rproc->snapshots);
+
+	dev_dbg(dev, "snapshot %s: da 0x%x len 0x%x\n", snap->name, snap->da,
+								snap->len);
+
+	return 0;
+
+unmap:
+	if (snap->mapped)
+		iounmap(snap->va);
+free_snap:
+	kfree(snap);
+	return -ENOMEM;
+}
+
+/**
+ * rproc_snapshot_detach() - forget the memory regions to snapshot
+ * @rproc: the remote processor
+ *
+ * Called as the resources of @rproc are cleaned up; whatever was saved is
+ * lost.
+ */
+void rproc_snapshot_detach(struct rproc *rproc)
+{
+	struct rproc_snapshot *snap, *tmp;
+
+	list_for_each_entry_safe(snap, tmp, &rproc->snapshots, node) {
+		list_del(&snap->node);
+		if (snap->mapped)
+			iounmap(snap->va);
+		vfree(snap->copy);
+		kfree(snap);
+	}
+
+	rproc->snapshot_valid = false;
+}
+
+/**
+ * rproc_snapshot_save() - save the memory regions of a remote processor
+ * @rproc: the remote processor, which was just stopped cleanly
+ *
+ * Must be called with rproc->lock held, before whatever the regions need
+ * is powered off, i.e. before the ->unprepare() handler of @rproc.
+ */
+void rproc_snapshot_save(struct rproc *rproc)
+{
+	struct rproc_snapshot *snap;
+	ktime_t start;
+
+	if (list_empty(&rproc->snapshots))
+		return;
+
+	start = ktime_get();
+
+	list_for_each_entry(snap, &rproc->snapshots, node)
+		memcpy_fromio(snap->copy, snap->va, snap->len);
+
+	rproc->snapshot_valid = true;
+
+	dev_dbg(&rproc->dev, "snapshot saved in %lld usecs\n",
+			ktime_to_us(ktime_sub(ktime_get(), start)));
+}
+
+/**
+ * rproc_snapshot_restore() - restore the memory regions of a remote processor
+ * @rproc: the remote processor, which is about to be started
+ * @table: the resource table in its memory, if any
+ * @image: the firmware image it's booted with
+ *
+ * The resource table in the memory of @rproc is then refreshed from the
+ * one of @image, which has what was set up for this boot (e.g. the
+ * addresses of the vrings).
+ *
+ * Must be called with rproc->lock held, once whatever the regions need is
+ * powered up again, and only if a snapshot was saved (see
+ * rproc->snapshot_valid), which is used up.
+ */
+void rproc_snapshot_restore(struct rproc *rproc, struct resource_table *table,
+						struct rproc_fw_image *image)
+{
+	struct rproc_snapshot *snap;
+	ktime_t start;
+
+	start = ktime_get();
+
+	list_for_each_entry(snap, &rproc->snapshots, node)
+		memcpy_toio(snap->va, snap->copy, snap->len);
+
+	if (table)
+		memcpy(table, image->table, image->tablesz);
+
+	rproc->snapshot_valid = false;
+
+	dev_dbg(&rproc->dev, "snapshot restored in %lld usecs\n",
+			ktime_to_us(ktime_sub(ktime_get(), start)));
+}
@@ -0,0 +1,575 @@
+/*
+ * Remote Processor Framework telemetry
+ *
+ * A remote processor may publish how it's doing in a telemetry page (see
+ * struct fw_rsc_telemetry), which it keeps up to date as it runs: how busy
+ * it is, how much of its heap is free, and how many messages each of its
+ * endpoints is behind on. Host drivers (e.g. the devfreq governor of the
+ * remote processor, see rproc_get_load(), or whoever spreads work over its
+ * endpoints) read it with rproc_get_telemetry() and
+ * rproc_get_ept_backlog(), for the cost of a few cache lines, instead of
+ * asking the remote processor with messages.
+ *
+ * With a RSC_TELEMETRY_TAGS entry (see struct fw_rsc_telemetry_tags), it
+ * may also tell how many cycles it spent on the messages of each sender
+ * tag (i.e. each rproc cgroup, see remoteproc_cgroup.c): these are sampled
+ * periodically, charged to their cgroups, and, while the remote processor
+ * is busy, the senders running ahead of their share are held back until
+ * the others catch up.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#define pr_fmt(fmt)    "%s: " fmt, __func__
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/remoteproc.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/sched.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+#include <linux/math64.h>
+
+#include "remoteproc_internal.h"
+
+/* how many times a read is retried, while it races with the remote's update */
+#define RPROC_TELEMETRY_READ_TRIES	16
+
+/* the most sender tags a telemetry page may account for */
+#define RPROC_TELEMETRY_MAX_TAGS	64
+
+/* how often (in msecs) the consumption of the sender tags is sampled */
+#define RPROC_ACCT_PERIOD_MS		100
+
+/* the senders only compete once the remote processor is that busy (in %) */
+#define RPROC_ACCT_BUSY			90
+
+/* how far (in %) a sender may run ahead of its share before it's held back */
+#define RPROC_ACCT_SLACK		10
+
+/**
+ * struct rproc_acct_tag - how much a sender tag consumed
+ * @tag: the tag
+ * @cycles: the cycles the remote processor last said it spent on @tag
+ * @avg: cycles spent on @tag per sampling period, on (exponential) average
+ * @weight: the weight of the sender of @tag, as of the last sample
+ * @throttled: the sender of @tag is held back (see rproc_acct_admit())
+ */
+struct rproc_acct_tag {
+	u32 tag;
+	u64 cycles;
+	u64 avg;
+	unsigned int weight;
+	bool throttled;
+};
+
+/**
+ * struct rproc_telemetry_page - the telemetry page of a remote processor
+ * @shm: the page, as published in the memory of the remote processor
+ * @max_epts: the number of endpoints the page has room for
+ * @dbg: the 'telemetry' debugfs entry of the rproc
+ * @rproc: the remote processor
+ * @tags: the sender tags the remote processor accounts for, in the page
+ * @max_tags: the number of sender tags the page has room for
+ * @snap: a consistent copy of @tags, as last read
+ * @acct: the consumption of the tags of @snap, in the same order
+ * @next: room for the next @acct, which the next sample fills
+ * @num_acct: the number of entries of @acct
+ * @acct_work: samples @tags, and enforces the shares of their senders
+ *
+ * @snap, @acct and @num_acct are protected by the rproc's telemetry_lock.
+ */
+struct rproc_telemetry_page {
+	struct fw_telemetry *shm;
+	u32 max_epts;
+	struct dentry *dbg;
+	struct rproc *rproc;
+	struct fw_telemetry_tag *tags;
+	u32 max_tags;
+	struct fw_telemetry_tag *snap;
+	struct rproc_acct_tag *acct;
+	struct rproc_acct_tag *next;
+	u32 num_acct;
+	struct delayed_work acct_work;
+};
+
+/* where the senders which are held back wait for their turn */
+static DECLARE_WAIT_QUEUE_HEAD(rproc_acct_wq);
+
+/*
+ * read the page consistently: the remote processor bumps its seq before
+ * and after it updates it. Must be called with the rproc's telemetry_lock
+ * held.
+ */
+static int rproc_telemetry_read(struct rproc_telemetry_page *tp,
+				struct rproc_telemetry *tm, u32 addr,
+				u32 *backlog)
+{
+	struct fw_telemetry *shm = tp->shm;
+	int tries, i;
+	u32 seq, num;
+
+	for (tries = 0; tries < RPROC_TELEMETRY_READ_TRIES; tries++) {
+		seq = ACCESS_ONCE(shm->seq);
+		if (seq & 1)
+			continue;
+
+		/* read the page only after the seq that tells it's stable */
+		rmb();
+
+		num = min(ACCESS_ONCE(shm->num_epts), tp->max_epts);
+		if (tm) {
+			tm->util = shm->util;
+			tm->heap_free = shm->heap_free;
+			tm->heap_size = shm->heap_size;
+			tm->num_epts = num;
+		}
+
+		if (backlog) {
+			for (i = 0; i < num; i++)
+				if (shm->epts[i].addr == addr)
+					break;
+			*backlog = i < num ? shm->epts[i].backlog : 0;
+		}
+
+		/* and make sure it wasn't updated meanwhile */
+		rmb();
+		if (ACCESS_ONCE(shm->seq) == seq)
+			return 0;
+	}
+
+	return -EBUSY;
+}
+
+/**
+ * rproc_get_telemetry() - read the telemetry a remote processor publishes
+ * @rproc: the remote processor
+ * @tm: where to put what it published
+ *
+ * This function can be called from atomic/interrupt context.
+ *
+ * Returns 0 on success, -ENODEV if the firmware of @rproc doesn't publish
+ * any telemetry (see fw_rsc_telemetry), or -EBUSY if the remote processor
+ * kept updating it as it was read.
+ */
+int rproc_get_telemetry(struct rproc *rproc, struct rproc_telemetry *tm)
+{
+	unsigned long flags;
+	int ret = -ENODEV;
+
+	spin_lock_irqsave(&rproc->telemetry_lock, flags);
+	if (rproc->telemetry)
+		ret = rproc_telemetry_read(rproc->telemetry, tm, 0, NULL);
+	spin_unlock_irqrestore(&rproc->telemetry_lock, flags);
+
+	return ret;
+}
+EXPORT_SYMBOL(rproc_get_telemetry);
+
+/**
+ * rproc_get_ept_backlog() - tell how far behind an endpoint of a remote is
+ * @rproc: the remote processor
+ * @addr: the (rpmsg) address of the endpoint
+ * @backlog: where to put the number of messages the endpoint is behind on
+ *
+ * Endpoints the remote processor doesn't publish a backlog for aren't
+ * behind on anything.
+ *
+ * This function can be called from atomic/interrupt context.
+ *
+ * Returns 0 on success, or an error code as rproc_get_telemetry() does.
+ */
+int rproc_get_ept_backlog(struct rproc *rproc, u32 addr, u32 *backlog)
+{
+	unsigned long flags;
+	int ret = -ENODEV;
+
+	spin_lock_irqsave(&rproc->telemetry_lock, flags);
+	if (rproc->telemetry)
+		ret = rproc_telemetry_read(rproc->telemetry, NULL, addr,
+								backlog);
+	spin_unlock_irqrestore(&rproc->telemetry_lock, flags);
+
+	return ret;
+}
+EXPORT_SYMBOL(rproc_get_ept_backlog);
+
+/*
+ * copy the sender tags into @tp->snap, consistently, and return how many
+ * there are. Must be called with the rproc's telemetry_lock held.
+ */
+static int rproc_telemetry_read_tags(struct rproc_telemetry_page *tp,
+								u32 *util)
+{
+	struct fw_telemetry *shm = tp->shm;
+	int tries, i;
+	u32 seq, num;
+
+	for (tries = 0; tries < RPROC_TELEMETRY_READ_TRIES; tries++) {
+		seq = ACCESS_ONCE(shm->seq);
+		if (seq & 1)
+			continue;
+
+		rmb();
+
+		*util = shm->util;
+		num = min(ACCESS_ONCE(shm->num_tags), tp->max_tags);
+		for (i = 0; i < num; i++)
+			tp->snap[i] = tp->tags[i];
+
+		rmb();
+		if (ACCESS_ONCE(shm->seq) == seq)
+			return num;
+	}
+
+	return -EBUSY;
+}
+
+static struct rproc_acct_tag *rproc_acct_find(struct rproc_telemetry_page *tp,
+								u32 tag)
+{
+	int i;
+
+	for (i = 0; i < tp->num_acct; i++)
+		if (tp->acct[i].tag == tag)
+			return &tp->acct[i];
+
+	return NULL;
+}
+
+/*
+ * Charge what the remote processor spent on each tag since the last sample
+ * to its sender, and, if the remote processor is busy, hold back those
+ * senders whose average consumption is over their share (their weight's
+ * part of the total of the senders which consumed anything). Tells whether
+ * any sender was let go.
+ *
+ * Must be called with the rproc's telemetry_lock held.
+ */
+static bool rproc_acct_update(struct rproc_telemetry_page *tp, int num,
+								u32 util)
+{
+	bool busy = util * 100 >= FW_TELEMETRY_UTIL_SCALE * RPROC_ACCT_BUSY;
+	struct rproc_acct_tag *new, *old;
+	u64 delta, total = 0, share;
+	unsigned int wsum = 0;
+	int i, active = 0;
+	bool released = false;
+
+	for (i = 0; i < num; i++) {
+		new = &tp->next[i];
+		old = rproc_acct_find(tp, tp->snap[i].tag);
+
+		new->tag = tp->snap[i].tag;
+		new->cycles = tp->snap[i].cycles;
+		new->avg = old ? old->avg : 0;
+		new->throttled = old ? old->throttled : false;
+		new->weight = rproc_cgroup_weight(new->tag);
+
+		/* the remote processor may have started over with the tag */
+		delta = new->cycles;
+		if (old && new->cycles >= old->cycles)
+			delta -= old->cycles;
+
+		rproc_cgroup_charge(new->tag, delta);
+		new->avg = (new->avg * 3 + delta) / 4;
+
+		if (new->avg) {
+			total += new->avg;
+			wsum += new->weight;
+			active++;
+		}
+	}
+
+	for (i = 0; i < num; i++) {
+		new = &tp->next[i];
+		old = rproc_acct_find(tp, new->tag);
+		if (old)
+			old->throttled = false;
+
+		if (!busy || active < 2 || !new->avg) {
+			released |= new->throttled;
+			new->throttled = false;
+			continue;
+		}
+
+		share = div64_u64(total * new->weight, wsum);
+		if (new->avg * 100 > share * (100 + RPROC_ACCT_SLACK)) {
+			new->throttled = true;
+		} else {
+			released |= new->throttled;
+			new->throttled = false;
+		}
+	}
+
+	/* the tags the remote processor forgot about are let go, too */
+	for (i = 0; i < tp->num_acct; i++)
+		released |= tp->acct[i].throttled;
+
+	swap(tp->acct, tp->next);
+	tp->num_acct = num;
+
+	return released;
+}
+
+static void rproc_acct_work(struct work_struct *work)
+{
+	struct rproc_telemetry_page *tp = container_of(to_delayed_work(work),
+				struct rproc_telemetry_page, acct_work);
+	struct rproc *rproc = tp->rproc;
+	bool released = false;
+	u32 util;
+	int num;
+
+	spin_lock_irq(&rproc->telemetry_lock);
+	num = rproc_telemetry_read_tags(tp, &util);
+	if (num >= 0)
+		released = rproc_acct_update(tp, num, util);
+	spin_unlock_irq(&rproc->telemetry_lock);
+
+	if (released)
+		wake_up_all(&rproc_acct_wq);
+
+	schedule_delayed_work(&tp->acct_work,
+				msecs_to_jiffies(RPROC_ACCT_PERIOD_MS));
+}
+
+static bool rproc_acct_throttled(struct rproc *rproc, u16 tag)
+{
+	struct rproc_acct_tag *acct;
+	unsigned long flags;
+	bool ret = false;
+
+	spin_lock_irqsave(&rproc->telemetry_lock, flags);
+	if (rproc->telemetry) {
+		acct = rproc_acct_find(rproc->telemetry, tag);
+		ret = acct && acct->throttled;
+	}
+	spin_unlock_irqrestore(&rproc->telemetry_lock, flags);
+
+	return ret;
+}
+
+/**
+ * rproc_acct_admit() - wait for a sender's turn to use a remote processor
+ * @rproc: the remote processor
+ * @tag: the tag of the sender (see rproc_cgroup_tag())
+ * @timeout: how long to wait, in jiffies (0 not to wait)
+ *
+ * A sender which consumed more than its share of @rproc, while @rproc is
+ * busy, is held back until its average consumption falls back to its
+ * share, or the others stop competing (which is re-evaluated every
+ * RPROC_ACCT_PERIOD_MS). The untagged senders (tag 0) never wait.
+ *
+ * Returns 0 if the sender may go on, -EAGAIN if it may not and @timeout is
+ * zero, -ETIMEDOUT if @timeout elapsed, or -ERESTARTSYS if a signal
+ * arrived.
+ */
+int rproc_acct_admit(struct rproc *rproc, u16 tag, long timeout)
+{
+	long ret;
+
+	if (!tag || !rproc_acct_throttled(rproc, tag))
+		return 0;
+
+	if (!timeout)
+		return -EAGAIN;
+
+	ret = wait_event_interruptible_timeout(rproc_acct_wq,
+				!rproc_acct_throttled(rproc, tag), timeout);
+	if (ret < 0)
+		return ret;
+
+	return ret ? 0 : -ETIMEDOUT;
+}
+EXPORT_SYMBOL(rproc_acct_admit);
+
+static int rproc_telemetry_show(struct seq_file *s, void *data)
+{
+	struct rproc *rproc = s->private;
+	struct rproc_telemetry_page *tp;
+	struct fw_telemetry_ept epts[16];
+	struct rproc_acct_tag acct[16];
+	struct rproc_telemetry tm;
+	unsigned long flags;
+	int i, num, ret;
+
+	spin_lock_irqsave(&rproc->telemetry_lock, flags);
+	tp = rproc->telemetry;
+	ret = tp ? rproc_telemetry_read(tp, &tm, 0, NULL) : -ENODEV;
+	num = ret ? 0 : min_t(int, tm.num_epts, ARRAY_SIZE(epts));
+	for (i = 0; i < num; i++)
+		epts[i] = tp->shm->epts[i];
+	spin_unlock_irqrestore(&rproc->telemetry_lock, flags);
+
+	if (ret)
+		return ret;
+
+	seq_printf(s, "util: %u/%u\n", tm.util, FW_TELEMETRY_UTIL_SCALE);
+	seq_printf(s, "heap_free: %u\n", tm.heap_free);
+	seq_printf(s, "heap_size: %u\n", tm.heap_size);
+	seq_printf(s, "endpoints: %u\n", tm.num_epts);
+	for (i = 0; i < num; i++)
+		seq_printf(s, "  addr %u backlog %u\n", epts[i].addr,
+							epts[i].backlog);
+
+	/* what the last sample found, which is all senders are held to */
+	spin_lock_irqsave(&rproc->telemetry_lock, flags);
+	tp = rproc->telemetry;
+	num = tp ? min_t(int, tp->num_acct, ARRAY_SIZE(acct)) : 0;
+	if (num)
+		memcpy(acct, tp->acct, num * sizeof(acct[0]));
+	spin_unlock_irqrestore(&rproc->telemetry_lock, flags);
+
+	if (num)
+		seq_printf(s, "tags: %d\n", num);
+	for (i = 0; i < num; i++)
+		seq_printf(s, "  tag %u cycles %llu avg %llu weight %u%s\n",
+				acct[i].tag, acct[i].cycles, acct[i].avg,
+				acct[i].weight,
+				acct[i].throttled ? " throttled" : "");
+
+	return 0;
+}
+
+static int rproc_telemetry_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, rproc_telemetry_show, inode->i_private);
+}
+
+static const struct file_operations rproc_telemetry_ops = {
+	.open = rproc_telemetry_open,
+	.read = seq_read,
+	.llseek	= seq_lseek,
+	.release = single_release,
+};
+
+static void rproc_telemetry_free(struct rproc_telemetry_page *tp)
+{
+	kfree(tp->snap);
+	kfree(tp->acct);
+	kfree(tp->next);
+	kfree(tp);
+}
+
+/**
+ * rproc_telemetry_attach() - handle a telemetry page resource
+ * @rproc: the remote processor, which is about to be booted
+ * @da: device address of the page
+ * @num_epts: the number of endpoints the page has room for
+ * @num_tags: the number of sender tags the page has room for (0 for a
+ *	      plain RSC_TELEMETRY entry)
+ *
+ * The page is cleared, so it tells nothing until the remote processor
+ * starts publishing.
+ *
+ * Returns 0 on success, or an appropriate error code otherwise.
+ */
+int rproc_telemetry_attach(struct rproc *rproc, u32 da, u32 num_epts,
+							u32 num_tags)
+{
+	struct device *dev = &rproc->dev;
+	struct rproc_telemetry_page *tp;
+	size_t len;
+
+	if (rproc->telemetry) {
+		dev_err(dev, "only one telemetry rsc is supported\n");
+		return -EINVAL;
+	}
+
+	if (num_epts > (INT_MAX - sizeof(*tp->shm) -
+			RPROC_TELEMETRY_MAX_TAGS *
+			sizeof(struct fw_telemetry_tag)) /
+					sizeof(struct fw_telemetry_ept) ||
+			num_tags > RPROC_TELEMETRY_MAX_TAGS) {
+		dev_err(dev, "bad telemetry rsc: %u endpoints, %u tags\n",
+						num_epts, num_tags);
+		return -EINVAL;
+	}
+
+	tp = kzalloc(sizeof(*tp), GFP_KERNEL);
+	if (!tp)
+		return -ENOMEM;
+
+	len = sizeof(*tp->shm) + num_epts * sizeof(tp->shm->epts[0]) +
+			num_tags * sizeof(struct fw_telemetry_tag);
+	tp->shm = rproc_da_to_va(rproc, da, len);
+	if (!tp->shm) {
+		dev_err(dev, "erroneous telemetry resource entry\n");
+		kfree(tp);
+		return -EINVAL;
+	}
+
+	tp->rproc = rproc;
+	tp->max_epts = num_epts;
+	tp->max_tags = num_tags;
+	tp->tags = (void *)&tp->shm->epts[num_epts];
+	INIT_DELAYED_WORK(&tp->acct_work, rproc_acct_work);
+
+	if (tp->max_tags) {
+		tp->snap = kcalloc(tp->max_tags, sizeof(*tp->snap),
+								GFP_KERNEL);
+		tp->acct = kcalloc(tp->max_tags, sizeof(*tp->acct),
+								GFP_KERNEL);
+		tp->next = kcalloc(tp->max_tags, sizeof(*tp->next),
+								GFP_KERNEL);
+		if (!tp->snap || !tp->acct || !tp->next) {
+			rproc_telemetry_free(tp);
+			return -ENOMEM;
+		}
+	}
+
+	memset(tp->shm, 0, len);
+
+	spin_lock_irq(&rproc->telemetry_lock);
+	rproc->telemetry = tp;
+	spin_unlock_irq(&rproc->telemetry_lock);
+
+	if (rproc->dbg_dir)
+		tp->dbg = debugfs_create_file("telemetry", 0400,
+				rproc->dbg_dir, rproc, &rproc_telemetry_ops);
+
+	if (tp->max_tags)
+		schedule_delayed_work(&tp->acct_work,
+				msecs_to_jiffies(RPROC_ACCT_PERIOD_MS));
+
+	dev_dbg(dev, "telemetry rsc: da 0x%x, %u endpoints, %u tags\n",
+				da, num_epts, num_tags);
+
+	return 0;
+}
+
+/**
+ * rproc_telemetry_detach() - forget about the telemetry page
+ * @rproc: the remote processor, whose resources are being released
+ */
+void rproc_telemetry_detach(struct rproc *rproc)
+{
+	struct rproc_telemetry_page *tp = rproc->telemetry;
+
+	if (!tp)
+		return;
+
+	cancel_delayed_work_sync(&tp->acct_work);
+	debugfs_remove(tp->dbg);
+
+	spin_lock_irq(&rproc->telemetry_lock);
+	rproc->telemetry = NULL;
+	spin_unlock_irq(&rproc->telemetry_lock);
+
+	/* whoever was held back doesn't have to wait anymore */
+	wake_up_all(&rproc_acct_wq);
+
+	rproc_telemetry_free(tp);
+}
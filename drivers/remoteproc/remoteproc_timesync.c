@@ -0,0 +1,382 @@
+/*
+ * Remote Processor Framework clock synchronization
+ *
+ * A remote processor may ask the host to keep an estimate of the host's
+ * clock, in terms of its own, in its memory (see struct fw_rsc_timesync):
+ * the host periodically samples both clocks together, and publishes the
+ * latest sample along with the measured rate of the host's clock against
+ * the remote processor's. Both sides then tell the other's time, and
+ * schedule deadline-driven work, without any message round trip.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#define pr_fmt(fmt)    "%s: " fmt, __func__
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/remoteproc.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+#include <linux/math64.h>
+
+#include "remoteproc_internal.h"
+
+/* default, and shortest, refresh period of an estimate, in msecs */
+#define RPROC_TIMESYNC_PERIOD_MS	1000
+#define RPROC_TIMESYNC_MIN_PERIOD_MS	10
+
+/* the measured rate is averaged over this many samples (a power of two) */
+#define RPROC_TIMESYNC_WEIGHT		8
+
+/*
+ * samples whose rate is off the nominal one by more than 2^-10 (~1000 ppm)
+ * are glitches (e.g. the host was preempted between reading both clocks)
+ */
+#define RPROC_TIMESYNC_MAX_DRIFT_SHIFT	10
+
+/**
+ * struct rproc_timesync - the clock synchronization of a remote processor
+ * @rproc: the remote processor
+ * @shm: the estimate, as published in the memory of the remote processor
+ * @work: samples both clocks, and refreshes @shm, every @period
+ * @period: refresh period of the estimate, in jiffies
+ * @remote: the remote processor's clock, at the last sample
+ * @host: the host's clock (in nsecs), at the last sample
+ * @mult: how many nsecs the host's clock advances by per tick of the
+ *	  remote processor's, times 2^@shift, as measured
+ * @nominal_mult: @mult, as trace_clock_rate says it should be
+ * @shift: see @mult
+ * @samples: number of samples taken, glitches excluded
+ * @glitches: number of samples that were dropped
+ * @dbg: the 'timesync' debugfs entry
+ *
+ * @remote, @host and @mult are protected by the rproc's timesync_lock.
+ */
+struct rproc_timesync {
+	struct rproc *rproc;
+	struct fw_timesync *shm;
+	struct delayed_work work;
+	unsigned long period;
+	u64 remote;
+	u64 host;
+	u32 mult;
+	u32 nominal_mult;
+	u32 shift;
+	unsigned long samples;
+	unsigned long glitches;
+	struct dentry *dbg;
+};
+
+/* sample the remote processor's clock, and the host's, together */
+static void rproc_timesync_sample(struct rproc *rproc, u64 *remote, u64 *host)
+{
+	unsigned long flags;
+
+	local_irq_save(flags);
+	*remote = rproc->ops->trace_clock(rproc);
+	*host = ktime_to_ns(ktime_get());
+	local_irq_restore(flags);
+}
+
+/* publish the estimate to the remote processor, seqcount-style */
+static void rproc_timesync_publish(struct rproc_timesync *ts)
+{
+	struct fw_timesync *shm = ts->shm;
+
+	ACCESS_ONCE(shm->seq) = shm->seq + 1;
+	wmb();
+
+	shm->shift = ts->shift;
+	shm->remote = ts->remote;
+	shm->host_ns = ts->host;
+	shm->mult = ts->mult;
+
+	wmb();
+	ACCESS_ONCE(shm->seq) = shm->seq + 1;
+}
+
+/* take a new sample, fold it into the estimate, and publish it */
+static void rproc_timesync_work(struct work_struct *work)
+{
+	struct rproc_timesync *ts = container_of(to_delayed_work(work),
+					struct rproc_timesync, work);
+	struct rproc *rproc = ts->rproc;
+	u64 remote, host, mult;
+	unsigned long flags;
+
+	rproc_timesync_sample(rproc, &remote, &host);
+
+	spin_lock_irqsave(&rproc->timesync_lock, flags);
+
+	/* how fast did the host's clock go, against the remote's ? */
+	if (remote <= ts->remote || host <= ts->host ||
+			host - ts->host >= 1ULL << (63 - ts->shift)) {
+		ts->glitches++;
+		goto publish;
+	}
+
+	mult = div64_u64((host - ts->host) << ts->shift, remote - ts->remote);
+	if (abs64((s64)mult - ts->nominal_mult) >
+			ts->nominal_mult >> RPROC_TIMESYNC_MAX_DRIFT_SHIFT) {
+		ts->glitches++;
+		goto publish;
+	}
+
+	ts->mult = div_u64((u64)ts->mult * (RPROC_TIMESYNC_WEIGHT - 1) + mult,
+						RPROC_TIMESYNC_WEIGHT);
+	ts->samples++;
+
+publish:
+	/* the estimate starts over from the latest sample */
+	ts->remote = remote;
+	ts->host = host;
+	rproc_timesync_publish(ts);
+
+	spin_unlock_irqrestore(&rproc->timesync_lock, flags);
+
+	schedule_delayed_work(&ts->work, ts->period);
+}
+
+/* the largest shift that leaves room for 1000 ppm of drift in mult */
+static void rproc_timesync_calc_mult(struct rproc_timesync *ts, u32 rate)
+{
+	u64 mult;
+
+	for (ts->shift = 32; ts->shift > 0; ts->shift--) {
+		mult = div_u64((u64)NSEC_PER_SEC << ts->shift, rate);
+		if (mult < 1ULL << 31)
+			break;
+	}
+
+	ts->nominal_mult = ts->mult = mult;
+}
+
+static int rproc_timesync_show(struct seq_file *s, void *data)
+{
+	struct rproc_timesync *ts = s->private;
+	struct rproc *rproc = ts->rproc;
+	unsigned long flags;
+	u32 mult;
+
+	spin_lock_irqsave(&rproc->timesync_lock, flags);
+	mult = ts->mult;
+	spin_unlock_irqrestore(&rproc->timesync_lock, flags);
+
+	seq_printf(s, "period_ms: %u\n", jiffies_to_msecs(ts->period));
+	seq_printf(s, "nominal_rate: %u\n", rproc->trace_clock_rate);
+	seq_printf(s, "mult: %u\n", mult);
+	seq_printf(s, "shift: %u\n", ts->shift);
+	/* a host's clock going slower than nominal means a fast remote one */
+	seq_printf(s, "drift_ppb: %lld\n",
+		div_s64(((s64)ts->nominal_mult - mult) * NSEC_PER_SEC,
+							ts->nominal_mult));
+	seq_printf(s, "samples: %lu\n", ts->samples);
+	seq_printf(s, "glitches: %lu\n", ts->glitches);
+
+	return 0;
+}
+
+static int rproc_timesync_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, rproc_timesync_show, inode->i_private);
+}
+
+static const struct file_operations rproc_timesync_ops = {
+	.open = rproc_timesync_open,
+	.read = seq_read,
+	.llseek	= seq_lseek,
+	.release = single_release,
+};
+
+/**
+ * rproc_timesync_attach() - start the clock synchronization of an rproc
+ * @rproc: the remote processor, which is about to be booted
+ * @rsc: the timesync resource entry
+ *
+ * Publishes a first estimate (with the nominal rate of the clocks) right
+ * away, so it's valid by the time the remote processor starts.
+ *
+ * Returns 0 on success (including when @rproc can't be synchronized with,
+ * in which case the entry is ignored), or an appropriate error otherwise.
+ */
+int rproc_timesync_attach(struct rproc *rproc, struct fw_rsc_timesync *rsc)
+{
+	struct device *dev = &rproc->dev;
+	struct rproc_timesync *ts;
+	u32 period_ms;
+
+	if (!rproc->ops->trace_clock || !rproc->trace_clock_rate) {
+		dev_warn(dev, "no shared clock to synchronize, ignoring\n");
+		return 0;
+	}
+
+	if (rproc->timesync) {
+		dev_err(dev, "only one timesync rsc is supported\n");
+		return -EINVAL;
+	}
+
+	ts = kzalloc(sizeof(*ts), GFP_KERNEL);
+	if (!ts)
+		return -ENOMEM;
+
+	ts->shm = rproc_da_to_va(rproc, rsc->da, sizeof(*ts->shm));
+	if (!ts->shm) {
+		dev_err(dev, "erroneous timesync resource entry\n");
+		kfree(ts);
+		return -EINVAL;
+	}
+
+	period_ms = rsc->period_ms ? : RPROC_TIMESYNC_PERIOD_MS;
+	period_ms = max_t(u32, period_ms, RPROC_TIMESYNC_MIN_PERIOD_MS);
+
+	ts->rproc = rproc;
+	ts->period = msecs_to_jiffies(period_ms);
+	INIT_DELAYED_WORK(&ts->work, rproc_timesync_work);
+	rproc_timesync_calc_mult(ts, rproc->trace_clock_rate);
+
+	memset(ts->shm, 0, sizeof(*ts->shm));
+	rproc_timesync_sample(rproc, &ts->remote, &ts->host);
+	rproc_timesync_publish(ts);
+
+	spin_lock_irq(&rproc->timesync_lock);
+	rproc->timesync = ts;
+	spin_unlock_irq(&rproc->timesync_lock);
+
+	if (rproc->dbg_dir)
+		ts->dbg = debugfs_create_file("timesync", 0400, rproc->dbg_dir,
+						ts, &rproc_timesync_ops);
+
+	schedule_delayed_work(&ts->work, ts->period);
+
+	dev_dbg(dev, "timesync rsc: da 0x%x, every %u msecs\n", rsc->da,
+								period_ms);
+
+	return 0;
+}
+
+/**
+ * rproc_timesync_detach() - stop the clock synchronization of an rproc
+ * @rproc: the remote processor, whose resources are being released
+ */
+void rproc_timesync_detach(struct rproc *rproc)
+{
+	struct rproc_timesync *ts = rproc->timesync;
+
+	if (!ts)
+		return;
+
+	cancel_delayed_work_sync(&ts->work);
+	debugfs_remove(ts->dbg);
+
+	spin_lock_irq(&rproc->timesync_lock);
+	rproc->timesync = NULL;
+	spin_unlock_irq(&rproc->timesync_lock);
+
+	kfree(ts);
+}
+
+/**
+ * rproc_timesync_to_remote() - tell when an instant is, for a remote processor
+ * @rproc: the remote processor
+ * @host: the instant, in the host's CLOCK_MONOTONIC time
+ * @ticks: where to store the value the remote processor's clock has then
+ *
+ * This lets host drivers schedule work on the remote processor at @host
+ * (e.g. the deadline of an audio period), in terms of its own clock, with
+ * the estimate the remote processor asked for (see fw_rsc_timesync).
+ *
+ * This function can be called from atomic/interrupt context.
+ *
+ * Returns 0 on success, -ENODEV if @rproc isn't synchronized with, or
+ * -ERANGE if @host is too far away from the estimate.
+ */
+int rproc_timesync_to_remote(struct rproc *rproc, ktime_t host, u64 *ticks)
+{
+	struct rproc_timesync *ts;
+	unsigned long flags;
+	s64 delta;
+	int ret = 0;
+
+	spin_lock_irqsave(&rproc->timesync_lock, flags);
+
+	ts = rproc->timesync;
+	if (!ts) {
+		ret = -ENODEV;
+		goto unlock;
+	}
+
+	delta = ktime_to_ns(host) - ts->host;
+	if (abs64(delta) >= 1LL << (63 - ts->shift)) {
+		ret = -ERANGE;
+		goto unlock;
+	}
+
+	if (delta >= 0)
+		*ticks = ts->remote + div_u64((u64)delta << ts->shift,
+								ts->mult);
+	else
+		*ticks = ts->remote - div_u64((u64)-delta << ts->shift,
+								ts->mult);
+
+unlock:
+	spin_unlock_irqrestore(&rproc->timesync_lock, flags);
+	return ret;
+}
+EXPORT_SYMBOL(rproc_timesync_to_remote);
+
+/**
+ * rproc_timesync_to_host() - tell when an instant of a remote processor is
+ * @rproc: the remote processor
+ * @ticks: the instant, as the remote processor's clock reads it
+ * @host: where to store the host's CLOCK_MONOTONIC time at @ticks
+ *
+ * This is the reverse of rproc_timesync_to_remote(), e.g. for host drivers
+ * whose remote side stamps its messages.
+ *
+ * This function can be called from atomic/interrupt context.
+ *
+ * Returns 0 on success, -ENODEV if @rproc isn't synchronized with, or
+ * -ERANGE if @ticks is too far away from the estimate.
+ */
+int rproc_timesync_to_host(struct rproc *rproc, u64 ticks, ktime_t *host)
+{
+	struct rproc_timesync *ts;
+	unsigned long flags;
+	s64 delta;
+	u64 ns;
+	int ret = 0;
+
+	spin_lock_irqsave(&rproc->timesync_lock, flags);
+
+	ts = rproc->timesync;
+	if (!ts) {
+		ret = -ENODEV;
+		goto unlock;
+	}
+
+	/* the product with mult (< 2^32) must fit in 64 bits */
+	delta = ticks - ts->remote;
+	if (abs64(delta) > UINT_MAX) {
+		ret = -ERANGE;
+		goto unlock;
+	}
+
+	ns = ((u64)abs64(delta) * ts->mult) >> ts->shift;
+	*host = ns_to_ktime(delta >= 0 ? ts->host + ns : ts->host - ns);
+
+unlock:
+	spin_unlock_irqrestore(&rproc->timesync_lock, flags);
+	return ret;
+}
+EXPORT_SYMBOL(rproc_timesync_to_host);
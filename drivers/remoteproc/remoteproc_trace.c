@@ -0,0 +1,317 @@
+/*
+ * Remote Processor Framework trace events
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#define pr_fmt(fmt)    "%s: " fmt, __func__
+
+#include <linux/kernel.h>
+#include <linux/export.h>
+#include <linux/remoteproc.h>
+#include <linux/slab.h>
+#include <linux/mutex.h>
+#include <linux/workqueue.h>
+#include <linux/sched.h>
+#include <linux/math64.h>
+
+#include "remoteproc_internal.h"
+
+#define CREATE_TRACE_POINTS
+#include <trace/events/remoteproc.h>
+
+/* how often (in msecs) the stamped trace rings are pulled, while traced */
+#define RPROC_TRACE_PULL_MS	10
+
+/* longest line that is logged as a single event; longer ones are split */
+#define RPROC_TRACE_LINE_MAX	256
+
+/**
+ * struct rproc_trace_pull - a stamped trace ring, as it's pulled into ftrace
+ * @node: node in rproc_trace_pulls
+ * @rproc: the remote processor which writes to the ring
+ * @trace: the trace buffer, which is a stamped ring
+ * @index: index of the trace buffer (as in its "traceN" debugfs entry)
+ * @pos: how far the pull got in the ring
+ * @len: length of the line being pulled, which isn't complete yet
+ * @line: the line being pulled
+ */
+struct rproc_trace_pull {
+	struct list_head node;
+	struct rproc *rproc;
+	struct rproc_mem_entry *trace;
+	int index;
+	u32 pos;
+	unsigned int len;
+	char line[RPROC_TRACE_LINE_MAX];
+};
+
+/**
+ * struct rproc_trace_sync - the trace clocks, sampled at the same time
+ * @remote: the remote processor's trace clock, in ticks
+ * @host: the host's local trace clock, in nsecs (i.e. sched_clock(), which is
+ *	  what ftrace's "local" clock reads)
+ */
+struct rproc_trace_sync {
+	u64 remote;
+	u64 host;
+};
+
+/* the stamped trace rings, and whether they're pulled (i.e. traced) */
+static LIST_HEAD(rproc_trace_pulls);
+static DEFINE_MUTEX(rproc_trace_pulls_lock);
+static bool rproc_trace_pulling;
+static char rproc_trace_buf[PAGE_SIZE];
+
+static void rproc_trace_pull_work(struct work_struct *work);
+static DECLARE_DELAYED_WORK(rproc_trace_pull_dwork, rproc_trace_pull_work);
+
+/* sample the remote processor's trace clock, and the host's, together */
+static void rproc_trace_sync_clocks(struct rproc *rproc,
+					struct rproc_trace_sync *sync)
+{
+	unsigned long flags;
+
+	local_irq_save(flags);
+	sync->remote = rproc->ops->trace_clock ?
+				rproc->ops->trace_clock(rproc) : 0;
+	sync->host = sched_clock();
+	local_irq_restore(flags);
+}
+
+/*
+ * convert a timestamp of the remote processor to the host's trace clock,
+ * using a sample of both clocks that was taken after it. Without a trace
+ * clock, lines are deemed to be written when they're pulled.
+ */
+static u64 rproc_trace_host_ns(struct rproc *rproc,
+				struct rproc_trace_sync *sync, u64 ts)
+{
+	u32 rate = rproc->trace_clock_rate;
+	u64 delta, secs;
+	u32 rem;
+
+	if (!rproc->ops->trace_clock || !rate || ts >= sync->remote)
+		return sync->host;
+
+	secs = div_u64_rem(sync->remote - ts, rate, &rem);
+	delta = secs * NSEC_PER_SEC + div_u64((u64)rem * NSEC_PER_SEC, rate);
+
+	return sync->host > delta ? sync->host - delta : 0;
+}
+
+/**
+ * rproc_trace_clock_to_host() - convert a timestamp of a remote processor
+ * @rproc: the remote processor
+ * @ts: a past instant, in ticks of its trace clock (see rproc_ops)
+ *
+ * This lets e.g. rpmsg drivers whose remote side stamps its messages tell
+ * when that was on the host's side.
+ *
+ * Returns when @ts was, in nsecs of the host's local trace clock (i.e.
+ * sched_clock()), or 0 if @rproc has no trace clock.
+ */
+u64 rproc_trace_clock_to_host(struct rproc *rproc, u64 ts)
+{
+	struct rproc_trace_sync sync;
+
+	if (!rproc->ops->trace_clock || !rproc->trace_clock_rate)
+		return 0;
+
+	rproc_trace_sync_clocks(rproc, &sync);
+
+	return rproc_trace_host_ns(rproc, &sync, ts);
+}
+EXPORT_SYMBOL(rproc_trace_clock_to_host);
+
+/* log a line, with the timestamp it starts with, if it's stamped */
+static void rproc_trace_emit(struct rproc_trace_pull *pull,
+				struct rproc_trace_sync *sync)
+{
+	char *msg = pull->line, *end;
+	unsigned int len = pull->len;
+	u64 ts = 0;
+
+	/* "[<hex ticks>] ", at most 16 digits */
+	end = len > 2 && msg[0] == '[' ? memchr(msg, ']', min(len, 18U)) : NULL;
+	if (end) {
+		*end = '\0';
+		if (!kstrtoull(msg + 1, 16, &ts)) {
+			len -= end + 1 - msg;
+			msg = end + 1;
+			if (len && *msg == ' ') {
+				msg++;
+				len--;
+			}
+		} else {
+			*end = ']';
+		}
+	}
+
+	trace_rproc_trace(&pull->rproc->dev, pull->index, ts,
+			rproc_trace_host_ns(pull->rproc, sync, ts), msg, len);
+
+	pull->len = 0;
+}
+
+/* log the lines that were written to a stamped trace ring, so far */
+static void rproc_trace_pull_ring(struct rproc_trace_pull *pull)
+{
+	struct rproc_trace_sync sync;
+	u32 len, i, budget = pull->trace->len;
+	char c;
+
+	while (budget) {
+		len = rproc_trace_ring_copy(pull->trace, &pull->pos,
+				rproc_trace_buf, min_t(u32, budget, PAGE_SIZE));
+		if (!len)
+			break;
+
+		/* the lines we just copied were stamped before this */
+		rproc_trace_sync_clocks(pull->rproc, &sync);
+
+		for (i = 0; i < len; i++) {
+			c = rproc_trace_buf[i];
+			if (c == '\n') {
+				rproc_trace_emit(pull, &sync);
+				continue;
+			}
+
+			if (c == '\0' || c == '\r')
+				continue;
+
+			pull->line[pull->len++] = c;
+			if (pull->len == RPROC_TRACE_LINE_MAX)
+				rproc_trace_emit(pull, &sync);
+		}
+
+		budget -= len;
+	}
+}
+
+/* start pulling a trace ring from what's written to it from now on */
+static void rproc_trace_pull_start(struct rproc_trace_pull *pull)
+{
+	u32 head, tail, size;
+
+	if (!rproc_trace_ring_span(pull->trace, &head, &tail, &size))
+		head = 0;
+
+	pull->pos = head;
+	pull->len = 0;
+}
+
+static void rproc_trace_pull_work(struct work_struct *work)
+{
+	struct rproc_trace_pull *pull;
+
+	mutex_lock(&rproc_trace_pulls_lock);
+
+	if (!rproc_trace_pulling)
+		goto out;
+
+	list_for_each_entry(pull, &rproc_trace_pulls, node)
+		rproc_trace_pull_ring(pull);
+
+	schedule_delayed_work(&rproc_trace_pull_dwork,
+				msecs_to_jiffies(RPROC_TRACE_PULL_MS));
+
+out:
+	mutex_unlock(&rproc_trace_pulls_lock);
+}
+
+/* the rproc_trace event was enabled: start pulling the stamped rings */
+void rproc_trace_pull_reg(void)
+{
+	struct rproc_trace_pull *pull;
+
+	mutex_lock(&rproc_trace_pulls_lock);
+
+	rproc_trace_pulling = true;
+	list_for_each_entry(pull, &rproc_trace_pulls, node)
+		rproc_trace_pull_start(pull);
+
+	schedule_delayed_work(&rproc_trace_pull_dwork, 0);
+
+	mutex_unlock(&rproc_trace_pulls_lock);
+}
+
+/* the rproc_trace event was disabled: stop pulling */
+void rproc_trace_pull_unreg(void)
+{
+	mutex_lock(&rproc_trace_pulls_lock);
+	rproc_trace_pulling = false;
+	mutex_unlock(&rproc_trace_pulls_lock);
+
+	cancel_delayed_work_sync(&rproc_trace_pull_dwork);
+}
+
+/**
+ * rproc_trace_pull_add() - have a stamped trace ring pulled into ftrace
+ * @rproc: the remote processor which writes to the ring
+ * @trace: the trace buffer, which is a stamped ring
+ * @index: index of the trace buffer
+ *
+ * The lines the remote processor writes to @trace are then logged as
+ * rproc_trace events, whenever those are enabled, until
+ * rproc_trace_pull_del() is called.
+ *
+ * Returns 0 on success, or an appropriate error value otherwise.
+ */
+int rproc_trace_pull_add(struct rproc *rproc, struct rproc_mem_entry *trace,
+								int index)
+{
+	struct rproc_trace_pull *pull;
+
+	pull = kzalloc(sizeof(*pull), GFP_KERNEL);
+	if (!pull) {
+		dev_err(&rproc->dev, "kzalloc pull failed\n");
+		return -ENOMEM;
+	}
+
+	pull->rproc = rproc;
+	pull->trace = trace;
+	pull->index = index;
+
+	mutex_lock(&rproc_trace_pulls_lock);
+
+	if (rproc_trace_pulling)
+		rproc_trace_pull_start(pull);
+
+	list_add_tail(&pull->node, &rproc_trace_pulls);
+
+	mutex_unlock(&rproc_trace_pulls_lock);
+
+	return 0;
+}
+
+/**
+ * rproc_trace_pull_del() - stop pulling a trace ring into ftrace
+ * @trace: the trace buffer
+ *
+ * Once this returns, @trace isn't looked at anymore, and can be freed.
+ * Nothing is done if @trace wasn't pulled.
+ */
+void rproc_trace_pull_del(struct rproc_mem_entry *trace)
+{
+	struct rproc_trace_pull *pull;
+
+	mutex_lock(&rproc_trace_pulls_lock);
+
+	list_for_each_entry(pull, &rproc_trace_pulls, node) {
+		if (pull->trace == trace) {
+			list_del(&pull->node);
+			kfree(pull);
+			break;
+		}
+	}
+
+	mutex_unlock(&rproc_trace_pulls_lock);
+}
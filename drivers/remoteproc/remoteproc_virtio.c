@@ -26,9 +26,32 @@
 #include <linux/err.h>
 #include <linux/kref.h>
 #include <linux/slab.h>
+#include <linux/pm_runtime.h>
+#include <linux/mutex.h>
+#include <linux/bitops.h>
+#include <linux/rcupdate.h>
+#include <linux/kthread.h>
+#include <linux/sched.h>
+#include <linux/async.h>
+#include <linux/spinlock.h>
 
 #include "remoteproc_internal.h"
 
+/* account for a kick of the remote processor about @rvring */
+static void rproc_vring_stat_kick(struct rproc_vring *rvring)
+{
+	struct rproc_vring_stats *stats = &rvring->stats;
+	struct vring vring;
+	u16 inflight;
+
+	vring_init(&vring, rvring->len, rvring->va, rvring->align);
+	inflight = ACCESS_ONCE(vring.avail->idx) - ACCESS_ONCE(vring.used->idx);
+
+	stats->kicks++;
+	if (inflight > stats->inflight_max)
+		stats->inflight_max = inflight;
+}
+
 /* kick the remote processor, and let it know which virtqueue to poke at */
 static void rproc_virtio_notify(struct virtqueue *vq)
 {
@@ -38,35 +61,403 @@ static void rproc_virtio_notify(struct virtqueue *vq)
 
 	dev_dbg(&rproc->dev, "kicking vq index: %d\n", notifyid);
 
-	rproc->ops->kick(rproc, notifyid);
+	rproc_vring_stat_kick(rvring);
+
+	/*
+	 * coalesce it with the kicks that come right after it (e.g. rpmsg
+	 * kicking its tx vring, and then its rx one), into a single one,
+	 * unless each kick must go to the core that serves its vring
+	 */
+	if (rproc->ops->kick_vqs && !rproc->ops->kick_core &&
+						notifyid < BITS_PER_LONG) {
+		set_bit(notifyid, &rproc->kicks_pending);
+		tasklet_schedule(&rproc->kick_tasklet);
+		return;
+	}
+
+	/*
+	 * wake the remote processor up if it was suspended as it idled: this
+	 * may be atomic context, so it's resumed asynchronously, and finds
+	 * the kick (and the new buffers) waiting for it once it is.
+	 */
+	pm_runtime_get(&rproc->dev);
+
+	if (rproc->ops->kick_core)
+		rproc->ops->kick_core(rproc, rvring->core, notifyid);
+	else
+		rproc->ops->kick(rproc, notifyid);
+
+	pm_runtime_mark_last_busy(&rproc->dev);
+	pm_runtime_put_autosuspend(&rproc->dev);
+}
+
+/* send the kicks rproc_virtio_notify() coalesced, with a single one */
+void rproc_kick_tasklet(unsigned long data)
+{
+	struct rproc *rproc = (struct rproc *)data;
+	unsigned long pending = xchg(&rproc->kicks_pending, 0);
+
+	if (!pending)
+		return;
+
+	dev_dbg(&rproc->dev, "kicking vqs 0x%lx\n", pending);
+
+	/* same as rproc_virtio_notify() */
+	pm_runtime_get(&rproc->dev);
+
+	rproc->ops->kick_vqs(rproc, pending);
+
+	pm_runtime_mark_last_busy(&rproc->dev);
+	pm_runtime_put_autosuspend(&rproc->dev);
+}
+
+/*
+ * the remote processor signalled some of its vrings: returns true if the
+ * notification is handed over to the poll thread (see rproc->poll_cpu)
+ * or to the chosen cpus (see rproc->ipc_cpus), in which case all the
+ * vrings are looked at there.
+ */
+static bool rproc_vq_notified(struct rproc *rproc)
+{
+	unsigned int cpu;
+
+	/* for the notification moderation to tell how often it's called */
+	rproc->notifications++;
+
+	/* the remote processor isn't idle, nor hung */
+	pm_runtime_mark_last_busy(&rproc->dev);
+	rproc_watchdog_pet(rproc);
+
+	/* it's up, if that's the first we hear of it since it was started */
+	if (unlikely(atomic_read(&rproc->boot_ready_pending)))
+		rproc_boot_ready(rproc);
+
+	/* the poll thread is on it already, or it will be once it's awake */
+	if (rproc->poll_thread) {
+		if (!ACCESS_ONCE(rproc->polling))
+			wake_up_process(rproc->poll_thread);
+		return true;
+	}
+
+	cpu = cpumask_any_and(rproc->ipc_cpus, cpu_online_mask);
+	if (cpu >= nr_cpu_ids)
+		return false;
+
+	queue_work_on(cpu, rproc->ipc_wq, &rproc->ipc_work);
+	return true;
+}
+
+/*
+ * look at the @notifyid vring, because the remote processor @notified us,
+ * or because it's busy-polled. Must be called under rcu_read_lock()
+ */
+static irqreturn_t rproc_vq_poll(struct rproc_vring_map *map, int notifyid,
+								bool notified)
+{
+	struct rproc_vring *rvring;
+	struct rproc_vring_stats *stats;
+	struct vring vring;
+	irqreturn_t ret;
+	u16 used, batch;
+
+	if (!map || notifyid < 0 || notifyid >= map->size)
+		return IRQ_NONE;
+
+	rvring = rcu_dereference(map->vrings[notifyid]);
+	if (!rvring || !rvring->vq)
+		return IRQ_NONE;
+
+	if (!notified)
+		return vring_interrupt(0, rvring->vq);
+
+	vring_init(&vring, rvring->len, rvring->va, rvring->align);
+	used = ACCESS_ONCE(vring.used->idx);
+
+	ret = vring_interrupt(0, rvring->vq);
+
+	stats = &rvring->stats;
+	stats->interrupts++;
+	if (ret == IRQ_NONE)
+		stats->spurious++;
+
+	batch = used - rvring->irq_used;
+	rvring->irq_used = used;
+	if (batch > stats->batch_max)
+		stats->batch_max = batch;
+
+	return ret;
+}
+
+/* look at all the vrings. Must be called under rcu_read_lock() */
+static irqreturn_t rproc_vqs_poll(struct rproc_vring_map *map, bool notified)
+{
+	irqreturn_t ret = IRQ_NONE;
+	int notifyid;
+
+	for (notifyid = 0; map && notifyid < map->size; notifyid++)
+		if (rproc_vq_poll(map, notifyid, notified) == IRQ_HANDLED)
+			ret = IRQ_HANDLED;
+
+	return ret;
 }
 
 /**
  * rproc_vq_interrupt() - tell remoteproc that a virtqueue is interrupted
  * @rproc: handle to the remote processor
- * @notifyid: index of the signalled virtqueue (unique per this @rproc)
+ * @notifyid: index of the signalled virtqueue (unique per this @rproc), or
+ *	      RPROC_ALL_VQS
  *
  * This function should be called by the platform-specific rproc driver,
  * when the remote processor signals that a specific virtqueue has pending
- * messages available.
+ * messages available. Remote processors which don't tell which one it is
+ * are handled with RPROC_ALL_VQS: all the virtqueues are then looked at.
  *
  * Returns IRQ_NONE if no message was found in the @notifyid virtqueue,
  * and otherwise returns IRQ_HANDLED.
  */
 irqreturn_t rproc_vq_interrupt(struct rproc *rproc, int notifyid)
 {
-	struct rproc_vring *rvring;
+	struct rproc_vring_map *map;
+	irqreturn_t ret;
 
 	dev_dbg(&rproc->dev, "vq index %d is interrupted\n", notifyid);
 
-	rvring = idr_find(&rproc->notifyids, notifyid);
-	if (!rvring || !rvring->vq)
-		return IRQ_NONE;
+	/* shared-memory queues are drained right away, wherever we are */
+	if (rproc_queue_interrupt(rproc, notifyid) == IRQ_HANDLED &&
+						notifyid != RPROC_ALL_VQS) {
+		pm_runtime_mark_last_busy(&rproc->dev);
+		rproc_watchdog_pet(rproc);
+		return IRQ_HANDLED;
+	}
+
+	/* and so are the completions of command queues */
+	if (rproc_cmdq_interrupt(rproc, notifyid) == IRQ_HANDLED &&
+						notifyid != RPROC_ALL_VQS) {
+		pm_runtime_mark_last_busy(&rproc->dev);
+		rproc_watchdog_pet(rproc);
+		return IRQ_HANDLED;
+	}
+
+	/* so are overlay requests, which are then served from a work */
+	if (rproc_overlay_interrupt(rproc, notifyid) == IRQ_HANDLED &&
+						notifyid != RPROC_ALL_VQS)
+		return IRQ_HANDLED;
+
+	/* and so are runtime memory requests */
+	if (rproc_dynmem_interrupt(rproc, notifyid) == IRQ_HANDLED &&
+						notifyid != RPROC_ALL_VQS)
+		return IRQ_HANDLED;
+
+	if (rproc_vq_notified(rproc))
+		return IRQ_HANDLED;
+
+	rcu_read_lock();
+	map = rcu_dereference(rproc->vring_map);
+	if (notifyid == RPROC_ALL_VQS)
+		ret = rproc_vqs_poll(map, true);
+	else
+		ret = rproc_vq_poll(map, notifyid, true);
+	rcu_read_unlock();
 
-	return vring_interrupt(0, rvring->vq);
+	return ret;
 }
 EXPORT_SYMBOL(rproc_vq_interrupt);
 
+/*
+ * account for the buffers the remote processor went through on @rvring,
+ * and for those it's still to go through. Must be called under
+ * rcu_read_lock()
+ */
+static void rproc_vring_load(struct rproc_vring *rvring,
+			struct rproc_load *load, unsigned int *capacity)
+{
+	struct vring vring;
+	u16 used, pending, head;
+
+	vring_init(&vring, rvring->len, rvring->va, rvring->align);
+
+	used = ACCESS_ONCE(vring.used->idx);
+	load->msgs += (u16)(used - rvring->last_used);
+	rvring->last_used = used;
+
+	/*
+	 * the buffers the remote processor is to fill (e.g. the rx buffers
+	 * of rpmsg) aren't work it's behind on, only those it's to consume
+	 */
+	pending = ACCESS_ONCE(vring.avail->idx) - used;
+	if (pending) {
+		head = ACCESS_ONCE(vring.avail->ring[used % vring.num]);
+		if (head >= vring.num ||
+				vring.desc[head].flags & VRING_DESC_F_WRITE)
+			return;
+	}
+
+	load->backlog += min_t(u16, pending, vring.num);
+	*capacity += vring.num;
+}
+
+/**
+ * rproc_get_load() - sample how busy a remote processor is kept
+ * @rproc: the remote processor
+ * @load: filled with the load since the previous sample
+ *
+ * This function tells how busy the vrings of @rproc kept it since it was
+ * last called: the remote processor is deemed busy for @rproc->msg_cost_us
+ * for each buffer it consumed (or filled), and, if the buffers it has yet
+ * to consume take more of its vrings than that, for as much of the period.
+ * Only the vrings themselves are looked at, so this costs nothing to the
+ * ipc paths, and a remote processor that isn't running is idle. If the
+ * remote processor publishes how busy it is itself (see fw_rsc_telemetry),
+ * that's what it's deemed, instead.
+ *
+ * It's meant to be called periodically by platform-specific rproc drivers
+ * which scale the frequency of their remote processor with its load (e.g.
+ * from the get_dev_status() handler of their devfreq profile). Its calls
+ * must be serialized.
+ */
+void rproc_get_load(struct rproc *rproc, struct rproc_load *load)
+{
+	struct rproc_vring_map *map;
+	struct rproc_vring *rvring;
+	struct rproc_telemetry tm;
+	unsigned int capacity = 0;
+	ktime_t now = ktime_get();
+	u64 busy;
+	int notifyid;
+
+	memset(load, 0, sizeof(*load));
+	load->period_us = ktime_us_delta(now, rproc->load_stamp);
+	rproc->load_stamp = now;
+
+	rcu_read_lock();
+	map = rcu_dereference(rproc->vring_map);
+	for (notifyid = 0; map && notifyid < map->size; notifyid++) {
+		rvring = rcu_dereference(map->vrings[notifyid]);
+		if (rvring && rvring->vq)
+			rproc_vring_load(rvring, load, &capacity);
+	}
+	rcu_read_unlock();
+
+	busy = (u64)load->msgs * rproc->msg_cost_us;
+	if (capacity)
+		busy = max_t(u64, busy, div_u64((u64)load->period_us *
+						load->backlog, capacity));
+
+	/* the remote processor knows better than our guess, if it tells */
+	if (!rproc_get_telemetry(rproc, &tm))
+		busy = div_u64((u64)load->period_us * tm.util,
+						FW_TELEMETRY_UTIL_SCALE);
+
+	load->busy_us = min_t(u64, busy, load->period_us);
+}
+EXPORT_SYMBOL(rproc_get_load);
+
+/**
+ * rproc_vqs_interrupt() - tell remoteproc that several virtqueues are
+ * interrupted
+ * @rproc: handle to the remote processor
+ * @pending: bitmask of the signalled virtqueues: bit n stands for the one
+ *	     whose notifyid is n
+ *
+ * This function is like rproc_vq_interrupt(), for platform-specific rproc
+ * drivers whose remote processor can signal several virtqueues (e.g. the
+ * first BITS_PER_LONG ones) with a single notification.
+ *
+ * Returns IRQ_NONE if no message was found in any of the @pending
+ * virtqueues, and otherwise returns IRQ_HANDLED.
+ */
+irqreturn_t rproc_vqs_interrupt(struct rproc *rproc, unsigned long pending)
+{
+	struct rproc_vring_map *map;
+	irqreturn_t ret = IRQ_NONE;
+	int notifyid;
+
+	dev_dbg(&rproc->dev, "vqs 0x%lx are interrupted\n", pending);
+
+	for_each_set_bit(notifyid, &pending, BITS_PER_LONG)
+		if (rproc_queue_interrupt(rproc, notifyid) == IRQ_HANDLED ||
+		    rproc_cmdq_interrupt(rproc, notifyid) == IRQ_HANDLED ||
+		    rproc_overlay_interrupt(rproc, notifyid) == IRQ_HANDLED ||
+		    rproc_dynmem_interrupt(rproc, notifyid) == IRQ_HANDLED)
+			ret = IRQ_HANDLED;
+
+	if (rproc_vq_notified(rproc))
+		return IRQ_HANDLED;
+
+	rcu_read_lock();
+	map = rcu_dereference(rproc->vring_map);
+	for_each_set_bit(notifyid, &pending, BITS_PER_LONG)
+		if (rproc_vq_poll(map, notifyid, true) == IRQ_HANDLED)
+			ret = IRQ_HANDLED;
+	rcu_read_unlock();
+
+	return ret;
+}
+EXPORT_SYMBOL(rproc_vqs_interrupt);
+
+/*
+ * handle the vring notifications of a remote processor on the cpus they
+ * were handed over to (see rproc->ipc_cpus). Notifications that pile up
+ * while this is pending are coalesced, so all the vrings are looked at.
+ */
+void rproc_ipc_work(struct work_struct *work)
+{
+	struct rproc *rproc = container_of(work, struct rproc, ipc_work);
+
+	rcu_read_lock();
+	rproc_vqs_poll(rcu_dereference(rproc->vring_map), true);
+	rcu_read_unlock();
+}
+
+/*
+ * busy-poll the vrings of a remote processor, on rproc->poll_cpu: like
+ * NAPI, a notification starts the polling, which goes on (and makes
+ * further notifications pointless) until the vrings were idle for
+ * rproc->poll_idle_usecs.
+ */
+int rproc_poll_thread(void *data)
+{
+	struct rproc *rproc = data;
+	u64 idle = (u64)rproc->poll_idle_usecs * NSEC_PER_USEC;
+	u64 last_busy = local_clock();
+	irqreturn_t ret;
+
+	while (!kthread_should_stop()) {
+		rcu_read_lock();
+		ret = rproc_vqs_poll(rcu_dereference(rproc->vring_map), false);
+		rcu_read_unlock();
+
+		if (ret == IRQ_HANDLED) {
+			last_busy = local_clock();
+		} else if (local_clock() - last_busy > idle) {
+			/*
+			 * go back to notifications. Look at the vrings once
+			 * more after saying so, since one that came in just
+			 * before that didn't wake us up.
+			 */
+			set_current_state(TASK_INTERRUPTIBLE);
+			ACCESS_ONCE(rproc->polling) = false;
+			smp_mb();
+
+			rcu_read_lock();
+			ret = rproc_vqs_poll(rcu_dereference(rproc->vring_map),
+									false);
+			rcu_read_unlock();
+
+			if (ret == IRQ_NONE && !kthread_should_stop())
+				schedule();
+			__set_current_state(TASK_RUNNING);
+
+			ACCESS_ONCE(rproc->polling) = true;
+			last_busy = local_clock();
+		}
+
+		cond_resched();
+	}
+
+	return 0;
+}
+
 static struct virtqueue *rp_find_vq(struct virtio_device *vdev,
 				    unsigned id,
 				    void (*callback)(struct virtqueue *vq),
@@ -77,11 +468,12 @@ static struct virtqueue *rp_find_vq(struct virtio_device *vdev,
 	struct device *dev = &rproc->dev;
 	struct rproc_vring *rvring;
 	struct virtqueue *vq;
+	bool weak_barriers;
 	void *addr;
 	int len, size, ret;
 
-	/* we're temporarily limited to two virtqueues per rvdev */
-	if (id >= ARRAY_SIZE(rvdev->vring))
+	/* we can only provide the vrings the firmware announced */
+	if (id >= rvdev->num_vrings)
 		return ERR_PTR(-EINVAL);
 
 	if (!name)
@@ -98,16 +490,20 @@ static struct virtqueue *rp_find_vq(struct virtio_device *vdev,
 	/* zero vring */
 	size = vring_size(len, rvring->align);
 	memset(addr, 0, size);
+	rvring->last_used = 0;
+	rvring->irq_used = 0;
 
 	dev_dbg(dev, "vring%d: va %p qsz %d notifyid %d\n",
 					id, addr, len, rvring->notifyid);
 
 	/*
-	 * Create the new vq, and tell virtio we're not interested in
-	 * the 'weak' smp barriers, since we're talking with a real device.
+	 * Create the new vq. We're talking with a real device, so virtio's
+	 * 'weak' smp barriers only do if it's cache coherent with us, and if
+	 * they're real barriers at all (they're compiler barriers on UP).
 	 */
-	vq = vring_new_virtqueue(id, len, rvring->align, vdev, false, addr,
-					rproc_virtio_notify, callback, name);
+	weak_barriers = rproc->coherent && IS_ENABLED(CONFIG_SMP);
+	vq = vring_new_virtqueue(id, len, rvring->align, vdev, weak_barriers,
+				addr, rproc_virtio_notify, callback, name);
 	if (!vq) {
 		dev_err(dev, "vring_new_virtqueue %s failed\n", name);
 		rproc_free_vring(rvring);
@@ -126,12 +522,26 @@ static void rproc_virtio_del_vqs(struct virtio_device *vdev)
 	struct rproc *rproc = vdev_to_rproc(vdev);
 	struct rproc_vring *rvring;
 
+	/* send the kicks that are still pending, while it's up */
+	tasklet_kill(&rproc->kick_tasklet);
+
 	/* power down the remote processor before deleting vqs */
 	rproc_shutdown(rproc);
 
-	list_for_each_entry_safe(vq, n, &vdev->vqs, list) {
+	/* and let go of the notifications it's sent already */
+	cancel_work_sync(&rproc->ipc_work);
+
+	list_for_each_entry(vq, &vdev->vqs, list) {
 		rvring = vq->priv;
 		rvring->vq = NULL;
+	}
+
+	/* the poll thread may be looking at the vqs still */
+	if (rproc->poll_thread)
+		synchronize_rcu();
+
+	list_for_each_entry_safe(vq, n, &vdev->vqs, list) {
+		rvring = vq->priv;
 		vring_del_virtqueue(vq);
 		rproc_free_vring(rvring);
 	}
@@ -168,25 +578,65 @@ error:
 }
 
 /*
- * We don't support yet real virtio status semantics.
+ * The status and the config space of a vdev are shared with the remote
+ * processor through the vdev's entry in the resource table it uses, if
+ * it's added on the fly (see rproc_report_rsc_update()), or if it's in the
+ * resource table it was loaded with (see rproc_share_vdevs()), while it's
+ * up: this way both sides see the changes the other one makes, e.g. the
+ * remote processor can tell when the vrings are ready, and parameters can
+ * be exchanged through the config space, without any message.
+ *
+ * Otherwise, they're kept here, and written to the resource table the
+ * remote processor is booted with.
  *
- * The plan is to provide this via the VDEV resource entry
- * which is part of the firmware: this way the remote processor
- * will be able to access the status values as set by us.
+ * Must be called with rproc->shared_lock held.
  */
+static struct fw_rsc_vdev *rproc_vdev_shared(struct rproc_vdev *rvdev)
+{
+	return rvdev->rsc ? rvdev->rsc : rvdev->shared;
+}
+
 static u8 rproc_virtio_get_status(struct virtio_device *vdev)
 {
-	return 0;
+	struct rproc_vdev *rvdev = vdev_to_rvdev(vdev);
+	struct rproc *rproc = vdev_to_rproc(vdev);
+	struct fw_rsc_vdev *rsc;
+	unsigned long flags;
+	u8 status;
+
+	spin_lock_irqsave(&rproc->shared_lock, flags);
+	rsc = rproc_vdev_shared(rvdev);
+	status = rsc ? rsc->status : rvdev->status;
+	spin_unlock_irqrestore(&rproc->shared_lock, flags);
+
+	return status;
 }
 
 static void rproc_virtio_set_status(struct virtio_device *vdev, u8 status)
 {
+	struct rproc_vdev *rvdev = vdev_to_rvdev(vdev);
+	struct rproc *rproc = vdev_to_rproc(vdev);
+	struct fw_rsc_vdev *rsc;
+	unsigned long flags;
+
 	dev_dbg(&vdev->dev, "status: %d\n", status);
+
+	spin_lock_irqsave(&rproc->shared_lock, flags);
+	rvdev->status = status;
+	rsc = rproc_vdev_shared(rvdev);
+	if (rsc) {
+		/* the config space must be seen as updated before the status */
+		wmb();
+		rsc->status = status;
+	}
+	spin_unlock_irqrestore(&rproc->shared_lock, flags);
 }
 
 static void rproc_virtio_reset(struct virtio_device *vdev)
 {
 	dev_dbg(&vdev->dev, "reset !\n");
+
+	rproc_virtio_set_status(vdev, 0);
 }
 
 /* provide the vdev features as retrieved from the firmware */
@@ -200,20 +650,117 @@ static u32 rproc_virtio_get_features(struct virtio_device *vdev)
 static void rproc_virtio_finalize_features(struct virtio_device *vdev)
 {
 	struct rproc_vdev *rvdev = vdev_to_rvdev(vdev);
+	struct rproc *rproc = vdev_to_rproc(vdev);
+	bool booted;
 
 	/* Give virtio_ring a chance to accept features */
 	vring_transport_features(vdev);
 
+	/*
+	 * Both sides must agree on event indices, and on the layout of the
+	 * vrings, before they are used:
+	 * the remote processor learns about it from the resource table it's
+	 * booted with (see rproc_publish_vdevs()), even an armed hot spare
+	 * as it takes over (or one whose firmware is still being read), or
+	 * from the one it uses, for vdevs that were added on the fly.
+	 * Otherwise, it's too late for that.
+	 */
+	mutex_lock(&rproc->lock);
+	booted = rproc->state != RPROC_OFFLINE && rproc->state != RPROC_ARMED &&
+					rproc->state != RPROC_BOOTING;
+	mutex_unlock(&rproc->lock);
+
+	if (booted && !rvdev->rsc) {
+		clear_bit(VIRTIO_RING_F_EVENT_IDX, vdev->features);
+		clear_bit(VIRTIO_RING_F_PACKED, vdev->features);
+	}
+
 	/*
 	 * Remember the finalized features of our vdev, and provide it
 	 * to the remote processor once it is powered on.
 	 *
-	 * Similarly to the status field, we don't expose yet the negotiated
-	 * features to the remote processors at this point. This will be
-	 * fixed as part of a small resource table overhaul and then an
-	 * extension of the virtio resource entries.
+	 * The negotiated features are written back to the vdev's entry in
+	 * the resource table as the remote processor is booted.
 	 */
 	rvdev->gfeatures = vdev->features[0];
+
+	/* but for vdevs that were added on the fly, see above */
+	if (rvdev->rsc)
+		rvdev->rsc->gfeatures = rvdev->gfeatures;
+}
+
+/* where the config space of a vdev is shared, in its resource table entry */
+static void *rproc_vdev_shared_config(struct rproc_vdev *rvdev,
+						struct fw_rsc_vdev *rsc)
+{
+	/* the number of vrings is ours: the remote processor may change it */
+	return &rsc->vring[rvdev->num_vrings];
+}
+
+/* read the virtio config space, as provided by the firmware */
+static void rproc_virtio_get(struct virtio_device *vdev, unsigned offset,
+							void *buf, unsigned len)
+{
+	struct rproc_vdev *rvdev = vdev_to_rvdev(vdev);
+	struct rproc *rproc = vdev_to_rproc(vdev);
+	struct fw_rsc_vdev *rsc;
+	unsigned long flags;
+
+	if (offset + len > rvdev->config_len || offset + len < len) {
+		dev_err(&vdev->dev, "config access out of bounds: %u@%u\n",
+								len, offset);
+		return;
+	}
+
+	spin_lock_irqsave(&rproc->shared_lock, flags);
+	rsc = rproc_vdev_shared(rvdev);
+	if (rsc)
+		memcpy(buf, rproc_vdev_shared_config(rvdev, rsc) + offset, len);
+	else
+		memcpy(buf, rvdev->config + offset, len);
+	spin_unlock_irqrestore(&rproc->shared_lock, flags);
+}
+
+/* write the virtio config space, for the remote processor to see */
+static void rproc_virtio_set(struct virtio_device *vdev, unsigned offset,
+						const void *buf, unsigned len)
+{
+	struct rproc_vdev *rvdev = vdev_to_rvdev(vdev);
+	struct rproc *rproc = vdev_to_rproc(vdev);
+	struct fw_rsc_vdev *rsc;
+	unsigned long flags;
+
+	if (offset + len > rvdev->config_len || offset + len < len) {
+		dev_err(&vdev->dev, "config access out of bounds: %u@%u\n",
+								len, offset);
+		return;
+	}
+
+	spin_lock_irqsave(&rproc->shared_lock, flags);
+	memcpy(rvdev->config + offset, buf, len);
+	rsc = rproc_vdev_shared(rvdev);
+	if (rsc)
+		memcpy(rproc_vdev_shared_config(rvdev, rsc) + offset, buf, len);
+	spin_unlock_irqrestore(&rproc->shared_lock, flags);
+}
+
+/**
+ * rproc_virtio_config_changed() - tell a vdev's driver its config changed
+ * @rvdev: the remote vdev
+ *
+ * The remote processor may have changed the config space of @rvdev (see
+ * rproc_report_rsc_update()): let its driver, if any, know about it.
+ */
+void rproc_virtio_config_changed(struct rproc_vdev *rvdev)
+{
+	struct virtio_device *vdev = &rvdev->vdev;
+	struct virtio_driver *drv;
+
+	device_lock(&vdev->dev);
+	drv = container_of(vdev->dev.driver, struct virtio_driver, driver);
+	if (vdev->dev.driver && drv->config_changed)
+		drv->config_changed(vdev);
+	device_unlock(&vdev->dev);
 }
 
 static struct virtio_config_ops rproc_virtio_config_ops = {
@@ -224,8 +771,174 @@ static struct virtio_config_ops rproc_virtio_config_ops = {
 	.reset		= rproc_virtio_reset,
 	.set_status	= rproc_virtio_set_status,
 	.get_status	= rproc_virtio_get_status,
+	.get		= rproc_virtio_get,
+	.set		= rproc_virtio_set,
 };
 
+/**
+ * rproc_vdev_account_bufs() - account for the buffers of a virtio driver
+ * @vdev: the virtio device, which may or may not belong to a remote processor
+ * @len: how many bytes the driver of @vdev allocated for its buffers, or
+ *	 (if negative) freed
+ *
+ * Virtio drivers (e.g. rpmsg) call this whenever they allocate or free the
+ * memory they share with the other side of @vdev, so it can be accounted
+ * to the remote processor @vdev belongs to, if any (see rproc_mem_usage()).
+ */
+void rproc_vdev_account_bufs(struct virtio_device *vdev, long len)
+{
+	if (vdev->config != &rproc_virtio_config_ops)
+		return;
+
+	atomic_long_add(len, &vdev_to_rvdev(vdev)->bufs_len);
+}
+EXPORT_SYMBOL(rproc_vdev_account_bufs);
+
+/**
+ * rproc_vdev_dma_dev() - the device a virtio driver's buffers are mapped for
+ * @vdev: the virtio device, which may or may not belong to a remote processor
+ *
+ * The remote processor sees memory through the device which controls it
+ * (and possibly its IOMMU), so virtio drivers (e.g. rpmsg) allocate and map
+ * the buffers they share with it with that device.
+ *
+ * Returns the device, or NULL if @vdev doesn't belong to a remote processor
+ * (e.g. a virtio_pci or virtio_mmio device, whose other side sees the
+ * kernel's memory at its physical addresses, as it sees the vrings).
+ */
+struct device *rproc_vdev_dma_dev(struct virtio_device *vdev)
+{
+	if (vdev->config != &rproc_virtio_config_ops)
+		return NULL;
+
+	return vdev_to_rproc(vdev)->dev.parent;
+}
+EXPORT_SYMBOL(rproc_vdev_dma_dev);
+
+/**
+ * rproc_vdev_alloc_ipc() - allocate buffers out of the IPC region of a vdev
+ * @vdev: the virtio device, which may or may not belong to a remote processor
+ * @size: how many bytes to allocate
+ * @dma: where to store the dma address of the allocated memory
+ *
+ * Virtio drivers (e.g. rpmsg) use this to place the buffers they share with
+ * the remote processor @vdev belongs to in the IPC region its firmware asked
+ * for (see fw_rsc_ipcmem), next to the vrings, so the remote processor can
+ * map all of them at once. The memory is coherent, as if it came from
+ * dma_alloc_coherent(), and zeroed.
+ *
+ * Returns the kernel address of the allocated memory, or NULL if @vdev has
+ * no IPC region (or not enough room left in it), in which case the driver
+ * should allocate its buffers on its own.
+ */
+void *rproc_vdev_alloc_ipc(struct virtio_device *vdev, size_t size,
+							dma_addr_t *dma)
+{
+	if (vdev->config != &rproc_virtio_config_ops)
+		return NULL;
+
+	return rproc_ipc_alloc(vdev_to_rvdev(vdev), size, dma);
+}
+EXPORT_SYMBOL(rproc_vdev_alloc_ipc);
+
+/**
+ * rproc_vdev_free_ipc() - free what rproc_vdev_alloc_ipc() allocated
+ * @vdev: the virtio device the memory was allocated for
+ * @va: kernel address of the memory, as returned by rproc_vdev_alloc_ipc()
+ * @size: size of the memory, as passed to rproc_vdev_alloc_ipc()
+ */
+void rproc_vdev_free_ipc(struct virtio_device *vdev, void *va, size_t size)
+{
+	rproc_ipc_free(vdev_to_rvdev(vdev), va, size);
+}
+EXPORT_SYMBOL(rproc_vdev_free_ipc);
+
+/**
+ * rproc_vdev_shared_clock() - read the clock shared with a remote processor
+ * @vdev: the virtio device, which may or may not belong to a remote processor
+ * @rate: where to store the rate of the clock, in Hz
+ *
+ * Virtio drivers (e.g. rpmsg) use this to stamp their messages, or to tell
+ * how long ago the remote processor stamped its own, in a timebase both
+ * sides read: the trace clock of the remote processor @vdev belongs to
+ * (see the ->trace_clock() handler of rproc_ops).
+ *
+ * This function can be called from atomic/interrupt context.
+ *
+ * Returns the current value of the clock, in ticks, or 0 (and sets @rate
+ * to 0) if there's no shared clock.
+ */
+u64 rproc_vdev_shared_clock(struct virtio_device *vdev, u32 *rate)
+{
+	struct rproc *rproc;
+	unsigned long flags;
+	u64 ticks;
+
+	*rate = 0;
+
+	if (vdev->config != &rproc_virtio_config_ops)
+		return 0;
+
+	rproc = vdev_to_rproc(vdev);
+	if (!rproc->ops->trace_clock || !rproc->trace_clock_rate)
+		return 0;
+
+	local_irq_save(flags);
+	ticks = rproc->ops->trace_clock(rproc);
+	local_irq_restore(flags);
+
+	*rate = rproc->trace_clock_rate;
+
+	return ticks;
+}
+EXPORT_SYMBOL(rproc_vdev_shared_clock);
+
+/**
+ * rproc_vdev_ept_backlog() - tell how far behind a remote endpoint is
+ * @vdev: the virtio device, which may or may not belong to a remote processor
+ * @addr: the (rpmsg) address of the endpoint
+ * @backlog: where to put the number of messages the endpoint is behind on
+ *
+ * Virtio drivers (e.g. rpmsg) use this to tell how loaded the remote
+ * services they spread work over are, from the telemetry page of the remote
+ * processor @vdev belongs to (see rproc_get_ept_backlog()).
+ *
+ * This function can be called from atomic/interrupt context.
+ *
+ * Returns 0 on success, or -ENODEV if there's no telemetry to go by.
+ */
+int rproc_vdev_ept_backlog(struct virtio_device *vdev, u32 addr, u32 *backlog)
+{
+	if (vdev->config != &rproc_virtio_config_ops)
+		return -ENODEV;
+
+	return rproc_get_ept_backlog(vdev_to_rproc(vdev), addr, backlog);
+}
+EXPORT_SYMBOL(rproc_vdev_ept_backlog);
+
+/**
+ * rproc_vdev_acct_admit() - wait for a sender's turn to use a remote processor
+ * @vdev: the virtio device, which may or may not belong to a remote processor
+ * @tag: the tag of the sender (see rproc_cgroup_tag())
+ * @timeout: how long to wait, in jiffies (0 not to wait)
+ *
+ * Virtio drivers (e.g. rpmsg) call this before sending on behalf of a
+ * tagged sender, which is held back for as long as it uses more than its
+ * share of the remote processor @vdev belongs to (see rproc_acct_admit()).
+ *
+ * Returns 0 if the sender may go on (which is always the case of virtio
+ * devices which don't belong to a remote processor), or the error
+ * rproc_acct_admit() returned.
+ */
+int rproc_vdev_acct_admit(struct virtio_device *vdev, u16 tag, long timeout)
+{
+	if (vdev->config != &rproc_virtio_config_ops)
+		return 0;
+
+	return rproc_acct_admit(vdev_to_rproc(vdev), tag, timeout);
+}
+EXPORT_SYMBOL(rproc_vdev_acct_admit);
+
 /*
  * This function is called whenever vdev is released, and is responsible
  * to decrement the remote processor's refcount which was taken when vdev was
@@ -240,12 +953,36 @@ static void rproc_vdev_release(struct device *dev)
 	struct rproc_vdev *rvdev = vdev_to_rvdev(vdev);
 	struct rproc *rproc = vdev_to_rproc(vdev);
 
-	list_del(&rvdev->node);
+	rproc_unlist_vdev(rvdev);
+	rproc_free_ipc(rvdev);
+	kfree(rvdev->config);
 	kfree(rvdev);
 
 	put_device(&rproc->dev);
 }
 
+/*
+ * vdevs are removed in parallel (see rproc_remove_virtio_devices()), so they
+ * may be released, and taken off the list of their rproc, concurrently
+ */
+static DEFINE_SPINLOCK(rproc_vdevs_lock);
+
+/* add @rvdev to the vdevs of its rproc */
+void rproc_list_vdev(struct rproc_vdev *rvdev)
+{
+	spin_lock(&rproc_vdevs_lock);
+	list_add_tail(&rvdev->node, &rvdev->rproc->rvdevs);
+	spin_unlock(&rproc_vdevs_lock);
+}
+
+/* take @rvdev off the vdevs of its rproc */
+void rproc_unlist_vdev(struct rproc_vdev *rvdev)
+{
+	spin_lock(&rproc_vdevs_lock);
+	list_del(&rvdev->node);
+	spin_unlock(&rproc_vdevs_lock);
+}
+
 /**
  * rproc_add_virtio_dev() - register an rproc-induced virtio device
  * @rvdev: the remote vdev
@@ -300,3 +1037,110 @@ void rproc_remove_virtio_dev(struct rproc_vdev *rvdev)
 {
 	unregister_virtio_device(&rvdev->vdev);
 }
+
+/* remove a vdev, along with the others (see rproc_remove_virtio_devices()) */
+static void rproc_remove_virtio_dev_async(void *data, async_cookie_t cookie)
+{
+	struct rproc_vdev *rvdev = data;
+	struct device *dev = &rvdev->vdev.dev;
+
+	rproc_remove_virtio_dev(rvdev);
+
+	/* which may release it */
+	put_device(dev);
+}
+
+/**
+ * rproc_remove_virtio_devices() - remove all the virtio devices of an rproc
+ * @rproc: the remote processor
+ *
+ * The vdevs of @rproc are all unregistered in parallel, each along with
+ * the devices its driver created (e.g. the channels of rpmsg, which are
+ * themselves removed in parallel), rather than one after the other, which
+ * shortens the recovery of remote processors with many of them.
+ *
+ * Returns once they're all gone. This function can sleep.
+ */
+void rproc_remove_virtio_devices(struct rproc *rproc)
+{
+	ASYNC_DOMAIN_EXCLUSIVE(domain);
+	struct rproc_vdev *rvdev, *tmp;
+
+	list_for_each_entry_safe(rvdev, tmp, &rproc->rvdevs, node) {
+		/* it stays listed until we're past it: its release waits */
+		get_device(&rvdev->vdev.dev);
+		async_schedule_domain(rproc_remove_virtio_dev_async, rvdev,
+								&domain);
+	}
+
+	async_synchronize_full_domain(&domain);
+}
+
+#ifdef CONFIG_PM
+/**
+ * rproc_freeze_virtio_dev() - freeze an rproc-induced virtio device
+ * @rvdev: the remote vdev
+ *
+ * This function asks the driver of @rvdev to let go of its virtqueues
+ * (which eventually powers the remote processor off), while keeping its
+ * own state, and the devices it created, around. This is the same
+ * freeze/restore contract virtio drivers already implement for system
+ * suspend: the device loses its state, and the driver sets up its
+ * virtqueues again once it's restored with rproc_restore_virtio_dev().
+ *
+ * A vdev no driver is bound to has nothing to freeze.
+ *
+ * Returns 0 on success, -EOPNOTSUPP if the driver of @rvdev doesn't support
+ * it, or another appropriate error value otherwise.
+ */
+int rproc_freeze_virtio_dev(struct rproc_vdev *rvdev)
+{
+	struct virtio_device *vdev = &rvdev->vdev;
+	struct virtio_driver *drv;
+	int ret = 0;
+
+	device_lock(&vdev->dev);
+
+	if (vdev->dev.driver) {
+		drv = container_of(vdev->dev.driver, struct virtio_driver,
+								driver);
+		if (drv->freeze && drv->restore)
+			ret = drv->freeze(vdev);
+		else
+			ret = -EOPNOTSUPP;
+	}
+
+	device_unlock(&vdev->dev);
+
+	return ret;
+}
+
+/**
+ * rproc_restore_virtio_dev() - restore a frozen rproc-induced virtio device
+ * @rvdev: the remote vdev
+ *
+ * This function lets the driver of a vdev which was frozen with
+ * rproc_freeze_virtio_dev() set up its virtqueues again (which boots the
+ * remote processor, if needed).
+ *
+ * Returns 0 on success, or an appropriate error value otherwise.
+ */
+int rproc_restore_virtio_dev(struct rproc_vdev *rvdev)
+{
+	struct virtio_device *vdev = &rvdev->vdev;
+	struct virtio_driver *drv;
+	int ret = 0;
+
+	device_lock(&vdev->dev);
+
+	if (vdev->dev.driver) {
+		drv = container_of(vdev->dev.driver, struct virtio_driver,
+								driver);
+		ret = drv->restore(vdev);
+	}
+
+	device_unlock(&vdev->dev);
+
+	return ret;
+}
+#endif
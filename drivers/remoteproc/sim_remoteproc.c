@@ -0,0 +1,614 @@
+/*
+ * Simulated Remote Processor driver
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * This driver registers a remote processor which only exists in software:
+ * its "firmware" is a kernel thread, which serves the rpmsg vdev of the
+ * remote processor over its vrings, the way real firmware would (it only
+ * knows about the vrings, and about the buffers their descriptors point
+ * to). It announces a couple of services with the rpmsg name service, and
+ * echoes their messages back:
+ *
+ * - "rpmsg-client-sample" (see samples/rpmsg/rpmsg_client_sample.c), whose
+ *   messages are all echoed back as they are
+ * - "rpmsg-bench" (see samples/rpmsg/rpmsg_bench.c), whose messages are
+ *   echoed back if they ask for it, stamped with when they were received
+ *
+ * This lets the cost of remoteproc and rpmsg themselves be measured (and
+ * regression tested) on any machine, without a remote processor: the
+ * remote side always keeps up, so what's measured is the host's side.
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/err.h>
+#include <linux/platform_device.h>
+#include <linux/dma-mapping.h>
+#include <linux/remoteproc.h>
+#include <linux/rpmsg.h>
+#include <linux/virtio_ids.h>
+#include <linux/virtio_ring.h>
+#include <linux/virtio_config.h>
+#include <linux/kthread.h>
+#include <linux/sched.h>
+#include <linux/wait.h>
+#include <linux/slab.h>
+
+#include "remoteproc_internal.h"
+
+#define SIM_RPROC_NAME		"sim-rproc"
+
+/* size of the vrings: the host posts half of its rpmsg buffers to each */
+#define SIM_RPROC_VRING_NUM	256
+#define SIM_RPROC_VRING_ALIGN	4096
+
+/* how many messages the remote side goes through before it interrupts */
+#define SIM_RPROC_BUDGET	16
+
+/* how often (in msecs) the remote side looks at its vrings when idle */
+#define SIM_RPROC_POLL_MS	10
+
+/* the rpmsg name service address */
+#define SIM_RPROC_NS_ADDR	53
+
+/* what the rpmsg-bench messages start with; see rpmsg_bench.c */
+struct sim_rproc_bench_hdr {
+	u32 seq;
+	u16 thread;
+	u16 flags;
+	u64 remote_ts;
+} __packed;
+
+#define SIM_RPROC_BENCH_ECHO	(1 << 0)
+
+static int remote_cpu = -1;
+module_param(remote_cpu, int, 0444);
+MODULE_PARM_DESC(remote_cpu, "CPU the remote side runs on (default: any)");
+
+/**
+ * struct sim_rproc_rsc_table - the resource table of the remote processor
+ * @table: its header
+ * @offset: offset of its single entry
+ * @vdev: the rpmsg vdev, with its rx vring (0) and its tx vring (1)
+ * @vring: the vrings of @vdev
+ */
+struct sim_rproc_rsc_table {
+	struct resource_table table;
+	u32 offset[1];
+	struct fw_rsc_hdr hdr;
+	struct fw_rsc_vdev vdev;
+	struct fw_rsc_vdev_vring vring[2];
+} __packed;
+
+/**
+ * struct sim_rproc_vring - the remote side of a vring
+ * @vr: the vring
+ * @notifyid: its notifyid, which the host is interrupted with
+ * @last_avail: index of the next available buffer to go through
+ * @used: how many buffers were pushed to the used ring since the last
+ *	  interrupt
+ */
+struct sim_rproc_vring {
+	struct vring vr;
+	int notifyid;
+	u16 last_avail;
+	unsigned int used;
+};
+
+/**
+ * struct sim_rproc - simulated remote processor
+ * @rproc: rproc handle
+ * @thread: the remote side
+ * @wq: where the remote side waits for kicks
+ * @kicked: the host kicked a vring since the remote side last looked
+ * @rx: the host's rx vring, which the remote side sends with
+ * @tx: the host's tx vring, which the remote side receives with
+ * @announced: the services were announced to the host
+ * @rsc: the "firmware" of the remote processor, i.e. its resource table
+ */
+struct sim_rproc {
+	struct rproc *rproc;
+	struct task_struct *thread;
+	wait_queue_head_t wq;
+	atomic_t kicked;
+	struct sim_rproc_vring rx;
+	struct sim_rproc_vring tx;
+	bool announced;
+	struct sim_rproc_rsc_table rsc;
+};
+
+/**
+ * struct sim_rproc_service - a service the remote side provides
+ * @name: its name, which it's announced with
+ * @addr: its rpmsg address
+ * @handle: serve one of its messages, replying with sim_rproc_send(), or
+ *	    return -EAGAIN to have it retried once the host posted rx buffers
+ */
+struct sim_rproc_service {
+	const char *name;
+	u32 addr;
+	int (*handle)(struct sim_rproc *sim, struct rpmsg_hdr *msg);
+};
+
+static int sim_rproc_echo(struct sim_rproc *sim, struct rpmsg_hdr *msg);
+static int sim_rproc_bench(struct sim_rproc *sim, struct rpmsg_hdr *msg);
+
+static const struct sim_rproc_service sim_rproc_services[] = {
+	{ "rpmsg-client-sample", 1024, sim_rproc_echo },
+	{ "rpmsg-bench", 1025, sim_rproc_bench },
+};
+
+/* the buffers the host posts are in its own memory, without any iommu */
+static void *sim_rproc_buf(struct vring_desc *desc)
+{
+	return phys_to_virt(desc->addr);
+}
+
+/* peek at the next buffer the host made available on @svr, if any */
+static struct vring_desc *sim_rproc_peek(struct sim_rproc_vring *svr)
+{
+	struct vring *vr = &svr->vr;
+	u16 head;
+
+	if (svr->last_avail == ACCESS_ONCE(vr->avail->idx))
+		return NULL;
+
+	/* read the ring entry only after seeing its index */
+	smp_rmb();
+
+	head = vr->avail->ring[svr->last_avail % vr->num];
+	if (head >= vr->num) {
+		pr_err("%s: bogus descriptor %u\n", SIM_RPROC_NAME, head);
+		return NULL;
+	}
+
+	return &vr->desc[head];
+}
+
+/* hand the buffer sim_rproc_peek() returned back to the host */
+static void sim_rproc_push(struct sim_rproc_vring *svr, u32 len)
+{
+	struct vring *vr = &svr->vr;
+	struct vring_used_elem *used;
+	u16 idx = vr->used->idx;
+
+	used = &vr->used->ring[idx % vr->num];
+	used->id = vr->avail->ring[svr->last_avail % vr->num];
+	used->len = len;
+
+	/* the host must see the entry before its index */
+	smp_wmb();
+
+	vr->used->idx = idx + 1;
+	svr->last_avail++;
+	svr->used++;
+}
+
+/* interrupt the host about @svr, if it pushed anything it wants to hear of */
+static void sim_rproc_interrupt(struct sim_rproc *sim,
+					struct sim_rproc_vring *svr)
+{
+	if (!svr->used)
+		return;
+
+	svr->used = 0;
+
+	/* the used index must be seen before the host's flags are looked at */
+	smp_mb();
+
+	if (!(ACCESS_ONCE(svr->vr.avail->flags) & VRING_AVAIL_F_NO_INTERRUPT))
+		rproc_vq_interrupt(sim->rproc, svr->notifyid);
+}
+
+/*
+ * start a @len bytes message to the host, in one of the rx buffers it
+ * posted, and return its payload, for the caller to fill in before it
+ * sends it with sim_rproc_send(). Returns -EAGAIN if the host has no rx
+ * buffer available, so the message is retried once it does.
+ */
+static void *sim_rproc_prepare(struct sim_rproc *sim, u32 src, u32 dst,
+								u16 len)
+{
+	struct vring_desc *desc = sim_rproc_peek(&sim->rx);
+	struct rpmsg_hdr *msg;
+
+	if (!desc)
+		return ERR_PTR(-EAGAIN);
+
+	if (!(desc->flags & VRING_DESC_F_WRITE) ||
+				desc->len < sizeof(*msg) + len) {
+		pr_err("%s: unusable rx buffer\n", SIM_RPROC_NAME);
+		sim_rproc_push(&sim->rx, 0);
+		return ERR_PTR(-EINVAL);
+	}
+
+	msg = sim_rproc_buf(desc);
+	msg->src = src;
+	msg->dst = dst;
+	msg->reserved = 0;
+	msg->len = len;
+	msg->flags = 0;
+
+	return msg->data;
+}
+
+/* send the message sim_rproc_prepare() started */
+static void sim_rproc_send(struct sim_rproc *sim, u16 len)
+{
+	sim_rproc_push(&sim->rx, sizeof(struct rpmsg_hdr) + len);
+}
+
+/* start a copy of @msg, back to where it came from */
+static void *sim_rproc_prepare_reply(struct sim_rproc *sim,
+						struct rpmsg_hdr *msg)
+{
+	void *data = sim_rproc_prepare(sim, msg->dst, msg->src, msg->len);
+
+	if (!IS_ERR(data))
+		memcpy(data, msg->data, msg->len);
+
+	return data;
+}
+
+static int sim_rproc_echo(struct sim_rproc *sim, struct rpmsg_hdr *msg)
+{
+	void *data = sim_rproc_prepare_reply(sim, msg);
+
+	if (IS_ERR(data))
+		return PTR_ERR(data);
+
+	sim_rproc_send(sim, msg->len);
+	return 0;
+}
+
+static int sim_rproc_bench(struct sim_rproc *sim, struct rpmsg_hdr *msg)
+{
+	struct sim_rproc_bench_hdr *hdr = (void *)msg->data;
+	/* when the message was received, on the remote side's trace clock */
+	u64 stamp = sched_clock();
+
+	if (msg->len < sizeof(*hdr) || !(hdr->flags & SIM_RPROC_BENCH_ECHO))
+		return 0;
+
+	hdr = sim_rproc_prepare_reply(sim, msg);
+	if (IS_ERR(hdr))
+		return PTR_ERR(hdr);
+
+	hdr->remote_ts = stamp;
+	sim_rproc_send(sim, msg->len);
+	return 0;
+}
+
+/* announce the services to the host */
+static int sim_rproc_announce(struct sim_rproc *sim)
+{
+	const struct sim_rproc_service *service;
+	struct rpmsg_ns_msg nsm;
+	void *data;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(sim_rproc_services); i++) {
+		service = &sim_rproc_services[i];
+
+		memset(&nsm, 0, sizeof(nsm));
+		strlcpy(nsm.name, service->name, sizeof(nsm.name));
+		nsm.addr = service->addr;
+		nsm.flags = RPMSG_NS_CREATE;
+
+		data = sim_rproc_prepare(sim, service->addr,
+					SIM_RPROC_NS_ADDR, sizeof(nsm));
+		if (IS_ERR(data))
+			return PTR_ERR(data);
+
+		memcpy(data, &nsm, sizeof(nsm));
+		sim_rproc_send(sim, sizeof(nsm));
+	}
+
+	return 0;
+}
+
+/* serve a message the host sent */
+static int sim_rproc_handle(struct sim_rproc *sim, struct vring_desc *desc)
+{
+	struct rpmsg_hdr *msg = sim_rproc_buf(desc);
+	int i;
+
+	if (desc->len < sizeof(*msg) || msg->len > desc->len - sizeof(*msg)) {
+		pr_err("%s: bogus message of %u bytes\n", SIM_RPROC_NAME,
+								desc->len);
+		return 0;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(sim_rproc_services); i++)
+		if (msg->dst == sim_rproc_services[i].addr)
+			return sim_rproc_services[i].handle(sim, msg);
+
+	pr_debug("%s: message to unknown address 0x%x\n", SIM_RPROC_NAME,
+								msg->dst);
+	return 0;
+}
+
+/*
+ * go through (some of) the messages the host sent. Returns whether there
+ * may be more of them to go through right away.
+ */
+static bool sim_rproc_serve(struct sim_rproc *sim)
+{
+	struct vring_desc *desc;
+	int i;
+
+	for (i = 0; i < SIM_RPROC_BUDGET; i++) {
+		desc = sim_rproc_peek(&sim->tx);
+		if (!desc)
+			break;
+
+		/* keep the message until the host posts an rx buffer */
+		if (sim_rproc_handle(sim, desc) == -EAGAIN)
+			break;
+
+		sim_rproc_push(&sim->tx, 0);
+	}
+
+	sim_rproc_interrupt(sim, &sim->rx);
+	sim_rproc_interrupt(sim, &sim->tx);
+
+	return i == SIM_RPROC_BUDGET;
+}
+
+/* tell whether the host has messages for the remote side, and wants kicks */
+static bool sim_rproc_idle(struct sim_rproc *sim)
+{
+	struct vring *vr = &sim->tx.vr;
+
+	vr->used->flags &= ~VRING_USED_F_NO_NOTIFY;
+
+	/* the host must see the flag before we look at the avail index */
+	smp_mb();
+
+	if (sim->tx.last_avail == ACCESS_ONCE(vr->avail->idx))
+		return true;
+
+	vr->used->flags |= VRING_USED_F_NO_NOTIFY;
+	return false;
+}
+
+/* the "firmware" of the remote processor */
+static int sim_rproc_thread(void *data)
+{
+	struct sim_rproc *sim = data;
+	unsigned long timeout = msecs_to_jiffies(SIM_RPROC_POLL_MS);
+
+	while (!kthread_should_stop()) {
+		/* messages are only looked at once the host is ready */
+		if (!sim->announced)
+			sim->announced = !sim_rproc_announce(sim);
+
+		/* no need for kicks while we're going through messages */
+		sim->tx.vr.used->flags |= VRING_USED_F_NO_NOTIFY;
+		while (sim_rproc_serve(sim) && !kthread_should_stop())
+			cond_resched();
+
+		if (!sim_rproc_idle(sim) && !atomic_read(&sim->kicked))
+			continue;
+
+		wait_event_interruptible_timeout(sim->wq,
+			atomic_read(&sim->kicked) || kthread_should_stop(),
+			timeout);
+		atomic_set(&sim->kicked, 0);
+	}
+
+	return 0;
+}
+
+/* set up the remote side of a vring, out of what the host allocated */
+static void sim_rproc_init_vring(struct sim_rproc_vring *svr,
+					struct rproc_vring *rvring)
+{
+	vring_init(&svr->vr, rvring->len, rvring->va, rvring->align);
+	svr->notifyid = rvring->notifyid;
+	svr->last_avail = 0;
+	svr->used = 0;
+}
+
+static int sim_rproc_start(struct rproc *rproc)
+{
+	struct sim_rproc *sim = rproc->priv;
+	struct rproc_vdev *rvdev;
+
+	/* the remote side only knows where its vrings are, like firmware */
+	rvdev = list_first_entry(&rproc->rvdevs, struct rproc_vdev, node);
+	sim_rproc_init_vring(&sim->rx, &rvdev->vring[0]);
+	sim_rproc_init_vring(&sim->tx, &rvdev->vring[1]);
+
+	sim->announced = false;
+	atomic_set(&sim->kicked, 0);
+
+	sim->thread = kthread_create(sim_rproc_thread, sim, "%s",
+							dev_name(&rproc->dev));
+	if (IS_ERR(sim->thread))
+		return PTR_ERR(sim->thread);
+
+	if (remote_cpu >= 0 && cpu_online(remote_cpu))
+		kthread_bind(sim->thread, remote_cpu);
+
+	wake_up_process(sim->thread);
+
+	return 0;
+}
+
+static int sim_rproc_stop(struct rproc *rproc)
+{
+	struct sim_rproc *sim = rproc->priv;
+
+	kthread_stop(sim->thread);
+
+	return 0;
+}
+
+/* kick the remote side, which looks at all its vrings anyway */
+static void sim_rproc_kick(struct rproc *rproc, int vqid)
+{
+	struct sim_rproc *sim = rproc->priv;
+
+	atomic_set(&sim->kicked, 1);
+	wake_up(&sim->wq);
+}
+
+/* the remote side's trace clock is the host's, in nsecs */
+static u64 sim_rproc_trace_clock(struct rproc *rproc)
+{
+	return sched_clock();
+}
+
+static struct rproc_ops sim_rproc_ops = {
+	.start		= sim_rproc_start,
+	.stop		= sim_rproc_stop,
+	.kick		= sim_rproc_kick,
+	.trace_clock	= sim_rproc_trace_clock,
+};
+
+/* the "firmware" is the resource table, there's nothing to load */
+static int sim_rproc_load(struct rproc *rproc, const struct firmware *fw)
+{
+	return 0;
+}
+
+static struct resource_table *
+sim_rproc_find_rsc_table(struct rproc *rproc, const struct firmware *fw,
+							int *tablesz)
+{
+	*tablesz = fw->size;
+
+	return (struct resource_table *)fw->data;
+}
+
+static const struct rproc_fw_ops sim_rproc_fw_ops = {
+	.load = sim_rproc_load,
+	.find_rsc_table = sim_rproc_find_rsc_table,
+};
+
+/* declare the rpmsg vdev, whose vrings are allocated by the host */
+static void sim_rproc_init_rsc(struct sim_rproc_rsc_table *rsc)
+{
+	int i;
+
+	rsc->table.ver = 1;
+	rsc->table.num = 1;
+	rsc->offset[0] = offsetof(struct sim_rproc_rsc_table, hdr);
+
+	rsc->hdr.type = RSC_VDEV;
+	rsc->vdev.id = VIRTIO_ID_RPMSG;
+	rsc->vdev.notifyid = FW_RSC_NOTIFY_ID_ANY;
+	rsc->vdev.dfeatures = 1 << VIRTIO_RPMSG_F_NS;
+	rsc->vdev.num_of_vrings = ARRAY_SIZE(rsc->vring);
+
+	for (i = 0; i < ARRAY_SIZE(rsc->vring); i++) {
+		rsc->vring[i].da = (u32)FW_RSC_ADDR_ANY;
+		rsc->vring[i].align = SIM_RPROC_VRING_ALIGN;
+		rsc->vring[i].num = SIM_RPROC_VRING_NUM;
+		rsc->vring[i].notifyid = FW_RSC_NOTIFY_ID_ANY;
+	}
+}
+
+static int __devinit sim_rproc_probe(struct platform_device *pdev)
+{
+	struct sim_rproc *sim;
+	struct rproc *rproc;
+	int ret;
+
+	/* the vrings and the rpmsg buffers are allocated for this device */
+	if (!pdev->dev.dma_mask) {
+		pdev->dev.coherent_dma_mask = DMA_BIT_MASK(32);
+		pdev->dev.dma_mask = &pdev->dev.coherent_dma_mask;
+	}
+
+	rproc = rproc_alloc(&pdev->dev, SIM_RPROC_NAME, &sim_rproc_ops,
+					SIM_RPROC_NAME "-fw", sizeof(*sim));
+	if (!rproc)
+		return -ENOMEM;
+
+	sim = rproc->priv;
+	sim->rproc = rproc;
+	init_waitqueue_head(&sim->wq);
+	sim_rproc_init_rsc(&sim->rsc);
+
+	rproc->fw_ops = &sim_rproc_fw_ops;
+	rproc->trace_clock_rate = NSEC_PER_SEC;
+
+	ret = rproc_set_preloaded_fw(rproc, &sim->rsc, sizeof(sim->rsc));
+	if (ret)
+		goto free_rproc;
+
+	platform_set_drvdata(pdev, rproc);
+
+	ret = rproc_add(rproc);
+	if (ret)
+		goto free_rproc;
+
+	return 0;
+
+free_rproc:
+	rproc_put(rproc);
+	return ret;
+}
+
+static int __devexit sim_rproc_remove(struct platform_device *pdev)
+{
+	struct rproc *rproc = platform_get_drvdata(pdev);
+
+	rproc_del(rproc);
+	rproc_put(rproc);
+
+	return 0;
+}
+
+static struct platform_driver sim_rproc_driver = {
+	.probe = sim_rproc_probe,
+	.remove = __devexit_p(sim_rproc_remove),
+	.driver = {
+		.name = SIM_RPROC_NAME,
+		.owner = THIS_MODULE,
+	},
+};
+
+/* there's no board to declare the simulated device: it's ours to add */
+static struct platform_device *sim_rproc_pdev;
+
+static int __init sim_rproc_init(void)
+{
+	int ret;
+
+	ret = platform_driver_register(&sim_rproc_driver);
+	if (ret)
+		return ret;
+
+	sim_rproc_pdev = platform_device_register_simple(SIM_RPROC_NAME, -1,
+								NULL, 0);
+	if (IS_ERR(sim_rproc_pdev)) {
+		platform_driver_unregister(&sim_rproc_driver);
+		return PTR_ERR(sim_rproc_pdev);
+	}
+
+	return 0;
+}
+module_init(sim_rproc_init);
+
+static void __exit sim_rproc_exit(void)
+{
+	platform_device_unregister(sim_rproc_pdev);
+	platform_driver_unregister(&sim_rproc_driver);
+}
+module_exit(sim_rproc_exit);
+
+MODULE_LICENSE("GPL v2");
+MODULE_DESCRIPTION("Simulated Remote Processor driver");
@@ -8,9 +8,12 @@
 #include <linux/dma-mapping.h>
 #include <linux/remoteproc.h>
 #include <linux/ste_modem_shm.h>
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/sched.h>
 #include "remoteproc_internal.h"
 
-#define SPROC_FW_SIZE (50 * 4096)
+#define SPROC_LOAD_CHUNK (64 * 1024)
 #define SPROC_MAX_TOC_ENTRIES 32
 #define SPROC_MAX_NOTIFY_ID 14
 #define SPROC_RESOURCE_NAME "rsc-table"
@@ -22,7 +25,17 @@
 #define sproc_err(sproc, fmt, ...) \
 	dev_err(&sproc->mdev->pdev.dev, fmt, ##__VA_ARGS__)
 
-/* STE-modem control structure */
+/*
+ * STE-modem control structure
+ * @fw_addr: the firmware region, at the start of the shared memory
+ * @fw_size: size of the firmware region, as reserved for the first image
+ * @fw_dma_addr: dma address of the firmware region
+ * @fw_attrs: attributes the firmware region is allocated with
+ * @toc: Table Of Content of the last image parsed, or NULL
+ * @rsc_entry: entry of the resource table in @toc
+ * @rsc_table: validated copy of the resource table of that image
+ * @image_size: size of that image
+ */
 struct sproc {
 	struct rproc *rproc;
 	struct ste_modem_device *mdev;
@@ -30,6 +43,11 @@ struct sproc {
 	void *fw_addr;
 	size_t fw_size;
 	dma_addr_t fw_dma_addr;
+	struct dma_attrs fw_attrs;
+	struct ste_toc *toc;
+	struct ste_toc_entry *rsc_entry;
+	struct resource_table *rsc_table;
+	size_t image_size;
 };
 
 /* STE-Modem firmware entry */
@@ -53,26 +71,91 @@ struct ste_toc {
 	struct ste_toc_entry table[SPROC_MAX_TOC_ENTRIES];
 };
 
+/*
+ * Reserve the firmware region for an image of @size bytes.
+ *
+ * STE-modem requires the firmware to be located at the start of the shared
+ * memory region, so the region is allocated when the first image is
+ * parsed, upon registration, before any vring is allocated. It can't grow
+ * afterwards.
+ */
+static int sproc_reserve_fw(struct sproc *sproc, size_t size)
+{
+	struct device *dev = sproc->rproc->dev.parent;
+
+	if (sproc->fw_addr) {
+		if (size <= sproc->fw_size)
+			return 0;
+
+		sproc_err(sproc, "Insufficient space for fw (%zd < %zd)\n",
+			  sproc->fw_size, size);
+		return -ENOSPC;
+	}
+
+	/*
+	 * The image is copied in in bulk, which is a lot faster through a
+	 * write-combining mapping than through an uncached one. The writes
+	 * are drained before the modem is started or kicked (sproc_flush()).
+	 */
+	init_dma_attrs(&sproc->fw_attrs);
+	dma_set_attr(DMA_ATTR_WRITE_COMBINE, &sproc->fw_attrs);
+
+	sproc->fw_addr = dma_alloc_attrs(dev, PAGE_ALIGN(size),
+					 &sproc->fw_dma_addr, GFP_KERNEL,
+					 &sproc->fw_attrs);
+	if (!sproc->fw_addr) {
+		sproc_err(sproc, "Cannot allocate memory for fw\n");
+		return -ENOMEM;
+	}
+
+	sproc->fw_size = PAGE_ALIGN(size);
+
+	return 0;
+}
+
+/*
+ * Make the writes to the (write-combined) firmware region, e.g. of the
+ * image or of its resource table, visible to the modem before it's told
+ * to look at them.
+ */
+static inline void sproc_flush(struct sproc *sproc)
+{
+	wmb();
+}
+
 /* Loads the firmware to shared memory. */
 static int sproc_load_segments(struct rproc *rproc, const struct firmware *fw)
 {
 	struct sproc *sproc = rproc->priv;
 
-	memcpy(sproc->fw_addr, fw->data, fw->size);
+	if (fw->size > sproc->fw_size)
+		return -ENOSPC;
+
+	/* it may have been read straight into shared memory already */
+	if (fw->data != sproc->fw_addr)
+		memcpy(sproc->fw_addr, fw->data, fw->size);
 
 	return 0;
 }
 
-/* Find the entry for resource table in the Table of Content */
-static struct ste_toc_entry *sproc_find_rsc_entry(const struct firmware *fw)
+/*
+ * Once the firmware region is reserved, images are read right into it
+ * rather than into a copy, unless they're streamed there anyway.
+ */
+static void *sproc_load_buf(struct rproc *rproc, size_t *size)
 {
-	int i;
-	struct ste_toc *toc;
+	struct sproc *sproc = rproc->priv;
 
-	if (!fw)
-		return NULL;
+	*size = sproc->fw_size;
+
+	return sproc->fw_addr;
+}
 
-	toc = (void *)fw->data;
+/* Find the entry for resource table in the Table of Content */
+static struct ste_toc_entry *sproc_find_rsc_entry(struct ste_toc *toc,
+						  size_t size)
+{
+	int i;
 
 	/* Search the table for the resource table */
 	for (i = 0; i < SPROC_MAX_TOC_ENTRIES &&
@@ -80,7 +163,7 @@ static struct ste_toc_entry *sproc_find_rsc_entry(const struct firmware *fw)
 
 		if (!strncmp(toc->table[i].name, SPROC_RESOURCE_NAME,
 			     sizeof(toc->table[i].name))) {
-			if (toc->table[i].start > fw->size)
+			if (toc->table[i].start > size)
 				return NULL;
 			return &toc->table[i];
 		}
@@ -89,70 +172,288 @@ static struct ste_toc_entry *sproc_find_rsc_entry(const struct firmware *fw)
 	return NULL;
 }
 
+/* Sanity check the resource table of an image of @size bytes */
+static int sproc_check_rsc_table(struct sproc *sproc,
+				 struct ste_toc_entry *entry,
+				 const struct resource_table *table,
+				 size_t size)
+{
+	/* we don't support any version beyond the first */
+	if (table->ver != 1) {
+		sproc_err(sproc, "unsupported fw ver: %d\n", table->ver);
+		return -EINVAL;
+	}
+
+	/* make sure reserved bytes are zeroes */
+	if (table->reserved[0] || table->reserved[1]) {
+		sproc_err(sproc, "non zero reserved bytes\n");
+		return -EINVAL;
+	}
+
+	/* make sure the offsets array isn't truncated */
+	if (table->num > SPROC_MAX_TOC_ENTRIES ||
+	    table->num * sizeof(table->offset[0]) +
+	    sizeof(struct resource_table) > entry->size) {
+		sproc_err(sproc, "resource table incomplete\n");
+		return -EINVAL;
+	}
+
+	return sproc_reserve_fw(sproc, size);
+}
+
+/* Sanity check size and offset of resource table */
+static bool sproc_rsc_entry_ok(struct ste_toc_entry *entry, size_t size)
+{
+	return entry->size <= size &&
+	       entry->start + entry->size <= size &&
+	       entry->start + entry->size >= entry->start &&
+	       sizeof(struct resource_table) <= entry->size;
+}
+
+/* Find and sanity check the resource table entry of an image's TOC */
+static struct ste_toc_entry *sproc_parse_toc(struct sproc *sproc,
+					     struct ste_toc *toc, size_t size)
+{
+	struct ste_toc_entry *entry;
+
+	entry = sproc_find_rsc_entry(toc, size);
+	if (!entry) {
+		sproc_err(sproc, "resource table not found in fw\n");
+		return NULL;
+	}
+
+	if (!sproc_rsc_entry_ok(entry, size)) {
+		sproc_err(sproc, "bad size of fw or resource table\n");
+		return NULL;
+	}
+
+	return entry;
+}
+
+/*
+ * The TOC and resource table of the last image parsed are kept, so an
+ * image is only looked up and validated once: when it's requested upon
+ * registration, and then streamed upon boot, it's recognized as the same.
+ * Since images are compared in full (size, TOC and resource table), a
+ * stale cache only costs a miss.
+ */
+
+/* Is the image of @size bytes, with @toc and @table, the one cached? */
+static bool sproc_image_cached(struct sproc *sproc, const struct ste_toc *toc,
+			       const void *table, size_t size)
+{
+	return sproc->toc && size == sproc->image_size &&
+	       !memcmp(toc, sproc->toc, sizeof(*toc)) &&
+	       !memcmp(table, sproc->rsc_table, sproc->rsc_entry->size);
+}
+
+/* The cached entry, as found in @toc, if it's the TOC of the cached image */
+static struct ste_toc_entry *sproc_cached_entry(struct sproc *sproc,
+						struct ste_toc *toc,
+						size_t size)
+{
+	if (!sproc->toc || size != sproc->image_size ||
+	    memcmp(toc, sproc->toc, sizeof(*toc)))
+		return NULL;
+
+	return &toc->table[sproc->rsc_entry - sproc->toc->table];
+}
+
+static void sproc_flush_image(struct sproc *sproc)
+{
+	kfree(sproc->toc);
+	kfree(sproc->rsc_table);
+	sproc->toc = NULL;
+	sproc->rsc_entry = NULL;
+	sproc->rsc_table = NULL;
+	sproc->image_size = 0;
+}
+
+/* Validate the resource table of an image, and cache the image */
+static int sproc_cache_image(struct sproc *sproc, const struct ste_toc *toc,
+			     struct ste_toc_entry *entry,
+			     const struct resource_table *table, size_t size)
+{
+	struct resource_table *rsc_table;
+	struct ste_toc *toc_copy;
+	int ret;
+
+	ret = sproc_check_rsc_table(sproc, entry, table, size);
+	if (ret)
+		return ret;
+
+	toc_copy = kmemdup(toc, sizeof(*toc), GFP_KERNEL);
+	rsc_table = kmemdup(table, entry->size, GFP_KERNEL);
+	if (!toc_copy || !rsc_table) {
+		kfree(toc_copy);
+		kfree(rsc_table);
+		return -ENOMEM;
+	}
+
+	sproc_flush_image(sproc);
+
+	sproc->toc = toc_copy;
+	sproc->rsc_entry = &toc_copy->table[entry - toc->table];
+	sproc->rsc_table = rsc_table;
+	sproc->image_size = size;
+
+	return 0;
+}
+
 /* Find the resource table inside the remote processor's firmware. */
 static struct resource_table *
 sproc_find_rsc_table(struct rproc *rproc, const struct firmware *fw,
 		     int *tablesz)
 {
 	struct sproc *sproc = rproc->priv;
-	struct resource_table *table;
+	struct ste_toc *toc = (void *)fw->data;
 	struct ste_toc_entry *entry;
+	struct resource_table *table;
 
-	entry = sproc_find_rsc_entry(fw);
-	if (!entry) {
+	if (fw->size < sizeof(*toc)) {
 		sproc_err(sproc, "resource table not found in fw\n");
 		return NULL;
 	}
 
+	entry = sproc_cached_entry(sproc, toc, fw->size);
+	if (!entry)
+		entry = sproc_parse_toc(sproc, toc, fw->size);
+	if (!entry)
+		return NULL;
+
 	table = (void *)(fw->data + entry->start);
 
-	/* sanity check size and offset of resource table */
-	if (entry->start > SPROC_FW_SIZE ||
-	    entry->size > SPROC_FW_SIZE ||
-	    fw->size > SPROC_FW_SIZE ||
-	    entry->start + entry->size > fw->size ||
-	    sizeof(struct resource_table) > entry->size) {
-		sproc_err(sproc, "bad size of fw or resource table\n");
+	if (!sproc_image_cached(sproc, toc, table, fw->size) &&
+	    sproc_cache_image(sproc, toc, entry, table, fw->size))
 		return NULL;
+
+	*tablesz = entry->size;
+
+	return table;
+}
+
+/*
+ * Parse the firmware file: only its Table Of Content and its resource table
+ * are read, the rest is streamed into shared memory upon boot.
+ */
+static int sproc_parse_stream(struct rproc *rproc, struct file *file,
+			      struct rproc_fw_image *image)
+{
+	struct sproc *sproc = rproc->priv;
+	struct ste_toc_entry *entry;
+	struct resource_table *table;
+	struct ste_toc *toc;
+	size_t size;
+	int ret;
+
+	/* packed images aren't supported (see sproc_fw_ops) */
+	if (!file)
+		return -EINVAL;
+
+	size = i_size_read(file->f_path.dentry->d_inode);
+	if (size < sizeof(*toc)) {
+		sproc_err(sproc, "resource table not found in fw\n");
+		return -EINVAL;
 	}
 
-	/* we don't support any version beyond the first */
-	if (table->ver != 1) {
-		sproc_err(sproc, "unsupported fw ver: %d\n", table->ver);
-		return NULL;
+	toc = kmalloc(sizeof(*toc), GFP_KERNEL);
+	if (!toc)
+		return -ENOMEM;
+
+	ret = kernel_read(file, 0, (char *)toc, sizeof(*toc));
+	if (ret != sizeof(*toc)) {
+		ret = ret < 0 ? ret : -EIO;
+		goto free_toc;
 	}
 
-	/* make sure reserved bytes are zeroes */
-	if (table->reserved[0] || table->reserved[1]) {
-		sproc_err(sproc, "non zero reserved bytes\n");
-		return NULL;
+	/* the image was most likely parsed already, upon registration */
+	entry = sproc_cached_entry(sproc, toc, size);
+	if (!entry)
+		entry = sproc_parse_toc(sproc, toc, size);
+	if (!entry) {
+		ret = -EINVAL;
+		goto free_toc;
 	}
 
-	/* make sure the offsets array isn't truncated */
-	if (table->num > SPROC_MAX_TOC_ENTRIES ||
-	    table->num * sizeof(table->offset[0]) +
-	    sizeof(struct resource_table) > entry->size) {
-		sproc_err(sproc, "resource table incomplete\n");
-		return NULL;
+	table = kmalloc(entry->size, GFP_KERNEL);
+	if (!table) {
+		ret = -ENOMEM;
+		goto free_toc;
 	}
 
-	/* If the fw size has grown, release the previous fw allocation */
-	if (SPROC_FW_SIZE < fw->size) {
-		sproc_err(sproc, "Insufficient space for fw (%d < %zd)\n",
-			  SPROC_FW_SIZE, fw->size);
-		return NULL;
+	ret = kernel_read(file, entry->start, (char *)table, entry->size);
+	if (ret != entry->size) {
+		ret = ret < 0 ? ret : -EIO;
+		goto free_table;
 	}
 
-	sproc->fw_size = fw->size;
-	*tablesz = entry->size;
+	if (!sproc_image_cached(sproc, toc, table, size)) {
+		ret = sproc_cache_image(sproc, toc, entry, table, size);
+		if (ret)
+			goto free_table;
+	}
 
-	return table;
+	image->table = table;
+	image->tablesz = entry->size;
+	image->size = size;
+
+	kfree(toc);
+	return 0;
+
+free_table:
+	kfree(table);
+free_toc:
+	kfree(toc);
+	return ret;
+}
+
+/*
+ * Stream the firmware file straight into shared memory, chunk by chunk,
+ * then put the resource table, as it was handled, back in place.
+ */
+static int sproc_load_stream(struct rproc *rproc, struct file *file,
+			     struct rproc_fw_image *image)
+{
+	struct sproc *sproc = rproc->priv;
+	size_t offset, len;
+	int ret;
+
+	if (!file || image->size > sproc->fw_size ||
+	    image->size != sproc->image_size)
+		return -EINVAL;
+
+	for (offset = 0; offset < image->size; offset += ret) {
+		len = min_t(size_t, image->size - offset, SPROC_LOAD_CHUNK);
+
+		ret = kernel_read(file, offset, sproc->fw_addr + offset, len);
+		if (ret <= 0) {
+			sproc_err(sproc, "failed to read fw: %d\n", ret);
+			return ret ? ret : -EIO;
+		}
+
+		cond_resched();
+	}
+
+	memcpy(sproc->fw_addr + sproc->rsc_entry->start, image->table,
+	       image->tablesz);
+
+	return 0;
+}
+
+static void sproc_free_stream(struct rproc *rproc,
+			      struct rproc_fw_image *image)
+{
+	kfree(image->table);
 }
 
 /* STE modem firmware handler operations */
 const struct rproc_fw_ops sproc_fw_ops = {
 	.load = sproc_load_segments,
 	.find_rsc_table = sproc_find_rsc_table,
+	.parse_stream = sproc_parse_stream,
+	.load_stream = sproc_load_stream,
+	.free_stream = sproc_free_stream,
+	.load_buf = sproc_load_buf,
 };
 
 /* Kick the modem with specified notification id */
@@ -162,6 +463,8 @@ static void sproc_kick(struct rproc *rproc, int vqid)
 
 	sproc_dbg(sproc, "kick vqid:%d\n", vqid);
 
+	sproc_flush(sproc);
+
 	/*
 	 * We need different notification IDs for RX and TX so add
 	 * an offset on TX notification IDs.
@@ -178,8 +481,32 @@ static void sproc_kick_callback(struct ste_modem_device *mdev, int vqid)
 		sproc_dbg(sproc, "no message was found in vqid %d\n", vqid);
 }
 
+/* Kick the modem once, for all the virtqueues set in @vqids */
+static void sproc_kick_vqs(struct rproc *rproc, unsigned long vqids)
+{
+	struct sproc *sproc = rproc->priv;
+
+	sproc_dbg(sproc, "ring doorbell vqids:0x%lx\n", vqids);
+
+	sproc_flush(sproc);
+
+	sproc->mdev->ops.doorbell(sproc->mdev, vqids);
+}
+
+/* The modem rang our doorbell, kick all the virtqueues it signals */
+static void sproc_doorbell_callback(struct ste_modem_device *mdev,
+				    unsigned long vqids)
+{
+	struct sproc *sproc = mdev->drv_data;
+
+	if (rproc_vqs_interrupt(sproc->rproc, vqids) == IRQ_NONE)
+		sproc_dbg(sproc, "no message was found in vqids 0x%lx\n",
+			  vqids);
+}
+
 struct ste_modem_dev_cb sproc_dev_cb = {
 	.kick = sproc_kick_callback,
+	.doorbell = sproc_doorbell_callback,
 };
 
 /* Start the STE modem */
@@ -190,6 +517,18 @@ static int sproc_start(struct rproc *rproc)
 
 	sproc_dbg(sproc, "start ste-modem\n");
 
+	/* A doorbell covers all the vrings, with one bit each */
+	if (sproc->mdev->ops.doorbell) {
+		if (rproc->max_notifyid >= BITS_PER_LONG) {
+			sproc_err(sproc, "Notification IDs too high:%d\n",
+				  rproc->max_notifyid);
+			return -EINVAL;
+		}
+
+		sproc_flush(sproc);
+		return sproc->mdev->ops.power(sproc->mdev, true);
+	}
+
 	/* Sanity test the max_notifyid */
 	if (rproc->max_notifyid > SPROC_MAX_NOTIFY_ID) {
 		sproc_err(sproc, "Notification IDs too high:%d\n",
@@ -208,6 +547,7 @@ static int sproc_start(struct rproc *rproc)
 	}
 
 	/* Request modem start-up*/
+	sproc_flush(sproc);
 	return sproc->mdev->ops.power(sproc->mdev, true);
 }
 
@@ -226,6 +566,18 @@ static struct rproc_ops sproc_ops = {
 	.kick		= sproc_kick,
 };
 
+/*
+ * Modems with a doorbell get the kicks of all their vrings coalesced by
+ * remoteproc, and sent with a single ring (all the vrings fit in the
+ * doorbell's bitmask, see sproc_start(), so .kick is never called).
+ */
+static struct rproc_ops sproc_doorbell_ops = {
+	.start		= sproc_start,
+	.stop		= sproc_stop,
+	.kick		= sproc_kick,
+	.kick_vqs	= sproc_kick_vqs,
+};
+
 /* STE modem device is unregistered */
 static int sproc_drv_remove(struct platform_device *pdev)
 {
@@ -240,6 +592,14 @@ static int sproc_drv_remove(struct platform_device *pdev)
 
 	/* Unregister as remoteproc device */
 	rproc_del(sproc->rproc);
+
+	if (sproc->fw_addr)
+		dma_free_attrs(sproc->rproc->dev.parent, sproc->fw_size,
+			       sproc->fw_addr, sproc->fw_dma_addr,
+			       &sproc->fw_attrs);
+
+	sproc_flush_image(sproc);
+
 	rproc_put(sproc->rproc);
 
 	mdev->drv_data = NULL;
@@ -252,19 +612,24 @@ static int sproc_probe(struct platform_device *pdev)
 {
 	struct ste_modem_device *mdev =
 		container_of(pdev, struct ste_modem_device, pdev);
+	struct rproc_ops *ops = &sproc_ops;
 	struct sproc *sproc;
 	struct rproc *rproc;
 	int err;
 
 	dev_dbg(&mdev->pdev.dev, "probe ste-modem\n");
 
-	if (!mdev->ops.setup || !mdev->ops.kick || !mdev->ops.kick_subscribe ||
-	    !mdev->ops.power) {
+	if (!mdev->ops.setup || !mdev->ops.power ||
+	    (!mdev->ops.doorbell &&
+	     (!mdev->ops.kick || !mdev->ops.kick_subscribe))) {
 		dev_err(&mdev->pdev.dev, "invalid mdev ops\n");
 		return -EINVAL;
 	}
 
-	rproc = rproc_alloc(&mdev->pdev.dev, mdev->pdev.name, &sproc_ops,
+	if (mdev->ops.doorbell)
+		ops = &sproc_doorbell_ops;
+
+	rproc = rproc_alloc(&mdev->pdev.dev, mdev->pdev.name, ops,
 			    SPROC_MODEM_FIRMWARE, sizeof(*sproc));
 	if (!rproc)
 		return -ENOMEM;
@@ -281,18 +646,17 @@ static int sproc_probe(struct platform_device *pdev)
 	rproc->fw_ops = &sproc_fw_ops;
 
 	/*
-	 * STE-modem requires the firmware to be located
-	 * at the start of the shared memory region. So we need to
-	 * reserve space for firmware at the start.
+	 * Boot by streaming the firmware file into shared memory, rather
+	 * than out of a whole in-memory copy of it. The firmware region is
+	 * reserved when the image is first parsed (see sproc_reserve_fw()).
 	 */
-	sproc->fw_addr = dma_alloc_coherent(rproc->dev.parent, SPROC_FW_SIZE,
-					    &sproc->fw_dma_addr,
-					    GFP_KERNEL);
-	if (!sproc->fw_addr) {
-		sproc_err(sproc, "Cannot allocate memory for fw\n");
-		err = -ENOMEM;
-		goto free_rproc;
-	}
+	rproc->stream_fw = true;
+
+	/*
+	 * Restart a crashed modem underneath its virtio devices, rather than
+	 * removing them: the CAIF interfaces stay around across the restart.
+	 */
+	rproc->fast_recovery = true;
 
 	/* Register as a remoteproc device */
 	err = rproc_add(rproc);
@@ -0,0 +1,785 @@
+/*
+ * Remote processor messaging - character device interface
+ *
+ * Exposes every "rpmsg-char" channel as a /dev/rpmsgN character device,
+ * so user space can exchange messages with the remote processor without
+ * a dedicated kernel driver.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#define pr_fmt(fmt) "%s: " fmt, __func__
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/device.h>
+#include <linux/cdev.h>
+#include <linux/fs.h>
+#include <linux/idr.h>
+#include <linux/list.h>
+#include <linux/kref.h>
+#include <linux/mm.h>
+#include <linux/poll.h>
+#include <linux/rwsem.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/splice.h>
+#include <linux/uio.h>
+#include <linux/wait.h>
+#include <linux/rpmsg.h>
+
+/* up to 256 rpmsg char devices */
+#define RPMSG_CHAR_MAX_MINORS	256
+
+/*
+ * Don't let an idle reader pin an unbounded amount of memory: once that
+ * many messages are waiting to be read, newer ones are dropped.
+ */
+#define RPMSG_CHAR_MAX_QUEUED	64
+
+/* the biggest message user space may hand us in a single iovec entry */
+#define RPMSG_CHAR_MAX_MSG	PAGE_SIZE
+
+/* writev() of more entries than this is sent in several batches */
+#define RPMSG_CHAR_MAX_BATCH	16
+
+/**
+ * struct rpmsg_char_dev - a character device exposing an rpmsg channel
+ * @rpdev: the underlying rpmsg channel, or NULL once it is removed
+ * @refcount: one reference for the channel, and one for every open file
+ * @cdev: the character device
+ * @dev: the device node, i.e. /dev/rpmsgN
+ * @minor: minor number of @cdev
+ * @rpdev_sem: protects @rpdev against removal while messages are sent
+ * @queue_lock: protects @queue and @num_queued
+ * @queue: incoming messages, waiting to be read
+ * @num_queued: number of messages in @queue
+ * @readq: readers sleep here until a message is available
+ * @mtu: the biggest message splice_write() sends, or 0 if it can't tell
+ */
+struct rpmsg_char_dev {
+	struct rpmsg_channel *rpdev;
+	struct kref refcount;
+	struct cdev cdev;
+	struct device *dev;
+	int minor;
+	struct rw_semaphore rpdev_sem;
+	spinlock_t queue_lock;
+	struct list_head queue;
+	int num_queued;
+	wait_queue_head_t readq;
+	int mtu;
+};
+
+/**
+ * struct rpmsg_char_msg - an incoming message
+ * @node: linked into the queue of the char device
+ * @len: length of @data
+ * @off: how much of @data was spliced already
+ * @held: true if @data is still in its rx buffer (see rpmsg_hold_rx_buf())
+ * @data: the payload of the message: in its rx buffer, or in @buf
+ * @buf: a copy of the payload, if its rx buffer couldn't be held
+ */
+struct rpmsg_char_msg {
+	struct list_head node;
+	int len;
+	int off;
+	bool held;
+	void *data;
+	u8 buf[0];
+};
+
+static struct class *rpmsg_char_class;
+static dev_t rpmsg_char_devt;
+static DEFINE_IDR(rpmsg_char_minors);
+static DEFINE_MUTEX(rpmsg_char_minors_lock);
+
+static void rpmsg_char_release_dev(struct kref *kref)
+{
+	struct rpmsg_char_dev *cdev = container_of(kref, struct rpmsg_char_dev,
+								refcount);
+	struct rpmsg_char_msg *msg, *tmp;
+
+	list_for_each_entry_safe(msg, tmp, &cdev->queue, node)
+		kfree(msg);
+
+	kfree(cdev);
+}
+
+/* pop the oldest incoming message, if any */
+static struct rpmsg_char_msg *rpmsg_char_dequeue(struct rpmsg_char_dev *cdev)
+{
+	struct rpmsg_char_msg *msg = NULL;
+	unsigned long flags;
+
+	spin_lock_irqsave(&cdev->queue_lock, flags);
+	if (!list_empty(&cdev->queue)) {
+		msg = list_first_entry(&cdev->queue, struct rpmsg_char_msg,
+									node);
+		list_del(&msg->node);
+		cdev->num_queued--;
+	}
+	spin_unlock_irqrestore(&cdev->queue_lock, flags);
+
+	return msg;
+}
+
+/* true if there's something to read, or the channel is gone */
+static bool rpmsg_char_readable(struct rpmsg_char_dev *cdev)
+{
+	return !list_empty(&cdev->queue) || !cdev->rpdev;
+}
+
+/* put back a message that was only partly spliced, to be read first */
+static void rpmsg_char_requeue(struct rpmsg_char_dev *cdev,
+				struct rpmsg_char_msg *msg)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&cdev->queue_lock, flags);
+	list_add(&msg->node, &cdev->queue);
+	cdev->num_queued++;
+	spin_unlock_irqrestore(&cdev->queue_lock, flags);
+}
+
+/* free a message, and give its rx buffer back if it was held */
+static void rpmsg_char_free_msg(struct rpmsg_channel *rpdev,
+				struct rpmsg_char_msg *msg)
+{
+	if (msg->held)
+		rpmsg_release_rx_buf(rpdev, msg->data);
+
+	kfree(msg);
+}
+
+/*
+ * Wait for an incoming message, and pop it. On success, rpdev_sem is held
+ * (for reading) until the caller is done with the message, so its rx
+ * buffer can still be given back to the channel.
+ */
+static struct rpmsg_char_msg *rpmsg_char_get_msg(struct rpmsg_char_dev *cdev,
+								bool nonblock)
+{
+	struct rpmsg_char_msg *msg;
+	int ret;
+
+	for (;;) {
+		down_read(&cdev->rpdev_sem);
+		if (!cdev->rpdev) {
+			up_read(&cdev->rpdev_sem);
+			return ERR_PTR(-ENODEV);
+		}
+
+		msg = rpmsg_char_dequeue(cdev);
+		if (msg)
+			return msg;
+		up_read(&cdev->rpdev_sem);
+
+		if (nonblock)
+			return ERR_PTR(-EAGAIN);
+
+		ret = wait_event_interruptible(cdev->readq,
+						rpmsg_char_readable(cdev));
+		if (ret)
+			return ERR_PTR(ret);
+	}
+}
+
+static int rpmsg_char_open(struct inode *inode, struct file *filp)
+{
+	struct rpmsg_char_dev *cdev = container_of(inode->i_cdev,
+						struct rpmsg_char_dev, cdev);
+
+	down_read(&cdev->rpdev_sem);
+	if (!cdev->rpdev) {
+		up_read(&cdev->rpdev_sem);
+		return -ENODEV;
+	}
+	kref_get(&cdev->refcount);
+	up_read(&cdev->rpdev_sem);
+
+	filp->private_data = cdev;
+
+	return nonseekable_open(inode, filp);
+}
+
+static int rpmsg_char_release(struct inode *inode, struct file *filp)
+{
+	struct rpmsg_char_dev *cdev = filp->private_data;
+
+	kref_put(&cdev->refcount, rpmsg_char_release_dev);
+
+	return 0;
+}
+
+/*
+ * Every read() (or readv()) returns a single message, scattered over the
+ * supplied iovec. A message that doesn't fit is truncated, as with
+ * datagram sockets.
+ */
+static ssize_t rpmsg_char_aio_read(struct kiocb *iocb, const struct iovec *iv,
+					unsigned long count, loff_t pos)
+{
+	struct file *filp = iocb->ki_filp;
+	struct rpmsg_char_dev *cdev = filp->private_data;
+	struct rpmsg_char_msg *msg;
+	size_t len, copied = 0;
+	int ret;
+
+	msg = rpmsg_char_get_msg(cdev, filp->f_flags & O_NONBLOCK);
+	if (IS_ERR(msg))
+		return PTR_ERR(msg);
+
+	for (ret = 0; count && msg->off + copied < msg->len; iv++, count--) {
+		len = min_t(size_t, iv->iov_len, msg->len - msg->off - copied);
+
+		if (copy_to_user(iv->iov_base, msg->data + msg->off + copied,
+									len)) {
+			ret = -EFAULT;
+			break;
+		}
+
+		copied += len;
+	}
+
+	rpmsg_char_free_msg(cdev->rpdev, msg);
+	up_read(&cdev->rpdev_sem);
+
+	return ret ? ret : copied;
+}
+
+static const struct pipe_buf_operations rpmsg_char_pipe_buf_ops = {
+	.can_merge	= 0,
+	.map		= generic_pipe_buf_map,
+	.unmap		= generic_pipe_buf_unmap,
+	.confirm	= generic_pipe_buf_confirm,
+	.release	= generic_pipe_buf_release,
+	.steal		= generic_pipe_buf_steal,
+	.get		= generic_pipe_buf_get,
+};
+
+/*
+ * splice() (or sendfile()) from the device streams the incoming messages,
+ * back to back, into as many pages as the pipe has room for: they are
+ * copied once, from their rx buffers, rather than through user space.
+ * Message boundaries are lost; a message that isn't spliced entirely is
+ * left in the queue, and its remainder is what's read next.
+ */
+static ssize_t rpmsg_char_splice_read(struct file *filp, loff_t *ppos,
+				struct pipe_inode_info *pipe, size_t len,
+				unsigned int flags)
+{
+	struct rpmsg_char_dev *cdev = filp->private_data;
+	struct page *pages[PIPE_DEF_BUFFERS];
+	struct partial_page partial[PIPE_DEF_BUFFERS];
+	struct splice_pipe_desc spd = {
+		.pages		= pages,
+		.partial	= partial,
+		.nr_pages_max	= PIPE_DEF_BUFFERS,
+		.flags		= flags,
+		.ops		= &rpmsg_char_pipe_buf_ops,
+		.spd_release	= spd_release_page,
+	};
+	struct rpmsg_char_msg *msg;
+	struct partial_page *cur = NULL;
+	struct page *page;
+	size_t count;
+	ssize_t ret;
+
+	if (splice_grow_spd(pipe, &spd))
+		return -ENOMEM;
+
+	/* only wait for the first message: then take what's there already */
+	msg = rpmsg_char_get_msg(cdev, filp->f_flags & O_NONBLOCK ||
+						flags & SPLICE_F_NONBLOCK);
+	if (IS_ERR(msg)) {
+		ret = PTR_ERR(msg);
+		goto shrink;
+	}
+
+	while (msg && len) {
+		/* start a new page once the current one is full */
+		if (!cur || cur->len == PAGE_SIZE) {
+			if (spd.nr_pages == spd.nr_pages_max)
+				break;
+
+			page = alloc_page(GFP_KERNEL);
+			if (!page)
+				break;
+
+			cur = &spd.partial[spd.nr_pages];
+			cur->offset = 0;
+			cur->len = 0;
+			spd.pages[spd.nr_pages++] = page;
+		}
+
+		count = min_t(size_t, len, PAGE_SIZE - cur->len);
+		count = min_t(size_t, count, msg->len - msg->off);
+		memcpy(page_address(spd.pages[spd.nr_pages - 1]) + cur->len,
+						msg->data + msg->off, count);
+		cur->len += count;
+		msg->off += count;
+		len -= count;
+
+		if (msg->off < msg->len)
+			continue;
+
+		rpmsg_char_free_msg(cdev->rpdev, msg);
+		msg = rpmsg_char_dequeue(cdev);
+	}
+
+	if (msg)
+		rpmsg_char_requeue(cdev, msg);
+
+	up_read(&cdev->rpdev_sem);
+
+	ret = spd.nr_pages ? splice_to_pipe(pipe, &spd) : -ENOMEM;
+shrink:
+	splice_shrink_spd(&spd);
+	return ret;
+}
+
+/*
+ * send the @num (at most RPMSG_CHAR_MAX_BATCH) entries of @iv as a batch,
+ * i.e. with a single kick of the remote processor.
+ *
+ * Returns the number of messages sent, and their length in @sent, or an
+ * error if none was.
+ */
+static int rpmsg_char_write_batch(struct file *filp, const struct iovec *iv,
+					unsigned long num, ssize_t *sent)
+{
+	struct rpmsg_char_dev *cdev = filp->private_data;
+	struct rpmsg_batch_msg msgs[RPMSG_CHAR_MAX_BATCH];
+	int i, ret;
+
+	memset(msgs, 0, sizeof(msgs));
+	*sent = 0;
+
+	for (i = 0; i < num; i++) {
+		if (iv[i].iov_len > RPMSG_CHAR_MAX_MSG) {
+			ret = -EMSGSIZE;
+			goto free_msgs;
+		}
+
+		msgs[i].len = iv[i].iov_len;
+		msgs[i].data = kmalloc(msgs[i].len, GFP_KERNEL);
+		if (!msgs[i].data) {
+			ret = -ENOMEM;
+			goto free_msgs;
+		}
+
+		if (copy_from_user(msgs[i].data, iv[i].iov_base, msgs[i].len)) {
+			ret = -EFAULT;
+			goto free_msgs;
+		}
+	}
+
+	down_read(&cdev->rpdev_sem);
+
+	if (!cdev->rpdev) {
+		ret = -ENODEV;
+		goto unlock;
+	}
+
+	for (i = 0; i < num; i++)
+		msgs[i].dst = cdev->rpdev->dst;
+
+	if (filp->f_flags & O_NONBLOCK)
+		ret = rpmsg_trysend_batch(cdev->rpdev, msgs, num);
+	else
+		ret = rpmsg_send_batch(cdev->rpdev, msgs, num);
+
+	for (i = 0; i < ret; i++)
+		*sent += msgs[i].len;
+
+unlock:
+	up_read(&cdev->rpdev_sem);
+free_msgs:
+	for (i = 0; i < num; i++)
+		kfree(msgs[i].data);
+
+	return ret;
+}
+
+/*
+ * Every entry of a writev() iovec is sent as a separate message, and the
+ * iovec is sent in batches of up to RPMSG_CHAR_MAX_BATCH messages, i.e.
+ * with a single kick of the remote processor per batch. A plain write()
+ * is simply a single message.
+ */
+static ssize_t rpmsg_char_aio_write(struct kiocb *iocb, const struct iovec *iv,
+					unsigned long count, loff_t pos)
+{
+	struct file *filp = iocb->ki_filp;
+	unsigned long num, done = 0;
+	ssize_t sent, total = 0;
+	int ret;
+
+	while (done < count) {
+		num = min_t(unsigned long, count - done, RPMSG_CHAR_MAX_BATCH);
+
+		ret = rpmsg_char_write_batch(filp, iv + done, num, &sent);
+		if (ret < 0)
+			return total ? total : ret;
+
+		total += sent;
+		done += ret;
+
+		/* the rest didn't make it either (e.g. out of buffers) */
+		if (ret < num)
+			break;
+	}
+
+	return total;
+}
+
+/* send what a pipe buffer holds, in messages as big as the channel allows */
+static int rpmsg_char_pipe_to_msgs(struct pipe_inode_info *pipe,
+			struct pipe_buffer *buf, struct splice_desc *sd)
+{
+	struct file *filp = sd->u.file;
+	struct rpmsg_char_dev *cdev = filp->private_data;
+	bool nonblock = filp->f_flags & O_NONBLOCK ||
+					sd->flags & SPLICE_F_NONBLOCK;
+	unsigned int sent = 0, count;
+	void *data;
+	int ret;
+
+	ret = buf->ops->confirm(pipe, buf);
+	if (ret)
+		return ret;
+
+	data = buf->ops->map(pipe, buf, 0) + buf->offset;
+
+	while (sent < sd->len) {
+		count = min_t(unsigned int, sd->len - sent, cdev->mtu);
+
+		if (nonblock)
+			ret = rpmsg_trysend(cdev->rpdev, data + sent, count);
+		else
+			ret = rpmsg_send(cdev->rpdev, data + sent, count);
+		if (ret)
+			break;
+
+		sent += count;
+	}
+
+	buf->ops->unmap(pipe, buf, data - buf->offset);
+
+	return sent ? sent : ret;
+}
+
+/*
+ * splice() (or sendfile()) to the device sends the data as a stream of
+ * messages, each filling up a tx buffer, which the data is copied to
+ * straight from the pages of the pipe.
+ */
+static ssize_t rpmsg_char_splice_write(struct pipe_inode_info *pipe,
+				struct file *filp, loff_t *ppos, size_t len,
+				unsigned int flags)
+{
+	struct rpmsg_char_dev *cdev = filp->private_data;
+	ssize_t ret;
+
+	if (!cdev->mtu)
+		return -EINVAL;
+
+	down_read(&cdev->rpdev_sem);
+
+	if (cdev->rpdev)
+		ret = splice_from_pipe(pipe, filp, ppos, len, flags,
+						rpmsg_char_pipe_to_msgs);
+	else
+		ret = -ENODEV;
+
+	up_read(&cdev->rpdev_sem);
+
+	return ret;
+}
+
+static unsigned int rpmsg_char_poll(struct file *filp, poll_table *wait)
+{
+	struct rpmsg_char_dev *cdev = filp->private_data;
+	unsigned int mask = 0;
+
+	poll_wait(filp, &cdev->readq, wait);
+
+	if (!list_empty(&cdev->queue))
+		mask |= POLLIN | POLLRDNORM;
+
+	if (!cdev->rpdev)
+		mask |= POLLHUP;
+	else
+		/*
+		 * tx buffers are shared by all channels, so we can't really
+		 * tell whether a write would block; claim it wouldn't.
+		 */
+		mask |= POLLOUT | POLLWRNORM;
+
+	return mask;
+}
+
+static const struct file_operations rpmsg_char_fops = {
+	.owner		= THIS_MODULE,
+	.open		= rpmsg_char_open,
+	.release	= rpmsg_char_release,
+	.read		= do_sync_read,
+	.aio_read	= rpmsg_char_aio_read,
+	.write		= do_sync_write,
+	.aio_write	= rpmsg_char_aio_write,
+	.splice_read	= rpmsg_char_splice_read,
+	.splice_write	= rpmsg_char_splice_write,
+	.poll		= rpmsg_char_poll,
+	.llseek		= no_llseek,
+};
+
+/* queue an incoming message until user space reads it */
+static void rpmsg_char_cb(struct rpmsg_channel *rpdev, void *data, int len,
+							void *priv, u32 src)
+{
+	struct rpmsg_char_dev *cdev = dev_get_drvdata(&rpdev->dev);
+	struct rpmsg_char_msg *msg;
+	unsigned long flags;
+
+	/* the channel is being removed */
+	if (!cdev)
+		return;
+
+	/* keep the message in its rx buffer, if we may */
+	if (!rpmsg_hold_rx_buf(rpdev, data)) {
+		msg = kmalloc(sizeof(*msg), GFP_ATOMIC);
+		if (!msg) {
+			rpmsg_release_rx_buf(rpdev, data);
+			goto nomem;
+		}
+		msg->held = true;
+		msg->data = data;
+	} else {
+		msg = kmalloc(sizeof(*msg) + len, GFP_ATOMIC);
+		if (!msg)
+			goto nomem;
+		msg->held = false;
+		msg->data = msg->buf;
+		memcpy(msg->buf, data, len);
+	}
+
+	msg->len = len;
+	msg->off = 0;
+
+	spin_lock_irqsave(&cdev->queue_lock, flags);
+	if (cdev->num_queued >= RPMSG_CHAR_MAX_QUEUED) {
+		spin_unlock_irqrestore(&cdev->queue_lock, flags);
+		dev_warn_ratelimited(&rpdev->dev, "rx queue full, msg dropped\n");
+		rpmsg_char_free_msg(rpdev, msg);
+		return;
+	}
+	list_add_tail(&msg->node, &cdev->queue);
+	cdev->num_queued++;
+	spin_unlock_irqrestore(&cdev->queue_lock, flags);
+
+	wake_up_interruptible(&cdev->readq);
+	return;
+
+nomem:
+	dev_err_ratelimited(&rpdev->dev, "dropping a %d bytes msg\n", len);
+}
+
+/*
+ * Drop the messages nobody read, giving their rx buffers back. Called once
+ * the callback is done with the cdev, and readers are done with @rpdev.
+ */
+static void rpmsg_char_drain(struct rpmsg_char_dev *cdev,
+				struct rpmsg_channel *rpdev)
+{
+	struct rpmsg_char_msg *msg;
+
+	while ((msg = rpmsg_char_dequeue(cdev)))
+		rpmsg_char_free_msg(rpdev, msg);
+}
+
+static int rpmsg_char_probe(struct rpmsg_channel *rpdev)
+{
+	struct rpmsg_char_dev *cdev;
+	int ret;
+
+	cdev = kzalloc(sizeof(*cdev), GFP_KERNEL);
+	if (!cdev)
+		return -ENOMEM;
+
+	cdev->rpdev = rpdev;
+	kref_init(&cdev->refcount);
+	init_rwsem(&cdev->rpdev_sem);
+	spin_lock_init(&cdev->queue_lock);
+	INIT_LIST_HEAD(&cdev->queue);
+	init_waitqueue_head(&cdev->readq);
+
+	/* splice_write() fills up tx buffers */
+	ret = rpmsg_get_mtu(rpdev);
+	cdev->mtu = ret > 0 ? ret : 0;
+
+	/* the callback may fire as soon as the cdev is registered */
+	dev_set_drvdata(&rpdev->dev, cdev);
+
+	if (!idr_pre_get(&rpmsg_char_minors, GFP_KERNEL)) {
+		ret = -ENOMEM;
+		goto free_cdev;
+	}
+
+	mutex_lock(&rpmsg_char_minors_lock);
+	ret = idr_get_new(&rpmsg_char_minors, cdev, &cdev->minor);
+	mutex_unlock(&rpmsg_char_minors_lock);
+	if (ret) {
+		dev_err(&rpdev->dev, "idr_get_new failed: %d\n", ret);
+		goto free_cdev;
+	}
+
+	if (cdev->minor >= RPMSG_CHAR_MAX_MINORS) {
+		dev_err(&rpdev->dev, "out of minor numbers\n");
+		ret = -EBUSY;
+		goto free_minor;
+	}
+
+	cdev_init(&cdev->cdev, &rpmsg_char_fops);
+	cdev->cdev.owner = THIS_MODULE;
+
+	ret = cdev_add(&cdev->cdev, MKDEV(MAJOR(rpmsg_char_devt), cdev->minor),
+									1);
+	if (ret) {
+		dev_err(&rpdev->dev, "cdev_add failed: %d\n", ret);
+		goto free_minor;
+	}
+
+	cdev->dev = device_create(rpmsg_char_class, &rpdev->dev,
+			MKDEV(MAJOR(rpmsg_char_devt), cdev->minor), NULL,
+			"rpmsg%d", cdev->minor);
+	if (IS_ERR(cdev->dev)) {
+		ret = PTR_ERR(cdev->dev);
+		dev_err(&rpdev->dev, "device_create failed: %d\n", ret);
+		goto del_cdev;
+	}
+
+	dev_info(&rpdev->dev, "new rpmsg char device: 0x%x -> 0x%x, rpmsg%d\n",
+					rpdev->src, rpdev->dst, cdev->minor);
+
+	return 0;
+
+del_cdev:
+	cdev_del(&cdev->cdev);
+free_minor:
+	mutex_lock(&rpmsg_char_minors_lock);
+	idr_remove(&rpmsg_char_minors, cdev->minor);
+	mutex_unlock(&rpmsg_char_minors_lock);
+free_cdev:
+	mutex_lock(&rpdev->ept->cb_lock);
+	dev_set_drvdata(&rpdev->dev, NULL);
+	mutex_unlock(&rpdev->ept->cb_lock);
+	rpmsg_char_drain(cdev, rpdev);
+	kfree(cdev);
+	return ret;
+}
+
+static void __devexit rpmsg_char_remove(struct rpmsg_channel *rpdev)
+{
+	struct rpmsg_char_dev *cdev = dev_get_drvdata(&rpdev->dev);
+
+	/* wait for in-flight readers and writers, and keep new ones out */
+	down_write(&cdev->rpdev_sem);
+	cdev->rpdev = NULL;
+	up_write(&cdev->rpdev_sem);
+
+	/* let blocked readers know the channel is gone */
+	wake_up_interruptible(&cdev->readq);
+
+	/*
+	 * The channel's ept is only destroyed after we return, so make sure
+	 * its callback won't touch the cdev anymore (it's invoked with
+	 * cb_lock taken).
+	 */
+	mutex_lock(&rpdev->ept->cb_lock);
+	dev_set_drvdata(&rpdev->dev, NULL);
+	mutex_unlock(&rpdev->ept->cb_lock);
+
+	/* held rx buffers must be given back before the channel goes away */
+	rpmsg_char_drain(cdev, rpdev);
+
+	device_destroy(rpmsg_char_class,
+			MKDEV(MAJOR(rpmsg_char_devt), cdev->minor));
+	cdev_del(&cdev->cdev);
+
+	mutex_lock(&rpmsg_char_minors_lock);
+	idr_remove(&rpmsg_char_minors, cdev->minor);
+	mutex_unlock(&rpmsg_char_minors_lock);
+
+	/* open files keep the cdev alive until they are closed */
+	kref_put(&cdev->refcount, rpmsg_char_release_dev);
+}
+
+static struct rpmsg_device_id rpmsg_char_id_table[] = {
+	{ .name	= "rpmsg-char" },
+	{ },
+};
+MODULE_DEVICE_TABLE(rpmsg, rpmsg_char_id_table);
+
+static struct rpmsg_driver rpmsg_char_driver = {
+	.drv.name	= KBUILD_MODNAME,
+	.drv.owner	= THIS_MODULE,
+	.id_table	= rpmsg_char_id_table,
+	.probe		= rpmsg_char_probe,
+	.callback	= rpmsg_char_cb,
+	.remove		= __devexit_p(rpmsg_char_remove),
+};
+
+static int __init rpmsg_char_init(void)
+{
+	int ret;
+
+	ret = alloc_chrdev_region(&rpmsg_char_devt, 0, RPMSG_CHAR_MAX_MINORS,
+								"rpmsg");
+	if (ret) {
+		pr_err("alloc_chrdev_region failed: %d\n", ret);
+		return ret;
+	}
+
+	rpmsg_char_class = class_create(THIS_MODULE, "rpmsg");
+	if (IS_ERR(rpmsg_char_class)) {
+		ret = PTR_ERR(rpmsg_char_class);
+		pr_err("class_create failed: %d\n", ret);
+		goto unreg_region;
+	}
+
+	ret = register_rpmsg_driver(&rpmsg_char_driver);
+	if (ret) {
+		pr_err("register_rpmsg_driver failed: %d\n", ret);
+		goto destroy_class;
+	}
+
+	return 0;
+
+destroy_class:
+	class_destroy(rpmsg_char_class);
+unreg_region:
+	unregister_chrdev_region(rpmsg_char_devt, RPMSG_CHAR_MAX_MINORS);
+	return ret;
+}
+module_init(rpmsg_char_init);
+
+static void __exit rpmsg_char_exit(void)
+{
+	unregister_rpmsg_driver(&rpmsg_char_driver);
+	class_destroy(rpmsg_char_class);
+	unregister_chrdev_region(rpmsg_char_devt, RPMSG_CHAR_MAX_MINORS);
+	idr_destroy(&rpmsg_char_minors);
+}
+module_exit(rpmsg_char_exit);
+
+MODULE_DESCRIPTION("Remote processor messaging character device interface");
+MODULE_LICENSE("GPL v2");
@@ -0,0 +1,891 @@
+/*
+ * Remote processor messaging bus core
+ *
+ * The rpmsg bus, its channel devices, and the matching of rpmsg drivers
+ * with channels. The messages themselves are carried by transports (see
+ * struct rpmsg_transport_ops), e.g. virtio_rpmsg_bus over the vrings of
+ * virtio devices, which register the channels of their remotes here: the
+ * rpmsg API below only dispatches to the transport of a channel.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#define pr_fmt(fmt) "%s: " fmt, __func__
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/device.h>
+#include <linux/slab.h>
+#include <linux/err.h>
+#include <linux/rpmsg.h>
+
+/* sysfs show configuration fields */
+#define rpmsg_show_attr(field, path, format_string)			\
+static ssize_t								\
+field##_show(struct device *dev,					\
+			struct device_attribute *attr, char *buf)	\
+{									\
+	struct rpmsg_channel *rpdev = to_rpmsg_channel(dev);		\
+									\
+	return sprintf(buf, format_string, rpdev->path);		\
+}
+
+/* for more info, see Documentation/ABI/testing/sysfs-bus-rpmsg */
+rpmsg_show_attr(name, id.name, "%s\n");
+rpmsg_show_attr(src, src, "0x%x\n");
+rpmsg_show_attr(dst, dst, "0x%x\n");
+rpmsg_show_attr(announce, announce ? "true" : "false", "%s\n");
+
+/*
+ * Unique (and free running) index for rpmsg devices.
+ *
+ * Yeah, we're not recycling those numbers (yet?). will be easy
+ * to change if/when we want to.
+ */
+static unsigned int rpmsg_dev_index;
+
+static ssize_t modalias_show(struct device *dev,
+			     struct device_attribute *attr, char *buf)
+{
+	struct rpmsg_channel *rpdev = to_rpmsg_channel(dev);
+
+	return sprintf(buf, RPMSG_DEVICE_MODALIAS_FMT "\n", rpdev->id.name);
+}
+
+static struct device_attribute rpmsg_dev_attrs[] = {
+	__ATTR_RO(name),
+	__ATTR_RO(modalias),
+	__ATTR_RO(dst),
+	__ATTR_RO(src),
+	__ATTR_RO(announce),
+	__ATTR_NULL
+};
+
+/* rpmsg devices and drivers are matched using the service name */
+static inline int rpmsg_id_match(const struct rpmsg_channel *rpdev,
+				  const struct rpmsg_device_id *id)
+{
+	return strncmp(id->name, rpdev->id.name, RPMSG_NAME_SIZE) == 0;
+}
+
+/* match rpmsg channel and rpmsg driver */
+static int rpmsg_dev_match(struct device *dev, struct device_driver *drv)
+{
+	struct rpmsg_channel *rpdev = to_rpmsg_channel(dev);
+	struct rpmsg_driver *rpdrv = to_rpmsg_driver(drv);
+	const struct rpmsg_device_id *ids = rpdrv->id_table;
+	unsigned int i;
+
+	for (i = 0; ids[i].name[0]; i++)
+		if (rpmsg_id_match(rpdev, &ids[i]))
+			return 1;
+
+	return 0;
+}
+
+static int rpmsg_uevent(struct device *dev, struct kobj_uevent_env *env)
+{
+	struct rpmsg_channel *rpdev = to_rpmsg_channel(dev);
+
+	return add_uevent_var(env, "MODALIAS=" RPMSG_DEVICE_MODALIAS_FMT,
+					rpdev->id.name);
+}
+
+/*
+ * tell the remote name service about @rpdev (with @flags being either
+ * RPMSG_NS_CREATE or RPMSG_NS_DESTROY), if it's a channel that needs to be
+ * announced, and its transport has a name service.
+ */
+static int rpmsg_announce(struct rpmsg_channel *rpdev, u32 flags)
+{
+	if (!rpdev->announce || !rpdev->ops->announce)
+		return 0;
+
+	return rpdev->ops->announce(rpdev, flags);
+}
+
+/*
+ * when an rpmsg driver is probed with a channel, we seamlessly create
+ * it an endpoint, binding its rx callback to a unique local rpmsg
+ * address.
+ *
+ * if we need to, we also announce about this channel to the remote
+ * processor (needed in case the driver is exposing an rpmsg service).
+ */
+static int rpmsg_dev_probe(struct device *dev)
+{
+	struct rpmsg_channel *rpdev = to_rpmsg_channel(dev);
+	struct rpmsg_driver *rpdrv = to_rpmsg_driver(rpdev->dev.driver);
+	struct rpmsg_endpoint *ept;
+	int err;
+
+	ept = rpmsg_create_ept(rpdev, rpdrv->callback, NULL, rpdev->src);
+	if (!ept) {
+		dev_err(dev, "failed to create endpoint\n");
+		err = -ENOMEM;
+		goto out;
+	}
+
+	rpdev->ept = ept;
+	rpdev->src = ept->addr;
+
+	err = rpdrv->probe(rpdev);
+	if (err) {
+		dev_err(dev, "%s: failed: %d\n", __func__, err);
+		rpmsg_destroy_ept(ept);
+		goto out;
+	}
+
+	/* need to tell remote processor's name service about this channel ? */
+	err = rpmsg_announce(rpdev, RPMSG_NS_CREATE);
+
+out:
+	return err;
+}
+
+static int rpmsg_dev_remove(struct device *dev)
+{
+	struct rpmsg_channel *rpdev = to_rpmsg_channel(dev);
+	struct rpmsg_driver *rpdrv = to_rpmsg_driver(rpdev->dev.driver);
+	int err;
+
+	/* tell remote processor's name service we're removing this channel */
+	err = rpmsg_announce(rpdev, RPMSG_NS_DESTROY);
+
+	rpdrv->remove(rpdev);
+
+	rpmsg_destroy_ept(rpdev->ept);
+
+	return err;
+}
+
+static struct bus_type rpmsg_bus = {
+	.name		= "rpmsg",
+	.match		= rpmsg_dev_match,
+	.dev_attrs	= rpmsg_dev_attrs,
+	.uevent		= rpmsg_uevent,
+	.probe		= rpmsg_dev_probe,
+	.remove		= rpmsg_dev_remove,
+};
+
+/**
+ * register_rpmsg_driver() - register an rpmsg driver with the rpmsg bus
+ * @rpdrv: pointer to a struct rpmsg_driver
+ *
+ * Returns 0 on success, and an appropriate error value on failure.
+ */
+int register_rpmsg_driver(struct rpmsg_driver *rpdrv)
+{
+	rpdrv->drv.bus = &rpmsg_bus;
+	return driver_register(&rpdrv->drv);
+}
+EXPORT_SYMBOL(register_rpmsg_driver);
+
+/**
+ * unregister_rpmsg_driver() - unregister an rpmsg driver from the rpmsg bus
+ * @rpdrv: pointer to a struct rpmsg_driver
+ *
+ * Returns 0 on success, and an appropriate error value on failure.
+ */
+void unregister_rpmsg_driver(struct rpmsg_driver *rpdrv)
+{
+	driver_unregister(&rpdrv->drv);
+}
+EXPORT_SYMBOL(unregister_rpmsg_driver);
+
+static void rpmsg_release_device(struct device *dev)
+{
+	struct rpmsg_channel *rpdev = to_rpmsg_channel(dev);
+
+	kfree(rpdev);
+}
+
+/**
+ * register_rpmsg_device() - add a channel to the rpmsg bus
+ * @rpdev: the channel, whose transport filled in its name, addresses, @ops
+ *	   and parent device
+ *
+ * Transports call this when a channel of one of their remotes shows up
+ * (e.g. when the remote announces a service), so the channel gets probed
+ * with a matching driver. The channel is freed (with kfree()) once it's
+ * unregistered and its last reference is dropped. If this function fails,
+ * the caller must drop its reference with put_device().
+ *
+ * Returns 0 on success, and an appropriate error value on failure.
+ */
+int register_rpmsg_device(struct rpmsg_channel *rpdev)
+{
+	if (WARN_ON(!rpdev->ops))
+		return -EINVAL;
+
+	/* very simple device indexing plumbing which is enough for now */
+	dev_set_name(&rpdev->dev, "rpmsg%d", rpmsg_dev_index++);
+
+	rpdev->dev.bus = &rpmsg_bus;
+	rpdev->dev.release = rpmsg_release_device;
+
+	return device_register(&rpdev->dev);
+}
+EXPORT_SYMBOL(register_rpmsg_device);
+
+/**
+ * unregister_rpmsg_device() - remove a channel from the rpmsg bus
+ * @rpdev: a channel that was added with register_rpmsg_device()
+ *
+ * Unbinds @rpdev from its driver, and drops the bus' reference to it.
+ */
+void unregister_rpmsg_device(struct rpmsg_channel *rpdev)
+{
+	device_unregister(&rpdev->dev);
+}
+EXPORT_SYMBOL(unregister_rpmsg_device);
+
+/**
+ * rpmsg_create_ept() - create a new rpmsg_endpoint
+ * @rpdev: rpmsg channel device
+ * @cb: rx callback handler
+ * @priv: private data for the driver's use
+ * @addr: local rpmsg address to bind with @cb
+ *
+ * Every rpmsg address in the system is bound to an rx callback (so when
+ * inbound messages arrive, they are dispatched by the rpmsg bus using the
+ * appropriate callback handler) by means of an rpmsg_endpoint struct.
+ *
+ * This function allows drivers to create such an endpoint, and by that,
+ * bind a callback, and possibly some private data too, to an rpmsg address
+ * (either one that is known in advance, or one that will be dynamically
+ * assigned for them).
+ *
+ * Simple rpmsg drivers need not call rpmsg_create_ept, because an endpoint
+ * is already created for them when they are probed by the rpmsg bus
+ * (using the rx callback provided when they registered to the rpmsg bus).
+ *
+ * So things should just work for simple drivers: they already have an
+ * endpoint, their rx callback is bound to their rpmsg address, and when
+ * relevant inbound messages arrive (i.e. messages which their dst address
+ * equals to the src address of their rpmsg channel), the driver's handler
+ * is invoked to process it.
+ *
+ * That said, more complicated drivers might do need to allocate
+ * additional rpmsg addresses, and bind them to different rx callbacks.
+ * To accomplish that, those drivers need to call this function.
+ *
+ * Drivers should provide their @rpdev channel (so the new endpoint would belong
+ * to the same remote processor their channel belongs to), an rx callback
+ * function, an optional private data (which is provided back when the
+ * rx callback is invoked), and an address they want to bind with the
+ * callback. If @addr is RPMSG_ADDR_ANY, then rpmsg_create_ept will
+ * dynamically assign them an available rpmsg address (drivers should have
+ * a very good reason why not to always use RPMSG_ADDR_ANY here).
+ *
+ * Returns a pointer to the endpoint on success, or NULL on error.
+ */
+struct rpmsg_endpoint *rpmsg_create_ept(struct rpmsg_channel *rpdev,
+				rpmsg_rx_cb_t cb, void *priv, u32 addr)
+{
+	return rpdev->ops->create_ept(rpdev, cb, priv, addr);
+}
+EXPORT_SYMBOL(rpmsg_create_ept);
+
+/**
+ * rpmsg_create_atomic_ept() - create an rpmsg_endpoint with an atomic callback
+ * @rpdev: rpmsg channel device
+ * @cb: rx callback handler, which must not sleep
+ * @priv: private data for the driver's use
+ * @addr: local rpmsg address to bind with @cb
+ *
+ * Same as rpmsg_create_ept(), but @cb is invoked in atomic context (under
+ * rcu_read_lock(), and possibly straight from the rx virtqueue interrupt),
+ * without taking any lock on the way. It is therefore not allowed to sleep.
+ *
+ * This is useful for latency sensitive users, whose inbound messages then
+ * don't have to wait for the rx work to be scheduled.
+ *
+ * Returns a pointer to the endpoint on success, or NULL on error.
+ */
+struct rpmsg_endpoint *rpmsg_create_atomic_ept(struct rpmsg_channel *rpdev,
+				rpmsg_rx_cb_t cb, void *priv, u32 addr)
+{
+	if (!rpdev->ops->create_atomic_ept)
+		return NULL;
+
+	return rpdev->ops->create_atomic_ept(rpdev, cb, priv, addr);
+}
+EXPORT_SYMBOL(rpmsg_create_atomic_ept);
+
+/**
+ * rpmsg_create_ept_ctx() - create an rpmsg_endpoint with its own rx context
+ * @rpdev: rpmsg channel device
+ * @cb: rx callback handler
+ * @priv: private data for the driver's use
+ * @addr: local rpmsg address to bind with @cb
+ * @ctx: where @cb is invoked (see enum rpmsg_rx_ctx)
+ * @cpu: the cpu @cb is invoked on, if @ctx is RPMSG_RX_CTX_CPU
+ *
+ * Same as rpmsg_create_ept(), but @cb is invoked from a workqueue of the
+ * endpoint's own (RPMSG_RX_CTX_WQ), or from a work item on @cpu
+ * (RPMSG_RX_CTX_CPU), rather than from the rx path. A slow callback (e.g.
+ * one that writes to a file) then doesn't delay the messages of the other
+ * endpoints, and a callback can be kept close to the data it works on.
+ *
+ * The rx buffers of the inbound messages are held until they're delivered,
+ * which counts against the rpmsg_hold_rx_buf() limit: beyond it, messages
+ * are delivered inline again (still in order).
+ *
+ * Returns a pointer to the endpoint on success, or NULL on error.
+ */
+struct rpmsg_endpoint *rpmsg_create_ept_ctx(struct rpmsg_channel *rpdev,
+				rpmsg_rx_cb_t cb, void *priv, u32 addr,
+				enum rpmsg_rx_ctx ctx, int cpu)
+{
+	/* inline callbacks are what every transport does */
+	if (ctx == RPMSG_RX_CTX_INLINE && !rpdev->ops->create_ept_ctx)
+		return rpmsg_create_ept(rpdev, cb, priv, addr);
+
+	if (!rpdev->ops->create_ept_ctx)
+		return NULL;
+
+	return rpdev->ops->create_ept_ctx(rpdev, cb, priv, addr, ctx, cpu);
+}
+EXPORT_SYMBOL(rpmsg_create_ept_ctx);
+
+/**
+ * rpmsg_create_batch_ept() - create an rpmsg_endpoint with a batch callback
+ * @rpdev: rpmsg channel device
+ * @cb: rx callback handler, which is handed several messages at once
+ * @priv: private data for the driver's use
+ * @addr: local rpmsg address to bind with @cb
+ *
+ * Same as rpmsg_create_ept(), but consecutive inbound messages the rpmsg
+ * bus picks up in a single pass over the rx virtqueue are handed over to
+ * @cb all at once (up to RPMSG_RX_BATCH of them), as an array of
+ * struct rpmsg_rx_msg, in order. The cost of delivering a message (the
+ * indirect call, taking the endpoint's cb_lock and a reference to it) is
+ * then paid once per batch, which helps endpoints receiving lots of small
+ * messages (e.g. telemetry samples).
+ *
+ * The buffers of a batch are given back to the remote processor as soon as
+ * @cb returns, and can't be held (see rpmsg_hold_rx_buf()).
+ *
+ * Returns a pointer to the endpoint on success, or NULL on error.
+ */
+struct rpmsg_endpoint *rpmsg_create_batch_ept(struct rpmsg_channel *rpdev,
+				rpmsg_rx_batch_cb_t cb, void *priv, u32 addr)
+{
+	if (!rpdev->ops->create_batch_ept)
+		return NULL;
+
+	return rpdev->ops->create_batch_ept(rpdev, cb, priv, addr);
+}
+EXPORT_SYMBOL(rpmsg_create_batch_ept);
+
+/**
+ * rpmsg_destroy_ept() - destroy an existing rpmsg endpoint
+ * @ept: endpoing to destroy
+ *
+ * Should be used by drivers to destroy an rpmsg endpoint previously
+ * created with rpmsg_create_ept().
+ */
+void rpmsg_destroy_ept(struct rpmsg_endpoint *ept)
+{
+	ept->rpdev->ops->destroy_ept(ept);
+}
+EXPORT_SYMBOL(rpmsg_destroy_ept);
+
+/**
+ * rpmsg_set_qos_latency() - require a cpu wakeup latency for an endpoint
+ * @ept: the endpoint
+ * @usecs: the latency, in usecs, or PM_QOS_DEFAULT_VALUE to drop it
+ *
+ * When the host is in a deep C-state, waking up for the interrupt of an
+ * inbound message can take hundreds of usecs. This function makes rpmsg
+ * hold a cpu_dma_latency request of @usecs (at most) while @ept sends or
+ * receives messages, which it relaxes once @ept's traffic has been
+ * idle for a while (see the qos_idle_ms module parameter), rather than
+ * keeping the whole system awake for good.
+ *
+ * The strictest latency of the endpoints of a remote processor applies
+ * as soon as any of them has traffic.
+ *
+ * Can only be called from process context.
+ */
+void rpmsg_set_qos_latency(struct rpmsg_endpoint *ept, s32 usecs)
+{
+	if (ept->rpdev->ops->set_qos_latency)
+		ept->rpdev->ops->set_qos_latency(ept, usecs);
+}
+EXPORT_SYMBOL(rpmsg_set_qos_latency);
+
+/**
+ * rpmsg_get_backlog() - tell how far behind the remote service of a channel is
+ * @rpdev: the rpmsg channel
+ * @backlog: where to put the number of messages the remote service (i.e.
+ *	     the endpoint at @rpdev->dst) has yet to handle
+ *
+ * This is only known if the remote processor publishes it, e.g. in its
+ * remoteproc telemetry page (see fw_rsc_telemetry).
+ *
+ * This function can be called from atomic/interrupt context.
+ *
+ * Returns 0 on success, or -ENODEV if the backlog isn't known.
+ */
+int rpmsg_get_backlog(struct rpmsg_channel *rpdev, u32 *backlog)
+{
+	if (!rpdev->ops->get_backlog)
+		return -ENODEV;
+
+	return rpdev->ops->get_backlog(rpdev, backlog);
+}
+EXPORT_SYMBOL(rpmsg_get_backlog);
+
+/**
+ * rpmsg_get_dma_dev() - the device memory shared over a channel comes from
+ * @rpdev: the rpmsg channel
+ *
+ * Drivers that share more memory with the remote processor than the rpmsg
+ * buffers (e.g. the periods of an audio stream, which they only pass the
+ * address of) allocate it with this device, e.g. with dma_alloc_coherent(),
+ * so the remote processor reaches it just like it reaches the rpmsg
+ * buffers, at its dma address.
+ */
+struct device *rpmsg_get_dma_dev(struct rpmsg_channel *rpdev)
+{
+	if (!rpdev->ops->get_dma_dev)
+		return rpdev->dev.parent;
+
+	return rpdev->ops->get_dma_dev(rpdev);
+}
+EXPORT_SYMBOL(rpmsg_get_dma_dev);
+
+/**
+ * rpmsg_get_mtu() - the biggest payload a message sent over a channel holds
+ * @rpdev: the rpmsg channel
+ *
+ * Drivers that stream data to the remote processor (rather than exchange
+ * messages with it) cut it into messages of this size, so every tx buffer
+ * they send is filled up.
+ *
+ * Returns the size, in bytes, or -EOPNOTSUPP if the transport of @rpdev
+ * doesn't tell it.
+ */
+int rpmsg_get_mtu(struct rpmsg_channel *rpdev)
+{
+	if (!rpdev->ops->get_mtu)
+		return -EOPNOTSUPP;
+
+	return rpdev->ops->get_mtu(rpdev);
+}
+EXPORT_SYMBOL(rpmsg_get_mtu);
+
+/**
+ * rpmsg_send_offchannel_raw() - send a message across to the remote processor
+ * @rpdev: the rpmsg channel
+ * @src: source address
+ * @dst: destination address
+ * @data: payload of message
+ * @len: length of payload
+ * @wait: indicates whether caller should block in case no TX buffers available
+ *
+ * This function is the base implementation for all of the rpmsg sending API.
+ *
+ * It will send @data of length @len to @dst, and say it's from @src. The
+ * message will be sent to the remote processor which the @rpdev channel
+ * belongs to.
+ *
+ * The message is sent using one of the TX buffers that are available for
+ * communication with this remote processor.
+ *
+ * If @wait is true, the caller will be blocked until either a TX buffer is
+ * available, or the tx timeout of @rpdev's endpoint elapses (15 seconds
+ * by default; we don't want callers to sleep indefinitely due to
+ * misbehaving remote processors), and in that case -ETIMEDOUT is returned.
+ * Blocked senders are served in FIFO order.
+ *
+ * Otherwise, if @wait is false, and there are no TX buffers available,
+ * the function will immediately fail, and -ENOMEM will be returned.
+ *
+ * Use rpmsg_send_offchannel_timeout() to specify the timeout per call.
+ *
+ * Normally drivers shouldn't use this function directly; instead, drivers
+ * should use the appropriate rpmsg_{try}send{to, _offchannel} API
+ * (see include/linux/rpmsg.h).
+ *
+ * Returns 0 on success and an appropriate error value on failure.
+ */
+int rpmsg_send_offchannel_raw(struct rpmsg_channel *rpdev, u32 src, u32 dst,
+					void *data, int len, bool wait)
+{
+	long timeout = wait ? rpmsg_tx_timeout(rpdev) : 0;
+
+	return rpdev->ops->send_offchannel(rpdev, src, dst, data, len,
+								timeout);
+}
+EXPORT_SYMBOL(rpmsg_send_offchannel_raw);
+
+/**
+ * rpmsg_send_offchannel_timeout() - send a message, with an explicit timeout
+ * @rpdev: the rpmsg channel
+ * @src: source address
+ * @dst: destination address
+ * @data: payload of message
+ * @len: length of payload
+ * @timeout: max time to wait for a TX buffer, in jiffies (0 not to wait,
+ *	     or MAX_SCHEDULE_TIMEOUT to wait indefinitely)
+ *
+ * Same as rpmsg_send_offchannel_raw(), but the caller decides how long it
+ * may be blocked in case no TX buffers are available.
+ *
+ * Returns 0 on success and an appropriate error value on failure:
+ * -ENOMEM if @timeout is zero and there are no TX buffers available,
+ * -ETIMEDOUT if @timeout elapsed, or -ERESTARTSYS if a signal arrived.
+ */
+int rpmsg_send_offchannel_timeout(struct rpmsg_channel *rpdev, u32 src,
+				u32 dst, void *data, int len, long timeout)
+{
+	return rpdev->ops->send_offchannel(rpdev, src, dst, data, len,
+								timeout);
+}
+EXPORT_SYMBOL(rpmsg_send_offchannel_timeout);
+
+/**
+ * rpmsg_send_offchannel_async() - send a message, and get notified when used
+ * @rpdev: the rpmsg channel
+ * @src: source address
+ * @dst: destination address
+ * @data: payload of message
+ * @len: length of payload
+ * @done: invoked once the remote processor is done with the message
+ * @priv: private data of @done
+ *
+ * Same as rpmsg_send_offchannel_raw() without waiting for a TX buffer,
+ * but once the message is sent, @done is invoked with @priv when the
+ * remote processor gives its TX buffer back, instead of the caller having
+ * to wait for that. The second argument of @done is 0 if the remote
+ * processor consumed the message, or -ECANCELED if it was dropped because
+ * the remote processor was restarted, or the rpmsg bus removed.
+ *
+ * @done is invoked in atomic context (possibly from the "tx-complete"
+ * interrupt), without any rpmsg lock held, so it may send further
+ * messages, but it must not sleep. It is not invoked when sending fails.
+ *
+ * Can be called from any context, including atomic ones: it never sleeps.
+ *
+ * Returns 0 on success and an appropriate error value on failure (-ENOMEM
+ * if there are no TX buffers available).
+ */
+int rpmsg_send_offchannel_async(struct rpmsg_channel *rpdev, u32 src, u32 dst,
+			void *data, int len, rpmsg_tx_done_t done, void *priv)
+{
+	if (!rpdev->ops->send_offchannel_async)
+		return -EOPNOTSUPP;
+
+	return rpdev->ops->send_offchannel_async(rpdev, src, dst, data, len,
+								done, priv);
+}
+EXPORT_SYMBOL(rpmsg_send_offchannel_async);
+
+/**
+ * rpmsg_sendv_offchannel_raw() - send a message gathered from several buffers
+ * @rpdev: the rpmsg channel
+ * @src: source address
+ * @dst: destination address
+ * @vec: the buffers making up the payload of the message, in order
+ * @num: number of entries in @vec
+ * @wait: indicates whether caller should block in case no TX buffers available
+ *
+ * Same as rpmsg_send_offchannel_raw(), but the payload is gathered from
+ * the @num buffers described by @vec, straight into the TX buffer. This
+ * way, a message whose header and body live in separate buffers doesn't
+ * have to be staged in a contiguous buffer by the caller first.
+ *
+ * Note that the payload still ends up in a single TX buffer: the remote
+ * processor can only access the buffers it shares with us, so pointing
+ * vring descriptors to arbitrary kernel memory isn't an option.
+ *
+ * Returns 0 on success and an appropriate error value on failure.
+ */
+int rpmsg_sendv_offchannel_raw(struct rpmsg_channel *rpdev, u32 src, u32 dst,
+				const struct kvec *vec, int num, bool wait)
+{
+	if (!rpdev->ops->sendv_offchannel)
+		return -EOPNOTSUPP;
+
+	return rpdev->ops->sendv_offchannel(rpdev, src, dst, vec, num, wait);
+}
+EXPORT_SYMBOL(rpmsg_sendv_offchannel_raw);
+
+/**
+ * rpmsg_send_offchannel_batch() - send several messages with a single kick
+ * @rpdev: the rpmsg channel
+ * @src: source address of all messages
+ * @msgs: array of messages to send (destination, payload and length of each)
+ * @num: number of entries in @msgs
+ * @wait: indicates whether caller should block in case no TX buffers available
+ *
+ * This function sends the @num messages described by @msgs, in order, to
+ * the remote processor which the @rpdev channel belongs to, and says they
+ * are all from @src.
+ *
+ * Unlike calling rpmsg_send_offchannel_raw() @num times, the messages are
+ * queued under a single acquisition of the tx lock, and the remote
+ * processor is kicked only once, after the whole batch is queued (and
+ * outside of the tx lock). This saves an interrupt to the remote processor
+ * per message, which usually dominates the latency of small messages.
+ *
+ * If we run out of TX buffers in the middle of a batch, the messages queued
+ * so far are flushed (i.e. the remote processor is kicked), and then either
+ * we block until another TX buffer is available (if @wait is true; see
+ * rpmsg_send_offchannel_raw() for the exact semantics), or we stop.
+ *
+ * Can only be called from process context (for now).
+ *
+ * Returns the number of messages sent (which may be smaller than @num), or
+ * an appropriate error value if not even a single message could be sent.
+ */
+int rpmsg_send_offchannel_batch(struct rpmsg_channel *rpdev, u32 src,
+			struct rpmsg_batch_msg *msgs, int num, bool wait)
+{
+	if (!rpdev->ops->send_offchannel_batch)
+		return -EOPNOTSUPP;
+
+	return rpdev->ops->send_offchannel_batch(rpdev, src, msgs, num, wait);
+}
+EXPORT_SYMBOL(rpmsg_send_offchannel_batch);
+
+/**
+ * rpmsg_send_offchannel_mcast() - send a single message to several addresses
+ * @rpdev: the rpmsg channel
+ * @src: source address
+ * @dst: the destination addresses
+ * @num: number of entries in @dst
+ * @data: payload of message
+ * @len: length of payload
+ * @wait: indicates whether caller should block in case no TX buffers available
+ *
+ * This function sends @data of length @len to each of the @num addresses
+ * of @dst, and says it's from @src.
+ *
+ * If the remote processor supports VIRTIO_RPMSG_F_MCAST, the payload is
+ * copied once, along with the list of destinations (see rpmsg_mcast_hdr),
+ * into a single TX buffer which is sent to RPMSG_MCAST_ADDR, and the remote
+ * processor fans it out. Otherwise, or if the whole thing doesn't fit in
+ * a TX buffer, a copy of the message is sent to each destination, in a
+ * single batch (see rpmsg_send_offchannel_batch()).
+ *
+ * Can only be called from process context (for now).
+ *
+ * Returns the number of destinations the message was sent to, or an
+ * appropriate error value if it couldn't be sent to any.
+ */
+int rpmsg_send_offchannel_mcast(struct rpmsg_channel *rpdev, u32 src,
+			const u32 *dst, int num, void *data, int len, bool wait)
+{
+	if (!rpdev->ops->send_offchannel_mcast)
+		return -EOPNOTSUPP;
+
+	return rpdev->ops->send_offchannel_mcast(rpdev, src, dst, num, data,
+								len, wait);
+}
+EXPORT_SYMBOL(rpmsg_send_offchannel_mcast);
+
+/**
+ * rpmsg_alloc_tx_buf() - allocate a tx buffer to be filled in place
+ * @rpdev: the rpmsg channel
+ * @len: length of the payload that is going to be placed in the buffer
+ * @wait: indicates whether caller should block in case no TX buffers available
+ *
+ * This function hands out the payload area of one of the TX buffers that are
+ * shared with the remote processor the @rpdev channel belongs to, so the
+ * caller can build its message directly in the buffer, and then send it
+ * (without any additional copy) using rpmsg_send_offchannel_buf().
+ *
+ * The semantics of @wait are identical to rpmsg_send_offchannel_raw().
+ *
+ * Every buffer obtained with this function must be either sent, or given
+ * back using rpmsg_free_tx_buf().
+ *
+ * Can only be called from process context (for now).
+ *
+ * Returns a pointer to a payload area of at least @len bytes on success,
+ * or an ERR_PTR value on failure.
+ */
+void *rpmsg_alloc_tx_buf(struct rpmsg_channel *rpdev, int len, bool wait)
+{
+	if (!rpdev->ops->alloc_tx_buf)
+		return ERR_PTR(-EOPNOTSUPP);
+
+	return rpdev->ops->alloc_tx_buf(rpdev, len, wait);
+}
+EXPORT_SYMBOL(rpmsg_alloc_tx_buf);
+
+/**
+ * rpmsg_free_tx_buf() - give back an unsent tx buffer
+ * @rpdev: the rpmsg channel
+ * @buf: a payload area previously obtained with rpmsg_alloc_tx_buf()
+ *
+ * Use this function to release a buffer previously obtained with
+ * rpmsg_alloc_tx_buf(), in case it is eventually not sent.
+ */
+void rpmsg_free_tx_buf(struct rpmsg_channel *rpdev, void *buf)
+{
+	rpdev->ops->free_tx_buf(rpdev, buf);
+}
+EXPORT_SYMBOL(rpmsg_free_tx_buf);
+
+/**
+ * rpmsg_send_offchannel_buf() - send a message that was built in place
+ * @rpdev: the rpmsg channel
+ * @src: source address
+ * @dst: destination address
+ * @buf: a payload area previously obtained with rpmsg_alloc_tx_buf()
+ * @len: length of payload
+ *
+ * This function sends the @len bytes payload which the caller already
+ * placed in @buf to @dst, and says it's from @src. Unlike
+ * rpmsg_send_offchannel_raw(), the payload isn't copied: the bus only
+ * fills in the rpmsg header in front of it.
+ *
+ * @len must not exceed the length requested when @buf was allocated.
+ *
+ * Ownership of @buf passes to the rpmsg bus as soon as this function is
+ * called, regardless of its return value: the caller must not access it
+ * (or free it) anymore.
+ *
+ * Normally drivers shouldn't use this function directly; instead, drivers
+ * should use rpmsg_send_buf() or rpmsg_sendto_buf() (see
+ * include/linux/rpmsg.h).
+ *
+ * Can only be called from process context (for now).
+ *
+ * Returns 0 on success and an appropriate error value on failure.
+ */
+int rpmsg_send_offchannel_buf(struct rpmsg_channel *rpdev, u32 src, u32 dst,
+							void *buf, int len)
+{
+	return rpdev->ops->send_offchannel_buf(rpdev, src, dst, buf, len);
+}
+EXPORT_SYMBOL(rpmsg_send_offchannel_buf);
+
+/**
+ * rpmsg_hold_rx_buf() - take ownership of an inbound message's buffer
+ * @rpdev: the rpmsg channel the message was received on
+ * @data: the payload, exactly as it was passed to the rx callback
+ *
+ * By default, the buffer of an inbound message is given back to the remote
+ * processor as soon as the rx callback returns, so anything the callback
+ * wants to process later must be copied first. Instead, the rx callback
+ * can call this function to keep the buffer (and @data) for itself, until
+ * it gives it back using rpmsg_release_rx_buf().
+ *
+ * Only about half of the rx buffers can be held at any given time, so the
+ * remote processor always has buffers to send messages with. Buffers
+ * should be released as soon as possible anyway, and before the channel
+ * is removed.
+ *
+ * Can only be called from the rx callback, on the message it's invoked for.
+ *
+ * Messages that came in a big rx buffer (see VIRTIO_RPMSG_F_RX_CHAIN) can't
+ * be held.
+ *
+ * Returns 0 on success, -EBUSY if too many rx buffers are already held, or
+ * if the message came in a big rx buffer (in both cases, the callback
+ * should copy what it needs, as usual), or -EINVAL if @data isn't the
+ * payload currently being delivered.
+ */
+int rpmsg_hold_rx_buf(struct rpmsg_channel *rpdev, void *data)
+{
+	if (!rpdev->ops->hold_rx_buf)
+		return -EBUSY;
+
+	return rpdev->ops->hold_rx_buf(rpdev, data);
+}
+EXPORT_SYMBOL(rpmsg_hold_rx_buf);
+
+/**
+ * rpmsg_release_rx_buf() - give back a held rx buffer
+ * @rpdev: the rpmsg channel the message was received on
+ * @data: the payload of a message whose buffer was held
+ *
+ * Gives back a buffer that was held with rpmsg_hold_rx_buf(), so the remote
+ * processor can use it again. @data must not be accessed anymore after
+ * this function is called.
+ *
+ * Can be called from any context.
+ */
+void rpmsg_release_rx_buf(struct rpmsg_channel *rpdev, void *data)
+{
+	rpdev->ops->release_rx_buf(rpdev, data);
+}
+EXPORT_SYMBOL(rpmsg_release_rx_buf);
+
+/**
+ * rpmsg_wait_tx_buf() - be called back once a tx buffer comes back
+ * @rpdev: the rpmsg channel
+ * @waiter: the callback, set up with rpmsg_init_tx_waiter()
+ *
+ * This is for senders which can't block when they're out of tx buffers
+ * (see rpmsg_trysend() and rpmsg_alloc_tx_buf()): @waiter->func is invoked
+ * once, from atomic context, after the next tx buffer is given back. It
+ * may then try again, e.g. by queueing a work.
+ *
+ * A buffer may come back right before @waiter is queued, so senders
+ * should try once more after calling this function. Queueing a waiter
+ * which is already pending does nothing.
+ *
+ * Returns 0 on success, or -EOPNOTSUPP if the transport can't tell when
+ * tx buffers come back.
+ */
+int rpmsg_wait_tx_buf(struct rpmsg_channel *rpdev,
+				struct rpmsg_tx_waiter *waiter)
+{
+	if (!rpdev->ops->wait_tx_buf)
+		return -EOPNOTSUPP;
+
+	return rpdev->ops->wait_tx_buf(rpdev, waiter);
+}
+EXPORT_SYMBOL(rpmsg_wait_tx_buf);
+
+/**
+ * rpmsg_cancel_tx_wait() - forget about a pending tx buffer callback
+ * @rpdev: the rpmsg channel
+ * @waiter: the callback, which was passed to rpmsg_wait_tx_buf()
+ *
+ * Once this function returns, @waiter->func isn't running, and won't be
+ * invoked (unless @waiter is queued again). Does nothing if @waiter isn't
+ * pending.
+ */
+void rpmsg_cancel_tx_wait(struct rpmsg_channel *rpdev,
+				struct rpmsg_tx_waiter *waiter)
+{
+	if (rpdev->ops->cancel_tx_wait)
+		rpdev->ops->cancel_tx_wait(rpdev, waiter);
+}
+EXPORT_SYMBOL(rpmsg_cancel_tx_wait);
+
+static int __init rpmsg_core_init(void)
+{
+	int ret;
+
+	ret = bus_register(&rpmsg_bus);
+	if (ret)
+		pr_err("failed to register rpmsg bus: %d\n", ret);
+
+	return ret;
+}
+subsys_initcall(rpmsg_core_init);
+
+static void __exit rpmsg_core_fini(void)
+{
+	bus_unregister(&rpmsg_bus);
+}
+module_exit(rpmsg_core_fini);
+
+MODULE_DESCRIPTION("Remote processor messaging bus");
+MODULE_LICENSE("GPL v2");
@@ -0,0 +1,500 @@
+/*
+ * Remote processor messaging - service groups
+ *
+ * When several identical remote processors announce the same service, each
+ * of them gets a channel of its own, and their driver would have to decide
+ * which one to send every request to. A service group does it instead: the
+ * driver adds the channels of the service to the group as they're probed,
+ * and sends to the group, which picks the least loaded of them. The load of
+ * a channel is what it was handed and has yet to give back (sends in
+ * flight, see rpmsg_group_get_channel(), and open sessions), plus the
+ * backlog of the remote service, if its remote processor publishes it (see
+ * rpmsg_get_backlog()). Requests that must all go to the same remote
+ * service, e.g. because it keeps state for them, are sent over a session,
+ * which sticks to the channel it was opened on.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#define pr_fmt(fmt) "%s: " fmt, __func__
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/device.h>
+#include <linux/err.h>
+#include <linux/kref.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/string.h>
+#include <linux/wait.h>
+#include <linux/rpmsg.h>
+#include <linux/rpmsg_group.h>
+
+/**
+ * struct rpmsg_group_member - a channel of a service group
+ * @node: list node, in the members of the group
+ * @rpdev: the channel
+ * @users: number of senders using the channel (see rpmsg_group_get_channel())
+ * @sessions: number of sessions open on the channel
+ * @dead: the channel is being removed from the group, and can't be picked
+ */
+struct rpmsg_group_member {
+	struct list_head node;
+	struct rpmsg_channel *rpdev;
+	unsigned int users;
+	unsigned int sessions;
+	bool dead;
+};
+
+/**
+ * struct rpmsg_group_session - requests that stick to a single channel
+ * @node: list node, in the sessions of the group
+ * @grp: the service group
+ * @member: the channel the session was opened on, or NULL once it's gone
+ */
+struct rpmsg_group_session {
+	struct list_head node;
+	struct rpmsg_group *grp;
+	struct rpmsg_group_member *member;
+};
+
+/**
+ * struct rpmsg_group - a service group
+ * @node: list node, in rpmsg_groups
+ * @name: the name of the service
+ * @refcount: held by the users of the group, and by each of its channels
+ * @lock: protects @members and @sessions
+ * @members: the channels of the group, least recently picked first
+ * @sessions: the sessions open on the group
+ * @wq: rpmsg_group_del() waits here for the senders of a channel to be gone
+ */
+struct rpmsg_group {
+	struct list_head node;
+	char name[RPMSG_NAME_SIZE];
+	struct kref refcount;
+	spinlock_t lock;
+	struct list_head members;
+	struct list_head sessions;
+	wait_queue_head_t wq;
+};
+
+static LIST_HEAD(rpmsg_groups);
+static DEFINE_MUTEX(rpmsg_groups_lock);
+
+/**
+ * rpmsg_group_get() - get the service group of a service
+ * @name: the name of the service
+ *
+ * The group is created the first time it's asked for, and is shared by all
+ * the users of @name.
+ *
+ * Returns the group on success, or an ERR_PTR() on failure.
+ */
+struct rpmsg_group *rpmsg_group_get(const char *name)
+{
+	struct rpmsg_group *grp;
+
+	mutex_lock(&rpmsg_groups_lock);
+
+	list_for_each_entry(grp, &rpmsg_groups, node) {
+		if (!strncmp(grp->name, name, RPMSG_NAME_SIZE)) {
+			kref_get(&grp->refcount);
+			goto unlock;
+		}
+	}
+
+	grp = kzalloc(sizeof(*grp), GFP_KERNEL);
+	if (!grp) {
+		grp = ERR_PTR(-ENOMEM);
+		goto unlock;
+	}
+
+	strlcpy(grp->name, name, sizeof(grp->name));
+	kref_init(&grp->refcount);
+	spin_lock_init(&grp->lock);
+	INIT_LIST_HEAD(&grp->members);
+	INIT_LIST_HEAD(&grp->sessions);
+	init_waitqueue_head(&grp->wq);
+
+	list_add_tail(&grp->node, &rpmsg_groups);
+
+unlock:
+	mutex_unlock(&rpmsg_groups_lock);
+	return grp;
+}
+EXPORT_SYMBOL(rpmsg_group_get);
+
+/* called with rpmsg_groups_lock held, which it releases */
+static void rpmsg_group_release(struct kref *kref)
+{
+	struct rpmsg_group *grp = container_of(kref, struct rpmsg_group,
+								refcount);
+
+	list_del(&grp->node);
+	mutex_unlock(&rpmsg_groups_lock);
+
+	WARN_ON(!list_empty(&grp->sessions));
+	kfree(grp);
+}
+
+/**
+ * rpmsg_group_put() - let go of a service group
+ * @grp: the service group, as returned by rpmsg_group_get()
+ */
+void rpmsg_group_put(struct rpmsg_group *grp)
+{
+	kref_put_mutex(&grp->refcount, rpmsg_group_release, &rpmsg_groups_lock);
+}
+EXPORT_SYMBOL(rpmsg_group_put);
+
+/**
+ * rpmsg_group_add() - add a channel to a service group
+ * @grp: the service group
+ * @rpdev: the channel, of the service of @grp
+ *
+ * This is meant to be called from the ->probe() handler of the driver of
+ * the service, for each of its channels.
+ *
+ * Returns 0 on success, or an appropriate error code otherwise.
+ */
+int rpmsg_group_add(struct rpmsg_group *grp, struct rpmsg_channel *rpdev)
+{
+	struct rpmsg_group_member *m;
+	unsigned long flags;
+
+	if (strncmp(rpdev->id.name, grp->name, RPMSG_NAME_SIZE)) {
+		dev_err(&rpdev->dev, "not a channel of %s\n", grp->name);
+		return -EINVAL;
+	}
+
+	m = kzalloc(sizeof(*m), GFP_KERNEL);
+	if (!m)
+		return -ENOMEM;
+
+	m->rpdev = rpdev;
+	kref_get(&grp->refcount);
+
+	/* a new channel is the first pick, all else being equal */
+	spin_lock_irqsave(&grp->lock, flags);
+	list_add(&m->node, &grp->members);
+	spin_unlock_irqrestore(&grp->lock, flags);
+
+	dev_dbg(&rpdev->dev, "joined service group %s\n", grp->name);
+
+	return 0;
+}
+EXPORT_SYMBOL(rpmsg_group_add);
+
+/* find the member of @rpdev. Must be called with @grp->lock held */
+static struct rpmsg_group_member *
+rpmsg_group_member(struct rpmsg_group *grp, struct rpmsg_channel *rpdev)
+{
+	struct rpmsg_group_member *m;
+
+	list_for_each_entry(m, &grp->members, node)
+		if (m->rpdev == rpdev)
+			return m;
+
+	return NULL;
+}
+
+/* are all the senders of @m gone ? */
+static bool rpmsg_group_member_idle(struct rpmsg_group *grp,
+					struct rpmsg_group_member *m)
+{
+	unsigned long flags;
+	bool ret;
+
+	spin_lock_irqsave(&grp->lock, flags);
+	ret = !m->users;
+	spin_unlock_irqrestore(&grp->lock, flags);
+
+	return ret;
+}
+
+/**
+ * rpmsg_group_del() - remove a channel from a service group
+ * @grp: the service group
+ * @rpdev: the channel, which was added with rpmsg_group_add()
+ *
+ * This is meant to be called from the ->remove() handler of the driver of
+ * the service. The sessions open on @rpdev fail with -ENODEV from now on.
+ * Returns once the senders that were handed @rpdev are done with it.
+ *
+ * Can only be called from process context.
+ */
+void rpmsg_group_del(struct rpmsg_group *grp, struct rpmsg_channel *rpdev)
+{
+	struct rpmsg_group_session *sess;
+	struct rpmsg_group_member *m;
+	unsigned long flags;
+
+	spin_lock_irqsave(&grp->lock, flags);
+
+	m = rpmsg_group_member(grp, rpdev);
+	if (!m || m->dead) {
+		spin_unlock_irqrestore(&grp->lock, flags);
+		WARN(1, "%s isn't in group %s\n", dev_name(&rpdev->dev),
+								grp->name);
+		return;
+	}
+
+	m->dead = true;
+
+	list_for_each_entry(sess, &grp->sessions, node)
+		if (sess->member == m)
+			sess->member = NULL;
+	m->sessions = 0;
+
+	spin_unlock_irqrestore(&grp->lock, flags);
+
+	wait_event(grp->wq, rpmsg_group_member_idle(grp, m));
+
+	spin_lock_irqsave(&grp->lock, flags);
+	list_del(&m->node);
+	spin_unlock_irqrestore(&grp->lock, flags);
+
+	kfree(m);
+
+	dev_dbg(&rpdev->dev, "left service group %s\n", grp->name);
+
+	rpmsg_group_put(grp);
+}
+EXPORT_SYMBOL(rpmsg_group_del);
+
+/* how loaded is the channel of @m ? Must be called with @grp->lock held */
+static unsigned long rpmsg_group_load(struct rpmsg_group_member *m)
+{
+	unsigned long load = m->users + m->sessions;
+	u32 backlog;
+
+	if (!rpmsg_get_backlog(m->rpdev, &backlog))
+		load += backlog;
+
+	return load;
+}
+
+/*
+ * pick the least loaded channel of @grp, which goes to the back of the
+ * members so channels that are equally loaded are picked in turn. Must be
+ * called with @grp->lock held.
+ */
+static struct rpmsg_group_member *rpmsg_group_pick(struct rpmsg_group *grp)
+{
+	struct rpmsg_group_member *m, *best = NULL;
+	unsigned long load, best_load = ULONG_MAX;
+
+	list_for_each_entry(m, &grp->members, node) {
+		if (m->dead)
+			continue;
+
+		load = rpmsg_group_load(m);
+		if (load < best_load) {
+			best = m;
+			best_load = load;
+		}
+	}
+
+	if (best)
+		list_move_tail(&best->node, &grp->members);
+
+	return best;
+}
+
+/**
+ * rpmsg_group_get_channel() - pick the least loaded channel of a group
+ * @grp: the service group
+ *
+ * The channel counts as loaded, and stays in the group, until it's given
+ * back with rpmsg_group_put_channel(). Users that know when the remote
+ * service is done with what they sent it (e.g. they wait for its reply)
+ * should hold it until then, so the load is known even if the remote
+ * processor doesn't publish it.
+ *
+ * This function can be called from atomic/interrupt context.
+ *
+ * Returns the channel, or NULL if @grp has none.
+ */
+struct rpmsg_channel *rpmsg_group_get_channel(struct rpmsg_group *grp)
+{
+	struct rpmsg_group_member *m;
+	unsigned long flags;
+
+	spin_lock_irqsave(&grp->lock, flags);
+	m = rpmsg_group_pick(grp);
+	if (m)
+		m->users++;
+	spin_unlock_irqrestore(&grp->lock, flags);
+
+	return m ? m->rpdev : NULL;
+}
+EXPORT_SYMBOL(rpmsg_group_get_channel);
+
+/**
+ * rpmsg_group_put_channel() - give back a channel of a group
+ * @grp: the service group
+ * @rpdev: the channel, as returned by rpmsg_group_get_channel()
+ *
+ * This function can be called from atomic/interrupt context.
+ */
+void rpmsg_group_put_channel(struct rpmsg_group *grp,
+					struct rpmsg_channel *rpdev)
+{
+	struct rpmsg_group_member *m;
+	unsigned long flags;
+
+	spin_lock_irqsave(&grp->lock, flags);
+
+	m = rpmsg_group_member(grp, rpdev);
+	if (!WARN_ON(!m || !m->users))
+		m->users--;
+
+	/* rpmsg_group_del() may free @m as soon as we unlock */
+	wake_up(&grp->wq);
+
+	spin_unlock_irqrestore(&grp->lock, flags);
+}
+EXPORT_SYMBOL(rpmsg_group_put_channel);
+
+/**
+ * rpmsg_group_send() - send a message to the least loaded remote service
+ * @grp: the service group
+ * @data: payload of message
+ * @len: length of payload
+ *
+ * Sends @data to the remote service of the least loaded channel of @grp,
+ * as rpmsg_send() does, i.e. waiting for a tx buffer if need be.
+ *
+ * Can only be called from process context.
+ *
+ * Returns 0 on success, -ENODEV if @grp has no channel, or an error code
+ * as rpmsg_send() does.
+ */
+int rpmsg_group_send(struct rpmsg_group *grp, void *data, int len)
+{
+	struct rpmsg_channel *rpdev;
+	int ret;
+
+	rpdev = rpmsg_group_get_channel(grp);
+	if (!rpdev)
+		return -ENODEV;
+
+	ret = rpmsg_send(rpdev, data, len);
+
+	rpmsg_group_put_channel(grp, rpdev);
+
+	return ret;
+}
+EXPORT_SYMBOL(rpmsg_group_send);
+
+/**
+ * rpmsg_group_open_session() - open a session on a service group
+ * @grp: the service group
+ *
+ * The session is opened on the least loaded channel of @grp, and all that's
+ * sent over it, with rpmsg_group_session_send(), goes to that channel. The
+ * session counts in the load of the channel until it's closed.
+ *
+ * Returns the session on success, or an ERR_PTR() on failure (-ENODEV if
+ * @grp has no channel).
+ */
+struct rpmsg_group_session *rpmsg_group_open_session(struct rpmsg_group *grp)
+{
+	struct rpmsg_group_session *sess;
+	unsigned long flags;
+
+	sess = kzalloc(sizeof(*sess), GFP_KERNEL);
+	if (!sess)
+		return ERR_PTR(-ENOMEM);
+
+	sess->grp = grp;
+
+	spin_lock_irqsave(&grp->lock, flags);
+
+	sess->member = rpmsg_group_pick(grp);
+	if (!sess->member) {
+		spin_unlock_irqrestore(&grp->lock, flags);
+		kfree(sess);
+		return ERR_PTR(-ENODEV);
+	}
+
+	sess->member->sessions++;
+	list_add_tail(&sess->node, &grp->sessions);
+
+	spin_unlock_irqrestore(&grp->lock, flags);
+
+	return sess;
+}
+EXPORT_SYMBOL(rpmsg_group_open_session);
+
+/**
+ * rpmsg_group_close_session() - close a session
+ * @sess: the session, as returned by rpmsg_group_open_session()
+ */
+void rpmsg_group_close_session(struct rpmsg_group_session *sess)
+{
+	struct rpmsg_group *grp = sess->grp;
+	unsigned long flags;
+
+	spin_lock_irqsave(&grp->lock, flags);
+	if (sess->member)
+		sess->member->sessions--;
+	list_del(&sess->node);
+	spin_unlock_irqrestore(&grp->lock, flags);
+
+	kfree(sess);
+}
+EXPORT_SYMBOL(rpmsg_group_close_session);
+
+/**
+ * rpmsg_group_session_send() - send a message over a session
+ * @sess: the session
+ * @data: payload of message
+ * @len: length of payload
+ *
+ * Sends @data to the remote service of the channel @sess was opened on, as
+ * rpmsg_send() does.
+ *
+ * Can only be called from process context.
+ *
+ * Returns 0 on success, -ENODEV if the channel of @sess is gone (the
+ * remote service then lost whatever it kept for the session), or an error
+ * code as rpmsg_send() does.
+ */
+int rpmsg_group_session_send(struct rpmsg_group_session *sess, void *data,
+								int len)
+{
+	struct rpmsg_group *grp = sess->grp;
+	struct rpmsg_group_member *m;
+	unsigned long flags;
+	int ret;
+
+	spin_lock_irqsave(&grp->lock, flags);
+	m = sess->member;
+	if (m)
+		m->users++;
+	spin_unlock_irqrestore(&grp->lock, flags);
+
+	if (!m)
+		return -ENODEV;
+
+	ret = rpmsg_send(m->rpdev, data, len);
+
+	rpmsg_group_put_channel(grp, m->rpdev);
+
+	return ret;
+}
+EXPORT_SYMBOL(rpmsg_group_session_send);
+
+MODULE_DESCRIPTION("Remote processor messaging service groups");
+MODULE_LICENSE("GPL v2");
@@ -0,0 +1,401 @@
+/*
+ * Remote processor messaging - request/response helper
+ *
+ * Lets drivers issue calls to a remote service, i.e. send a request and
+ * wait for the matching reply, with any number of calls in flight at once.
+ * Replies are matched to their calls by the transaction ID of the message
+ * header (see <linux/rpmsg_rpc.h>), and copied straight into the buffer
+ * of the caller, so the fast path doesn't allocate anything.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#define pr_fmt(fmt) "%s: " fmt, __func__
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/bitmap.h>
+#include <linux/completion.h>
+#include <linux/device.h>
+#include <linux/err.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/string.h>
+#include <linux/uio.h>
+#include <linux/wait.h>
+#include <linux/rpmsg.h>
+#include <linux/rpmsg_rpc.h>
+
+/*
+ * the payload of a call is still pending: a reply (or an error) replaces it
+ * once the call is complete
+ */
+#define RPMSG_RPC_PENDING	(-EINPROGRESS)
+
+/**
+ * struct rpmsg_rpc_call - a call slot
+ * @done: completed once the reply arrives (or the rpc endpoint goes away)
+ * @reply: where the reply payload is copied
+ * @reply_size: size of @reply
+ * @len: length of the reply, RPMSG_RPC_PENDING until it arrives, or an
+ *	 error code
+ * @id: transaction ID of the current call. Its low bits are the index of
+ *	the slot, and the rest is bumped on every call, so late replies of
+ *	calls that were given up on can't be mistaken for newer ones
+ */
+struct rpmsg_rpc_call {
+	struct completion done;
+	void *reply;
+	int reply_size;
+	int len;
+	u32 id;
+};
+
+/**
+ * struct rpmsg_rpc - an rpc endpoint
+ * @rpdev: the channel of the remote service
+ * @ept: our endpoint, whose address requests are sent from
+ * @dst: address of the remote service
+ * @cb: invoked with the incoming messages that aren't replies (optional)
+ * @priv: private data of @cb
+ * @lock: protects the call slots, @busy, @users and @dead
+ * @slotq: callers wait here for a free call slot, and rpmsg_rpc_destroy()
+ *	   for the last caller to be gone
+ * @users: number of callers holding a call slot
+ * @dead: the endpoint is being destroyed
+ * @max_calls: number of entries in @calls
+ * @busy: call slots in use
+ * @calls: the call slots
+ */
+struct rpmsg_rpc {
+	struct rpmsg_channel *rpdev;
+	struct rpmsg_endpoint *ept;
+	u32 dst;
+	rpmsg_rx_cb_t cb;
+	void *priv;
+	spinlock_t lock;
+	wait_queue_head_t slotq;
+	int users;
+	bool dead;
+	int max_calls;
+	DECLARE_BITMAP(busy, RPMSG_RPC_MAX_CALLS);
+	struct rpmsg_rpc_call calls[0];
+};
+
+/*
+ * dispatch an incoming message: replies complete their call, anything else
+ * is handed over to the user's callback.
+ *
+ * This is an atomic endpoint callback: it must not sleep.
+ */
+static void rpmsg_rpc_cb(struct rpmsg_channel *rpdev, void *data, int len,
+							void *priv, u32 src)
+{
+	struct rpmsg_rpc *rpc = priv;
+	struct rpmsg_rpc_hdr *hdr = data;
+	struct rpmsg_rpc_call *call;
+	unsigned long flags;
+	int idx;
+
+	if (len < sizeof(*hdr)) {
+		dev_warn_ratelimited(&rpdev->dev, "short rpc message (%d)\n",
+									len);
+		return;
+	}
+
+	len -= sizeof(*hdr);
+
+	if (!(hdr->flags & RPMSG_RPC_F_REPLY)) {
+		if (rpc->cb)
+			rpc->cb(rpdev, hdr->data, len, rpc->priv, src);
+		return;
+	}
+
+	idx = hdr->id % RPMSG_RPC_MAX_CALLS;
+	if (idx >= rpc->max_calls) {
+		dev_warn_ratelimited(&rpdev->dev, "bogus rpc reply 0x%x\n",
+								hdr->id);
+		return;
+	}
+
+	call = &rpc->calls[idx];
+
+	spin_lock_irqsave(&rpc->lock, flags);
+
+	/* the caller may have given up on this one already */
+	if (!test_bit(idx, rpc->busy) || call->id != hdr->id ||
+					call->len != RPMSG_RPC_PENDING) {
+		spin_unlock_irqrestore(&rpc->lock, flags);
+		dev_dbg(&rpdev->dev, "stale rpc reply 0x%x\n", hdr->id);
+		return;
+	}
+
+	memcpy(call->reply, hdr->data, min(len, call->reply_size));
+	call->len = len > call->reply_size ? -EMSGSIZE : len;
+	complete(&call->done);
+
+	spin_unlock_irqrestore(&rpc->lock, flags);
+}
+
+/*
+ * grab a free call slot, and give it a new transaction ID. Returns NULL if
+ * all the slots are busy, or ERR_PTR(-ENODEV) if @rpc is being destroyed.
+ */
+static struct rpmsg_rpc_call *rpmsg_rpc_get_call(struct rpmsg_rpc *rpc,
+						void *reply, int reply_size)
+{
+	struct rpmsg_rpc_call *call = NULL;
+	unsigned long flags;
+	int idx;
+
+	spin_lock_irqsave(&rpc->lock, flags);
+
+	if (rpc->dead) {
+		call = ERR_PTR(-ENODEV);
+		goto unlock;
+	}
+
+	idx = find_first_zero_bit(rpc->busy, rpc->max_calls);
+	if (idx >= rpc->max_calls)
+		goto unlock;
+
+	set_bit(idx, rpc->busy);
+	rpc->users++;
+
+	call = &rpc->calls[idx];
+	call->id += RPMSG_RPC_MAX_CALLS;
+	call->reply = reply;
+	call->reply_size = reply_size;
+	call->len = RPMSG_RPC_PENDING;
+	INIT_COMPLETION(call->done);
+
+unlock:
+	spin_unlock_irqrestore(&rpc->lock, flags);
+	return call;
+}
+
+/*
+ * give back a call slot, and return the outcome of its call: the reply
+ * length, or @err if the reply didn't arrive (in time).
+ */
+static int rpmsg_rpc_put_call(struct rpmsg_rpc *rpc,
+					struct rpmsg_rpc_call *call, int err)
+{
+	unsigned long flags;
+	int ret;
+
+	spin_lock_irqsave(&rpc->lock, flags);
+
+	/* the reply may have won the race against the timeout */
+	ret = call->len == RPMSG_RPC_PENDING ? err : call->len;
+
+	call->reply = NULL;
+	clear_bit(call - rpc->calls, rpc->busy);
+	rpc->users--;
+
+	/* rpmsg_rpc_destroy() may free @rpc as soon as we unlock */
+	wake_up(&rpc->slotq);
+
+	spin_unlock_irqrestore(&rpc->lock, flags);
+
+	return ret;
+}
+
+/* are all the callers gone ? */
+static bool rpmsg_rpc_idle(struct rpmsg_rpc *rpc)
+{
+	unsigned long flags;
+	bool ret;
+
+	spin_lock_irqsave(&rpc->lock, flags);
+	ret = !rpc->users;
+	spin_unlock_irqrestore(&rpc->lock, flags);
+
+	return ret;
+}
+
+/**
+ * rpmsg_rpc_call() - call the remote service, and wait for its reply
+ * @rpc: the rpc endpoint
+ * @req: payload of the request
+ * @req_len: length of @req
+ * @reply: where the payload of the reply is copied
+ * @reply_size: size of @reply
+ * @timeout: max time to wait for the reply (and for a free call slot,
+ *	     beforehand), in jiffies, or MAX_SCHEDULE_TIMEOUT to wait
+ *	     indefinitely
+ *
+ * Sends @req to the remote service of @rpc, with a new transaction ID, and
+ * waits until the reply with the same ID arrives. Any number of callers
+ * may have a call in flight at once, up to the max_calls @rpc was created
+ * with; beyond that, callers wait for one of the calls to complete.
+ *
+ * Nothing is allocated along the way: the request is gathered straight
+ * into a TX buffer, and the reply copied straight into @reply. Waiting
+ * for that TX buffer is bound by the tx timeout of the channel, as with
+ * rpmsg_sendv().
+ *
+ * Can only be called from process context.
+ *
+ * Returns the length of the reply on success, or an appropriate error
+ * value on failure: -ETIMEDOUT if @timeout elapsed, -ERESTARTSYS if a
+ * signal arrived, -EMSGSIZE if the reply was bigger than @reply_size
+ * (@reply then holds its first @reply_size bytes), or -ENODEV if @rpc is
+ * being destroyed. A reply that arrives after its caller gave up on it
+ * is dropped.
+ */
+int rpmsg_rpc_call(struct rpmsg_rpc *rpc, void *req, int req_len,
+			void *reply, int reply_size, long timeout)
+{
+	struct rpmsg_rpc_call *call = NULL;
+	struct rpmsg_rpc_hdr hdr;
+	struct kvec vec[2];
+	long ret;
+	int err;
+
+	might_sleep();
+
+	if (req_len < 0 || reply_size < 0 || timeout <= 0)
+		return -EINVAL;
+
+	/* wait for a free call slot */
+	ret = wait_event_interruptible_timeout(rpc->slotq,
+			(call = rpmsg_rpc_get_call(rpc, reply, reply_size)),
+			timeout);
+	if (!call)
+		return ret < 0 ? ret : -ETIMEDOUT;
+	if (IS_ERR(call))
+		return PTR_ERR(call);
+
+	/* whatever's left of the timeout is for the reply */
+	timeout = ret;
+
+	hdr.id = call->id;
+	hdr.flags = 0;
+	hdr.reserved = 0;
+
+	vec[0].iov_base = &hdr;
+	vec[0].iov_len = sizeof(hdr);
+	vec[1].iov_base = req;
+	vec[1].iov_len = req_len;
+
+	err = rpmsg_sendv_offchannel_raw(rpc->rpdev, rpc->ept->addr, rpc->dst,
+								vec, 2, true);
+	if (err)
+		return rpmsg_rpc_put_call(rpc, call, err);
+
+	ret = wait_for_completion_interruptible_timeout(&call->done, timeout);
+
+	return rpmsg_rpc_put_call(rpc, call, ret < 0 ? ret : -ETIMEDOUT);
+}
+EXPORT_SYMBOL(rpmsg_rpc_call);
+
+/**
+ * rpmsg_rpc_create() - create an rpc endpoint to call a remote service
+ * @rpdev: the channel of the remote service
+ * @dst: address of the remote service
+ * @max_calls: max number of calls in flight at once (up to
+ *	       RPMSG_RPC_MAX_CALLS)
+ * @cb: invoked with the incoming messages that aren't replies, i.e. the
+ *	requests and notifications of the remote service (optional)
+ * @priv: private data of @cb
+ *
+ * Creates a new endpoint on @rpdev, which calls to the @dst remote service
+ * are issued from, with rpmsg_rpc_call(). The call slots are all allocated
+ * upfront.
+ *
+ * @cb is invoked with the payload of the message, past its rpc header, in
+ * atomic context: it must not sleep.
+ *
+ * Returns the rpc endpoint on success, or an ERR_PTR() on failure.
+ */
+struct rpmsg_rpc *rpmsg_rpc_create(struct rpmsg_channel *rpdev, u32 dst,
+			int max_calls, rpmsg_rx_cb_t cb, void *priv)
+{
+	struct rpmsg_rpc *rpc;
+	int i;
+
+	if (max_calls <= 0 || max_calls > RPMSG_RPC_MAX_CALLS ||
+						dst == RPMSG_ADDR_ANY)
+		return ERR_PTR(-EINVAL);
+
+	rpc = kzalloc(sizeof(*rpc) + max_calls * sizeof(rpc->calls[0]),
+								GFP_KERNEL);
+	if (!rpc)
+		return ERR_PTR(-ENOMEM);
+
+	rpc->rpdev = rpdev;
+	rpc->dst = dst;
+	rpc->cb = cb;
+	rpc->priv = priv;
+	rpc->max_calls = max_calls;
+	spin_lock_init(&rpc->lock);
+	init_waitqueue_head(&rpc->slotq);
+
+	for (i = 0; i < max_calls; i++) {
+		init_completion(&rpc->calls[i].done);
+		rpc->calls[i].id = i;
+	}
+
+	/* replies are dispatched right from the rx path */
+	rpc->ept = rpmsg_create_atomic_ept(rpdev, rpmsg_rpc_cb, rpc,
+							RPMSG_ADDR_ANY);
+	if (!rpc->ept) {
+		dev_err(&rpdev->dev, "failed to create rpc endpoint\n");
+		kfree(rpc);
+		return ERR_PTR(-ENOMEM);
+	}
+
+	return rpc;
+}
+EXPORT_SYMBOL(rpmsg_rpc_create);
+
+/**
+ * rpmsg_rpc_destroy() - destroy an rpc endpoint
+ * @rpc: the rpc endpoint
+ *
+ * Calls that are still in flight fail with -ENODEV, as do those issued
+ * from now on. Returns once all the callers are gone.
+ */
+void rpmsg_rpc_destroy(struct rpmsg_rpc *rpc)
+{
+	unsigned long flags;
+	int idx;
+
+	/* no more replies after this */
+	rpmsg_destroy_ept(rpc->ept);
+
+	spin_lock_irqsave(&rpc->lock, flags);
+
+	rpc->dead = true;
+
+	for_each_set_bit(idx, rpc->busy, rpc->max_calls) {
+		struct rpmsg_rpc_call *call = &rpc->calls[idx];
+
+		if (call->len == RPMSG_RPC_PENDING) {
+			call->len = -ENODEV;
+			complete(&call->done);
+		}
+	}
+
+	spin_unlock_irqrestore(&rpc->lock, flags);
+
+	/* callers waiting for a call slot give up, too */
+	wake_up_all(&rpc->slotq);
+
+	wait_event(rpc->slotq, rpmsg_rpc_idle(rpc));
+
+	kfree(rpc);
+}
+EXPORT_SYMBOL(rpmsg_rpc_destroy);
+
+MODULE_DESCRIPTION("Remote processor messaging request/response helper");
+MODULE_LICENSE("GPL v2");
@@ -33,24 +33,422 @@
 #include <linux/wait.h>
 #include <linux/rpmsg.h>
 #include <linux/mutex.h>
+#include <linux/genalloc.h>
+#include <linux/workqueue.h>
+#include <linux/rcupdate.h>
+#include <linux/bitops.h>
+#include <linux/llist.h>
+#include <linux/jhash.h>
+#include <linux/percpu.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/delay.h>
+#include <linux/fault-inject.h>
+#include <linux/remoteproc.h>
+#include <linux/vmalloc.h>
+#include <linux/virtio_ring.h>
+#include <linux/kfifo.h>
+#include <linux/cache.h>
+#include <linux/pm_qos.h>
+#include <linux/shrinker.h>
+#include <linux/async.h>
+#include <linux/cpu.h>
+
+#define CREATE_TRACE_POINTS
+#include <trace/events/rpmsg.h>
+
+static const struct rpmsg_transport_ops virtio_rpmsg_ops;
+
+/* most inbound msgs a batch endpoint is handed at once */
+#define RPMSG_RX_BATCH		(32)
 
 /**
- * struct virtproc_info - virtual remote processor state
- * @vdev:	the virtio device
+ * struct rpmsg_queue_pair - a pair of rx and tx virtqueues
+ * @vrp:	the virtual remote processor this pair belongs to
  * @rvq:	rx virtqueue
  * @svq:	tx virtqueue
+ * @rbufs:	kernel address of this pair's rx buffers
+ * @num_rbufs:	number of rx buffers of this pair
+ * @rx_chains:	big rx buffers, made of chains of pages (see
+ *		VIRTIO_RPMSG_F_RX_CHAIN)
+ * @num_rx_chains: number of entries in @rx_chains
+ * @rx_bounce:	where messages spanning several pages of a chain are
+ *		reassembled before they're delivered
+ * @rx_chains_spare: entries of @rx_chains that have no pages at the moment
+ * @rx_chains_live: number of entries of @rx_chains that have their pages
+ * @rx_chains_posted: number of chains the remote processor may fill. only
+ *		touched by the owner of the rx virtqueue
+ * @rx_chains_trim: number of chains whose pages should be freed as they
+ *		come back, instead of being given back (see rpmsg_rx_shrink())
+ * @rx_grow_work: gives a spare chain its pages, once the remote processor
+ *		filled all of those it had
+ * @rx_work:	polls the rx virtqueue, and dispatches inbound messages
+ * @rx_state:	RPMSG_RX_POLLING is set while someone owns the rx virtqueue
+ * @rx_deferred: inbound buffer that was picked up by the rx virtqueue
+ *		callback, but whose msg must be delivered to its endpoint from
+ *		a sleepable context
+ * @rx_cur:	inbound msg currently being delivered to its endpoint
+ * @rx_cur_held: the endpoint took ownership of @rx_cur's buffer
+ * @rx_held:	number of rx buffers currently held by endpoints
+ * @rx_released: held rx buffers that were released, and should be given
+ *		back to the remote processor by the owner of the rx virtqueue
+ * @rx_stamp:	local_clock() time of the last rx interrupt, against which the
+ *		rx latency of the messages it brought in is measured
+ * @rx_bulk:	index (in @rbufs) of the inbound msgs of low priority
+ *		endpoints, whose buffers are held until @rx_bulk_work delivers
+ *		them. filled by the owner of the rx virtqueue, and emptied
+ *		under @rx_bulk_lock
+ * @rx_bulk_work: delivers the msgs of @rx_bulk, out of the way of the rx path
+ * @rx_bulk_lock: serializes the deliveries of @rx_bulk msgs, to keep them in
+ *		order
+ * @rx_bulk_cur: @rx_bulk msg currently being delivered to its endpoint
+ * @rx_bulk_cur_held: the endpoint took ownership of @rx_bulk_cur's buffer
+ * @rx_stalled:	an rx stall was injected, which the rx work is to sit through
+ *		before it polls the rx virtqueue (see CONFIG_FAIL_RPMSG)
+ * @rx_batch:	consecutive inbound msgs of the batch endpoint @rx_batch_ept,
+ *		picked up by the owner of the rx virtqueue in its current
+ *		drain pass, whose buffers are held until they're delivered
+ * @rx_batch_num: number of msgs in @rx_batch
+ * @rx_batch_ept: endpoint @rx_batch is for (which it holds a reference to),
+ *		or NULL if @rx_batch is empty
+ * @rx_out:	number of rx buffers (not counting the big ones) the remote
+ *		processor filled, and which weren't given back to it yet
+ *
+ * Remote processors supporting VIRTIO_RPMSG_F_MQ may announce several
+ * queue pairs, so independent traffic doesn't have to go through (and
+ * block behind other messages in) a single pair of vrings.
+ */
+struct rpmsg_queue_pair {
+	struct virtproc_info *vrp;
+	struct virtqueue *rvq, *svq;
+	void *rbufs;
+	int num_rbufs;
+	struct rpmsg_rx_chain *rx_chains;
+	int num_rx_chains;
+	void *rx_bounce;
+	struct llist_head rx_chains_spare;
+	atomic_t rx_chains_live;
+	int rx_chains_posted;
+	atomic_t rx_chains_trim;
+	struct work_struct rx_grow_work;
+	struct work_struct rx_work;
+	unsigned long rx_state;
+	void *rx_deferred;
+	struct rpmsg_hdr *rx_cur;
+	bool rx_cur_held;
+	atomic_t rx_held;
+	struct llist_head rx_released;
+	u64 rx_stamp;
+	DECLARE_KFIFO_PTR(rx_bulk, unsigned int);
+	struct work_struct rx_bulk_work;
+	struct mutex rx_bulk_lock;
+	struct rpmsg_hdr *rx_bulk_cur;
+	bool rx_bulk_cur_held;
+#ifdef CONFIG_FAIL_RPMSG
+	bool rx_stalled;
+#endif
+	struct rpmsg_rx_msg rx_batch[RPMSG_RX_BATCH];
+	int rx_batch_num;
+	struct rpmsg_endpoint *rx_batch_ept;
+	atomic_t rx_out;
+};
+
+/* size of a big rx buffer, and the number of pages it's made of */
+#define RPMSG_RX_CHAIN_SIZE	(64 * 1024)
+#define RPMSG_RX_CHAIN_PAGES	DIV_ROUND_UP(RPMSG_RX_CHAIN_SIZE, PAGE_SIZE)
+
+/**
+ * struct rpmsg_rx_chain - a big rx buffer, made of a chain of pages
+ * @node:	links the chain into rx_released (see rpmsg_freeze()), just
+ *		like the regular rx buffers are; must come first
+ * @sg:		the pages, as added to the rx virtqueue, which uses a single
+ *		(indirect) descriptor for all of them
+ * @dma:	dma address of each page, through which it's synced
+ * @msg:	the msg last received in the chain: its first page, if the msg
+ *		fits in there, or else its queue pair's rx_bounce buffer
+ *
+ * The pages are allocated one by one, so big messages don't need big
+ * physically contiguous buffers, and only these few buffers are big.
+ */
+struct rpmsg_rx_chain {
+	struct llist_node node;
+	struct scatterlist sg[RPMSG_RX_CHAIN_PAGES];
+	dma_addr_t dma[RPMSG_RX_CHAIN_PAGES];
+	struct rpmsg_hdr *msg;
+};
+
+/* size (log2) of the per-vrp channels hash table */
+#define RPMSG_CHANNELS_HASH_BITS	8
+
+/* bits of rpmsg_queue_pair's rx_state */
+#define RPMSG_RX_POLLING	0
+#define RPMSG_RX_THROTTLED	1
+#define RPMSG_RX_NO_GROW	2
+
+/* bits of virtproc_info's qos_state */
+#define RPMSG_QOS_ACTIVE	0
+
+/*
+ * Endpoints may hold at most half of the rx buffers of a queue pair;
+ * the rest is a reserve, so the remote processor can't be starved.
+ */
+#define RPMSG_RX_HOLD_RATIO	2
+
+/* we currently support up to 4 queue pairs */
+#define RPMSG_MAX_QUEUE_PAIRS	(4)
+
+/* latency histograms have log2 buckets, of up to 2^31 nsecs (~2 seconds) */
+#define RPMSG_LAT_BUCKETS	(32)
+
+/**
+ * struct rpmsg_ept_stats - per-cpu traffic counters of an endpoint
+ * @rx_msgs:	number of inbound messages handed over to the endpoint
+ * @rx_bytes:	payload bytes of those messages
+ * @tx_msgs:	number of messages sent on behalf of the endpoint
+ * @tx_bytes:	payload bytes of those messages
+ * @tx_waits:	number of times a sender had to wait for a tx buffer (or
+ *		credit) on behalf of the endpoint
+ * @oneway_lat:	log2 histogram (in nsecs) of the time elapsed between the
+ *		moment the remote processor stamped an inbound message, and
+ *		the invocation of the endpoint's rx callback (only filled if
+ *		VIRTIO_RPMSG_F_TSTAMP was negotiated)
+ */
+struct rpmsg_ept_stats {
+	u64 rx_msgs;
+	u64 rx_bytes;
+	u64 tx_msgs;
+	u64 tx_bytes;
+	u64 tx_waits;
+	u64 oneway_lat[RPMSG_LAT_BUCKETS];
+};
+
+/**
+ * struct rpmsg_ept_rx - deferred deliveries of an endpoint
+ * @ept:	the endpoint
+ * @vrp:	the remote processor @ept belongs to
+ * @fifo:	the inbound msgs of @ept, whose rx buffers are held until
+ *		@work delivers them: the index of each msg in the rbufs of its
+ *		queue pair, times RPMSG_MAX_QUEUE_PAIRS, plus the index of
+ *		the queue pair
+ * @fifo_lock:	serializes the rx virtqueues feeding @fifo
+ * @work:	delivers the msgs of @fifo
+ * @wq:		ordered workqueue @work runs on (RPMSG_RX_CTX_WQ only)
+ * @cpu:	cpu @work runs on (RPMSG_RX_CTX_CPU only, -1 otherwise)
+ * @lock:	serializes the deliveries of @fifo msgs, to keep them in order
+ * @cur:	@fifo msg currently being delivered
+ * @cur_held:	@ept took ownership of @cur's buffer
+ */
+struct rpmsg_ept_rx {
+	struct rpmsg_endpoint *ept;
+	struct virtproc_info *vrp;
+	DECLARE_KFIFO_PTR(fifo, unsigned int);
+	spinlock_t fifo_lock;
+	struct work_struct work;
+	struct workqueue_struct *wq;
+	int cpu;
+	struct mutex lock;
+	struct rpmsg_hdr *cur;
+	bool cur_held;
+};
+
+/**
+ * struct rpmsg_vrp_stats - per-cpu traffic counters of a remote processor
+ * @rx_msgs:	number of inbound messages handed over to an endpoint
+ * @rx_bytes:	payload bytes of those messages
+ * @rx_drops:	number of inbound messages that were dropped, be it because
+ *		they had no recipient or because they were malformed
+ * @tx_msgs:	number of messages sent
+ * @tx_bytes:	payload bytes of those messages
+ * @tx_waits:	number of times a sender had to wait for a tx buffer
+ * @tx_timeouts: number of times a sender gave up waiting for a tx buffer
+ * @rx_throttles: number of times the remote processor was told to hold off
+ *		sending, because we were running out of rx buffers
+ * @tx_lat:	log2 histogram (in nsecs) of the time it took to get tx
+ *		buffers back from the remote processor, once sent
+ * @rx_lat:	log2 histogram (in nsecs) of the time elapsed between an rx
+ *		interrupt and the invocation of an endpoint's rx callback
+ * @oneway_lat:	the oneway_lat histograms of all the endpoints, combined
+ */
+struct rpmsg_vrp_stats {
+	u64 rx_msgs;
+	u64 rx_bytes;
+	u64 rx_drops;
+	u64 tx_msgs;
+	u64 tx_bytes;
+	u64 tx_waits;
+	u64 tx_timeouts;
+	u64 rx_throttles;
+	u64 tx_lat[RPMSG_LAT_BUCKETS];
+	u64 rx_lat[RPMSG_LAT_BUCKETS];
+	u64 oneway_lat[RPMSG_LAT_BUCKETS];
+};
+
+/**
+ * struct rpmsg_tx_cb - completion of an in-flight asynchronous message
+ * @done:	invoked once the remote processor is done with the message
+ *		(NULL if the message wasn't sent with rpmsg_send_async())
+ * @priv:	private data of @done
+ * @buf:	the tx buffer, which is only freed once @done returns
+ * @err:	outcome of the message, as reported to @done
+ * @node:	linked into the vrp's tx_done list, once it's complete
+ */
+struct rpmsg_tx_cb {
+	rpmsg_tx_done_t done;
+	void *priv;
+	void *buf;
+	int err;
+	struct list_head node;
+};
+
+/*
+ * Senders of endpoints without a tx quota grab fixed-size tx buffers from
+ * a cache of their cpu, which is refilled from the free buffers in bulk,
+ * so the tx lock is only taken once per batch of buffers to allocate them.
+ * The caches hold up to this many buffers each, and no more than a fourth
+ * of all the tx buffers altogether.
+ */
+#define RPMSG_TX_CACHE_SIZE	(16)
+
+/**
+ * struct rpmsg_tx_cache - per-cpu cache of free fixed-size tx buffers
+ * @lock:	protects @bufs. only contended when a sender ran out of tx
+ *		buffers, and takes back those of the other caches
+ * @count:	number of buffers in @bufs
+ * @bufs:	the cached buffers
+ */
+struct rpmsg_tx_cache {
+	spinlock_t lock;
+	int count;
+	void *bufs[RPMSG_TX_CACHE_SIZE];
+};
+
+/*
+ * number of dynamic addresses (above RPMSG_RESERVED_ADDRESSES) handed out
+ * from the address bitmap of a vrp. If they're all taken, addresses
+ * beyond them are looked up in the endpoints idr, the slow way.
+ */
+#define RPMSG_DYN_ADDRESSES	(4096)
+
+/**
+ * struct virtproc_info - virtual remote processor state
+ * @vdev:	the virtio device
+ * @qps:	the rx/tx virtqueue pairs
+ * @num_qps:	number of entries in @qps
  * @rbufs:	kernel address of rx buffers
  * @sbufs:	kernel address of tx buffers
+ * @num_rbufs:	number of rx buffers (of all queue pairs)
+ * @num_sbufs:	number of tx buffers
+ * @buf_size:	size of each rx buffer, and of each fixed-size tx buffer
+ * @buf_stride:	distance between two consecutive rx (or fixed-size tx)
+ *		buffers: @buf_size, unless the buffers are aligned (see
+ *		align_bufs)
+ * @buf_pad:	offset of the first rx (resp. fixed-size tx) buffer in
+ *		@rbufs (resp. @sbufs): 0, unless the buffers are aligned
+ * @total_buf_space: size of the whole (rx and tx) buffer space
+ * @max_txbuf_size: biggest tx buffer we can hand out (header included)
  * @last_sbuf:	index of last tx buffer used
  * @bufs_dma:	dma base addr of the buffers
- * @tx_lock:	protects svq, sbufs and sleepers, to allow concurrent senders.
- *		sending a message might require waking up a dozing remote
- *		processor, which involves sleeping, hence the mutex.
- * @endpoints:	idr of local endpoints, allows fast retrieval
- * @endpoints_lock: lock of the endpoints set
- * @sendq:	wait queue of sending contexts waiting for a tx buffers
+ * @dma_dev:	the device the buffers are allocated and mapped with, i.e.
+ *		the one the remote processor sees memory through, or NULL if
+ *		the other side sees the kernel's memory at its physical
+ *		addresses (e.g. a hypervisor, behind virtio_pci or virtio_mmio),
+ *		in which case the buffers are plain kernel memory
+ * @cached_bufs: the buffers are cacheable memory, rather than coherent one,
+ *		so they're synced as they're handed to the remote processor,
+ *		and as they're handed back (see cached_bufs)
+ * @ipc_bufs:	the (coherent) buffers are in the IPC region of the remote
+ *		processor, next to the vrings (see rproc_vdev_alloc_ipc())
+ * @tx_pool:	variable-size tx buffer allocator, if VIRTIO_RPMSG_F_VARBUF
+ *		was negotiated (NULL otherwise)
+ * @tx_sizes:	size (in pool granules) of every allocated @tx_pool buffer,
+ *		indexed by the buffer's granule offset within @sbufs
+ * @free_sbufs:	stack of free fixed-size tx buffers, be it buffers that were
+ *		given back unused, or used ones reclaimed from the tx vring
+ * @num_free_sbufs: number of buffers in @free_sbufs
+ * @tx_cache:	per-cpu caches of free fixed-size tx buffers (NULL if
+ *		variable-size tx buffers are used, or if there are too few
+ *		tx buffers to spread them over the cpus)
+ * @tx_cache_size: number of buffers a cache is refilled with
+ * @tx_lock:	protects the svqs, sbufs and sleepers, to allow concurrent
+ *		senders. it is a spinlock (taken with irqs disabled), so
+ *		non-blocking senders can be in any context; kicking the
+ *		remote processor is always done outside of it.
+ * @endpoints:	idr of local endpoints, allows fast retrieval. lookups are
+ *		protected by RCU, updates by @endpoints_lock
+ * @endpoints_lock: serializes updates of the endpoints set
+ * @dyn_addrs:	bound addresses of the dynamic range (including those that
+ *		were explicitly requested), so allocating one is a bitmap
+ *		lookup. protected by @endpoints_lock
+ * @next_dyn_addr: where the next bitmap lookup starts, so a freed address
+ *		isn't immediately reused (stale messages of its previous
+ *		owner may still be on their way)
+ * @tx_owners:	endpoint charged for every in-flight tx buffer (if it has a
+ *		tx quota), indexed like @tx_sizes (or by buffer index, if
+ *		fixed-size tx buffers are used)
+ * @tx_stamps:	local_clock() time at which every in-flight tx buffer was
+ *		sent (0 if it wasn't), indexed like @tx_owners
+ * @sendq:	wait queues of sending contexts waiting for a tx buffers, one
+ *		per tx priority. senders wait exclusively, and are woken up
+ *		in FIFO order, higher priorities first
+ * @tx_waiters:	number of senders waiting on each of @sendq
+ * @creditq:	wait queue of senders waiting for their endpoint's tx quota
  * @sleepers:	number of senders that are waiting for a tx buffer
+ * @tx_cbs:	completion of every in-flight tx buffer, indexed like
+ *		@tx_owners
+ * @tx_done:	completed asynchronous messages, whose callback is yet to
+ *		be invoked. protected by @tx_lock
+ * @tx_done_work: invokes the callbacks of @tx_done, when the messages
+ *		were reclaimed outside of the "tx-complete" interrupt
+ * @tx_notify:	non-blocking senders waiting for a tx buffer, see
+ *		rpmsg_wait_tx_buf(). protected by @tx_lock
+ * @tx_notify_work: calls back @tx_notify once a tx buffer is given back
+ * @tx_pending:	number of asynchronous messages in flight, which keep
+ *		"tx-complete" interrupts enabled. protected by @tx_lock
  * @ns_ept:	the bus's name service endpoint
+ * @hb_ept:	the bus's heartbeat endpoint
+ * @channels:	hash table of this vrp's channels, keyed on their name and
+ *		dst address, so name service announcements are resolved
+ *		without walking all the existing channels
+ * @channels_lock: protects @channels
+ * @ns_wq:	ordered workqueue on which name service records are processed,
+ *		so the rx path doesn't have to wait for channels to be set up
+ * @ns_work:	processes the records of @ns_pending
+ * @ns_pending:	name service records waiting to be processed
+ * @ns_lock:	protects @ns_pending
+ * @rx_wq:	high priority workqueue on which the rx virtqueues are polled,
+ *		on the cpu their interrupt came in on, so latency-critical
+ *		messages don't wait behind the system's other work items
+ * @probe_wq:	unbound workqueue on which new channels are registered (and
+ *		thus probed by their drivers), in parallel
+ * @stats:	per-cpu traffic counters and latency histograms
+ * @tstamp_rate: rate (in Hz) of the clock shared with the remote processor,
+ *		which messages are stamped with, if VIRTIO_RPMSG_F_TSTAMP was
+ *		negotiated (0 otherwise, or if there's no shared clock)
+ * @dbg_dir:	debugfs directory exposing @stats, and those of the endpoints
+ * @frozen:	the virtqueues are gone, because the remote processor is being
+ *		restarted (see rpmsg_freeze()). senders wait for them to come
+ *		back. protected by @tx_lock
+ * @fail_kick:	drops kicks of the tx virtqueues (see CONFIG_FAIL_RPMSG)
+ * @fail_tx_buf: pretends the tx buffers are all in use
+ * @fail_rx:	stalls the rx virtqueues, for @rx_stall_ms
+ * @rx_stall_ms: how long an injected rx stall lasts
+ * @qos_req:	cpu_dma_latency request, which applies @qos_latency while
+ *		the traffic of the endpoints requiring it is active
+ * @qos_latency: strictest latency the endpoints require (see
+ *		rpmsg_set_qos_latency()), or PM_QOS_DEFAULT_VALUE if none does.
+ *		protected by @endpoints_lock
+ * @qos_state:	RPMSG_QOS_ACTIVE is set while @qos_req is applied
+ * @qos_stamp:	jiffies of the last message of an endpoint requiring a latency
+ * @qos_work:	applies @qos_req, once traffic shows up
+ * @qos_idle_work: relaxes @qos_req, once traffic has been idle for qos_idle_ms
+ * @rx_fc:	VIRTIO_RPMSG_F_RX_FC was negotiated, so the remote processor is
+ *		told to hold off sending when we run out of rx buffers
+ * @rx_fc_lock:	serializes the updates of the rx_throttle config field
+ * @acct:	VIRTIO_RPMSG_F_ACCT was negotiated, so our messages are tagged
+ *		with their sender's rproc cgroup, and senders over their share
+ *		of the remote processor are held back
+ * @rx_shrinker: frees the pages of the rx chains beyond rx_chains_min under
+ *		memory pressure, if any (its shrink handler is set then)
  *
  * This structure stores the rpmsg state of a given virtio remote processor
  * device (there might be several virtio proc devices for each physical
@@ -58,16 +456,83 @@
  */
 struct virtproc_info {
 	struct virtio_device *vdev;
-	struct virtqueue *rvq, *svq;
+	struct rpmsg_queue_pair *qps;
+	int num_qps;
 	void *rbufs, *sbufs;
+	int num_rbufs, num_sbufs;
+	unsigned int buf_size;
+	unsigned int buf_stride;
+	unsigned int buf_pad;
+	size_t total_buf_space;
+	unsigned int max_txbuf_size;
 	int last_sbuf;
 	dma_addr_t bufs_dma;
-	struct mutex tx_lock;
+	struct device *dma_dev;
+	bool cached_bufs;
+	bool ipc_bufs;
+	struct gen_pool *tx_pool;
+	u16 *tx_sizes;
+	void **free_sbufs;
+	int num_free_sbufs;
+	struct rpmsg_tx_cache __percpu *tx_cache;
+	int tx_cache_size;
+	spinlock_t tx_lock;
 	struct idr endpoints;
 	struct mutex endpoints_lock;
-	wait_queue_head_t sendq;
+	DECLARE_BITMAP(dyn_addrs, RPMSG_DYN_ADDRESSES);
+	int next_dyn_addr;
+	struct rpmsg_endpoint **tx_owners;
+	u64 *tx_stamps;
+	wait_queue_head_t sendq[RPMSG_TX_PRIO_NUM];
+	atomic_t tx_waiters[RPMSG_TX_PRIO_NUM];
+	wait_queue_head_t creditq;
 	atomic_t sleepers;
+	struct rpmsg_tx_cb *tx_cbs;
+	struct list_head tx_done;
+	struct work_struct tx_done_work;
+	struct list_head tx_notify;
+	struct work_struct tx_notify_work;
+	int tx_pending;
 	struct rpmsg_endpoint *ns_ept;
+	struct rpmsg_endpoint *hb_ept;
+	struct hlist_head channels[1 << RPMSG_CHANNELS_HASH_BITS];
+	struct mutex channels_lock;
+	struct workqueue_struct *ns_wq;
+	struct work_struct ns_work;
+	struct list_head ns_pending;
+	spinlock_t ns_lock;
+	struct workqueue_struct *rx_wq;
+	struct workqueue_struct *probe_wq;
+	struct rpmsg_vrp_stats __percpu *stats;
+	u32 tstamp_rate;
+	struct dentry *dbg_dir;
+	bool frozen;
+#ifdef CONFIG_FAIL_RPMSG
+	struct fault_attr fail_kick;
+	struct fault_attr fail_tx_buf;
+	struct fault_attr fail_rx;
+	u32 rx_stall_ms;
+#endif
+	struct pm_qos_request qos_req;
+	s32 qos_latency;
+	unsigned long qos_state;
+	unsigned long qos_stamp;
+	struct work_struct qos_work;
+	struct delayed_work qos_idle_work;
+	bool rx_fc;
+	bool acct;
+	spinlock_t rx_fc_lock;
+	struct shrinker rx_shrinker;
+};
+
+/**
+ * struct rpmsg_ns_record - a name service record waiting to be processed
+ * @node: linked into the vrp's ns_pending list
+ * @msg: the record itself
+ */
+struct rpmsg_ns_record {
+	struct list_head node;
+	struct rpmsg_ns_msg msg;
 };
 
 /**
@@ -82,110 +547,293 @@ struct rpmsg_channel_info {
 	u32 dst;
 };
 
-#define to_rpmsg_channel(d) container_of(d, struct rpmsg_channel, dev)
-#define to_rpmsg_driver(d) container_of(d, struct rpmsg_driver, drv)
+/**
+ * struct rpmsg_probe_work - registration of a new channel, in the background
+ * @work: queued on the vrp's probe_wq
+ * @vrp: the virtual remote processor the channel belongs to
+ * @chinfo: the channel to create
+ */
+struct rpmsg_probe_work {
+	struct work_struct work;
+	struct virtproc_info *vrp;
+	struct rpmsg_channel_info chinfo;
+};
 
 /*
- * We're allocating 512 buffers of 512 bytes for communications, and then
- * using the first 256 buffers for RX, and the last 256 buffers for TX.
+ * By default, we're allocating as many buffers of 512 bytes as the vrings
+ * the remote processor set up can hold: with the usual 256-entry vrings,
+ * that's 256 buffers for RX, and 256 buffers for TX, but a remote processor
+ * may as well pick a big rx vring for bursts of inbound messages, and a
+ * small tx one.
  *
  * Each buffer will have 16 bytes for the msg header and 496 bytes for
  * the payload.
  *
- * This will require a total space of 256KB for the buffers.
- *
- * We might also want to add support for user-provided buffers in time.
- * This will allow bigger buffer size flexibility, and can also be used
- * to achieve zero-copy messaging.
+ * With 256-entry vrings, this will require a total space of 256KB for the
+ * buffers.
  *
- * Note that these numbers are purely a decision of this driver - we
- * can change this without changing anything in the firmware of the remote
- * processor.
+ * These numbers don't fit every remote processor though (e.g. some want
+ * many small buffers, while others prefer a few big ones), so a firmware
+ * supporting VIRTIO_RPMSG_F_BUFCFG can ask for its own layout through the
+ * vdev config space. The module parameters below override both.
  */
-#define RPMSG_NUM_BUFS		(512)
 #define RPMSG_BUF_SIZE		(512)
-#define RPMSG_TOTAL_BUF_SPACE	(RPMSG_NUM_BUFS * RPMSG_BUF_SIZE)
+
+/* sanity limit for the size of a single buffer */
+#define RPMSG_MAX_BUF_SIZE	(64 * 1024)
+
+/* sanity limit for the number of rx (resp. tx) buffers: a vring's worth */
+#define RPMSG_MAX_NUM_BUFS	(32 * 1024)
+
+static unsigned int rx_bufs;
+module_param(rx_bufs, uint, 0444);
+MODULE_PARM_DESC(rx_bufs, "number of rx buffers (0 to let the remote decide)");
+
+static unsigned int tx_bufs;
+module_param(tx_bufs, uint, 0444);
+MODULE_PARM_DESC(tx_bufs, "number of tx buffers (0 to let the remote decide)");
+
+static unsigned int buf_size;
+module_param(buf_size, uint, 0444);
+MODULE_PARM_DESC(buf_size, "size of a buffer (0 to let the remote decide)");
 
 /*
- * Local addresses are dynamically allocated on-demand.
- * We do not dynamically assign addresses from the low 1024 range,
- * in order to reserve that address range for predefined services.
+ * Remote processors supporting VIRTIO_RPMSG_F_RX_CHAIN (along with indirect
+ * descriptors) also get a few big rx buffers in every rx vring, so they can
+ * send messages of up to RPMSG_RX_CHAIN_SIZE bytes at once.
  */
-#define RPMSG_RESERVED_ADDRESSES	(1024)
+static unsigned int rx_chains = 8;
+module_param(rx_chains, uint, 0444);
+MODULE_PARM_DESC(rx_chains, "number of 64KB rx buffers per rx vring");
 
-/* Address 53 is reserved for advertising remote services */
-#define RPMSG_NS_ADDR			(53)
+/*
+ * Only the first few of them get their pages up front: the others only do
+ * once the remote processor fills all of the big rx buffers it has, and
+ * they give them back under memory pressure, as soon as it's done with
+ * them. An idle vring thus only pins rx_chains_min of them.
+ */
+static unsigned int rx_chains_min = 2;
+module_param(rx_chains_min, uint, 0444);
+MODULE_PARM_DESC(rx_chains_min, "number of 64KB rx buffers always kept");
 
-/* sysfs show configuration fields */
-#define rpmsg_show_attr(field, path, format_string)			\
-static ssize_t								\
-field##_show(struct device *dev,					\
-			struct device_attribute *attr, char *buf)	\
-{									\
-	struct rpmsg_channel *rpdev = to_rpmsg_channel(dev);		\
-									\
-	return sprintf(buf, format_string, rpdev->path);		\
-}
+/*
+ * The buffers are coherent (i.e. uncached, on most non-coherent platforms)
+ * memory by default, so every message is copied in and out of them the
+ * slow way. Remote processors which can reach any of our memory through
+ * the DMA API (e.g. they aren't restricted to a carveout by an iommu) may
+ * use cacheable buffers instead, whose caches are then maintained as they
+ * change hands.
+ */
+static bool cached_bufs;
+module_param(cached_bufs, bool, 0444);
+MODULE_PARM_DESC(cached_bufs, "use cacheable buffers (with cache maintenance)");
+
+/*
+ * Consecutive buffers normally share cache lines, and so does the header
+ * of a msg with the beginning of its payload: with cacheable buffers, that
+ * means false sharing, and maintenance of partial lines, between the host
+ * writing into a buffer and the remote processor reading the next one.
+ * Aligned buffers each start a cache line (of the biggest of ours and, if
+ * it supports VIRTIO_RPMSG_F_ALIGN, the remote processor's) with their
+ * payload, which leaves their header alone in the line before, and the rx
+ * and tx buffers take separate pages. This is the default for remote
+ * processors supporting VIRTIO_RPMSG_F_ALIGN.
+ */
+static bool align_bufs;
+module_param(align_bufs, bool, 0444);
+MODULE_PARM_DESC(align_bufs, "align the buffers to cache lines");
+
+/*
+ * Endpoints requiring a cpu wakeup latency (see rpmsg_set_qos_latency())
+ * have it applied as long as they get or send messages, and then for that
+ * long, so a burst of traffic doesn't take a deep C-state exit per message,
+ * while the host can still go idle in between bursts.
+ */
+static unsigned int qos_idle_ms = 100;
+module_param(qos_idle_ms, uint, 0644);
+MODULE_PARM_DESC(qos_idle_ms, "idle msecs before relaxing pm_qos latencies");
 
-/* for more info, see Documentation/ABI/testing/sysfs-bus-rpmsg */
-rpmsg_show_attr(name, id.name, "%s\n");
-rpmsg_show_attr(src, src, "0x%x\n");
-rpmsg_show_attr(dst, dst, "0x%x\n");
-rpmsg_show_attr(announce, announce ? "true" : "false", "%s\n");
+/*
+ * Remote processors supporting VIRTIO_RPMSG_F_RX_FC are told to hold off
+ * sending over a queue pair once less than rx_throttle_low percent of its
+ * rx buffers are left for them to fill, and to resume once at least
+ * rx_throttle_high percent are back, so a slow host doesn't leave bursty
+ * producers spinning on a full ring.
+ */
+static unsigned int rx_throttle_low = 25;
+module_param(rx_throttle_low, uint, 0644);
+MODULE_PARM_DESC(rx_throttle_low, "% of free rx buffers to throttle under");
+
+static unsigned int rx_throttle_high = 50;
+module_param(rx_throttle_high, uint, 0644);
+MODULE_PARM_DESC(rx_throttle_high, "% of free rx buffers to unthrottle at");
+
+/*
+ * All the inbound messages of a remote processor are otherwise delivered by
+ * its rx work, on a single cpu. With rx_steer, the regular endpoints (those
+ * of rpmsg_create_ept()) each get an rx context on a cpu of their own,
+ * which their address is hashed onto: the messages of an endpoint are still
+ * delivered in order, while busy endpoints spread over the online cpus.
+ */
+static bool rx_steer;
+module_param(rx_steer, bool, 0444);
+MODULE_PARM_DESC(rx_steer, "spread the endpoints' deliveries over the cpus");
+
+#ifdef CONFIG_FAIL_RPMSG
 
 /*
- * Unique (and free running) index for rpmsg devices.
+ * Slow or misbehaving remote processors are simulated by injecting faults
+ * where we deal with the vrings (see Documentation/fault-injection/):
+ *
+ * - fail_kick drops the kick of a tx virtqueue, as if the remote processor
+ *   missed it: the message is only noticed along with the next one.
+ * - fail_tx_buf pretends that all the tx buffers are in use, as if the
+ *   remote processor was slow to give them back: senders block (or fail,
+ *   if they don't wait), just like they would under backpressure.
+ * - fail_rx stalls an rx virtqueue for rx_stall_ms, as if we were slow to
+ *   give rx buffers back: the remote processor runs out of them.
  *
- * Yeah, we're not recycling those numbers (yet?). will be easy
- * to change if/when we want to.
+ * Each vdev has its own set of fault attributes in its debugfs directory,
+ * whose defaults can be set with the module parameters below, in the
+ * "<interval>,<probability>,<space>,<times>" form of the fault injection
+ * framework's boot options.
  */
-static unsigned int rpmsg_dev_index;
+static char *fail_kick;
+module_param(fail_kick, charp, 0);
+static char *fail_tx_buf;
+module_param(fail_tx_buf, charp, 0);
+static char *fail_rx;
+module_param(fail_rx, charp, 0);
 
-static ssize_t modalias_show(struct device *dev,
-			     struct device_attribute *attr, char *buf)
+/* how long an injected rx stall lasts, by default */
+#define RPMSG_RX_STALL_MS	10
+
+static void rpmsg_init_fault_attrs(struct virtproc_info *vrp)
 {
-	struct rpmsg_channel *rpdev = to_rpmsg_channel(dev);
+	static DECLARE_FAULT_ATTR(fail_default_attr);
+
+	vrp->fail_kick = fail_default_attr;
+	vrp->fail_tx_buf = fail_default_attr;
+	vrp->fail_rx = fail_default_attr;
+	vrp->rx_stall_ms = RPMSG_RX_STALL_MS;
+
+	if (fail_kick)
+		setup_fault_attr(&vrp->fail_kick, fail_kick);
+	if (fail_tx_buf)
+		setup_fault_attr(&vrp->fail_tx_buf, fail_tx_buf);
+	if (fail_rx)
+		setup_fault_attr(&vrp->fail_rx, fail_rx);
+}
 
-	return sprintf(buf, RPMSG_DEVICE_MODALIAS_FMT "\n", rpdev->id.name);
+static void rpmsg_create_fault_attrs(struct virtproc_info *vrp)
+{
+	fault_create_debugfs_attr("fail_kick", vrp->dbg_dir,
+						&vrp->fail_kick);
+	fault_create_debugfs_attr("fail_tx_buf", vrp->dbg_dir,
+						&vrp->fail_tx_buf);
+	fault_create_debugfs_attr("fail_rx", vrp->dbg_dir, &vrp->fail_rx);
+	debugfs_create_u32("rx_stall_ms", 0600, vrp->dbg_dir,
+						&vrp->rx_stall_ms);
 }
 
-static struct device_attribute rpmsg_dev_attrs[] = {
-	__ATTR_RO(name),
-	__ATTR_RO(modalias),
-	__ATTR_RO(dst),
-	__ATTR_RO(src),
-	__ATTR_RO(announce),
-	__ATTR_NULL
-};
+static bool rpmsg_should_fail_kick(struct virtproc_info *vrp)
+{
+	return should_fail(&vrp->fail_kick, 1);
+}
 
-/* rpmsg devices and drivers are matched using the service name */
-static inline int rpmsg_id_match(const struct rpmsg_channel *rpdev,
-				  const struct rpmsg_device_id *id)
+static bool rpmsg_should_fail_tx_buf(struct virtproc_info *vrp,
+							unsigned int size)
 {
-	return strncmp(id->name, rpdev->id.name, RPMSG_NAME_SIZE) == 0;
+	return should_fail(&vrp->fail_tx_buf, size);
 }
 
-/* match rpmsg channel and rpmsg driver */
-static int rpmsg_dev_match(struct device *dev, struct device_driver *drv)
+/* stall the rx virtqueue of @qp: the rx work sits it out, then polls it */
+static bool rpmsg_should_stall_rx(struct rpmsg_queue_pair *qp)
 {
-	struct rpmsg_channel *rpdev = to_rpmsg_channel(dev);
-	struct rpmsg_driver *rpdrv = to_rpmsg_driver(drv);
-	const struct rpmsg_device_id *ids = rpdrv->id_table;
-	unsigned int i;
+	if (!should_fail(&qp->vrp->fail_rx, 1))
+		return false;
 
-	for (i = 0; ids[i].name[0]; i++)
-		if (rpmsg_id_match(rpdev, &ids[i]))
-			return 1;
+	qp->rx_stalled = true;
+	return true;
+}
 
-	return 0;
+static void rpmsg_rx_stall(struct rpmsg_queue_pair *qp)
+{
+	if (!qp->rx_stalled)
+		return;
+
+	qp->rx_stalled = false;
+	msleep(ACCESS_ONCE(qp->vrp->rx_stall_ms));
 }
 
-static int rpmsg_uevent(struct device *dev, struct kobj_uevent_env *env)
+#else /* CONFIG_FAIL_RPMSG */
+
+static inline void rpmsg_init_fault_attrs(struct virtproc_info *vrp) { }
+static inline void rpmsg_create_fault_attrs(struct virtproc_info *vrp) { }
+
+static inline bool rpmsg_should_fail_kick(struct virtproc_info *vrp)
 {
-	struct rpmsg_channel *rpdev = to_rpmsg_channel(dev);
+	return false;
+}
+
+static inline bool rpmsg_should_fail_tx_buf(struct virtproc_info *vrp,
+							unsigned int size)
+{
+	return false;
+}
+
+static inline bool rpmsg_should_stall_rx(struct rpmsg_queue_pair *qp)
+{
+	return false;
+}
+
+static inline void rpmsg_rx_stall(struct rpmsg_queue_pair *qp) { }
+
+#endif /* CONFIG_FAIL_RPMSG */
+
+/*
+ * If the remote processor supports VIRTIO_RPMSG_F_VARBUF, the TX half of
+ * the buffer space is not sliced into fixed-size buffers.
+ * Instead, it is managed by a genalloc pool, and every message gets a
+ * buffer that is just big enough to hold it (rounded up to the pool's
+ * granule), up to RPMSG_MAX_TXBUF_SIZE bytes (header included), or the
+ * size of the whole tx buffer space, if smaller.
+ *
+ * This way big payloads go out in a single buffer (i.e. one descriptor
+ * and one kick), and small ones don't waste a whole 512 bytes buffer.
+ */
+#define RPMSG_TXBUF_ORDER	(6)
+#define RPMSG_TXBUF_GRANULE	(1 << RPMSG_TXBUF_ORDER)
+#define RPMSG_MAX_TXBUF_SIZE	(16 * 1024)
+
+/* max number of inbound messages handled in a single rx poll loop run */
+#define RPMSG_RX_BUDGET		(64)
+
+/*
+ * Local addresses are dynamically allocated on-demand.
+ * We do not dynamically assign addresses from the low 1024 range,
+ * in order to reserve that address range for predefined services.
+ */
+#define RPMSG_RESERVED_ADDRESSES	(1024)
+
+/* Address 53 is reserved for advertising remote services */
+#define RPMSG_NS_ADDR			(53)
 
-	return add_uevent_var(env, "MODALIAS=" RPMSG_DEVICE_MODALIAS_FMT,
-					rpdev->id.name);
+/* Address 54 is reserved for heartbeats of remote processors */
+#define RPMSG_HB_ADDR			(54)
+
+/* Address 55 is reserved for multicast messages (see rpmsg_mcast_hdr) */
+#define RPMSG_MCAST_ADDR		(55)
+
+/* endpoints come and go with sessions, so they get a cache of their own */
+static struct kmem_cache *rpmsg_ept_cache;
+
+/* the state a cached endpoint is in, be it brand new or freed */
+static void rpmsg_ept_ctor(void *obj)
+{
+	struct rpmsg_endpoint *ept = obj;
+
+	mutex_init(&ept->cb_lock);
 }
 
 /**
@@ -197,21 +845,66 @@ static int rpmsg_uevent(struct device *dev, struct kobj_uevent_env *env)
  *
  * Never invoke this function directly!
  */
+static void rpmsg_free_ept_rcu(struct rcu_head *rcu)
+{
+	struct rpmsg_endpoint *ept = container_of(rcu, struct rpmsg_endpoint,
+						  rcu);
+
+	if (ept->rx) {
+		kfifo_free(&ept->rx->fifo);
+		kfree(ept->rx);
+	}
+
+	free_percpu(ept->stats);
+	kmem_cache_free(rpmsg_ept_cache, ept);
+}
+
 static void __ept_release(struct kref *kref)
 {
 	struct rpmsg_endpoint *ept = container_of(kref, struct rpmsg_endpoint,
 						  refcount);
 	/*
-	 * At this point no one holds a reference to ept anymore,
-	 * so we can directly free it
+	 * At this point no one holds a reference to ept anymore, but
+	 * lockless rx lookups might still be looking at it (and updating
+	 * its stats), so let them go first.
 	 */
-	kfree(ept);
+	call_rcu(&ept->rcu, rpmsg_free_ept_rcu);
+}
+
+/* is @addr in the range of the address bitmap ? */
+static bool rpmsg_is_dyn_addr(u32 addr)
+{
+	return addr >= RPMSG_RESERVED_ADDRESSES &&
+		addr < RPMSG_RESERVED_ADDRESSES + RPMSG_DYN_ADDRESSES;
+}
+
+/*
+ * pick a free dynamic address, and mark it bound. Returns RPMSG_ADDR_ANY
+ * if the address bitmap is full.
+ *
+ * Must be called with vrp->endpoints_lock held.
+ */
+static u32 rpmsg_alloc_dyn_addr(struct virtproc_info *vrp)
+{
+	int bit;
+
+	bit = find_next_zero_bit(vrp->dyn_addrs, RPMSG_DYN_ADDRESSES,
+							vrp->next_dyn_addr);
+	if (bit >= RPMSG_DYN_ADDRESSES)
+		bit = find_first_zero_bit(vrp->dyn_addrs, RPMSG_DYN_ADDRESSES);
+	if (bit >= RPMSG_DYN_ADDRESSES)
+		return RPMSG_ADDR_ANY;
+
+	set_bit(bit, vrp->dyn_addrs);
+	vrp->next_dyn_addr = bit + 1;
+
+	return RPMSG_RESERVED_ADDRESSES + bit;
 }
 
 /* for more info, see below documentation of rpmsg_create_ept() */
 static struct rpmsg_endpoint *__rpmsg_create_ept(struct virtproc_info *vrp,
 		struct rpmsg_channel *rpdev, rpmsg_rx_cb_t cb,
-		void *priv, u32 addr)
+		rpmsg_rx_batch_cb_t batch_cb, void *priv, u32 addr, bool atomic)
 {
 	int err, tmpaddr, request;
 	struct rpmsg_endpoint *ept;
@@ -220,97 +913,222 @@ static struct rpmsg_endpoint *__rpmsg_create_ept(struct virtproc_info *vrp,
 	if (!idr_pre_get(&vrp->endpoints, GFP_KERNEL))
 		return NULL;
 
-	ept = kzalloc(sizeof(*ept), GFP_KERNEL);
+	ept = kmem_cache_alloc(rpmsg_ept_cache, GFP_KERNEL);
 	if (!ept) {
-		dev_err(dev, "failed to kzalloc a new ept\n");
+		dev_err(dev, "failed to allocate a new ept\n");
 		return NULL;
 	}
 
+	ept->stats = alloc_percpu(struct rpmsg_ept_stats);
+	if (!ept->stats) {
+		dev_err(dev, "failed to alloc ept stats\n");
+		kmem_cache_free(rpmsg_ept_cache, ept);
+		return NULL;
+	}
+
+	/* cb_lock is set up by the cache's constructor */
 	kref_init(&ept->refcount);
-	mutex_init(&ept->cb_lock);
 
 	ept->rpdev = rpdev;
 	ept->cb = cb;
+	ept->batch_cb = batch_cb;
 	ept->priv = priv;
-
-	/* do we need to allocate a local address ? */
-	request = addr == RPMSG_ADDR_ANY ? RPMSG_RESERVED_ADDRESSES : addr;
+	ept->atomic = atomic;
+	ept->tx_timeout = RPMSG_TX_TIMEOUT;
+	ept->tx_prio = RPMSG_TX_PRIO_NORMAL;
+	ept->tx_quota = 0;
+	ept->tx_inflight = 0;
+	ept->tx_queue = -1;
+	ept->rx_prio = RPMSG_RX_PRIO_NORMAL;
+	ept->rx = NULL;
+	ept->qos_latency = PM_QOS_DEFAULT_VALUE;
 
 	mutex_lock(&vrp->endpoints_lock);
 
-	/* bind the endpoint to an rpmsg address (and allocate one if needed) */
+	if (addr != RPMSG_ADDR_ANY) {
+		/* make sure the user's address request can be fulfilled */
+		if (idr_find(&vrp->endpoints, addr)) {
+			dev_err(dev, "address 0x%x already in use\n", addr);
+			goto free_ept;
+		}
+		request = addr;
+	} else {
+		/* allocate a local address, the fast way if we can */
+		request = rpmsg_alloc_dyn_addr(vrp);
+		if (request == RPMSG_ADDR_ANY)
+			request = RPMSG_RESERVED_ADDRESSES +
+						RPMSG_DYN_ADDRESSES;
+	}
+
+	/* bind the endpoint to its rpmsg address */
 	err = idr_get_new_above(&vrp->endpoints, ept, request, &tmpaddr);
 	if (err) {
 		dev_err(dev, "idr_get_new_above failed: %d\n", err);
-		goto free_ept;
-	}
-
-	/* make sure the user's address request is fulfilled, if relevant */
-	if (addr != RPMSG_ADDR_ANY && tmpaddr != addr) {
-		dev_err(dev, "address 0x%x already in use\n", addr);
-		goto rem_idr;
+		goto free_addr;
 	}
 
 	ept->addr = tmpaddr;
+	if (rpmsg_is_dyn_addr(tmpaddr))
+		set_bit(tmpaddr - RPMSG_RESERVED_ADDRESSES, vrp->dyn_addrs);
 
 	mutex_unlock(&vrp->endpoints_lock);
 
 	return ept;
 
-rem_idr:
-	idr_remove(&vrp->endpoints, request);
+free_addr:
+	if (addr == RPMSG_ADDR_ANY && rpmsg_is_dyn_addr(request))
+		clear_bit(request - RPMSG_RESERVED_ADDRESSES, vrp->dyn_addrs);
 free_ept:
 	mutex_unlock(&vrp->endpoints_lock);
 	kref_put(&ept->refcount, __ept_release);
 	return NULL;
 }
 
-/**
- * rpmsg_create_ept() - create a new rpmsg_endpoint
- * @rpdev: rpmsg channel device
- * @cb: rx callback handler
- * @priv: private data for the driver's use
- * @addr: local rpmsg address to bind with @cb
- *
- * Every rpmsg address in the system is bound to an rx callback (so when
- * inbound messages arrive, they are dispatched by the rpmsg bus using the
- * appropriate callback handler) by means of an rpmsg_endpoint struct.
- *
- * This function allows drivers to create such an endpoint, and by that,
- * bind a callback, and possibly some private data too, to an rpmsg address
- * (either one that is known in advance, or one that will be dynamically
- * assigned for them).
- *
- * Simple rpmsg drivers need not call rpmsg_create_ept, because an endpoint
- * is already created for them when they are probed by the rpmsg bus
- * (using the rx callback provided when they registered to the rpmsg bus).
- *
- * So things should just work for simple drivers: they already have an
- * endpoint, their rx callback is bound to their rpmsg address, and when
- * relevant inbound messages arrive (i.e. messages which their dst address
- * equals to the src address of their rpmsg channel), the driver's handler
- * is invoked to process it.
- *
- * That said, more complicated drivers might do need to allocate
- * additional rpmsg addresses, and bind them to different rx callbacks.
- * To accomplish that, those drivers need to call this function.
- *
- * Drivers should provide their @rpdev channel (so the new endpoint would belong
- * to the same remote processor their channel belongs to), an rx callback
- * function, an optional private data (which is provided back when the
- * rx callback is invoked), and an address they want to bind with the
- * callback. If @addr is RPMSG_ADDR_ANY, then rpmsg_create_ept will
- * dynamically assign them an available rpmsg address (drivers should have
- * a very good reason why not to always use RPMSG_ADDR_ANY here).
- *
- * Returns a pointer to the endpoint on success, or NULL on error.
- */
-struct rpmsg_endpoint *rpmsg_create_ept(struct rpmsg_channel *rpdev,
+static int rpmsg_ept_rx_attach(struct virtproc_info *vrp,
+		struct rpmsg_endpoint *ept, enum rpmsg_rx_ctx ctx, int cpu);
+static void rpmsg_ept_rx_work(struct work_struct *work);
+static void rpmsg_ept_rx_stop(struct rpmsg_ept_rx *rx);
+static void rpmsg_qos_update(struct virtproc_info *vrp);
+
+/* the online cpu the msgs of the endpoint at @addr are steered to, or -1 */
+static int rpmsg_steer_cpu(u32 addr)
+{
+	int cpu, i, ret = -1;
+
+	get_online_cpus();
+
+	i = jhash_1word(addr, 0) % num_online_cpus();
+	for_each_online_cpu(cpu) {
+		if (!i--) {
+			ret = cpu;
+			break;
+		}
+	}
+
+	put_online_cpus();
+
+	return ret;
+}
+
+/* the virtio transport of rpmsg_create_ept() */
+static struct rpmsg_endpoint *
+virtio_rpmsg_create_ept(struct rpmsg_channel *rpdev,
+				rpmsg_rx_cb_t cb, void *priv, u32 addr)
+{
+	struct rpmsg_endpoint *ept;
+	int cpu;
+
+	ept = __rpmsg_create_ept(rpdev->vrp, rpdev, cb, NULL, priv, addr,
+								false);
+	if (!ept || !rx_steer || num_online_cpus() < 2)
+		return ept;
+
+	/* its msgs are delivered inline, as usual, if it can't be steered */
+	cpu = rpmsg_steer_cpu(ept->addr);
+	if (cpu >= 0 && rpmsg_ept_rx_attach(rpdev->vrp, ept, RPMSG_RX_CTX_CPU,
+								cpu))
+		dev_warn(&rpdev->dev, "can't steer the rx of 0x%x\n",
+								ept->addr);
+
+	return ept;
+}
+
+/* the virtio transport of rpmsg_create_atomic_ept() */
+static struct rpmsg_endpoint *
+virtio_rpmsg_create_atomic_ept(struct rpmsg_channel *rpdev,
 				rpmsg_rx_cb_t cb, void *priv, u32 addr)
 {
-	return __rpmsg_create_ept(rpdev->vrp, rpdev, cb, priv, addr);
+	return __rpmsg_create_ept(rpdev->vrp, rpdev, cb, NULL, priv, addr,
+								true);
+}
+
+/*
+ * give @ept, which was just created, an rx context: its msgs are then
+ * delivered by a work item of its own, on @cpu, or on an ordered workqueue
+ * of its own if @ctx is RPMSG_RX_CTX_WQ
+ */
+static int rpmsg_ept_rx_attach(struct virtproc_info *vrp,
+		struct rpmsg_endpoint *ept, enum rpmsg_rx_ctx ctx, int cpu)
+{
+	struct rpmsg_ept_rx *rx;
+	int i, size = 0;
+
+	rx = kzalloc(sizeof(*rx), GFP_KERNEL);
+	if (!rx)
+		return -ENOMEM;
+
+	/* the fifo can hold as many msgs as there may be held buffers */
+	for (i = 0; i < vrp->num_qps; i++)
+		size += vrp->qps[i].num_rbufs / RPMSG_RX_HOLD_RATIO;
+
+	if (kfifo_alloc(&rx->fifo, max(size, 1), GFP_KERNEL))
+		goto free_rx;
+
+	rx->cpu = -1;
+	if (ctx == RPMSG_RX_CTX_CPU) {
+		rx->cpu = cpu;
+	} else {
+		rx->wq = alloc_ordered_workqueue("rpmsg-ept-%u", 0, ept->addr);
+		if (!rx->wq)
+			goto free_fifo;
+	}
+
+	rx->ept = ept;
+	rx->vrp = vrp;
+	spin_lock_init(&rx->fifo_lock);
+	mutex_init(&rx->lock);
+	INIT_WORK(&rx->work, rpmsg_ept_rx_work);
+
+	/* whatever came in so far was delivered inline */
+	smp_wmb();
+	ept->rx = rx;
+
+	return 0;
+
+free_fifo:
+	kfifo_free(&rx->fifo);
+free_rx:
+	kfree(rx);
+	return -ENOMEM;
+}
+
+/* the virtio transport of rpmsg_create_ept_ctx() */
+static struct rpmsg_endpoint *
+virtio_rpmsg_create_ept_ctx(struct rpmsg_channel *rpdev,
+				rpmsg_rx_cb_t cb, void *priv, u32 addr,
+				enum rpmsg_rx_ctx ctx, int cpu)
+{
+	struct virtproc_info *vrp = rpdev->vrp;
+	struct rpmsg_endpoint *ept;
+
+	if (ctx > RPMSG_RX_CTX_CPU || (ctx == RPMSG_RX_CTX_CPU &&
+			(cpu < 0 || cpu >= nr_cpu_ids || !cpu_possible(cpu)))) {
+		dev_err(&rpdev->dev, "invalid rx context %d (cpu %d)\n", ctx,
+									cpu);
+		return NULL;
+	}
+
+	ept = __rpmsg_create_ept(vrp, rpdev, cb, NULL, priv, addr, false);
+	if (!ept || ctx == RPMSG_RX_CTX_INLINE)
+		return ept;
+
+	if (!rpmsg_ept_rx_attach(vrp, ept, ctx, cpu))
+		return ept;
+
+	dev_err(&rpdev->dev, "failed to set up the rx context of 0x%x\n",
+								ept->addr);
+	rpmsg_destroy_ept(ept);
+	return NULL;
+}
+
+/* the virtio transport of rpmsg_create_batch_ept() */
+static struct rpmsg_endpoint *
+virtio_rpmsg_create_batch_ept(struct rpmsg_channel *rpdev,
+				rpmsg_rx_batch_cb_t cb, void *priv, u32 addr)
+{
+	return __rpmsg_create_ept(rpdev->vrp, rpdev, NULL, cb, priv, addr,
+								false);
 }
-EXPORT_SYMBOL(rpmsg_create_ept);
 
 /**
  * __rpmsg_destroy_ept() - destroy an existing rpmsg endpoint
@@ -328,170 +1146,227 @@ __rpmsg_destroy_ept(struct virtproc_info *vrp, struct rpmsg_endpoint *ept)
 	/* make sure new inbound messages can't find this ept anymore */
 	mutex_lock(&vrp->endpoints_lock);
 	idr_remove(&vrp->endpoints, ept->addr);
+	if (rpmsg_is_dyn_addr(ept->addr))
+		clear_bit(ept->addr - RPMSG_RESERVED_ADDRESSES, vrp->dyn_addrs);
 	mutex_unlock(&vrp->endpoints_lock);
 
+	/* its latency requirement goes along with it */
+	if (ept->qos_latency != PM_QOS_DEFAULT_VALUE)
+		rpmsg_qos_update(vrp);
+
 	/* make sure in-flight inbound messages won't invoke cb anymore */
 	mutex_lock(&ept->cb_lock);
 	ept->cb = NULL;
+	ept->batch_cb = NULL;
 	mutex_unlock(&ept->cb_lock);
 
+	/* atomic callbacks (and rx deferrals) are only fenced by RCU */
+	if (ept->atomic || ept->rx)
+		synchronize_rcu();
+
+	/* give the buffers of the msgs that are still deferred back */
+	if (ept->rx)
+		rpmsg_ept_rx_stop(ept->rx);
+
 	kref_put(&ept->refcount, __ept_release);
 }
 
-/**
- * rpmsg_destroy_ept() - destroy an existing rpmsg endpoint
- * @ept: endpoing to destroy
- *
- * Should be used by drivers to destroy an rpmsg endpoint previously
- * created with rpmsg_create_ept().
- */
-void rpmsg_destroy_ept(struct rpmsg_endpoint *ept)
+/* the virtio transport of rpmsg_destroy_ept() */
+static void virtio_rpmsg_destroy_ept(struct rpmsg_endpoint *ept)
 {
 	__rpmsg_destroy_ept(ept->rpdev->vrp, ept);
 }
-EXPORT_SYMBOL(rpmsg_destroy_ept);
 
-/*
- * when an rpmsg driver is probed with a channel, we seamlessly create
- * it an endpoint, binding its rx callback to a unique local rpmsg
- * address.
- *
- * if we need to, we also announce about this channel to the remote
- * processor (needed in case the driver is exposing an rpmsg service).
- */
-static int rpmsg_dev_probe(struct device *dev)
+/* there's traffic on an endpoint requiring a latency: apply it, if need be */
+static void rpmsg_qos_touch(struct virtproc_info *vrp)
 {
-	struct rpmsg_channel *rpdev = to_rpmsg_channel(dev);
-	struct rpmsg_driver *rpdrv = to_rpmsg_driver(rpdev->dev.driver);
-	struct virtproc_info *vrp = rpdev->vrp;
-	struct rpmsg_endpoint *ept;
-	int err;
+	vrp->qos_stamp = jiffies;
 
-	ept = rpmsg_create_ept(rpdev, rpdrv->callback, NULL, rpdev->src);
-	if (!ept) {
-		dev_err(dev, "failed to create endpoint\n");
-		err = -ENOMEM;
-		goto out;
-	}
+	if (!test_and_set_bit(RPMSG_QOS_ACTIVE, &vrp->qos_state))
+		schedule_work(&vrp->qos_work);
+}
 
-	rpdev->ept = ept;
-	rpdev->src = ept->addr;
+static void rpmsg_qos_work(struct work_struct *work)
+{
+	struct virtproc_info *vrp = container_of(work, struct virtproc_info,
+								qos_work);
 
-	err = rpdrv->probe(rpdev);
-	if (err) {
-		dev_err(dev, "%s: failed: %d\n", __func__, err);
-		rpmsg_destroy_ept(ept);
-		goto out;
-	}
+	pm_qos_update_request(&vrp->qos_req, ACCESS_ONCE(vrp->qos_latency));
+	schedule_delayed_work(&vrp->qos_idle_work,
+					msecs_to_jiffies(qos_idle_ms));
+}
 
-	/* need to tell remote processor's name service about this channel ? */
-	if (rpdev->announce &&
-			virtio_has_feature(vrp->vdev, VIRTIO_RPMSG_F_NS)) {
-		struct rpmsg_ns_msg nsm;
+static void rpmsg_qos_idle_work(struct work_struct *work)
+{
+	struct virtproc_info *vrp = container_of(to_delayed_work(work),
+					struct virtproc_info, qos_idle_work);
+	unsigned long timeout = msecs_to_jiffies(qos_idle_ms);
+	unsigned long idle = jiffies - ACCESS_ONCE(vrp->qos_stamp);
+
+	/* not idle for long enough yet: check again once it could be */
+	if (idle < timeout) {
+		schedule_delayed_work(&vrp->qos_idle_work, timeout - idle);
+		return;
+	}
 
-		strncpy(nsm.name, rpdev->id.name, RPMSG_NAME_SIZE);
-		nsm.addr = rpdev->src;
-		nsm.flags = RPMSG_NS_CREATE;
+	pm_qos_update_request(&vrp->qos_req, PM_QOS_DEFAULT_VALUE);
 
-		err = rpmsg_sendto(rpdev, &nsm, sizeof(nsm), RPMSG_NS_ADDR);
-		if (err)
-			dev_err(dev, "failed to announce service %d\n", err);
-	}
+	clear_bit(RPMSG_QOS_ACTIVE, &vrp->qos_state);
+	smp_mb__after_clear_bit();
 
-out:
-	return err;
+	/* traffic that showed up meanwhile may have missed the bit */
+	if (jiffies - ACCESS_ONCE(vrp->qos_stamp) < timeout &&
+			ACCESS_ONCE(vrp->qos_latency) != PM_QOS_DEFAULT_VALUE &&
+			!test_and_set_bit(RPMSG_QOS_ACTIVE, &vrp->qos_state))
+		schedule_work(&vrp->qos_work);
 }
 
-static int rpmsg_dev_remove(struct device *dev)
+static int rpmsg_ept_qos_latency(int id, void *p, void *data)
 {
-	struct rpmsg_channel *rpdev = to_rpmsg_channel(dev);
-	struct rpmsg_driver *rpdrv = to_rpmsg_driver(rpdev->dev.driver);
-	struct virtproc_info *vrp = rpdev->vrp;
-	int err = 0;
-
-	/* tell remote processor's name service we're removing this channel */
-	if (rpdev->announce &&
-			virtio_has_feature(vrp->vdev, VIRTIO_RPMSG_F_NS)) {
-		struct rpmsg_ns_msg nsm;
+	struct rpmsg_endpoint *ept = p;
+	s32 *latency = data;
 
-		strncpy(nsm.name, rpdev->id.name, RPMSG_NAME_SIZE);
-		nsm.addr = rpdev->src;
-		nsm.flags = RPMSG_NS_DESTROY;
+	if (ept->qos_latency != PM_QOS_DEFAULT_VALUE &&
+			(*latency == PM_QOS_DEFAULT_VALUE ||
+			 ept->qos_latency < *latency))
+		*latency = ept->qos_latency;
 
-		err = rpmsg_sendto(rpdev, &nsm, sizeof(nsm), RPMSG_NS_ADDR);
-		if (err)
-			dev_err(dev, "failed to announce service %d\n", err);
-	}
+	return 0;
+}
 
-	rpdrv->remove(rpdev);
+/* recompute the strictest latency the endpoints require, and apply it */
+static void rpmsg_qos_update(struct virtproc_info *vrp)
+{
+	s32 latency = PM_QOS_DEFAULT_VALUE;
 
-	rpmsg_destroy_ept(rpdev->ept);
+	mutex_lock(&vrp->endpoints_lock);
+	idr_for_each(&vrp->endpoints, rpmsg_ept_qos_latency, &latency);
+	vrp->qos_latency = latency;
+	mutex_unlock(&vrp->endpoints_lock);
 
-	return err;
+	if (test_bit(RPMSG_QOS_ACTIVE, &vrp->qos_state))
+		schedule_work(&vrp->qos_work);
 }
 
-static struct bus_type rpmsg_bus = {
-	.name		= "rpmsg",
-	.match		= rpmsg_dev_match,
-	.dev_attrs	= rpmsg_dev_attrs,
-	.uevent		= rpmsg_uevent,
-	.probe		= rpmsg_dev_probe,
-	.remove		= rpmsg_dev_remove,
-};
+/* the virtio transport of rpmsg_set_qos_latency() */
+static void virtio_rpmsg_set_qos_latency(struct rpmsg_endpoint *ept,
+								s32 usecs)
+{
+	ept->qos_latency = usecs;
+	rpmsg_qos_update(ept->rpdev->vrp);
+}
 
-/**
- * register_rpmsg_driver() - register an rpmsg driver with the rpmsg bus
- * @rpdrv: pointer to a struct rpmsg_driver
- *
- * Returns 0 on success, and an appropriate error value on failure.
- */
-int register_rpmsg_driver(struct rpmsg_driver *rpdrv)
+/* the virtio transport of rpmsg_get_backlog() */
+static int virtio_rpmsg_get_backlog(struct rpmsg_channel *rpdev, u32 *backlog)
 {
-	rpdrv->drv.bus = &rpmsg_bus;
-	return driver_register(&rpdrv->drv);
+	return rproc_vdev_ept_backlog(rpdev->vrp->vdev, rpdev->dst, backlog);
 }
-EXPORT_SYMBOL(register_rpmsg_driver);
 
-/**
- * unregister_rpmsg_driver() - unregister an rpmsg driver from the rpmsg bus
- * @rpdrv: pointer to a struct rpmsg_driver
- *
- * Returns 0 on success, and an appropriate error value on failure.
- */
-void unregister_rpmsg_driver(struct rpmsg_driver *rpdrv)
+/* the virtio transport of rpmsg_get_dma_dev() */
+static struct device *virtio_rpmsg_get_dma_dev(struct rpmsg_channel *rpdev)
 {
-	driver_unregister(&rpdrv->drv);
+	struct virtproc_info *vrp = rpdev->vrp;
+
+	/* the other side of a virtio_pci/mmio device sees what it sees */
+	return vrp->dma_dev ? vrp->dma_dev : vrp->vdev->dev.parent;
 }
-EXPORT_SYMBOL(unregister_rpmsg_driver);
 
-static void rpmsg_release_device(struct device *dev)
+/* the virtio transport of rpmsg_get_mtu() */
+static int virtio_rpmsg_get_mtu(struct rpmsg_channel *rpdev)
 {
-	struct rpmsg_channel *rpdev = to_rpmsg_channel(dev);
+	return rpdev->vrp->max_txbuf_size - sizeof(struct rpmsg_hdr);
+}
 
-	kfree(rpdev);
+/* undo the pm_qos setup of @vrp, once its endpoints are all gone */
+static void rpmsg_qos_release(struct virtproc_info *vrp)
+{
+	cancel_work_sync(&vrp->qos_work);
+	cancel_delayed_work_sync(&vrp->qos_idle_work);
+	pm_qos_remove_request(&vrp->qos_req);
 }
 
 /*
- * match an rpmsg channel with a channel info struct.
- * this is used to make sure we're not creating rpmsg devices for channels
- * that already exist.
+ * tell the remote processor's name service about @rpdev (with @flags being
+ * either RPMSG_NS_CREATE or RPMSG_NS_DESTROY), if it's a channel that needs
+ * to be announced. This is the announce op of the virtio transport, which
+ * the rpmsg core calls as drivers are bound to (and unbound from) channels.
  */
-static int rpmsg_channel_match(struct device *dev, void *data)
+static int virtio_rpmsg_announce(struct rpmsg_channel *rpdev, u32 flags)
 {
-	struct rpmsg_channel_info *chinfo = data;
-	struct rpmsg_channel *rpdev = to_rpmsg_channel(dev);
+	struct virtproc_info *vrp = rpdev->vrp;
+	struct rpmsg_ns_msg nsm;
+	int err;
 
-	if (chinfo->src != RPMSG_ADDR_ANY && chinfo->src != rpdev->src)
+	if (!rpdev->announce ||
+			!virtio_has_feature(vrp->vdev, VIRTIO_RPMSG_F_NS))
 		return 0;
 
+	strncpy(nsm.name, rpdev->id.name, RPMSG_NAME_SIZE);
+	nsm.addr = rpdev->src;
+	nsm.flags = flags;
+
+	err = rpmsg_sendto(rpdev, &nsm, sizeof(nsm), RPMSG_NS_ADDR);
+	if (err)
+		dev_err(&rpdev->dev, "failed to announce service %d\n", err);
+
+	return err;
+}
+
+/* the hash bucket of channels named @name, with a @dst remote address */
+static struct hlist_head *rpmsg_channel_bucket(struct virtproc_info *vrp,
+						const char *name, u32 dst)
+{
+	u32 hash = jhash(name, strnlen(name, RPMSG_NAME_SIZE), dst);
+
+	return &vrp->channels[hash & ((1 << RPMSG_CHANNELS_HASH_BITS) - 1)];
+}
+
+/* match an rpmsg channel with a channel info struct */
+static bool rpmsg_channel_match(struct rpmsg_channel *rpdev,
+				struct rpmsg_channel_info *chinfo)
+{
+	if (chinfo->src != RPMSG_ADDR_ANY && chinfo->src != rpdev->src)
+		return false;
+
 	if (chinfo->dst != RPMSG_ADDR_ANY && chinfo->dst != rpdev->dst)
-		return 0;
+		return false;
 
-	if (strncmp(chinfo->name, rpdev->id.name, RPMSG_NAME_SIZE))
-		return 0;
+	return !strncmp(chinfo->name, rpdev->id.name, RPMSG_NAME_SIZE);
+}
+
+/*
+ * find an existing channel using its name + address properties.
+ * this is used, e.g., to make sure we're not creating rpmsg devices for
+ * channels that already exist.
+ *
+ * Channels are hashed by name and dst address, so only a single bucket
+ * is looked at, unless the dst address is a wildcard (which the name
+ * service never uses).
+ *
+ * Must be called with vrp->channels_lock held.
+ */
+static struct rpmsg_channel *rpmsg_find_channel(struct virtproc_info *vrp,
+					struct rpmsg_channel_info *chinfo)
+{
+	struct rpmsg_channel *rpdev;
+	struct hlist_node *node;
+	int i;
+
+	if (chinfo->dst != RPMSG_ADDR_ANY) {
+		hlist_for_each_entry(rpdev, node, rpmsg_channel_bucket(vrp,
+					chinfo->name, chinfo->dst), hnode)
+			if (rpmsg_channel_match(rpdev, chinfo))
+				return rpdev;
+
+		return NULL;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(vrp->channels); i++)
+		hlist_for_each_entry(rpdev, node, &vrp->channels[i], hnode)
+			if (rpmsg_channel_match(rpdev, chinfo))
+				return rpdev;
 
-	/* found a match ! */
-	return 1;
+	return NULL;
 }
 
 /*
@@ -503,23 +1378,23 @@ static struct rpmsg_channel *rpmsg_create_channel(struct virtproc_info *vrp,
 				struct rpmsg_channel_info *chinfo)
 {
 	struct rpmsg_channel *rpdev;
-	struct device *tmp, *dev = &vrp->vdev->dev;
+	struct device *dev = &vrp->vdev->dev;
 	int ret;
 
+	mutex_lock(&vrp->channels_lock);
+
 	/* make sure a similar channel doesn't already exist */
-	tmp = device_find_child(dev, chinfo, rpmsg_channel_match);
-	if (tmp) {
-		/* decrement the matched device's refcount back */
-		put_device(tmp);
+	if (rpmsg_find_channel(vrp, chinfo)) {
 		dev_err(dev, "channel %s:%x:%x already exist\n",
 				chinfo->name, chinfo->src, chinfo->dst);
-		return NULL;
+		rpdev = NULL;
+		goto out;
 	}
 
 	rpdev = kzalloc(sizeof(struct rpmsg_channel), GFP_KERNEL);
 	if (!rpdev) {
 		pr_err("kzalloc failed\n");
-		return NULL;
+		goto out;
 	}
 
 	rpdev->vrp = vrp;
@@ -534,20 +1409,22 @@ static struct rpmsg_channel *rpmsg_create_channel(struct virtproc_info *vrp,
 
 	strncpy(rpdev->id.name, chinfo->name, RPMSG_NAME_SIZE);
 
-	/* very simple device indexing plumbing which is enough for now */
-	dev_set_name(&rpdev->dev, "rpmsg%d", rpmsg_dev_index++);
-
+	rpdev->ops = &virtio_rpmsg_ops;
 	rpdev->dev.parent = &vrp->vdev->dev;
-	rpdev->dev.bus = &rpmsg_bus;
-	rpdev->dev.release = rpmsg_release_device;
 
-	ret = device_register(&rpdev->dev);
+	ret = register_rpmsg_device(rpdev);
 	if (ret) {
-		dev_err(dev, "device_register failed: %d\n", ret);
+		dev_err(dev, "register_rpmsg_device failed: %d\n", ret);
 		put_device(&rpdev->dev);
-		return NULL;
+		rpdev = NULL;
+		goto out;
 	}
 
+	hlist_add_head(&rpdev->hnode,
+			rpmsg_channel_bucket(vrp, rpdev->id.name, rpdev->dst));
+
+out:
+	mutex_unlock(&vrp->channels_lock);
 	return rpdev;
 }
 
@@ -558,497 +1435,3692 @@ static struct rpmsg_channel *rpmsg_create_channel(struct virtproc_info *vrp,
 static int rpmsg_destroy_channel(struct virtproc_info *vrp,
 					struct rpmsg_channel_info *chinfo)
 {
-	struct virtio_device *vdev = vrp->vdev;
-	struct device *dev;
+	struct rpmsg_channel *rpdev;
 
-	dev = device_find_child(&vdev->dev, chinfo, rpmsg_channel_match);
-	if (!dev)
-		return -EINVAL;
+	mutex_lock(&vrp->channels_lock);
+
+	rpdev = rpmsg_find_channel(vrp, chinfo);
+	if (rpdev)
+		hlist_del(&rpdev->hnode);
 
-	device_unregister(dev);
+	mutex_unlock(&vrp->channels_lock);
+
+	if (!rpdev)
+		return -EINVAL;
 
-	put_device(dev);
+	unregister_rpmsg_device(rpdev);
 
 	return 0;
 }
 
-/* super simple buffer "allocator" that is just enough for now */
-static void *get_a_tx_buf(struct virtproc_info *vrp)
+/* the @idx-th of the (rx or fixed-size tx) buffers which start at @base */
+static inline void *rpmsg_buf_at(struct virtproc_info *vrp, void *base,
+								int idx)
 {
-	unsigned int len;
-	void *ret;
+	return base + vrp->buf_pad + idx * vrp->buf_stride;
+}
 
-	/* support multiple concurrent senders */
-	mutex_lock(&vrp->tx_lock);
+/* index of @buf among the @num buffers which start at @base, or -1 */
+static int rpmsg_buf_idx(struct virtproc_info *vrp, void *base, int num,
+								void *buf)
+{
+	long offset = buf - base - vrp->buf_pad;
 
-	/*
-	 * either pick the next unused tx buffer
-	 * (half of our buffers are used for sending messages)
-	 */
-	if (vrp->last_sbuf < RPMSG_NUM_BUFS / 2)
-		ret = vrp->sbufs + RPMSG_BUF_SIZE * vrp->last_sbuf++;
-	/* or recycle a used one */
-	else
-		ret = virtqueue_get_buf(vrp->svq, &len);
+	if (offset < 0 || offset >= (long)num * vrp->buf_stride ||
+						offset % vrp->buf_stride)
+		return -1;
 
-	mutex_unlock(&vrp->tx_lock);
+	return offset / vrp->buf_stride;
+}
 
-	return ret;
+/* return a variable-size tx buffer back to the pool */
+static void rpmsg_free_pool_buf(struct virtproc_info *vrp, void *buf)
+{
+	int idx = (buf - vrp->sbufs) >> RPMSG_TXBUF_ORDER;
+
+	gen_pool_free(vrp->tx_pool, (unsigned long)buf,
+				vrp->tx_sizes[idx] << RPMSG_TXBUF_ORDER);
+	vrp->tx_sizes[idx] = 0;
 }
 
-/**
- * rpmsg_upref_sleepers() - enable "tx-complete" interrupts, if needed
- * @vrp: virtual remote processor state
- *
- * This function is called before a sender is blocked, waiting for
- * a tx buffer to become available.
- *
- * If we already have blocking senders, this function merely increases
- * the "sleepers" reference count, and exits.
- *
- * Otherwise, if this is the first sender to block, we also enable
- * virtio's tx callbacks, so we'd be immediately notified when a tx
- * buffer is consumed (we rely on virtio's tx callback in order
- * to wake up sleeping senders as soon as a tx buffer is used by the
- * remote processor).
+/* index of tx buffer @buf in the per-buffer bookkeeping arrays */
+static int rpmsg_tx_slot(struct virtproc_info *vrp, void *buf)
+{
+	if (vrp->tx_pool)
+		return (buf - vrp->sbufs) >> RPMSG_TXBUF_ORDER;
+
+	return rpmsg_buf_idx(vrp, vrp->sbufs, vrp->num_sbufs, buf);
+}
+
+/* where we keep track of the endpoint charged for tx buffer @buf */
+static struct rpmsg_endpoint **rpmsg_tx_owner(struct virtproc_info *vrp,
+								void *buf)
+{
+	return &vrp->tx_owners[rpmsg_tx_slot(vrp, buf)];
+}
+
+/* log2 histogram bucket of a @delta nsecs latency */
+static inline int rpmsg_lat_bucket(s64 delta)
+{
+	/* clocks of different cpus may be slightly off */
+	if (delta <= 0)
+		return 0;
+
+	return min_t(int, fls64(delta), RPMSG_LAT_BUCKETS - 1);
+}
+
+/*
+ * the low 32 bits of the clock shared with the remote processor, which
+ * messages are stamped with (0 is never returned: it means "not stamped")
  */
-static void rpmsg_upref_sleepers(struct virtproc_info *vrp)
+static u32 rpmsg_tstamp(struct virtproc_info *vrp)
 {
-	/* support multiple concurrent senders */
-	mutex_lock(&vrp->tx_lock);
+	u32 rate, ticks;
 
-	/* are we the first sleeping context waiting for tx buffers ? */
-	if (atomic_inc_return(&vrp->sleepers) == 1)
-		/* enable "tx-complete" interrupts before dozing off */
-		virtqueue_enable_cb(vrp->svq);
+	ticks = rproc_vdev_shared_clock(vrp->vdev, &rate);
 
-	mutex_unlock(&vrp->tx_lock);
+	return ticks ?: 1;
 }
 
-/**
- * rpmsg_downref_sleepers() - disable "tx-complete" interrupts, if needed
- * @vrp: virtual remote processor state
+/* hand @buf back to its allocator, be it the pool or the free list */
+static void __free_a_tx_buf(struct virtproc_info *vrp, void *buf)
+{
+	if (vrp->tx_pool)
+		rpmsg_free_pool_buf(vrp, buf);
+	else
+		vrp->free_sbufs[vrp->num_free_sbufs++] = buf;
+}
+
+/*
+ * stop the "tx-complete" interrupts, unless blocked senders or in-flight
+ * asynchronous messages still need them.
  *
- * This function is called after a sender, that waited for a tx buffer
- * to become available, is unblocked.
+ * Must be called with vrp->tx_lock held.
+ */
+static void __rpmsg_tx_cbs_idle(struct virtproc_info *vrp)
+{
+	int i;
+
+	if (vrp->tx_pending || atomic_read(&vrp->sleepers) || vrp->frozen)
+		return;
+
+	for (i = 0; i < vrp->num_qps; i++)
+		virtqueue_disable_cb(vrp->qps[i].svq);
+}
+
+/*
+ * return a tx buffer, that is free to be reused, back to its allocator.
  *
- * If we still have blocking senders, this function merely decreases
- * the "sleepers" reference count, and exits.
+ * If the buffer carries an asynchronous message, its completion is queued
+ * instead, and the buffer is only freed once the completion is reported
+ * (see rpmsg_complete_tx()).
  *
- * Otherwise, if there are no more blocking senders, we also disable
- * virtio's tx callbacks, to avoid the overhead incurred with handling
- * those (now redundant) interrupts.
+ * Must be called with vrp->tx_lock held.
  */
-static void rpmsg_downref_sleepers(struct virtproc_info *vrp)
+static void __put_a_tx_buf(struct virtproc_info *vrp, void *buf)
 {
-	/* support multiple concurrent senders */
-	mutex_lock(&vrp->tx_lock);
+	struct rpmsg_endpoint **owner = rpmsg_tx_owner(vrp, buf);
+	u64 *stamp = &vrp->tx_stamps[rpmsg_tx_slot(vrp, buf)];
+	struct rpmsg_tx_cb *cb = &vrp->tx_cbs[rpmsg_tx_slot(vrp, buf)];
+
+	/* was it sent ? then account for its round trip */
+	if (*stamp) {
+		this_cpu_inc(vrp->stats->tx_lat[rpmsg_lat_bucket(
+						local_clock() - *stamp)]);
+		*stamp = 0;
+	}
 
-	/* are we the last sleeping context waiting for tx buffers ? */
-	if (atomic_dec_and_test(&vrp->sleepers))
-		/* disable "tx-complete" interrupts */
-		virtqueue_disable_cb(vrp->svq);
+	/* give the buffer's credit back to its endpoint */
+	if (*owner) {
+		(*owner)->tx_inflight--;
+		kref_put(&(*owner)->refcount, __ept_release);
+		*owner = NULL;
 
-	mutex_unlock(&vrp->tx_lock);
+		if (waitqueue_active(&vrp->creditq))
+			wake_up_interruptible(&vrp->creditq);
+	}
+
+	if (cb->done) {
+		cb->buf = buf;
+
+		/* callbacks aren't invoked with the tx lock held */
+		if (list_empty(&vrp->tx_done))
+			schedule_work(&vrp->tx_done_work);
+		list_add_tail(&cb->node, &vrp->tx_done);
+
+		vrp->tx_pending--;
+		__rpmsg_tx_cbs_idle(vrp);
+		return;
+	}
+
+	__free_a_tx_buf(vrp, buf);
 }
 
-/**
- * rpmsg_send_offchannel_raw() - send a message across to the remote processor
- * @rpdev: the rpmsg channel
- * @src: source address
- * @dst: destination address
- * @data: payload of message
- * @len: length of payload
- * @wait: indicates whether caller should block in case no TX buffers available
+/*
+ * reclaim all the tx buffers the remote processor is done with.
  *
- * This function is the base implementation for all of the rpmsg sending API.
+ * Must be called with vrp->tx_lock held.
+ */
+static void rpmsg_reclaim_tx_bufs(struct virtproc_info *vrp)
+{
+	unsigned int len;
+	void *buf;
+	int i;
+
+	/* the tx virtqueues are gone while we're frozen */
+	if (vrp->frozen)
+		return;
+
+	for (i = 0; i < vrp->num_qps; i++)
+		while ((buf = virtqueue_get_buf(vrp->qps[i].svq, &len)))
+			__put_a_tx_buf(vrp, buf);
+}
+
+/* grab a tx buffer of @size bytes from the variable-size pool */
+static void *rpmsg_alloc_pool_buf(struct virtproc_info *vrp, unsigned int size)
+{
+	void *buf;
+
+	/* first, reclaim all the buffers the remote processor is done with */
+	rpmsg_reclaim_tx_bufs(vrp);
+
+	size = ALIGN(size, RPMSG_TXBUF_GRANULE);
+
+	buf = (void *)gen_pool_alloc(vrp->tx_pool, size);
+	if (buf)
+		vrp->tx_sizes[(buf - vrp->sbufs) >> RPMSG_TXBUF_ORDER] =
+						size >> RPMSG_TXBUF_ORDER;
+
+	return buf;
+}
+
+/*
+ * grab a fixed-size tx buffer, that isn't cached by any cpu.
  *
- * It will send @data of length @len to @dst, and say it's from @src. The
- * message will be sent to the remote processor which the @rpdev channel
- * belongs to.
+ * Must be called with vrp->tx_lock held.
+ */
+static void *__alloc_a_sbuf(struct virtproc_info *vrp)
+{
+	/* either reuse a free buffer */
+	if (vrp->num_free_sbufs)
+		return vrp->free_sbufs[--vrp->num_free_sbufs];
+
+	/* or pick the next unused tx buffer */
+	if (vrp->last_sbuf < vrp->num_sbufs)
+		return rpmsg_buf_at(vrp, vrp->sbufs, vrp->last_sbuf++);
+
+	/* or recycle the used ones */
+	rpmsg_reclaim_tx_bufs(vrp);
+	if (vrp->num_free_sbufs)
+		return vrp->free_sbufs[--vrp->num_free_sbufs];
+
+	return NULL;
+}
+
+/* grab a free tx buffer from the cache of the local cpu, if it has any */
+static void *rpmsg_tx_cache_get(struct virtproc_info *vrp)
+{
+	struct rpmsg_tx_cache *cache;
+	unsigned long flags;
+	void *buf = NULL;
+
+	local_irq_save(flags);
+	cache = this_cpu_ptr(vrp->tx_cache);
+	spin_lock(&cache->lock);
+	if (cache->count)
+		buf = cache->bufs[--cache->count];
+	spin_unlock(&cache->lock);
+	local_irq_restore(flags);
+
+	return buf;
+}
+
+/*
+ * refill the cache of the local cpu with free tx buffers, so its next
+ * senders don't need the tx lock.
  *
- * The message is sent using one of the TX buffers that are available for
- * communication with this remote processor.
+ * Must be called with vrp->tx_lock held.
+ */
+static void __rpmsg_tx_cache_fill(struct virtproc_info *vrp)
+{
+	struct rpmsg_tx_cache *cache = this_cpu_ptr(vrp->tx_cache);
+	void *buf;
+
+	spin_lock(&cache->lock);
+	while (cache->count < vrp->tx_cache_size) {
+		buf = __alloc_a_sbuf(vrp);
+		if (!buf)
+			break;
+		cache->bufs[cache->count++] = buf;
+	}
+	spin_unlock(&cache->lock);
+}
+
+/*
+ * take a free tx buffer back from the cache of any cpu, for senders who
+ * would otherwise wait for one while it sits there.
  *
- * If @wait is true, the caller will be blocked until either a TX buffer is
- * available, or 15 seconds elapses (we don't want callers to
- * sleep indefinitely due to misbehaving remote processors), and in that
- * case -ERESTARTSYS is returned. The number '15' itself was picked
- * arbitrarily; there's little point in asking drivers to provide a timeout
- * value themselves.
+ * Must be called with vrp->tx_lock held.
+ */
+static void *__rpmsg_tx_cache_steal(struct virtproc_info *vrp)
+{
+	struct rpmsg_tx_cache *cache;
+	void *buf = NULL;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		cache = per_cpu_ptr(vrp->tx_cache, cpu);
+
+		spin_lock(&cache->lock);
+		if (cache->count)
+			buf = cache->bufs[--cache->count];
+		spin_unlock(&cache->lock);
+
+		if (buf)
+			break;
+	}
+
+	return buf;
+}
+
+/*
+ * super simple buffer "allocator" that is just enough for now.
  *
- * Otherwise, if @wait is false, and there are no TX buffers available,
- * the function will immediately fail, and -ENOMEM will be returned.
+ * @size is the total size needed (header included); it is only taken into
+ * account when variable-size tx buffers are in use, since otherwise all
+ * tx buffers are vrp->buf_size bytes long anyway.
  *
- * Normally drivers shouldn't use this function directly; instead, drivers
- * should use the appropriate rpmsg_{try}send{to, _offchannel} API
- * (see include/linux/rpmsg.h).
+ * Must be called with vrp->tx_lock held.
+ */
+static void *__alloc_a_tx_buf(struct virtproc_info *vrp, unsigned int size)
+{
+	void *buf;
+
+	if (vrp->tx_pool)
+		return rpmsg_alloc_pool_buf(vrp, size);
+
+	buf = __alloc_a_sbuf(vrp);
+	if (!buf && vrp->tx_cache)
+		buf = __rpmsg_tx_cache_steal(vrp);
+
+	return buf;
+}
+
+/*
+ * does @ept have a tx credit left ? endpoints without a quota always do.
  *
- * Returns 0 on success and an appropriate error value on failure.
+ * Must be called with vrp->tx_lock held.
  */
-int rpmsg_send_offchannel_raw(struct rpmsg_channel *rpdev, u32 src, u32 dst,
-					void *data, int len, bool wait)
+static bool __rpmsg_tx_has_credit(struct virtproc_info *vrp,
+						struct rpmsg_endpoint *ept)
 {
-	struct virtproc_info *vrp = rpdev->vrp;
-	struct device *dev = &rpdev->dev;
-	struct scatterlist sg;
-	struct rpmsg_hdr *msg;
-	int err;
+	if (!ept || !ept->tx_quota || ept->tx_inflight < ept->tx_quota)
+		return true;
 
-	/* bcasting isn't allowed */
-	if (src == RPMSG_ADDR_ANY || dst == RPMSG_ADDR_ANY) {
-		dev_err(dev, "invalid addr (src 0x%x, dst 0x%x)\n", src, dst);
-		return -EINVAL;
-	}
+	/* maybe some of its buffers were consumed in the meantime */
+	rpmsg_reclaim_tx_bufs(vrp);
 
-	/*
-	 * We currently use fixed-sized buffers, and therefore the payload
-	 * length is limited.
-	 *
-	 * One of the possible improvements here is either to support
-	 * user-provided buffers (and then we can also support zero-copy
-	 * messaging), or to improve the buffer allocator, to support
-	 * variable-length buffer sizes.
-	 */
-	if (len > RPMSG_BUF_SIZE - sizeof(struct rpmsg_hdr)) {
-		dev_err(dev, "message is too big (%d)\n", len);
-		return -EMSGSIZE;
-	}
+	return ept->tx_inflight < ept->tx_quota;
+}
 
-	/* grab a buffer */
-	msg = get_a_tx_buf(vrp);
-	if (!msg && !wait)
-		return -ENOMEM;
+static bool rpmsg_tx_has_credit(struct virtproc_info *vrp,
+						struct rpmsg_endpoint *ept)
+{
+	unsigned long flags;
+	bool ret;
 
-	/* no free buffer ? wait for one (but bail after 15 seconds) */
-	while (!msg) {
-		/* enable "tx-complete" interrupts, if not already enabled */
-		rpmsg_upref_sleepers(vrp);
-
-		/*
-		 * sleep until a free buffer is available or 15 secs elapse.
-		 * the timeout period is not configurable because there's
-		 * little point in asking drivers to specify that.
-		 * if later this happens to be required, it'd be easy to add.
-		 */
-		err = wait_event_interruptible_timeout(vrp->sendq,
-					(msg = get_a_tx_buf(vrp)),
-					msecs_to_jiffies(15000));
-
-		/* disable "tx-complete" interrupts if we're the last sleeper */
-		rpmsg_downref_sleepers(vrp);
-
-		/* timeout ? */
-		if (!err) {
-			dev_err(dev, "timeout waiting for a tx buffer\n");
-			return -ERESTARTSYS;
-		}
-	}
+	spin_lock_irqsave(&vrp->tx_lock, flags);
+	ret = __rpmsg_tx_has_credit(vrp, ept);
+	spin_unlock_irqrestore(&vrp->tx_lock, flags);
 
-	msg->len = len;
-	msg->flags = 0;
-	msg->src = src;
-	msg->dst = dst;
-	msg->reserved = 0;
-	memcpy(msg->data, data, len);
+	return ret;
+}
+
+/*
+ * grab a tx buffer on behalf of @ept, and charge @ept for it if it has
+ * a tx quota. Returns NULL if there's no free buffer, or if @ept is out
+ * of credits.
+ *
+ * Must be called with vrp->tx_lock held.
+ */
+static void *__get_a_tx_buf(struct virtproc_info *vrp,
+				struct rpmsg_endpoint *ept, unsigned int size)
+{
+	void *buf;
 
-	dev_dbg(dev, "TX From 0x%x, To 0x%x, Len %d, Flags %d, Reserved %d\n",
-					msg->src, msg->dst, msg->len,
-					msg->flags, msg->reserved);
-	print_hex_dump(KERN_DEBUG, "rpmsg_virtio TX: ", DUMP_PREFIX_NONE, 16, 1,
-					msg, sizeof(*msg) + msg->len, true);
+	/* there's no point in sending anything while we're frozen */
+	if (vrp->frozen)
+		return NULL;
 
-	sg_init_one(&sg, msg, sizeof(*msg) + len);
+	if (!__rpmsg_tx_has_credit(vrp, ept))
+		return NULL;
 
-	mutex_lock(&vrp->tx_lock);
+	if (rpmsg_should_fail_tx_buf(vrp, size))
+		return NULL;
 
-	/* add message to the remote processor's virtqueue */
-	err = virtqueue_add_buf(vrp->svq, &sg, 1, 0, msg, GFP_KERNEL);
-	if (err < 0) {
-		/*
-		 * need to reclaim the buffer here, otherwise it's lost
-		 * (memory won't leak, but rpmsg won't use it again for TX).
-		 * this will wait for a buffer management overhaul.
-		 */
-		dev_err(dev, "virtqueue_add_buf failed: %d\n", err);
-		goto out;
+	buf = __alloc_a_tx_buf(vrp, size);
+	if (buf && ept && ept->tx_quota) {
+		kref_get(&ept->refcount);
+		ept->tx_inflight++;
+		*rpmsg_tx_owner(vrp, buf) = ept;
 	}
 
-	/* tell the remote processor it has a pending message to read */
-	virtqueue_kick(vrp->svq);
+	return buf;
+}
+
+static void *get_a_tx_buf(struct virtproc_info *vrp,
+				struct rpmsg_endpoint *ept, unsigned int size)
+{
+	bool cached = vrp->tx_cache && !(ept && ept->tx_quota);
+	unsigned long flags;
+	void *ret;
+
+	/* the fast path: a buffer of our cpu's cache, without the tx lock */
+	if (cached && !ACCESS_ONCE(vrp->frozen)) {
+		if (rpmsg_should_fail_tx_buf(vrp, size))
+			return NULL;
+
+		ret = rpmsg_tx_cache_get(vrp);
+		if (ret)
+			return ret;
+	}
+
+	/* support multiple concurrent senders */
+	spin_lock_irqsave(&vrp->tx_lock, flags);
+	ret = __get_a_tx_buf(vrp, ept, size);
+	if (ret && cached)
+		__rpmsg_tx_cache_fill(vrp);
+	spin_unlock_irqrestore(&vrp->tx_lock, flags);
+
+	return ret;
+}
+
+/*
+ * wake up the first sender waiting for a tx buffer, looking at higher
+ * priorities first, along with those waiting for tx credits.
+ */
+static void rpmsg_wake_senders(struct virtproc_info *vrp)
+{
+	int prio;
+
+	if (waitqueue_active(&vrp->creditq))
+		wake_up_interruptible(&vrp->creditq);
+
+	for (prio = RPMSG_TX_PRIO_NUM - 1; prio >= 0; prio--) {
+		if (waitqueue_active(&vrp->sendq[prio])) {
+			wake_up_interruptible(&vrp->sendq[prio]);
+			break;
+		}
+	}
+
+	/* may be called with tx_lock held: let a work call them back */
+	if (!list_empty(&vrp->tx_notify))
+		schedule_work(&vrp->tx_notify_work);
+}
+
+/*
+ * are there senders of a higher priority than @prio waiting for a tx
+ * buffer ? if so, they should be served first.
+ */
+static bool rpmsg_tx_preempted(struct virtproc_info *vrp, int prio)
+{
+	while (++prio < RPMSG_TX_PRIO_NUM)
+		if (atomic_read(&vrp->tx_waiters[prio]))
+			return true;
+
+	return false;
+}
+
+/* give back a tx buffer that was never handed over to the remote processor */
+static void put_a_tx_buf(struct virtproc_info *vrp, void *buf)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&vrp->tx_lock, flags);
+	__put_a_tx_buf(vrp, buf);
+	spin_unlock_irqrestore(&vrp->tx_lock, flags);
+
+	/* someone might be waiting for a tx buffer */
+	rpmsg_wake_senders(vrp);
+}
+
+/* rpmsg_upref_sleepers(), with vrp->tx_lock already held */
+static void __rpmsg_upref_sleepers(struct virtproc_info *vrp)
+{
+	int i;
+
+	/* are we the first sleeping context waiting for tx buffers ? */
+	if (atomic_inc_return(&vrp->sleepers) == 1 && !vrp->frozen)
+		/* enable "tx-complete" interrupts before dozing off */
+		for (i = 0; i < vrp->num_qps; i++)
+			virtqueue_enable_cb_delayed(vrp->qps[i].svq);
+}
+
+/**
+ * rpmsg_upref_sleepers() - enable "tx-complete" interrupts, if needed
+ * @vrp: virtual remote processor state
+ *
+ * This function is called before a sender is blocked, waiting for
+ * a tx buffer to become available.
+ *
+ * If we already have blocking senders, this function merely increases
+ * the "sleepers" reference count, and exits.
+ *
+ * Otherwise, if this is the first sender to block, we also enable
+ * virtio's tx callbacks, so we'd be notified when tx buffers are consumed
+ * (we rely on virtio's tx callback in order to wake up sleeping senders
+ * as soon as tx buffers are used by the remote processor).
+ *
+ * Callbacks are enabled in their delayed flavor, so the remote processor
+ * interrupts us only once the bulk of the pending tx buffers were used,
+ * and not on every single one of them.
+ */
+static void rpmsg_upref_sleepers(struct virtproc_info *vrp)
+{
+	unsigned long flags;
+
+	/* support multiple concurrent senders */
+	spin_lock_irqsave(&vrp->tx_lock, flags);
+	__rpmsg_upref_sleepers(vrp);
+	spin_unlock_irqrestore(&vrp->tx_lock, flags);
+}
+
+/**
+ * rpmsg_downref_sleepers() - disable "tx-complete" interrupts, if needed
+ * @vrp: virtual remote processor state
+ *
+ * This function is called after a sender, that waited for a tx buffer
+ * to become available, is unblocked.
+ *
+ * If we still have blocking senders, this function merely decreases
+ * the "sleepers" reference count, and exits.
+ *
+ * Otherwise, if there are no more blocking senders, we also disable
+ * virtio's tx callbacks, to avoid the overhead incurred with handling
+ * those (now redundant) interrupts.
+ */
+static void rpmsg_downref_sleepers(struct virtproc_info *vrp)
+{
+	unsigned long flags;
+
+	/* support multiple concurrent senders */
+	spin_lock_irqsave(&vrp->tx_lock, flags);
+
+	/*
+	 * are we the last sleeping context waiting for tx buffers ? then
+	 * disable "tx-complete" interrupts, unless asynchronous messages
+	 * are still waiting for them
+	 */
+	if (atomic_dec_and_test(&vrp->sleepers))
+		__rpmsg_tx_cbs_idle(vrp);
+
+	spin_unlock_irqrestore(&vrp->tx_lock, flags);
+}
+
+/*
+ * invoke the callbacks of the asynchronous messages that completed, and
+ * only then free their tx buffers. The tx lock is dropped meanwhile, so
+ * the callbacks may send further messages.
+ */
+static void rpmsg_complete_tx(struct virtproc_info *vrp)
+{
+	struct rpmsg_tx_cb *cb, *tmp;
+	unsigned long flags;
+	LIST_HEAD(done);
+
+	spin_lock_irqsave(&vrp->tx_lock, flags);
+	list_splice_init(&vrp->tx_done, &done);
+	spin_unlock_irqrestore(&vrp->tx_lock, flags);
+
+	if (list_empty(&done))
+		return;
+
+	list_for_each_entry(cb, &done, node)
+		cb->done(cb->priv, cb->err);
+
+	spin_lock_irqsave(&vrp->tx_lock, flags);
+	list_for_each_entry_safe(cb, tmp, &done, node) {
+		list_del(&cb->node);
+		cb->done = NULL;
+		cb->err = 0;
+		__free_a_tx_buf(vrp, cb->buf);
+	}
+	spin_unlock_irqrestore(&vrp->tx_lock, flags);
+
+	/* someone might be waiting for those tx buffers */
+	rpmsg_wake_senders(vrp);
+}
+
+/* completions of messages reclaimed by senders, or by rpmsg_freeze() */
+static void rpmsg_tx_done_work(struct work_struct *work)
+{
+	struct virtproc_info *vrp = container_of(work, struct virtproc_info,
+							tx_done_work);
+
+	rpmsg_complete_tx(vrp);
+}
+
+/*
+ * call back the non-blocking senders that waited for a tx buffer. Each of
+ * them counted as a sleeper while it was queued.
+ */
+static void rpmsg_tx_notify_work(struct work_struct *work)
+{
+	struct virtproc_info *vrp = container_of(work, struct virtproc_info,
+							tx_notify_work);
+	struct rpmsg_tx_waiter *waiter, *tmp;
+	unsigned long flags;
+
+	spin_lock_irqsave(&vrp->tx_lock, flags);
+
+	list_for_each_entry_safe(waiter, tmp, &vrp->tx_notify, node) {
+		list_del_init(&waiter->node);
+		atomic_dec(&vrp->sleepers);
+		waiter->func(waiter);
+	}
+
+	__rpmsg_tx_cbs_idle(vrp);
+
+	spin_unlock_irqrestore(&vrp->tx_lock, flags);
+}
+
+/*
+ * grab a tx buffer which is big enough for a @len bytes payload, and
+ * possibly wait (but bail after @timeout jiffies) if none is available.
+ * A zero @timeout means don't wait at all.
+ *
+ * Returns a pointer to the (header of the) buffer, or an ERR_PTR value
+ * on failure.
+ */
+static struct rpmsg_hdr *rpmsg_get_tx_msg(struct rpmsg_channel *rpdev,
+							int len, long timeout)
+{
+	struct virtproc_info *vrp = rpdev->vrp;
+	struct rpmsg_endpoint *ept = rpdev->ept;
+	int prio = ept ? ept->tx_prio : RPMSG_TX_PRIO_NORMAL;
+	struct device *dev = &rpdev->dev;
+	DECLARE_WAITQUEUE(wait, current);
+	struct rpmsg_hdr *msg;
+	int max_len, err;
+
+	/*
+	 * The payload length is limited by the size of our tx buffers:
+	 * fixed-size buffers, unless the remote processor supports
+	 * variable-size ones.
+	 */
+	max_len = vrp->max_txbuf_size;
+	if (len < 0 || len > max_len - sizeof(struct rpmsg_hdr)) {
+		dev_err(dev, "message is too big (%d)\n", len);
+		return ERR_PTR(-EMSGSIZE);
+	}
+
+	/*
+	 * senders using more than their share of a busy remote processor
+	 * wait for their turn; those which can't wait are told there's no
+	 * room, as they would be if we were out of buffers.
+	 */
+	if (vrp->acct) {
+		err = rproc_vdev_acct_admit(vrp->vdev, rproc_cgroup_tag(),
+								timeout);
+		if (err)
+			return ERR_PTR(err == -EAGAIN ? -ENOMEM : err);
+	}
+
+	/* grab a buffer, unless more urgent senders are already waiting */
+	if (!rpmsg_tx_preempted(vrp, prio)) {
+		msg = get_a_tx_buf(vrp, ept, sizeof(*msg) + len);
+		if (msg)
+			return msg;
+	}
+
+	if (!timeout)
+		return ERR_PTR(-ENOMEM);
+
+	trace_rpmsg_tx_wait(dev, ept ? ept->addr : rpdev->src, len, prio);
+
+	this_cpu_inc(vrp->stats->tx_waits);
+	if (ept)
+		this_cpu_inc(ept->stats->tx_waits);
+
+	/* enable "tx-complete" interrupts, if not already enabled */
+	rpmsg_upref_sleepers(vrp);
+
+	/* out of credits ? wait until some of our buffers are consumed */
+	if (ept && ept->tx_quota) {
+		timeout = wait_event_interruptible_timeout(vrp->creditq,
+				rpmsg_tx_has_credit(vrp, ept), timeout);
+		if (timeout <= 0) {
+			msg = ERR_PTR(timeout ? -ERESTARTSYS : -ETIMEDOUT);
+			goto out;
+		}
+	}
+
+	/*
+	 * no free buffer ? wait for one, behind the senders of our priority
+	 * that were here first. Senders wait exclusively, so a tx completion
+	 * wakes up a single sender, and since the wait queue entry isn't
+	 * removed on wake up, a sender that loses the race keeps its place
+	 * in line.
+	 */
+	atomic_inc(&vrp->tx_waiters[prio]);
+	add_wait_queue_exclusive(&vrp->sendq[prio], &wait);
+
+	for (;;) {
+		set_current_state(TASK_INTERRUPTIBLE);
+
+		if (!rpmsg_tx_preempted(vrp, prio)) {
+			msg = get_a_tx_buf(vrp, ept, sizeof(*msg) + len);
+			if (msg)
+				break;
+		}
+
+		if (signal_pending(current)) {
+			msg = ERR_PTR(-ERESTARTSYS);
+			break;
+		}
+
+		if (!timeout) {
+			msg = ERR_PTR(-ETIMEDOUT);
+			break;
+		}
+
+		timeout = schedule_timeout(timeout);
+	}
+
+	__set_current_state(TASK_RUNNING);
+	remove_wait_queue(&vrp->sendq[prio], &wait);
+	atomic_dec(&vrp->tx_waiters[prio]);
+
+	/* more buffers may have been freed: let the next one in line try */
+	if (!IS_ERR(msg))
+		rpmsg_wake_senders(vrp);
+
+out:
+	/* disable "tx-complete" interrupts if we're the last sleeper */
+	rpmsg_downref_sleepers(vrp);
+
+	if (PTR_ERR(msg) == -ETIMEDOUT) {
+		this_cpu_inc(vrp->stats->tx_timeouts);
+		dev_err(dev, "timeout waiting for a tx buffer\n");
+	}
+
+	return msg;
+}
+
+/*
+ * pick the tx virtqueue for messages sent from @src over @rpdev: the one
+ * the channel's endpoint is pinned to, if any, or otherwise a hash of @src.
+ *
+ * Must be called with vrp->tx_lock held. Returns NULL if we're frozen.
+ */
+static struct virtqueue *rpmsg_tx_vq(struct rpmsg_channel *rpdev, u32 src)
+{
+	struct virtproc_info *vrp = rpdev->vrp;
+	int qp = rpdev->ept ? rpdev->ept->tx_queue : -1;
+
+	if (vrp->frozen)
+		return NULL;
+
+	if (qp < 0 || qp >= vrp->num_qps)
+		qp = src % vrp->num_qps;
+
+	return vrp->qps[qp].svq;
+}
+
+/* hand @len bytes of a cacheable buffer over to the remote processor */
+static void rpmsg_sync_buf_for_device(struct virtproc_info *vrp, void *buf,
+				size_t len, enum dma_data_direction dir)
+{
+	if (vrp->cached_bufs)
+		dma_sync_single_for_device(vrp->dma_dev,
+				vrp->bufs_dma + (buf - vrp->rbufs), len, dir);
+}
+
+/* take @len bytes of a cacheable buffer back from the remote processor */
+static void rpmsg_sync_buf_for_cpu(struct virtproc_info *vrp, void *buf,
+				size_t len, enum dma_data_direction dir)
+{
+	if (vrp->cached_bufs)
+		dma_sync_single_for_cpu(vrp->dma_dev,
+				vrp->bufs_dma + (buf - vrp->rbufs), len, dir);
+}
+
+/*
+ * fill in the header of a tx buffer, whose @len bytes payload is already
+ * in place, and add it to the remote processor's @svq virtqueue (as
+ * returned by rpmsg_tx_vq()).
+ *
+ * Must be called with vrp->tx_lock held. The remote processor isn't kicked.
+ * On failure, the buffer is given back to the tx buffer allocator.
+ */
+static int rpmsg_queue_tx_msg(struct rpmsg_channel *rpdev,
+				struct virtqueue *svq, u32 src, u32 dst,
+				struct rpmsg_hdr *msg, int len)
+{
+	struct virtproc_info *vrp = rpdev->vrp;
+	struct device *dev = &rpdev->dev;
+	struct scatterlist sg;
+	int err;
+
+	msg->len = len;
+	msg->flags = vrp->acct ? rproc_cgroup_tag() : 0;
+	msg->src = src;
+	msg->dst = dst;
+	msg->reserved = vrp->tstamp_rate ? rpmsg_tstamp(vrp) : 0;
+
+	/* the remote processor is being restarted: try again later */
+	if (!svq) {
+		err = -EAGAIN;
+		goto put_buf;
+	}
+
+	trace_rpmsg_tx(dev, src, dst, len, virtqueue_get_queue_index(svq));
+
+	sg_init_one(&sg, msg, sizeof(*msg) + len);
+	rpmsg_sync_buf_for_device(vrp, msg, sizeof(*msg) + len, DMA_TO_DEVICE);
+
+	/* add message to the remote processor's virtqueue */
+	/* a single entry never needs an indirect descriptor allocation */
+	err = virtqueue_add_buf(svq, &sg, 1, 0, msg, GFP_ATOMIC);
+	if (err < 0) {
+		dev_err(dev, "virtqueue_add_buf failed: %d\n", err);
+		goto put_buf;
+	}
+
+	vrp->tx_stamps[rpmsg_tx_slot(vrp, msg)] = local_clock();
+
+	this_cpu_inc(vrp->stats->tx_msgs);
+	this_cpu_add(vrp->stats->tx_bytes, len);
+	if (rpdev->ept) {
+		this_cpu_inc(rpdev->ept->stats->tx_msgs);
+		this_cpu_add(rpdev->ept->stats->tx_bytes, len);
+		if (rpdev->ept->qos_latency != PM_QOS_DEFAULT_VALUE)
+			rpmsg_qos_touch(vrp);
+	}
+
+	return 0;
+
+put_buf:
+	/* the buffer is still ours: make it available again */
+	__put_a_tx_buf(vrp, msg);
+	rpmsg_wake_senders(vrp);
+	return err;
+}
+
+/*
+ * hand a tx buffer, whose @len bytes payload is already in place, over to
+ * the remote processor, and kick it.
+ *
+ * If @done is given, it is invoked with @priv once the remote processor is
+ * done with the message, and "tx-complete" interrupts are enabled until
+ * then, so the completion is reported without delay.
+ */
+static int rpmsg_submit_tx_msg(struct rpmsg_channel *rpdev, u32 src, u32 dst,
+				struct rpmsg_hdr *msg, int len,
+				rpmsg_tx_done_t done, void *priv)
+{
+	struct virtproc_info *vrp = rpdev->vrp;
+	struct virtqueue *svq;
+	bool notify = false;
+	unsigned long flags;
+	int err;
+
+	/* the tx virtqueue can't go away before it's kicked (see rpmsg_freeze) */
+	rcu_read_lock();
+	spin_lock_irqsave(&vrp->tx_lock, flags);
+
+	svq = rpmsg_tx_vq(rpdev, src);
+
+	err = rpmsg_queue_tx_msg(rpdev, svq, src, dst, msg, len);
+	if (!err && done) {
+		struct rpmsg_tx_cb *cb = &vrp->tx_cbs[rpmsg_tx_slot(vrp, msg)];
+
+		cb->done = done;
+		cb->priv = priv;
+		vrp->tx_pending++;
+		virtqueue_enable_cb_delayed(svq);
+	}
+
+	if (!err && !rpmsg_should_fail_kick(vrp))
+		notify = virtqueue_kick_prepare(svq);
+
+	spin_unlock_irqrestore(&vrp->tx_lock, flags);
+
+	/* tell the remote processor it has a pending message to read */
+	if (notify)
+		virtqueue_notify(svq);
+
+	rcu_read_unlock();
+
+	return err;
+}
+
+/* the virtio transport of rpmsg_send_offchannel_timeout() */
+static int virtio_rpmsg_send_offchannel(struct rpmsg_channel *rpdev, u32 src,
+				u32 dst, void *data, int len, long timeout)
+{
+	struct device *dev = &rpdev->dev;
+	struct rpmsg_hdr *msg;
+
+	/* bcasting isn't allowed */
+	if (src == RPMSG_ADDR_ANY || dst == RPMSG_ADDR_ANY) {
+		dev_err(dev, "invalid addr (src 0x%x, dst 0x%x)\n", src, dst);
+		return -EINVAL;
+	}
+
+	msg = rpmsg_get_tx_msg(rpdev, len, timeout);
+	if (IS_ERR(msg))
+		return PTR_ERR(msg);
+
+	memcpy(msg->data, data, len);
+
+	return rpmsg_submit_tx_msg(rpdev, src, dst, msg, len, NULL, NULL);
+}
+
+/* the virtio transport of rpmsg_send_offchannel_async() */
+static int virtio_rpmsg_send_offchannel_async(struct rpmsg_channel *rpdev,
+			u32 src, u32 dst, void *data, int len,
+			rpmsg_tx_done_t done, void *priv)
+{
+	struct device *dev = &rpdev->dev;
+	struct rpmsg_hdr *msg;
+
+	/* bcasting isn't allowed */
+	if (src == RPMSG_ADDR_ANY || dst == RPMSG_ADDR_ANY) {
+		dev_err(dev, "invalid addr (src 0x%x, dst 0x%x)\n", src, dst);
+		return -EINVAL;
+	}
+
+	if (!done)
+		return -EINVAL;
+
+	msg = rpmsg_get_tx_msg(rpdev, len, 0);
+	if (IS_ERR(msg))
+		return PTR_ERR(msg);
+
+	memcpy(msg->data, data, len);
+
+	return rpmsg_submit_tx_msg(rpdev, src, dst, msg, len, done, priv);
+}
+
+/* the virtio transport of rpmsg_sendv_offchannel_raw() */
+static int virtio_rpmsg_sendv_offchannel(struct rpmsg_channel *rpdev,
+			u32 src, u32 dst, const struct kvec *vec, int num,
+			bool wait)
+{
+	long timeout = wait ? rpmsg_tx_timeout(rpdev) : 0;
+	struct device *dev = &rpdev->dev;
+	struct rpmsg_hdr *msg;
+	void *data;
+	int i, len = 0;
+
+	/* bcasting isn't allowed */
+	if (src == RPMSG_ADDR_ANY || dst == RPMSG_ADDR_ANY) {
+		dev_err(dev, "invalid addr (src 0x%x, dst 0x%x)\n", src, dst);
+		return -EINVAL;
+	}
+
+	for (i = 0; i < num; i++) {
+		if (vec[i].iov_len > INT_MAX - len)
+			return -EMSGSIZE;
+		len += vec[i].iov_len;
+	}
+
+	msg = rpmsg_get_tx_msg(rpdev, len, timeout);
+	if (IS_ERR(msg))
+		return PTR_ERR(msg);
+
+	for (i = 0, data = msg->data; i < num; i++) {
+		memcpy(data, vec[i].iov_base, vec[i].iov_len);
+		data += vec[i].iov_len;
+	}
+
+	return rpmsg_submit_tx_msg(rpdev, src, dst, msg, len, NULL, NULL);
+}
+
+/* the virtio transport of rpmsg_send_offchannel_batch() */
+static int virtio_rpmsg_send_offchannel_batch(struct rpmsg_channel *rpdev,
+			u32 src, struct rpmsg_batch_msg *msgs, int num,
+			bool wait)
+{
+	struct virtproc_info *vrp = rpdev->vrp;
+	struct device *dev = &rpdev->dev;
+	struct rpmsg_hdr *msg;
+	bool notify;
+	struct virtqueue *svq;
+	int prio = rpdev->ept ? rpdev->ept->tx_prio : RPMSG_TX_PRIO_NORMAL;
+	unsigned long flags;
+	int i, max_len, err = 0;
+
+	max_len = vrp->max_txbuf_size - sizeof(struct rpmsg_hdr);
+
+	/* validate the whole batch before sending anything */
+	for (i = 0; i < num; i++) {
+		/* bcasting isn't allowed */
+		if (src == RPMSG_ADDR_ANY || msgs[i].dst == RPMSG_ADDR_ANY) {
+			dev_err(dev, "invalid addr (src 0x%x, dst 0x%x)\n",
+							src, msgs[i].dst);
+			return -EINVAL;
+		}
+
+		if (msgs[i].len < 0 || msgs[i].len > max_len) {
+			dev_err(dev, "message is too big (%d)\n", msgs[i].len);
+			return -EMSGSIZE;
+		}
+	}
+
+	i = 0;
+	while (i < num) {
+		notify = false;
+
+		rcu_read_lock();
+		spin_lock_irqsave(&vrp->tx_lock, flags);
+
+		svq = rpmsg_tx_vq(rpdev, src);
+
+		/* queue as many messages as we can without blocking */
+		for (; i < num; i++) {
+			if (rpmsg_tx_preempted(vrp, prio))
+				break;
+
+			msg = __get_a_tx_buf(vrp, rpdev->ept,
+						sizeof(*msg) + msgs[i].len);
+			if (!msg)
+				break;
+
+			memcpy(msg->data, msgs[i].data, msgs[i].len);
+
+			err = rpmsg_queue_tx_msg(rpdev, svq, src, msgs[i].dst,
+							msg, msgs[i].len);
+			if (err)
+				break;
+
+			notify = true;
+		}
+
+		if (notify && !rpmsg_should_fail_kick(vrp))
+			notify = virtqueue_kick_prepare(svq);
+		else
+			notify = false;
+
+		spin_unlock_irqrestore(&vrp->tx_lock, flags);
+
+		/* tell the remote processor it has pending messages to read */
+		if (notify)
+			virtqueue_notify(svq);
+
+		rcu_read_unlock();
+
+		if (err || i == num || !wait)
+			break;
+
+		/* out of tx buffers: wait for one, and send it on its own */
+		msg = rpmsg_get_tx_msg(rpdev, msgs[i].len,
+						rpmsg_tx_timeout(rpdev));
+		if (IS_ERR(msg)) {
+			err = PTR_ERR(msg);
+			break;
+		}
+
+		memcpy(msg->data, msgs[i].data, msgs[i].len);
+
+		err = rpmsg_submit_tx_msg(rpdev, src, msgs[i].dst, msg,
+						msgs[i].len, NULL, NULL);
+		if (err)
+			break;
+
+		i++;
+	}
+
+	if (i)
+		return i;
+
+	return err ? err : -ENOMEM;
+}
+
+/* the virtio transport of rpmsg_send_offchannel_mcast() */
+static int virtio_rpmsg_send_offchannel_mcast(struct rpmsg_channel *rpdev,
+			u32 src, const u32 *dst, int num, void *data,
+			int len, bool wait)
+{
+	struct virtproc_info *vrp = rpdev->vrp;
+	struct device *dev = &rpdev->dev;
+	struct rpmsg_batch_msg *msgs;
+	struct rpmsg_mcast_hdr hdr;
+	struct kvec vec[3];
+	int i, ret, room;
+
+	if (num <= 0 || len < 0)
+		return -EINVAL;
+
+	/* bcasting isn't allowed */
+	for (i = 0; i < num; i++) {
+		if (src == RPMSG_ADDR_ANY || dst[i] == RPMSG_ADDR_ANY) {
+			dev_err(dev, "invalid addr (src 0x%x, dst 0x%x)\n",
+								src, dst[i]);
+			return -EINVAL;
+		}
+	}
+
+	/* room left for the destinations, in a single tx buffer */
+	room = vrp->max_txbuf_size - (int)(sizeof(struct rpmsg_hdr) +
+							sizeof(hdr)) - len;
+
+	if (virtio_has_feature(vrp->vdev, VIRTIO_RPMSG_F_MCAST) &&
+				room >= 0 && num <= room / (int)sizeof(u32)) {
+		hdr.num = num;
+
+		vec[0].iov_base = &hdr;
+		vec[0].iov_len = sizeof(hdr);
+		vec[1].iov_base = (void *)dst;
+		vec[1].iov_len = num * sizeof(u32);
+		vec[2].iov_base = data;
+		vec[2].iov_len = len;
+
+		ret = rpmsg_sendv_offchannel_raw(rpdev, src, RPMSG_MCAST_ADDR,
+							vec, 3, wait);
+
+		return ret ? ret : num;
+	}
+
+	/* the remote processor can't fan it out: send a copy to everyone */
+	msgs = kcalloc(num, sizeof(*msgs), GFP_KERNEL);
+	if (!msgs)
+		return -ENOMEM;
+
+	for (i = 0; i < num; i++) {
+		msgs[i].dst = dst[i];
+		msgs[i].data = data;
+		msgs[i].len = len;
+	}
+
+	ret = virtio_rpmsg_send_offchannel_batch(rpdev, src, msgs, num, wait);
+
+	kfree(msgs);
+
+	return ret;
+}
+
+/*
+ * translate a payload pointer, previously handed out by rpmsg_alloc_tx_buf(),
+ * back to its tx buffer, and make sure it can hold @len bytes of payload.
+ *
+ * Returns NULL if @buf isn't a valid tx buffer payload.
+ */
+static struct rpmsg_hdr *rpmsg_buf_to_tx_msg(struct virtproc_info *vrp,
+							void *buf, int len)
+{
+	struct rpmsg_hdr *msg = buf - sizeof(*msg);
+	int offset = (void *)msg - vrp->sbufs;
+	int size;
+
+	if (offset < 0 || offset >= (size_t)vrp->num_sbufs * vrp->buf_stride)
+		return NULL;
+
+	if (vrp->tx_pool) {
+		if (offset & (RPMSG_TXBUF_GRANULE - 1))
+			return NULL;
+		size = vrp->tx_sizes[offset >> RPMSG_TXBUF_ORDER] <<
+							RPMSG_TXBUF_ORDER;
+	} else {
+		if (rpmsg_buf_idx(vrp, vrp->sbufs, vrp->num_sbufs, msg) < 0)
+			return NULL;
+		size = vrp->buf_size;
+	}
+
+	if (len < 0 || len > size - (int)sizeof(*msg))
+		return NULL;
+
+	return msg;
+}
+
+/* the virtio transport of rpmsg_alloc_tx_buf() */
+static void *
+virtio_rpmsg_alloc_tx_buf(struct rpmsg_channel *rpdev, int len, bool wait)
+{
+	struct rpmsg_hdr *msg;
+
+	msg = rpmsg_get_tx_msg(rpdev, len, wait ? rpmsg_tx_timeout(rpdev) : 0);
+	if (IS_ERR(msg))
+		return msg;
+
+	return msg->data;
+}
+
+/* the virtio transport of rpmsg_free_tx_buf() */
+static void virtio_rpmsg_free_tx_buf(struct rpmsg_channel *rpdev, void *buf)
+{
+	struct virtproc_info *vrp = rpdev->vrp;
+	struct rpmsg_hdr *msg;
+
+	msg = rpmsg_buf_to_tx_msg(vrp, buf, 0);
+	if (!msg) {
+		dev_err(&rpdev->dev, "invalid tx buffer %p\n", buf);
+		return;
+	}
+
+	put_a_tx_buf(vrp, msg);
+}
+
+/* the virtio transport of rpmsg_send_offchannel_buf() */
+static int virtio_rpmsg_send_offchannel_buf(struct rpmsg_channel *rpdev,
+					u32 src, u32 dst, void *buf, int len)
+{
+	struct virtproc_info *vrp = rpdev->vrp;
+	struct device *dev = &rpdev->dev;
+	struct rpmsg_hdr *msg;
+
+	msg = rpmsg_buf_to_tx_msg(vrp, buf, 0);
+	if (!msg) {
+		dev_err(dev, "invalid tx buffer %p\n", buf);
+		return -EINVAL;
+	}
+
+	/* the buffer is ours whatever happens: give it back if it's too small */
+	if (!rpmsg_buf_to_tx_msg(vrp, buf, len)) {
+		dev_err(dev, "message too long for tx buffer %p (len %d)\n",
+								buf, len);
+		put_a_tx_buf(vrp, msg);
+		return -EINVAL;
+	}
+
+	/* bcasting isn't allowed */
+	if (src == RPMSG_ADDR_ANY || dst == RPMSG_ADDR_ANY) {
+		dev_err(dev, "invalid addr (src 0x%x, dst 0x%x)\n", src, dst);
+		put_a_tx_buf(vrp, msg);
+		return -EINVAL;
+	}
+
+	return rpmsg_submit_tx_msg(rpdev, src, dst, msg, len, NULL, NULL);
+}
+
+/* find the queue pair an rx buffer belongs to */
+static struct rpmsg_queue_pair *rpmsg_rx_buf_qp(struct virtproc_info *vrp,
+							struct rpmsg_hdr *msg)
+{
+	int i, offset;
+
+	for (i = 0; i < vrp->num_qps; i++) {
+		struct rpmsg_queue_pair *qp = &vrp->qps[i];
+
+		offset = (void *)msg - qp->rbufs;
+		if (offset < 0 ||
+			offset >= (size_t)qp->num_rbufs * vrp->buf_stride)
+			continue;
+
+		return rpmsg_buf_idx(vrp, qp->rbufs, qp->num_rbufs, msg) < 0 ?
+								NULL : qp;
+	}
+
+	return NULL;
+}
+
+/* the virtio transport of rpmsg_hold_rx_buf() */
+static int virtio_rpmsg_hold_rx_buf(struct rpmsg_channel *rpdev, void *data)
+{
+	struct virtproc_info *vrp = rpdev->vrp;
+	struct rpmsg_hdr *msg = data - sizeof(*msg);
+	struct rpmsg_queue_pair *qp = rpmsg_rx_buf_qp(vrp, msg);
+	struct rpmsg_endpoint *ept;
+	int i;
+
+	/* so are the deferred msgs of endpoints with their own rx context */
+	rcu_read_lock();
+	ept = qp ? idr_find(&vrp->endpoints, msg->dst) : NULL;
+	if (ept && ept->rx && ept->rx->cur == msg) {
+		ept->rx->cur_held = true;
+		rcu_read_unlock();
+		return 0;
+	}
+	rcu_read_unlock();
+
+	/* deferred low priority msgs are held on their behalf already */
+	if (qp && qp->rx_bulk_cur == msg) {
+		qp->rx_bulk_cur_held = true;
+		return 0;
+	}
+
+	/* not a regular rx buffer: it may still be a chain's msg */
+	for (i = 0; !qp && i < vrp->num_qps; i++)
+		if (vrp->qps[i].rx_cur == msg)
+			return -EBUSY;
+
+	if (!qp || qp->rx_cur != msg) {
+		dev_err(&rpdev->dev, "invalid rx buffer %p\n", data);
+		return -EINVAL;
+	}
+
+	if (!atomic_add_unless(&qp->rx_held, 1,
+				qp->num_rbufs / RPMSG_RX_HOLD_RATIO))
+		return -EBUSY;
+
+	qp->rx_cur_held = true;
+
+	return 0;
+}
+
+/* give an rx buffer (or chain) of @qp back, through its owner */
+static void rpmsg_rx_hand_over(struct rpmsg_queue_pair *qp, void *buf)
+{
+	/* the buffer itself is used as the list node */
+	llist_add(buf, &qp->rx_released);
+
+	/*
+	 * Only the owner of the rx virtqueue may add buffers to it: if no one
+	 * owns it at the moment, let the rx work give the buffer back.
+	 * Otherwise, the current owner is bound to pick it up.
+	 */
+	if (!test_and_set_bit(RPMSG_RX_POLLING, &qp->rx_state)) {
+		virtqueue_disable_cb(qp->rvq);
+		queue_work(qp->vrp->rx_wq, &qp->rx_work);
+	}
+}
+
+/* give a held rx buffer of @qp back, through its owner */
+static void rpmsg_rx_release(struct rpmsg_queue_pair *qp, void *buf)
+{
+	atomic_dec(&qp->rx_held);
+
+	rpmsg_rx_hand_over(qp, buf);
+}
+
+/* the virtio transport of rpmsg_release_rx_buf() */
+static void virtio_rpmsg_release_rx_buf(struct rpmsg_channel *rpdev,
+								void *data)
+{
+	struct virtproc_info *vrp = rpdev->vrp;
+	struct rpmsg_hdr *msg = data - sizeof(*msg);
+	struct rpmsg_queue_pair *qp = rpmsg_rx_buf_qp(vrp, msg);
+
+	if (!qp) {
+		dev_err(&rpdev->dev, "invalid rx buffer %p\n", data);
+		return;
+	}
+
+	rpmsg_rx_release(qp, msg);
+}
+
+/* the virtio transport of rpmsg_wait_tx_buf() */
+static int virtio_rpmsg_wait_tx_buf(struct rpmsg_channel *rpdev,
+					struct rpmsg_tx_waiter *waiter)
+{
+	struct virtproc_info *vrp = rpdev->vrp;
+	unsigned long flags;
+
+	spin_lock_irqsave(&vrp->tx_lock, flags);
+
+	/* like a blocking sender, keep "tx-complete" interrupts enabled */
+	if (list_empty(&waiter->node)) {
+		list_add_tail(&waiter->node, &vrp->tx_notify);
+		__rpmsg_upref_sleepers(vrp);
+	}
+
+	spin_unlock_irqrestore(&vrp->tx_lock, flags);
+
+	return 0;
+}
+
+/* the virtio transport of rpmsg_cancel_tx_wait() */
+static void virtio_rpmsg_cancel_tx_wait(struct rpmsg_channel *rpdev,
+					struct rpmsg_tx_waiter *waiter)
+{
+	struct virtproc_info *vrp = rpdev->vrp;
+	unsigned long flags;
+
+	spin_lock_irqsave(&vrp->tx_lock, flags);
+
+	if (!list_empty(&waiter->node)) {
+		list_del_init(&waiter->node);
+		if (atomic_dec_and_test(&vrp->sleepers))
+			__rpmsg_tx_cbs_idle(vrp);
+	}
+
+	spin_unlock_irqrestore(&vrp->tx_lock, flags);
+}
+
+/* account for an inbound msg that is about to be handed over to @ept */
+static void rpmsg_rx_account(struct rpmsg_queue_pair *qp,
+			struct rpmsg_endpoint *ept, struct rpmsg_hdr *msg)
+{
+	struct rpmsg_vrp_stats __percpu *stats = qp->vrp->stats;
+	s64 delta = local_clock() - ACCESS_ONCE(qp->rx_stamp);
+
+	this_cpu_inc(stats->rx_msgs);
+	this_cpu_add(stats->rx_bytes, msg->len);
+	this_cpu_inc(stats->rx_lat[rpmsg_lat_bucket(delta)]);
+
+	this_cpu_inc(ept->stats->rx_msgs);
+	this_cpu_add(ept->stats->rx_bytes, msg->len);
+
+	/* how long ago did the remote processor send it ? */
+	if (qp->vrp->tstamp_rate && msg->reserved) {
+		s32 ticks = rpmsg_tstamp(qp->vrp) - msg->reserved;
+		int bucket = 0;
+
+		/* a stamp ahead of ours is a clock glitch: count it as 0 */
+		if (ticks > 0)
+			bucket = rpmsg_lat_bucket(div_u64((u64)ticks *
+					NSEC_PER_SEC, qp->vrp->tstamp_rate));
+
+		this_cpu_inc(stats->oneway_lat[bucket]);
+		this_cpu_inc(ept->stats->oneway_lat[bucket]);
+	}
+}
+
+/*
+ * Hand the inbound msg of a low priority endpoint over to the bulk work,
+ * holding its rx buffer meanwhile. Only regular rx buffers can be held,
+ * and as many as rpmsg_hold_rx_buf() allows: otherwise, false is returned,
+ * and the msg is to be delivered right away.
+ *
+ * Must be called by the owner of the rx virtqueue, with the msg it's
+ * currently delivering (msgs of the bulk work itself aren't deferred again).
+ */
+static bool rpmsg_rx_defer(struct rpmsg_queue_pair *qp, struct rpmsg_hdr *msg)
+{
+	unsigned int idx;
+
+	if (qp->rx_cur != msg || rpmsg_rx_buf_qp(qp->vrp, msg) != qp)
+		return false;
+
+	idx = rpmsg_buf_idx(qp->vrp, qp->rbufs, qp->num_rbufs, msg);
+
+	if (!atomic_add_unless(&qp->rx_held, 1,
+				qp->num_rbufs / RPMSG_RX_HOLD_RATIO))
+		return false;
+
+	/* the fifo can hold as many msgs as there may be held buffers */
+	if (!kfifo_put(&qp->rx_bulk, &idx)) {
+		atomic_dec(&qp->rx_held);
+		return false;
+	}
+
+	qp->rx_cur_held = true;
+	queue_work(system_wq, &qp->rx_bulk_work);
+
+	return true;
+}
+
+/*
+ * invoke the rx callback of @ept for @msg, be it a regular one or a batch
+ * one (which is then handed a batch of one msg).
+ *
+ * Must be called with ept->cb_lock held.
+ */
+static void rpmsg_ept_cb(struct rpmsg_endpoint *ept, struct rpmsg_hdr *msg)
+{
+	struct rpmsg_rx_msg one;
+
+	if (ept->cb) {
+		ept->cb(ept->rpdev, msg->data, msg->len, ept->priv, msg->src);
+	} else if (ept->batch_cb) {
+		one.data = msg->data;
+		one.len = msg->len;
+		one.src = msg->src;
+		ept->batch_cb(ept->rpdev, &one, 1, ept->priv);
+	}
+}
+
+/*
+ * Hand the msgs batched up in the current drain pass over to their batch
+ * endpoint, and queue their buffers up to be given back to the remote
+ * processor (see rpmsg_recycle_released()).
+ *
+ * Must be called by the owner of the rx virtqueue, from a sleepable context.
+ */
+static void rpmsg_rx_batch_flush(struct rpmsg_queue_pair *qp)
+{
+	struct rpmsg_endpoint *ept = qp->rx_batch_ept;
+	int i;
+
+	if (!ept)
+		return;
+
+	/* make sure ept->batch_cb doesn't go away while we use it */
+	mutex_lock(&ept->cb_lock);
+
+	if (ept->batch_cb)
+		ept->batch_cb(ept->rpdev, qp->rx_batch, qp->rx_batch_num,
+								ept->priv);
+
+	mutex_unlock(&ept->cb_lock);
+
+	/* the buffers themselves are used as the list nodes */
+	for (i = 0; i < qp->rx_batch_num; i++)
+		llist_add(qp->rx_batch[i].data - sizeof(struct rpmsg_hdr),
+							&qp->rx_released);
+
+	qp->rx_batch_num = 0;
+	qp->rx_batch_ept = NULL;
+	kref_put(&ept->refcount, __ept_release);
+}
+
+/*
+ * Add the inbound msg currently being delivered to the batch of @ept,
+ * holding its buffer until the batch is delivered. Consumes the caller's
+ * reference to @ept.
+ */
+static void rpmsg_rx_batch(struct rpmsg_queue_pair *qp,
+			struct rpmsg_endpoint *ept, struct rpmsg_hdr *msg)
+{
+	struct rpmsg_rx_msg *m;
+
+	if (qp->rx_batch_ept != ept || qp->rx_batch_num == RPMSG_RX_BATCH)
+		rpmsg_rx_batch_flush(qp);
+
+	/* a batch holds a single reference to its endpoint */
+	if (qp->rx_batch_ept)
+		kref_put(&ept->refcount, __ept_release);
+	else
+		qp->rx_batch_ept = ept;
+
+	rpmsg_rx_account(qp, ept, msg);
+
+	m = &qp->rx_batch[qp->rx_batch_num++];
+	m->data = msg->data;
+	m->len = msg->len;
+	m->src = msg->src;
+
+	qp->rx_cur_held = true;
+}
+
+/*
+ * Hand the inbound msg of an endpoint with its own rx context over to it,
+ * holding its rx buffer meanwhile, under the same conditions as
+ * rpmsg_rx_defer(): otherwise, false is returned, and the msg is to be
+ * delivered right away.
+ *
+ * Must be called under rcu_read_lock(), by the owner of the rx virtqueue.
+ */
+static bool rpmsg_ept_rx_defer(struct rpmsg_queue_pair *qp,
+			struct rpmsg_ept_rx *rx, struct rpmsg_hdr *msg)
+{
+	unsigned int ref;
+
+	if (qp->rx_cur != msg || rpmsg_rx_buf_qp(qp->vrp, msg) != qp)
+		return false;
+
+	ref = rpmsg_buf_idx(qp->vrp, qp->rbufs, qp->num_rbufs, msg) *
+			RPMSG_MAX_QUEUE_PAIRS + (qp - qp->vrp->qps);
+
+	if (!atomic_add_unless(&qp->rx_held, 1,
+				qp->num_rbufs / RPMSG_RX_HOLD_RATIO))
+		return false;
+
+	/* several rx virtqueues may feed the same endpoint */
+	if (!kfifo_in_spinlocked(&rx->fifo, &ref, 1, &rx->fifo_lock)) {
+		atomic_dec(&qp->rx_held);
+		return false;
+	}
+
+	qp->rx_cur_held = true;
+
+	if (rx->cpu >= 0)
+		queue_work_on(rx->cpu, system_wq, &rx->work);
+	else
+		queue_work(rx->wq, &rx->work);
+
+	return true;
+}
+
+/* deliver the deferred msgs of an endpoint with its own rx context, in order */
+static void rpmsg_ept_rx_flush(struct rpmsg_ept_rx *rx)
+{
+	struct rpmsg_endpoint *ept = rx->ept;
+	struct rpmsg_queue_pair *qp;
+	struct rpmsg_hdr *msg;
+	unsigned int ref;
+
+	mutex_lock(&rx->lock);
+
+	while (kfifo_get(&rx->fifo, &ref)) {
+		qp = &rx->vrp->qps[ref % RPMSG_MAX_QUEUE_PAIRS];
+		msg = rpmsg_buf_at(rx->vrp, qp->rbufs,
+					ref / RPMSG_MAX_QUEUE_PAIRS);
+		rx->cur = msg;
+		rx->cur_held = false;
+
+		/* make sure ept->cb doesn't go away while we use it */
+		mutex_lock(&ept->cb_lock);
+
+		if (ept->cb || ept->batch_cb) {
+			rpmsg_rx_account(qp, ept, msg);
+			rpmsg_ept_cb(ept, msg);
+		}
+
+		mutex_unlock(&ept->cb_lock);
+
+		rx->cur = NULL;
+
+		/* the buffer was held on the msg's behalf until now */
+		if (!rx->cur_held)
+			rpmsg_rx_release(qp, msg);
+	}
+
+	mutex_unlock(&rx->lock);
+}
+
+static void rpmsg_ept_rx_work(struct work_struct *work)
+{
+	struct rpmsg_ept_rx *rx = container_of(work, struct rpmsg_ept_rx,
+									work);
+
+	rpmsg_ept_rx_flush(rx);
+}
+
+/*
+ * stop the deferred deliveries of an endpoint that is being destroyed (its
+ * callback is gone already), and give the buffers they held back
+ */
+static void rpmsg_ept_rx_stop(struct rpmsg_ept_rx *rx)
+{
+	cancel_work_sync(&rx->work);
+	rpmsg_ept_rx_flush(rx);
+
+	if (rx->wq)
+		destroy_workqueue(rx->wq);
+}
+
+static void rpmsg_rx_bulk_flush(struct rpmsg_queue_pair *qp);
+
+/*
+ * Hand an inbound message over to its endpoint.
+ *
+ * Endpoints are looked up locklessly, under RCU. Atomic callbacks are then
+ * invoked right away, while regular ones are invoked under the endpoint's
+ * cb_lock, which requires a sleepable context: if @can_sleep is false,
+ * such messages are left untouched and -EAGAIN is returned.
+ *
+ * Messages of low priority endpoints are deferred to the bulk work (see
+ * rpmsg_rx_defer()), if possible; otherwise, the bulk work is flushed
+ * first, so they're still delivered in order. The same goes for endpoints
+ * with their own rx context (see rpmsg_ept_rx_defer()).
+ *
+ * Consecutive messages of a batch endpoint are batched up, and handed over
+ * to it all at once by the owner of the rx virtqueue, before it delivers
+ * any other message (see rpmsg_rx_batch()).
+ */
+static int rpmsg_dispatch(struct rpmsg_queue_pair *qp, struct device *dev,
+					struct rpmsg_hdr *msg, bool can_sleep)
+{
+	struct virtproc_info *vrp = qp->vrp;
+	struct rpmsg_endpoint *ept;
+	struct rpmsg_ept_rx *rx;
+	bool bulk = false;
+	rpmsg_rx_cb_t cb;
+
+	/* msgs batched up for another endpoint (or before a chain) go first */
+	if (qp->rx_cur == msg && qp->rx_batch_ept &&
+			(qp->rx_batch_ept->addr != msg->dst ||
+			 rpmsg_rx_buf_qp(vrp, msg) != qp))
+		rpmsg_rx_batch_flush(qp);
+
+	/* use the dst addr to fetch the callback of the appropriate user */
+	rcu_read_lock();
+
+	ept = idr_find(&vrp->endpoints, msg->dst);
+	rx = ept ? ACCESS_ONCE(ept->rx) : NULL;
+
+	/* keep the host responsive while this endpoint is busy */
+	if (ept && ept->qos_latency != PM_QOS_DEFAULT_VALUE)
+		rpmsg_qos_touch(vrp);
+
+	/* endpoints with their own rx context take it from here */
+	if (rx && rpmsg_ept_rx_defer(qp, rx, msg)) {
+		rcu_read_unlock();
+		return 0;
+	}
+
+	/* keep bulk traffic out of the way of the others (batches aside) */
+	if (ept && !ept->atomic && !ept->batch_cb && qp->rx_cur == msg &&
+					ept->rx_prio == RPMSG_RX_PRIO_LOW) {
+		if (rpmsg_rx_defer(qp, msg)) {
+			rcu_read_unlock();
+			return 0;
+		}
+		bulk = true;
+	}
+
+	if (ept && ept->atomic) {
+		rpmsg_rx_account(qp, ept, msg);
+
+		cb = ACCESS_ONCE(ept->cb);
+		if (cb)
+			cb(ept->rpdev, msg->data, msg->len, ept->priv,
+				msg->src);
+
+		rcu_read_unlock();
+		return 0;
+	}
+
+	if (ept && !can_sleep) {
+		rcu_read_unlock();
+		return -EAGAIN;
+	}
+
+	/*
+	 * let's make sure no one deallocates ept while we use it (and
+	 * skip it if it's already on its way out)
+	 */
+	if (ept && !atomic_inc_not_zero(&ept->refcount.refcount))
+		ept = NULL;
+
+	rcu_read_unlock();
+
+	/* batch the regular rx buffers of batch endpoints up */
+	if (ept && ept->batch_cb && qp->rx_cur == msg &&
+					rpmsg_rx_buf_qp(vrp, msg) == qp) {
+		rpmsg_rx_batch(qp, ept, msg);
+		return 0;
+	}
+
+	/* deferred msgs of low priority endpoints go first */
+	if (bulk)
+		rpmsg_rx_bulk_flush(qp);
+
+	if (ept) {
+		/* and so do those of the endpoint itself */
+		if (rx)
+			rpmsg_ept_rx_flush(rx);
+
+		rpmsg_rx_account(qp, ept, msg);
+
+		/* make sure ept->cb doesn't go away while we use it */
+		mutex_lock(&ept->cb_lock);
+		rpmsg_ept_cb(ept, msg);
+		mutex_unlock(&ept->cb_lock);
+
+		/* farewell, ept, we don't need you anymore */
+		kref_put(&ept->refcount, __ept_release);
+	} else {
+		this_cpu_inc(vrp->stats->rx_drops);
+		dev_warn(dev, "msg received with no recepient\n");
+	}
+
+	return 0;
+}
+
+/* digest a single inbound message, and hand it over to its endpoint */
+static int rpmsg_recv_single(struct rpmsg_queue_pair *qp, struct device *dev,
+				struct rpmsg_hdr *msg, unsigned int len,
+				unsigned int size, bool can_sleep)
+{
+	struct virtproc_info *vrp = qp->vrp;
+
+	trace_rpmsg_rx(dev, msg->src, msg->dst, msg->len,
+				virtqueue_get_queue_index(qp->rvq));
+
+	/*
+	 * We use fixed-sized buffers (of @size bytes), so trivially sanitize
+	 * the reported payload length.
+	 */
+	if (len > size ||
+		msg->len > (len - sizeof(struct rpmsg_hdr))) {
+		this_cpu_inc(vrp->stats->rx_drops);
+		dev_warn(dev, "inbound msg too big: (%d, %d)\n", len, msg->len);
+		return 0;
+	}
+
+	return rpmsg_dispatch(qp, dev, msg, can_sleep);
+}
+
+/* is this rx virtqueue token a chain of pages, or a regular rx buffer ? */
+static struct rpmsg_rx_chain *rpmsg_rx_chain(struct rpmsg_queue_pair *qp,
+								void *buf)
+{
+	struct rpmsg_rx_chain *chain = buf;
+
+	if (chain >= qp->rx_chains &&
+			chain < qp->rx_chains + qp->num_rx_chains)
+		return chain;
+
+	return NULL;
+}
+
+/* the device the buffers are mapped for, if they're mapped at all */
+static struct device *rpmsg_dma_dev(struct virtproc_info *vrp)
+{
+	return vrp->dma_dev;
+}
+
+/*
+ * A chain was used by the remote processor: sync the pages it wrote, and
+ * reassemble the msg if it spans more than the first one.
+ */
+static void rpmsg_rx_chain_msg(struct rpmsg_queue_pair *qp,
+				struct rpmsg_rx_chain *chain, unsigned int len)
+{
+	struct device *dev = rpmsg_dma_dev(qp->vrp);
+	int i, num = DIV_ROUND_UP(min_t(unsigned int, len,
+					RPMSG_RX_CHAIN_SIZE), PAGE_SIZE);
+
+	for (i = 0; dev && i < num; i++)
+		dma_sync_single_for_cpu(dev, chain->dma[i], PAGE_SIZE,
+							DMA_FROM_DEVICE);
+
+	if (len <= PAGE_SIZE) {
+		chain->msg = sg_virt(&chain->sg[0]);
+		return;
+	}
+
+	sg_copy_to_buffer(chain->sg, num, qp->rx_bounce, RPMSG_RX_CHAIN_SIZE);
+	chain->msg = qp->rx_bounce;
+}
+
+/* number of chains of @qp that keep their pages, no matter what */
+static int rpmsg_rx_chains_reserve(struct rpmsg_queue_pair *qp)
+{
+	return min_t(int, max(rx_chains_min, 1U), qp->num_rx_chains);
+}
+
+/* free the pages of a chain (if it has any), which makes it a spare one */
+static void rpmsg_drain_rx_chain(struct rpmsg_queue_pair *qp,
+					struct rpmsg_rx_chain *chain)
+{
+	struct device *dev = rpmsg_dma_dev(qp->vrp);
+	int i;
+
+	if (!sg_page(&chain->sg[0]))
+		return;
+
+	for (i = 0; i < RPMSG_RX_CHAIN_PAGES; i++) {
+		if (dev)
+			dma_unmap_page(dev, chain->dma[i], PAGE_SIZE,
+							DMA_FROM_DEVICE);
+		__free_page(sg_page(&chain->sg[i]));
+	}
+
+	sg_init_table(chain->sg, RPMSG_RX_CHAIN_PAGES);
+
+	atomic_dec(&qp->rx_chains_live);
+	rproc_vdev_account_bufs(qp->vrp->vdev,
+				-(long)RPMSG_RX_CHAIN_PAGES * PAGE_SIZE);
+}
+
+/* give a spare chain its pages, one by one */
+static int rpmsg_fill_rx_chain(struct rpmsg_queue_pair *qp,
+				struct rpmsg_rx_chain *chain, gfp_t gfp)
+{
+	struct device *dev = rpmsg_dma_dev(qp->vrp);
+	struct page *page;
+	int i;
+
+	for (i = 0; i < RPMSG_RX_CHAIN_PAGES; i++) {
+		page = alloc_page(gfp);
+		if (!page)
+			goto unwind;
+
+		chain->dma[i] = dev ? dma_map_page(dev, page, 0, PAGE_SIZE,
+					DMA_FROM_DEVICE) : page_to_phys(page);
+		if (dev && dma_mapping_error(dev, chain->dma[i])) {
+			__free_page(page);
+			goto unwind;
+		}
+
+		sg_set_page(&chain->sg[i], page, PAGE_SIZE, 0);
+	}
+
+	atomic_inc(&qp->rx_chains_live);
+	rproc_vdev_account_bufs(qp->vrp->vdev,
+				(long)RPMSG_RX_CHAIN_PAGES * PAGE_SIZE);
+
+	return 0;
+
+unwind:
+	while (--i >= 0) {
+		if (dev)
+			dma_unmap_page(dev, chain->dma[i], PAGE_SIZE,
+							DMA_FROM_DEVICE);
+		__free_page(sg_page(&chain->sg[i]));
+	}
+	sg_init_table(chain->sg, RPMSG_RX_CHAIN_PAGES);
+
+	return -ENOMEM;
+}
+
+/*
+ * A consumed chain is let go of, instead of being given back, if the
+ * shrinker asked for it and we still have more than the reserve.
+ */
+static bool rpmsg_trim_rx_chain(struct rpmsg_queue_pair *qp,
+					struct rpmsg_rx_chain *chain)
+{
+	if (!atomic_read(&qp->rx_chains_trim))
+		return false;
+
+	if (atomic_read(&qp->rx_chains_live) <=
+					rpmsg_rx_chains_reserve(qp)) {
+		atomic_set(&qp->rx_chains_trim, 0);
+		return false;
+	}
+
+	if (!atomic_add_unless(&qp->rx_chains_trim, -1, 0))
+		return false;
+
+	rpmsg_drain_rx_chain(qp, chain);
+	llist_add(&chain->node, &qp->rx_chains_spare);
+
+	return true;
+}
+
+/* give a consumed chain back to the remote processor */
+static void rpmsg_recycle_rx_chain(struct rpmsg_queue_pair *qp,
+			struct device *dev, struct rpmsg_rx_chain *chain)
+{
+	struct device *dma_dev = rpmsg_dma_dev(qp->vrp);
+	int i, err;
+
+	if (rpmsg_trim_rx_chain(qp, chain))
+		return;
+
+	for (i = 0; dma_dev && i < RPMSG_RX_CHAIN_PAGES; i++)
+		dma_sync_single_for_device(dma_dev, chain->dma[i], PAGE_SIZE,
+							DMA_FROM_DEVICE);
+
+	err = virtqueue_add_buf(qp->rvq, chain->sg, 0, RPMSG_RX_CHAIN_PAGES,
+							chain, GFP_ATOMIC);
+	if (err < 0)
+		dev_err(dev, "failed to add an rx chain: %d\n", err);
+	else
+		qp->rx_chains_posted++;
+}
+
+/* give a consumed rx buffer (or chain) back to the remote processor */
+static void rpmsg_recycle_rx_buf(struct rpmsg_queue_pair *qp,
+				struct device *dev, void *buf)
+{
+	struct rpmsg_rx_chain *chain = rpmsg_rx_chain(qp, buf);
+	struct rpmsg_hdr *msg = buf;
+	struct scatterlist sg;
+	int err;
+
+	if (chain) {
+		rpmsg_recycle_rx_chain(qp, dev, chain);
+		return;
+	}
+
+	atomic_dec(&qp->rx_out);
+
+	/* publish the real size of the buffer */
+	sg_init_one(&sg, msg, qp->vrp->buf_size);
+	rpmsg_sync_buf_for_device(qp->vrp, msg, qp->vrp->buf_size,
+							DMA_FROM_DEVICE);
+
+	/* a single entry never needs an indirect descriptor allocation */
+	err = virtqueue_add_buf(qp->rvq, &sg, 0, 1, msg, GFP_ATOMIC);
+	if (err < 0)
+		dev_err(dev, "failed to add a virtqueue buffer: %d\n", err);
+}
+
+/* give back the held rx buffers that were released in the meantime */
+static int rpmsg_recycle_released(struct rpmsg_queue_pair *qp,
+							struct device *dev)
+{
+	struct llist_node *node = llist_del_all(&qp->rx_released);
+	int recycled = 0;
+
+	while (node) {
+		void *buf = node;
+
+		/* the buffer is about to be overwritten */
+		node = node->next;
+
+		rpmsg_recycle_rx_buf(qp, dev, buf);
+		recycled++;
+	}
+
+	return recycled;
+}
+
+/* tell the remote processor which of its tx vrings it should hold off */
+static void rpmsg_rx_fc_publish(struct rpmsg_queue_pair *qp)
+{
+	struct virtproc_info *vrp = qp->vrp;
+	unsigned long flags;
+	u32 mask = 0;
+	int i;
+
+	spin_lock_irqsave(&vrp->rx_fc_lock, flags);
+
+	for (i = 0; i < vrp->num_qps; i++)
+		if (test_bit(RPMSG_RX_THROTTLED, &vrp->qps[i].rx_state))
+			mask |= BIT(i);
+
+	vrp->vdev->config->set(vrp->vdev,
+			offsetof(struct virtio_rpmsg_config, rx_throttle),
+			&mask, sizeof(mask));
+
+	spin_unlock_irqrestore(&vrp->rx_fc_lock, flags);
+
+	/* the remote processor looks at rx_throttle when it's kicked */
+	virtqueue_notify(qp->rvq);
+}
+
+/*
+ * throttle the remote processor if it's running out of rx buffers to fill,
+ * or let it resume once enough of them are back. Must be called by the
+ * owner of the rx virtqueue.
+ */
+static void rpmsg_rx_fc_update(struct rpmsg_queue_pair *qp)
+{
+	unsigned int free = qp->num_rbufs - atomic_read(&qp->rx_out);
+	unsigned int high = max(rx_throttle_high, rx_throttle_low);
+
+	if (!qp->vrp->rx_fc)
+		return;
+
+	if (free * 100 < qp->num_rbufs * rx_throttle_low) {
+		if (test_and_set_bit(RPMSG_RX_THROTTLED, &qp->rx_state))
+			return;
+		this_cpu_inc(qp->vrp->stats->rx_throttles);
+		dev_dbg(&qp->vrp->vdev->dev, "throttling %s: %u rx bufs left\n",
+							qp->rvq->name, free);
+	} else if (free * 100 >= qp->num_rbufs * high) {
+		if (!test_and_clear_bit(RPMSG_RX_THROTTLED, &qp->rx_state))
+			return;
+		dev_dbg(&qp->vrp->vdev->dev, "unthrottling %s\n",
+							qp->rvq->name);
+	} else {
+		return;
+	}
+
+	rpmsg_rx_fc_publish(qp);
+}
+
+/*
+ * Deliver the inbound msg of an rx buffer (or chain), and tell whether the
+ * buffer can be given back right away (i.e. its endpoint didn't hold it).
+ */
+static int rpmsg_rx_deliver(struct rpmsg_queue_pair *qp, struct device *dev,
+			void *buf, unsigned int len, bool can_sleep,
+			bool *held)
+{
+	struct rpmsg_rx_chain *chain = rpmsg_rx_chain(qp, buf);
+	struct rpmsg_hdr *msg = chain ? chain->msg : buf;
+	unsigned int size = chain ? RPMSG_RX_CHAIN_SIZE : qp->vrp->buf_size;
+	int err;
+
+	qp->rx_cur = msg;
+	qp->rx_cur_held = false;
+
+	if (len)
+		err = rpmsg_recv_single(qp, dev, msg, len, size, can_sleep);
+	else
+		err = rpmsg_dispatch(qp, dev, msg, can_sleep);
+
+	qp->rx_cur = NULL;
+	*held = qp->rx_cur_held;
+
+	return err;
+}
+
+/*
+ * Drain the rx virtqueue, NAPI-style.
+ *
+ * The caller must own the rx virtqueue (i.e. have set RPMSG_RX_POLLING),
+ * and have its callbacks disabled, so a burst of inbound messages costs a
+ * single interrupt. Consumed buffers are given back to the remote
+ * processor in bulk, with a single kick. @recycled is the number of
+ * buffers the caller already gave back, but didn't kick for yet.
+ *
+ * At most RPMSG_RX_BUDGET messages are processed per run; if there's more
+ * pending, or if a message needs a sleepable context we can't provide,
+ * ownership of the rx virtqueue is passed over to the rx work.
+ *
+ * Buffers that endpoints held (see rpmsg_hold_rx_buf()) are only given back
+ * once they're released, by whoever owns the rx virtqueue at that point.
+ */
+static void rpmsg_rx_poll(struct rpmsg_queue_pair *qp, int recycled,
+							bool can_sleep)
+{
+	struct virtqueue *rvq = qp->rvq;
+	struct device *dev = &rvq->vdev->dev;
+	struct rpmsg_rx_chain *chain;
+	unsigned int len;
+	int received = 0;
+	bool held;
+	void *buf;
+
+again:
+	recycled += rpmsg_recycle_released(qp, dev);
+
+	while (received < RPMSG_RX_BUDGET) {
+		buf = virtqueue_get_buf(rvq, &len);
+		if (!buf)
+			break;
+
+		chain = rpmsg_rx_chain(qp, buf);
+		if (chain) {
+			rpmsg_rx_chain_msg(qp, chain, len);
+
+			/* the remote processor could use some more of them */
+			if (!--qp->rx_chains_posted &&
+					!atomic_read(&qp->rx_chains_trim) &&
+					!llist_empty(&qp->rx_chains_spare) &&
+					!test_bit(RPMSG_RX_NO_GROW,
+							&qp->rx_state))
+				schedule_work(&qp->rx_grow_work);
+		} else {
+			atomic_inc(&qp->rx_out);
+			rpmsg_sync_buf_for_cpu(qp->vrp, buf, qp->vrp->buf_size,
+							DMA_FROM_DEVICE);
+		}
+
+		if (rpmsg_rx_deliver(qp, dev, buf, len, can_sleep, &held)) {
+			/* this one must wait for the rx work */
+			qp->rx_deferred = buf;
+			goto defer;
+		}
+
+		received++;
+		if (held)
+			continue;
+
+		rpmsg_recycle_rx_buf(qp, dev, buf);
+		recycled++;
+	}
+
+	/* what was batched up in this pass is delivered before we move on */
+	if (qp->rx_batch_ept) {
+		rpmsg_rx_batch_flush(qp);
+		recycled += rpmsg_recycle_released(qp, dev);
+	}
+
+	rpmsg_rx_fc_update(qp);
+
+	/* budget exhausted: let others run, and keep on polling later */
+	if (received >= RPMSG_RX_BUDGET)
+		goto defer;
+
+	/* tell the remote processor we added more available rx buffers */
+	if (recycled) {
+		virtqueue_kick(rvq);
+		recycled = 0;
+	}
+
+	/*
+	 * Release the rx virtqueue and re-enable its callbacks. If a buffer
+	 * was used (or a held one released) in the meantime, and no one else
+	 * grabbed the rx virtqueue, we must take care of it ourselves (or
+	 * we'd miss the signal).
+	 */
+	clear_bit(RPMSG_RX_POLLING, &qp->rx_state);
+	smp_mb__after_clear_bit();
+
+	if ((!virtqueue_enable_cb(rvq) || !llist_empty(&qp->rx_released)) &&
+			!test_and_set_bit(RPMSG_RX_POLLING, &qp->rx_state)) {
+		virtqueue_disable_cb(rvq);
+		goto again;
+	}
+
+	return;
+
+defer:
+	rpmsg_rx_fc_update(qp);
+	if (recycled)
+		virtqueue_kick(rvq);
+	queue_work(qp->vrp->rx_wq, &qp->rx_work);
+}
+
+/* deliver the deferred msgs of low priority endpoints, in order */
+static void rpmsg_rx_bulk_flush(struct rpmsg_queue_pair *qp)
+{
+	struct device *dev = &qp->vrp->vdev->dev;
+	struct rpmsg_hdr *msg;
+	unsigned int idx;
+
+	mutex_lock(&qp->rx_bulk_lock);
+
+	while (kfifo_get(&qp->rx_bulk, &idx)) {
+		msg = rpmsg_buf_at(qp->vrp, qp->rbufs, idx);
+		qp->rx_bulk_cur = msg;
+		qp->rx_bulk_cur_held = false;
+
+		rpmsg_dispatch(qp, dev, msg, true);
+
+		qp->rx_bulk_cur = NULL;
+
+		/* the buffer was held on the msg's behalf until now */
+		if (!qp->rx_bulk_cur_held)
+			rpmsg_rx_release(qp, msg);
+	}
+
+	mutex_unlock(&qp->rx_bulk_lock);
+}
+
+static void rpmsg_rx_bulk_work(struct work_struct *work)
+{
+	struct rpmsg_queue_pair *qp = container_of(work,
+					struct rpmsg_queue_pair, rx_bulk_work);
+
+	rpmsg_rx_bulk_flush(qp);
+}
+
+static void rpmsg_rx_work(struct work_struct *work)
+{
+	struct rpmsg_queue_pair *qp = container_of(work,
+					struct rpmsg_queue_pair, rx_work);
+	struct device *dev = &qp->vrp->vdev->dev;
+	void *buf = qp->rx_deferred;
+	int recycled = 0;
+	bool held;
+
+	rpmsg_rx_stall(qp);
+
+	/* first deliver the msg the rx callback couldn't handle, if any */
+	if (buf) {
+		qp->rx_deferred = NULL;
+		rpmsg_rx_deliver(qp, dev, buf, 0, true, &held);
+		if (!held) {
+			rpmsg_recycle_rx_buf(qp, dev, buf);
+			recycled++;
+		}
+	}
+
+	rpmsg_rx_poll(qp, recycled, true);
+}
+
+/*
+ * Called when an rx buffer is used, and it's time to digest a message.
+ *
+ * Unless someone is already polling the rx virtqueue, mute further rx
+ * callbacks and start draining it right here: atomic endpoints are served
+ * immediately, and as soon as a regular endpoint is hit, the rest is
+ * deferred to the rx work.
+ */
+static void rpmsg_recv_done(struct virtqueue *rvq)
+{
+	struct virtproc_info *vrp = rvq->vdev->priv;
+	struct rpmsg_queue_pair *qp;
+
+	/* rx and tx virtqueues are interleaved */
+	qp = &vrp->qps[virtqueue_get_queue_index(rvq) / 2];
+
+	qp->rx_stamp = local_clock();
+
+	/* the current owner of the rx virtqueue will pick this up */
+	if (test_and_set_bit(RPMSG_RX_POLLING, &qp->rx_state))
+		return;
+
+	virtqueue_disable_cb(rvq);
+
+	/* the rx work owns the rx virtqueue until the stall is over */
+	if (rpmsg_should_stall_rx(qp)) {
+		queue_work(vrp->rx_wq, &qp->rx_work);
+		return;
+	}
+
+	rpmsg_rx_poll(qp, 0, false);
+}
+
+/*
+ * This is invoked whenever the remote processor completed processing
+ * a TX msg we just sent it, and the buffer is put back to the used ring.
+ *
+ * Normally, though, we suppress this "tx complete" interrupt in order to
+ * avoid the incurred overhead, unless asynchronous messages are in flight.
+ */
+static void rpmsg_xmit_done(struct virtqueue *svq)
+{
+	struct virtproc_info *vrp = svq->vdev->priv;
+	unsigned long flags;
+
+	dev_dbg(&svq->vdev->dev, "%s\n", __func__);
+
+	/*
+	 * report the completion of asynchronous messages right away, and
+	 * keep being interrupted as long as some are still in flight
+	 */
+	spin_lock_irqsave(&vrp->tx_lock, flags);
+	if (vrp->tx_pending) {
+		do {
+			rpmsg_reclaim_tx_bufs(vrp);
+		} while (vrp->tx_pending && !vrp->frozen &&
+					!virtqueue_enable_cb_delayed(svq));
+	}
+	spin_unlock_irqrestore(&vrp->tx_lock, flags);
+
+	rpmsg_complete_tx(vrp);
+
+	/* wake up potential senders that are waiting for a tx buffer */
+	rpmsg_wake_senders(vrp);
+}
+
+/* register a channel announced by the name service, and probe its driver */
+static void rpmsg_probe_work(struct work_struct *work)
+{
+	struct rpmsg_probe_work *pw = container_of(work,
+					struct rpmsg_probe_work, work);
+
+	if (!rpmsg_create_channel(pw->vrp, &pw->chinfo))
+		dev_err(&pw->vrp->vdev->dev, "rpmsg_create_channel failed\n");
+
+	kfree(pw);
+}
+
+/*
+ * create or destroy the channel a single name service record is about.
+ *
+ * New channels are registered on the probe workqueue, so (possibly slow)
+ * driver probes run in parallel. Before a channel is destroyed, all
+ * pending registrations are waited for, so a channel announced and then
+ * removed is really gone.
+ */
+static void rpmsg_ns_handle(struct virtproc_info *vrp, struct rpmsg_ns_msg *msg)
+{
+	struct rpmsg_channel_info chinfo;
+	struct device *dev = &vrp->vdev->dev;
+	struct rpmsg_probe_work *pw;
+	int ret;
+
+	trace_rpmsg_ns(dev, msg->name, msg->addr, msg->flags);
+
+	dev_info(dev, "%sing channel %s addr 0x%x\n",
+			msg->flags & RPMSG_NS_DESTROY ? "destroy" : "creat",
+			msg->name, msg->addr);
+
+	strncpy(chinfo.name, msg->name, sizeof(chinfo.name));
+	chinfo.src = RPMSG_ADDR_ANY;
+	chinfo.dst = msg->addr;
+
+	if (msg->flags & RPMSG_NS_DESTROY) {
+		flush_workqueue(vrp->probe_wq);
+
+		ret = rpmsg_destroy_channel(vrp, &chinfo);
+		if (ret)
+			dev_err(dev, "rpmsg_destroy_channel failed: %d\n", ret);
+		return;
+	}
+
+	pw = kmalloc(sizeof(*pw), GFP_KERNEL);
+	if (!pw) {
+		/* no memory to defer it: just register the channel right away */
+		if (!rpmsg_create_channel(vrp, &chinfo))
+			dev_err(dev, "rpmsg_create_channel failed\n");
+		return;
+	}
+
+	INIT_WORK(&pw->work, rpmsg_probe_work);
+	pw->vrp = vrp;
+	pw->chinfo = chinfo;
+
+	queue_work(vrp->probe_wq, &pw->work);
+}
+
+/* process the pending name service records, in order */
+static void rpmsg_ns_work(struct work_struct *work)
+{
+	struct virtproc_info *vrp = container_of(work, struct virtproc_info,
+								ns_work);
+	struct rpmsg_ns_record *rec;
+
+	for (;;) {
+		rec = NULL;
+
+		spin_lock(&vrp->ns_lock);
+		if (!list_empty(&vrp->ns_pending)) {
+			rec = list_first_entry(&vrp->ns_pending,
+					struct rpmsg_ns_record, node);
+			list_del(&rec->node);
+		}
+		spin_unlock(&vrp->ns_lock);
+
+		if (!rec)
+			break;
+
+		rpmsg_ns_handle(vrp, &rec->msg);
+		kfree(rec);
+	}
+}
+
+/* queue a single name service record, to be processed by the ns work */
+static void rpmsg_ns_queue(struct virtproc_info *vrp, struct rpmsg_ns_msg *msg)
+{
+	struct rpmsg_ns_record *rec;
+
+	rec = kmalloc(sizeof(*rec), GFP_KERNEL);
+	if (!rec) {
+		dev_err(&vrp->vdev->dev, "dropping ns record of %.*s\n",
+						RPMSG_NAME_SIZE, msg->name);
+		return;
+	}
+
+	rec->msg = *msg;
+
+	/* don't trust the remote processor for null terminating the name */
+	rec->msg.name[RPMSG_NAME_SIZE - 1] = '\0';
+
+	spin_lock(&vrp->ns_lock);
+	list_add_tail(&rec->node, &vrp->ns_pending);
+	spin_unlock(&vrp->ns_lock);
+}
+
+/*
+ * invoked when a heartbeat arrives. there's nothing to do: the remote
+ * processor proved it's alive by interrupting us with it, which already
+ * pushed its watchdog deadline back (see rproc_watchdog_pet()). the
+ * heartbeats are only there to keep it going when there's no other traffic.
+ */
+static void rpmsg_hb_cb(struct rpmsg_channel *rpdev, void *data, int len,
+							void *priv, u32 src)
+{
+	struct virtproc_info *vrp = priv;
+
+	dev_dbg(&vrp->vdev->dev, "heartbeat from 0x%x\n", src);
+}
+
+/* invoked when a name service announcement arrives */
+static void rpmsg_ns_cb(struct rpmsg_channel *rpdev, void *data, int len,
+							void *priv, u32 src)
+{
+	struct rpmsg_ns_bulk_msg *bulk = data;
+	struct virtproc_info *vrp = priv;
+	struct device *dev = &vrp->vdev->dev;
+	int i;
+
+	/*
+	 * the name service ept does _not_ belong to a real rpmsg channel,
+	 * and is handled by the rpmsg bus itself.
+	 * for sanity reasons, make sure a valid rpdev has _not_ sneaked
+	 * in somehow.
+	 */
+	if (rpdev) {
+		dev_err(dev, "anomaly: ns ept has an rpdev handle\n");
+		return;
+	}
+
+	if (len == sizeof(struct rpmsg_ns_msg)) {
+		rpmsg_ns_queue(vrp, data);
+		queue_work(vrp->ns_wq, &vrp->ns_work);
+		return;
+	}
+
+	/* anything else must be a bulk announcement */
+	if (!virtio_has_feature(vrp->vdev, VIRTIO_RPMSG_F_NS_BULK) ||
+			len < sizeof(*bulk) ||
+			bulk->num > (len - sizeof(*bulk)) / sizeof(bulk->recs[0]) ||
+			len != sizeof(*bulk) + bulk->num * sizeof(bulk->recs[0])) {
+		dev_err(dev, "malformed ns msg (%d)\n", len);
+		return;
+	}
+
+	for (i = 0; i < bulk->num; i++)
+		rpmsg_ns_queue(vrp, &bulk->recs[i]);
+
+	queue_work(vrp->ns_wq, &vrp->ns_work);
+}
+
+/* hand the tx half of the buffer space to a variable-size allocator */
+static int rpmsg_init_tx_pool(struct virtproc_info *vrp)
+{
+	struct device *dev = &vrp->vdev->dev;
+	dma_addr_t sbufs_dma = vrp->bufs_dma + (vrp->sbufs - vrp->rbufs);
+	size_t pool_size = (size_t)vrp->num_sbufs * vrp->buf_stride;
+	int err;
+
+	vrp->tx_sizes = kcalloc(pool_size >> RPMSG_TXBUF_ORDER,
+					sizeof(*vrp->tx_sizes), GFP_KERNEL);
+	if (!vrp->tx_sizes)
+		return -ENOMEM;
+
+	vrp->tx_pool = gen_pool_create(RPMSG_TXBUF_ORDER, -1);
+	if (!vrp->tx_pool) {
+		err = -ENOMEM;
+		goto free_sizes;
+	}
+
+	err = gen_pool_add_virt(vrp->tx_pool, (unsigned long)vrp->sbufs,
+					sbufs_dma, pool_size, -1);
+	if (err) {
+		dev_err(dev, "gen_pool_add_virt failed: %d\n", err);
+		goto destroy_pool;
+	}
+
+	vrp->max_txbuf_size = min_t(size_t, RPMSG_MAX_TXBUF_SIZE,
+				pool_size & ~(RPMSG_TXBUF_GRANULE - 1));
+
+	dev_dbg(dev, "using variable-size tx buffers (up to %u bytes)\n",
+						vrp->max_txbuf_size);
+
+	return 0;
+
+destroy_pool:
+	gen_pool_destroy(vrp->tx_pool);
+	vrp->tx_pool = NULL;
+free_sizes:
+	kfree(vrp->tx_sizes);
+	vrp->tx_sizes = NULL;
+	return err;
+}
+
+/*
+ * reclaim all outstanding tx buffers (both used and still pending ones),
+ * so their endpoints get their credits back. must only be called when
+ * the remote processor is no longer using the tx virtqueues.
+ */
+static void rpmsg_drop_tx_bufs(struct virtproc_info *vrp)
+{
+	void *buf;
+	int i;
+
+	if (vrp->frozen)
+		return;
+
+	rpmsg_reclaim_tx_bufs(vrp);
+
+	for (i = 0; i < vrp->num_qps; i++) {
+		while ((buf = virtqueue_detach_unused_buf(vrp->qps[i].svq))) {
+			/* the remote processor never got to this one */
+			vrp->tx_cbs[rpmsg_tx_slot(vrp, buf)].err = -ECANCELED;
+			__put_a_tx_buf(vrp, buf);
+		}
+	}
+}
+
+/*
+ * reclaim all outstanding tx buffers, and destroy the tx buffers
+ * bookkeeping (and the variable-size allocator). must only be called when
+ * the remote processor is no longer using the tx virtqueues.
+ */
+static void rpmsg_free_tx_bufs(struct virtproc_info *vrp)
+{
+	if (vrp->tx_cbs) {
+		rpmsg_drop_tx_bufs(vrp);
+
+		/* report the last completions before the buffers are gone */
+		cancel_work_sync(&vrp->tx_done_work);
+		cancel_work_sync(&vrp->tx_notify_work);
+		rpmsg_complete_tx(vrp);
+
+		kfree(vrp->tx_cbs);
+		vrp->tx_cbs = NULL;
+	}
+
+	kfree(vrp->tx_owners);
+	vrp->tx_owners = NULL;
+
+	kfree(vrp->tx_stamps);
+	vrp->tx_stamps = NULL;
+
+	free_percpu(vrp->tx_cache);
+	vrp->tx_cache = NULL;
+
+	if (!vrp->tx_pool)
+		return;
+
+	gen_pool_destroy(vrp->tx_pool);
+	vrp->tx_pool = NULL;
+
+	kfree(vrp->tx_sizes);
+	vrp->tx_sizes = NULL;
+}
+
+/*
+ * the buffer space must not be so large that its size, and the offsets
+ * into it, overflow (the remote processor may ask for any number of
+ * buffers, of up to RPMSG_MAX_BUF_SIZE bytes each)
+ */
+static int rpmsg_check_buf_space(struct virtproc_info *vrp)
+{
+	struct device *dev = &vrp->vdev->dev;
+	size_t num = (size_t)vrp->num_rbufs + vrp->num_sbufs;
+
+	if (num > (INT_MAX - PAGE_SIZE) / vrp->buf_stride) {
+		dev_err(dev, "too many buffers: %d rx and %d tx of %u bytes\n",
+			vrp->num_rbufs, vrp->num_sbufs, vrp->buf_stride);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+/*
+ * Lay the buffers out (see align_bufs): the tx buffers come after the rx
+ * ones, at the end of the buffer space.
+ */
+static int rpmsg_config_align(struct virtproc_info *vrp)
+{
+	struct virtio_device *vdev = vrp->vdev;
+	unsigned int align = cache_line_size();
+	size_t rx_space;
+	u32 line = 0;
+
+	vrp->buf_stride = vrp->buf_size;
+	vrp->buf_pad = 0;
+
+	if (!virtio_config_val(vdev, VIRTIO_RPMSG_F_ALIGN,
+			offsetof(struct virtio_rpmsg_config, cache_line_size),
+			&line)) {
+		if (!is_power_of_2(line) || line > PAGE_SIZE) {
+			dev_err(&vdev->dev, "invalid cache line size: %u\n",
+									line);
+			return -EINVAL;
+		}
+		align = max(align, (unsigned int)line);
+	} else if (!align_bufs) {
+		if (rpmsg_check_buf_space(vrp))
+			return -EINVAL;
+		vrp->total_buf_space = ((size_t)vrp->num_rbufs +
+					vrp->num_sbufs) * vrp->buf_size;
+		return 0;
+	}
+
+	/* the header is in the line before the payload, at its very end */
+	vrp->buf_pad = ALIGN(sizeof(struct rpmsg_hdr), align) -
+						sizeof(struct rpmsg_hdr);
+	vrp->buf_stride = ALIGN(vrp->buf_pad + vrp->buf_size, align);
+
+	if (rpmsg_check_buf_space(vrp))
+		return -EINVAL;
+
+	rx_space = PAGE_ALIGN((size_t)vrp->num_rbufs * vrp->buf_stride);
+	vrp->total_buf_space = rx_space +
+				(size_t)vrp->num_sbufs * vrp->buf_stride;
+
+	dev_dbg(&vdev->dev, "buffers aligned to %u bytes, every %u bytes\n",
+						align, vrp->buf_stride);
+
+	return 0;
+}
+
+/*
+ * Decide on the layout of our buffers: the module parameters take
+ * precedence, then the remote processor's requirements (if it provides
+ * them in its config space), and then our own defaults.
+ */
+static int rpmsg_config_bufs(struct virtproc_info *vrp)
+{
+	struct virtio_device *vdev = vrp->vdev;
+	struct virtio_rpmsg_config cfg = { 0 };
+	unsigned int rvq_size, chains = 0;
+	u32 num_rbufs, num_sbufs;
+	int i, per_qp = 0, err;
+
+	virtio_config_val(vdev, VIRTIO_RPMSG_F_BUFCFG,
+			offsetof(struct virtio_rpmsg_config, num_rx_bufs),
+			&cfg.num_rx_bufs);
+	virtio_config_val(vdev, VIRTIO_RPMSG_F_BUFCFG,
+			offsetof(struct virtio_rpmsg_config, num_tx_bufs),
+			&cfg.num_tx_bufs);
+	virtio_config_val(vdev, VIRTIO_RPMSG_F_BUFCFG,
+			offsetof(struct virtio_rpmsg_config, buf_size),
+			&cfg.buf_size);
+
+	/* otherwise, the rx (resp. tx) vrings are filled up */
+	num_rbufs = rx_bufs ? : cfg.num_rx_bufs;
+	num_sbufs = tx_bufs ? : cfg.num_tx_bufs;
+	vrp->buf_size = buf_size ? : cfg.buf_size ? : RPMSG_BUF_SIZE;
+
+	if (num_rbufs > RPMSG_MAX_NUM_BUFS || num_sbufs > RPMSG_MAX_NUM_BUFS) {
+		dev_err(&vdev->dev, "invalid number of buffers: %u rx, %u tx\n",
+							num_rbufs, num_sbufs);
+		return -EINVAL;
+	}
+
+	vrp->num_rbufs = num_rbufs;
+	vrp->num_sbufs = num_sbufs;
+
+	if (!vrp->num_sbufs)
+		for (i = 0; i < vrp->num_qps; i++)
+			vrp->num_sbufs += virtqueue_get_vring_size(
+							vrp->qps[i].svq);
+
+	if (vrp->buf_size <= sizeof(struct rpmsg_hdr) ||
+				vrp->buf_size > RPMSG_MAX_BUF_SIZE) {
+		dev_err(&vdev->dev, "invalid buffer size: %u\n", vrp->buf_size);
+		return -EINVAL;
+	}
+
+	/* big rx buffers only take a descriptor each, if indirect */
+	if (virtio_has_feature(vdev, VIRTIO_RPMSG_F_RX_CHAIN) &&
+			virtio_has_feature(vdev, VIRTIO_RING_F_INDIRECT_DESC))
+		chains = rx_chains;
+
+	/*
+	 * rx buffers asked for are evenly spread over the queue pairs, but
+	 * there's no point in having more rx buffers than a vring can hold
+	 */
+	if (vrp->num_rbufs)
+		per_qp = max(vrp->num_rbufs / vrp->num_qps, 1);
+	vrp->num_rbufs = 0;
+
+	for (i = 0; i < vrp->num_qps; i++) {
+		struct rpmsg_queue_pair *qp = &vrp->qps[i];
+
+		rvq_size = virtqueue_get_vring_size(qp->rvq);
+
+		/* filling a vring up leaves some room for the big buffers */
+		qp->num_rbufs = per_qp ? : rvq_size - min(chains, rvq_size / 2);
+
+		if (qp->num_rbufs > rvq_size) {
+			dev_warn(&vdev->dev, "only %u of %d rx buffers of %s can be used\n",
+					rvq_size, qp->num_rbufs, qp->rvq->name);
+			qp->num_rbufs = rvq_size;
+		}
+
+		vrp->num_rbufs += qp->num_rbufs;
+
+		qp->num_rx_chains = min(chains, rvq_size - qp->num_rbufs);
+	}
+
+	err = rpmsg_config_align(vrp);
+	if (err)
+		return err;
+
+	dev_dbg(&vdev->dev, "%d rx and %d tx buffers of %u bytes, %d queue pairs\n",
+		vrp->num_rbufs, vrp->num_sbufs, vrp->buf_size, vrp->num_qps);
+
+	return 0;
+}
+
+/* how many queue pairs did the remote processor announce ? */
+static int rpmsg_get_num_qps(struct virtio_device *vdev)
+{
+	u32 num_qps;
+
+	if (virtio_config_val(vdev, VIRTIO_RPMSG_F_MQ,
+			offsetof(struct virtio_rpmsg_config, num_queue_pairs),
+			&num_qps) || !num_qps)
+		return 1;
+
+	if (num_qps > RPMSG_MAX_QUEUE_PAIRS) {
+		dev_warn(&vdev->dev, "only %d of %u queue pairs are supported\n",
+					RPMSG_MAX_QUEUE_PAIRS, num_qps);
+		num_qps = RPMSG_MAX_QUEUE_PAIRS;
+	}
+
+	return num_qps;
+}
+
+/* names of our virtqueues, which are interleaved rx and tx ones */
+static const char *rpmsg_vq_names[RPMSG_MAX_QUEUE_PAIRS * 2] = {
+	"input", "output",
+	"input1", "output1",
+	"input2", "output2",
+	"input3", "output3",
+};
+
+/* rpmsg debugfs parent dir */
+static struct dentry *rpmsg_dbg;
+
+/* sum up the per-cpu u64 counter at @offset of @stats, over all cpus */
+static u64 rpmsg_stats_sum(void __percpu *stats, size_t offset)
+{
+	u64 sum = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		sum += *(u64 *)(per_cpu_ptr(stats, cpu) + offset);
+
+	return sum;
+}
+
+#define rpmsg_stat(stats, type, field) \
+	rpmsg_stats_sum(stats, offsetof(type, field))
+
+static void rpmsg_show_lat(struct seq_file *s, void __percpu *stats,
+					const char *name, size_t offset)
+{
+	int i;
+
+	seq_printf(s, "%s latency (nsecs):\n", name);
+
+	for (i = 0; i < RPMSG_LAT_BUCKETS; i++) {
+		u64 count = rpmsg_stats_sum(stats, offset + i * sizeof(u64));
+
+		if (!count)
+			continue;
+
+		if (i == RPMSG_LAT_BUCKETS - 1)
+			seq_printf(s, "  >= %10llu: %llu\n", 1ULL << (i - 1),
+									count);
+		else
+			seq_printf(s, "  <  %10llu: %llu\n", 1ULL << i, count);
+	}
+}
+
+/* expose the traffic counters and latency histograms of a vrp */
+static int rpmsg_stats_show(struct seq_file *s, void *data)
+{
+	struct virtproc_info *vrp = s->private;
+
+#define vrp_stat(field) rpmsg_stat(vrp->stats, struct rpmsg_vrp_stats, field)
+	seq_printf(s, "rx_msgs: %llu\n", vrp_stat(rx_msgs));
+	seq_printf(s, "rx_bytes: %llu\n", vrp_stat(rx_bytes));
+	seq_printf(s, "rx_drops: %llu\n", vrp_stat(rx_drops));
+	seq_printf(s, "tx_msgs: %llu\n", vrp_stat(tx_msgs));
+	seq_printf(s, "tx_bytes: %llu\n", vrp_stat(tx_bytes));
+	seq_printf(s, "tx_waits: %llu\n", vrp_stat(tx_waits));
+	seq_printf(s, "tx_timeouts: %llu\n", vrp_stat(tx_timeouts));
+	seq_printf(s, "rx_throttles: %llu\n", vrp_stat(rx_throttles));
+#undef vrp_stat
+
+	rpmsg_show_lat(s, vrp->stats, "tx",
+			offsetof(struct rpmsg_vrp_stats, tx_lat));
+	rpmsg_show_lat(s, vrp->stats, "rx",
+			offsetof(struct rpmsg_vrp_stats, rx_lat));
+	if (vrp->tstamp_rate)
+		rpmsg_show_lat(s, vrp->stats, "one-way",
+				offsetof(struct rpmsg_vrp_stats, oneway_lat));
+
+	return 0;
+}
+
+static int rpmsg_show_ept(int id, void *p, void *data)
+{
+	struct rpmsg_endpoint *ept = p;
+	struct seq_file *s = data;
+
+#define ept_stat(field) rpmsg_stat(ept->stats, struct rpmsg_ept_stats, field)
+	seq_printf(s, "0x%-8x %-32s %10llu %12llu %10llu %12llu %8llu\n",
+			ept->addr, ept->rpdev ? ept->rpdev->id.name : "-",
+			ept_stat(rx_msgs), ept_stat(rx_bytes),
+			ept_stat(tx_msgs), ept_stat(tx_bytes),
+			ept_stat(tx_waits));
+#undef ept_stat
+
+	return 0;
+}
+
+/* expose the traffic counters of all the endpoints of a vrp */
+static int rpmsg_endpoints_show(struct seq_file *s, void *data)
+{
+	struct virtproc_info *vrp = s->private;
+
+	seq_printf(s, "%-10s %-32s %10s %12s %10s %12s %8s\n", "addr",
+			"channel", "rx_msgs", "rx_bytes", "tx_msgs",
+			"tx_bytes", "tx_waits");
+
+	mutex_lock(&vrp->endpoints_lock);
+	idr_for_each(&vrp->endpoints, rpmsg_show_ept, s);
+	mutex_unlock(&vrp->endpoints_lock);
+
+	return 0;
+}
+
+static int rpmsg_show_ept_lat(int id, void *p, void *data)
+{
+	struct rpmsg_endpoint *ept = p;
+	struct seq_file *s = data;
+
+	seq_printf(s, "0x%x (%s) ", ept->addr,
+			ept->rpdev ? ept->rpdev->id.name : "-");
+	rpmsg_show_lat(s, ept->stats, "one-way",
+			offsetof(struct rpmsg_ept_stats, oneway_lat));
+
+	return 0;
+}
+
+/* expose the one-way latency histograms of all the endpoints of a vrp */
+static int rpmsg_latency_show(struct seq_file *s, void *data)
+{
+	struct virtproc_info *vrp = s->private;
+
+	mutex_lock(&vrp->endpoints_lock);
+	idr_for_each(&vrp->endpoints, rpmsg_show_ept_lat, s);
+	mutex_unlock(&vrp->endpoints_lock);
+
+	return 0;
+}
+
+static int rpmsg_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, rpmsg_stats_show, inode->i_private);
+}
+
+static const struct file_operations rpmsg_stats_ops = {
+	.open = rpmsg_stats_open,
+	.read = seq_read,
+	.llseek	= seq_lseek,
+	.release = single_release,
+};
+
+static int rpmsg_endpoints_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, rpmsg_endpoints_show, inode->i_private);
+}
+
+static const struct file_operations rpmsg_endpoints_ops = {
+	.open = rpmsg_endpoints_open,
+	.read = seq_read,
+	.llseek	= seq_lseek,
+	.release = single_release,
+};
+
+static int rpmsg_latency_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, rpmsg_latency_show, inode->i_private);
+}
+
+static const struct file_operations rpmsg_latency_ops = {
+	.open = rpmsg_latency_open,
+	.read = seq_read,
+	.llseek	= seq_lseek,
+	.release = single_release,
+};
+
+static void rpmsg_create_debug_dir(struct virtproc_info *vrp)
+{
+	if (!rpmsg_dbg)
+		return;
+
+	vrp->dbg_dir = debugfs_create_dir(dev_name(&vrp->vdev->dev),
+								rpmsg_dbg);
+	if (!vrp->dbg_dir)
+		return;
+
+	debugfs_create_file("stats", 0400, vrp->dbg_dir, vrp,
+						&rpmsg_stats_ops);
+	debugfs_create_file("endpoints", 0400, vrp->dbg_dir, vrp,
+						&rpmsg_endpoints_ops);
+	if (vrp->tstamp_rate)
+		debugfs_create_file("latency", 0400, vrp->dbg_dir, vrp,
+						&rpmsg_latency_ops);
+
+	rpmsg_create_fault_attrs(vrp);
+}
+
+/* set up the rx/tx virtqueue pairs (which boots the remote processor) */
+static int rpmsg_find_vqs(struct virtproc_info *vrp)
+{
+	vq_callback_t *vq_cbs[RPMSG_MAX_QUEUE_PAIRS * 2];
+	struct virtqueue *vqs[RPMSG_MAX_QUEUE_PAIRS * 2];
+	struct virtio_device *vdev = vrp->vdev;
+	int err, i;
+
+	for (i = 0; i < vrp->num_qps; i++) {
+		vq_cbs[2 * i] = rpmsg_recv_done;
+		vq_cbs[2 * i + 1] = rpmsg_xmit_done;
+	}
+
+	/* We expect pairs of virtqueues, rx and tx (and in this order) */
+	err = vdev->config->find_vqs(vdev, 2 * vrp->num_qps, vqs, vq_cbs,
+							rpmsg_vq_names);
+	if (err)
+		return err;
+
+	for (i = 0; i < vrp->num_qps; i++) {
+		vrp->qps[i].rvq = vqs[2 * i];
+		vrp->qps[i].svq = vqs[2 * i + 1];
+	}
+
+	return 0;
+}
+
+/*
+ * allocate the (rx and tx) buffer space: coherent memory, unless cacheable
+ * buffers are used (see cached_bufs), in which case it's mapped for
+ * streaming DMA instead, and owned by the remote processor to begin with.
+ * Coherent buffers go in the IPC region of the remote processor, if its
+ * firmware asked for one and they fit.
+ *
+ * Without a dma device (i.e. when the other side is a hypervisor), the
+ * buffers are plain kernel memory, which it sees at its physical address
+ * and keeps coherent on its own, as it does with the vrings.
+ */
+static void *rpmsg_alloc_bufs(struct virtproc_info *vrp)
+{
+	struct device *dev = vrp->dma_dev;
+	size_t size = vrp->total_buf_space;
+	void *va;
+
+	if (!dev) {
+		vrp->cached_bufs = false;
+		va = alloc_pages_exact(size, GFP_KERNEL | __GFP_ZERO);
+		if (va)
+			vrp->bufs_dma = virt_to_phys(va);
+		return va;
+	}
+
+	vrp->cached_bufs = cached_bufs;
+	if (!vrp->cached_bufs) {
+		va = rproc_vdev_alloc_ipc(vrp->vdev, size, &vrp->bufs_dma);
+		vrp->ipc_bufs = !!va;
+		if (!va)
+			va = dma_alloc_coherent(dev, size, &vrp->bufs_dma,
+								GFP_KERNEL);
+		goto out;
+	}
+
+	va = alloc_pages_exact(size, GFP_KERNEL | __GFP_ZERO);
+	if (!va)
+		return NULL;
+
+	vrp->bufs_dma = dma_map_single(dev, va, size, DMA_BIDIRECTIONAL);
+	if (dma_mapping_error(dev, vrp->bufs_dma)) {
+		dev_err(&vrp->vdev->dev, "can't map the buffers\n");
+		free_pages_exact(va, size);
+		return NULL;
+	}
+
+out:
+	/* they're part of what the remote processor pins down */
+	if (va)
+		rproc_vdev_account_bufs(vrp->vdev, size);
+
+	return va;
+}
+
+static void rpmsg_free_bufs(struct virtproc_info *vrp, void *va)
+{
+	struct device *dev = vrp->dma_dev;
+	size_t size = vrp->total_buf_space;
+
+	if (!dev) {
+		free_pages_exact(va, size);
+		return;
+	}
+
+	rproc_vdev_account_bufs(vrp->vdev, -(long)size);
+
+	if (vrp->ipc_bufs) {
+		rproc_vdev_free_ipc(vrp->vdev, va, size);
+		return;
+	}
+
+	if (!vrp->cached_bufs) {
+		dma_free_coherent(dev, size, va, vrp->bufs_dma);
+		return;
+	}
 
-	err = 0;
-out:
-	mutex_unlock(&vrp->tx_lock);
-	return err;
+	dma_unmap_single(dev, vrp->bufs_dma, size, DMA_BIDIRECTIONAL);
+	free_pages_exact(va, size);
 }
-EXPORT_SYMBOL(rpmsg_send_offchannel_raw);
 
-/* called when an rx buffer is used, and it's time to digest a message */
-static void rpmsg_recv_done(struct virtqueue *rvq)
+/*
+ * stop polling the rx virtqueues, and growing their chains (which would
+ * have them polled again)
+ */
+static void rpmsg_stop_rx(struct virtproc_info *vrp)
 {
-	struct rpmsg_hdr *msg;
-	unsigned int len;
-	struct rpmsg_endpoint *ept;
-	struct scatterlist sg;
-	struct virtproc_info *vrp = rvq->vdev->priv;
-	struct device *dev = &rvq->vdev->dev;
-	int err;
+	int i;
 
-	msg = virtqueue_get_buf(rvq, &len);
-	if (!msg) {
-		dev_err(dev, "uhm, incoming signal, but no used buffer ?\n");
-		return;
+	for (i = 0; i < vrp->num_qps; i++) {
+		struct rpmsg_queue_pair *qp = &vrp->qps[i];
+
+		set_bit(RPMSG_RX_NO_GROW, &qp->rx_state);
+		cancel_work_sync(&qp->rx_grow_work);
+		cancel_work_sync(&qp->rx_work);
 	}
+}
 
-	dev_dbg(dev, "From: 0x%x, To: 0x%x, Len: %d, Flags: %d, Reserved: %d\n",
-					msg->src, msg->dst, msg->len,
-					msg->flags, msg->reserved);
-	print_hex_dump(KERN_DEBUG, "rpmsg_virtio RX: ", DUMP_PREFIX_NONE, 16, 1,
-					msg, sizeof(*msg) + msg->len, true);
+/* stop delivering deferred msgs, and free the fifos they're queued on */
+static void rpmsg_free_rx_bulk(struct virtproc_info *vrp)
+{
+	int i;
 
-	/*
-	 * We currently use fixed-sized buffers, so trivially sanitize
-	 * the reported payload length.
-	 */
-	if (len > RPMSG_BUF_SIZE ||
-		msg->len > (len - sizeof(struct rpmsg_hdr))) {
-		dev_warn(dev, "inbound msg too big: (%d, %d)\n", len, msg->len);
-		return;
+	for (i = 0; i < vrp->num_qps; i++) {
+		cancel_work_sync(&vrp->qps[i].rx_bulk_work);
+		kfifo_free(&vrp->qps[i].rx_bulk);
 	}
+}
 
-	/* use the dst addr to fetch the callback of the appropriate user */
-	mutex_lock(&vrp->endpoints_lock);
+static void rpmsg_free_rx_chains(struct virtproc_info *vrp)
+{
+	int i, j;
 
-	ept = idr_find(&vrp->endpoints, msg->dst);
+	for (i = 0; i < vrp->num_qps; i++) {
+		struct rpmsg_queue_pair *qp = &vrp->qps[i];
 
-	/* let's make sure no one deallocates ept while we use it */
-	if (ept)
-		kref_get(&ept->refcount);
+		if (!qp->rx_chains)
+			continue;
 
-	mutex_unlock(&vrp->endpoints_lock);
+		for (j = 0; j < qp->num_rx_chains; j++)
+			rpmsg_drain_rx_chain(qp, &qp->rx_chains[j]);
 
-	if (ept) {
-		/* make sure ept->cb doesn't go away while we use it */
-		mutex_lock(&ept->cb_lock);
+		vfree(qp->rx_bounce);
+		kfree(qp->rx_chains);
+		qp->rx_bounce = NULL;
+		qp->rx_chains = NULL;
+	}
+}
 
-		if (ept->cb)
-			ept->cb(ept->rpdev, msg->data, msg->len, ept->priv,
-				msg->src);
+/*
+ * The remote processor filled all the chains it had: give a spare one its
+ * pages, and to the remote processor, unless we're short on memory.
+ */
+static void rpmsg_rx_grow_work(struct work_struct *work)
+{
+	struct rpmsg_queue_pair *qp = container_of(work,
+				struct rpmsg_queue_pair, rx_grow_work);
+	struct rpmsg_rx_chain *chain;
+	struct llist_node *node;
 
-		mutex_unlock(&ept->cb_lock);
+	if (atomic_read(&qp->rx_chains_trim) ||
+			test_bit(RPMSG_RX_NO_GROW, &qp->rx_state))
+		return;
 
-		/* farewell, ept, we don't need you anymore */
-		kref_put(&ept->refcount, __ept_release);
-	} else
-		dev_warn(dev, "msg received with no recepient\n");
+	/* we're the only one taking spare chains off the list */
+	node = llist_del_first(&qp->rx_chains_spare);
+	if (!node)
+		return;
 
-	/* publish the real size of the buffer */
-	sg_init_one(&sg, msg, RPMSG_BUF_SIZE);
+	chain = llist_entry(node, struct rpmsg_rx_chain, node);
 
-	/* add the buffer back to the remote processor's virtqueue */
-	err = virtqueue_add_buf(vrp->rvq, &sg, 0, 1, msg, GFP_KERNEL);
-	if (err < 0) {
-		dev_err(dev, "failed to add a virtqueue buffer: %d\n", err);
+	if (rpmsg_fill_rx_chain(qp, chain, GFP_KERNEL | __GFP_NOWARN)) {
+		llist_add(&chain->node, &qp->rx_chains_spare);
 		return;
 	}
 
-	/* tell the remote processor we added another available rx buffer */
-	virtqueue_kick(vrp->rvq);
+	rpmsg_rx_hand_over(qp, chain);
 }
 
 /*
- * This is invoked whenever the remote processor completed processing
- * a TX msg we just sent it, and the buffer is put back to the used ring.
- *
- * Normally, though, we suppress this "tx complete" interrupt in order to
- * avoid the incurred overhead.
+ * Under memory pressure, the chains beyond the reserve of each queue pair
+ * are let go of as the remote processor gives them back (those it keeps
+ * can't be taken away from it), and they don't grow back in the meantime.
+ * The count is in chains, 64KB each.
  */
-static void rpmsg_xmit_done(struct virtqueue *svq)
+static int rpmsg_rx_shrink(struct shrinker *shrinker,
+					struct shrink_control *sc)
 {
-	struct virtproc_info *vrp = svq->vdev->priv;
+	struct virtproc_info *vrp = container_of(shrinker,
+				struct virtproc_info, rx_shrinker);
+	unsigned long nr = sc->nr_to_scan;
+	int i, excess, left = 0;
+
+	for (i = 0; i < vrp->num_qps; i++) {
+		struct rpmsg_queue_pair *qp = &vrp->qps[i];
+
+		excess = atomic_read(&qp->rx_chains_live) -
+				rpmsg_rx_chains_reserve(qp) -
+				atomic_read(&qp->rx_chains_trim);
+		if (excess <= 0)
+			continue;
+
+		if (nr) {
+			int trim = min_t(unsigned long, nr, excess);
+
+			atomic_add(trim, &qp->rx_chains_trim);
+			excess -= trim;
+			nr -= trim;
+		}
 
-	dev_dbg(&svq->vdev->dev, "%s\n", __func__);
+		left += excess;
+	}
 
-	/* wake up potential senders that are waiting for a tx buffer */
-	wake_up_interruptible(&vrp->sendq);
+	return left;
 }
 
-/* invoked when a name service announcement arrives */
-static void rpmsg_ns_cb(struct rpmsg_channel *rpdev, void *data, int len,
-							void *priv, u32 src)
+/*
+ * allocate the rx chains of a queue pair: only the reserve gets its pages
+ * now, the others start out as spare ones
+ */
+static int rpmsg_alloc_rx_chains(struct virtproc_info *vrp,
+					struct rpmsg_queue_pair *qp)
 {
-	struct rpmsg_ns_msg *msg = data;
-	struct rpmsg_channel *newch;
-	struct rpmsg_channel_info chinfo;
-	struct virtproc_info *vrp = priv;
-	struct device *dev = &vrp->vdev->dev;
-	int ret;
+	int i, err;
 
-	print_hex_dump(KERN_DEBUG, "NS announcement: ",
-			DUMP_PREFIX_NONE, 16, 1,
-			data, len, true);
-
-	if (len != sizeof(*msg)) {
-		dev_err(dev, "malformed ns msg (%d)\n", len);
-		return;
-	}
+	qp->rx_chains = kcalloc(qp->num_rx_chains, sizeof(*qp->rx_chains),
+								GFP_KERNEL);
+	if (!qp->rx_chains)
+		return -ENOMEM;
 
-	/*
-	 * the name service ept does _not_ belong to a real rpmsg channel,
-	 * and is handled by the rpmsg bus itself.
-	 * for sanity reasons, make sure a valid rpdev has _not_ sneaked
-	 * in somehow.
-	 */
-	if (rpdev) {
-		dev_err(dev, "anomaly: ns ept has an rpdev handle\n");
-		return;
-	}
+	for (i = 0; i < qp->num_rx_chains; i++)
+		sg_init_table(qp->rx_chains[i].sg, RPMSG_RX_CHAIN_PAGES);
 
-	/* don't trust the remote processor for null terminating the name */
-	msg->name[RPMSG_NAME_SIZE - 1] = '\0';
+	qp->rx_bounce = vmalloc(RPMSG_RX_CHAIN_SIZE);
+	if (!qp->rx_bounce)
+		return -ENOMEM;
 
-	dev_info(dev, "%sing channel %s addr 0x%x\n",
-			msg->flags & RPMSG_NS_DESTROY ? "destroy" : "creat",
-			msg->name, msg->addr);
+	for (i = 0; i < rpmsg_rx_chains_reserve(qp); i++) {
+		err = rpmsg_fill_rx_chain(qp, &qp->rx_chains[i], GFP_KERNEL);
+		if (err)
+			return err;
+	}
 
-	strncpy(chinfo.name, msg->name, sizeof(chinfo.name));
-	chinfo.src = RPMSG_ADDR_ANY;
-	chinfo.dst = msg->addr;
+	for (; i < qp->num_rx_chains; i++)
+		llist_add(&qp->rx_chains[i].node, &qp->rx_chains_spare);
 
-	if (msg->flags & RPMSG_NS_DESTROY) {
-		ret = rpmsg_destroy_channel(vrp, &chinfo);
-		if (ret)
-			dev_err(dev, "rpmsg_destroy_channel failed: %d\n", ret);
-	} else {
-		newch = rpmsg_create_channel(vrp, &chinfo);
-		if (!newch)
-			dev_err(dev, "rpmsg_create_channel failed\n");
-	}
+	return 0;
 }
 
 static int rpmsg_probe(struct virtio_device *vdev)
 {
-	vq_callback_t *vq_cbs[] = { rpmsg_recv_done, rpmsg_xmit_done };
-	const char *names[] = { "input", "output" };
-	struct virtqueue *vqs[2];
 	struct virtproc_info *vrp;
-	void *bufs_va;
-	int err = 0, i;
+	void *bufs_va, *rbufs;
+	int err = 0, i, num_slots;
 
 	vrp = kzalloc(sizeof(*vrp), GFP_KERNEL);
 	if (!vrp)
 		return -ENOMEM;
 
 	vrp->vdev = vdev;
+	vrp->dma_dev = rproc_vdev_dma_dev(vdev);
+	rpmsg_init_fault_attrs(vrp);
+
+	vrp->stats = alloc_percpu(struct rpmsg_vrp_stats);
+	if (!vrp->stats) {
+		err = -ENOMEM;
+		goto free_vrp;
+	}
 
 	idr_init(&vrp->endpoints);
 	mutex_init(&vrp->endpoints_lock);
-	mutex_init(&vrp->tx_lock);
-	init_waitqueue_head(&vrp->sendq);
+	mutex_init(&vrp->channels_lock);
+	for (i = 0; i < ARRAY_SIZE(vrp->channels); i++)
+		INIT_HLIST_HEAD(&vrp->channels[i]);
+	spin_lock_init(&vrp->tx_lock);
+	for (i = 0; i < RPMSG_TX_PRIO_NUM; i++)
+		init_waitqueue_head(&vrp->sendq[i]);
+	init_waitqueue_head(&vrp->creditq);
+	INIT_LIST_HEAD(&vrp->tx_done);
+	INIT_WORK(&vrp->tx_done_work, rpmsg_tx_done_work);
+	INIT_LIST_HEAD(&vrp->tx_notify);
+	INIT_WORK(&vrp->tx_notify_work, rpmsg_tx_notify_work);
+	vrp->qos_latency = PM_QOS_DEFAULT_VALUE;
+	INIT_WORK(&vrp->qos_work, rpmsg_qos_work);
+	INIT_DELAYED_WORK(&vrp->qos_idle_work, rpmsg_qos_idle_work);
+	spin_lock_init(&vrp->rx_fc_lock);
+	pm_qos_add_request(&vrp->qos_req, PM_QOS_CPU_DMA_LATENCY,
+							PM_QOS_DEFAULT_VALUE);
+
+	vrp->num_qps = rpmsg_get_num_qps(vdev);
+	vrp->qps = kcalloc(vrp->num_qps, sizeof(*vrp->qps), GFP_KERNEL);
+	if (!vrp->qps) {
+		err = -ENOMEM;
+		goto free_stats;
+	}
+
+	for (i = 0; i < vrp->num_qps; i++) {
+		vrp->qps[i].vrp = vrp;
+		INIT_WORK(&vrp->qps[i].rx_work, rpmsg_rx_work);
+		INIT_WORK(&vrp->qps[i].rx_bulk_work, rpmsg_rx_bulk_work);
+		INIT_WORK(&vrp->qps[i].rx_grow_work, rpmsg_rx_grow_work);
+		mutex_init(&vrp->qps[i].rx_bulk_lock);
+	}
+
+	vrp->rx_wq = alloc_workqueue("rpmsg_rx/%s",
+				WQ_HIGHPRI | WQ_CPU_INTENSIVE, 0,
+				dev_name(&vdev->dev));
+	if (!vrp->rx_wq) {
+		err = -ENOMEM;
+		goto free_qps;
+	}
 
-	/* We expect two virtqueues, rx and tx (and in this order) */
-	err = vdev->config->find_vqs(vdev, 2, vqs, vq_cbs, names);
+	err = rpmsg_find_vqs(vrp);
 	if (err)
-		goto free_vrp;
+		goto destroy_rx_wq;
 
-	vrp->rvq = vqs[0];
-	vrp->svq = vqs[1];
+	err = rpmsg_config_bufs(vrp);
+	if (err)
+		goto vqs_del;
 
-	/* allocate coherent memory for the buffers */
-	bufs_va = dma_alloc_coherent(vdev->dev.parent->parent,
-				RPMSG_TOTAL_BUF_SPACE,
-				&vrp->bufs_dma, GFP_KERNEL);
-	if (!bufs_va)
+	/* unused tx buffers that are given back are kept here until reused */
+	vrp->free_sbufs = kcalloc(vrp->num_sbufs, sizeof(void *),
+								GFP_KERNEL);
+	if (!vrp->free_sbufs) {
+		err = -ENOMEM;
 		goto vqs_del;
+	}
+
+	/* allocate memory for the buffers */
+	bufs_va = rpmsg_alloc_bufs(vrp);
+	if (!bufs_va) {
+		err = -ENOMEM;
+		goto free_sbufs;
+	}
 
 	dev_dbg(&vdev->dev, "buffers: va %p, dma 0x%llx\n", bufs_va,
 					(unsigned long long)vrp->bufs_dma);
 
-	/* half of the buffers is dedicated for RX */
+	/* the first buffers are dedicated for RX */
 	vrp->rbufs = bufs_va;
 
-	/* and half is dedicated for TX */
-	vrp->sbufs = bufs_va + RPMSG_TOTAL_BUF_SPACE / 2;
+	/* and the rest is dedicated for TX */
+	vrp->sbufs = bufs_va + vrp->total_buf_space -
+				(size_t)vrp->num_sbufs * vrp->buf_stride;
+	vrp->max_txbuf_size = vrp->buf_size;
+
+	/* if supported by the remote processor, use variable-size tx buffers */
+	if (virtio_has_feature(vdev, VIRTIO_RPMSG_F_VARBUF)) {
+		err = rpmsg_init_tx_pool(vrp);
+		if (err)
+			goto free_bufs;
+	}
 
-	/* set up the receive buffers */
-	for (i = 0; i < RPMSG_NUM_BUFS / 2; i++) {
-		struct scatterlist sg;
-		void *cpu_addr = vrp->rbufs + i * RPMSG_BUF_SIZE;
+	/* keep track of the endpoint charged for every tx buffer */
+	num_slots = vrp->tx_pool ?
+		(size_t)vrp->num_sbufs * vrp->buf_stride >> RPMSG_TXBUF_ORDER :
+			vrp->num_sbufs;
 
-		sg_init_one(&sg, cpu_addr, RPMSG_BUF_SIZE);
+	vrp->tx_owners = kcalloc(num_slots, sizeof(*vrp->tx_owners),
+								GFP_KERNEL);
+	if (!vrp->tx_owners) {
+		err = -ENOMEM;
+		goto free_pool;
+	}
 
-		err = virtqueue_add_buf(vrp->rvq, &sg, 0, 1, cpu_addr,
+	/* and of when it was sent, to measure tx latencies */
+	vrp->tx_stamps = kcalloc(num_slots, sizeof(*vrp->tx_stamps),
 								GFP_KERNEL);
-		WARN_ON(err < 0); /* sanity check; this can't really happen */
+	if (!vrp->tx_stamps) {
+		err = -ENOMEM;
+		goto free_pool;
+	}
+
+	/* and of who wants to know when it was consumed */
+	vrp->tx_cbs = kcalloc(num_slots, sizeof(*vrp->tx_cbs), GFP_KERNEL);
+	if (!vrp->tx_cbs) {
+		err = -ENOMEM;
+		goto free_pool;
+	}
+
+	/* and spread some of the fixed-size tx buffers over per-cpu caches */
+	vrp->tx_cache_size = min_t(int, RPMSG_TX_CACHE_SIZE,
+				vrp->num_sbufs / (4 * num_possible_cpus()));
+	if (!vrp->tx_pool && vrp->tx_cache_size > 1) {
+		vrp->tx_cache = alloc_percpu(struct rpmsg_tx_cache);
+		if (!vrp->tx_cache) {
+			err = -ENOMEM;
+			goto free_pool;
+		}
+
+		for_each_possible_cpu(i)
+			spin_lock_init(&per_cpu_ptr(vrp->tx_cache, i)->lock);
 	}
 
-	/* suppress "tx-complete" interrupts */
-	virtqueue_disable_cb(vrp->svq);
+	/* set up the receive buffers of every queue pair */
+	rbufs = vrp->rbufs;
+	for (i = 0; i < vrp->num_qps; i++) {
+		struct rpmsg_queue_pair *qp = &vrp->qps[i];
+		int j;
+
+		qp->rbufs = rbufs;
+		rbufs += (size_t)qp->num_rbufs * vrp->buf_stride;
+
+		/* deferred msgs of low priority endpoints hold their buffer */
+		err = kfifo_alloc(&qp->rx_bulk, max(qp->num_rbufs /
+					RPMSG_RX_HOLD_RATIO, 2), GFP_KERNEL);
+		if (err)
+			goto free_pool;
+
+		for (j = 0; j < qp->num_rbufs; j++) {
+			struct scatterlist sg;
+			void *cpu_addr = rpmsg_buf_at(vrp, qp->rbufs, j);
+
+			sg_init_one(&sg, cpu_addr, vrp->buf_size);
+
+			err = virtqueue_add_buf(qp->rvq, &sg, 0, 1, cpu_addr,
+								GFP_KERNEL);
+			WARN_ON(err < 0); /* sanity check; this can't really happen */
+		}
+
+		if (qp->num_rx_chains) {
+			err = rpmsg_alloc_rx_chains(vrp, qp);
+			if (err)
+				goto free_pool;
+
+			for (j = 0; j < rpmsg_rx_chains_reserve(qp); j++) {
+				err = virtqueue_add_buf(qp->rvq,
+						qp->rx_chains[j].sg, 0,
+						RPMSG_RX_CHAIN_PAGES,
+						&qp->rx_chains[j], GFP_KERNEL);
+				if (err < 0)
+					goto free_pool;
+			}
+
+			qp->rx_chains_posted = j;
+
+			if (qp->num_rx_chains > j)
+				vrp->rx_shrinker.shrink = rpmsg_rx_shrink;
+		}
+
+		/* suppress "tx-complete" interrupts */
+		virtqueue_disable_cb(qp->svq);
+	}
 
 	vdev->priv = vrp;
 
+	/* ns records are processed, and channels probed, off the rx path */
+	INIT_WORK(&vrp->ns_work, rpmsg_ns_work);
+	INIT_LIST_HEAD(&vrp->ns_pending);
+	spin_lock_init(&vrp->ns_lock);
+
+	vrp->ns_wq = alloc_ordered_workqueue("rpmsg_ns/%s", 0,
+							dev_name(&vdev->dev));
+	if (!vrp->ns_wq) {
+		err = -ENOMEM;
+		goto free_pool;
+	}
+
+	vrp->probe_wq = alloc_workqueue("rpmsg_probe/%s", WQ_UNBOUND, 0,
+							dev_name(&vdev->dev));
+	if (!vrp->probe_wq) {
+		err = -ENOMEM;
+		goto destroy_ns_wq;
+	}
+
+	/* stamp the messages, if both sides read a shared clock */
+	if (virtio_has_feature(vdev, VIRTIO_RPMSG_F_TSTAMP)) {
+		rproc_vdev_shared_clock(vdev, &vrp->tstamp_rate);
+		if (!vrp->tstamp_rate)
+			dev_info(&vdev->dev, "no shared clock to stamp msgs\n");
+	}
+
+	/* tell the remote processor to back off when we run out of rx bufs */
+	vrp->rx_fc = virtio_has_feature(vdev, VIRTIO_RPMSG_F_RX_FC);
+
+	/* tag our messages with their sender, to share the remote processor */
+	vrp->acct = virtio_has_feature(vdev, VIRTIO_RPMSG_F_ACCT);
+
 	/* if supported by the remote processor, enable the name service */
 	if (virtio_has_feature(vdev, VIRTIO_RPMSG_F_NS)) {
 		/* a dedicated endpoint handles the name service msgs */
-		vrp->ns_ept = __rpmsg_create_ept(vrp, NULL, rpmsg_ns_cb,
-						vrp, RPMSG_NS_ADDR);
+		vrp->ns_ept = __rpmsg_create_ept(vrp, NULL, rpmsg_ns_cb, NULL,
+						vrp, RPMSG_NS_ADDR, false);
 		if (!vrp->ns_ept) {
 			dev_err(&vdev->dev, "failed to create the ns ept\n");
 			err = -ENOMEM;
-			goto free_coherent;
+			goto destroy_probe_wq;
+		}
+	}
+
+	/* if the remote processor sends heartbeats, silently take them in */
+	if (virtio_has_feature(vdev, VIRTIO_RPMSG_F_HB)) {
+		vrp->hb_ept = __rpmsg_create_ept(vrp, NULL, rpmsg_hb_cb, NULL,
+						vrp, RPMSG_HB_ADDR, false);
+		if (!vrp->hb_ept) {
+			dev_err(&vdev->dev, "failed to create the hb ept\n");
+			err = -ENOMEM;
+			goto destroy_ns_ept;
 		}
 	}
 
+	rpmsg_create_debug_dir(vrp);
+
+	if (vrp->rx_shrinker.shrink) {
+		vrp->rx_shrinker.seeks = DEFAULT_SEEKS;
+		register_shrinker(&vrp->rx_shrinker);
+	}
+
 	/* tell the remote processor it can start sending messages */
-	virtqueue_kick(vrp->rvq);
+	for (i = 0; i < vrp->num_qps; i++)
+		virtqueue_kick(vrp->qps[i].rvq);
 
 	dev_info(&vdev->dev, "rpmsg host is online\n");
 
 	return 0;
 
-free_coherent:
-	dma_free_coherent(vdev->dev.parent->parent, RPMSG_TOTAL_BUF_SPACE,
-					bufs_va, vrp->bufs_dma);
+destroy_ns_ept:
+	if (vrp->ns_ept)
+		__rpmsg_destroy_ept(vrp, vrp->ns_ept);
+destroy_probe_wq:
+	destroy_workqueue(vrp->probe_wq);
+destroy_ns_wq:
+	destroy_workqueue(vrp->ns_wq);
+free_pool:
+	rpmsg_stop_rx(vrp);
+	rpmsg_free_rx_bulk(vrp);
+	rpmsg_free_rx_chains(vrp);
+	rpmsg_free_tx_bufs(vrp);
+free_bufs:
+	rpmsg_free_bufs(vrp, bufs_va);
+free_sbufs:
+	kfree(vrp->free_sbufs);
 vqs_del:
 	vdev->config->del_vqs(vrp->vdev);
+destroy_rx_wq:
+	destroy_workqueue(vrp->rx_wq);
+free_qps:
+	kfree(vrp->qps);
+free_stats:
+	rpmsg_qos_release(vrp);
+	free_percpu(vrp->stats);
 free_vrp:
 	kfree(vrp);
 	return err;
 }
 
+/* unregister a channel, along with the others (see rpmsg_remove_device()) */
+static void rpmsg_remove_device_async(void *data, async_cookie_t cookie)
+{
+	struct rpmsg_channel *rpdev = data;
+
+	unregister_rpmsg_device(rpdev);
+	put_device(&rpdev->dev);
+}
+
+/*
+ * the channels are unregistered in parallel, in the async domain @data,
+ * since their drivers may take a while to let go of them
+ */
 static int rpmsg_remove_device(struct device *dev, void *data)
 {
-	device_unregister(dev);
+	struct rpmsg_channel *rpdev = to_rpmsg_channel(dev);
+	struct virtproc_info *vrp = rpdev->vrp;
+
+	mutex_lock(&vrp->channels_lock);
+	hlist_del(&rpdev->hnode);
+	mutex_unlock(&vrp->channels_lock);
+
+	/* device_for_each_child() lets go of it as soon as we return */
+	get_device(dev);
+	async_schedule_domain(rpmsg_remove_device_async, rpdev, data);
 
 	return 0;
 }
 
 static void __devexit rpmsg_remove(struct virtio_device *vdev)
 {
+	ASYNC_DOMAIN_EXCLUSIVE(channels);
 	struct virtproc_info *vrp = vdev->priv;
+	unsigned long flags;
 	int ret;
 
+	debugfs_remove_recursive(vrp->dbg_dir);
+
+	if (vrp->rx_shrinker.shrink)
+		unregister_shrinker(&vrp->rx_shrinker);
+
 	vdev->config->reset(vdev);
 
-	ret = device_for_each_child(&vdev->dev, NULL, rpmsg_remove_device);
-	if (ret)
-		dev_warn(&vdev->dev, "can't remove rpmsg device: %d\n", ret);
+	/* make sure we're not polling the rx virtqueues anymore */
+	rpmsg_stop_rx(vrp);
+
+	/* nor delivering deferred msgs (they're dropped) */
+	rpmsg_free_rx_bulk(vrp);
+
+	/* cancel asynchronous messages while their drivers are still here */
+	spin_lock_irqsave(&vrp->tx_lock, flags);
+	rpmsg_drop_tx_bufs(vrp);
+	spin_unlock_irqrestore(&vrp->tx_lock, flags);
+	rpmsg_complete_tx(vrp);
 
 	if (vrp->ns_ept)
 		__rpmsg_destroy_ept(vrp, vrp->ns_ept);
 
+	if (vrp->hb_ept)
+		__rpmsg_destroy_ept(vrp, vrp->hb_ept);
+
+	/* let pending name service records and channel probes complete */
+	destroy_workqueue(vrp->ns_wq);
+	destroy_workqueue(vrp->probe_wq);
+
+	ret = device_for_each_child(&vdev->dev, &channels, rpmsg_remove_device);
+	if (ret)
+		dev_warn(&vdev->dev, "can't remove rpmsg device: %d\n", ret);
+
+	async_synchronize_full_domain(&channels);
+
 	idr_remove_all(&vrp->endpoints);
 	idr_destroy(&vrp->endpoints);
 
-	vdev->config->del_vqs(vrp->vdev);
+	rpmsg_qos_release(vrp);
+
+	rpmsg_free_tx_bufs(vrp);
 
-	dma_free_coherent(vdev->dev.parent->parent, RPMSG_TOTAL_BUF_SPACE,
-					vrp->rbufs, vrp->bufs_dma);
+	/* unless they're already gone, because we couldn't be restored */
+	if (!vrp->frozen)
+		vdev->config->del_vqs(vrp->vdev);
 
+	rpmsg_free_rx_chains(vrp);
+	rpmsg_free_bufs(vrp, vrp->rbufs);
+
+	kfree(vrp->free_sbufs);
+	destroy_workqueue(vrp->rx_wq);
+	kfree(vrp->qps);
+	free_percpu(vrp->stats);
 	kfree(vrp);
 }
 
+#ifdef CONFIG_PM
+/*
+ * The remote processor is about to be restarted underneath us (e.g. to
+ * recover from a crash): let go of our virtqueues, without tearing down
+ * our channels and endpoints, which rpmsg_restore() will reconnect.
+ *
+ * The rx buffers are gathered along with the held ones that are released
+ * in the meantime, so they're all given back once we're restored. The tx
+ * buffers still in flight are dropped (their messages are lost anyway),
+ * and until we're restored, blocking senders wait for a tx buffer.
+ */
+static int rpmsg_freeze(struct virtio_device *vdev)
+{
+	struct virtproc_info *vrp = vdev->priv;
+	unsigned long flags;
+	void *buf;
+	int i;
+
+	for (i = 0; i < vrp->num_qps; i++) {
+		struct rpmsg_queue_pair *qp = &vrp->qps[i];
+
+		/* take ownership of the rx virtqueue, until we're restored */
+		while (test_and_set_bit(RPMSG_RX_POLLING, &qp->rx_state))
+			flush_work(&qp->rx_work);
+
+		virtqueue_disable_cb(qp->rvq);
+
+		while ((buf = virtqueue_detach_unused_buf(qp->rvq))) {
+			if (rpmsg_rx_chain(qp, buf))
+				qp->rx_chains_posted--;
+			else
+				atomic_inc(&qp->rx_out);
+			llist_add(buf, &qp->rx_released);
+		}
+
+		/* the restarted remote processor isn't throttled */
+		clear_bit(RPMSG_RX_THROTTLED, &qp->rx_state);
+	}
+
+	spin_lock_irqsave(&vrp->tx_lock, flags);
+	rpmsg_drop_tx_bufs(vrp);
+	vrp->frozen = true;
+	spin_unlock_irqrestore(&vrp->tx_lock, flags);
+
+	/* wait for the senders that may still be kicking a tx virtqueue */
+	synchronize_rcu();
+
+	vdev->config->del_vqs(vdev);
+
+	return 0;
+}
+
+/* tell a channel's driver that its remote side was restarted */
+static int rpmsg_reset_device(struct device *dev, void *data)
+{
+	struct rpmsg_channel *rpdev = to_rpmsg_channel(dev);
+	struct rpmsg_driver *rpdrv;
+
+	device_lock(dev);
+
+	if (dev->driver) {
+		rpdrv = to_rpmsg_driver(dev->driver);
+
+		/* the remote name service forgot about our channel, too */
+		virtio_rpmsg_announce(rpdev, RPMSG_NS_CREATE);
+
+		if (rpdrv->reset)
+			rpdrv->reset(rpdev);
+	}
+
+	device_unlock(dev);
+
+	return 0;
+}
+
+/* the remote processor is being restarted: set up our virtqueues again */
+static int rpmsg_restore(struct virtio_device *vdev)
+{
+	struct virtproc_info *vrp = vdev->priv;
+	unsigned long flags;
+	int err, i;
+
+	err = rpmsg_find_vqs(vrp);
+	if (err)
+		return err;
+
+	/* the firmware might have changed in the meantime */
+	for (i = 0; i < vrp->num_qps; i++) {
+		struct rpmsg_queue_pair *qp = &vrp->qps[i];
+
+		if (virtqueue_get_vring_size(qp->rvq) <
+				qp->num_rbufs + qp->num_rx_chains) {
+			dev_err(&vdev->dev, "%s can't hold %d rx buffers anymore\n",
+					qp->rvq->name,
+					qp->num_rbufs + qp->num_rx_chains);
+			vdev->config->del_vqs(vdev);
+			return -EINVAL;
+		}
+	}
+
+	spin_lock_irqsave(&vrp->tx_lock, flags);
+
+	vrp->frozen = false;
+
+	/* senders may have been waiting for a tx buffer all along */
+	for (i = 0; i < vrp->num_qps; i++) {
+		if (atomic_read(&vrp->sleepers))
+			virtqueue_enable_cb_delayed(vrp->qps[i].svq);
+		else
+			virtqueue_disable_cb(vrp->qps[i].svq);
+	}
+
+	spin_unlock_irqrestore(&vrp->tx_lock, flags);
+
+	/*
+	 * give the rx buffers back to the remote processor, let go of the
+	 * rx virtqueues, and tell the remote processor it can start sending
+	 */
+	for (i = 0; i < vrp->num_qps; i++)
+		rpmsg_rx_poll(&vrp->qps[i], 0, true);
+
+	rpmsg_wake_senders(vrp);
+
+	device_for_each_child(&vdev->dev, vrp, rpmsg_reset_device);
+
+	dev_info(&vdev->dev, "rpmsg host is online again\n");
+
+	return 0;
+}
+#endif
+
+/* how rpmsg channels of virtio remote processors send and receive */
+static const struct rpmsg_transport_ops virtio_rpmsg_ops = {
+	.create_ept		= virtio_rpmsg_create_ept,
+	.create_atomic_ept	= virtio_rpmsg_create_atomic_ept,
+	.create_ept_ctx		= virtio_rpmsg_create_ept_ctx,
+	.create_batch_ept	= virtio_rpmsg_create_batch_ept,
+	.destroy_ept		= virtio_rpmsg_destroy_ept,
+	.set_qos_latency	= virtio_rpmsg_set_qos_latency,
+	.get_backlog		= virtio_rpmsg_get_backlog,
+	.get_dma_dev		= virtio_rpmsg_get_dma_dev,
+	.get_mtu		= virtio_rpmsg_get_mtu,
+	.announce		= virtio_rpmsg_announce,
+	.send_offchannel	= virtio_rpmsg_send_offchannel,
+	.send_offchannel_async	= virtio_rpmsg_send_offchannel_async,
+	.sendv_offchannel	= virtio_rpmsg_sendv_offchannel,
+	.send_offchannel_batch	= virtio_rpmsg_send_offchannel_batch,
+	.send_offchannel_mcast	= virtio_rpmsg_send_offchannel_mcast,
+	.alloc_tx_buf		= virtio_rpmsg_alloc_tx_buf,
+	.free_tx_buf		= virtio_rpmsg_free_tx_buf,
+	.send_offchannel_buf	= virtio_rpmsg_send_offchannel_buf,
+	.hold_rx_buf		= virtio_rpmsg_hold_rx_buf,
+	.release_rx_buf		= virtio_rpmsg_release_rx_buf,
+	.wait_tx_buf		= virtio_rpmsg_wait_tx_buf,
+	.cancel_tx_wait		= virtio_rpmsg_cancel_tx_wait,
+};
+
 static struct virtio_device_id id_table[] = {
 	{ VIRTIO_ID_RPMSG, VIRTIO_DEV_ANY_ID },
 	{ 0 },
@@ -1056,6 +5128,17 @@ static struct virtio_device_id id_table[] = {
 
 static unsigned int features[] = {
 	VIRTIO_RPMSG_F_NS,
+	VIRTIO_RPMSG_F_VARBUF,
+	VIRTIO_RPMSG_F_BUFCFG,
+	VIRTIO_RPMSG_F_MQ,
+	VIRTIO_RPMSG_F_NS_BULK,
+	VIRTIO_RPMSG_F_HB,
+	VIRTIO_RPMSG_F_RX_CHAIN,
+	VIRTIO_RPMSG_F_TSTAMP,
+	VIRTIO_RPMSG_F_MCAST,
+	VIRTIO_RPMSG_F_ALIGN,
+	VIRTIO_RPMSG_F_RX_FC,
+	VIRTIO_RPMSG_F_ACCT,
 };
 
 static struct virtio_driver virtio_ipc_driver = {
@@ -1066,24 +5149,43 @@ static struct virtio_driver virtio_ipc_driver = {
 	.id_table	= id_table,
 	.probe		= rpmsg_probe,
 	.remove		= __devexit_p(rpmsg_remove),
+#ifdef CONFIG_PM
+	.freeze		= rpmsg_freeze,
+	.restore	= rpmsg_restore,
+#endif
 };
 
 static int __init rpmsg_init(void)
 {
 	int ret;
 
-	ret = bus_register(&rpmsg_bus);
-	if (ret) {
-		pr_err("failed to register rpmsg bus: %d\n", ret);
-		return ret;
+	if (debugfs_initialized()) {
+		rpmsg_dbg = debugfs_create_dir(KBUILD_MODNAME, NULL);
+		if (!rpmsg_dbg)
+			pr_err("can't create debugfs dir\n");
+	}
+
+	rpmsg_ept_cache = kmem_cache_create("rpmsg_ept",
+					sizeof(struct rpmsg_endpoint), 0,
+					SLAB_HWCACHE_ALIGN, rpmsg_ept_ctor);
+	if (!rpmsg_ept_cache) {
+		pr_err("failed to create the endpoints cache\n");
+		ret = -ENOMEM;
+		goto rmdir;
 	}
 
 	ret = register_virtio_driver(&virtio_ipc_driver);
 	if (ret) {
 		pr_err("failed to register virtio driver: %d\n", ret);
-		bus_unregister(&rpmsg_bus);
+		goto destroy_cache;
 	}
 
+	return 0;
+
+destroy_cache:
+	kmem_cache_destroy(rpmsg_ept_cache);
+rmdir:
+	debugfs_remove(rpmsg_dbg);
 	return ret;
 }
 subsys_initcall(rpmsg_init);
@@ -1091,7 +5193,11 @@ subsys_initcall(rpmsg_init);
 static void __exit rpmsg_fini(void)
 {
 	unregister_virtio_driver(&virtio_ipc_driver);
-	bus_unregister(&rpmsg_bus);
+	debugfs_remove(rpmsg_dbg);
+
+	/* endpoints are freed after an RCU grace period */
+	rcu_barrier();
+	kmem_cache_destroy(rpmsg_ept_cache);
 }
 module_exit(rpmsg_fini);
 
@@ -109,6 +109,46 @@ static void copy_iovec_hdr(const struct iovec *from, struct iovec *to,
 }
 
 /* Caller must have TX VQ lock */
+/* Busy poll clock, in roughly microseconds. */
+static unsigned long busy_clock(void)
+{
+	return local_clock() >> 10;
+}
+
+static bool vhost_can_busy_poll(struct vhost_dev *dev,
+				unsigned long endtime)
+{
+	return likely(!need_resched()) &&
+	       likely(!time_after(busy_clock(), endtime)) &&
+	       likely(!signal_pending(current)) &&
+	       !vhost_has_work(dev);
+}
+
+/* Like vhost_get_vq_desc, but when the ring is empty spin on it for up to
+ * busyloop_timeout before giving up, to save the guest a kick and us a
+ * wakeup for back-to-back packets. */
+static int vhost_net_tx_get_vq_desc(struct vhost_net *net,
+				    struct vhost_virtqueue *vq,
+				    unsigned int *out_num,
+				    unsigned int *in_num)
+{
+	unsigned long endtime;
+	int r;
+
+	r = vhost_get_vq_desc(&net->dev, vq, vq->iov, ARRAY_SIZE(vq->iov),
+			      out_num, in_num, NULL, NULL);
+	if (r == vq->num && vq->busyloop_timeout) {
+		endtime = busy_clock() + vq->busyloop_timeout;
+		while (vhost_can_busy_poll(&net->dev, endtime) &&
+		       vhost_vq_avail_empty(&net->dev, vq))
+			cpu_relax();
+		r = vhost_get_vq_desc(&net->dev, vq, vq->iov,
+				      ARRAY_SIZE(vq->iov), out_num, in_num,
+				      NULL, NULL);
+	}
+	return r;
+}
+
 static void tx_poll_stop(struct vhost_net *net)
 {
 	if (likely(net->tx_poll_state != VHOST_NET_POLL_STARTED))
@@ -147,6 +187,7 @@ static void handle_tx(struct vhost_net *net)
 	struct socket *sock;
 	struct vhost_ubuf_ref *uninitialized_var(ubufs);
 	bool zcopy;
+	int nheads = 0;
 
 	/* TODO: check that we are running from vhost_worker? */
 	sock = rcu_dereference_check(vq->private_data, 1);
@@ -174,10 +215,7 @@ static void handle_tx(struct vhost_net *net)
 		if (zcopy)
 			vhost_zerocopy_signal_used(vq);
 
-		head = vhost_get_vq_desc(&net->dev, vq, vq->iov,
-					 ARRAY_SIZE(vq->iov),
-					 &out, &in,
-					 NULL, NULL);
+		head = vhost_net_tx_get_vq_desc(net, vq, &out, &in);
 		/* On error, stop handling until the next kick. */
 		if (unlikely(head < 0))
 			break;
@@ -265,9 +303,15 @@ static void handle_tx(struct vhost_net *net)
 		if (err != len)
 			pr_debug("Truncated TX packet: "
 				 " len %d != %zd\n", err, len);
-		if (!zcopy)
-			vhost_add_used_and_signal(&net->dev, vq, head, 0);
-		else
+		if (!zcopy) {
+			vq->heads[nheads].id = head;
+			vq->heads[nheads].len = 0;
+			if (++nheads == VHOST_USED_BATCH) {
+				vhost_add_used_and_signal_n(&net->dev, vq,
+							    vq->heads, nheads);
+				nheads = 0;
+			}
+		} else
 			vhost_zerocopy_signal_used(vq);
 		total_len += len;
 		if (unlikely(total_len >= VHOST_NET_WEIGHT)) {
@@ -276,6 +320,8 @@ static void handle_tx(struct vhost_net *net)
 		}
 	}
 
+	if (nheads)
+		vhost_add_used_and_signal_n(&net->dev, vq, vq->heads, nheads);
 	mutex_unlock(&vq->mutex);
 }
 
@@ -297,6 +343,24 @@ static int peek_head_len(struct sock *sk)
 	return len;
 }
 
+/* Like peek_head_len, but spin on an empty socket for up to the RX ring's
+ * busyloop_timeout. */
+static int vhost_net_rx_peek_head_len(struct vhost_net *net, struct sock *sk)
+{
+	struct vhost_virtqueue *vq = &net->dev.vqs[VHOST_NET_VQ_RX];
+	unsigned long endtime;
+	int len = peek_head_len(sk);
+
+	if (!len && vq->busyloop_timeout) {
+		endtime = busy_clock() + vq->busyloop_timeout;
+		while (vhost_can_busy_poll(&net->dev, endtime) &&
+		       skb_queue_empty(&sk->sk_receive_queue))
+			cpu_relax();
+		len = peek_head_len(sk);
+	}
+	return len;
+}
+
 /* This is a multi-buffer version of vhost_get_desc, that works if
  *	vq has read descriptors only.
  * @vq		- the relevant virtqueue
@@ -383,6 +447,7 @@ static void handle_rx(struct vhost_net *net)
 	s16 headcount;
 	size_t vhost_hlen, sock_hlen;
 	size_t vhost_len, sock_len;
+	bool added = false;
 	/* TODO: check that we are running from vhost_worker? */
 	struct socket *sock = rcu_dereference_check(vq->private_data, 1);
 
@@ -398,7 +463,7 @@ static void handle_rx(struct vhost_net *net)
 		vq->log : NULL;
 	mergeable = vhost_has_feature(&net->dev, VIRTIO_NET_F_MRG_RXBUF);
 
-	while ((sock_len = peek_head_len(sock->sk))) {
+	while ((sock_len = vhost_net_rx_peek_head_len(net, sock->sk))) {
 		sock_len += sock_hlen;
 		vhost_len = sock_len + vhost_hlen;
 		headcount = get_rx_bufs(vq, vq->heads, vhost_len,
@@ -455,8 +520,9 @@ static void handle_rx(struct vhost_net *net)
 			vhost_discard_vq_desc(vq, headcount);
 			break;
 		}
-		vhost_add_used_and_signal_n(&net->dev, vq, vq->heads,
-					    headcount);
+		/* the guest is signalled once for the whole batch */
+		vhost_add_used_n(vq, vq->heads, headcount);
+		added = true;
 		if (unlikely(vq_log))
 			vhost_log_write(vq, vq_log, log, vhost_len);
 		total_len += vhost_len;
@@ -466,6 +532,8 @@ static void handle_rx(struct vhost_net *net)
 		}
 	}
 
+	if (added)
+		vhost_signal(&net->dev, vq);
 	mutex_unlock(&vq->mutex);
 }
 
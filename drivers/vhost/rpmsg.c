@@ -0,0 +1,980 @@
+/*
+ * rpmsg server in host kernel.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.
+ *
+ * Bridges the rpmsg bus of a guest (i.e. virtio_rpmsg_bus, which drives
+ * the guest's side of the rings) to an rpmsg channel of the host, so that
+ * guests can talk to a remote processor of the host without a user space
+ * proxy in between.
+ *
+ * The remote processor announces "rpmsg-vhost" channels, which user space
+ * hands out to guests with VHOST_RPMSG_SET_BACKEND. The guest then sees a
+ * single remote service, announced to it under the name user space picked,
+ * and every message it sends to that service goes to the remote end of the
+ * host channel (and the other way around).
+ *
+ * Both rpmsg buses use the very same message layout, so payloads are moved
+ * directly between the guest's buffers and the buffers the host shares with
+ * the remote processor: outbound messages are built in place in a tx
+ * buffer of the host (see rpmsg_alloc_tx_buf()), and inbound ones are held
+ * in their rx buffer (see rpmsg_hold_rx_buf()) until the guest gives us a
+ * buffer to put them in.
+ */
+
+#include <linux/compat.h>
+#include <linux/eventfd.h>
+#include <linux/vhost.h>
+#include <linux/virtio_net.h> /* TODO vhost.h currently depends on this */
+#include <linux/miscdevice.h>
+#include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/rwsem.h>
+#include <linux/spinlock.h>
+#include <linux/list.h>
+#include <linux/kref.h>
+#include <linux/rcupdate.h>
+#include <linux/file.h>
+#include <linux/slab.h>
+#include <linux/socket.h>
+#include <linux/rpmsg.h>
+
+#include "vhost.c"
+#include "vhost.h"
+
+/* Max number of bytes transferred before requeueing the job.
+ * Using this limit prevents one virtqueue from starving others. */
+#define VHOST_RPMSG_WEIGHT 0x80000
+
+/* Max number of inbound messages waiting for the guest to take them */
+#define VHOST_RPMSG_MAX_QUEUED	64
+
+/* The name service address of the rpmsg bus (as in virtio_rpmsg_bus.c) */
+#define VHOST_RPMSG_NS_ADDR	53
+
+enum {
+	VHOST_RPMSG_FEATURES = VHOST_FEATURES |
+			 (1ULL << VIRTIO_RPMSG_F_NS),
+};
+
+/* The guest's rx ring (filled by us) comes first, as on the rpmsg bus */
+enum {
+	VHOST_RPMSG_VQ_RX = 0,
+	VHOST_RPMSG_VQ_TX = 1,
+	VHOST_RPMSG_VQ_MAX = 2,
+};
+
+struct vhost_rpmsg;
+
+/**
+ * struct vhost_rpmsg_chan - an "rpmsg-vhost" channel of the host
+ * @rpdev: the underlying rpmsg channel, or NULL once it is removed
+ * @refcount: one reference for the channel, and one for its vhost device
+ * @node: linked into vhost_rpmsg_chans, until the channel is removed
+ * @addr: the address of the remote service (announced to the guest)
+ * @rpdev_sem: protects @rpdev against removal while it's being used
+ * @lock: protects @owner, @queue and @num_queued
+ * @owner: the vhost device the channel was handed out to, if any
+ * @queue: inbound messages, waiting for the guest to take them
+ * @num_queued: number of messages in @queue
+ * @tx_waiter: kicks the guest's tx ring again once tx buffers come back
+ */
+struct vhost_rpmsg_chan {
+	struct rpmsg_channel *rpdev;
+	struct kref refcount;
+	struct list_head node;
+	u32 addr;
+	struct rw_semaphore rpdev_sem;
+	spinlock_t lock;
+	struct vhost_rpmsg *owner;
+	struct list_head queue;
+	int num_queued;
+	struct rpmsg_tx_waiter tx_waiter;
+};
+
+/**
+ * struct vhost_rpmsg_msg - a message on its way to the guest
+ * @node: linked into the queue of the channel
+ * @src: source address
+ * @dst: destination address, or RPMSG_ADDR_ANY for "the guest's endpoint"
+ * @len: length of @data
+ * @held: @data is the rx buffer the message arrived in, which is held
+ * @data: the payload of the message, either held or in @buf
+ * @buf: a copy of the payload, if its rx buffer couldn't be held
+ */
+struct vhost_rpmsg_msg {
+	struct list_head node;
+	u32 src;
+	u32 dst;
+	int len;
+	bool held;
+	void *data;
+	u8 buf[0];
+};
+
+struct vhost_rpmsg {
+	struct vhost_dev dev;
+	struct vhost_virtqueue vqs[VHOST_RPMSG_VQ_MAX];
+	/* The backend; protected by dev.mutex */
+	struct vhost_rpmsg_chan *chan;
+	/* The name the remote service is announced to the guest with */
+	char name[RPMSG_NAME_SIZE];
+	/* The guest's endpoint of the service, once it said something.
+	 * Only accessed from the worker (and before it is started). */
+	u32 guest_addr;
+};
+
+/* All the "rpmsg-vhost" channels; protected by vhost_rpmsg_mutex */
+static LIST_HEAD(vhost_rpmsg_chans);
+static DEFINE_MUTEX(vhost_rpmsg_mutex);
+
+static void vhost_rpmsg_release_chan(struct kref *kref)
+{
+	struct vhost_rpmsg_chan *chan = container_of(kref,
+					struct vhost_rpmsg_chan, refcount);
+
+	kfree(chan);
+}
+
+static void vhost_rpmsg_free_msg(struct vhost_rpmsg_chan *chan,
+				 struct vhost_rpmsg_msg *msg)
+{
+	/* held buffers are all given back before the channel is removed */
+	if (msg->held)
+		rpmsg_release_rx_buf(chan->rpdev, msg->data);
+
+	kfree(msg);
+}
+
+/*
+ * Drop all the inbound messages. Called with rpdev_sem taken, so held rx
+ * buffers are given back before the channel goes away.
+ */
+static void vhost_rpmsg_purge(struct vhost_rpmsg_chan *chan)
+{
+	struct vhost_rpmsg_msg *msg, *tmp;
+	unsigned long flags;
+	LIST_HEAD(msgs);
+
+	spin_lock_irqsave(&chan->lock, flags);
+	list_splice_init(&chan->queue, &msgs);
+	chan->num_queued = 0;
+	spin_unlock_irqrestore(&chan->lock, flags);
+
+	list_for_each_entry_safe(msg, tmp, &msgs, node)
+		vhost_rpmsg_free_msg(chan, msg);
+}
+
+/* queue a message for the guest, and have the worker deliver it */
+static void vhost_rpmsg_queue_msg(struct vhost_rpmsg_chan *chan,
+				  struct vhost_rpmsg_msg *msg)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&chan->lock, flags);
+
+	if (!chan->owner || chan->num_queued >= VHOST_RPMSG_MAX_QUEUED) {
+		spin_unlock_irqrestore(&chan->lock, flags);
+		pr_debug("dropping a %d bytes msg from 0x%x\n", msg->len,
+								msg->src);
+		vhost_rpmsg_free_msg(chan, msg);
+		return;
+	}
+
+	list_add_tail(&msg->node, &chan->queue);
+	chan->num_queued++;
+	vhost_poll_queue(&chan->owner->vqs[VHOST_RPMSG_VQ_RX].poll);
+
+	spin_unlock_irqrestore(&chan->lock, flags);
+}
+
+/* announce the remote service to the guest (or its removal) */
+static void vhost_rpmsg_announce(struct vhost_rpmsg_chan *chan,
+				 const char *name, u32 flags)
+{
+	struct vhost_rpmsg_msg *msg;
+	struct rpmsg_ns_msg *nsm;
+
+	msg = kzalloc(sizeof(*msg) + sizeof(*nsm), GFP_KERNEL);
+	if (!msg)
+		return;
+
+	nsm = (struct rpmsg_ns_msg *)msg->buf;
+	strncpy(nsm->name, name, RPMSG_NAME_SIZE);
+	nsm->addr = chan->addr;
+	nsm->flags = flags;
+
+	msg->src = VHOST_RPMSG_NS_ADDR;
+	msg->dst = VHOST_RPMSG_NS_ADDR;
+	msg->len = sizeof(*nsm);
+	msg->data = msg->buf;
+
+	vhost_rpmsg_queue_msg(chan, msg);
+}
+
+/* the first inbound message, if it can be delivered already */
+static struct vhost_rpmsg_msg *vhost_rpmsg_peek(struct vhost_rpmsg *n,
+						struct vhost_rpmsg_chan *chan)
+{
+	struct vhost_rpmsg_msg *msg = NULL;
+	unsigned long flags;
+
+	spin_lock_irqsave(&chan->lock, flags);
+	if (!list_empty(&chan->queue))
+		msg = list_first_entry(&chan->queue, struct vhost_rpmsg_msg,
+									node);
+	spin_unlock_irqrestore(&chan->lock, flags);
+
+	/* we don't know where to send it yet */
+	if (msg && msg->dst == RPMSG_ADDR_ANY &&
+	    n->guest_addr == RPMSG_ADDR_ANY)
+		return NULL;
+
+	return msg;
+}
+
+static void vhost_rpmsg_dequeue(struct vhost_rpmsg_chan *chan,
+				struct vhost_rpmsg_msg *msg)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&chan->lock, flags);
+	list_del(&msg->node);
+	chan->num_queued--;
+	spin_unlock_irqrestore(&chan->lock, flags);
+
+	vhost_rpmsg_free_msg(chan, msg);
+}
+
+/* a tx buffer came back: have the worker pick up the guest's msgs again */
+static void vhost_rpmsg_tx_ready(struct rpmsg_tx_waiter *waiter)
+{
+	struct vhost_rpmsg_chan *chan = container_of(waiter,
+					struct vhost_rpmsg_chan, tx_waiter);
+	unsigned long flags;
+
+	spin_lock_irqsave(&chan->lock, flags);
+	if (chan->owner)
+		vhost_poll_queue(&chan->owner->vqs[VHOST_RPMSG_VQ_TX].poll);
+	spin_unlock_irqrestore(&chan->lock, flags);
+}
+
+/*
+ * grab a tx buffer without blocking the worker (which holds the vq mutex).
+ * If none is available, tx_waiter kicks the worker once one comes back.
+ */
+static void *vhost_rpmsg_alloc_tx_buf(struct vhost_rpmsg_chan *chan,
+							int len)
+{
+	void *buf;
+
+	buf = rpmsg_alloc_tx_buf(chan->rpdev, len, false);
+	if (!IS_ERR(buf) || PTR_ERR(buf) != -ENOMEM)
+		return buf;
+
+	if (rpmsg_wait_tx_buf(chan->rpdev, &chan->tx_waiter))
+		return buf;
+
+	/* a tx buffer may have come back before we queued the waiter */
+	buf = rpmsg_alloc_tx_buf(chan->rpdev, len, false);
+	if (IS_ERR(buf) && PTR_ERR(buf) == -ENOMEM)
+		return ERR_PTR(-EAGAIN);
+
+	return buf;
+}
+
+/*
+ * send a message of the guest (@len bytes in @iov) to the remote service.
+ *
+ * Returns -EAGAIN if the message should be retried once tx buffers come
+ * back, or 0 if it was consumed (malformed or undeliverable messages are
+ * dropped).
+ */
+static int vhost_rpmsg_forward(struct vhost_rpmsg *n,
+				struct vhost_rpmsg_chan *chan,
+				struct vhost_virtqueue *vq, size_t len)
+{
+	struct rpmsg_hdr hdr;
+	void *buf;
+	int err, ret = 0;
+
+	if (len < sizeof(hdr) ||
+	    memcpy_fromiovecend((unsigned char *)&hdr, vq->iov, 0,
+							sizeof(hdr))) {
+		vq_err(vq, "Faulted on rpmsg header\n");
+		return 0;
+	}
+
+	if (hdr.len > len - sizeof(hdr)) {
+		vq_err(vq, "Bad rpmsg length %u (%zu bytes buffer)\n", hdr.len,
+									len);
+		return 0;
+	}
+
+	/* the guest's own announcements, for instance, have nowhere to go */
+	if (hdr.dst != chan->addr) {
+		pr_debug("dropping a %u bytes msg to 0x%x\n", hdr.len,
+								hdr.dst);
+		return 0;
+	}
+
+	/* replies go to the guest's endpoint, now that we know it */
+	if (n->guest_addr != hdr.src) {
+		n->guest_addr = hdr.src;
+		vhost_poll_queue(&n->vqs[VHOST_RPMSG_VQ_RX].poll);
+	}
+
+	down_read(&chan->rpdev_sem);
+
+	if (!chan->rpdev)
+		goto out;
+
+	/* build the message in place, in a buffer the remote can see */
+	buf = vhost_rpmsg_alloc_tx_buf(chan, hdr.len);
+	if (IS_ERR(buf)) {
+		if (PTR_ERR(buf) == -EAGAIN)
+			ret = -EAGAIN;
+		else
+			pr_debug("no tx buffer: %ld\n", PTR_ERR(buf));
+		goto out;
+	}
+
+	if (memcpy_fromiovecend(buf, vq->iov, sizeof(hdr), hdr.len)) {
+		vq_err(vq, "Faulted on rpmsg payload\n");
+		rpmsg_free_tx_buf(chan->rpdev, buf);
+		goto out;
+	}
+
+	err = rpmsg_send_offchannel_buf(chan->rpdev, chan->rpdev->src,
+					chan->rpdev->dst, buf, hdr.len);
+	if (err)
+		pr_debug("rpmsg_send_offchannel_buf failed: %d\n", err);
+
+out:
+	up_read(&chan->rpdev_sem);
+	return ret;
+}
+
+/* Expects to be always run from workqueue - which acts as
+ * read-side critical section for our kind of RCU. */
+static void handle_tx(struct vhost_rpmsg *n)
+{
+	struct vhost_virtqueue *vq = &n->vqs[VHOST_RPMSG_VQ_TX];
+	struct vhost_rpmsg_chan *chan;
+	unsigned out, in;
+	int head;
+	size_t len, total_len = 0;
+	int nheads = 0;
+	bool added = false;
+
+	chan = rcu_dereference_check(vq->private_data, 1);
+	if (!chan)
+		return;
+
+	mutex_lock(&vq->mutex);
+	vhost_disable_notify(&n->dev, vq);
+
+	for (;;) {
+		head = vhost_get_vq_desc(&n->dev, vq, vq->iov,
+					 ARRAY_SIZE(vq->iov),
+					 &out, &in,
+					 NULL, NULL);
+		/* On error, stop handling until the next kick. */
+		if (unlikely(head < 0))
+			break;
+		/* Nothing new?  Wait for eventfd to tell us they refilled. */
+		if (head == vq->num) {
+			if (unlikely(vhost_enable_notify(&n->dev, vq))) {
+				vhost_disable_notify(&n->dev, vq);
+				continue;
+			}
+			break;
+		}
+		if (in) {
+			vq_err(vq, "Unexpected descriptor format for TX: "
+			       "out %d, int %d\n", out, in);
+			break;
+		}
+		len = iov_length(vq->iov, out);
+
+		/* out of tx buffers: retry once the remote gives some back */
+		if (vhost_rpmsg_forward(n, chan, vq, len) == -EAGAIN) {
+			vhost_discard_vq_desc(vq, 1);
+			break;
+		}
+
+		/* the guest is signalled once for the whole batch */
+		vq->heads[nheads].id = head;
+		vq->heads[nheads].len = 0;
+		if (++nheads == VHOST_USED_BATCH) {
+			vhost_add_used_n(vq, vq->heads, nheads);
+			nheads = 0;
+		}
+		added = true;
+		total_len += len;
+		if (unlikely(total_len >= VHOST_RPMSG_WEIGHT)) {
+			vhost_poll_queue(&vq->poll);
+			break;
+		}
+	}
+
+	if (nheads)
+		vhost_add_used_n(vq, vq->heads, nheads);
+	if (added)
+		vhost_signal(&n->dev, vq);
+
+	mutex_unlock(&vq->mutex);
+}
+
+/* Expects to be always run from workqueue - which acts as
+ * read-side critical section for our kind of RCU. */
+static void handle_rx(struct vhost_rpmsg *n)
+{
+	struct vhost_virtqueue *vq = &n->vqs[VHOST_RPMSG_VQ_RX];
+	struct vhost_rpmsg_chan *chan;
+	struct vhost_rpmsg_msg *msg;
+	struct rpmsg_hdr hdr;
+	unsigned out, in;
+	int head;
+	size_t len, total_len = 0;
+	int nheads = 0;
+	bool added = false;
+
+	chan = rcu_dereference_check(vq->private_data, 1);
+	if (!chan)
+		return;
+
+	/* held rx buffers can't be given back underneath us */
+	down_read(&chan->rpdev_sem);
+	mutex_lock(&vq->mutex);
+	vhost_disable_notify(&n->dev, vq);
+
+	while ((msg = vhost_rpmsg_peek(n, chan))) {
+		head = vhost_get_vq_desc(&n->dev, vq, vq->iov,
+					 ARRAY_SIZE(vq->iov),
+					 &out, &in,
+					 NULL, NULL);
+		/* On error, stop handling until the next kick. */
+		if (unlikely(head < 0))
+			break;
+		/* No buffer?  Wait for eventfd to tell us they refilled. */
+		if (head == vq->num) {
+			if (unlikely(vhost_enable_notify(&n->dev, vq))) {
+				vhost_disable_notify(&n->dev, vq);
+				continue;
+			}
+			break;
+		}
+		if (out) {
+			vq_err(vq, "Unexpected descriptor format for RX: "
+			       "out %d, int %d\n", out, in);
+			vhost_discard_vq_desc(vq, 1);
+			break;
+		}
+
+		len = sizeof(hdr) + msg->len;
+		if (unlikely(iov_length(vq->iov, in) < len)) {
+			vq_err(vq, "Dropping a %zu bytes msg "
+			       "(%zu bytes buffer)\n", len,
+			       iov_length(vq->iov, in));
+			vhost_discard_vq_desc(vq, 1);
+			vhost_rpmsg_dequeue(chan, msg);
+			continue;
+		}
+
+		hdr.src = msg->src;
+		hdr.dst = msg->dst == RPMSG_ADDR_ANY ? n->guest_addr : msg->dst;
+		hdr.reserved = 0;
+		hdr.len = msg->len;
+		hdr.flags = 0;
+
+		if (memcpy_toiovecend(vq->iov, (unsigned char *)&hdr, 0,
+							sizeof(hdr)) ||
+		    memcpy_toiovecend(vq->iov, msg->data, sizeof(hdr),
+							msg->len)) {
+			vq_err(vq, "Faulted on rpmsg rx\n");
+			vhost_discard_vq_desc(vq, 1);
+			break;
+		}
+
+		vq->heads[nheads].id = head;
+		vq->heads[nheads].len = len;
+		if (++nheads == VHOST_USED_BATCH) {
+			vhost_add_used_n(vq, vq->heads, nheads);
+			nheads = 0;
+		}
+		added = true;
+
+		/* which gives its buffer back to the remote, if it's held */
+		vhost_rpmsg_dequeue(chan, msg);
+
+		total_len += len;
+		if (unlikely(total_len >= VHOST_RPMSG_WEIGHT)) {
+			vhost_poll_queue(&vq->poll);
+			break;
+		}
+	}
+
+	if (nheads)
+		vhost_add_used_n(vq, vq->heads, nheads);
+	if (added)
+		vhost_signal(&n->dev, vq);
+
+	mutex_unlock(&vq->mutex);
+	up_read(&chan->rpdev_sem);
+}
+
+static void handle_tx_kick(struct vhost_work *work)
+{
+	struct vhost_virtqueue *vq = container_of(work, struct vhost_virtqueue,
+						  poll.work);
+	struct vhost_rpmsg *n = container_of(vq->dev, struct vhost_rpmsg, dev);
+
+	handle_tx(n);
+}
+
+/* also queued whenever a message shows up for the guest */
+static void handle_rx_kick(struct vhost_work *work)
+{
+	struct vhost_virtqueue *vq = container_of(work, struct vhost_virtqueue,
+						  poll.work);
+	struct vhost_rpmsg *n = container_of(vq->dev, struct vhost_rpmsg, dev);
+
+	handle_rx(n);
+}
+
+static int vhost_rpmsg_open(struct inode *inode, struct file *f)
+{
+	struct vhost_rpmsg *n = kzalloc(sizeof(*n), GFP_KERNEL);
+	int r;
+
+	if (!n)
+		return -ENOMEM;
+
+	n->vqs[VHOST_RPMSG_VQ_TX].handle_kick = handle_tx_kick;
+	n->vqs[VHOST_RPMSG_VQ_RX].handle_kick = handle_rx_kick;
+	r = vhost_dev_init(&n->dev, n->vqs, VHOST_RPMSG_VQ_MAX);
+	if (r < 0) {
+		kfree(n);
+		return r;
+	}
+
+	f->private_data = n;
+
+	return 0;
+}
+
+static void vhost_rpmsg_flush(struct vhost_rpmsg *n)
+{
+	vhost_poll_flush(&n->dev.vqs[VHOST_RPMSG_VQ_TX].poll);
+	vhost_poll_flush(&n->dev.vqs[VHOST_RPMSG_VQ_RX].poll);
+}
+
+/* detach the backend from the rings; returns it, if there was one */
+static struct vhost_rpmsg_chan *vhost_rpmsg_stop(struct vhost_rpmsg *n)
+{
+	struct vhost_rpmsg_chan *chan = n->chan;
+	struct vhost_virtqueue *vq;
+	int i;
+
+	for (i = 0; i < VHOST_RPMSG_VQ_MAX; i++) {
+		vq = &n->vqs[i];
+		mutex_lock(&vq->mutex);
+		rcu_assign_pointer(vq->private_data, NULL);
+		mutex_unlock(&vq->mutex);
+	}
+
+	n->chan = NULL;
+	return chan;
+}
+
+/* give up a backend, once the worker is done with it */
+static void vhost_rpmsg_put_chan(struct vhost_rpmsg_chan *chan)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&chan->lock, flags);
+	chan->owner = NULL;
+	spin_unlock_irqrestore(&chan->lock, flags);
+
+	down_read(&chan->rpdev_sem);
+	if (chan->rpdev)
+		rpmsg_cancel_tx_wait(chan->rpdev, &chan->tx_waiter);
+	vhost_rpmsg_purge(chan);
+	up_read(&chan->rpdev_sem);
+
+	kref_put(&chan->refcount, vhost_rpmsg_release_chan);
+}
+
+static int vhost_rpmsg_release(struct inode *inode, struct file *f)
+{
+	struct vhost_rpmsg *n = f->private_data;
+	struct vhost_rpmsg_chan *chan;
+
+	chan = vhost_rpmsg_stop(n);
+	vhost_rpmsg_flush(n);
+	vhost_dev_cleanup(&n->dev, false);
+	if (chan)
+		vhost_rpmsg_put_chan(chan);
+	/* We do an extra flush before freeing memory,
+	 * since jobs can re-queue themselves. */
+	vhost_rpmsg_flush(n);
+	kfree(n);
+	return 0;
+}
+
+static long vhost_rpmsg_set_backend(struct vhost_rpmsg *n,
+				    struct vhost_rpmsg_target *t)
+{
+	struct vhost_rpmsg_chan *chan, *found = NULL;
+	struct vhost_virtqueue *vq;
+	unsigned long flags;
+	int i, r;
+
+	mutex_lock(&n->dev.mutex);
+	r = vhost_dev_check_owner(&n->dev);
+	if (r)
+		goto err;
+
+	/* Verify that ring has been setup correctly. */
+	for (i = 0; i < VHOST_RPMSG_VQ_MAX; i++) {
+		if (!vhost_vq_access_ok(&n->vqs[i])) {
+			r = -EFAULT;
+			goto err;
+		}
+	}
+
+	if (n->chan) {
+		r = -EEXIST;
+		goto err;
+	}
+
+	mutex_lock(&vhost_rpmsg_mutex);
+	list_for_each_entry(chan, &vhost_rpmsg_chans, node) {
+		if (strncmp(dev_name(&chan->rpdev->dev), t->channel,
+						sizeof(t->channel)))
+			continue;
+
+		spin_lock_irqsave(&chan->lock, flags);
+		if (!chan->owner) {
+			chan->owner = n;
+			kref_get(&chan->refcount);
+			found = chan;
+		}
+		spin_unlock_irqrestore(&chan->lock, flags);
+		break;
+	}
+	mutex_unlock(&vhost_rpmsg_mutex);
+
+	if (!found) {
+		r = -ENODEV;
+		goto err;
+	}
+
+	n->chan = found;
+	n->guest_addr = RPMSG_ADDR_ANY;
+	if (t->name[0])
+		strlcpy(n->name, t->name, sizeof(n->name));
+	else
+		strlcpy(n->name, found->rpdev->id.name, sizeof(n->name));
+
+	for (i = 0; i < VHOST_RPMSG_VQ_MAX; i++) {
+		vq = &n->vqs[i];
+		mutex_lock(&vq->mutex);
+		rcu_assign_pointer(vq->private_data, found);
+		r = vhost_init_used(vq);
+		mutex_unlock(&vq->mutex);
+		if (r)
+			goto err_stop;
+	}
+
+	/* the guest's rpmsg bus creates its channel once it hears of it */
+	vhost_rpmsg_announce(found, n->name, RPMSG_NS_CREATE);
+
+	mutex_unlock(&n->dev.mutex);
+	return 0;
+
+err_stop:
+	vhost_rpmsg_stop(n);
+	vhost_rpmsg_flush(n);
+	vhost_rpmsg_put_chan(found);
+err:
+	mutex_unlock(&n->dev.mutex);
+	return r;
+}
+
+static long vhost_rpmsg_clear_backend(struct vhost_rpmsg *n)
+{
+	struct vhost_rpmsg_chan *chan;
+	int r;
+
+	mutex_lock(&n->dev.mutex);
+	r = vhost_dev_check_owner(&n->dev);
+	if (r)
+		goto done;
+
+	chan = vhost_rpmsg_stop(n);
+	if (!chan) {
+		r = -ENODEV;
+		goto done;
+	}
+
+	vhost_rpmsg_flush(n);
+	vhost_rpmsg_put_chan(chan);
+done:
+	mutex_unlock(&n->dev.mutex);
+	return r;
+}
+
+static long vhost_rpmsg_reset_owner(struct vhost_rpmsg *n)
+{
+	struct vhost_rpmsg_chan *chan;
+	long err;
+
+	mutex_lock(&n->dev.mutex);
+	err = vhost_dev_check_owner(&n->dev);
+	if (err)
+		goto done;
+	chan = vhost_rpmsg_stop(n);
+	vhost_rpmsg_flush(n);
+	if (chan)
+		vhost_rpmsg_put_chan(chan);
+	err = vhost_dev_reset_owner(&n->dev);
+done:
+	mutex_unlock(&n->dev.mutex);
+	return err;
+}
+
+static int vhost_rpmsg_set_features(struct vhost_rpmsg *n, u64 features)
+{
+	mutex_lock(&n->dev.mutex);
+	if ((features & (1 << VHOST_F_LOG_ALL)) &&
+	    !vhost_log_access_ok(&n->dev)) {
+		mutex_unlock(&n->dev.mutex);
+		return -EFAULT;
+	}
+	n->dev.acked_features = features;
+	smp_wmb();
+	vhost_rpmsg_flush(n);
+	mutex_unlock(&n->dev.mutex);
+	return 0;
+}
+
+static long vhost_rpmsg_ioctl(struct file *f, unsigned int ioctl,
+			      unsigned long arg)
+{
+	struct vhost_rpmsg *n = f->private_data;
+	void __user *argp = (void __user *)arg;
+	u64 __user *featurep = argp;
+	struct vhost_rpmsg_target backend;
+	u64 features;
+	int r;
+
+	switch (ioctl) {
+	case VHOST_RPMSG_SET_BACKEND:
+		if (copy_from_user(&backend, argp, sizeof backend))
+			return -EFAULT;
+		return vhost_rpmsg_set_backend(n, &backend);
+	case VHOST_RPMSG_CLEAR_BACKEND:
+		return vhost_rpmsg_clear_backend(n);
+	case VHOST_GET_FEATURES:
+		features = VHOST_RPMSG_FEATURES;
+		if (copy_to_user(featurep, &features, sizeof features))
+			return -EFAULT;
+		return 0;
+	case VHOST_SET_FEATURES:
+		if (copy_from_user(&features, featurep, sizeof features))
+			return -EFAULT;
+		if (features & ~VHOST_RPMSG_FEATURES)
+			return -EOPNOTSUPP;
+		return vhost_rpmsg_set_features(n, features);
+	case VHOST_RESET_OWNER:
+		return vhost_rpmsg_reset_owner(n);
+	default:
+		mutex_lock(&n->dev.mutex);
+		r = vhost_dev_ioctl(&n->dev, ioctl, arg);
+		vhost_rpmsg_flush(n);
+		mutex_unlock(&n->dev.mutex);
+		return r;
+	}
+}
+
+#ifdef CONFIG_COMPAT
+static long vhost_rpmsg_compat_ioctl(struct file *f, unsigned int ioctl,
+				     unsigned long arg)
+{
+	return vhost_rpmsg_ioctl(f, ioctl, (unsigned long)compat_ptr(arg));
+}
+#endif
+
+static const struct file_operations vhost_rpmsg_fops = {
+	.owner          = THIS_MODULE,
+	.release        = vhost_rpmsg_release,
+	.unlocked_ioctl = vhost_rpmsg_ioctl,
+#ifdef CONFIG_COMPAT
+	.compat_ioctl   = vhost_rpmsg_compat_ioctl,
+#endif
+	.open           = vhost_rpmsg_open,
+	.llseek		= noop_llseek,
+};
+
+static struct miscdevice vhost_rpmsg_misc = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.name = "vhost-rpmsg",
+	.fops = &vhost_rpmsg_fops,
+};
+
+/* messages from the remote service, on their way to the guest */
+static void vhost_rpmsg_cb(struct rpmsg_channel *rpdev, void *data, int len,
+			   void *priv, u32 src)
+{
+	struct vhost_rpmsg_chan *chan = dev_get_drvdata(&rpdev->dev);
+	struct vhost_rpmsg_msg *msg;
+
+	/* the channel is being removed */
+	if (!chan)
+		return;
+
+	/* nobody to deliver it to (this is racy, but only an optimization) */
+	if (!chan->owner)
+		return;
+
+	/* keep the message in its rx buffer, if we may */
+	if (!rpmsg_hold_rx_buf(rpdev, data)) {
+		msg = kmalloc(sizeof(*msg), GFP_ATOMIC);
+		if (!msg) {
+			rpmsg_release_rx_buf(rpdev, data);
+			goto nomem;
+		}
+		msg->held = true;
+		msg->data = data;
+	} else {
+		msg = kmalloc(sizeof(*msg) + len, GFP_ATOMIC);
+		if (!msg)
+			goto nomem;
+		msg->held = false;
+		msg->data = msg->buf;
+		memcpy(msg->buf, data, len);
+	}
+
+	msg->src = src;
+	msg->dst = RPMSG_ADDR_ANY;
+	msg->len = len;
+
+	vhost_rpmsg_queue_msg(chan, msg);
+	return;
+
+nomem:
+	dev_err_ratelimited(&rpdev->dev, "dropping a %d bytes msg\n", len);
+}
+
+static int vhost_rpmsg_probe(struct rpmsg_channel *rpdev)
+{
+	struct vhost_rpmsg_chan *chan;
+
+	chan = kzalloc(sizeof(*chan), GFP_KERNEL);
+	if (!chan)
+		return -ENOMEM;
+
+	chan->rpdev = rpdev;
+	chan->addr = rpdev->dst;
+	kref_init(&chan->refcount);
+	init_rwsem(&chan->rpdev_sem);
+	spin_lock_init(&chan->lock);
+	INIT_LIST_HEAD(&chan->queue);
+	rpmsg_init_tx_waiter(&chan->tx_waiter, vhost_rpmsg_tx_ready);
+
+	dev_set_drvdata(&rpdev->dev, chan);
+
+	mutex_lock(&vhost_rpmsg_mutex);
+	list_add_tail(&chan->node, &vhost_rpmsg_chans);
+	mutex_unlock(&vhost_rpmsg_mutex);
+
+	dev_info(&rpdev->dev, "new vhost rpmsg channel: 0x%x -> 0x%x\n",
+						rpdev->src, rpdev->dst);
+
+	return 0;
+}
+
+static void __devexit vhost_rpmsg_remove(struct rpmsg_channel *rpdev)
+{
+	struct vhost_rpmsg_chan *chan = dev_get_drvdata(&rpdev->dev);
+	struct vhost_rpmsg *owner;
+	unsigned long flags;
+	char name[RPMSG_NAME_SIZE] = "";
+
+	/* can't be handed out anymore */
+	mutex_lock(&vhost_rpmsg_mutex);
+	list_del(&chan->node);
+	mutex_unlock(&vhost_rpmsg_mutex);
+
+	/*
+	 * The channel's ept is only destroyed after we return, so make sure
+	 * its callback won't touch the chan anymore (it's invoked with
+	 * cb_lock taken).
+	 */
+	mutex_lock(&rpdev->ept->cb_lock);
+	dev_set_drvdata(&rpdev->dev, NULL);
+	mutex_unlock(&rpdev->ept->cb_lock);
+
+	/* wait for the worker, give the held rx buffers back, and let go */
+	down_write(&chan->rpdev_sem);
+	rpmsg_cancel_tx_wait(rpdev, &chan->tx_waiter);
+	vhost_rpmsg_purge(chan);
+	chan->rpdev = NULL;
+	up_write(&chan->rpdev_sem);
+
+	/* tell the guest its service went away */
+	spin_lock_irqsave(&chan->lock, flags);
+	owner = chan->owner;
+	if (owner)
+		memcpy(name, owner->name, sizeof(name));
+	spin_unlock_irqrestore(&chan->lock, flags);
+
+	if (owner)
+		vhost_rpmsg_announce(chan, name, RPMSG_NS_DESTROY);
+
+	/* the vhost device it was handed out to keeps it alive */
+	kref_put(&chan->refcount, vhost_rpmsg_release_chan);
+}
+
+static struct rpmsg_device_id vhost_rpmsg_id_table[] = {
+	{ .name	= "rpmsg-vhost" },
+	{ },
+};
+MODULE_DEVICE_TABLE(rpmsg, vhost_rpmsg_id_table);
+
+static struct rpmsg_driver vhost_rpmsg_driver = {
+	.drv.name	= KBUILD_MODNAME,
+	.drv.owner	= THIS_MODULE,
+	.id_table	= vhost_rpmsg_id_table,
+	.probe		= vhost_rpmsg_probe,
+	.callback	= vhost_rpmsg_cb,
+	.remove		= __devexit_p(vhost_rpmsg_remove),
+};
+
+static int vhost_rpmsg_init(void)
+{
+	int r;
+
+	r = register_rpmsg_driver(&vhost_rpmsg_driver);
+	if (r)
+		return r;
+
+	r = misc_register(&vhost_rpmsg_misc);
+	if (r)
+		unregister_rpmsg_driver(&vhost_rpmsg_driver);
+
+	return r;
+}
+module_init(vhost_rpmsg_init);
+
+static void vhost_rpmsg_exit(void)
+{
+	misc_deregister(&vhost_rpmsg_misc);
+	unregister_rpmsg_driver(&vhost_rpmsg_driver);
+}
+module_exit(vhost_rpmsg_exit);
+
+MODULE_LICENSE("GPL v2");
+MODULE_DESCRIPTION("Host kernel accelerator for virtio rpmsg");
@@ -378,7 +378,10 @@ static void vhost_scsi_complete_cmd_work(struct vhost_work *work)
 {
 	struct vhost_scsi *vs = container_of(work, struct vhost_scsi,
 					vs_completion_work);
+	struct vhost_virtqueue *vq = &vs->vqs[VHOST_SCSI_VQ_IO];
 	struct tcm_vhost_cmd *tv_cmd;
+	int nheads = 0;
+	bool added = false;
 
 	while ((tv_cmd = vhost_scsi_get_cmd_from_completion(vs))) {
 		struct virtio_scsi_cmd_resp v_rsp;
@@ -396,15 +399,24 @@ static void vhost_scsi_complete_cmd_work(struct vhost_work *work)
 		memcpy(v_rsp.sense, tv_cmd->tvc_sense_buf,
 		       v_rsp.sense_len);
 		ret = copy_to_user(tv_cmd->tvc_resp, &v_rsp, sizeof(v_rsp));
-		if (likely(ret == 0))
-			vhost_add_used(&vs->vqs[2], tv_cmd->tvc_vq_desc, 0);
-		else
+		if (likely(ret == 0)) {
+			vq->heads[nheads].id = tv_cmd->tvc_vq_desc;
+			vq->heads[nheads].len = 0;
+			if (++nheads == VHOST_USED_BATCH) {
+				vhost_add_used_n(vq, vq->heads, nheads);
+				nheads = 0;
+			}
+			added = true;
+		} else
 			pr_err("Faulted on virtio_scsi_cmd_resp\n");
 
 		vhost_scsi_free_cmd(tv_cmd);
 	}
 
-	vhost_signal(&vs->dev, &vs->vqs[2]);
+	if (nheads)
+		vhost_add_used_n(vq, vq->heads, nheads);
+	if (added)
+		vhost_signal(&vs->dev, vq);
 }
 
 static struct tcm_vhost_cmd *vhost_scsi_allocate_cmd(
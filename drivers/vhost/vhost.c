@@ -25,6 +25,9 @@
 #include <linux/slab.h>
 #include <linux/kthread.h>
 #include <linux/cgroup.h>
+#include <linux/moduleparam.h>
+#include <linux/topology.h>
+#include <linux/sort.h>
 
 #include <linux/net.h>
 #include <linux/if_packet.h>
@@ -39,6 +42,13 @@ enum {
 
 static unsigned vhost_zcopy_mask __read_mostly;
 
+static int shared_workers;
+module_param(shared_workers, int, 0444);
+MODULE_PARM_DESC(shared_workers, "Number of workers per NUMA node shared "
+		 "by all devices instead of one thread per device (0 = off)");
+
+static void vhost_pool_queue_dev(struct vhost_dev *dev);
+
 #define vhost_used_event(vq) ((u16 __user *)&vq->avail->ring[vq->num])
 #define vhost_avail_event(vq) ((u16 __user *)&vq->used->ring[vq->num])
 
@@ -145,7 +155,12 @@ void vhost_work_queue(struct vhost_dev *dev, struct vhost_work *work)
 	if (list_empty(&work->node)) {
 		list_add_tail(&work->node, &dev->work_list);
 		work->queue_seq++;
-		wake_up_process(dev->worker);
+		if (!dev->pooled)
+			wake_up_process(dev->worker);
+		else if (!dev->pool_busy) {
+			dev->pool_busy = true;
+			vhost_pool_queue_dev(dev);
+		}
 	}
 	spin_unlock_irqrestore(&dev->work_lock, flags);
 }
@@ -155,6 +170,12 @@ void vhost_poll_queue(struct vhost_poll *poll)
 	vhost_work_queue(poll->dev, &poll->work);
 }
 
+/* A lockless hint for busy polling: is there other work for the device? */
+bool vhost_has_work(struct vhost_dev *dev)
+{
+	return !list_empty(&dev->work_list);
+}
+
 static void vhost_vq_reset(struct vhost_dev *dev,
 			   struct vhost_virtqueue *vq)
 {
@@ -183,6 +204,8 @@ static void vhost_vq_reset(struct vhost_dev *dev,
 	vq->upend_idx = 0;
 	vq->done_idx = 0;
 	vq->ubufs = NULL;
+	vq->busyloop_timeout = 0;
+	vq->mem_cache = 0;
 }
 
 static int vhost_worker(void *data)
@@ -234,6 +257,265 @@ static int vhost_worker(void *data)
 	return 0;
 }
 
+/*
+ * Shared worker pool.  Instead of a thread per device, devices with work
+ * pending are put on the run queue of the NUMA node their owner was on when
+ * it called VHOST_SET_OWNER, and served by a small set of threads bound to
+ * that node.  Idle threads steal from other nodes' queues.  A device is on
+ * at most one queue and is run by at most one thread at a time (pool_busy,
+ * under work_lock), so works of a device still run in the order they were
+ * queued, exactly as with vhost_worker.  After VHOST_POOL_BATCH works a busy
+ * device goes back to the tail of its queue so others get a turn.
+ */
+#define VHOST_POOL_BATCH 16
+
+struct vhost_pool_node {
+	spinlock_t lock;
+	struct list_head devs;
+	wait_queue_head_t wait;
+	int nr_workers;
+};
+
+static struct vhost_pool {
+	struct mutex mutex;
+	int users;
+	struct vhost_pool_node *nodes;
+	struct task_struct **workers;
+	int nr_workers;
+	wait_queue_head_t idle;
+} vhost_pool = {
+	.mutex = __MUTEX_INITIALIZER(vhost_pool.mutex),
+	.idle = __WAIT_QUEUE_HEAD_INITIALIZER(vhost_pool.idle),
+};
+
+/* Called with dev->work_lock held, pool_busy just set or still set. */
+static void vhost_pool_queue_dev(struct vhost_dev *dev)
+{
+	struct vhost_pool_node *pn = &vhost_pool.nodes[dev->pool_node];
+	bool backlog;
+	int node;
+
+	spin_lock(&pn->lock);
+	backlog = !list_empty(&pn->devs);
+	list_add_tail(&dev->pool_entry, &pn->devs);
+	spin_unlock(&pn->lock);
+	wake_up(&pn->wait);
+
+	/* All workers on this node may be busy: let another node steal. */
+	if (!backlog)
+		return;
+	for (node = next_node(dev->pool_node, node_online_map);;
+	     node = next_node(node, node_online_map)) {
+		if (node >= MAX_NUMNODES) {
+			node = first_node(node_online_map);
+			if (node >= MAX_NUMNODES)
+				break;
+		}
+		if (node == dev->pool_node)
+			break;
+		if (vhost_pool.nodes[node].nr_workers) {
+			wake_up(&vhost_pool.nodes[node].wait);
+			break;
+		}
+	}
+}
+
+static struct vhost_dev *vhost_pool_pick(int node)
+{
+	struct vhost_pool_node *pn;
+	struct vhost_dev *dev = NULL;
+	int i;
+
+	/* Own node first, then steal. */
+	for (i = 0; i < nr_node_ids && !dev; ++i) {
+		pn = &vhost_pool.nodes[(node + i) % nr_node_ids];
+		if (!pn->nr_workers)
+			continue;
+		spin_lock_irq(&pn->lock);
+		if (!list_empty(&pn->devs)) {
+			dev = list_first_entry(&pn->devs, struct vhost_dev,
+					       pool_entry);
+			list_del_init(&dev->pool_entry);
+		}
+		spin_unlock_irq(&pn->lock);
+	}
+	return dev;
+}
+
+static void vhost_pool_run(struct vhost_dev *dev)
+{
+	struct mm_struct *mm = dev->mm;
+	struct vhost_work *work = NULL;
+	unsigned uninitialized_var(seq);
+	int n = 0;
+
+	use_mm(mm);
+	for (;;) {
+		spin_lock_irq(&dev->work_lock);
+		if (work) {
+			work->done_seq = seq;
+			if (work->flushing)
+				wake_up_all(&work->done);
+		}
+		if (list_empty(&dev->work_list) || n++ == VHOST_POOL_BATCH)
+			break;
+		work = list_first_entry(&dev->work_list,
+					struct vhost_work, node);
+		list_del_init(&work->node);
+		seq = work->queue_seq;
+		spin_unlock_irq(&dev->work_lock);
+
+		work->fn(work);
+		cond_resched();
+	}
+	if (list_empty(&dev->work_list))
+		dev->pool_busy = false;
+	else
+		vhost_pool_queue_dev(dev);
+	spin_unlock_irq(&dev->work_lock);
+	/* dev may be gone now; the mm is kept alive by use_mm. */
+	unuse_mm(mm);
+	wake_up_all(&vhost_pool.idle);
+}
+
+static int vhost_pool_worker(void *data)
+{
+	struct vhost_pool_node *pn;
+	struct vhost_dev *dev;
+	int node = (long)data;
+	mm_segment_t oldfs = get_fs();
+	DEFINE_WAIT(wait);
+
+	pn = &vhost_pool.nodes[node];
+	set_fs(USER_DS);
+	for (;;) {
+		prepare_to_wait_exclusive(&pn->wait, &wait,
+					  TASK_INTERRUPTIBLE);
+		dev = vhost_pool_pick(node);
+		if (dev) {
+			finish_wait(&pn->wait, &wait);
+			vhost_pool_run(dev);
+			continue;
+		}
+		if (kthread_should_stop())
+			break;
+		schedule();
+	}
+	finish_wait(&pn->wait, &wait);
+	set_fs(oldfs);
+	return 0;
+}
+
+static void vhost_pool_stop(void)
+{
+	int i;
+
+	for (i = 0; i < vhost_pool.nr_workers; ++i)
+		kthread_stop(vhost_pool.workers[i]);
+	kfree(vhost_pool.workers);
+	kfree(vhost_pool.nodes);
+	vhost_pool.workers = NULL;
+	vhost_pool.nodes = NULL;
+	vhost_pool.nr_workers = 0;
+}
+
+static int vhost_pool_start(void)
+{
+	struct task_struct *worker;
+	int node, i, err;
+
+	vhost_pool.nodes = kcalloc(nr_node_ids, sizeof *vhost_pool.nodes,
+				   GFP_KERNEL);
+	vhost_pool.workers = kcalloc(num_node_state(N_CPU) * shared_workers,
+				     sizeof *vhost_pool.workers, GFP_KERNEL);
+	if (!vhost_pool.nodes || !vhost_pool.workers) {
+		err = -ENOMEM;
+		goto err;
+	}
+	for (node = 0; node < nr_node_ids; ++node) {
+		spin_lock_init(&vhost_pool.nodes[node].lock);
+		INIT_LIST_HEAD(&vhost_pool.nodes[node].devs);
+		init_waitqueue_head(&vhost_pool.nodes[node].wait);
+	}
+
+	for_each_node_state(node, N_CPU) {
+		for (i = 0; i < shared_workers; ++i) {
+			worker = kthread_create_on_node(vhost_pool_worker,
+							(void *)(long)node,
+							node, "vhost-n%d/%d",
+							node, i);
+			if (IS_ERR(worker)) {
+				err = PTR_ERR(worker);
+				goto err;
+			}
+			set_cpus_allowed_ptr(worker, cpumask_of_node(node));
+			vhost_pool.workers[vhost_pool.nr_workers++] = worker;
+			vhost_pool.nodes[node].nr_workers++;
+			wake_up_process(worker);
+		}
+	}
+	return 0;
+err:
+	vhost_pool_stop();
+	return err;
+}
+
+/* Take a reference on the pool, starting it for the first device. */
+static int vhost_pool_get(void)
+{
+	int err = 0;
+
+	mutex_lock(&vhost_pool.mutex);
+	if (!vhost_pool.users)
+		err = vhost_pool_start();
+	if (!err)
+		vhost_pool.users++;
+	mutex_unlock(&vhost_pool.mutex);
+	return err;
+}
+
+static void vhost_pool_put(void)
+{
+	mutex_lock(&vhost_pool.mutex);
+	if (!--vhost_pool.users)
+		vhost_pool_stop();
+	mutex_unlock(&vhost_pool.mutex);
+}
+
+static bool vhost_pool_dev_idle(struct vhost_dev *dev)
+{
+	bool idle;
+
+	spin_lock_irq(&dev->work_lock);
+	idle = !dev->pool_busy;
+	spin_unlock_irq(&dev->work_lock);
+	return idle;
+}
+
+/* Caller should have device mutex */
+static int vhost_dev_attach_pool(struct vhost_dev *dev)
+{
+	int node = numa_node_id();
+	int err;
+
+	err = vhost_pool_get();
+	if (err)
+		return err;
+	if (!vhost_pool.nodes[node].nr_workers)
+		node = first_node(node_states[N_CPU]);
+	dev->pool_node = node;
+	dev->pooled = true;
+	return 0;
+}
+
+static void vhost_dev_detach_pool(struct vhost_dev *dev)
+{
+	/* Flushed already, but a worker may still be on its way out. */
+	wait_event(vhost_pool.idle, vhost_pool_dev_idle(dev));
+	dev->pooled = false;
+	vhost_pool_put();
+}
+
 static void vhost_vq_free_iovecs(struct vhost_virtqueue *vq)
 {
 	kfree(vq->indirect);
@@ -305,6 +587,9 @@ long vhost_dev_init(struct vhost_dev *dev,
 	spin_lock_init(&dev->work_lock);
 	INIT_LIST_HEAD(&dev->work_list);
 	dev->worker = NULL;
+	dev->pooled = false;
+	dev->pool_busy = false;
+	INIT_LIST_HEAD(&dev->pool_entry);
 
 	for (i = 0; i < dev->nvqs; ++i) {
 		dev->vqs[i].log = NULL;
@@ -368,6 +653,17 @@ static long vhost_dev_set_owner(struct vhost_dev *dev)
 
 	/* No owner, become one */
 	dev->mm = get_task_mm(current);
+	if (shared_workers > 0) {
+		/* Pool threads are shared, so they can't join our cgroups. */
+		err = vhost_dev_attach_pool(dev);
+		if (err)
+			goto err_worker;
+		err = vhost_dev_alloc_iovecs(dev);
+		if (err)
+			goto err_pool;
+		return 0;
+	}
+
 	worker = kthread_create(vhost_worker, dev, "vhost-%d", current->pid);
 	if (IS_ERR(worker)) {
 		err = PTR_ERR(worker);
@@ -389,6 +685,9 @@ static long vhost_dev_set_owner(struct vhost_dev *dev)
 err_cgroup:
 	kthread_stop(worker);
 	dev->worker = NULL;
+	goto err_worker;
+err_pool:
+	vhost_dev_detach_pool(dev);
 err_worker:
 	if (dev->mm)
 		mmput(dev->mm);
@@ -421,20 +720,27 @@ long vhost_dev_reset_owner(struct vhost_dev *dev)
  */
 int vhost_zerocopy_signal_used(struct vhost_virtqueue *vq)
 {
-	int i;
+	int i, add;
 	int j = 0;
 
 	for (i = vq->done_idx; i != vq->upend_idx; i = (i + 1) % UIO_MAXIOV) {
 		if ((vq->heads[i].len == VHOST_DMA_DONE_LEN)) {
 			vq->heads[i].len = VHOST_DMA_CLEAR_LEN;
-			vhost_add_used_and_signal(vq->dev, vq,
-						  vq->heads[i].id, 0);
 			++j;
 		} else
 			break;
 	}
-	if (j)
-		vq->done_idx = i;
+	if (!j)
+		return 0;
+
+	/* Done entries are contiguous in heads, save for the wrap around:
+	 * write them to the used ring in at most two chunks, signal once. */
+	for (i = j; i; i -= add) {
+		add = min(UIO_MAXIOV - vq->done_idx, i);
+		vhost_add_used_n(vq, &vq->heads[vq->done_idx], add);
+		vq->done_idx = (vq->done_idx + add) % UIO_MAXIOV;
+	}
+	vhost_signal(vq->dev, vq);
 	return j;
 }
 
@@ -484,6 +790,8 @@ void vhost_dev_cleanup(struct vhost_dev *dev, bool locked)
 		kthread_stop(dev->worker);
 		dev->worker = NULL;
 	}
+	if (dev->pooled)
+		vhost_dev_detach_pool(dev);
 	if (dev->mm)
 		mmput(dev->mm);
 	dev->mm = NULL;
@@ -599,10 +907,21 @@ int vhost_vq_access_ok(struct vhost_virtqueue *vq)
 		vq_log_access_ok(vq->dev, vq, vq->log_base);
 }
 
+static int vhost_region_cmp(const void *a, const void *b)
+{
+	const struct vhost_memory_region *ra = a, *rb = b;
+
+	if (ra->guest_phys_addr < rb->guest_phys_addr)
+		return -1;
+	return ra->guest_phys_addr > rb->guest_phys_addr;
+}
+
 static long vhost_set_memory(struct vhost_dev *d, struct vhost_memory __user *m)
 {
 	struct vhost_memory mem, *newmem, *oldmem;
 	unsigned long size = offsetof(struct vhost_memory, regions);
+	struct vhost_memory_region *reg;
+	int i;
 
 	if (copy_from_user(&mem, m, size))
 		return -EFAULT;
@@ -621,6 +940,18 @@ static long vhost_set_memory(struct vhost_dev *d, struct vhost_memory __user *m)
 		return -EFAULT;
 	}
 
+	/* find_region relies on sorted, non-overlapping regions. */
+	sort(newmem->regions, newmem->nregions, sizeof *newmem->regions,
+	     vhost_region_cmp, NULL);
+	for (i = 1; i < newmem->nregions; ++i) {
+		reg = newmem->regions + i - 1;
+		if (reg->guest_phys_addr + reg->memory_size >
+		    reg[1].guest_phys_addr) {
+			kfree(newmem);
+			return -EINVAL;
+		}
+	}
+
 	if (!memory_access_ok(d, newmem,
 			      vhost_has_feature(d, VHOST_F_LOG_ALL))) {
 		kfree(newmem);
@@ -700,6 +1031,19 @@ static long vhost_set_vring(struct vhost_dev *d, int ioctl, void __user *argp)
 		if (copy_to_user(argp, &s, sizeof s))
 			r = -EFAULT;
 		break;
+	case VHOST_SET_VRING_BUSYLOOP_TIMEOUT:
+		if (copy_from_user(&s, argp, sizeof s)) {
+			r = -EFAULT;
+			break;
+		}
+		vq->busyloop_timeout = s.num;
+		break;
+	case VHOST_GET_VRING_BUSYLOOP_TIMEOUT:
+		s.index = idx;
+		s.num = vq->busyloop_timeout;
+		if (copy_to_user(argp, &s, sizeof s))
+			r = -EFAULT;
+		break;
 	case VHOST_SET_VRING_ADDR:
 		if (copy_from_user(&a, argp, sizeof a)) {
 			r = -EFAULT;
@@ -909,20 +1253,35 @@ done:
 	return r;
 }
 
-static const struct vhost_memory_region *find_region(struct vhost_memory *mem,
+static const struct vhost_memory_region *find_region(struct vhost_virtqueue *vq,
+						     struct vhost_memory *mem,
 						     __u64 addr, __u32 len)
 {
 	struct vhost_memory_region *reg;
-	int i;
+	int start = 0, end = mem->nregions, i;
 
-	/* linear search is not brilliant, but we really have on the order of 6
-	 * regions in practice */
-	for (i = 0; i < mem->nregions; ++i) {
-		reg = mem->regions + i;
+	/* Descriptors mostly point into the region the last one did.  The
+	 * index may be from an older table: it is only a hint. */
+	if (likely(vq->mem_cache < mem->nregions)) {
+		reg = mem->regions + vq->mem_cache;
 		if (reg->guest_phys_addr <= addr &&
 		    reg->guest_phys_addr + reg->memory_size - 1 >= addr)
 			return reg;
 	}
+
+	/* Regions are sorted by vhost_set_memory. */
+	while (start < end) {
+		i = start + (end - start) / 2;
+		reg = mem->regions + i;
+		if (addr < reg->guest_phys_addr)
+			end = i;
+		else if (addr > reg->guest_phys_addr + reg->memory_size - 1)
+			start = i + 1;
+		else {
+			vq->mem_cache = i;
+			return reg;
+		}
+	}
 	return NULL;
 }
 
@@ -1051,7 +1410,8 @@ int vhost_init_used(struct vhost_virtqueue *vq)
 	return get_user(vq->last_used_idx, &vq->used->idx);
 }
 
-static int translate_desc(struct vhost_dev *dev, u64 addr, u32 len,
+/* Caller should have vq mutex */
+static int translate_desc(struct vhost_virtqueue *vq, u64 addr, u32 len,
 			  struct iovec iov[], int iov_size)
 {
 	const struct vhost_memory_region *reg;
@@ -1062,14 +1422,14 @@ static int translate_desc(struct vhost_dev *dev, u64 addr, u32 len,
 
 	rcu_read_lock();
 
-	mem = rcu_dereference(dev->memory);
+	mem = rcu_dereference(vq->dev->memory);
 	while ((u64)len > s) {
 		u64 size;
 		if (unlikely(ret >= iov_size)) {
 			ret = -ENOBUFS;
 			break;
 		}
-		reg = find_region(mem, addr, len);
+		reg = find_region(vq, mem, addr, len);
 		if (unlikely(!reg)) {
 			ret = -EFAULT;
 			break;
@@ -1128,7 +1488,7 @@ static int get_indirect(struct vhost_dev *dev, struct vhost_virtqueue *vq,
 		return -EINVAL;
 	}
 
-	ret = translate_desc(dev, indirect->addr, indirect->len, vq->indirect,
+	ret = translate_desc(vq, indirect->addr, indirect->len, vq->indirect,
 			     UIO_MAXIOV);
 	if (unlikely(ret < 0)) {
 		vq_err(vq, "Translation failure %d in indirect.\n", ret);
@@ -1168,7 +1528,7 @@ static int get_indirect(struct vhost_dev *dev, struct vhost_virtqueue *vq,
 			return -EINVAL;
 		}
 
-		ret = translate_desc(dev, desc.addr, desc.len, iov + iov_count,
+		ret = translate_desc(vq, desc.addr, desc.len, iov + iov_count,
 				     iov_size - iov_count);
 		if (unlikely(ret < 0)) {
 			vq_err(vq, "Translation failure %d indirect idx %d\n",
@@ -1290,7 +1650,7 @@ int vhost_get_vq_desc(struct vhost_dev *dev, struct vhost_virtqueue *vq,
 			continue;
 		}
 
-		ret = translate_desc(dev, desc.addr, desc.len, iov + iov_count,
+		ret = translate_desc(vq, desc.addr, desc.len, iov + iov_count,
 				     iov_size - iov_count);
 		if (unlikely(ret < 0)) {
 			vq_err(vq, "Translation failure %d descriptor idx %d\n",
@@ -1333,6 +1693,16 @@ void vhost_discard_vq_desc(struct vhost_virtqueue *vq, int n)
 	vq->last_avail_idx -= n;
 }
 
+/* Cheap check for new available buffers, for busy polling. */
+bool vhost_vq_avail_empty(struct vhost_dev *dev, struct vhost_virtqueue *vq)
+{
+	u16 avail_idx;
+
+	if (__get_user(avail_idx, &vq->avail->idx))
+		return false;
+	return avail_idx == vq->avail_idx;
+}
+
 /* After we've used one of their buffers, we tell them about it.  We'll then
  * want to notify the guest, using eventfd. */
 int vhost_add_used(struct vhost_virtqueue *vq, unsigned int head, int len)
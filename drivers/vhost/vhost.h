@@ -18,6 +18,10 @@
 #define VHOST_DMA_DONE_LEN	1
 #define VHOST_DMA_CLEAR_LEN	0
 
+/* Used ring entries collected in vq->heads before they are written out
+ * with a single vhost_add_used_n */
+#define VHOST_USED_BATCH	64
+
 struct vhost_device;
 
 struct vhost_work;
@@ -144,6 +148,10 @@ struct vhost_virtqueue {
 	/* Reference counting for outstanding ubufs.
 	 * Protected by vq mutex. Writers must also take device mutex. */
 	struct vhost_ubuf_ref *ubufs;
+	/* Microseconds to busy poll before enabling notification. */
+	unsigned busyloop_timeout;
+	/* Index of the memory region last found by find_region. */
+	u32 mem_cache;
 };
 
 struct vhost_dev {
@@ -161,6 +169,11 @@ struct vhost_dev {
 	spinlock_t work_lock;
 	struct list_head work_list;
 	struct task_struct *worker;
+	/* Shared worker pool, see shared_workers in vhost.c */
+	bool pooled;
+	bool pool_busy;
+	int pool_node;
+	struct list_head pool_entry;
 };
 
 long vhost_dev_init(struct vhost_dev *, struct vhost_virtqueue *vqs, int nvqs);
@@ -176,6 +189,8 @@ int vhost_get_vq_desc(struct vhost_dev *, struct vhost_virtqueue *,
 		      unsigned int *out_num, unsigned int *in_num,
 		      struct vhost_log *log, unsigned int *log_num);
 void vhost_discard_vq_desc(struct vhost_virtqueue *, int n);
+bool vhost_vq_avail_empty(struct vhost_dev *, struct vhost_virtqueue *);
+bool vhost_has_work(struct vhost_dev *);
 
 int vhost_init_used(struct vhost_virtqueue *);
 int vhost_add_used(struct vhost_virtqueue *, unsigned int head, int len);
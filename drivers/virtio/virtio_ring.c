@@ -93,6 +93,24 @@ struct vring_virtqueue
 	/* Host publishes avail event idx */
 	bool event;
 
+	/* The ring is in the packed layout (VIRTIO_RING_F_PACKED) */
+	bool packed;
+
+	/* Actual memory layout for this queue, if it's packed */
+	struct vring_packed packed_vring;
+
+	/* Packed: next descriptor to make available, and its wrap counter */
+	u16 next_avail_idx;
+	bool avail_wrap_counter;
+	/* Packed: the avail/used flags bits that mark a descriptor available */
+	u16 avail_used_flags;
+	/* Packed: wrap counter of last_used_idx */
+	bool used_wrap_counter;
+	/* Packed: what we last told the host about interrupting us */
+	u16 event_flags_shadow;
+	/* Packed: number of descriptors of each buffer, indexed like data */
+	u16 *desc_num;
+
 	/* Number of free buffers */
 	unsigned int num_free;
 	/* Head of free buffer list. */
@@ -103,6 +121,9 @@ struct vring_virtqueue
 	/* Last used index we've seen. */
 	u16 last_used_idx;
 
+	/* Host's used index, as of the last time we had run out of buffers */
+	u16 used_idx_shadow;
+
 	/* How to notify other side. FIXME: commonalize hcalls! */
 	void (*notify)(struct virtqueue *vq);
 
@@ -118,7 +139,7 @@ struct vring_virtqueue
 	ktime_t last_add_time;
 #endif
 
-	/* Tokens for callbacks. */
+	/* Tokens for callbacks (followed by desc_num, if it's packed). */
 	void *data[];
 };
 
@@ -174,6 +195,205 @@ static int vring_add_indirect(struct vring_virtqueue *vq,
 	return head;
 }
 
+#define VRING_PACKED_AVAIL	(1 << VRING_PACKED_DESC_F_AVAIL)
+#define VRING_PACKED_USED	(1 << VRING_PACKED_DESC_F_USED)
+
+/* Has the host used the packed ring's descriptor at @idx, in @wrap's lap ? */
+static inline bool is_used_desc_packed(const struct vring_virtqueue *vq,
+				       u16 idx, bool wrap)
+{
+	u16 flags = vq->packed_vring.desc[idx].flags;
+	bool avail = flags & VRING_PACKED_AVAIL;
+	bool used = flags & VRING_PACKED_USED;
+
+	return avail == used && used == wrap;
+}
+
+/* Add a buffer to a packed ring: its descriptors are consecutive, and the
+ * first one is only marked available once the others are in place. */
+static int vring_add_buf_packed(struct vring_virtqueue *vq,
+				struct scatterlist sg[],
+				unsigned int out,
+				unsigned int in,
+				void *data)
+{
+	struct vring_packed_desc *desc = vq->packed_vring.desc;
+	unsigned int total = out + in, i, n;
+	u16 head, flags, uninitialized_var(head_flags);
+
+	BUG_ON(total > vq->vring.num);
+	BUG_ON(total == 0);
+
+	if (vq->num_free < total) {
+		pr_debug("Can't add buf len %i - avail = %i\n",
+			 total, vq->num_free);
+		/* Same as the split ring: force a notify for outgoing parts. */
+		if (out)
+			vq->notify(&vq->vq);
+		return -ENOSPC;
+	}
+
+	head = i = vq->next_avail_idx;
+	for (n = 0; n < total; n++, sg++) {
+		flags = vq->avail_used_flags;
+		if (n >= out)
+			flags |= VRING_DESC_F_WRITE;
+		if (n + 1 < total)
+			flags |= VRING_DESC_F_NEXT;
+
+		desc[i].addr = sg_phys(sg);
+		desc[i].len = sg->length;
+		desc[i].id = head;
+		if (i == head)
+			head_flags = flags;
+		else
+			desc[i].flags = flags;
+
+		if (++i >= vq->vring.num) {
+			i = 0;
+			vq->avail_wrap_counter ^= 1;
+			vq->avail_used_flags ^= VRING_PACKED_AVAIL |
+						VRING_PACKED_USED;
+		}
+	}
+
+	/* Buffers are used in order, so the head doubles as the buffer id. */
+	vq->data[head] = data;
+	vq->desc_num[head] = total;
+
+	vq->next_avail_idx = i;
+	vq->num_free -= total;
+	vq->num_added += total;
+
+	/* The other descriptors need to be set before we expose the head. */
+	virtio_wmb(vq);
+	desc[head].flags = head_flags;
+
+	pr_debug("Added buffer head %i to %p\n", head, vq);
+
+	return vq->num_free;
+}
+
+static bool vring_kick_prepare_packed(struct vring_virtqueue *vq)
+{
+	struct vring_packed_desc_event *event = vq->packed_vring.device;
+	u16 new, old, off_wrap, flags, event_idx;
+
+	old = vq->next_avail_idx - vq->num_added;
+	new = vq->next_avail_idx;
+	vq->num_added = 0;
+
+	off_wrap = ACCESS_ONCE(event->off_wrap);
+	flags = ACCESS_ONCE(event->flags);
+
+	if (flags != VRING_PACKED_EVENT_FLAG_DESC)
+		return flags != VRING_PACKED_EVENT_FLAG_DISABLE;
+
+	/* An offset from the previous lap is behind us. */
+	event_idx = off_wrap & ~(1 << VRING_PACKED_EVENT_F_WRAP_CTR);
+	if (!!(off_wrap >> VRING_PACKED_EVENT_F_WRAP_CTR) !=
+						vq->avail_wrap_counter)
+		event_idx -= vq->vring.num;
+
+	return vring_need_event(event_idx, new, old);
+}
+
+/* Tell the host what we want to be interrupted about, if it changed. */
+static void vring_set_event_flags_packed(struct vring_virtqueue *vq, u16 flags)
+{
+	if (vq->event_flags_shadow == flags)
+		return;
+
+	vq->event_flags_shadow = flags;
+	vq->packed_vring.driver->flags = flags;
+}
+
+/* Point the host at the packed ring's descriptor we want an interrupt for. */
+static void vring_set_used_event_packed(struct vring_virtqueue *vq,
+					u16 idx, bool wrap)
+{
+	vq->packed_vring.driver->off_wrap = idx |
+				(wrap << VRING_PACKED_EVENT_F_WRAP_CTR);
+}
+
+static void *vring_get_buf_packed(struct vring_virtqueue *vq,
+				  unsigned int *len)
+{
+	struct vring_packed_desc *desc = vq->packed_vring.desc;
+	u16 last = vq->last_used_idx;
+	unsigned int id;
+	void *ret;
+
+	id = desc[last].id;
+	*len = desc[last].len;
+
+	if (unlikely(id != last)) {
+		BAD_RING(vq, "id %u used out of order (expected %u)\n",
+			 id, last);
+		return NULL;
+	}
+	if (unlikely(!vq->data[id])) {
+		BAD_RING(vq, "id %u is not a head!\n", id);
+		return NULL;
+	}
+
+	ret = vq->data[id];
+	vq->data[id] = NULL;
+	vq->num_free += vq->desc_num[id];
+
+	/* The used descriptor stands for all the descriptors of the buffer. */
+	last += vq->desc_num[id];
+	if (last >= vq->vring.num) {
+		last -= vq->vring.num;
+		vq->used_wrap_counter ^= 1;
+	}
+	vq->last_used_idx = last;
+
+	/* If we expect an interrupt for the next entry, tell host
+	 * by writing event index and flush out the write before
+	 * the read in the next get_buf call. */
+	if (vq->event_flags_shadow == VRING_PACKED_EVENT_FLAG_DESC) {
+		vring_set_used_event_packed(vq, last, vq->used_wrap_counter);
+		virtio_mb(vq);
+	}
+
+	return ret;
+}
+
+/* Re-enable the callbacks of a packed ring. Returns the index of the
+ * buffer whose use we'll be interrupted for (along with its wrap
+ * counter): the last one that starts at most @bufs descriptors past the
+ * last used one. */
+static u16 vring_enable_cb_packed(struct vring_virtqueue *vq, u16 bufs,
+				  bool *wrap)
+{
+	u16 idx = vq->last_used_idx;
+
+	*wrap = vq->used_wrap_counter;
+
+	if (!vq->event) {
+		vring_set_event_flags_packed(vq, VRING_PACKED_EVENT_FLAG_ENABLE);
+		return idx;
+	}
+
+	/* The host only marks the head of each buffer used. */
+	while (vq->data[idx] && vq->desc_num[idx] <= bufs) {
+		bufs -= vq->desc_num[idx];
+		idx += vq->desc_num[idx];
+		if (idx >= vq->vring.num) {
+			idx -= vq->vring.num;
+			*wrap ^= 1;
+		}
+	}
+
+	/* The event offset needs to be set before the flags point at it. */
+	vring_set_used_event_packed(vq, idx, *wrap);
+	virtio_wmb(vq);
+	vring_set_event_flags_packed(vq, VRING_PACKED_EVENT_FLAG_DESC);
+
+	return idx;
+}
+
 int virtqueue_get_queue_index(struct virtqueue *_vq)
 {
 	struct vring_virtqueue *vq = to_vvq(_vq);
@@ -226,6 +446,17 @@ int virtqueue_add_buf(struct virtqueue *_vq,
 	}
 #endif
 
+	if (vq->packed) {
+		int ret = vring_add_buf_packed(vq, sg, out, in, data);
+
+		/* Indices only make sense within a lap of the ring: kick
+		 * before the host could lose track of ours. */
+		if (unlikely(vq->num_added >= vq->vring.num))
+			virtqueue_kick(_vq);
+		END_USE(vq);
+		return ret;
+	}
+
 	/* If the host supports indirect descriptor tables, and we have multiple
 	 * buffers, then go indirect. FIXME: tune this threshold */
 	if (vq->indirect && (out + in) > 1 && vq->num_free) {
@@ -322,6 +553,12 @@ bool virtqueue_kick_prepare(struct virtqueue *_vq)
 	 * event. */
 	virtio_mb(vq);
 
+	if (vq->packed) {
+		needs_kick = vring_kick_prepare_packed(vq);
+		END_USE(vq);
+		return needs_kick;
+	}
+
 	old = vq->vring.avail->idx - vq->num_added;
 	new = vq->vring.avail->idx;
 	vq->num_added = 0;
@@ -384,6 +621,15 @@ static void detach_buf(struct vring_virtqueue *vq, unsigned int head)
 	/* Clear data ptr. */
 	vq->data[head] = NULL;
 
+	/* Single descriptor (e.g. rpmsg's): nothing to walk or free. */
+	if (likely(!(vq->vring.desc[head].flags &
+		     (VRING_DESC_F_NEXT | VRING_DESC_F_INDIRECT)))) {
+		vq->vring.desc[head].next = vq->free_head;
+		vq->free_head = head;
+		vq->num_free++;
+		return;
+	}
+
 	/* Put back on free list: find end */
 	i = head;
 
@@ -404,6 +650,10 @@ static void detach_buf(struct vring_virtqueue *vq, unsigned int head)
 
 static inline bool more_used(const struct vring_virtqueue *vq)
 {
+	if (vq->packed)
+		return is_used_desc_packed(vq, vq->last_used_idx,
+					   vq->used_wrap_counter);
+
 	return vq->last_used_idx != vq->vring.used->idx;
 }
 
@@ -437,14 +687,35 @@ void *virtqueue_get_buf(struct virtqueue *_vq, unsigned int *len)
 		return NULL;
 	}
 
-	if (!more_used(vq)) {
-		pr_debug("No more buffers in queue\n");
+	if (vq->packed) {
+		if (!more_used(vq)) {
+			pr_debug("No more buffers in queue\n");
+			END_USE(vq);
+			return NULL;
+		}
+
+		/* Only get used entries after they have been exposed by host. */
+		virtio_rmb(vq);
+
+		ret = vring_get_buf_packed(vq, len);
 		END_USE(vq);
-		return NULL;
+		return ret;
 	}
 
-	/* Only get used array entries after they have been exposed by host. */
-	virtio_rmb(vq);
+	/* Reclaim used buffers in bulk: only read the host's used index (and
+	 * pay for the barrier) once we're done with those we already saw. */
+	if (vq->last_used_idx == vq->used_idx_shadow) {
+		vq->used_idx_shadow = vq->vring.used->idx;
+		if (vq->last_used_idx == vq->used_idx_shadow) {
+			pr_debug("No more buffers in queue\n");
+			END_USE(vq);
+			return NULL;
+		}
+
+		/* Only get used array entries after they have been exposed
+		 * by host. */
+		virtio_rmb(vq);
+	}
 
 	last_used = (vq->last_used_idx & (vq->vring.num - 1));
 	i = vq->vring.used->ring[last_used].id;
@@ -493,6 +764,11 @@ void virtqueue_disable_cb(struct virtqueue *_vq)
 {
 	struct vring_virtqueue *vq = to_vvq(_vq);
 
+	if (vq->packed) {
+		vring_set_event_flags_packed(vq, VRING_PACKED_EVENT_FLAG_DISABLE);
+		return;
+	}
+
 	vq->vring.avail->flags |= VRING_AVAIL_F_NO_INTERRUPT;
 }
 EXPORT_SYMBOL_GPL(virtqueue_disable_cb);
@@ -511,9 +787,22 @@ EXPORT_SYMBOL_GPL(virtqueue_disable_cb);
 bool virtqueue_enable_cb(struct virtqueue *_vq)
 {
 	struct vring_virtqueue *vq = to_vvq(_vq);
+	bool wrap;
 
 	START_USE(vq);
 
+	if (vq->packed) {
+		vring_enable_cb_packed(vq, 0, &wrap);
+		virtio_mb(vq);
+		if (unlikely(more_used(vq))) {
+			END_USE(vq);
+			return false;
+		}
+
+		END_USE(vq);
+		return true;
+	}
+
 	/* We optimistically turn back on interrupts, then check if there was
 	 * more to do. */
 	/* Depending on the VIRTIO_RING_F_EVENT_IDX feature, we need to
@@ -548,10 +837,26 @@ EXPORT_SYMBOL_GPL(virtqueue_enable_cb);
 bool virtqueue_enable_cb_delayed(struct virtqueue *_vq)
 {
 	struct vring_virtqueue *vq = to_vvq(_vq);
-	u16 bufs;
+	u16 bufs, idx;
+	bool wrap;
 
 	START_USE(vq);
 
+	if (vq->packed) {
+		/* TODO: tune this threshold */
+		bufs = (vq->vring.num - vq->num_free) * 3 / 4;
+		idx = vring_enable_cb_packed(vq, bufs, &wrap);
+		virtio_mb(vq);
+		/* Buffers are used in order: has the host gone past it ? */
+		if (unlikely(is_used_desc_packed(vq, idx, wrap))) {
+			END_USE(vq);
+			return false;
+		}
+
+		END_USE(vq);
+		return true;
+	}
+
 	/* We optimistically turn back on interrupts, then check if there was
 	 * more to do. */
 	/* Depending on the VIRTIO_RING_F_USED_EVENT_IDX feature, we need to
@@ -593,6 +898,12 @@ void *virtqueue_detach_unused_buf(struct virtqueue *_vq)
 			continue;
 		/* detach_buf clears data, so grab it now. */
 		buf = vq->data[i];
+		if (vq->packed) {
+			vq->data[i] = NULL;
+			vq->num_free += vq->desc_num[i];
+			END_USE(vq);
+			return buf;
+		}
 		detach_buf(vq, i);
 		vq->vring.avail->idx--;
 		END_USE(vq);
@@ -638,6 +949,7 @@ struct virtqueue *vring_new_virtqueue(unsigned int index,
 {
 	struct vring_virtqueue *vq;
 	unsigned int i;
+	bool packed = virtio_has_feature(vdev, VIRTIO_RING_F_PACKED);
 
 	/* We assume num is a power of 2. */
 	if (num & (num - 1)) {
@@ -645,11 +957,20 @@ struct virtqueue *vring_new_virtqueue(unsigned int index,
 		return NULL;
 	}
 
-	vq = kmalloc(sizeof(*vq) + sizeof(void *)*num, GFP_KERNEL);
+	vq = kmalloc(sizeof(*vq) + sizeof(void *)*num +
+		     (packed ? sizeof(u16)*num : 0), GFP_KERNEL);
 	if (!vq)
 		return NULL;
 
-	vring_init(&vq->vring, num, pages, vring_align);
+	vq->packed = packed;
+	if (packed) {
+		/* Only the split ring's num is of any use then. */
+		memset(&vq->vring, 0, sizeof(vq->vring));
+		vq->vring.num = num;
+		vring_packed_init(&vq->packed_vring, num, pages, vring_align);
+		vq->desc_num = (u16 *)&vq->data[num];
+	} else
+		vring_init(&vq->vring, num, pages, vring_align);
 	vq->vq.callback = callback;
 	vq->vq.vdev = vdev;
 	vq->vq.name = name;
@@ -657,6 +978,7 @@ struct virtqueue *vring_new_virtqueue(unsigned int index,
 	vq->weak_barriers = weak_barriers;
 	vq->broken = false;
 	vq->last_used_idx = 0;
+	vq->used_idx_shadow = 0;
 	vq->num_added = 0;
 	vq->queue_index = index;
 	list_add_tail(&vq->vq.list, &vdev->vqs);
@@ -668,6 +990,27 @@ struct virtqueue *vring_new_virtqueue(unsigned int index,
 	vq->indirect = virtio_has_feature(vdev, VIRTIO_RING_F_INDIRECT_DESC);
 	vq->event = virtio_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX);
 
+	if (packed) {
+		/* The first lap of the ring has both wrap counters set. */
+		vq->next_avail_idx = 0;
+		vq->avail_wrap_counter = true;
+		vq->avail_used_flags = VRING_PACKED_AVAIL;
+		vq->used_wrap_counter = true;
+		vq->event_flags_shadow = VRING_PACKED_EVENT_FLAG_ENABLE;
+		vq->packed_vring.driver->flags = VRING_PACKED_EVENT_FLAG_ENABLE;
+
+		/* No callback?  Tell other side not to bother us. */
+		if (!callback)
+			vring_set_event_flags_packed(vq,
+					VRING_PACKED_EVENT_FLAG_DISABLE);
+
+		vq->num_free = num;
+		for (i = 0; i < num; i++)
+			vq->data[i] = NULL;
+
+		return &vq->vq;
+	}
+
 	/* No callback?  Tell other side not to bother us. */
 	if (!callback)
 		vq->vring.avail->flags |= VRING_AVAIL_F_NO_INTERRUPT;
@@ -703,6 +1046,8 @@ void vring_transport_features(struct virtio_device *vdev)
 			break;
 		case VIRTIO_RING_F_EVENT_IDX:
 			break;
+		case VIRTIO_RING_F_PACKED:
+			break;
 		default:
 			/* We don't understand this bit. */
 			clear_bit(i, vdev->features);
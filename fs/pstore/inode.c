@@ -318,6 +318,9 @@ int pstore_mkfile(enum pstore_type_id type, char *psname, u64 id,
 	case PSTORE_TYPE_FTRACE:
 		sprintf(name, "ftrace-%s", psname);
 		break;
+	case PSTORE_TYPE_RPROC:
+		sprintf(name, "rproc-%s", psname);
+		break;
 	case PSTORE_TYPE_MCE:
 		sprintf(name, "mce-%s-%lld", psname, id);
 		break;
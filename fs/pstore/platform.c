@@ -255,6 +255,48 @@ int pstore_register(struct pstore_info *psi)
 }
 EXPORT_SYMBOL_GPL(pstore_register);
 
+/**
+ * pstore_write_rproc() - log events of remote processors
+ * @buf: the text of the events
+ * @size: length of @buf, in bytes
+ *
+ * Appends @buf to the remote processor record of the backend (a ring in
+ * persistent RAM, with ramoops), which keeps the crashes of the remote
+ * processors across resets of the host. Can't be called from atomic
+ * context if the backend sleeps as it writes.
+ *
+ * Returns 0 on success, -ENODEV if there's no backend, or the error the
+ * backend returned (e.g. if it has no room for such records).
+ */
+int pstore_write_rproc(const char *buf, size_t size)
+{
+	unsigned long flags;
+	size_t c;
+	u64 id;
+	int ret = 0;
+
+	if (!psinfo)
+		return -ENODEV;
+
+	if (!psinfo->bufsize)
+		return -ENOSPC;
+
+	while (size && !ret) {
+		c = min(size, psinfo->bufsize);
+
+		spin_lock_irqsave(&psinfo->buf_lock, flags);
+		memcpy(psinfo->buf, buf, c);
+		ret = psinfo->write(PSTORE_TYPE_RPROC, 0, &id, 0, c, psinfo);
+		spin_unlock_irqrestore(&psinfo->buf_lock, flags);
+
+		buf += c;
+		size -= c;
+	}
+
+	return ret;
+}
+EXPORT_SYMBOL_GPL(pstore_write_rproc);
+
 /*
  * Read all the records from the persistent store. Create
  * files in our filesystem.  Don't warn about -EEXIST errors
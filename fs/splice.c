@@ -263,6 +263,7 @@ ssize_t splice_to_pipe(struct pipe_inode_info *pipe,
 
 	return ret;
 }
+EXPORT_SYMBOL_GPL(splice_to_pipe);
 
 void spd_release_page(struct splice_pipe_desc *spd, unsigned int i)
 {
@@ -291,6 +292,7 @@ int splice_grow_spd(const struct pipe_inode_info *pipe, struct splice_pipe_desc
 	kfree(spd->partial);
 	return -ENOMEM;
 }
+EXPORT_SYMBOL_GPL(splice_grow_spd);
 
 void splice_shrink_spd(struct splice_pipe_desc *spd)
 {
@@ -300,6 +302,7 @@ void splice_shrink_spd(struct splice_pipe_desc *spd)
 	kfree(spd->pages);
 	kfree(spd->partial);
 }
+EXPORT_SYMBOL_GPL(splice_shrink_spd);
 
 static int
 __generic_file_splice_read(struct file *in, loff_t *ppos,
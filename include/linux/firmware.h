@@ -45,6 +45,8 @@ int request_firmware_nowait(
 	struct module *module, bool uevent,
 	const char *name, struct device *device, gfp_t gfp, void *context,
 	void (*cont)(const struct firmware *fw, void *context));
+int request_firmware_into_buf(const struct firmware **fw, const char *name,
+			      struct device *device, void *buf, size_t size);
 
 void release_firmware(const struct firmware *fw);
 int cache_firmware(const char *name);
@@ -64,6 +66,14 @@ static inline int request_firmware_nowait(
 	return -EINVAL;
 }
 
+static inline int request_firmware_into_buf(const struct firmware **fw,
+					    const char *name,
+					    struct device *device,
+					    void *buf, size_t size)
+{
+	return -EINVAL;
+}
+
 static inline void release_firmware(const struct firmware *fw)
 {
 }
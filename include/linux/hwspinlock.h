@@ -69,8 +69,11 @@ int hwspin_lock_free(struct hwspinlock *hwlock);
 int hwspin_lock_get_id(struct hwspinlock *hwlock);
 int __hwspin_lock_timeout(struct hwspinlock *, unsigned int, int,
 							unsigned long *);
+int __hwspin_lock_wait(struct hwspinlock *, unsigned int, int,
+							unsigned long *);
 int __hwspin_trylock(struct hwspinlock *, int, unsigned long *);
 void __hwspin_unlock(struct hwspinlock *, int, unsigned long *);
+void hwspin_lock_notify(struct hwspinlock *hwlock);
 
 #else /* !CONFIG_HWSPINLOCK */
 
@@ -109,6 +112,13 @@ int __hwspin_lock_timeout(struct hwspinlock *hwlock, unsigned int to,
 	return 0;
 }
 
+static inline
+int __hwspin_lock_wait(struct hwspinlock *hwlock, unsigned int to,
+					int mode, unsigned long *flags)
+{
+	return 0;
+}
+
 static inline
 int __hwspin_trylock(struct hwspinlock *hwlock, int mode, unsigned long *flags)
 {
@@ -125,6 +135,10 @@ static inline int hwspin_lock_get_id(struct hwspinlock *hwlock)
 	return 0;
 }
 
+static inline void hwspin_lock_notify(struct hwspinlock *hwlock)
+{
+}
+
 #endif /* !CONFIG_HWSPINLOCK */
 
 /**
@@ -260,6 +274,29 @@ int hwspin_lock_timeout(struct hwspinlock *hwlock, unsigned int to)
 	return __hwspin_lock_timeout(hwlock, to, 0, NULL);
 }
 
+/**
+ * hwspin_lock_wait() - lock an hwspinlock, sleeping while it's taken
+ * @hwlock: the hwspinlock to be locked
+ * @to: timeout value in msecs
+ *
+ * This function locks the underlying @hwlock. If the @hwlock is already
+ * taken, the caller sleeps until it's released (see hwspin_lock_notify()),
+ * rather than busy loop, but gives up after @to msecs have elapsed.
+ *
+ * Must be called from process context. Upon a successful return from this
+ * function, preemption is disabled, so the caller must not sleep, and is
+ * advised to release the hwspinlock as soon as possible.
+ *
+ * Returns 0 when the @hwlock was successfully taken, and an appropriate
+ * error code otherwise (most notably an -ETIMEDOUT if the @hwlock is still
+ * busy after @timeout msecs).
+ */
+static inline
+int hwspin_lock_wait(struct hwspinlock *hwlock, unsigned int to)
+{
+	return __hwspin_lock_wait(hwlock, to, 0, NULL);
+}
+
 /**
  * hwspin_unlock_irqrestore() - unlock hwspinlock, restore irq state
  * @hwlock: a previously-acquired hwspinlock which we want to unlock
@@ -0,0 +1,50 @@
+/*
+ * Mailbox framework, client API
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef __MAILBOX_CLIENT_H
+#define __MAILBOX_CLIENT_H
+
+#include <linux/device.h>
+
+struct mbox_chan;
+
+/**
+ * struct mbox_client - a user of a mailbox channel
+ * @dev: the device the client belongs to
+ * @rx_callback: called with each message the remote end sends, from atomic
+ *		 context (usually the controller's interrupt handler)
+ * @tx_done: called, from atomic context, once a message that was queued by
+ *	     mbox_send_message() is sent, or failed to be (optional)
+ * @tx_block: have mbox_send_message() wait until the message is sent
+ * @tx_tout: how long (in msecs) mbox_send_message() waits, if @tx_block
+ *	     is set; 0 means forever
+ * @knows_txdone: the client tells when a message was sent (e.g. because the
+ *		  remote acknowledges it), using mbox_client_txdone(), if the
+ *		  controller can't tell by itself
+ */
+struct mbox_client {
+	struct device *dev;
+	void (*rx_callback)(struct mbox_client *cl, void *mssg);
+	void (*tx_done)(struct mbox_client *cl, void *mssg, int r);
+	bool tx_block;
+	unsigned long tx_tout;
+	bool knows_txdone;
+};
+
+struct mbox_chan *mbox_request_channel(struct mbox_client *cl,
+							const char *name);
+int mbox_send_message(struct mbox_chan *chan, void *mssg);
+void mbox_client_txdone(struct mbox_chan *chan, int r);
+void mbox_free_channel(struct mbox_chan *chan);
+
+#endif /* __MAILBOX_CLIENT_H */
@@ -0,0 +1,125 @@
+/*
+ * Mailbox framework, controller API
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef __MAILBOX_CONTROLLER_H
+#define __MAILBOX_CONTROLLER_H
+
+#include <linux/device.h>
+#include <linux/hrtimer.h>
+#include <linux/completion.h>
+#include <linux/spinlock.h>
+
+struct mbox_chan;
+struct dentry;
+
+/**
+ * struct mbox_chan_ops - methods to control a mailbox channel
+ * @send_data:	hand a message over to the hardware, or return -EBUSY if it
+ *		can't take it yet (it's then tried again once the previous
+ *		message is sent). Called from atomic context.
+ * @startup:	get the channel ready for its client (optional)
+ * @shutdown:	the client is done with the channel (optional)
+ * @last_tx_done: has the hardware sent the last message it was handed ?
+ *		Needed by the controllers that have their tx done polled.
+ *		Called from atomic context.
+ */
+struct mbox_chan_ops {
+	int (*send_data)(struct mbox_chan *chan, void *data);
+	int (*startup)(struct mbox_chan *chan);
+	void (*shutdown)(struct mbox_chan *chan);
+	bool (*last_tx_done)(struct mbox_chan *chan);
+};
+
+/**
+ * struct mbox_controller - a mailbox controller
+ * @dev:	the device of the controller
+ * @ops:	methods to control its channels
+ * @chans:	its channels, which the controller driver names
+ * @num_chans:	number of channels in @chans
+ * @txdone_irq:	the controller reports, with mbox_chan_txdone(), when a
+ *		message is sent (usually from its tx interrupt)
+ * @txdone_poll: the controller can't report it, but can tell, when it's
+ *		polled with ->last_tx_done()
+ * @txpoll_period: how often (in msecs) ->last_tx_done() is polled
+ * @poll_hrt:	the hrtimer which polls the tx done; internal
+ * @dbg:	debugfs entry of the channels statistics; internal
+ * @node:	node in the list of controllers; internal
+ *
+ * If neither @txdone_irq nor @txdone_poll is set, the clients tell when
+ * a message is sent, with mbox_client_txdone().
+ */
+struct mbox_controller {
+	struct device *dev;
+	const struct mbox_chan_ops *ops;
+	struct mbox_chan *chans;
+	int num_chans;
+	bool txdone_irq;
+	bool txdone_poll;
+	unsigned txpoll_period;
+	struct hrtimer poll_hrt;
+	struct dentry *dbg;
+	struct list_head node;
+};
+
+/* how many messages a channel can have queued */
+#define MBOX_TX_QUEUE_LEN	20
+
+/**
+ * struct mbox_chan_stats - what a mailbox channel went through
+ * @tx:		messages handed over to the hardware
+ * @tx_full:	messages rejected because the tx queue was full
+ * @tx_errors:	messages that failed to be sent
+ * @rx:		messages received
+ */
+struct mbox_chan_stats {
+	unsigned long tx;
+	unsigned long tx_full;
+	unsigned long tx_errors;
+	unsigned long rx;
+};
+
+/**
+ * struct mbox_chan - a mailbox channel
+ * @name:	name of the channel, which its client requests it with
+ * @mbox:	the controller of the channel
+ * @txdone_method: how the tx done is told (TXDONE_BY_*); internal
+ * @cl:		the client of the channel, if any
+ * @tx_complete: completed once a message is sent, if @cl->tx_block
+ * @active_req: the message the hardware is currently sending
+ * @msg_count:	number of messages in @msg_data
+ * @msg_free:	index of the next free slot of @msg_data
+ * @msg_data:	the tx queue, a ring of messages
+ * @lock:	protects the tx queue, and @stats
+ * @stats:	what the channel went through
+ * @con_priv:	private data of the controller driver
+ */
+struct mbox_chan {
+	const char *name;
+	struct mbox_controller *mbox;
+	unsigned txdone_method;
+	struct mbox_client *cl;
+	struct completion tx_complete;
+	void *active_req;
+	unsigned msg_count, msg_free;
+	void *msg_data[MBOX_TX_QUEUE_LEN];
+	spinlock_t lock;
+	struct mbox_chan_stats stats;
+	void *con_priv;
+};
+
+int mbox_controller_register(struct mbox_controller *mbox);
+void mbox_controller_unregister(struct mbox_controller *mbox);
+void mbox_chan_received_data(struct mbox_chan *chan, void *data);
+void mbox_chan_txdone(struct mbox_chan *chan, int r);
+
+#endif /* __MAILBOX_CONTROLLER_H */
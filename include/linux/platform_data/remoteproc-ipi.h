@@ -0,0 +1,44 @@
+/*
+ * Remote Processor - bits of the remote processors signalled with IPIs
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef _IPI_REMOTEPROC_H
+#define _IPI_REMOTEPROC_H
+
+/*
+ * struct ipi_rproc_pdata - platform data of a remote processor running on
+ * a core of our own cluster, and sharing our interrupt controller
+ * @name: the remoteproc's name
+ * @firmware: name of firmware file to load
+ * @cpu: the (logical) cpu the remote processor runs on. It must be kept
+ *	 out of Linux (e.g. with maxcpus=, or by taking it offline) before
+ *	 the remote processor is booted, and it can't be brought online
+ *	 while the remote processor runs
+ * @kick_ipi: the spare IPI (see set_ipi_handler()) raised on @cpu to kick
+ *	      the vrings of the remote processor
+ * @notify_ipi: the spare IPI the remote processor raises on our cpus to
+ *		notify us of its vrings
+ * @boot: platform-specific handler for starting @cpu at @bootaddr (e.g.
+ *	  through its holding pen, or the power controller of the cluster)
+ * @shutdown: platform-specific handler for stopping @cpu
+ */
+struct ipi_rproc_pdata {
+	const char *name;
+	const char *firmware;
+	unsigned int cpu;
+	int kick_ipi;
+	int notify_ipi;
+	int (*boot)(unsigned int cpu, u32 bootaddr);
+	int (*shutdown)(unsigned int cpu);
+};
+
+#endif /* _IPI_REMOTEPROC_H */
@@ -30,7 +30,21 @@ struct platform_device;
  * @ops: start/stop rproc handlers
  * @device_enable: omap-specific handler for enabling a device
  * @device_shutdown: omap-specific handler for shutting down a device
+ * @device_idle: omap-specific handler for idling a device, keeping its
+ *		 state intact (optional; the rproc is suspended whenever it
+ *		 idles if it's provided)
  * @set_bootaddr: omap-specific handler for setting the rproc boot address
+ * @num_cores: number of cores of the rproc, if they run their own instance
+ *	       of the firmware (e.g. 2 for the dual Cortex-M3 IPU), or 0
+ * @set_core_bootaddr: omap-specific handler for setting the boot address of
+ *		       the other cores, when @num_cores is 2 or more
+ * @watchdog_timer: id of the dmtimer the remote processor uses as its
+ *		    watchdog, if any (0 otherwise): the rproc is deemed hung,
+ *		    and recovered, if the timer ever overflows
+ * @doorbell_da: device address of the doorbell (a struct omap_rproc_doorbell)
+ *		 the firmware shares with us, if any (0 otherwise): kicks are
+ *		 then posted there, and only take a mailbox message when the
+ *		 remote processor has caught up with the previous ones
  */
 struct omap_rproc_pdata {
 	const char *name;
@@ -41,7 +55,12 @@ struct omap_rproc_pdata {
 	const struct rproc_ops *ops;
 	int (*device_enable) (struct platform_device *pdev);
 	int (*device_shutdown) (struct platform_device *pdev);
+	int (*device_idle) (struct platform_device *pdev);
 	void(*set_bootaddr)(u32);
+	unsigned int num_cores;
+	void (*set_core_bootaddr)(unsigned int core, u32 bootaddr);
+	int watchdog_timer;
+	u32 doorbell_da;
 };
 
 #if defined(CONFIG_OMAP_REMOTEPROC) || defined(CONFIG_OMAP_REMOTEPROC_MODULE)
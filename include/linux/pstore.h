@@ -35,6 +35,7 @@ enum pstore_type_id {
 	PSTORE_TYPE_MCE		= 1,
 	PSTORE_TYPE_CONSOLE	= 2,
 	PSTORE_TYPE_FTRACE	= 3,
+	PSTORE_TYPE_RPROC	= 4,
 	PSTORE_TYPE_UNKNOWN	= 255
 };
 
@@ -66,12 +67,18 @@ struct pstore_info {
 
 #ifdef CONFIG_PSTORE
 extern int pstore_register(struct pstore_info *);
+extern int pstore_write_rproc(const char *buf, size_t size);
 #else
 static inline int
 pstore_register(struct pstore_info *psi)
 {
 	return -ENODEV;
 }
+static inline int
+pstore_write_rproc(const char *buf, size_t size)
+{
+	return -ENODEV;
+}
 #endif
 
 #endif /*_LINUX_PSTORE_H*/
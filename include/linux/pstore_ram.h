@@ -74,6 +74,7 @@ struct ramoops_platform_data {
 	unsigned long	record_size;
 	unsigned long	console_size;
 	unsigned long	ftrace_size;
+	unsigned long	rproc_size;
 	int		dump_oops;
 	int		ecc_size;
 };
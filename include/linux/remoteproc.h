@@ -40,11 +40,18 @@
 #include <linux/mutex.h>
 #include <linux/virtio.h>
 #include <linux/completion.h>
+#include <linux/hrtimer.h>
+#include <linux/cpumask.h>
+#include <linux/workqueue.h>
 #include <linux/idr.h>
+#include <linux/interrupt.h>
+#include <linux/ktime.h>
+#include <linux/err.h>
+#include <linux/cdev.h>
 
 /**
  * struct resource_table - firmware resource table header
- * @ver: version number
+ * @ver: version number (1, or 2 for tables holding 64-bit entries)
  * @num: number of resource entries
  * @reserved: reserved (must be zero)
  * @offset: array of offsets pointing at the various resource entries
@@ -52,7 +59,9 @@
  * A resource table is essentially a list of system resources required
  * by the remote processor. It may also include configuration entries.
  * If needed, the remote processor firmware should contain this table
- * as a dedicated ".resource_table" ELF section.
+ * as a dedicated ".resource_table" ELF section. Firmwares with many
+ * sections may also point a PT_RPROC_RSC_TABLE program header at it, which
+ * is then used instead of looking the section up by name.
  *
  * Some resources entries are mere announcements, where the host is informed
  * of specific remoteproc configuration. Other entries require the host to
@@ -68,7 +77,13 @@
  *
  * Immediately following this header are the resource entries themselves,
  * each of which begins with a resource entry header (as described below).
+ *
+ * Version 2 tables are just like version 1 ones, but may also hold the
+ * RSC_CARVEOUT64 and RSC_DEVMEM64 entries, whose physical addresses and
+ * lengths are 64 bits wide (e.g. for memory above 4GB on LPAE systems).
  */
+#define PT_RPROC_RSC_TABLE	(PT_LOOS + 0x5253430)
+
 struct resource_table {
 	u32 ver;
 	u32 num;
@@ -100,6 +115,37 @@ struct fw_rsc_hdr {
  *		    the remote processor will be writing logs.
  * @RSC_VDEV:       declare support for a virtio device, and serve as its
  *		    virtio header.
+ * @RSC_PERF:	    announces performance counters the remote processor
+ *		    keeps up to date in its memory.
+ * @RSC_PEER:	    request vrings shared with another remote processor.
+ * @RSC_QUEUE:	    declare a shared-memory queue for small messages.
+ * @RSC_TIMESYNC:   request the host to keep an estimate of its clock, in
+ *		    terms of the remote processor's, in its memory.
+ * @RSC_COALESCE:   let the host moderate the notifications of the remote
+ *		    processor about its vrings.
+ * @RSC_IPCMEM:     request a single memory region for the vrings and buffers
+ *		    of a vdev.
+ * @RSC_SNAPSHOT:   declare a memory region whose contents should be saved
+ *		    across power cycles.
+ * @RSC_OVERLAY:    declare a memory region the firmware's overlays are copied
+ *		    into, as the remote processor asks for them.
+ * @RSC_TELEMETRY:  declare a page the remote processor publishes its load,
+ *		    heap and endpoint backlogs in.
+ * @RSC_CORE:	    declare where a core of a multi-core remote processor
+ *		    boots.
+ * @RSC_TRACE_FMT:  declare where the format strings of a binary trace
+ *		    buffer are.
+ * @RSC_CMDQ:	    declare a pair of submission and completion rings for
+ *		    commands.
+ * @RSC_MINIDUMP:   declare the regions a crash dump is limited to.
+ * @RSC_CARVEOUT64: same as RSC_CARVEOUT, with 64-bit addresses and length
+ *		    (version 2 tables only).
+ * @RSC_DEVMEM64:   same as RSC_DEVMEM, with 64-bit addresses and length
+ *		    (version 2 tables only).
+ * @RSC_DYNMEM:     declare a window of device addresses the remote processor
+ *		    may ask for more memory to be mapped into, as it runs.
+ * @RSC_TELEMETRY_TAGS: same as RSC_TELEMETRY, with room for what the remote
+ *		    processor spent on each sender tag.
  * @RSC_LAST:       just keep this one at the end
  *
  * For more details regarding a specific resource type, please see its
@@ -115,10 +161,28 @@ enum fw_resource_type {
 	RSC_DEVMEM	= 1,
 	RSC_TRACE	= 2,
 	RSC_VDEV	= 3,
-	RSC_LAST	= 4,
+	RSC_PERF	= 4,
+	RSC_PEER	= 5,
+	RSC_QUEUE	= 6,
+	RSC_TIMESYNC	= 7,
+	RSC_COALESCE	= 8,
+	RSC_IPCMEM	= 9,
+	RSC_SNAPSHOT	= 10,
+	RSC_OVERLAY	= 11,
+	RSC_TELEMETRY	= 12,
+	RSC_CORE	= 13,
+	RSC_TRACE_FMT	= 14,
+	RSC_CMDQ	= 15,
+	RSC_MINIDUMP	= 16,
+	RSC_CARVEOUT64	= 17,
+	RSC_DEVMEM64	= 18,
+	RSC_DYNMEM	= 19,
+	RSC_TELEMETRY_TAGS = 20,
+	RSC_LAST	= 21,
 };
 
 #define FW_RSC_ADDR_ANY (0xFFFFFFFFFFFFFFFF)
+#define FW_RSC_NOTIFY_ID_ANY (0xFFFFFFFF)
 
 /**
  * struct fw_rsc_carveout - physically contiguous memory request
@@ -161,8 +225,35 @@ enum fw_resource_type {
  *
  * @flags is used to provide IOMMU protection flags, and @name should
  * (optionally) contain a human readable name of this carveout region
- * (mainly for debugging purposes).
+ * (mainly for debugging purposes). The flags of the regions that are
+ * latency critical (code, vrings, buffer pools) can ask for their IOTLB
+ * entries to be locked, if the IOMMU supports it, so the accesses to them
+ * never miss the IOTLB (on OMAP, with the MMU_CAM_P flag).
+ *
+ * The FW_CARVEOUT_BANK_MASK bits of @flags aren't IOMMU flags: they can ask
+ * for the region to be placed in a given memory bank (FW_CARVEOUT_BANK(n)),
+ * e.g. the DRAM bank closest to the remote processor, or an interleaved one,
+ * for bandwidth. The banks are numbered by the rproc implementation (see
+ * rproc->banks); if the regions can't be placed as asked for, they're placed
+ * just like those that don't ask for any bank.
+ *
+ * Neither is FW_CARVEOUT_SHARED: it tells that the region only holds
+ * read-only segments (e.g. code), which the remote processor never writes
+ * to. Remote processors booted with the same firmware image may then share
+ * a single copy of the region (see rproc->share_carveouts), which is only
+ * loaded once, and mapped read-only onto each of their iommus.
+ *
+ * Nor is FW_CARVEOUT_USER: it lets user space mmap() the region through
+ * the /dev/remoteprocN node of the remote processor (e.g. for the buffers
+ * of a zero-copy data plane), at the offset of its @da, which must then be
+ * page aligned. It's ignored for regions that are shared.
  */
+#define FW_CARVEOUT_BANK_SHIFT	24
+#define FW_CARVEOUT_BANK_MASK	(0xf << FW_CARVEOUT_BANK_SHIFT)
+#define FW_CARVEOUT_BANK(n)	(((n) + 1) << FW_CARVEOUT_BANK_SHIFT)
+#define FW_CARVEOUT_SHARED	(1 << 28)
+#define FW_CARVEOUT_USER	(1 << 29)
+
 struct fw_rsc_carveout {
 	u32 da;
 	u32 pa;
@@ -172,6 +263,31 @@ struct fw_rsc_carveout {
 	u8 name[32];
 } __packed;
 
+/**
+ * struct fw_rsc_carveout64 - physically contiguous memory request, 64-bit
+ * @da: device address
+ * @pa: physical address
+ * @len: length (in bytes)
+ * @flags: iommu protection flags, and placement flags (see fw_rsc_carveout)
+ * @reserved: reserved (must be zero)
+ * @name: human-readable name of the requested memory region
+ *
+ * This is the RSC_CARVEOUT64 entry of version 2 resource tables. It's just
+ * like fw_rsc_carveout, except its addresses and length are 64 bits wide:
+ * the region may be bigger than 2GB, and be placed anywhere in physical
+ * memory (e.g. above 4GB on LPAE systems), as told by the @pa the host
+ * writes back. The device address space of the remote processor is still
+ * 32 bits wide, though: [@da, @da + @len) must fit in it.
+ */
+struct fw_rsc_carveout64 {
+	u64 da;
+	u64 pa;
+	u64 len;
+	u32 flags;
+	u32 reserved;
+	u8 name[32];
+} __packed;
+
 /**
  * struct fw_rsc_devmem - iommu mapping request
  * @da: device address
@@ -191,9 +307,10 @@ struct fw_rsc_carveout {
  *
  * @da should specify the required device address, @pa should specify
  * the physical address we want to map, @len should specify the size of
- * the mapping and @flags is the IOMMU protection flags. As always, @name may
- * (optionally) contain a human readable name of this mapping (mainly for
- * debugging purposes).
+ * the mapping and @flags is the IOMMU protection flags (which can ask for
+ * the IOTLB entries of the mapping to be locked, see fw_rsc_carveout).
+ * As always, @name may (optionally) contain a human readable name of this
+ * mapping (mainly for debugging purposes).
  *
  * Note: at this point we just "trust" those devmem entries to contain valid
  * physical addresses, but this isn't safe and will be changed: eventually we
@@ -211,10 +328,34 @@ struct fw_rsc_devmem {
 } __packed;
 
 /**
- * struct fw_rsc_trace - trace buffer declaration
+ * struct fw_rsc_devmem64 - iommu mapping request, 64-bit
  * @da: device address
+ * @pa: physical address
  * @len: length (in bytes)
+ * @flags: iommu protection flags
  * @reserved: reserved (must be zero)
+ * @name: human-readable name of the requested region to be mapped
+ *
+ * This is the RSC_DEVMEM64 entry of version 2 resource tables: it's just
+ * like fw_rsc_devmem, except its addresses and length are 64 bits wide,
+ * so the region mapped may be anywhere in physical memory. As with
+ * fw_rsc_carveout64, [@da, @da + @len) must fit in 32 bits.
+ */
+struct fw_rsc_devmem64 {
+	u64 da;
+	u64 pa;
+	u64 len;
+	u32 flags;
+	u32 reserved;
+	u8 name[32];
+} __packed;
+
+/**
+ * struct fw_rsc_trace - trace buffer declaration
+ * @da: device address
+ * @len: length (in bytes)
+ * @flags: format of the trace buffer (zero, or FW_TRACE_RING, possibly along
+ *	   with FW_TRACE_STAMPED or FW_TRACE_BINARY)
  * @name: human-readable name of the trace buffer
  *
  * This resource entry provides the host information about a trace buffer
@@ -223,16 +364,139 @@ struct fw_rsc_devmem {
  * @da specifies the device address of the buffer, @len specifies
  * its size, and @name may contain a human readable name of the trace buffer.
  *
+ * By default, the trace buffer holds a NUL-terminated string. If @flags has
+ * FW_TRACE_RING set, it starts with a struct fw_trace_ring instead, and the
+ * remote processor writes its logs to it as a ring. If FW_TRACE_STAMPED is
+ * set too, every line the remote processor writes to the ring starts with
+ * its timestamp, in ticks of its trace clock (see rproc_ops), as hex
+ * digits in brackets, e.g. "[1234abcd] booted\n": the lines can then be
+ * logged as rproc_trace ftrace events, with the timestamps converted to the
+ * host's clock.
+ *
+ * If FW_TRACE_BINARY is set instead, the remote processor doesn't format its
+ * logs at all: it writes binary records to the ring (see fw_trace_rec),
+ * which the host expands, with the format strings a RSC_TRACE_FMT entry
+ * points at, as the ring is read.
+ *
  * After booting the remote processor, the trace buffers are exposed to the
- * user via debugfs entries (called trace0, trace1, etc..).
+ * user via debugfs entries (called trace0, trace1, etc..). Those of ring
+ * trace buffers are streams: each reader consumes the logs as they come,
+ * from the oldest ones that are still in the ring.
  */
 struct fw_rsc_trace {
 	u32 da;
 	u32 len;
-	u32 reserved;
+	u32 flags;
 	u8 name[32];
 } __packed;
 
+/* the trace buffer is a ring (see struct fw_trace_ring) */
+#define FW_TRACE_RING		(1 << 0)
+
+/* the lines of the ring start with their timestamp (see fw_rsc_trace) */
+#define FW_TRACE_STAMPED	(1 << 1)
+
+/* the ring holds binary records (see struct fw_trace_rec) */
+#define FW_TRACE_BINARY		(1 << 2)
+
+/* "RTRC", once the remote processor set its trace ring up */
+#define FW_TRACE_RING_MAGIC	0x43525452
+
+/**
+ * struct fw_trace_ring - header of a ring trace buffer
+ * @magic: FW_TRACE_RING_MAGIC, once the remote processor set the ring up
+ * @size: size of @data, in bytes
+ * @head: how many bytes the remote processor wrote to the ring so far
+ * @tail: how many bytes it overwrote (or dropped) so far
+ * @data: the ring itself
+ *
+ * Only the remote processor writes to a trace ring: it writes its logs to
+ * @data, at their offset modulo @size, advances @tail past the bytes it's
+ * about to overwrite, and then advances @head past what it wrote. @head and
+ * @tail are free-running (they wrap at 2^32), and @data holds the logs from
+ * @tail to @head. The host never blocks the remote processor: readers that
+ * fall too far behind just miss the logs that were overwritten.
+ */
+struct fw_trace_ring {
+	u32 magic;
+	u32 size;
+	u32 head;
+	u32 tail;
+	u8 data[0];
+} __packed;
+
+/**
+ * struct fw_trace_rec - a record of a binary trace ring
+ * @hdr: FW_TRACE_REC(fmt, nargs)
+ * @args: the @nargs arguments of the format string
+ *
+ * Rather than formatting its logs, the remote processor of a FW_TRACE_BINARY
+ * trace ring just writes the offset of their format string, in the format
+ * strings section of its image (see fw_rsc_trace_fmt), and their raw
+ * arguments. Every conversion of the format string takes a single 32-bit
+ * argument: d, i, o, u, x, X and c ones are expanded (with their flags,
+ * width and precision, and regardless of their length modifiers), and the
+ * others (e.g. %s, whose string the host can't tell the address of) show
+ * up as '?'.
+ *
+ * The records are written whole, and advance @head and @tail of the ring
+ * by whole records too, so the host always reads them from their start.
+ */
+struct fw_trace_rec {
+	u32 hdr;
+	u32 args[0];
+} __packed;
+
+#define FW_TRACE_REC(fmt, nargs)	((fmt) | (nargs) << 24)
+#define FW_TRACE_REC_FMT(hdr)		((hdr) & 0xffffff)
+#define FW_TRACE_REC_NARGS(hdr)		((hdr) >> 24)
+
+/* size of the names of the performance counters */
+#define FW_PERF_NAME_LEN	16
+
+/* how many performance counters a remote processor may declare */
+#define FW_PERF_MAX_COUNTERS	64
+
+/**
+ * struct fw_rsc_perf - performance counters declaration
+ * @da: device address of the counters (a struct fw_perf_counters)
+ * @num: number of counters
+ * @reserved: reserved (must be zero)
+ * @names: name of each counter, e.g. "cycles" (NUL-padded)
+ *
+ * This resource entry announces performance counters (e.g. cycles, stalls
+ * or cache misses) which the remote processor keeps up to date in its own
+ * memory, at @da. They're exported to perf as the events of a PMU named
+ * after the remote processor (e.g. "rproc0"), and counted with e.g.
+ * "perf stat -a -e rproc0/cycles/", or with "rproc0/counter=N/".
+ *
+ * The counters must stay where they are, and keep their names, across the
+ * boots of the remote processor; they may be reset when it's booted.
+ */
+struct fw_rsc_perf {
+	u32 da;
+	u32 num;
+	u32 reserved;
+	char names[0][FW_PERF_NAME_LEN];
+} __packed;
+
+/**
+ * struct fw_perf_counters - the performance counters of a remote processor
+ * @seq: incremented by the remote processor before and after it updates
+ *	 @values (i.e. it's odd while it does)
+ * @reserved: reserved (must be zero)
+ * @values: the free-running counters, in the order of their fw_rsc_perf
+ *	    names
+ *
+ * The host reads the counters without stopping the remote processor: it
+ * retries whenever @seq tells it raced with an update.
+ */
+struct fw_perf_counters {
+	u32 seq;
+	u32 reserved;
+	u64 values[0];
+} __packed;
+
 /**
  * struct fw_rsc_vdev_vring - vring descriptor entry
  * @da: device address
@@ -247,8 +511,16 @@ struct fw_rsc_trace {
  * vdev resource type (see below).
  *
  * Note that @da should either contain the device address where
- * the remote processor is expecting the vring, or indicate that
- * dynamically allocation of the vring's device address is supported.
+ * the remote processor is expecting the vring, or be set to FW_RSC_ADDR_ANY
+ * to indicate that dynamically allocation of the vring's device address is
+ * supported. Likewise, @notifyid is either the index the remote processor
+ * expects, or FW_RSC_NOTIFY_ID_ANY. Dynamically allocated ones are written
+ * back by the host before the remote processor is booted.
+ *
+ * A vring can only be placed at a given @da if it isn't regular memory
+ * (e.g. it's on-chip SRAM): the host then finds it through the RSC_DEVMEM
+ * entry mapping @da if the remote processor is behind an iommu, or at that
+ * very physical address otherwise. Other vrings are allocated dynamically.
  */
 struct fw_rsc_vdev_vring {
 	u32 da;
@@ -266,11 +538,19 @@ struct fw_rsc_vdev_vring {
  * status/features of this vdev have changes.
  * @dfeatures specifies the virtio device features supported by the firmware
  * @gfeatures is a place holder used by the host to write back the
- * negotiated features that are supported by both sides.
+ * negotiated features that are supported by both sides, before the remote
+ * processor is booted. A firmware that offers VIRTIO_RING_F_EVENT_IDX must
+ * only use event indices on the vdev's vrings if it's set there.
  * @config_len is the size of the virtio config space of this vdev. The config
  * space lies in the resource table immediate after this vdev header.
  * @status is a place holder where the host will indicate its virtio progress.
+ * While the remote processor is up, the host keeps accessing @status and the
+ * config space right there, if the resource table is loaded along with the
+ * firmware's segments (or if the vdev was added on the fly): it's how both
+ * sides can exchange parameters, without any message.
  * @num_of_vrings indicates how many vrings are described in this vdev header
+ * @core: the core of a multi-core remote processor that serves this vdev
+ * (see fw_rsc_core), or 0
  * @reserved: reserved (must be zero)
  * @vring is an array of @num_of_vrings entries of 'struct fw_rsc_vdev_vring'.
  *
@@ -279,8 +559,11 @@ struct fw_rsc_vdev_vring {
  * to negotiate and share certain virtio properties.
  *
  * By providing this resource entry, the firmware essentially asks remoteproc
- * to statically allocate a vdev upon registration of the rproc (dynamic vdev
- * allocation is not yet supported).
+ * to statically allocate a vdev upon registration of the rproc. A running
+ * remote processor may also add vdev entries to (or remove them from) the
+ * resource table it uses, and have the vdevs created (or destroyed) on the
+ * fly (see rproc_report_rsc_update()): their vrings' @da and @notifyid, and
+ * their @gfeatures and @status, are then written back by the host.
  *
  * Note: unlike virtualization systems, the term 'host' here means
  * the Linux side which is running remoteproc to control the remote
@@ -301,40 +584,822 @@ struct fw_rsc_vdev {
 	u32 config_len;
 	u8 status;
 	u8 num_of_vrings;
-	u8 reserved[2];
+	u8 core;
+	u8 reserved;
 	struct fw_rsc_vdev_vring vring[0];
 } __packed;
 
+/**
+ * struct fw_rsc_peer - vrings shared with another remote processor
+ * @name: name of the other remote processor (i.e. of its rproc), NUL-padded
+ * @tx: the vring this remote processor sends buffers to the other one on
+ * @rx: the vring it gets buffers from the other one on
+ *
+ * This resource entry requests a pair of vrings, shared with the remote
+ * processor @name, whose resource table must have a matching RSC_PEER
+ * entry (naming this one, with its @tx and @rx swapped). Both remote
+ * processors then run rpmsg over the vrings, name service included, while
+ * the host stays out of the way: it allocates the vrings, maps them into
+ * both remote processors, and has their notifications go straight from
+ * one to the other (see rproc_ops->route_peer), but never touches them.
+ *
+ * The host must be told which remote processors are peers (see
+ * rproc_add_peer()). @num, @align and @notifyid of each vring must be the
+ * same in both entries, and the notifyids can't be FW_RSC_NOTIFY_ID_ANY:
+ * both remote processors kick each other with the notifyid of a vring
+ * about it. @da works as for a vdev's vrings, except that a remote
+ * processor behind an iommu needs one.
+ */
+struct fw_rsc_peer {
+	u8 name[32];
+	struct fw_rsc_vdev_vring tx;
+	struct fw_rsc_vdev_vring rx;
+} __packed;
+
+/* the remote processor sends (rather than receives) on the queue */
+#define FW_QUEUE_TO_HOST	(1 << 0)
+
+/* the queue has a single producer, and no hwspinlock */
+#define FW_QUEUE_NO_HWLOCK	0xFFFFFFFF
+
+/* largest slot of a queue, in bytes */
+#define FW_QUEUE_SLOT_MAX	256
+
+/**
+ * struct fw_rsc_queue - shared-memory queue declaration
+ * @da: device address of the queue (a struct fw_queue)
+ * @num: number of slots of the queue (must be a power of two)
+ * @slot_size: size of each slot, in bytes, its header included (a multiple
+ *	       of 4, up to FW_QUEUE_SLOT_MAX)
+ * @notifyid: the notifyid the queue is kicked with (by its producer)
+ * @flags: FW_QUEUE_TO_HOST if the remote processor sends on the queue
+ * @hwlock: id of the hwspinlock the producers of the queue take while they
+ *	    publish a message, or FW_QUEUE_NO_HWLOCK if there's only one
+ * @name: name of the queue, which its host user opens it by (NUL-padded)
+ *
+ * This resource entry declares a queue of small messages (e.g. control
+ * words of a few bytes), in one of the carveouts of the remote processor:
+ * sending one costs a copy into a slot and an index update, instead of a
+ * vring descriptor, a buffer and an rpmsg header. The host opens it with
+ * rproc_queue_open(), and sends on it with rproc_queue_send().
+ *
+ * Each queue only goes one way. @notifyid must not be the notifyid of a
+ * vring, and, if the platform driver only tells that the remote processor
+ * signalled (RPROC_ALL_VQS), queues are drained on every notification.
+ */
+struct fw_rsc_queue {
+	u32 da;
+	u32 num;
+	u32 slot_size;
+	u32 notifyid;
+	u32 flags;
+	u32 hwlock;
+	u8 name[32];
+} __packed;
+
+/**
+ * struct fw_queue - a shared-memory queue
+ * @head: index of the next slot the producer writes (free-running)
+ * @reserved0: keeps @tail off the cache line of @head
+ * @tail: index of the next slot the consumer reads (free-running)
+ * @reserved1: keeps the slots off the cache line of @tail
+ * @slots: the slots (struct fw_queue_slot), the slot of index i being
+ *	   the (i % num) one
+ *
+ * The producer only ever writes @head, after the slot it publishes, and
+ * the consumer only ever writes @tail, once it's done with the slots it
+ * consumed; the queue is full when @head - @tail == num.
+ */
+struct fw_queue {
+	u32 head;
+	u32 reserved0[15];
+	u32 tail;
+	u32 reserved1[15];
+	u8 slots[0];
+} __packed;
+
+/**
+ * struct fw_queue_slot - a slot of a shared-memory queue
+ * @len: length of @data, in bytes
+ * @data: the message
+ */
+struct fw_queue_slot {
+	u32 len;
+	u8 data[0];
+} __packed;
+
+/**
+ * struct fw_rsc_timesync - clock synchronization request
+ * @da: device address of the estimate (a struct fw_timesync)
+ * @period_ms: how often the host should refresh the estimate, in msecs
+ *	       (0 for the default of 1000, and no less than 10)
+ * @reserved: reserved (must be zero)
+ *
+ * This resource entry asks the host to keep an estimate of the offset and
+ * drift between its clock (CLOCK_MONOTONIC) and the remote processor's own
+ * (the one its rproc implementation reads with ->trace_clock()), at @da,
+ * so the remote processor can tell the host's time, and schedule work at
+ * a time of the host's, without messages going back and forth. Host
+ * drivers convert between both clocks with rproc_timesync_to_remote() and
+ * rproc_timesync_to_host().
+ */
+struct fw_rsc_timesync {
+	u32 da;
+	u32 period_ms;
+	u32 reserved;
+} __packed;
+
+/**
+ * struct fw_timesync - an estimate of the host's clock
+ * @seq: incremented by the host before and after it updates the estimate
+ *	 (i.e. it's odd while it does)
+ * @shift: see @mult
+ * @remote: the remote processor's clock, when the host's read @host_ns
+ * @host_ns: the host's clock, in nsecs, at @remote
+ * @mult: how many nsecs the host's clock advances by per tick of the
+ *	  remote processor's clock, times 2^@shift
+ * @reserved: reserved (must be zero)
+ *
+ * Whenever the remote processor's clock reads t, the host's clock reads
+ * @host_ns + (((t - @remote) * @mult) >> @shift). @mult is measured, so it
+ * accounts for the drift of the clocks. The remote processor reads the
+ * estimate without locking, and retries whenever @seq tells it raced with
+ * an update.
+ */
+struct fw_timesync {
+	u32 seq;
+	u32 shift;
+	u64 remote;
+	u64 host_ns;
+	u32 mult;
+	u32 reserved;
+} __packed;
+
+/**
+ * struct fw_rsc_coalesce - notification moderation request
+ * @da: device address of the moderation hint (a struct fw_coalesce)
+ * @reserved: reserved (must be zero)
+ *
+ * This resource entry declares that the remote processor can hold back its
+ * notifications about the vrings (and thus the host's interrupts), as told
+ * by the host at @da, like a NIC coalesces its interrupts. The host tunes
+ * the hint as the message rate of the remote processor changes (see the
+ * 'coalesce' debugfs entry of the rproc).
+ */
+struct fw_rsc_coalesce {
+	u32 da;
+	u32 reserved;
+} __packed;
+
+/**
+ * struct fw_coalesce - how the remote processor should notify the host
+ * @usecs: longest a buffer may wait in a vring before the remote processor
+ *	   notifies the host about it, in usecs (0 to notify right away)
+ * @frames: most buffers the remote processor may put in a vring before it
+ *	    notifies the host about them (0 or 1 to notify for each)
+ * @reserved: reserved (must be zero)
+ *
+ * The remote processor notifies the host as soon as either limit is hit.
+ * The host updates both fields at any time, independently of each other,
+ * and the remote processor applies them from its next buffer on.
+ */
+struct fw_coalesce {
+	u32 usecs;
+	u32 frames;
+	u32 reserved[2];
+} __packed;
+
+/**
+ * struct fw_rsc_ipcmem - IPC memory region request
+ * @da: device address of the region (filled in by the host)
+ * @len: size of the region, in bytes
+ * @notifyid: notify index of the vdev the region is for (see fw_rsc_vdev)
+ * @reserved: reserved (must be zero)
+ *
+ * This resource entry asks the host to allocate a single physically
+ * contiguous region of @len bytes for the vrings of a vdev, and for the
+ * buffers its driver shares with the remote processor (e.g. the rpmsg
+ * buffers), instead of allocating each of them on its own. The remote
+ * processor then only has to map one region, e.g. with a single large page
+ * IOMMU or MPU entry.
+ *
+ * @len is rounded up to a power of two, so the region is aligned to its
+ * own size. Whatever doesn't fit in the region is allocated on its own, as
+ * it would be without this entry.
+ *
+ * The host writes the address of the region to @da before booting the
+ * remote processor.
+ */
+struct fw_rsc_ipcmem {
+	u32 da;
+	u32 len;
+	u32 notifyid;
+	u32 reserved;
+} __packed;
+
+/**
+ * struct fw_rsc_snapshot - memory snapshot request
+ * @da: device address of the memory region
+ * @pa: physical address of the memory region
+ * @len: size of the memory region, in bytes
+ * @reserved: reserved (must be zero)
+ * @name: human-readable name of the memory region
+ *
+ * This resource entry declares a memory region of the remote processor
+ * (typically an on-chip memory) which loses its contents when it's powered
+ * off. When the remote processor is shut down cleanly, the host saves the
+ * contents of the region, and restores them as it boots it again, instead
+ * of loading its firmware anew: the remote processor then starts at its
+ * boot address with its memory as it left it, and must reset its vdevs
+ * (whose vrings are set up anew) on its own.
+ *
+ * The region is accessed through the carveout it's part of, if any, or at
+ * @pa otherwise. The entry is ignored unless the resources of the remote
+ * processor stay resident (see rproc->keep_resources).
+ */
+struct fw_rsc_snapshot {
+	u32 da;
+	u32 pa;
+	u32 len;
+	u32 reserved;
+	u8 name[32];
+} __packed;
+
+/**
+ * struct fw_rsc_overlay - overlay region declaration
+ * @da: device address of the overlay region
+ * @pa: physical address of the overlay region
+ * @len: size of the overlay region, in bytes
+ * @ctrl: device address of the control block of the overlays (a struct
+ *	  fw_overlay), in a carveout
+ * @notifyid: the notifyid overlay requests are kicked with, both ways
+ * @reserved: reserved (must be zero)
+ *
+ * This resource entry declares a memory region of the remote processor
+ * (typically a small, fast internal memory) that overlays are linked to
+ * run from: the sections of the firmware image whose addresses are in the
+ * region. They aren't loaded as the remote processor is booted, but copied
+ * into the region, out of the firmware image the host keeps around, as the
+ * remote processor asks for them (see struct fw_overlay).
+ *
+ * The region is accessed through the carveout it's part of, if any, or at
+ * @pa otherwise. @notifyid must not be the notifyid of a vring.
+ */
+struct fw_rsc_overlay {
+	u32 da;
+	u32 pa;
+	u32 len;
+	u32 ctrl;
+	u32 notifyid;
+	u32 reserved;
+} __packed;
+
+/**
+ * struct fw_overlay - overlay requests of the remote processor
+ * @name: name of the section of the overlay to copy in (NUL-padded)
+ * @seq: number of the request, bumped for each of them by the remote
+ *	 processor (once @name is set)
+ * @done: number of the last request the host served (once @status is set)
+ * @status: 0 if the overlay was copied in, or a negative error code
+ *
+ * The remote processor kicks the host once it bumped @seq, and the host
+ * kicks it back once it copied the overlay in and set @done. There's a
+ * single request in flight at a time. Both numbers are reset to zero
+ * before the remote processor is started.
+ */
+struct fw_overlay {
+	u8 name[32];
+	u32 seq;
+	u32 done;
+	s32 status;
+} __packed;
+
+/**
+ * struct fw_rsc_dynmem - runtime memory window declaration
+ * @da: device address of the window
+ * @len: size of the window, in bytes
+ * @ctrl: device address of the control block of the window (a struct
+ *	  fw_dynmem), in a carveout
+ * @notifyid: the notifyid memory requests are kicked with, both ways
+ * @flags: iommu protection flags of the regions mapped into the window
+ * @reserved: reserved (must be zero)
+ *
+ * This resource entry declares a window of the device address space of the
+ * remote processor that's left unmapped as it's booted: as it runs, the
+ * remote processor may ask the host for regions of memory mapped into it,
+ * e.g. as its load grows, and give them back once it drops (see struct
+ * fw_dynmem). @da must be page aligned, and the remote processor must sit
+ * behind an iommu. @notifyid must not be the notifyid of a vring.
+ */
+struct fw_rsc_dynmem {
+	u32 da;
+	u32 len;
+	u32 ctrl;
+	u32 notifyid;
+	u32 flags;
+	u32 reserved;
+} __packed;
+
+/**
+ * enum fw_dynmem_op - runtime memory requests
+ * @FW_DYNMEM_ALLOC: map a region of (at least) @len bytes into the window,
+ *		     and tell its device address in @da
+ * @FW_DYNMEM_FREE:  unmap the region at @da, and free it
+ */
+enum fw_dynmem_op {
+	FW_DYNMEM_ALLOC	= 1,
+	FW_DYNMEM_FREE	= 2,
+};
+
+/**
+ * struct fw_dynmem - runtime memory requests of the remote processor
+ * @seq: number of the request, bumped for each of them by the remote
+ *	 processor (once @op, @len and @da are set)
+ * @done: number of the last request the host served (once @status is set)
+ * @op: what the request is about (see enum fw_dynmem_op)
+ * @len: size of the region to allocate, in bytes (rounded up to pages)
+ * @da: device address of the region to free, or of the one allocated
+ * @status: 0 if the request was served, or a negative error code
+ *
+ * Just like overlay requests (see struct fw_overlay), there's a single
+ * request in flight at a time, and both numbers are reset to zero before
+ * the remote processor is started: all the regions it asked for are then
+ * gone.
+ */
+struct fw_dynmem {
+	u32 seq;
+	u32 done;
+	u32 op;
+	u32 len;
+	u32 da;
+	s32 status;
+} __packed;
+
+/**
+ * struct fw_rsc_telemetry - telemetry page declaration
+ * @da: device address of the telemetry page (a struct fw_telemetry), in a
+ *	carveout
+ * @num_epts: the number of endpoints the page has room for
+ * @reserved: reserved (ignored)
+ *
+ * This resource entry declares a page the remote processor keeps up to
+ * date, as it runs, with how it's doing: how busy it is, how much of its
+ * heap is free, and how many messages each of its endpoints is behind on.
+ * Host drivers read it with rproc_get_telemetry() and
+ * rproc_get_ept_backlog(), e.g. to scale the clocks of the remote
+ * processor or to decide where to send work, without asking it.
+ */
+struct fw_rsc_telemetry {
+	u32 da;
+	u32 num_epts;
+	u32 reserved;
+} __packed;
+
+/**
+ * struct fw_rsc_telemetry_tags - telemetry page declaration, with sender tags
+ * @da: device address of the telemetry page (a struct fw_telemetry), in a
+ *	carveout
+ * @num_epts: the number of endpoints the page has room for
+ * @num_tags: the number of sender tags the page has room for
+ * @reserved: reserved (must be zero)
+ *
+ * This is the RSC_TELEMETRY_TAGS entry: it's just like fw_rsc_telemetry,
+ * except the page also tells how many cycles the remote processor spent on
+ * the messages of each sender tag (see VIRTIO_RPMSG_F_ACCT), and the host
+ * enforces the shares of the senders out of it (see fw_telemetry_tag).
+ */
+struct fw_rsc_telemetry_tags {
+	u32 da;
+	u32 num_epts;
+	u32 num_tags;
+	u32 reserved;
+} __packed;
+
+/**
+ * struct fw_rsc_core - a core of a multi-core remote processor
+ * @core: index of the core, below rproc->num_cores
+ * @bootaddr: address of the first instruction the core runs
+ * @reserved: reserved (must be zero)
+ *
+ * The cores of some remote processors (e.g. the dual Cortex-M3 of the OMAP4
+ * IPU) each run their own instance of the firmware, out of a single image.
+ * This resource entry tells where @core boots, when that isn't the entry
+ * point of the image. Each core can serve its own vdevs (see fw_rsc_vdev's
+ * @core), whose vrings are then kicked on that very core, so the cores
+ * communicate with the host directly, rather than all through the first
+ * one.
+ */
+struct fw_rsc_core {
+	u32 core;
+	u32 bootaddr;
+	u32 reserved;
+} __packed;
+
+/* the most cores a remote processor can have */
+#define RPROC_MAX_CORES		4
+
+/**
+ * struct fw_rsc_trace_fmt - the format strings of a binary trace buffer
+ * @trace: index of the trace buffer (as in its "traceN" debugfs entry),
+ *	   which must be declared before this entry
+ * @da: device address of the format strings section of the image
+ * @len: length of the section, in bytes
+ * @reserved: reserved (must be zero)
+ *
+ * The records of a FW_TRACE_BINARY trace buffer name their format string by
+ * its offset in this section, which is loaded along with the rest of the
+ * image, but which the remote processor never reads: it holds the
+ * NUL-terminated format strings of its logs (e.g. the .trace_fmt section
+ * its logging macros put them in), and the host reads them as it expands
+ * the records.
+ */
+struct fw_rsc_trace_fmt {
+	u32 trace;
+	u32 da;
+	u32 len;
+	u32 reserved;
+} __packed;
+
+/* largest submission entry of a command queue, in bytes */
+#define FW_CMDQ_SQE_MAX		256
+
+/* most entries a command queue may have (its tags are 16 bits) */
+#define FW_CMDQ_DEPTH_MAX	4096
+
+/**
+ * struct fw_rsc_cmdq - command queue declaration
+ * @da: device address of the queue (a struct fw_cmdq)
+ * @depth: number of entries of each ring (a power of two, up to
+ *	   FW_CMDQ_DEPTH_MAX)
+ * @sqe_size: size of each submission entry, in bytes, its header included
+ *	      (a multiple of 4, up to FW_CMDQ_SQE_MAX)
+ * @sq_notifyid: the notifyid the host rings the doorbell of the queue with
+ * @cq_notifyid: the notifyid the remote processor signals completions with
+ * @reserved: reserved (must be zero)
+ * @name: name of the queue, which its host user opens it by (NUL-padded)
+ *
+ * This resource entry declares a pair of rings in one of the carveouts of
+ * the remote processor, NVMe-style, for command-heavy offload: the host
+ * writes commands into the submission ring, and only publishes its tail
+ * (the doorbell) once per batch; the remote processor writes a tag per
+ * completed command into the completion ring, and never publishes an
+ * index at all, as the host tells new completions by their phase bit.
+ * Host drivers use the queue with rproc_cmdq_open() and
+ * rproc_cmdq_submit().
+ *
+ * No more than @depth commands are ever in flight, since that's how many
+ * tags there are, so neither ring can overflow: the remote processor
+ * needs no completion ring head, and the host no submission ring head.
+ * The notifyids must be distinct, and not those of a vring or a queue.
+ */
+struct fw_rsc_cmdq {
+	u32 da;
+	u32 depth;
+	u32 sqe_size;
+	u32 sq_notifyid;
+	u32 cq_notifyid;
+	u32 reserved;
+	u8 name[32];
+} __packed;
+
+/**
+ * struct fw_cmdq - a command queue
+ * @sq_tail: index of the next submission entry the host writes
+ *	     (free-running), which is only published when the doorbell is
+ *	     rung
+ * @reserved: keeps the rings off the cache line of @sq_tail
+ * @rings: the submission ring (@depth entries of @sqe_size bytes, each a
+ *	   struct fw_cmdq_sqe), followed by the completion ring (@depth
+ *	   struct fw_cmdq_cqe)
+ *
+ * The entry of index i is the (i % depth) one of its ring. The remote
+ * processor consumes the submission entries in order, but may complete
+ * them in any order.
+ */
+struct fw_cmdq {
+	u32 sq_tail;
+	u32 reserved[15];
+	u8 rings[0];
+} __packed;
+
+/**
+ * struct fw_cmdq_sqe - a submission entry of a command queue
+ * @tag: the tag the command is completed with
+ * @len: length of @data, in bytes
+ * @data: the command
+ */
+struct fw_cmdq_sqe {
+	u16 tag;
+	u16 len;
+	u8 data[0];
+} __packed;
+
+/* set in fw_cmdq_cqe's @status on the odd passes over the completion ring */
+#define FW_CMDQ_CQE_PHASE	(1 << 15)
+
+/**
+ * struct fw_cmdq_cqe - a completion entry of a command queue
+ * @tag: the tag of the completed command
+ * @status: the outcome of the command (up to 15 bits, whose meaning is
+ *	    up to the firmware and its host driver), with FW_CMDQ_CQE_PHASE
+ *	    set on the first pass over the ring, cleared on the second, and
+ *	    so on
+ *
+ * The remote processor writes @tag before @status, and the whole entry
+ * at once if it can. The ring starts out zeroed.
+ */
+struct fw_cmdq_cqe {
+	u16 tag;
+	u16 status;
+} __packed;
+
+/* most regions a minidump may be made of */
+#define FW_MINIDUMP_MAX_REGIONS	64
+
+/**
+ * struct fw_rsc_minidump - minidump declaration
+ * @da: device address of the region table (@num struct fw_minidump_region)
+ * @num: number of entries of the region table (up to
+ *	 FW_MINIDUMP_MAX_REGIONS)
+ * @reserved: reserved (must be zero)
+ *
+ * This resource entry limits the core dumps of the remote processor (see
+ * rproc_coredump_capture()) to the regions of its table, e.g. the stacks of
+ * its tasks, its exception frame and its log buffer, rather than its whole
+ * carveouts: the dump is then small enough to be taken on the crash path
+ * without holding the recovery up, and still tells what went wrong.
+ *
+ * The table is only read as the remote processor crashes, so it may be
+ * updated at any time (e.g. with the exception frame, as the crash is
+ * handled by the remote processor). Entries whose @len is 0 are unused.
+ */
+struct fw_rsc_minidump {
+	u32 da;
+	u32 num;
+	u32 reserved;
+} __packed;
+
+/**
+ * struct fw_minidump_region - a region of a minidump
+ * @da: device address of the region
+ * @len: length of the region, in bytes (0 if the entry is unused)
+ */
+struct fw_minidump_region {
+	u32 da;
+	u32 len;
+} __packed;
+
+/* fw_telemetry's @util is in 1/FW_TELEMETRY_UTIL_SCALE units */
+#define FW_TELEMETRY_UTIL_SCALE	1024
+
+/**
+ * struct fw_telemetry_ept - the backlog of an endpoint of the remote processor
+ * @addr: the (rpmsg) address of the endpoint
+ * @backlog: the number of messages the endpoint has yet to handle
+ */
+struct fw_telemetry_ept {
+	u32 addr;
+	u32 backlog;
+} __packed;
+
+/**
+ * struct fw_telemetry - the telemetry the remote processor publishes
+ * @seq: bumped by the remote processor before and after each update, so
+ *	 it's odd while the page is being updated
+ * @util: how busy the remote processor was over its last sampling period,
+ *	  from 0 (idle) to FW_TELEMETRY_UTIL_SCALE (fully busy)
+ * @heap_free: free bytes in the heap of the remote processor
+ * @heap_size: size of the heap of the remote processor, in bytes
+ * @num_epts: number of entries in @epts (at most fw_rsc_telemetry's
+ *	      @num_epts)
+ * @num_tags: number of sender tags accounted for, in the array of struct
+ *	      fw_telemetry_tag that follows the @num_epts entries of @epts
+ *	      the page has room for (at most fw_rsc_telemetry_tags's
+ *	      @num_tags; ignored with a plain RSC_TELEMETRY entry)
+ * @epts: the backlogs of the endpoints of the remote processor
+ *
+ * The page is cleared by the host before the remote processor is booted.
+ */
+struct fw_telemetry {
+	u32 seq;
+	u32 util;
+	u32 heap_free;
+	u32 heap_size;
+	u32 num_epts;
+	u32 num_tags;
+	struct fw_telemetry_ept epts[0];
+} __packed;
+
+/**
+ * struct fw_telemetry_tag - what a remote processor spent on a sender tag
+ * @tag: the tag, as the messages of its sender carry it (see
+ *	 VIRTIO_RPMSG_F_ACCT)
+ * @reserved: reserved (must be zero)
+ * @cycles: cycles the remote processor spent on the messages of @tag since
+ *	    it was booted (or since it last listed @tag)
+ *
+ * The host samples these to charge each tag's consumption to its sender
+ * (a cgroup, see CONFIG_CGROUP_RPROC), and, while the remote processor is
+ * busy, holds back the senders which used more than their share.
+ */
+struct fw_telemetry_tag {
+	u32 tag;
+	u32 reserved;
+	u64 cycles;
+} __packed;
+
+/**
+ * struct rproc_coalesce_params - how to moderate the notifications of an rproc
+ * @adaptive: tune the moderation to the rate, in buffers per second, the
+ *	      vrings of the remote processor go through, rather than use
+ *	      @usecs and @frames
+ * @usecs: see fw_coalesce, when not @adaptive
+ * @frames: see fw_coalesce, when not @adaptive
+ * @rate_low: at or under this rate, when @adaptive, @usecs_low and
+ *	      @frames_low are used
+ * @usecs_low: see @rate_low
+ * @frames_low: see @rate_low
+ * @rate_high: at or over this rate, when @adaptive, @usecs_high and
+ *	       @frames_high are used (and in between, a linear mix of both)
+ * @usecs_high: see @rate_high
+ * @frames_high: see @rate_high
+ * @sample_ms: how often the rate is measured, when @adaptive, in msecs
+ *
+ * These are named after their ethtool counterparts (rx-usecs, etc.).
+ */
+struct rproc_coalesce_params {
+	bool adaptive;
+	u32 usecs;
+	u32 frames;
+	u32 rate_low;
+	u32 usecs_low;
+	u32 frames_low;
+	u32 rate_high;
+	u32 usecs_high;
+	u32 frames_high;
+	u32 sample_ms;
+};
+
 /**
  * struct rproc_mem_entry - memory entry descriptor
  * @va:	virtual address
  * @dma: dma address
  * @len: length, in bytes
  * @da: device address
- * @priv: associated data
+ * @priv: associated data (for iommu mappings: the dma-buf they map, if any)
  * @node: list node
+ * @fresh: the memory was just allocated (and thus zeroed out), and the
+ *	   remote processor wasn't booted with it yet
+ * @flags: iommu mapping flags of the carveout, or the format of a trace
+ *	   buffer (its fw_rsc_trace flags)
+ * @deferred: the iommu mapping of the carveout is deferred until the
+ *	      firmware segments are loaded (see rproc->sparse_load)
+ * @adopted: the carveout was set up by whoever booted the remote processor
+ *	     (see RPROC_DETACHED), and is only mapped into the kernel by us
+ * @dev: the device the memory of the carveout was allocated with
+ * @shared: the copy of the carveout which is shared with other remote
+ *	    processors, if any (see FW_CARVEOUT_SHARED)
+ * @user: the memory of the carveout, if user space may map it (see
+ *	  FW_CARVEOUT_USER)
+ * @formats: the format strings of a binary trace buffer (see
+ *	     fw_rsc_trace_fmt), if it has some
+ * @formats_len: length of @formats, in bytes
  */
 struct rproc_mem_entry {
 	void *va;
 	dma_addr_t dma;
-	int len;
+	size_t len;
 	u32 da;
 	void *priv;
 	struct list_head node;
+	bool fresh;
+	u32 flags;
+	bool deferred;
+	bool adopted;
+	struct device *dev;
+	struct rproc_shared_carveout *shared;
+	struct rproc_user_mem *user;
+	const char *formats;
+	u32 formats_len;
 };
 
 struct rproc;
+struct rproc_shared_carveout;
+struct rproc_user_mem;
+struct dma_buf;
+struct rproc_fw_image;
+struct rproc_vring_map;
+struct rproc_carveout_index;
+struct rproc_perf;
+struct rproc_timesync;
+struct rproc_coalesce;
+struct rproc_overlay;
+struct rproc_dynmem;
+struct rproc_telemetry_page;
+struct firmware;
+struct gen_pool;
+
+/**
+ * enum rproc_boot_phase - the phases a boot of a remote processor goes through
+ * @RPROC_BOOT_REQUEST_FW: getting its firmware image (e.g. request_firmware())
+ * @RPROC_BOOT_CHECK_FW: sanity checking, validating and parsing the image
+ * @RPROC_BOOT_RESOURCES: setting up the resources of the image (carveouts,
+ *			  iommu mappings, trace buffers, ...)
+ * @RPROC_BOOT_LOAD: loading the segments of the image
+ * @RPROC_BOOT_START: powering the remote processor on (ops->start())
+ * @RPROC_BOOT_READY: waiting for the remote processor to first notify us
+ *		      (e.g. with its rpmsg name service announcements)
+ * @RPROC_BOOT_PHASES: just keep this one at the end
+ *
+ * The firmware phases take no time if the image was already cached, and
+ * the resources phase only accounts for mapping the carveouts if they were
+ * kept resident (see rproc->keep_resources).
+ */
+enum rproc_boot_phase {
+	RPROC_BOOT_REQUEST_FW,
+	RPROC_BOOT_CHECK_FW,
+	RPROC_BOOT_RESOURCES,
+	RPROC_BOOT_LOAD,
+	RPROC_BOOT_START,
+	RPROC_BOOT_READY,
+	RPROC_BOOT_PHASES,
+};
+
+/**
+ * typedef rproc_event_cb_t - handler of the inline events of an rproc
+ * @rproc: the remote processor which sent the event
+ * @event: the event, whose meaning is up to the firmware and its driver
+ * @priv: private data, as given to rproc_register_event_cb()
+ *
+ * Called from the interrupt handler of the notification which carried the
+ * event, so it must not sleep.
+ */
+typedef void (*rproc_event_cb_t)(struct rproc *rproc, u32 event, void *priv);
 
 /**
  * struct rproc_ops - platform-specific device handlers
- * @start:	power on the device and boot it
+ * @prepare:	power up what the device needs to be booted (e.g. its
+ *		mailbox), short of taking it out of reset. It's called from a
+ *		workqueue, while the firmware image is read, and its resources
+ *		set up and loaded, so it may sleep for long, but must not rely
+ *		on any of them (optional)
+ * @unprepare:	undo @prepare, once the device is powered off, or if the
+ *		boot failed before it was started (optional)
+ * @start:	power on the device and boot it (once @prepare completed)
  * @stop:	power off the device
- * @kick:	kick a virtqueue (virtqueue id given as a parameter)
+ * @kick:	kick a virtqueue (virtqueue id given as a parameter); may be
+ *		called from atomic context, so it must not sleep
+ * @kick_vqs:	kick several virtqueues with a single notification (bit n of
+ *		the mask given as a parameter stands for virtqueue id n); if
+ *		it's provided, the kicks of the first BITS_PER_LONG virtqueues
+ *		are coalesced, and it's used for them instead of @kick. Called
+ *		from a tasklet, so it must not sleep (optional)
+ * @kick_core:	kick a virtqueue on the core of a multi-core device which
+ *		serves it (see fw_rsc_core); if it's provided, it's used for
+ *		the kicks of all the vrings, instead of @kick and @kick_vqs.
+ *		May be called from atomic context, so it must not sleep
+ *		(optional)
+ * @suspend:	put the device in a low power state, keeping its memory (and
+ *		thus its loaded firmware and state) intact (optional)
+ * @resume:	bring a suspended device back to where it was (optional)
+ * @validate:	validate a firmware image (e.g. check its signature), once it
+ *		passed the sanity checks of its format. Only done once per
+ *		image, since images are cached across boots (optional)
+ * @attach:	take over a device that is running already, e.g. because the
+ *		bootloader booted it (see RPROC_DETACHED), without resetting it
+ *		(optional)
+ * @find_loaded_rsc_table: find the resource table of a device that is
+ *		running already, in its memory (required along with @attach)
+ * @trace_clock: read the clock the device stamps its trace lines with (see
+ *		FW_TRACE_STAMPED), which ticks at rproc->trace_clock_rate.
+ *		Called with interrupts disabled, so it must not sleep (optional)
+ * @route_peer:	route the notifications about @notifyid between the device
+ *		and the peer it shares vrings with (see fw_rsc_peer), both
+ *		ways, e.g. between their mailboxes, or stop routing them if
+ *		@enable is false (optional)
+ * @send_event:	send an inline event (see rproc_send_event()) in the
+ *		notification itself, e.g. in the mailbox message, rather than
+ *		through a vring. Returns -EINVAL if @event doesn't fit. Called
+ *		from any context, so it must not sleep (optional)
  */
 struct rproc_ops {
+	int (*prepare)(struct rproc *rproc);
+	void (*unprepare)(struct rproc *rproc);
 	int (*start)(struct rproc *rproc);
 	int (*stop)(struct rproc *rproc);
 	void (*kick)(struct rproc *rproc, int vqid);
+	void (*kick_vqs)(struct rproc *rproc, unsigned long vqids);
+	void (*kick_core)(struct rproc *rproc, unsigned int core, int vqid);
+	int (*suspend)(struct rproc *rproc);
+	int (*resume)(struct rproc *rproc);
+	int (*validate)(struct rproc *rproc, const struct firmware *fw);
+	int (*attach)(struct rproc *rproc);
+	struct resource_table *(*find_loaded_rsc_table)(struct rproc *rproc,
+								int *tablesz);
+	u64 (*trace_clock)(struct rproc *rproc);
+	int (*route_peer)(struct rproc *rproc, struct rproc *peer, u32 notifyid,
+								bool enable);
+	int (*send_event)(struct rproc *rproc, u32 event);
 };
 
 /**
@@ -344,6 +1409,15 @@ struct rproc_ops {
  *			a message.
  * @RPROC_RUNNING:	device is up and running
  * @RPROC_CRASHED:	device has crashed; need to start recovery
+ * @RPROC_DETACHED:	device was booted by someone else (e.g. the bootloader)
+ *			and is running, but we haven't attached to it yet.
+ *			Set by rproc implementations before rproc_add().
+ * @RPROC_ARMED:	device is the hot spare of another one (see
+ *			rproc_set_failover()): its firmware is loaded, and
+ *			it's held in reset, ready to take over
+ * @RPROC_BOOTING:	device is being booted (or armed): its firmware is
+ *			being read, without rproc->lock held, and other
+ *			rproc_boot() callers wait for the outcome
  * @RPROC_LAST:		just keep this one at the end
  *
  * Please note that the values of these states are used as indices
@@ -357,12 +1431,19 @@ enum rproc_state {
 	RPROC_SUSPENDED	= 1,
 	RPROC_RUNNING	= 2,
 	RPROC_CRASHED	= 3,
-	RPROC_LAST	= 4,
+	RPROC_DETACHED	= 4,
+	RPROC_ARMED	= 5,
+	RPROC_BOOTING	= 6,
+	RPROC_LAST	= 7,
 };
 
 /**
  * enum rproc_crash_type - remote processor crash types
  * @RPROC_MMUFAULT:	iommu fault
+ * @RPROC_WATCHDOG:	the remote processor hung, and missed its watchdog
+ *			deadline (see rproc->watchdog_timeout), or had its
+ *			hardware watchdog timer expire
+ * @RPROC_FATAL_ERROR:	the remote processor reported a fatal error itself
  *
  * Each element of the enum is used as an array index. So that, the value of
  * the elements should be always something sane.
@@ -371,6 +1452,37 @@ enum rproc_state {
  */
 enum rproc_crash_type {
 	RPROC_MMUFAULT,
+	RPROC_WATCHDOG,
+	RPROC_FATAL_ERROR,
+};
+
+/**
+ * struct rproc_load - how busy a remote processor was kept by its vrings
+ * @period_us: length of the sampled period, in usecs
+ * @busy_us: how much of @period_us the remote processor is deemed busy
+ * @msgs: number of buffers it consumed, or filled, during the period
+ * @backlog: number of buffers it was sent, and has yet to consume
+ */
+struct rproc_load {
+	unsigned long period_us;
+	unsigned long busy_us;
+	unsigned int msgs;
+	unsigned int backlog;
+};
+
+/**
+ * struct rproc_telemetry - what a remote processor tells of how it's doing
+ * @util: how busy it was over its last sampling period, from 0 (idle) to
+ *	  FW_TELEMETRY_UTIL_SCALE (fully busy)
+ * @heap_free: free bytes in its heap
+ * @heap_size: size of its heap, in bytes
+ * @num_epts: number of endpoints it publishes a backlog for
+ */
+struct rproc_telemetry {
+	u32 util;
+	u32 heap_free;
+	u32 heap_size;
+	u32 num_epts;
 };
 
 /**
@@ -385,22 +1497,204 @@ enum rproc_crash_type {
  * @fw_ops: firmware-specific handlers
  * @power: refcount of users who need this rproc powered up
  * @state: state of the device
- * @lock: lock which protects concurrent manipulations of the rproc
+ * @lock: lock which protects concurrent manipulations of the rproc. It's
+ *	  only held briefly: the firmware is read without it (see
+ *	  RPROC_BOOTING)
+ * @fw_lock: serializes the reads of the firmware image (which may take
+ *	     seconds) with each other, and with the changes of @firmware and
+ *	     of its cache. Taken before @lock, if both are.
+ * @boot_done: completed once @rproc is no longer RPROC_BOOTING
  * @dbg_dir: debugfs directory of this rproc device
  * @traces: list of trace buffers
  * @num_traces: number of trace buffers
  * @carveouts: list of physically contiguous memory allocations
  * @mappings: list of iommu mappings we initiated, needed on shutdown
+ * @carveout_index: @carveouts, sorted for address translations to be
+ *		    O(log n) (RCU-protected; see rproc_index_carveouts())
+ * @dmabuf_da: start of the window of device addresses in which dma-bufs are
+ *	       mapped when no address is given (see rproc_map_dmabuf()). May
+ *	       be set by rproc implementations before rproc_add().
+ * @dmabuf_len: size of that window, in bytes (0 if there's none)
+ * @banks: devices standing for the memory banks the carveouts can ask to be
+ *	   placed in (see FW_CARVEOUT_BANK()), each backed by its own CMA area
+ *	   declared by the platform. May be set by rproc implementations
+ *	   before rproc_add(), along with @num_banks.
+ * @num_banks: number of entries in @banks
  * @firmware_loading_complete: marks e/o asynchronous firmware loading
  * @bootaddr: address of first instruction to boot rproc with (optional)
+ * @num_cores: number of cores of the remote processor, each of which runs
+ *	       its own instance of the firmware (see fw_rsc_core). 1 by
+ *	       default; may be set by rproc implementations before rproc_add().
+ * @core_bootaddr: address of the first instruction each core boots with
+ *		   (the first one's is @bootaddr)
  * @rvdevs: list of remote virtio devices
  * @notifyids: idr for dynamically assigning rproc-wide unique notify ids
  * @index: index of this rproc device
  * @crash_handler: workqueue for handling a crash
  * @crash_cnt: crash counter
+ * @crash_type: type of the last crash reported
  * @crash_comp: completion used to sync crash handler and the rproc reload
  * @recovery_disabled: flag that state if recovery was disabled
  * @max_notifyid: largest allocated notify id.
+ * @fw_image: the parsed firmware image, cached across boots (protected
+ *	      by @lock)
+ * @fw_pinned: the firmware file is held in firmware_class' cache too
+ *	       (protected by @lock)
+ * @standby_image: a parsed image of another firmware, which can be switched
+ *		   to quickly (see rproc_prefetch_fw()), protected by @lock
+ * @standby_fw: name of the firmware of @standby_image
+ * @prefetch_fw: name of the firmware to prefetch, if any (protected by @lock)
+ * @prefetch_work: loads @prefetch_fw into @standby_image, in the background
+ * @rsc_table_fw: name of a firmware file holding a copy of the resource
+ *		  table of @firmware (e.g. its .resource_table section). If
+ *		  set, the vdevs are registered out of it, so the (much
+ *		  bigger) image is only read once the remote processor is
+ *		  booted. May be set by rproc implementations before
+ *		  rproc_add().
+ * @stream_fw: load the firmware segments straight from the firmware file,
+ *	       as it is read, instead of going through a whole in-memory copy
+ *	       of the image. May be set by rproc implementations before
+ *	       rproc_add(); requires the firmware to be available on the
+ *	       filesystem.
+ * @keep_resources: keep the resources (carveouts, iommu mappings, trace
+ *		    buffers) of the firmware resident across power cycles,
+ *		    so booting again only reloads the segments and restarts
+ *		    the remote processor. May be set by rproc implementations
+ *		    before rproc_add().
+ * @resident_image: the firmware image whose resources are resident, if any
+ *		    (protected by @lock)
+ * @snapshots: the memory regions whose contents are saved while the remote
+ *	       processor is powered off (see fw_rsc_snapshot)
+ * @snapshot_valid: whether the contents of @snapshots were saved, and
+ *		    should be restored on the next boot (protected by @lock)
+ * @fast_recovery: recover from crashes by restarting the remote processor
+ *		   underneath its virtio devices, which are only frozen and
+ *		   restored (see rproc_trigger_recovery()), instead of being
+ *		   removed and added back. May be set by rproc implementations
+ *		   before rproc_add().
+ * @sparse_load: only map the file-backed parts of the firmware segments
+ *		 onto the iommu, and zero out and map the rest (i.e. their
+ *		 bss) on demand, as the remote processor faults on it. May be
+ *		 set by rproc implementations before rproc_add(), if their
+ *		 iommu driver can map memory from its fault handler.
+ * @share_carveouts: share the read-only carveouts of the firmware (see
+ *		     FW_CARVEOUT_SHARED) with the other remote processors
+ *		     which are booted with the same firmware image. May be
+ *		     set by rproc implementations before rproc_add(), if
+ *		     their remote processors are behind an iommu.
+ * @fw_crc: crc32 of the firmware image whose resources are set up, or 0 if
+ *	    its carveouts can't be shared (e.g. it's streamed)
+ * @holes: list of the parts of the carveouts that are faulted in on demand
+ * @deps: list of the remote processors this one depends on (see
+ *	  rproc_add_dep())
+ * @peers: list of the remote processors this one shares vrings with (see
+ *	   rproc_add_peer())
+ * @failover: the remote processor this one is paired with, which takes over
+ *	      when the one of the pair that's running crashes (see
+ *	      rproc_set_failover())
+ * @spare: this one is the hot spare of the pair, rather than the active one
+ * @armed_image: the firmware image the hot spare is loaded with, while it's
+ *		 armed (see RPROC_ARMED)
+ * @arm_work: arms the hot spare, in the background
+ * @queues: list of the shared-memory queues of the remote processor (see
+ *	    fw_rsc_queue), which are kept until it's released
+ * @cmdqs: list of the command queues of the remote processor (see
+ *	   fw_rsc_cmdq), which are kept until it's released
+ * @boot_work: asynchronous boot work (see rproc_boot_async())
+ * @boot_comp: completed once the last asynchronous boot is over
+ * @boot_ret: outcome of the last asynchronous boot
+ * @boot_pending: whether an asynchronous boot is in flight
+ * @prepare_work: runs the ->prepare() handler, while booting
+ * @prepare_ret: outcome of the last ->prepare() handler
+ * @prepared: the ->prepare() handler succeeded, and is yet to be undone
+ * @preloaded_fw: the firmware image, if it was handed to us in memory (see
+ *		  rproc_set_preloaded_fw())
+ * @rsc_update: work rescanning the resource table of the running remote
+ *		processor for vdevs (see rproc_report_rsc_update())
+ * @autosuspend_delay: suspend the running remote processor (see
+ *		       rproc_suspend()) once it's been idle, i.e. neither
+ *		       kicked nor interrupting, for this many msecs, and
+ *		       resume it as soon as it's kicked again; 0 means never.
+ *		       May be set by rproc implementations before rproc_add().
+ * @runtime_suspended: the remote processor was suspended because it idled
+ *		       (protected by @lock)
+ * @dump: core dump of the last crash, if any (protected by @lock)
+ * @minidump_da: device address of the minidump region table, if the
+ *		 firmware declared one (see fw_rsc_minidump)
+ * @minidump_num: number of entries of the minidump region table, or 0
+ * @watchdog_timeout: deadline, in usecs, within which a running remote
+ *		      processor must show signs of life (i.e. interrupt with
+ *		      a virtqueue index, or be petted with rproc_watchdog_pet()),
+ *		      or it's deemed hung, and recovered; 0 means no deadline.
+ *		      May be set by rproc implementations before rproc_add().
+ * @watchdog: timer enforcing @watchdog_timeout
+ * @watchdog_lock: protects @watchdog_armed
+ * @watchdog_armed: whether @watchdog is enforced, i.e. whether the remote
+ *		    processor is running
+ * @ipc_cpus: cpus the vring notifications of the remote processor (and the
+ *	      rpmsg dispatch they lead to) are handled on, along with its
+ *	      mailbox interrupt, if the rproc implementation can tell; empty
+ *	      means wherever they're reported from. May be filled in by rproc
+ *	      implementations before rproc_add(), and changed via debugfs.
+ * @ipc_wq: high priority workqueue the vring notifications are handled on,
+ *	    if @ipc_cpus isn't empty
+ * @ipc_work: handles the vring notifications, on @ipc_wq
+ * @vring_map: the vrings, indexed by their notifyid, for the vring
+ *	       notifications to find them with a single load (RCU-protected;
+ *	       updated along with @notifyids)
+ * @coherent: the remote processor is cache coherent with us (e.g. it sits
+ *	      on a coherent interconnect), so its vrings only need SMP
+ *	      barriers rather than mandatory ones. May be set by rproc
+ *	      implementations before rproc_add().
+ * @kicks_pending: the virtqueues whose kicks are being coalesced, for
+ *		   ops->kick_vqs() (bit n stands for virtqueue id n)
+ * @kick_tasklet: sends the coalesced kicks, from softirq context
+ * @poll_cpu: cpu on which the vrings are busy-polled while the remote
+ *	      processor keeps them busy, rather than waiting for its
+ *	      notifications; -1 (the default) means they never are. May be
+ *	      set by rproc implementations before rproc_add().
+ * @poll_idle_usecs: busy-polling stops once the vrings were idle for this
+ *		     long, until the next notification. May be set by rproc
+ *		     implementations before rproc_add().
+ * @poll_thread: busy-polls the vrings, on @poll_cpu
+ * @polling: whether @poll_thread is busy-polling the vrings at the moment
+ * @shared_lock: protects the @shared entries of the vdevs
+ * @msg_cost_us: how long each buffer going through the vrings is deemed to
+ *		 keep the remote processor busy, by rproc_get_load(). May be
+ *		 set by rproc implementations before rproc_add().
+ * @load_stamp: when rproc_get_load() last sampled the vrings
+ * @trace_clock_rate: rate (in Hz) of the clock ops->trace_clock() reads.
+ *		      Should be set by rproc implementations which provide it,
+ *		      before rproc_add().
+ * @boot_ns: how long (in nsecs) each phase of the last boot took (see
+ *	     enum rproc_boot_phase; protected by @lock, but for the ready one)
+ * @boot_mark: when the last boot phase that was accounted for ended
+ * @boot_profiling: a boot is going on, whose phases are accounted for
+ * @boot_ready_pending: the remote processor was started, and is yet to
+ *			first notify us
+ * @perf: the perf PMU of the remote processor's performance counters, if
+ *	  its firmware declared some (see fw_rsc_perf)
+ * @event_cb: the handler of the inline events of the remote processor
+ * @event_priv: private data of @event_cb
+ * @event_lock: protects @event_cb and @event_priv
+ * @timesync: the clock synchronization requested by the firmware, if any
+ * @timesync_lock: protects @timesync
+ * @notifications: number of vring notifications of the remote processor
+ * @coalesce_params: how to moderate the vring notifications of the remote
+ *		     processor, if its firmware lets us (see fw_rsc_coalesce);
+ *		     may be set by the rproc implementation before rproc_add()
+ * @coalesce: the notification moderation, while the remote processor is
+ *	      running with it
+ * @coalesce_lock: protects @coalesce_params and @coalesce
+ * @overlay: the overlay region of the firmware, if any (see
+ *	     fw_rsc_overlay)
+ * @dynmem: the runtime memory window of the firmware, if any (see
+ *	    fw_rsc_dynmem)
+ * @telemetry: the telemetry page of the firmware, if any (see
+ *	       fw_rsc_telemetry)
+ * @telemetry_lock: protects @telemetry
+ * @cdev: the /dev/remoteprocN node user space maps carveouts through (see
+ *	  FW_CARVEOUT_USER)
  */
 struct rproc {
 	struct klist_node node;
@@ -414,25 +1708,132 @@ struct rproc {
 	atomic_t power;
 	unsigned int state;
 	struct mutex lock;
+	struct mutex fw_lock;
+	struct completion boot_done;
 	struct dentry *dbg_dir;
 	struct list_head traces;
 	int num_traces;
 	struct list_head carveouts;
 	struct list_head mappings;
+	struct rproc_carveout_index *carveout_index;
+	u32 dmabuf_da;
+	u32 dmabuf_len;
+	struct device **banks;
+	int num_banks;
 	struct completion firmware_loading_complete;
 	u32 bootaddr;
+	unsigned int num_cores;
+	u32 core_bootaddr[RPROC_MAX_CORES];
 	struct list_head rvdevs;
 	struct idr notifyids;
 	int index;
 	struct work_struct crash_handler;
 	unsigned crash_cnt;
+	enum rproc_crash_type crash_type;
 	struct completion crash_comp;
 	bool recovery_disabled;
 	int max_notifyid;
+	struct rproc_fw_image *fw_image;
+	bool fw_pinned;
+	struct rproc_fw_image *standby_image;
+	const char *standby_fw;
+	const char *prefetch_fw;
+	struct work_struct prefetch_work;
+	const char *rsc_table_fw;
+	bool stream_fw;
+	bool keep_resources;
+	struct rproc_fw_image *resident_image;
+	struct list_head snapshots;
+	bool snapshot_valid;
+	bool fast_recovery;
+	bool sparse_load;
+	bool share_carveouts;
+	u32 fw_crc;
+	struct list_head holes;
+	struct list_head deps;
+	struct list_head peers;
+	struct rproc *failover;
+	bool spare;
+	struct rproc_fw_image *armed_image;
+	struct work_struct arm_work;
+	struct list_head queues;
+	struct list_head cmdqs;
+	struct work_struct boot_work;
+	struct completion boot_comp;
+	int boot_ret;
+	atomic_t boot_pending;
+	struct work_struct prepare_work;
+	int prepare_ret;
+	bool prepared;
+	const struct firmware *preloaded_fw;
+	struct work_struct rsc_update;
+	int autosuspend_delay;
+	bool runtime_suspended;
+	struct rproc_dump *dump;
+	u32 minidump_da;
+	u32 minidump_num;
+	unsigned int watchdog_timeout;
+	struct hrtimer watchdog;
+	spinlock_t watchdog_lock;
+	bool watchdog_armed;
+	cpumask_var_t ipc_cpus;
+	struct workqueue_struct *ipc_wq;
+	struct work_struct ipc_work;
+	struct rproc_vring_map *vring_map;
+	bool coherent;
+	unsigned long kicks_pending;
+	struct tasklet_struct kick_tasklet;
+	int poll_cpu;
+	unsigned int poll_idle_usecs;
+	struct task_struct *poll_thread;
+	bool polling;
+	spinlock_t shared_lock;
+	unsigned int msg_cost_us;
+	ktime_t load_stamp;
+	u32 trace_clock_rate;
+	u64 boot_ns[RPROC_BOOT_PHASES];
+	ktime_t boot_mark;
+	bool boot_profiling;
+	atomic_t boot_ready_pending;
+	struct rproc_perf *perf;
+	rproc_event_cb_t event_cb;
+	void *event_priv;
+	spinlock_t event_lock;
+	struct rproc_timesync *timesync;
+	spinlock_t timesync_lock;
+	unsigned long notifications;
+	struct rproc_coalesce_params coalesce_params;
+	struct rproc_coalesce *coalesce;
+	spinlock_t coalesce_lock;
+	struct rproc_overlay *overlay;
+	struct rproc_dynmem *dynmem;
+	struct rproc_telemetry_page *telemetry;
+	spinlock_t telemetry_lock;
+	struct cdev cdev;
 };
 
-/* we currently support only two vrings per rvdev */
-#define RVDEV_NUM_VRINGS 2
+/**
+ * struct rproc_vring_stats - what went through a vring
+ * @kicks: kicks of the remote processor about the vring
+ * @interrupts: notifications of the remote processor the vring was looked at
+ *		for (all the vrings are, for those that don't tell which vring
+ *		they're about)
+ * @spurious: those of @interrupts which found nothing new in the vring
+ * @inflight_max: most buffers the remote processor was yet to use, as it was
+ *		  kicked: a full vring means it can't keep up
+ * @batch_max: most buffers the remote processor used between two of its
+ *	       notifications: 1 means it's interrupting for every buffer
+ *
+ * These are updated without any locking, from wherever the kicks and the
+ * notifications come from, so they may miss a few of them.
+ */
+struct rproc_vring_stats {
+	unsigned long kicks;
+	unsigned long interrupts;
+	unsigned long spurious;
+	u16 inflight_max;
+	u16 batch_max;
+};
 
 /**
  * struct rproc_vring - remoteproc vring state
@@ -442,8 +1843,21 @@ struct rproc {
  * @da: device address
  * @align: vring alignment
  * @notifyid: rproc-specific unique vring index
+ * @core: the core of the remote processor that serves the vring
  * @rvdev: remote vdev
  * @vq: the virtqueue of this vring
+ * @adopted: the vring is the one a detached remote processor uses already,
+ *	     rather than one we allocated
+ * @fixed: the vring is where the firmware asked for it (at @pa), rather
+ *	   than one we allocated
+ * @pa: physical address of a @fixed vring
+ * @ipc: the vring is in the IPC region of its vdev (see fw_rsc_ipcmem)
+ * @last_used: the used index of the vring, as rproc_get_load() last saw it
+ * @irq_used: the used index of the vring, as the last notification of the
+ *	      remote processor that it was looked at for saw it
+ * @coalesce_used: the used index of the vring, as the notification
+ *		   moderation last sampled it
+ * @stats: what went through the vring
  */
 struct rproc_vring {
 	void *va;
@@ -452,8 +1866,17 @@ struct rproc_vring {
 	u32 da;
 	u32 align;
 	int notifyid;
+	unsigned int core;
 	struct rproc_vdev *rvdev;
 	struct virtqueue *vq;
+	bool adopted;
+	bool fixed;
+	phys_addr_t pa;
+	bool ipc;
+	u16 last_used;
+	u16 irq_used;
+	u16 coalesce_used;
+	struct rproc_vring_stats stats;
 };
 
 /**
@@ -461,17 +1884,53 @@ struct rproc_vring {
  * @node: list node
  * @rproc: the rproc handle
  * @vdev: the virio device
- * @vring: the vrings for this vdev
+ * @num_vrings: number of entries in @vring, as announced by the firmware
  * @dfeatures: virtio device features
  * @gfeatures: virtio guest features
+ * @config: copy of the virtio config space, as provided by the firmware
+ * @config_len: size of @config
+ * @notifyid: the vdev's notify index, as announced by the firmware
+ * @core: the core of the remote processor that serves the vdev
+ * @rsc: the vdev's entry in the resource table the remote processor uses,
+ *	 if it was added on the fly (see rproc_report_rsc_update())
+ * @listed: the vdev is still in the resource table (only used while the
+ *	    table is rescanned)
+ * @status: the vdev's virtio status
+ * @shared: the vdev's entry in the resource table the remote processor was
+ *	    loaded with, while it's up and if that table is part of its
+ *	    memory: its config space and status go through there (protected
+ *	    by rproc->shared_lock)
+ * @bufs_len: how much memory the driver of the vdev allocated for its
+ *	      buffers (see rproc_vdev_account_bufs())
+ * @ipc_va: kernel address of the IPC region of the vdev, if the firmware
+ *	    asked for one (see fw_rsc_ipcmem)
+ * @ipc_dma: dma address of the IPC region
+ * @ipc_len: size of the IPC region
+ * @ipc_pool: allocator of the vrings and buffers in the IPC region
+ * @vring: the vrings for this vdev (e.g. all the queues of a multiqueue
+ *	   device)
  */
 struct rproc_vdev {
 	struct list_head node;
 	struct rproc *rproc;
 	struct virtio_device vdev;
-	struct rproc_vring vring[RVDEV_NUM_VRINGS];
+	int num_vrings;
 	unsigned long dfeatures;
 	unsigned long gfeatures;
+	void *config;
+	u32 config_len;
+	u32 notifyid;
+	unsigned int core;
+	struct fw_rsc_vdev *rsc;
+	bool listed;
+	u8 status;
+	struct fw_rsc_vdev *shared;
+	atomic_long_t bufs_len;
+	void *ipc_va;
+	dma_addr_t ipc_dma;
+	size_t ipc_len;
+	struct gen_pool *ipc_pool;
+	struct rproc_vring vring[0];
 };
 
 struct rproc *rproc_alloc(struct device *dev, const char *name,
@@ -482,8 +1941,155 @@ int rproc_add(struct rproc *rproc);
 int rproc_del(struct rproc *rproc);
 
 int rproc_boot(struct rproc *rproc);
+struct completion *rproc_boot_async(struct rproc *rproc);
+int rproc_boot_wait(struct rproc *rproc);
+int rproc_add_dep(struct rproc *rproc, struct rproc *dep);
+int rproc_add_peer(struct rproc *rproc, struct rproc *peer);
+int rproc_set_failover(struct rproc *rproc, struct rproc *spare);
+int rproc_set_preloaded_fw(struct rproc *rproc, const void *data, size_t size);
 void rproc_shutdown(struct rproc *rproc);
+void rproc_flush_fw_cache(struct rproc *rproc);
+int rproc_preload_fw(struct rproc *rproc);
+int rproc_prefetch_fw(struct rproc *rproc, const char *firmware);
+int rproc_set_firmware(struct rproc *rproc, const char *firmware);
+int rproc_map_dmabuf(struct rproc *rproc, struct dma_buf *dmabuf, u32 *da,
+								int flags);
+int rproc_unmap_dmabuf(struct rproc *rproc, u32 da);
+int rproc_suspend(struct rproc *rproc);
+int rproc_resume(struct rproc *rproc);
 void rproc_report_crash(struct rproc *rproc, enum rproc_crash_type type);
+void rproc_report_rsc_update(struct rproc *rproc);
+void rproc_watchdog_pet(struct rproc *rproc);
+int rproc_register_event_cb(struct rproc *rproc, rproc_event_cb_t cb,
+								void *priv);
+void rproc_unregister_event_cb(struct rproc *rproc);
+int rproc_send_event(struct rproc *rproc, u32 event);
+void rproc_event_interrupt(struct rproc *rproc, u32 event);
+void rproc_get_load(struct rproc *rproc, struct rproc_load *load);
+u64 rproc_trace_clock_to_host(struct rproc *rproc, u64 ts);
+int rproc_timesync_to_remote(struct rproc *rproc, ktime_t host, u64 *ticks);
+int rproc_timesync_to_host(struct rproc *rproc, u64 ticks, ktime_t *host);
+int rproc_get_telemetry(struct rproc *rproc, struct rproc_telemetry *tm);
+int rproc_get_ept_backlog(struct rproc *rproc, u32 addr, u32 *backlog);
+int rproc_acct_admit(struct rproc *rproc, u16 tag, long timeout);
+
+struct rproc_queue;
+
+typedef void (*rproc_queue_cb_t)(struct rproc_queue *q, void *data, int len,
+								void *priv);
+
+#ifdef CONFIG_REMOTEPROC_QUEUE
+struct rproc_queue *rproc_queue_open(struct rproc *rproc, const char *name,
+					rproc_queue_cb_t cb, void *priv);
+void rproc_queue_close(struct rproc_queue *q);
+int rproc_queue_send(struct rproc_queue *q, const void *data, int len);
+#else
+static inline struct rproc_queue *rproc_queue_open(struct rproc *rproc,
+		const char *name, rproc_queue_cb_t cb, void *priv)
+{
+	return ERR_PTR(-ENODEV);
+}
+
+static inline void rproc_queue_close(struct rproc_queue *q) { }
+
+static inline
+int rproc_queue_send(struct rproc_queue *q, const void *data, int len)
+{
+	return -ENODEV;
+}
+#endif
+
+struct rproc_cmdq;
+
+typedef void (*rproc_cmdq_cb_t)(struct rproc_cmdq *q, void *ctx, int status,
+								void *priv);
+
+/* more commands follow: don't ring the doorbell yet */
+#define RPROC_CMDQ_MORE		(1 << 0)
+
+#ifdef CONFIG_REMOTEPROC_CMDQ
+struct rproc_cmdq *rproc_cmdq_open(struct rproc *rproc, const char *name,
+					rproc_cmdq_cb_t cb, void *priv);
+void rproc_cmdq_close(struct rproc_cmdq *q);
+int rproc_cmdq_submit(struct rproc_cmdq *q, const void *cmd, int len,
+					void *ctx, unsigned int flags);
+void rproc_cmdq_kick(struct rproc_cmdq *q);
+#else
+static inline struct rproc_cmdq *rproc_cmdq_open(struct rproc *rproc,
+		const char *name, rproc_cmdq_cb_t cb, void *priv)
+{
+	return ERR_PTR(-ENODEV);
+}
+
+static inline void rproc_cmdq_close(struct rproc_cmdq *q) { }
+
+static inline int rproc_cmdq_submit(struct rproc_cmdq *q, const void *cmd,
+				int len, void *ctx, unsigned int flags)
+{
+	return -ENODEV;
+}
+
+static inline void rproc_cmdq_kick(struct rproc_cmdq *q) { }
+#endif
+
+/* virtio drivers may be built in, while remoteproc itself is a module */
+#if defined(CONFIG_REMOTEPROC) || \
+	(defined(CONFIG_REMOTEPROC_MODULE) && defined(MODULE))
+void rproc_vdev_account_bufs(struct virtio_device *vdev, long len);
+struct device *rproc_vdev_dma_dev(struct virtio_device *vdev);
+void *rproc_vdev_alloc_ipc(struct virtio_device *vdev, size_t size,
+							dma_addr_t *dma);
+void rproc_vdev_free_ipc(struct virtio_device *vdev, void *va, size_t size);
+u64 rproc_vdev_shared_clock(struct virtio_device *vdev, u32 *rate);
+int rproc_vdev_ept_backlog(struct virtio_device *vdev, u32 addr, u32 *backlog);
+int rproc_vdev_acct_admit(struct virtio_device *vdev, u16 tag, long timeout);
+#else
+static inline
+void rproc_vdev_account_bufs(struct virtio_device *vdev, long len) { }
+
+static inline struct device *rproc_vdev_dma_dev(struct virtio_device *vdev)
+{
+	return NULL;
+}
+
+static inline void *rproc_vdev_alloc_ipc(struct virtio_device *vdev,
+						size_t size, dma_addr_t *dma)
+{
+	return NULL;
+}
+
+static inline
+void rproc_vdev_free_ipc(struct virtio_device *vdev, void *va, size_t size) { }
+
+static inline u64 rproc_vdev_shared_clock(struct virtio_device *vdev,
+								u32 *rate)
+{
+	*rate = 0;
+	return 0;
+}
+
+static inline int rproc_vdev_ept_backlog(struct virtio_device *vdev,
+						u32 addr, u32 *backlog)
+{
+	return -ENODEV;
+}
+
+static inline int rproc_vdev_acct_admit(struct virtio_device *vdev, u16 tag,
+								long timeout)
+{
+	return 0;
+}
+#endif
+
+/* the tag of the current task's rproc cgroup, if any */
+#ifdef CONFIG_CGROUP_RPROC
+u16 rproc_cgroup_tag(void);
+#else
+static inline u16 rproc_cgroup_tag(void)
+{
+	return 0;
+}
+#endif
 
 static inline struct rproc_vdev *vdev_to_rvdev(struct virtio_device *vdev)
 {
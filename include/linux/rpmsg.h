@@ -40,17 +40,80 @@
 #include <linux/mod_devicetable.h>
 #include <linux/kref.h>
 #include <linux/mutex.h>
+#include <linux/uio.h>
 
 /* The feature bitmap for virtio rpmsg */
 #define VIRTIO_RPMSG_F_NS	0 /* RP supports name service notifications */
+#define VIRTIO_RPMSG_F_VARBUF	1 /* RP supports variable-size tx buffers */
+#define VIRTIO_RPMSG_F_BUFCFG	2 /* RP provides its buffers layout */
+#define VIRTIO_RPMSG_F_MQ	3 /* RP supports several pairs of vrings */
+#define VIRTIO_RPMSG_F_NS_BULK	4 /* RP may announce several services at once */
+#define VIRTIO_RPMSG_F_HB	5 /* RP sends heartbeats to RPMSG_HB_ADDR */
+#define VIRTIO_RPMSG_F_RX_CHAIN	6 /* RP can send msgs over chains of pages */
+#define VIRTIO_RPMSG_F_TSTAMP	7 /* msgs are stamped with a shared clock */
+#define VIRTIO_RPMSG_F_MCAST	8 /* RP fans out multicast msgs */
+#define VIRTIO_RPMSG_F_ALIGN	9 /* RP provides its cache line size */
+#define VIRTIO_RPMSG_F_RX_FC	10 /* RP backs off when told to throttle */
+#define VIRTIO_RPMSG_F_ACCT	11 /* RP accounts for its cycles per sender */
+
+/**
+ * struct virtio_rpmsg_config - virtio rpmsg config space
+ * @num_rx_bufs: number of buffers the host should use for receiving
+ * @num_tx_bufs: number of buffers the host should use for sending
+ * @buf_size: size of each of those buffers, in bytes (header included)
+ * @num_queue_pairs: number of rx/tx vring pairs the remote processor
+ *		     provides (only valid with VIRTIO_RPMSG_F_MQ)
+ * @cache_line_size: size of the cache lines of the remote processor, in
+ *		     bytes (only valid with VIRTIO_RPMSG_F_ALIGN)
+ * @rx_throttle: written by the host (only with VIRTIO_RPMSG_F_RX_FC): bit n
+ *		 is set while the host is running out of rx buffers for the
+ *		 queue pair n, and the remote processor should hold off
+ *		 sending over it
+ *
+ * The buffers fields are only valid if the VIRTIO_RPMSG_F_BUFCFG feature is
+ * supported by the remote processor. They allow every firmware to size the
+ * messaging buffers according to its own needs. Any zero field means "use
+ * the host's default": as many buffers as the rx (resp. tx) vrings hold, so
+ * firmwares may as well just size their vrings (e.g. a big rx vring and a
+ * small tx one, whatever their sizes, as long as they're powers of two).
+ *
+ * With VIRTIO_RPMSG_F_MQ, the vdev resource entry should announce
+ * 2 * @num_queue_pairs vrings: rx, tx, rx, tx, ... (in this order). The rx
+ * buffers are then evenly spread over the rx vrings.
+ *
+ * With VIRTIO_RPMSG_F_ALIGN, the payload of every buffer starts a cache line
+ * of the remote processor (and of the host), and no two buffers share one,
+ * so the remote processor doesn't have to maintain partial lines of them.
+ *
+ * With VIRTIO_RPMSG_F_RX_FC, the host sets the bit of a queue pair in
+ * @rx_throttle once fewer than a low watermark of its rx buffers are left
+ * for the remote processor to fill (e.g. because endpoints hold them, or
+ * are slow to consume their messages), and clears it once more than a high
+ * watermark are back. It kicks the rx vring of the queue pair whenever it
+ * does, so the remote processor should look at @rx_throttle as it's kicked
+ * about its tx vrings, and hold its burst producers back, rather than spin
+ * on a full ring, while the bit is set.
+ */
+struct virtio_rpmsg_config {
+	u32 num_rx_bufs;
+	u32 num_tx_bufs;
+	u32 buf_size;
+	u32 num_queue_pairs;
+	u32 cache_line_size;
+	u32 rx_throttle;
+} __packed;
 
 /**
  * struct rpmsg_hdr - common header for all rpmsg messages
  * @src: source address
  * @dst: destination address
- * @reserved: reserved for future use
+ * @reserved: the low 32 bits of the shared clock when the message was sent,
+ *	      if VIRTIO_RPMSG_F_TSTAMP was negotiated (0 if it wasn't, or if
+ *	      the sender has no shared clock)
  * @len: length of payload (in bytes)
- * @flags: message flags
+ * @flags: message flags: with VIRTIO_RPMSG_F_ACCT, the messages the host
+ *	   sends carry the tag of their sender's rproc cgroup (0 for the root
+ *	   cgroup), which the remote processor accounts its cycles to
  * @data: @len bytes of message payload data
  *
  * Every message sent(/received) on the rpmsg bus begins with this header.
@@ -82,6 +145,40 @@ struct rpmsg_ns_msg {
 	u32 flags;
 } __packed;
 
+/**
+ * struct rpmsg_ns_bulk_msg - bulk name service announcement message
+ * @num: number of records in @recs
+ * @reserved: reserved for future use, must be zero
+ * @recs: @num name service records, each one being handled exactly as a
+ *	  separate struct rpmsg_ns_msg would have been
+ *
+ * If the VIRTIO_RPMSG_F_NS_BULK feature is supported, the remote processor
+ * may publish (or remove) many services with a single message, instead of
+ * paying a whole message (and buffer) per service. Bulk announcements are
+ * told apart from regular ones by their length.
+ */
+struct rpmsg_ns_bulk_msg {
+	u32 num;
+	u32 reserved;
+	struct rpmsg_ns_msg recs[0];
+} __packed;
+
+/**
+ * struct rpmsg_mcast_hdr - header of a multicast message
+ * @num: number of addresses in @dst
+ * @dst: the local addresses of the remote processor the payload is for
+ *
+ * If the VIRTIO_RPMSG_F_MCAST feature is supported, a message sent to
+ * RPMSG_MCAST_ADDR begins with this header, and is followed by a payload
+ * the remote processor delivers to each of @dst, as if it was sent to each
+ * of them, from the source address of the message. This way the payload is
+ * copied into a single tx buffer, and kicked once.
+ */
+struct rpmsg_mcast_hdr {
+	u32 num;
+	u32 dst[0];
+} __packed;
+
 /**
  * enum rpmsg_ns_flags - dynamic name service announcement flags
  *
@@ -95,38 +192,152 @@ enum rpmsg_ns_flags {
 
 #define RPMSG_ADDR_ANY		0xFFFFFFFF
 
+/*
+ * Default time a sender may block waiting for a tx buffer. We don't want
+ * callers to sleep indefinitely due to misbehaving remote processors; the
+ * number '15' itself was picked arbitrarily.
+ */
+#define RPMSG_TX_TIMEOUT		msecs_to_jiffies(15000)
+
 struct virtproc_info;
+struct rpmsg_transport_ops;
 
 /**
  * rpmsg_channel - devices that belong to the rpmsg bus are called channels
- * @vrp: the remote processor this channel belongs to
+ * @vrp: the virtio remote processor this channel belongs to, if it runs
+ *	 over the virtio transport
+ * @ops: the transport this channel runs over (see rpmsg_transport_ops)
  * @dev: the device struct
  * @id: device id (used to match between rpmsg drivers and devices)
  * @src: local address
  * @dst: destination address
  * @ept: the rpmsg endpoint of this channel
  * @announce: if set, rpmsg will announce the creation/removal of this channel
+ * @hnode: linked into the channels hash table of @vrp
  */
 struct rpmsg_channel {
 	struct virtproc_info *vrp;
+	const struct rpmsg_transport_ops *ops;
 	struct device dev;
 	struct rpmsg_device_id id;
 	u32 src;
 	u32 dst;
 	struct rpmsg_endpoint *ept;
 	bool announce;
+	struct hlist_node hnode;
+};
+
+/**
+ * enum rpmsg_tx_prio - tx priorities of rpmsg endpoints
+ *
+ * When tx buffers are scarce, waiting senders are served in FIFO order
+ * within a priority, but higher priorities are always served first (and
+ * new senders don't get to jump ahead of more urgent waiting ones).
+ *
+ * @RPMSG_TX_PRIO_LOW: bulk traffic (e.g. logging channels)
+ * @RPMSG_TX_PRIO_NORMAL: the default
+ * @RPMSG_TX_PRIO_HIGH: latency critical traffic (e.g. control channels)
+ * @RPMSG_TX_PRIO_NUM: number of tx priorities
+ */
+enum rpmsg_tx_prio {
+	RPMSG_TX_PRIO_LOW	= 0,
+	RPMSG_TX_PRIO_NORMAL	= 1,
+	RPMSG_TX_PRIO_HIGH	= 2,
+	RPMSG_TX_PRIO_NUM,
+};
+
+/**
+ * enum rpmsg_rx_prio - rx priorities of rpmsg endpoints
+ *
+ * Inbound messages of regular endpoints are normally delivered in ring
+ * order, so a burst of bulk traffic would delay the messages behind it.
+ * Messages of low priority endpoints are instead handed over to a worker
+ * of their own, and delivered from there (still in order), while the
+ * messages of other endpoints are delivered right away.
+ *
+ * @RPMSG_RX_PRIO_LOW: bulk traffic, delivered out of the way of the others
+ * @RPMSG_RX_PRIO_NORMAL: the default
+ */
+enum rpmsg_rx_prio {
+	RPMSG_RX_PRIO_LOW	= 0,
+	RPMSG_RX_PRIO_NORMAL	= 1,
+};
+
+/**
+ * enum rpmsg_rx_ctx - where the rx callback of an endpoint is invoked
+ * @RPMSG_RX_CTX_INLINE: straight from the rx path, as inbound messages are
+ *			 processed (the default)
+ * @RPMSG_RX_CTX_WQ:	 from an ordered workqueue of the endpoint's own
+ * @RPMSG_RX_CTX_CPU:	 from a work item of the endpoint's own, on a given cpu
+ *
+ * Callbacks that aren't invoked inline run in process context, one message
+ * at a time and in order, out of the way of the other endpoints: a slow
+ * callback then only delays its own messages. See rpmsg_create_ept_ctx().
+ */
+enum rpmsg_rx_ctx {
+	RPMSG_RX_CTX_INLINE	= 0,
+	RPMSG_RX_CTX_WQ		= 1,
+	RPMSG_RX_CTX_CPU	= 2,
+};
+
+/**
+ * struct rpmsg_rx_msg - a single inbound message of an rx batch
+ * @data: payload of message
+ * @len: length of payload
+ * @src: source address
+ *
+ * See rpmsg_create_batch_ept().
+ */
+struct rpmsg_rx_msg {
+	void *data;
+	int len;
+	u32 src;
 };
 
 typedef void (*rpmsg_rx_cb_t)(struct rpmsg_channel *, void *, int, void *, u32);
+typedef void (*rpmsg_rx_batch_cb_t)(struct rpmsg_channel *,
+				struct rpmsg_rx_msg *, int, void *);
+typedef void (*rpmsg_tx_done_t)(void *priv, int err);
+
+struct rpmsg_ept_stats;
+struct rpmsg_ept_rx;
 
 /**
  * struct rpmsg_endpoint - binds a local rpmsg address to its user
  * @rpdev: rpmsg channel device
  * @refcount: when this drops to zero, the ept is deallocated
  * @cb: rx callback handler
- * @cb_lock: must be taken before accessing/changing @cb
+ * @batch_cb: rx callback handler of a batch endpoint, which is handed
+ *	      several messages at once (see rpmsg_create_batch_ept()),
+ *	      instead of @cb
+ * @cb_lock: must be taken before accessing/changing @cb or @batch_cb
  * @addr: local rpmsg address
  * @priv: private data for the driver's use
+ * @atomic: @cb can't sleep, and is invoked without taking @cb_lock
+ * @rcu: used to free the ept once lockless rx lookups are done with it
+ * @tx_timeout: max time (in jiffies) senders on this ept's channel may block
+ *		waiting for a tx buffer. defaults to 15 seconds, and may be
+ *		changed by the ept's owner
+ * @tx_prio:	tx priority of this ept's channel (see enum rpmsg_tx_prio).
+ *		defaults to RPMSG_TX_PRIO_NORMAL, and may be changed by the
+ *		ept's owner
+ * @tx_quota:	max number of tx buffers this ept's channel may have in flight
+ *		(0, the default, means unlimited). may be changed by the
+ *		ept's owner
+ * @tx_inflight: number of tx buffers this ept is currently charged for
+ * @tx_queue:	queue pair this ept's channel transmits on, if the remote
+ *		processor supports several of them. defaults to -1 (i.e.
+ *		picked by hashing the source address), and may be changed by
+ *		the ept's owner, to pin its traffic onto a dedicated queue
+ * @rx_prio:	rx priority of this ept (see enum rpmsg_rx_prio). defaults to
+ *		RPMSG_RX_PRIO_NORMAL, and may be changed by the ept's owner.
+ *		only matters for regular (i.e. non-atomic) endpoints
+ * @stats:	per-cpu traffic counters of this ept (exposed in debugfs)
+ * @rx:		deferred deliveries of this ept, if its callback isn't invoked
+ *		inline (see enum rpmsg_rx_ctx)
+ * @qos_latency: cpu wakeup latency (in usecs) this ept requires while its
+ *		traffic is active, or PM_QOS_DEFAULT_VALUE (the default) if it
+ *		has no such requirement (see rpmsg_set_qos_latency())
  *
  * In essence, an rpmsg endpoint represents a listener on the rpmsg bus, as
  * it binds an rpmsg address with an rx callback handler.
@@ -146,9 +357,21 @@ struct rpmsg_endpoint {
 	struct rpmsg_channel *rpdev;
 	struct kref refcount;
 	rpmsg_rx_cb_t cb;
+	rpmsg_rx_batch_cb_t batch_cb;
 	struct mutex cb_lock;
 	u32 addr;
 	void *priv;
+	bool atomic;
+	struct rcu_head rcu;
+	long tx_timeout;
+	int tx_prio;
+	int tx_quota;
+	int tx_inflight;
+	int tx_queue;
+	int rx_prio;
+	struct rpmsg_ept_stats __percpu *stats;
+	struct rpmsg_ept_rx *rx;
+	s32 qos_latency;
 };
 
 /**
@@ -158,6 +381,9 @@ struct rpmsg_endpoint {
  * @probe: invoked when a matching rpmsg channel (i.e. device) is found
  * @remove: invoked when the rpmsg channel is removed
  * @callback: invoked when an inbound message is received on the channel
+ * @reset: invoked when the remote processor was restarted underneath the
+ *	   channel (which stays around), so whatever state its remote side had
+ *	   is lost and messages may have been dropped (optional)
  */
 struct rpmsg_driver {
 	struct device_driver drv;
@@ -165,8 +391,135 @@ struct rpmsg_driver {
 	int (*probe)(struct rpmsg_channel *dev);
 	void (*remove)(struct rpmsg_channel *dev);
 	void (*callback)(struct rpmsg_channel *, void *, int, void *, u32);
+	void (*reset)(struct rpmsg_channel *dev);
+};
+
+/**
+ * struct rpmsg_batch_msg - a single message of an rpmsg batch
+ * @dst: destination address
+ * @data: payload of message
+ * @len: length of payload
+ *
+ * See rpmsg_send_offchannel_batch().
+ */
+struct rpmsg_batch_msg {
+	u32 dst;
+	void *data;
+	int len;
+};
+
+/**
+ * struct rpmsg_tx_waiter - a callback for when tx buffers come back
+ * @node: queued on the transport while the callback is pending
+ * @func: invoked once a tx buffer was given back, from atomic context
+ *
+ * See rpmsg_wait_tx_buf(). Initialize it with rpmsg_init_tx_waiter().
+ */
+struct rpmsg_tx_waiter {
+	struct list_head node;
+	void (*func)(struct rpmsg_tx_waiter *waiter);
+};
+
+static inline void rpmsg_init_tx_waiter(struct rpmsg_tx_waiter *waiter,
+				void (*func)(struct rpmsg_tx_waiter *waiter))
+{
+	INIT_LIST_HEAD(&waiter->node);
+	waiter->func = func;
+}
+
+/**
+ * struct rpmsg_transport_ops - how the messages of rpmsg channels get across
+ * @create_ept:		see rpmsg_create_ept()
+ * @create_atomic_ept:	see rpmsg_create_atomic_ept() (optional)
+ * @create_ept_ctx:	see rpmsg_create_ept_ctx() (optional)
+ * @create_batch_ept:	see rpmsg_create_batch_ept() (optional)
+ * @destroy_ept:	see rpmsg_destroy_ept()
+ * @set_qos_latency:	see rpmsg_set_qos_latency() (optional)
+ * @get_backlog:	see rpmsg_get_backlog() (optional)
+ * @get_dma_dev:	see rpmsg_get_dma_dev() (optional: the channel's parent
+ *			device is used otherwise)
+ * @get_mtu:		see rpmsg_get_mtu() (optional)
+ * @announce:		tell the remote name service about a channel that
+ *			needs to be announced, with RPMSG_NS_CREATE or
+ *			RPMSG_NS_DESTROY (optional)
+ * @send_offchannel:	see rpmsg_send_offchannel_timeout(), which
+ *			rpmsg_send_offchannel_raw() and its wrappers also end
+ *			up in
+ * @send_offchannel_async: see rpmsg_send_offchannel_async() (optional)
+ * @sendv_offchannel:	see rpmsg_sendv_offchannel_raw() (optional)
+ * @send_offchannel_batch: see rpmsg_send_offchannel_batch() (optional)
+ * @send_offchannel_mcast: see rpmsg_send_offchannel_mcast() (optional)
+ * @alloc_tx_buf:	see rpmsg_alloc_tx_buf() (optional)
+ * @free_tx_buf:	see rpmsg_free_tx_buf() (must be there if @alloc_tx_buf
+ *			is)
+ * @send_offchannel_buf: see rpmsg_send_offchannel_buf() (must be there if
+ *			@alloc_tx_buf is)
+ * @hold_rx_buf:	see rpmsg_hold_rx_buf() (optional)
+ * @release_rx_buf:	see rpmsg_release_rx_buf() (must be there if
+ *			@hold_rx_buf is)
+ * @wait_tx_buf:	see rpmsg_wait_tx_buf() (optional)
+ * @cancel_tx_wait:	see rpmsg_cancel_tx_wait() (must be there if
+ *			@wait_tx_buf is)
+ *
+ * The rpmsg core only deals with the rpmsg bus, its channel devices and
+ * the matching of drivers: transports (e.g. virtio_rpmsg_bus, over the
+ * vrings of virtio devices) carry the messages, and own the endpoints,
+ * and register the channels of a remote with register_rpmsg_device(),
+ * along with their ops, which the rpmsg API calls into. Transports which
+ * lack an optional op make the API fail with -EOPNOTSUPP (or NULL, for
+ * the ones returning endpoints), or -EBUSY for @hold_rx_buf, which drivers
+ * already fall back from by copying the message.
+ */
+struct rpmsg_transport_ops {
+	struct rpmsg_endpoint *(*create_ept)(struct rpmsg_channel *rpdev,
+				rpmsg_rx_cb_t cb, void *priv, u32 addr);
+	struct rpmsg_endpoint *(*create_atomic_ept)(struct rpmsg_channel *rpdev,
+				rpmsg_rx_cb_t cb, void *priv, u32 addr);
+	struct rpmsg_endpoint *(*create_ept_ctx)(struct rpmsg_channel *rpdev,
+				rpmsg_rx_cb_t cb, void *priv, u32 addr,
+				enum rpmsg_rx_ctx ctx, int cpu);
+	struct rpmsg_endpoint *(*create_batch_ept)(struct rpmsg_channel *rpdev,
+				rpmsg_rx_batch_cb_t cb, void *priv, u32 addr);
+	void (*destroy_ept)(struct rpmsg_endpoint *ept);
+	void (*set_qos_latency)(struct rpmsg_endpoint *ept, s32 usecs);
+	int (*get_backlog)(struct rpmsg_channel *rpdev, u32 *backlog);
+	struct device *(*get_dma_dev)(struct rpmsg_channel *rpdev);
+	int (*get_mtu)(struct rpmsg_channel *rpdev);
+	int (*announce)(struct rpmsg_channel *rpdev, u32 flags);
+	int (*send_offchannel)(struct rpmsg_channel *rpdev, u32 src, u32 dst,
+				void *data, int len, long timeout);
+	int (*send_offchannel_async)(struct rpmsg_channel *rpdev, u32 src,
+				u32 dst, void *data, int len,
+				rpmsg_tx_done_t done, void *priv);
+	int (*sendv_offchannel)(struct rpmsg_channel *rpdev, u32 src, u32 dst,
+				const struct kvec *vec, int num, bool wait);
+	int (*send_offchannel_batch)(struct rpmsg_channel *rpdev, u32 src,
+				struct rpmsg_batch_msg *msgs, int num,
+				bool wait);
+	int (*send_offchannel_mcast)(struct rpmsg_channel *rpdev, u32 src,
+				const u32 *dst, int num, void *data, int len,
+				bool wait);
+	void *(*alloc_tx_buf)(struct rpmsg_channel *rpdev, int len, bool wait);
+	void (*free_tx_buf)(struct rpmsg_channel *rpdev, void *buf);
+	int (*send_offchannel_buf)(struct rpmsg_channel *rpdev, u32 src,
+				u32 dst, void *buf, int len);
+	int (*hold_rx_buf)(struct rpmsg_channel *rpdev, void *data);
+	void (*release_rx_buf)(struct rpmsg_channel *rpdev, void *data);
+	int (*wait_tx_buf)(struct rpmsg_channel *rpdev,
+				struct rpmsg_tx_waiter *waiter);
+	void (*cancel_tx_wait)(struct rpmsg_channel *rpdev,
+				struct rpmsg_tx_waiter *waiter);
 };
 
+#define to_rpmsg_channel(d) container_of(d, struct rpmsg_channel, dev)
+#define to_rpmsg_driver(d) container_of(d, struct rpmsg_driver, drv)
+
+/* how long a sender on @rpdev may block waiting for a tx buffer */
+static inline long rpmsg_tx_timeout(struct rpmsg_channel *rpdev)
+{
+	return rpdev->ept ? rpdev->ept->tx_timeout : RPMSG_TX_TIMEOUT;
+}
+
 int register_rpmsg_device(struct rpmsg_channel *dev);
 void unregister_rpmsg_device(struct rpmsg_channel *dev);
 int register_rpmsg_driver(struct rpmsg_driver *drv);
@@ -174,8 +527,36 @@ void unregister_rpmsg_driver(struct rpmsg_driver *drv);
 void rpmsg_destroy_ept(struct rpmsg_endpoint *);
 struct rpmsg_endpoint *rpmsg_create_ept(struct rpmsg_channel *,
 				rpmsg_rx_cb_t cb, void *priv, u32 addr);
+struct rpmsg_endpoint *rpmsg_create_atomic_ept(struct rpmsg_channel *,
+				rpmsg_rx_cb_t cb, void *priv, u32 addr);
+struct rpmsg_endpoint *rpmsg_create_ept_ctx(struct rpmsg_channel *,
+				rpmsg_rx_cb_t cb, void *priv, u32 addr,
+				enum rpmsg_rx_ctx ctx, int cpu);
+struct rpmsg_endpoint *rpmsg_create_batch_ept(struct rpmsg_channel *,
+				rpmsg_rx_batch_cb_t cb, void *priv, u32 addr);
+void rpmsg_set_qos_latency(struct rpmsg_endpoint *ept, s32 usecs);
+int rpmsg_get_backlog(struct rpmsg_channel *rpdev, u32 *backlog);
+struct device *rpmsg_get_dma_dev(struct rpmsg_channel *rpdev);
+int rpmsg_get_mtu(struct rpmsg_channel *rpdev);
 int
 rpmsg_send_offchannel_raw(struct rpmsg_channel *, u32, u32, void *, int, bool);
+int rpmsg_send_offchannel_timeout(struct rpmsg_channel *, u32, u32, void *,
+							int, long timeout);
+int rpmsg_send_offchannel_async(struct rpmsg_channel *, u32, u32, void *, int,
+					rpmsg_tx_done_t done, void *priv);
+void *rpmsg_alloc_tx_buf(struct rpmsg_channel *, int len, bool wait);
+void rpmsg_free_tx_buf(struct rpmsg_channel *, void *buf);
+int rpmsg_send_offchannel_buf(struct rpmsg_channel *, u32, u32, void *, int);
+int rpmsg_send_offchannel_batch(struct rpmsg_channel *, u32,
+				struct rpmsg_batch_msg *, int, bool);
+int rpmsg_sendv_offchannel_raw(struct rpmsg_channel *, u32, u32,
+				const struct kvec *, int, bool);
+int rpmsg_send_offchannel_mcast(struct rpmsg_channel *, u32, const u32 *dst,
+				int num, void *data, int len, bool wait);
+int rpmsg_hold_rx_buf(struct rpmsg_channel *, void *data);
+void rpmsg_release_rx_buf(struct rpmsg_channel *, void *data);
+int rpmsg_wait_tx_buf(struct rpmsg_channel *, struct rpmsg_tx_waiter *);
+void rpmsg_cancel_tx_wait(struct rpmsg_channel *, struct rpmsg_tx_waiter *);
 
 /**
  * rpmsg_send() - send a message across to the remote processor
@@ -187,8 +568,8 @@ rpmsg_send_offchannel_raw(struct rpmsg_channel *, u32, u32, void *, int, bool);
  * The message will be sent to the remote processor which the @rpdev
  * channel belongs to, using @rpdev's source and destination addresses.
  * In case there are no TX buffers available, the function will block until
- * one becomes available, or a timeout of 15 seconds elapses. When the latter
- * happens, -ERESTARTSYS is returned.
+ * one becomes available, or the channel's tx timeout (15 seconds by default)
+ * elapses. When the latter happens, -ETIMEDOUT is returned.
  *
  * Can only be called from process context (for now).
  *
@@ -201,6 +582,31 @@ static inline int rpmsg_send(struct rpmsg_channel *rpdev, void *data, int len)
 	return rpmsg_send_offchannel_raw(rpdev, src, dst, data, len, true);
 }
 
+/**
+ * rpmsg_send_timeout() - send a message, with an explicit tx timeout
+ * @rpdev: the rpmsg channel
+ * @data: payload of message
+ * @len: length of payload
+ * @timeout: max time to wait for a TX buffer, in jiffies
+ *
+ * Same as rpmsg_send(), but in case there are no TX buffers available,
+ * the function will block for @timeout jiffies at most (0 not to block at
+ * all, or MAX_SCHEDULE_TIMEOUT to block indefinitely).
+ *
+ * Can only be called from process context (for now).
+ *
+ * Returns 0 on success, -ETIMEDOUT if @timeout elapsed, and an appropriate
+ * error value on other failures.
+ */
+static inline int rpmsg_send_timeout(struct rpmsg_channel *rpdev, void *data,
+							int len, long timeout)
+{
+	u32 src = rpdev->src, dst = rpdev->dst;
+
+	return rpmsg_send_offchannel_timeout(rpdev, src, dst, data, len,
+								timeout);
+}
+
 /**
  * rpmsg_sendto() - send a message across to the remote processor, specify dst
  * @rpdev: the rpmsg channel
@@ -212,8 +618,8 @@ static inline int rpmsg_send(struct rpmsg_channel *rpdev, void *data, int len)
  * The message will be sent to the remote processor which the @rpdev
  * channel belongs to, using @rpdev's source address.
  * In case there are no TX buffers available, the function will block until
- * one becomes available, or a timeout of 15 seconds elapses. When the latter
- * happens, -ERESTARTSYS is returned.
+ * one becomes available, or the channel's tx timeout (15 seconds by default)
+ * elapses. When the latter happens, -ETIMEDOUT is returned.
  *
  * Can only be called from process context (for now).
  *
@@ -240,8 +646,8 @@ int rpmsg_sendto(struct rpmsg_channel *rpdev, void *data, int len, u32 dst)
  * The message will be sent to the remote processor which the @rpdev
  * channel belongs to.
  * In case there are no TX buffers available, the function will block until
- * one becomes available, or a timeout of 15 seconds elapses. When the latter
- * happens, -ERESTARTSYS is returned.
+ * one becomes available, or the channel's tx timeout (15 seconds by default)
+ * elapses. When the latter happens, -ETIMEDOUT is returned.
  *
  * Can only be called from process context (for now).
  *
@@ -266,7 +672,7 @@ int rpmsg_send_offchannel(struct rpmsg_channel *rpdev, u32 src, u32 dst,
  * In case there are no TX buffers available, the function will immediately
  * return -ENOMEM without waiting until one becomes available.
  *
- * Can only be called from process context (for now).
+ * Can be called from any context, including atomic ones: it never sleeps.
  *
  * Returns 0 on success and an appropriate error value on failure.
  */
@@ -291,7 +697,7 @@ int rpmsg_trysend(struct rpmsg_channel *rpdev, void *data, int len)
  * In case there are no TX buffers available, the function will immediately
  * return -ENOMEM without waiting until one becomes available.
  *
- * Can only be called from process context (for now).
+ * Can be called from any context, including atomic ones: it never sleeps.
  *
  * Returns 0 on success and an appropriate error value on failure.
  */
@@ -318,7 +724,7 @@ int rpmsg_trysendto(struct rpmsg_channel *rpdev, void *data, int len, u32 dst)
  * In case there are no TX buffers available, the function will immediately
  * return -ENOMEM without waiting until one becomes available.
  *
- * Can only be called from process context (for now).
+ * Can be called from any context, including atomic ones: it never sleeps.
  *
  * Returns 0 on success and an appropriate error value on failure.
  */
@@ -329,4 +735,211 @@ int rpmsg_trysend_offchannel(struct rpmsg_channel *rpdev, u32 src, u32 dst,
 	return rpmsg_send_offchannel_raw(rpdev, src, dst, data, len, false);
 }
 
+/**
+ * rpmsg_sendv() - send a message gathered from several buffers
+ * @rpdev: the rpmsg channel
+ * @vec: the buffers making up the payload of the message, in order
+ * @num: number of entries in @vec
+ *
+ * This function sends the concatenation of the @num buffers described by
+ * @vec on the @rpdev channel, using @rpdev's source and destination
+ * addresses. The buffers are copied straight into the TX buffer, so e.g.
+ * a protocol header and a body can be sent without staging them together
+ * first.
+ * In case there are no TX buffers available, the function will block until
+ * one becomes available, or the channel's tx timeout (15 seconds by default)
+ * elapses. When the latter happens, -ETIMEDOUT is returned.
+ *
+ * Can only be called from process context (for now).
+ *
+ * Returns 0 on success and an appropriate error value on failure.
+ */
+static inline int rpmsg_sendv(struct rpmsg_channel *rpdev,
+					const struct kvec *vec, int num)
+{
+	u32 src = rpdev->src, dst = rpdev->dst;
+
+	return rpmsg_sendv_offchannel_raw(rpdev, src, dst, vec, num, true);
+}
+
+/**
+ * rpmsg_send_async() - send a message, and get notified once it's consumed
+ * @rpdev: the rpmsg channel
+ * @data: payload of message
+ * @len: length of payload
+ * @done: invoked once the remote processor is done with the message
+ * @priv: private data of @done
+ *
+ * This function sends @data of length @len on the @rpdev channel, using
+ * @rpdev's source and destination addresses, and invokes @done with @priv
+ * once the remote processor gives the message's TX buffer back (with 0),
+ * or once the message is dropped (with -ECANCELED). @done is invoked in
+ * atomic context and must not sleep, but it may send further messages.
+ * In case there are no TX buffers available, the function will immediately
+ * return -ENOMEM without waiting until one becomes available, and @done
+ * is never invoked.
+ *
+ * Can be called from any context, including atomic ones: it never sleeps.
+ *
+ * Returns 0 on success and an appropriate error value on failure.
+ */
+static inline int rpmsg_send_async(struct rpmsg_channel *rpdev, void *data,
+			int len, rpmsg_tx_done_t done, void *priv)
+{
+	u32 src = rpdev->src, dst = rpdev->dst;
+
+	return rpmsg_send_offchannel_async(rpdev, src, dst, data, len,
+								done, priv);
+}
+
+/**
+ * rpmsg_trysendv() - send a message gathered from several buffers
+ * @rpdev: the rpmsg channel
+ * @vec: the buffers making up the payload of the message, in order
+ * @num: number of entries in @vec
+ *
+ * This function sends the concatenation of the @num buffers described by
+ * @vec on the @rpdev channel, using @rpdev's source and destination
+ * addresses.
+ * In case there are no TX buffers available, the function will immediately
+ * return -ENOMEM without waiting until one becomes available.
+ *
+ * Can be called from any context, including atomic ones: it never sleeps.
+ *
+ * Returns 0 on success and an appropriate error value on failure.
+ */
+static inline int rpmsg_trysendv(struct rpmsg_channel *rpdev,
+					const struct kvec *vec, int num)
+{
+	u32 src = rpdev->src, dst = rpdev->dst;
+
+	return rpmsg_sendv_offchannel_raw(rpdev, src, dst, vec, num, false);
+}
+
+/**
+ * rpmsg_send_buf() - send a message that was built in place
+ * @rpdev: the rpmsg channel
+ * @buf: a payload area previously obtained with rpmsg_alloc_tx_buf()
+ * @len: length of payload
+ *
+ * This function sends the @len bytes payload which the caller already placed
+ * in @buf on the @rpdev channel, using @rpdev's source and destination
+ * addresses. The payload is not copied (zero-copy).
+ *
+ * Ownership of @buf passes to the rpmsg bus, regardless of the return value.
+ *
+ * Can only be called from process context (for now).
+ *
+ * Returns 0 on success and an appropriate error value on failure.
+ */
+static inline int rpmsg_send_buf(struct rpmsg_channel *rpdev, void *buf, int len)
+{
+	u32 src = rpdev->src, dst = rpdev->dst;
+
+	return rpmsg_send_offchannel_buf(rpdev, src, dst, buf, len);
+}
+
+/**
+ * rpmsg_sendto_buf() - send a message that was built in place, specify dst
+ * @rpdev: the rpmsg channel
+ * @buf: a payload area previously obtained with rpmsg_alloc_tx_buf()
+ * @len: length of payload
+ * @dst: destination address
+ *
+ * This function sends the @len bytes payload which the caller already placed
+ * in @buf to the remote @dst address, using @rpdev's source address.
+ * The payload is not copied (zero-copy).
+ *
+ * Ownership of @buf passes to the rpmsg bus, regardless of the return value.
+ *
+ * Can only be called from process context (for now).
+ *
+ * Returns 0 on success and an appropriate error value on failure.
+ */
+static inline
+int rpmsg_sendto_buf(struct rpmsg_channel *rpdev, void *buf, int len, u32 dst)
+{
+	u32 src = rpdev->src;
+
+	return rpmsg_send_offchannel_buf(rpdev, src, dst, buf, len);
+}
+
+/**
+ * rpmsg_send_batch() - send several messages with a single kick
+ * @rpdev: the rpmsg channel
+ * @msgs: array of messages to send (destination, payload and length of each)
+ * @num: number of entries in @msgs
+ *
+ * This function sends the @num messages described by @msgs to the remote
+ * processor which the @rpdev channel belongs to, using @rpdev's source
+ * address, while kicking the remote processor only once for the whole batch.
+ * In case there are no TX buffers available, the function will block until
+ * one becomes available, or the channel's tx timeout (15 seconds by default)
+ * elapses. When the latter happens, -ETIMEDOUT is returned (if no message
+ * was sent at all).
+ *
+ * Can only be called from process context (for now).
+ *
+ * Returns the number of messages sent, or an appropriate error value if
+ * no message could be sent.
+ */
+static inline int
+rpmsg_send_batch(struct rpmsg_channel *rpdev, struct rpmsg_batch_msg *msgs,
+								int num)
+{
+	return rpmsg_send_offchannel_batch(rpdev, rpdev->src, msgs, num, true);
+}
+
+/**
+ * rpmsg_trysend_batch() - send several messages with a single kick
+ * @rpdev: the rpmsg channel
+ * @msgs: array of messages to send (destination, payload and length of each)
+ * @num: number of entries in @msgs
+ *
+ * This function sends the @num messages described by @msgs to the remote
+ * processor which the @rpdev channel belongs to, using @rpdev's source
+ * address, while kicking the remote processor only once for the whole batch.
+ * In case we run out of TX buffers, the function will immediately return
+ * without waiting until one becomes available.
+ *
+ * Can be called from any context, including atomic ones: it never sleeps.
+ *
+ * Returns the number of messages sent, or an appropriate error value if
+ * no message could be sent (-ENOMEM if no TX buffers were available).
+ */
+static inline int
+rpmsg_trysend_batch(struct rpmsg_channel *rpdev, struct rpmsg_batch_msg *msgs,
+								int num)
+{
+	return rpmsg_send_offchannel_batch(rpdev, rpdev->src, msgs, num, false);
+}
+
+/**
+ * rpmsg_send_mcast() - send a single message to several remote endpoints
+ * @rpdev: the rpmsg channel
+ * @dst: the destination addresses
+ * @num: number of entries in @dst
+ * @data: payload of message
+ * @len: length of payload
+ *
+ * This function sends @data of length @len to each of the @num addresses
+ * of @dst, using @rpdev's source address. If the remote processor supports
+ * it, the payload is written once and fanned out on its side; otherwise,
+ * it's sent as a batch of @num messages (see rpmsg_send_batch()).
+ * In case there are no TX buffers available, the function will block until
+ * one becomes available, or the channel's tx timeout (15 seconds by default)
+ * elapses.
+ *
+ * Can only be called from process context (for now).
+ *
+ * Returns the number of destinations the message was sent to, or an
+ * appropriate error value if it couldn't be sent to any.
+ */
+static inline int rpmsg_send_mcast(struct rpmsg_channel *rpdev,
+			const u32 *dst, int num, void *data, int len)
+{
+	return rpmsg_send_offchannel_mcast(rpdev, rpdev->src, dst, num,
+							data, len, true);
+}
+
 #endif /* _LINUX_RPMSG_H */
@@ -0,0 +1,38 @@
+/*
+ * Remote processor messaging - service groups
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef _LINUX_RPMSG_GROUP_H
+#define _LINUX_RPMSG_GROUP_H
+
+#include <linux/types.h>
+#include <linux/rpmsg.h>
+
+struct rpmsg_group;
+struct rpmsg_group_session;
+
+struct rpmsg_group *rpmsg_group_get(const char *name);
+void rpmsg_group_put(struct rpmsg_group *grp);
+int rpmsg_group_add(struct rpmsg_group *grp, struct rpmsg_channel *rpdev);
+void rpmsg_group_del(struct rpmsg_group *grp, struct rpmsg_channel *rpdev);
+
+struct rpmsg_channel *rpmsg_group_get_channel(struct rpmsg_group *grp);
+void rpmsg_group_put_channel(struct rpmsg_group *grp,
+					struct rpmsg_channel *rpdev);
+int rpmsg_group_send(struct rpmsg_group *grp, void *data, int len);
+
+struct rpmsg_group_session *rpmsg_group_open_session(struct rpmsg_group *grp);
+void rpmsg_group_close_session(struct rpmsg_group_session *sess);
+int rpmsg_group_session_send(struct rpmsg_group_session *sess, void *data,
+								int len);
+
+#endif /* _LINUX_RPMSG_GROUP_H */
@@ -0,0 +1,53 @@
+/*
+ * Remote processor messaging - request/response helper
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef _LINUX_RPMSG_RPC_H
+#define _LINUX_RPMSG_RPC_H
+
+#include <linux/types.h>
+#include <linux/rpmsg.h>
+
+/* the most calls that may be in flight at once on a single rpc endpoint */
+#define RPMSG_RPC_MAX_CALLS	256
+
+/* set in the header of replies, and only of replies */
+#define RPMSG_RPC_F_REPLY	(1 << 0)
+
+/**
+ * struct rpmsg_rpc_hdr - header of every rpc message
+ * @id: transaction ID, picked by the caller, and echoed back in the reply
+ * @flags: RPMSG_RPC_F_* bits
+ * @reserved: reserved (must be zero)
+ * @data: the request (resp. reply) payload
+ *
+ * Transaction IDs are opaque to the remote processor: it only has to
+ * copy the ID of a request into its reply, and set RPMSG_RPC_F_REPLY.
+ * Messages without RPMSG_RPC_F_REPLY are requests (or notifications)
+ * of the remote processor.
+ */
+struct rpmsg_rpc_hdr {
+	u32 id;
+	u16 flags;
+	u16 reserved;
+	u8 data[0];
+} __packed;
+
+struct rpmsg_rpc;
+
+struct rpmsg_rpc *rpmsg_rpc_create(struct rpmsg_channel *rpdev, u32 dst,
+			int max_calls, rpmsg_rx_cb_t cb, void *priv);
+void rpmsg_rpc_destroy(struct rpmsg_rpc *rpc);
+int rpmsg_rpc_call(struct rpmsg_rpc *rpc, void *req, int req_len,
+			void *reply, int reply_size, long timeout);
+
+#endif /* _LINUX_RPMSG_RPC_H */
@@ -15,11 +15,14 @@ struct ste_modem_device;
 /**
  * struct ste_modem_dev_cb - Callbacks for modem initiated events.
  * @kick: Called when the modem kicks the host.
+ * @doorbell: Called when the modem rings the host's doorbell, with the
+ *	notification ids it signals as a bitmask (bit n for id n).
  *
  * This structure contains callbacks for actions triggered by the modem.
  */
 struct ste_modem_dev_cb {
 	void (*kick)(struct ste_modem_device *mdev, int notify_id);
+	void (*doorbell)(struct ste_modem_device *mdev, unsigned long ids);
 };
 
 /**
@@ -29,6 +32,11 @@ struct ste_modem_dev_cb {
  * @kick:	Kick the modem.
  * @kick_subscribe: Subscribe for notifications from the modem.
  * @setup:	Provide callback functions to modem device.
+ * @doorbell:	Ring the modem's doorbell once, for all the notification ids
+ *		set in a bitmask (bit n for id n). Modems that provide it
+ *		use it instead of @kick and @kick_subscribe, and signal the
+ *		host with the @doorbell callback (optional). May be called
+ *		from atomic context.
  *
  * This structure contains functions used by the ste remoteproc driver
  * to manage the modem.
@@ -39,6 +47,7 @@ struct ste_modem_dev_ops {
 	int (*kick_subscribe)(struct ste_modem_device *mdev, int notify_id);
 	int (*setup)(struct ste_modem_device *mdev,
 		     struct ste_modem_dev_cb *cfg);
+	int (*doorbell)(struct ste_modem_device *mdev, unsigned long ids);
 };
 
 /**
@@ -125,4 +125,15 @@ void caif_enroll_dev(struct net_device *dev, struct caif_dev_common *caifdev,
 				struct sk_buff *, struct net_device *,
 				struct packet_type *, struct net_device *));
 
+/**
+ * caif_receive_list - Receive a batch of packets on a CAIF Link layer
+ * @dev:		Network device the packets were received on.
+ * @list:		The packets, this list is emptied.
+ *
+ * Link layers receiving packets in batches may use this function instead of
+ * netif_receive_skb() on each packet, to have the batch go up the CAIF
+ * stack at once. Returns NET_RX_DROP if any packet was dropped.
+ */
+int caif_receive_list(struct net_device *dev, struct sk_buff_head *list);
+
 #endif /* CAIF_DEV_H_ */
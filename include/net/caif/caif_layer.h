@@ -11,6 +11,7 @@
 
 struct cflayer;
 struct cfpkt;
+struct sk_buff_head;
 struct cfpktq;
 struct caif_payload_info;
 struct caif_packet_funcs;
@@ -118,6 +119,7 @@ enum caif_direction {
  * @dn:		Pointer down to the layer below.
  * @node:	List node used when layer participate in a list.
  * @receive:	Packet receive function.
+ * @receive_list: Batched packet receive function (optional).
  * @transmit:	Packet transmit funciton.
  * @ctrlcmd:	Used for control signalling upwards in the stack.
  * @modemcmd:	Used for control signaling downwards in the stack.
@@ -178,6 +180,31 @@ struct cflayer {
 	 */
 	int (*receive)(struct cflayer *layr, struct cfpkt *cfpkt);
 
+	/*
+	 *  receive_list() - Receive a batch of packets (non-blocking).
+	 *  Optional: layers without it get each packet of the batch passed
+	 *  to receive() instead (see cfpkt_receive_list()).
+	 *	Packet handling rules:
+	 *	      - Ownership of all the packets on the list is passed to
+	 *		the called function, which empties the list.
+	 *
+	 *	      - Packets that fail parsing are destroyed, including
+	 *		those with a bad checksum: the -EILSEQ exception of
+	 *		receive() doesn't apply.
+	 *
+	 *	      - The packets of a batch that passes through a layer
+	 *		should be handed to the layer above as a batch too,
+	 *		with cfpkt_receive_list().
+	 *
+	 *  Returns result < 0 if any packet of the batch failed, 0 or
+	 *	     positive value if they were all handled.
+	 *
+	 *  @layr: Pointer to the current layer the receive function is
+	 *		implemented for (this pointer).
+	 *  @pkts: List of CaifPackets to be handled.
+	 */
+	int (*receive_list)(struct cflayer *layr, struct sk_buff_head *pkts);
+
 	/*
 	 *  transmit() - Transmit Function (non-blocking).
 	 *  Contract: Each layer must implement a transmit function passing the
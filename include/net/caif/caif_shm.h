@@ -13,6 +13,8 @@ struct shmdev_layer {
 	u32 shm_total_sz;
 	u32 shm_id;
 	u32 shm_loopback;
+	/* Map the TX buffers write-combined rather than uncached */
+	u32 shm_tx_wc;
 	void *hmbx;
 	int (*pshmdev_mbxsend) (u32 shm_id, u32 mbx_msg);
 	int (*pshmdev_mbxsetup) (void *pshmdrv_cb,
@@ -8,6 +8,7 @@
 #define CFPKT_H_
 #include <net/caif/caif_layer.h>
 #include <linux/types.h>
+#include <linux/skbuff.h>
 struct cfpkt;
 
 /* Create a CAIF packet.
@@ -202,4 +203,45 @@ struct caif_payload_info *cfpkt_info(struct cfpkt *pkt);
  */
 void cfpkt_set_prio(struct cfpkt *pkt, int prio);
 
+/*
+ * Lists of CAIF packets, as handed up the stack by the batched receive
+ * path (see cflayer.receive_list()). CAIF packets are socket buffers,
+ * so these are plain sk_buff lists, without locking.
+ */
+static inline void cfpkt_list_init(struct sk_buff_head *list)
+{
+	__skb_queue_head_init(list);
+}
+
+static inline bool cfpkt_list_empty(const struct sk_buff_head *list)
+{
+	return skb_queue_empty(list);
+}
+
+static inline void cfpkt_list_add(struct sk_buff_head *list,
+				  struct cfpkt *pkt)
+{
+	__skb_queue_tail(list, (struct sk_buff *)pkt);
+}
+
+static inline struct cfpkt *cfpkt_list_dequeue(struct sk_buff_head *list)
+{
+	return (struct cfpkt *)__skb_dequeue(list);
+}
+
+/* Destroy all the packets of a list. */
+static inline void cfpkt_list_purge(struct sk_buff_head *list)
+{
+	__skb_queue_purge(list);
+}
+
+/*
+ * Pass a list of packets up to a layer: to its receive_list() function,
+ * or packet by packet to its receive() function if it has none.
+ * layr Layer to pass the packets to.
+ * pkts List of packets, it's emptied.
+ * @return < 0 if any of the packets failed, 0 otherwise.
+ */
+int cfpkt_receive_list(struct cflayer *layr, struct sk_buff_head *pkts);
+
 #endif				/* CFPKT_H_ */
@@ -0,0 +1,82 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM remoteproc
+
+#if !defined(_TRACE_REMOTEPROC_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TRACE_REMOTEPROC_H
+
+#include <linux/tracepoint.h>
+
+struct device;
+
+/* start and stop pulling the stamped trace rings, as the event is toggled */
+extern void rproc_trace_pull_reg(void);
+extern void rproc_trace_pull_unreg(void);
+
+/*
+ * Log the lines remote processors write to their stamped trace rings:
+ * @remote_ts is the line's timestamp, in ticks of the remote processor's
+ * trace clock, and @host_ns is when that was, in the host's local trace
+ * clock (in nsecs)
+ */
+TRACE_EVENT_FN(rproc_trace,
+
+	TP_PROTO(struct device *dev, int index, u64 remote_ts, u64 host_ns,
+		 const char *msg, unsigned int len),
+
+	TP_ARGS(dev, index, remote_ts, host_ns, msg, len),
+
+	TP_STRUCT__entry(
+		__string(	name,		dev_name(dev)	)
+		__field(	int,		index		)
+		__field(	u64,		remote_ts	)
+		__field(	u64,		host_ns		)
+		__dynamic_array(char,		msg,	len + 1	)
+	),
+
+	TP_fast_assign(
+		__assign_str(name, dev_name(dev));
+		__entry->index = index;
+		__entry->remote_ts = remote_ts;
+		__entry->host_ns = host_ns;
+		memcpy(__get_dynamic_array(msg), msg, len);
+		((char *)__get_dynamic_array(msg))[len] = '\0';
+	),
+
+	TP_printk("%s trace%d remote_ts=%llu host_ns=%llu %s",
+		  __get_str(name), __entry->index,
+		  (unsigned long long)__entry->remote_ts,
+		  (unsigned long long)__entry->host_ns, __get_str(msg)),
+
+	rproc_trace_pull_reg, rproc_trace_pull_unreg
+);
+
+/*
+ * Log how long each phase of the boot of a remote processor took (see
+ * enum rproc_boot_phase), as it ends
+ */
+TRACE_EVENT(rproc_boot_phase,
+
+	TP_PROTO(struct device *dev, const char *phase, s64 ns),
+
+	TP_ARGS(dev, phase, ns),
+
+	TP_STRUCT__entry(
+		__string(	name,		dev_name(dev)	)
+		__string(	phase,		phase		)
+		__field(	s64,		ns		)
+	),
+
+	TP_fast_assign(
+		__assign_str(name, dev_name(dev));
+		__assign_str(phase, phase);
+		__entry->ns = ns;
+	),
+
+	TP_printk("%s %s took %lld ns", __get_str(name), __get_str(phase),
+		  (long long)__entry->ns)
+);
+
+#endif /* _TRACE_REMOTEPROC_H */
+
+/* This part must be outside protection */
+#include <trace/define_trace.h>
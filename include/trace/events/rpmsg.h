@@ -0,0 +1,118 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM rpmsg
+
+#if !defined(_TRACE_RPMSG_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TRACE_RPMSG_H
+
+#include <linux/tracepoint.h>
+
+struct device;
+
+/*
+ * Log messages going through the virtqueues
+ */
+DECLARE_EVENT_CLASS(rpmsg_msg,
+
+	TP_PROTO(struct device *dev, u32 src, u32 dst, u16 len,
+		 unsigned int vq),
+
+	TP_ARGS(dev, src, dst, len, vq),
+
+	TP_STRUCT__entry(
+		__string(	name,		dev_name(dev)	)
+		__field(	u32,		src		)
+		__field(	u32,		dst		)
+		__field(	u16,		len		)
+		__field(	unsigned int,	vq		)
+	),
+
+	TP_fast_assign(
+		__assign_str(name, dev_name(dev));
+		__entry->src = src;
+		__entry->dst = dst;
+		__entry->len = len;
+		__entry->vq = vq;
+	),
+
+	TP_printk("%s src=0x%x dst=0x%x len=%u vq=%u", __get_str(name),
+		  __entry->src, __entry->dst, (unsigned int)__entry->len,
+		  __entry->vq)
+);
+
+DEFINE_EVENT(rpmsg_msg, rpmsg_tx,
+
+	TP_PROTO(struct device *dev, u32 src, u32 dst, u16 len,
+		 unsigned int vq),
+
+	TP_ARGS(dev, src, dst, len, vq)
+
+);
+
+DEFINE_EVENT(rpmsg_msg, rpmsg_rx,
+
+	TP_PROTO(struct device *dev, u32 src, u32 dst, u16 len,
+		 unsigned int vq),
+
+	TP_ARGS(dev, src, dst, len, vq)
+
+);
+
+/*
+ * Log senders that have to wait for a tx buffer (or credit)
+ */
+TRACE_EVENT(rpmsg_tx_wait,
+
+	TP_PROTO(struct device *dev, u32 src, int len, int prio),
+
+	TP_ARGS(dev, src, len, prio),
+
+	TP_STRUCT__entry(
+		__string(	name,		dev_name(dev)	)
+		__field(	u32,		src		)
+		__field(	int,		len		)
+		__field(	int,		prio		)
+	),
+
+	TP_fast_assign(
+		__assign_str(name, dev_name(dev));
+		__entry->src = src;
+		__entry->len = len;
+		__entry->prio = prio;
+	),
+
+	TP_printk("%s src=0x%x len=%d prio=%d", __get_str(name),
+		  __entry->src, __entry->len, __entry->prio)
+);
+
+/*
+ * Log name service records, as they're processed
+ */
+TRACE_EVENT(rpmsg_ns,
+
+	TP_PROTO(struct device *dev, const char *service, u32 addr,
+		 u32 flags),
+
+	TP_ARGS(dev, service, addr, flags),
+
+	TP_STRUCT__entry(
+		__string(	name,		dev_name(dev)	)
+		__string(	service,	service		)
+		__field(	u32,		addr		)
+		__field(	u32,		flags		)
+	),
+
+	TP_fast_assign(
+		__assign_str(name, dev_name(dev));
+		__assign_str(service, service);
+		__entry->addr = addr;
+		__entry->flags = flags;
+	),
+
+	TP_printk("%s service=%s addr=0x%x flags=0x%x", __get_str(name),
+		  __get_str(service), __entry->addr, __entry->flags)
+);
+
+#endif /* _TRACE_RPMSG_H */
+
+/* This part must be outside protection */
+#include <trace/define_trace.h>
@@ -0,0 +1,35 @@
+/*
+ * Remote processor messaging sockets
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef _UAPI_LINUX_RPMSG_SOCKET_H
+#define _UAPI_LINUX_RPMSG_SOCKET_H
+
+#include <linux/types.h>
+#include <linux/socket.h>
+
+/* bind() to this address to let the rpmsg bus pick a local address */
+#define RPMSG_SOCK_ADDR_ANY	0xFFFFFFFF
+
+/**
+ * struct sockaddr_rpmsg - the address of an rpmsg socket
+ * @family: AF_RPMSG
+ * @vproc_id: the remote processor, as numbered by the rpmsg socket layer
+ * @addr: the rpmsg address, local (bind) or remote (connect, sendto)
+ */
+struct sockaddr_rpmsg {
+	__kernel_sa_family_t family;
+	__u32 vproc_id;
+	__u32 addr;
+};
+
+#endif /* _UAPI_LINUX_RPMSG_SOCKET_H */
@@ -112,6 +112,14 @@ struct vhost_memory {
 #define VHOST_SET_VRING_CALL _IOW(VHOST_VIRTIO, 0x21, struct vhost_vring_file)
 /* Set eventfd to signal an error */
 #define VHOST_SET_VRING_ERR _IOW(VHOST_VIRTIO, 0x22, struct vhost_vring_file)
+/* Set the time in microseconds to busy poll for new buffers (and, for
+ * vhost-net RX, for packets on the socket) before enabling notifications
+ * again.  0 (the default) disables busy polling. */
+#define VHOST_SET_VRING_BUSYLOOP_TIMEOUT _IOW(VHOST_VIRTIO, 0x23,	\
+					      struct vhost_vring_state)
+/* Get accessor: reads index, writes value in num */
+#define VHOST_GET_VRING_BUSYLOOP_TIMEOUT _IOWR(VHOST_VIRTIO, 0x23,	\
+					       struct vhost_vring_state)
 
 /* VHOST_NET specific defines */
 
@@ -121,6 +129,24 @@ struct vhost_memory {
  * device.  This can be used to stop the ring (e.g. for migration). */
 #define VHOST_NET_SET_BACKEND _IOW(VHOST_VIRTIO, 0x30, struct vhost_vring_file)
 
+/* VHOST_RPMSG specific defines */
+
+struct vhost_rpmsg_target {
+	/* The host rpmsg channel to bridge the rings to (e.g. "rpmsg3", as
+	 * listed in /sys/bus/rpmsg/devices), which must be an "rpmsg-vhost"
+	 * channel that isn't bridged to another guest already. */
+	char channel[32];
+	/* The name the remote service is announced to the guest with.
+	 * Defaults to the name of the host channel if empty. */
+	char name[32];
+};
+
+/* Bridge both rings to a host rpmsg channel, and announce its remote
+ * service to the guest. The rings must be set up already. */
+#define VHOST_RPMSG_SET_BACKEND _IOW(VHOST_VIRTIO, 0x50, struct vhost_rpmsg_target)
+/* Detach the rings from their host rpmsg channel. */
+#define VHOST_RPMSG_CLEAR_BACKEND _IO(VHOST_VIRTIO, 0x51)
+
 /* Feature bits */
 /* Log all write descriptors. Can be changed while device is active. */
 #define VHOST_F_LOG_ALL 26
@@ -37,5 +37,7 @@
 #define VIRTIO_ID_RPMSG		7 /* virtio remote processor messaging */
 #define VIRTIO_ID_SCSI		8 /* virtio scsi */
 #define VIRTIO_ID_9P		9 /* 9p virtio console */
+#define VIRTIO_ID_RPROC_SERIAL	11 /* virtio remoteproc serial link */
+#define VIRTIO_ID_CAIF		12 /* Virtio caif */
 
 #endif /* _LINUX_VIRTIO_IDS_H */
@@ -58,6 +58,10 @@
  * at the end of the used ring. Guest should ignore the used->flags field. */
 #define VIRTIO_RING_F_EVENT_IDX		29
 
+/* We support the (experimental) packed ring layout, see below. Buffers are
+ * used in the order they were made available. */
+#define VIRTIO_RING_F_PACKED		31
+
 /* Virtio ring descriptors: 16 bytes.  These can chain together via "next". */
 struct vring_desc {
 	/* Address (guest-physical). */
@@ -160,4 +164,89 @@ static inline int vring_need_event(__u16 event_idx, __u16 new_idx, __u16 old)
 	return (__u16)(new_idx - event_idx - 1) < (__u16)(new_idx - old);
 }
 
+/* The packed layout marks its descriptors available, then used, with these
+ * flags bits, which make sense along with the wrap counters of both sides. */
+#define VRING_PACKED_DESC_F_AVAIL	7
+#define VRING_PACKED_DESC_F_USED	15
+
+/* Either side tells the other whether it wants to be notified about used
+ * (resp. available) descriptors with these event suppression flags. */
+#define VRING_PACKED_EVENT_FLAG_ENABLE	0x0
+#define VRING_PACKED_EVENT_FLAG_DISABLE	0x1
+/* Only for the descriptor at off_wrap (with VIRTIO_RING_F_EVENT_IDX). */
+#define VRING_PACKED_EVENT_FLAG_DESC	0x2
+
+/* The wrap counter that goes along with the offset, in off_wrap. */
+#define VRING_PACKED_EVENT_F_WRAP_CTR	15
+
+/* Packed ring descriptors: 16 bytes.  A buffer is made available, and then
+ * used, in place: its descriptors are consecutive, and the used descriptor
+ * overwrites the first of them. */
+struct vring_packed_desc {
+	/* Address (guest-physical). */
+	__u64 addr;
+	/* Length (written to, once used). */
+	__u32 len;
+	/* Buffer id, given back once used. */
+	__u16 id;
+	/* The flags as indicated above. */
+	__u16 flags;
+};
+
+struct vring_packed_desc_event {
+	/* Descriptor ring offset, and wrap counter (in the top bit). */
+	__u16 off_wrap;
+	/* Event suppression flags, as indicated above. */
+	__u16 flags;
+};
+
+struct vring_packed {
+	unsigned int num;
+
+	struct vring_packed_desc *desc;
+
+	/* Written by the driver, read by the device. */
+	struct vring_packed_desc_event *driver;
+
+	/* Written by the device, read by the driver. */
+	struct vring_packed_desc_event *device;
+};
+
+/* The packed layout is a continuous chunk of memory which looks like this:
+ * a single ring, so each buffer only touches the cache lines of its own
+ * descriptors (and, when notifications change, of the event structures).
+ *
+ * struct vring_packed
+ * {
+ *	// The actual descriptors (16 bytes each)
+ *	struct vring_packed_desc desc[num];
+ *
+ *	// The driver's event suppression structure.
+ *	struct vring_packed_desc_event driver;
+ *
+ *	// Padding to the next align boundary.
+ *	char pad[];
+ *
+ *	// The device's event suppression structure.
+ *	struct vring_packed_desc_event device;
+ * };
+ */
+static inline void vring_packed_init(struct vring_packed *vr, unsigned int num,
+				     void *p, unsigned long align)
+{
+	vr->num = num;
+	vr->desc = p;
+	vr->driver = p + num*sizeof(struct vring_packed_desc);
+	vr->device = (void *)(((unsigned long)&vr->driver[1] + align-1)
+			      & ~(align - 1));
+}
+
+static inline unsigned vring_packed_size(unsigned int num, unsigned long align)
+{
+	return ((sizeof(struct vring_packed_desc) * num
+		 + sizeof(struct vring_packed_desc_event) + align - 1)
+		& ~(align - 1))
+		+ sizeof(struct vring_packed_desc_event);
+}
+
 #endif /* _UAPI_LINUX_VIRTIO_RING_H */
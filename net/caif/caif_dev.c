@@ -38,6 +38,8 @@ struct caif_device_entry {
 	struct sk_buff *xoff_skb;
 	void (*xoff_skb_dtor)(struct sk_buff *skb);
 	bool xoff;
+	/* The link went down underneath the running device (carrier off) */
+	bool nocarrier;
 };
 
 struct caif_device_entry_list {
@@ -272,6 +274,50 @@ static int receive(struct sk_buff *skb, struct net_device *dev,
 	return err;
 }
 
+/**
+ * caif_receive_list() - Stuff a batch of received packets into CAIF.
+ * @dev:	CAIF link layer device the packets were received on.
+ * @list:	The packets, which are all consumed.
+ *
+ * Link layers that receive packets in batches (e.g. from NAPI) may use
+ * this instead of netif_receive_skb() on each packet: the batch is then
+ * passed up the CAIF stack at once, and delivered to each channel at once.
+ * Packets handed over this way don't go through packet taps.
+ */
+int caif_receive_list(struct net_device *dev, struct sk_buff_head *list)
+{
+	struct caif_device_entry *caifd;
+	struct sk_buff *skb;
+	int err;
+
+	rcu_read_lock();
+	caifd = caif_get(dev);
+
+	if (!caifd || !caifd->layer.up || !caifd->layer.up->receive ||
+			!netif_oper_up(caifd->netdev)) {
+		rcu_read_unlock();
+		__skb_queue_purge(list);
+		return NET_RX_DROP;
+	}
+
+	/* Hold reference to netdevice while using CAIF stack */
+	caifd_hold(caifd);
+	rcu_read_unlock();
+
+	skb_queue_walk(list, skb)
+		cfpkt_fromnative(CAIF_DIR_IN, skb);
+
+	err = cfpkt_receive_list(caifd->layer.up, list);
+
+	/* Release reference to stack upwards */
+	caifd_put(caifd);
+
+	if (err != 0)
+		err = NET_RX_DROP;
+	return err;
+}
+EXPORT_SYMBOL(caif_receive_list);
+
 static struct packet_type caif_packet_type __read_mostly = {
 	.type = cpu_to_be16(ETH_P_CAIF),
 	.func = receive,
@@ -349,6 +395,48 @@ void caif_enroll_dev(struct net_device *dev, struct caif_dev_common *caifdev,
 }
 EXPORT_SYMBOL(caif_enroll_dev);
 
+/* take the link layer of @dev down, and tell the channels across it */
+static int caif_phy_down(struct cfcnfg *cfg, struct net_device *dev)
+{
+	struct caif_device_entry *caifd;
+
+	rcu_read_lock();
+
+	caifd = caif_get(dev);
+	if (!caifd || !caifd->layer.up || !caifd->layer.up->ctrlcmd) {
+		rcu_read_unlock();
+		return -EINVAL;
+	}
+
+	cfcnfg_set_phy_state(cfg, &caifd->layer, false);
+	caifd_hold(caifd);
+	rcu_read_unlock();
+
+	caifd->layer.up->ctrlcmd(caifd->layer.up,
+				 _CAIF_CTRLCMD_PHYIF_DOWN_IND,
+				 caifd->layer.id);
+
+	spin_lock_bh(&caifd->flow_lock);
+
+	/*
+	 * Replace our xoff-destructor with original destructor.
+	 * We trust that skb->destructor *always* is called before
+	 * the skb reference is invalid. The hijacked SKB destructor
+	 * takes the flow_lock so manipulating the skb->destructor here
+	 * should be safe.
+	*/
+	if (caifd->xoff_skb_dtor != NULL && caifd->xoff_skb != NULL)
+		caifd->xoff_skb->destructor = caifd->xoff_skb_dtor;
+
+	caifd->xoff = 0;
+	caifd->xoff_skb_dtor = NULL;
+	caifd->xoff_skb = NULL;
+
+	spin_unlock_bh(&caifd->flow_lock);
+	caifd_put(caifd);
+	return 0;
+}
+
 /* notify Caif of device events */
 static int caif_device_notify(struct notifier_block *me, unsigned long what,
 			      void *arg)
@@ -400,47 +488,54 @@ static int caif_device_notify(struct notifier_block *me, unsigned long what,
 		}
 
 		caifd->xoff = 0;
-		cfcnfg_set_phy_state(cfg, &caifd->layer, true);
+		/* A link without carrier is brought up on NETDEV_CHANGE */
+		caifd->nocarrier = !netif_carrier_ok(dev);
+		if (!caifd->nocarrier)
+			cfcnfg_set_phy_state(cfg, &caifd->layer, true);
 		rcu_read_unlock();
 
 		break;
 
-	case NETDEV_DOWN:
+	case NETDEV_CHANGE:
+		/*
+		 * Link layers that can lose their link while staying around
+		 * (e.g. a restarting modem) turn their carrier off: the
+		 * channels across it are shut down, as if the device went
+		 * down, but the device stays up and is used again as soon as
+		 * the carrier comes back.
+		 */
+		if (!netif_running(dev))
+			break;
+
 		rcu_read_lock();
 
 		caifd = caif_get(dev);
-		if (!caifd || !caifd->layer.up || !caifd->layer.up->ctrlcmd) {
+		if (caifd == NULL ||
+		    caifd->nocarrier == !netif_carrier_ok(dev)) {
 			rcu_read_unlock();
-			return -EINVAL;
+			break;
 		}
 
-		cfcnfg_set_phy_state(cfg, &caifd->layer, false);
-		caifd_hold(caifd);
+		caifd->nocarrier = !netif_carrier_ok(dev);
+		if (!caifd->nocarrier) {
+			caifd->xoff = 0;
+			cfcnfg_set_phy_state(cfg, &caifd->layer, true);
+			rcu_read_unlock();
+			break;
+		}
 		rcu_read_unlock();
 
-		caifd->layer.up->ctrlcmd(caifd->layer.up,
-					 _CAIF_CTRLCMD_PHYIF_DOWN_IND,
-					 caifd->layer.id);
+		return caif_phy_down(cfg, dev);
 
-		spin_lock_bh(&caifd->flow_lock);
-
-		/*
-		 * Replace our xoff-destructor with original destructor.
-		 * We trust that skb->destructor *always* is called before
-		 * the skb reference is invalid. The hijacked SKB destructor
-		 * takes the flow_lock so manipulating the skb->destructor here
-		 * should be safe.
-		*/
-		if (caifd->xoff_skb_dtor != NULL && caifd->xoff_skb != NULL)
-			caifd->xoff_skb->destructor = caifd->xoff_skb_dtor;
+	case NETDEV_DOWN:
+		rcu_read_lock();
 
-		caifd->xoff = 0;
-		caifd->xoff_skb_dtor = NULL;
-		caifd->xoff_skb = NULL;
+		caifd = caif_get(dev);
+		if (caifd)
+			caifd->nocarrier = false;
+		rcu_read_unlock();
 
-		spin_unlock_bh(&caifd->flow_lock);
-		caifd_put(caifd);
-		break;
+		return caif_phy_down(cfg, dev);
 
 	case NETDEV_UNREGISTER:
 		mutex_lock(&caifdevs->lock);
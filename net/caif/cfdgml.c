@@ -22,6 +22,8 @@
 #define DGM_MTU 1500
 
 static int cfdgml_receive(struct cflayer *layr, struct cfpkt *pkt);
+static int cfdgml_receive_list(struct cflayer *layr,
+			       struct sk_buff_head *pkts);
 static int cfdgml_transmit(struct cflayer *layr, struct cfpkt *pkt);
 
 struct cflayer *cfdgml_create(u8 channel_id, struct dev_info *dev_info)
@@ -32,17 +34,22 @@ struct cflayer *cfdgml_create(u8 channel_id, struct dev_info *dev_info)
 	caif_assert(offsetof(struct cfsrvl, layer) == 0);
 	cfsrvl_init(dgm, channel_id, dev_info, true);
 	dgm->layer.receive = cfdgml_receive;
+	dgm->layer.receive_list = cfdgml_receive_list;
 	dgm->layer.transmit = cfdgml_transmit;
 	snprintf(dgm->layer.name, CAIF_LAYER_NAME_SZ - 1, "dgm%d", channel_id);
 	dgm->layer.name[CAIF_LAYER_NAME_SZ - 1] = '\0';
 	return &dgm->layer;
 }
 
-static int cfdgml_receive(struct cflayer *layr, struct cfpkt *pkt)
+/*
+ * Strip the datagram header off a received packet. Returns 1 if it's a
+ * data packet, to be passed up. Control packets are handled here, and
+ * destroyed, as are erroneous ones.
+ */
+static int cfdgml_parse(struct cflayer *layr, struct cfpkt *pkt)
 {
 	u8 cmd = -1;
 	u8 dgmhdr[3];
-	int ret;
 	caif_assert(layr->up != NULL);
 	caif_assert(layr->receive != NULL);
 	caif_assert(layr->ctrlcmd != NULL);
@@ -59,8 +66,7 @@ static int cfdgml_receive(struct cflayer *layr, struct cfpkt *pkt)
 			cfpkt_destroy(pkt);
 			return -EPROTO;
 		}
-		ret = layr->up->receive(layr->up, pkt);
-		return ret;
+		return 1;
 	}
 
 	switch (cmd) {
@@ -79,6 +85,42 @@ static int cfdgml_receive(struct cflayer *layr, struct cfpkt *pkt)
 	}
 }
 
+static int cfdgml_receive(struct cflayer *layr, struct cfpkt *pkt)
+{
+	int ret;
+
+	ret = cfdgml_parse(layr, pkt);
+	if (ret <= 0)
+		return ret;
+
+	return layr->up->receive(layr->up, pkt);
+}
+
+static int cfdgml_receive_list(struct cflayer *layr,
+			       struct sk_buff_head *pkts)
+{
+	struct sk_buff_head data;
+	struct cfpkt *pkt;
+	int ret, err = 0;
+
+	cfpkt_list_init(&data);
+
+	while ((pkt = cfpkt_list_dequeue(pkts)) != NULL) {
+		ret = cfdgml_parse(layr, pkt);
+		if (ret < 0)
+			err = ret;
+		else if (ret > 0)
+			cfpkt_list_add(&data, pkt);
+	}
+
+	if (cfpkt_list_empty(&data))
+		return err;
+
+	ret = cfpkt_receive_list(layr->up, &data);
+
+	return err ? err : ret;
+}
+
 static int cfdgml_transmit(struct cflayer *layr, struct cfpkt *pkt)
 {
 	u8 packet_type;
@@ -26,6 +26,8 @@ struct cffrml {
 };
 
 static int cffrml_receive(struct cflayer *layr, struct cfpkt *pkt);
+static int cffrml_receive_list(struct cflayer *layr,
+			       struct sk_buff_head *pkts);
 static int cffrml_transmit(struct cflayer *layr, struct cfpkt *pkt);
 static void cffrml_ctrlcmd(struct cflayer *layr, enum caif_ctrlcmd ctrl,
 				int phyid);
@@ -46,6 +48,7 @@ struct cflayer *cffrml_create(u16 phyid, bool use_fcs)
 	caif_assert(offsetof(struct cffrml, layer) == 0);
 
 	this->layer.receive = cffrml_receive;
+	this->layer.receive_list = cffrml_receive_list;
 	this->layer.transmit = cffrml_transmit;
 	this->layer.ctrlcmd = cffrml_ctrlcmd;
 	snprintf(this->layer.name, CAIF_LAYER_NAME_SZ, "frm%d", phyid);
@@ -79,7 +82,12 @@ static u16 cffrml_checksum(u16 chks, void *buf, u16 len)
 	return crc_ccitt(chks, buf, len);
 }
 
-static int cffrml_receive(struct cflayer *layr, struct cfpkt *pkt)
+/*
+ * Strip the framing off a received packet, and check it. Returns 0 if the
+ * packet is to be passed up, otherwise it's destroyed, unless the error is
+ * -EILSEQ (bad checksum).
+ */
+static int cffrml_deframe(struct cflayer *layr, struct cfpkt *pkt)
 {
 	u16 tmp;
 	u16 len;
@@ -125,6 +133,17 @@ static int cffrml_receive(struct cflayer *layr, struct cfpkt *pkt)
 		return -EPROTO;
 	}
 
+	return 0;
+}
+
+static int cffrml_receive(struct cflayer *layr, struct cfpkt *pkt)
+{
+	int ret;
+
+	ret = cffrml_deframe(layr, pkt);
+	if (ret)
+		return ret;
+
 	if (layr->up == NULL) {
 		pr_err("Layr up is missing!\n");
 		cfpkt_destroy(pkt);
@@ -134,6 +153,41 @@ static int cffrml_receive(struct cflayer *layr, struct cfpkt *pkt)
 	return layr->up->receive(layr->up, pkt);
 }
 
+static int cffrml_receive_list(struct cflayer *layr,
+			       struct sk_buff_head *pkts)
+{
+	struct sk_buff_head frames;
+	struct cfpkt *pkt;
+	int ret, err = 0;
+
+	if (layr->up == NULL) {
+		pr_err("Layr up is missing!\n");
+		cfpkt_list_purge(pkts);
+		return -EINVAL;
+	}
+
+	cfpkt_list_init(&frames);
+
+	while ((pkt = cfpkt_list_dequeue(pkts)) != NULL) {
+		ret = cffrml_deframe(layr, pkt);
+		if (ret == -EILSEQ)
+			cfpkt_destroy(pkt);
+		if (ret) {
+			err = ret;
+			continue;
+		}
+
+		cfpkt_list_add(&frames, pkt);
+	}
+
+	if (cfpkt_list_empty(&frames))
+		return err;
+
+	ret = cfpkt_receive_list(layr->up, &frames);
+
+	return err ? err : ret;
+}
+
 static int cffrml_transmit(struct cflayer *layr, struct cfpkt *pkt)
 {
 	u16 chks;
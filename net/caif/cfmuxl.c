@@ -18,14 +18,22 @@
 #define container_obj(layr) container_of(layr, struct cfmuxl, layer)
 
 #define CAIF_CTRL_CHANNEL 0
-#define UP_CACHE_SIZE 8
+/* Link IDs are 8 bits wide */
+#define UP_LAYERS 256
 #define DN_CACHE_SIZE 8
 
+/* Number of channels a received batch is sorted into at most at once */
+#define RCV_CHANNELS 8
+
 struct cfmuxl {
 	struct cflayer layer;
 	struct list_head srvl_list;
 	struct list_head frml_list;
-	struct cflayer *up_cache[UP_CACHE_SIZE];
+	/*
+	 * Upwards layers indexed by link ID, so received packets find theirs
+	 * under RCU only. srvl_list holds the same layers, for walking them.
+	 */
+	struct cflayer __rcu *up_layers[UP_LAYERS];
 	struct cflayer *dn_cache[DN_CACHE_SIZE];
 	/*
 	 * Set when inserting or removing downwards layers.
@@ -40,10 +48,12 @@ struct cfmuxl {
 };
 
 static int cfmuxl_receive(struct cflayer *layr, struct cfpkt *pkt);
+static int cfmuxl_receive_list(struct cflayer *layr,
+			       struct sk_buff_head *pkts);
 static int cfmuxl_transmit(struct cflayer *layr, struct cfpkt *pkt);
 static void cfmuxl_ctrlcmd(struct cflayer *layr, enum caif_ctrlcmd ctrl,
 				int phyid);
-static struct cflayer *get_up(struct cfmuxl *muxl, u16 id);
+static struct cflayer *get_up(struct cfmuxl *muxl, u8 id);
 
 struct cflayer *cfmuxl_create(void)
 {
@@ -52,6 +62,7 @@ struct cflayer *cfmuxl_create(void)
 		return NULL;
 	memset(this, 0, sizeof(*this));
 	this->layer.receive = cfmuxl_receive;
+	this->layer.receive_list = cfmuxl_receive_list;
 	this->layer.transmit = cfmuxl_transmit;
 	this->layer.ctrlcmd = cfmuxl_ctrlcmd;
 	INIT_LIST_HEAD(&this->srvl_list);
@@ -96,6 +107,7 @@ int cfmuxl_set_uplayer(struct cflayer *layr, struct cflayer *up, u8 linkid)
 		list_del_rcu(&old->node);
 
 	list_add_rcu(&up->node, &muxl->srvl_list);
+	rcu_assign_pointer(muxl->up_layers[linkid], up);
 	spin_unlock_bh(&muxl->receive_lock);
 
 	return 0;
@@ -120,18 +132,10 @@ out:
 	return dn;
 }
 
-static struct cflayer *get_up(struct cfmuxl *muxl, u16 id)
+/* Must be called under rcu_read_lock() */
+static struct cflayer *get_up(struct cfmuxl *muxl, u8 id)
 {
-	struct cflayer *up;
-	int idx = id % UP_CACHE_SIZE;
-	up = rcu_dereference(muxl->up_cache[idx]);
-	if (up == NULL || up->id != id) {
-		spin_lock_bh(&muxl->receive_lock);
-		up = get_from_id(&muxl->srvl_list, id);
-		rcu_assign_pointer(muxl->up_cache[idx], up);
-		spin_unlock_bh(&muxl->receive_lock);
-	}
-	return up;
+	return rcu_dereference(muxl->up_layers[id]);
 }
 
 static struct cflayer *get_dn(struct cfmuxl *muxl, struct dev_info *dev_info)
@@ -152,7 +156,6 @@ struct cflayer *cfmuxl_remove_uplayer(struct cflayer *layr, u8 id)
 {
 	struct cflayer *up;
 	struct cfmuxl *muxl = container_obj(layr);
-	int idx = id % UP_CACHE_SIZE;
 
 	if (id == 0) {
 		pr_warn("Trying to remove control layer\n");
@@ -164,7 +167,7 @@ struct cflayer *cfmuxl_remove_uplayer(struct cflayer *layr, u8 id)
 	if (up == NULL)
 		goto out;
 
-	RCU_INIT_POINTER(muxl->up_cache[idx], NULL);
+	RCU_INIT_POINTER(muxl->up_layers[id], NULL);
 	list_del_rcu(&up->node);
 out:
 	spin_unlock_bh(&muxl->receive_lock);
@@ -208,6 +211,89 @@ static int cfmuxl_receive(struct cflayer *layr, struct cfpkt *pkt)
 	return ret;
 }
 
+/* Pass the packets of one channel up, with a single lookup */
+static int cfmuxl_receive_channel(struct cfmuxl *muxl, u8 id,
+				  struct sk_buff_head *pkts)
+{
+	struct cflayer *up;
+	int ret;
+
+	rcu_read_lock();
+	up = get_up(muxl, id);
+
+	if (up == NULL) {
+		pr_debug("Received data on unknown link ID = %d (0x%x)"
+			" up == NULL", id, id);
+		rcu_read_unlock();
+		/* Not an error, see cfmuxl_receive() */
+		cfpkt_list_purge(pkts);
+		return 0;
+	}
+
+	cfsrvl_get(up);
+	rcu_read_unlock();
+
+	ret = cfpkt_receive_list(up, pkts);
+
+	cfsrvl_put(up);
+	return ret;
+}
+
+/*
+ * Sort a batch of packets by channel, and pass each channel's packets up
+ * at once. Packets of a channel stay in the order they were received in.
+ */
+static int cfmuxl_receive_list(struct cflayer *layr,
+			       struct sk_buff_head *pkts)
+{
+	struct cfmuxl *muxl = container_obj(layr);
+	struct sk_buff_head chnl_pkts[RCV_CHANNELS];
+	u8 chnl_id[RCV_CHANNELS];
+	int i, nchnl = 0;
+	int ret, err = 0;
+	struct cfpkt *pkt;
+	u8 id;
+
+	for (i = 0; i < RCV_CHANNELS; i++)
+		cfpkt_list_init(&chnl_pkts[i]);
+
+	while ((pkt = cfpkt_list_dequeue(pkts)) != NULL) {
+		if (cfpkt_extr_head(pkt, &id, 1) < 0) {
+			pr_err("erroneous Caif Packet\n");
+			cfpkt_destroy(pkt);
+			err = -EPROTO;
+			continue;
+		}
+
+		for (i = 0; i < nchnl && chnl_id[i] != id; i++)
+			;
+
+		/* Too many channels in this batch: flush what's sorted */
+		if (i == RCV_CHANNELS) {
+			for (i = 0; i < nchnl; i++) {
+				ret = cfmuxl_receive_channel(muxl, chnl_id[i],
+							     &chnl_pkts[i]);
+				if (ret < 0)
+					err = ret;
+			}
+			nchnl = i = 0;
+		}
+
+		if (i == nchnl)
+			chnl_id[nchnl++] = id;
+
+		cfpkt_list_add(&chnl_pkts[i], pkt);
+	}
+
+	for (i = 0; i < nchnl; i++) {
+		ret = cfmuxl_receive_channel(muxl, chnl_id[i], &chnl_pkts[i]);
+		if (ret < 0)
+			err = ret;
+	}
+
+	return err;
+}
+
 static int cfmuxl_transmit(struct cflayer *layr, struct cfpkt *pkt)
 {
 	struct cfmuxl *muxl = container_obj(layr);
@@ -401,3 +401,25 @@ void cfpkt_set_prio(struct cfpkt *pkt, int prio)
 	pkt_to_skb(pkt)->priority = prio;
 }
 EXPORT_SYMBOL(cfpkt_set_prio);
+
+int cfpkt_receive_list(struct cflayer *layr, struct sk_buff_head *pkts)
+{
+	struct cfpkt *pkt;
+	int ret, err = 0;
+
+	if (layr->receive_list)
+		return layr->receive_list(layr, pkts);
+
+	while ((pkt = cfpkt_list_dequeue(pkts)) != NULL) {
+		ret = layr->receive(layr, pkt);
+
+		/* For -EILSEQ the packet is not freed, so do it now */
+		if (ret == -EILSEQ)
+			cfpkt_destroy(pkt);
+		if (ret < 0)
+			err = ret;
+	}
+
+	return err;
+}
+EXPORT_SYMBOL(cfpkt_receive_list);
@@ -13,6 +13,7 @@
 #include <linux/module.h>
 #include <linux/netdevice.h>
 #include <linux/if_ether.h>
+#include <linux/if_arp.h>
 #include <linux/moduleparam.h>
 #include <linux/ip.h>
 #include <linux/sched.h>
@@ -29,6 +30,17 @@
 #define CONNECT_TIMEOUT (5 * HZ)
 #define CAIF_NET_DEFAULT_QUEUE_LEN 500
 #define UNDEF_CONNID 0xffffffff
+/* Received packets waiting for NAPI, at which the modem is flowed off */
+#define CAIF_NET_RX_HIGH_WATER CAIF_NET_DEFAULT_QUEUE_LEN
+/* ... and at which it's dropped, if it doesn't stop */
+#define CAIF_NET_RX_MAX_QUEUE (2 * CAIF_NET_RX_HIGH_WATER)
+
+/* Default number of TX queues, see chnl_net_num_tx_queues() */
+#define CAIF_NET_MAX_TX_QUEUES 8
+
+static int napi_weight = 64;
+module_param(napi_weight, int, 0444);
+MODULE_PARM_DESC(napi_weight, "Packets received per NAPI poll, at most");
 
 /*This list is protected by the rtnl lock. */
 static LIST_HEAD(chnl_net_list);
@@ -54,6 +66,15 @@ struct chnl_net {
 	/* Flow status to remember and control the transmission. */
 	bool flowenabled;
 	enum caif_states state;
+	/* Received packets, delivered to the network stack by NAPI. */
+	struct sk_buff_head rx_queue;
+	struct napi_struct napi;
+	/* The modem was asked to stop sending, rx_queue is too long. */
+	bool rx_flow_off;
+	/* The CAIF link layer device the channel was connected across */
+	int llifindex;
+	/* The link was lost, reconnect once it's back (see reattach_work) */
+	bool reattach;
 };
 
 static void robust_list_del(struct list_head *delete_node)
@@ -70,23 +91,24 @@ static void robust_list_del(struct list_head *delete_node)
 	WARN_ON(1);
 }
 
-static int chnl_recv_cb(struct cflayer *layr, struct cfpkt *pkt)
+static void chnl_rx_flowctrl(struct chnl_net *priv, int mode)
+{
+	if (priv->chnl.dn && priv->chnl.dn->modemcmd)
+		priv->chnl.dn->modemcmd(priv->chnl.dn, mode);
+}
+
+/*
+ * Prepare a received packet for the network stack. Returns the packet's
+ * skb, or NULL if it's dropped.
+ */
+static struct sk_buff *chnl_rx_skb(struct chnl_net *priv, struct cfpkt *pkt)
 {
 	struct sk_buff *skb;
-	struct chnl_net *priv;
-	int pktlen;
 	const u8 *ip_version;
 	u8 buf;
 
-	priv = container_of(layr, struct chnl_net, chnl);
-	if (!priv)
-		return -EINVAL;
-
 	skb = (struct sk_buff *) cfpkt_tonative(pkt);
 
-	/* Get length of CAIF packet. */
-	pktlen = skb->len;
-
 	/* Pass some minimum information and
 	 * send the packet to the net stack.
 	 */
@@ -96,7 +118,7 @@ static int chnl_recv_cb(struct cflayer *layr, struct cfpkt *pkt)
 	ip_version = skb_header_pointer(skb, 0, 1, &buf);
 	if (!ip_version) {
 		kfree_skb(skb);
-		return -EINVAL;
+		return NULL;
 	}
 
 	switch (*ip_version >> 4) {
@@ -109,7 +131,7 @@ static int chnl_recv_cb(struct cflayer *layr, struct cfpkt *pkt)
 	default:
 		kfree_skb(skb);
 		priv->netdev->stats.rx_errors++;
-		return -EINVAL;
+		return NULL;
 	}
 
 	/* If we change the header in loop mode, the checksum is corrupted. */
@@ -118,16 +140,129 @@ static int chnl_recv_cb(struct cflayer *layr, struct cfpkt *pkt)
 	else
 		skb->ip_summed = CHECKSUM_NONE;
 
-	if (in_interrupt())
-		netif_rx(skb);
-	else
-		netif_rx_ni(skb);
-
 	/* Update statistics. */
 	priv->netdev->stats.rx_packets++;
-	priv->netdev->stats.rx_bytes += pktlen;
+	priv->netdev->stats.rx_bytes += skb->len;
 
-	return 0;
+	return skb;
+}
+
+/*
+ * Queue received packets for NAPI, and schedule it. Once too many packets
+ * are waiting, the modem is flowed off: CAIF doesn't expect packets to be
+ * dropped, they only are if the modem keeps on sending regardless.
+ */
+static int chnl_rx_queue(struct chnl_net *priv, struct sk_buff_head *skbs)
+{
+	bool flow_off = false;
+	unsigned long flags;
+	int qlen, dropped;
+
+	spin_lock_irqsave(&priv->rx_queue.lock, flags);
+	skb_queue_splice_tail_init(skbs, &priv->rx_queue);
+
+	qlen = skb_queue_len(&priv->rx_queue);
+	if (qlen > CAIF_NET_RX_HIGH_WATER && !priv->rx_flow_off) {
+		priv->rx_flow_off = true;
+		flow_off = true;
+	}
+
+	for (dropped = 0; qlen - dropped > CAIF_NET_RX_MAX_QUEUE; dropped++)
+		kfree_skb(__skb_dequeue_tail(&priv->rx_queue));
+	spin_unlock_irqrestore(&priv->rx_queue.lock, flags);
+
+	if (flow_off)
+		chnl_rx_flowctrl(priv, CAIF_MODEMCMD_FLOW_OFF_REQ);
+
+	priv->netdev->stats.rx_dropped += dropped;
+
+	napi_schedule(&priv->napi);
+
+	return dropped ? -ENOBUFS : 0;
+}
+
+static int chnl_recv_cb(struct cflayer *layr, struct cfpkt *pkt)
+{
+	struct chnl_net *priv = container_of(layr, struct chnl_net, chnl);
+	struct sk_buff_head skbs;
+	struct sk_buff *skb;
+
+	skb = chnl_rx_skb(priv, pkt);
+	if (!skb)
+		return -EINVAL;
+
+	__skb_queue_head_init(&skbs);
+	__skb_queue_tail(&skbs, skb);
+
+	return chnl_rx_queue(priv, &skbs);
+}
+
+static int chnl_recv_list_cb(struct cflayer *layr, struct sk_buff_head *pkts)
+{
+	struct chnl_net *priv = container_of(layr, struct chnl_net, chnl);
+	struct sk_buff_head skbs;
+	struct sk_buff *skb;
+	struct cfpkt *pkt;
+	int ret, err = 0;
+
+	__skb_queue_head_init(&skbs);
+
+	while ((pkt = cfpkt_list_dequeue(pkts)) != NULL) {
+		skb = chnl_rx_skb(priv, pkt);
+		if (skb)
+			__skb_queue_tail(&skbs, skb);
+		else
+			err = -EINVAL;
+	}
+
+	if (skb_queue_empty(&skbs))
+		return err;
+
+	/* The whole batch is queued, and NAPI scheduled, at once. */
+	ret = chnl_rx_queue(priv, &skbs);
+
+	return err ? err : ret;
+}
+
+static int chnl_net_poll(struct napi_struct *napi, int budget)
+{
+	struct chnl_net *priv = container_of(napi, struct chnl_net, napi);
+	struct sk_buff_head skbs;
+	struct sk_buff *skb;
+	bool flow_on = false;
+	int work = 0;
+
+	__skb_queue_head_init(&skbs);
+
+	spin_lock_irq(&priv->rx_queue.lock);
+	while (work < budget &&
+	       (skb = __skb_dequeue(&priv->rx_queue)) != NULL) {
+		__skb_queue_tail(&skbs, skb);
+		work++;
+	}
+
+	if (priv->rx_flow_off &&
+	    skb_queue_len(&priv->rx_queue) < CAIF_NET_RX_HIGH_WATER / 4) {
+		priv->rx_flow_off = false;
+		flow_on = true;
+	}
+	spin_unlock_irq(&priv->rx_queue.lock);
+
+	if (flow_on)
+		chnl_rx_flowctrl(priv, CAIF_MODEMCMD_FLOW_ON_REQ);
+
+	while ((skb = __skb_dequeue(&skbs)) != NULL)
+		napi_gro_receive(napi, skb);
+
+	if (work < budget) {
+		napi_complete(napi);
+
+		/* Packets queued while NAPI was still scheduled */
+		if (!skb_queue_empty(&priv->rx_queue))
+			napi_schedule(napi);
+	}
+
+	return work;
 }
 
 static int delete_device(struct chnl_net *dev)
@@ -138,22 +273,105 @@ static int delete_device(struct chnl_net *dev)
 	return 0;
 }
 
+static void reattach_work(struct work_struct *work);
+static DECLARE_WORK(reattach_worker, reattach_work);
+
+/*
+ * A channel is shut down along with the link it's connected across, but a
+ * link layer device which stays up without carrier (e.g. a restarting
+ * modem) is going to be used again: the interface then stays up, without
+ * carrier, and the channel is reconnected once the carrier is back.
+ */
+static bool chnl_link_lost(struct chnl_net *priv)
+{
+	struct net_device *lldev;
+
+	ASSERT_RTNL();
+	lldev = __dev_get_by_index(dev_net(priv->netdev), priv->llifindex);
+
+	return lldev && netif_running(lldev) && !netif_carrier_ok(lldev);
+}
+
+static void chnl_net_detach(struct chnl_net *priv)
+{
+	ASSERT_RTNL();
+	netif_carrier_off(priv->netdev);
+	priv->flowenabled = false;
+	priv->reattach = true;
+	caif_disconnect_client(dev_net(priv->netdev), &priv->chnl);
+
+	skb_queue_purge(&priv->rx_queue);
+	priv->rx_flow_off = false;
+}
+
 static void close_work(struct work_struct *work)
 {
 	struct chnl_net *dev = NULL;
 	struct list_head *list_node;
 	struct list_head *_tmp;
+	bool detached = false;
 
 	rtnl_lock();
 	list_for_each_safe(list_node, _tmp, &chnl_net_list) {
 		dev = list_entry(list_node, struct chnl_net, list_field);
-		if (dev->state == CAIF_SHUTDOWN)
+		if (dev->state != CAIF_SHUTDOWN)
+			continue;
+		if (chnl_link_lost(dev)) {
+			chnl_net_detach(dev);
+			detached = true;
+		} else {
 			dev_close(dev->netdev);
+		}
 	}
 	rtnl_unlock();
+
+	/* the link may be back already */
+	if (detached)
+		schedule_work(&reattach_worker);
 }
 static DECLARE_WORK(close_worker, close_work);
 
+static void reattach_work(struct work_struct *work)
+{
+	struct chnl_net *dev = NULL;
+	struct net_device *lldev;
+	struct list_head *list_node;
+	struct list_head *_tmp;
+	int llifindex, headroom, tailroom;
+	int err;
+
+	rtnl_lock();
+	list_for_each_safe(list_node, _tmp, &chnl_net_list) {
+		dev = list_entry(list_node, struct chnl_net, list_field);
+		if (!dev->reattach || dev->state != CAIF_DISCONNECTED)
+			continue;
+
+		lldev = __dev_get_by_index(dev_net(dev->netdev),
+					   dev->llifindex);
+		if (lldev && netif_running(lldev) && !netif_carrier_ok(lldev))
+			continue;
+
+		if (!lldev || !netif_running(lldev)) {
+			/* the link is gone for good */
+			dev->reattach = false;
+			dev_close(dev->netdev);
+			continue;
+		}
+
+		dev->state = CAIF_CONNECTING;
+		err = caif_connect_client(dev_net(dev->netdev), &dev->conn_req,
+					  &dev->chnl, &llifindex, &headroom,
+					  &tailroom);
+		if (err) {
+			pr_debug("reconnect failed: %d\n", err);
+			dev->reattach = false;
+			dev->state = CAIF_DISCONNECTED;
+			dev_close(dev->netdev);
+		}
+	}
+	rtnl_unlock();
+}
+
 static void chnl_hold(struct cflayer *lyr)
 {
 	struct chnl_net *priv = container_of(lyr, struct chnl_net, chnl);
@@ -184,12 +402,19 @@ static void chnl_flowctrl_cb(struct cflayer *layr, enum caif_ctrlcmd flow,
 	switch (flow) {
 	case CAIF_CTRLCMD_FLOW_OFF_IND:
 		priv->flowenabled = false;
-		netif_stop_queue(priv->netdev);
+		netif_tx_stop_all_queues(priv->netdev);
 		break;
 	case CAIF_CTRLCMD_DEINIT_RSP:
 		priv->state = CAIF_DISCONNECTED;
 		break;
 	case CAIF_CTRLCMD_INIT_FAIL_RSP:
+		if (priv->reattach) {
+			/* nobody waits for a reconnect, give up on it */
+			priv->reattach = false;
+			priv->state = CAIF_SHUTDOWN;
+			schedule_work(&close_worker);
+			break;
+		}
 		priv->state = CAIF_DISCONNECTED;
 		wake_up_interruptible(&priv->netmgmt_wq);
 		break;
@@ -200,13 +425,15 @@ static void chnl_flowctrl_cb(struct cflayer *layr, enum caif_ctrlcmd flow,
 		break;
 	case CAIF_CTRLCMD_FLOW_ON_IND:
 		priv->flowenabled = true;
-		netif_wake_queue(priv->netdev);
+		netif_tx_wake_all_queues(priv->netdev);
 		break;
 	case CAIF_CTRLCMD_INIT_RSP:
 		caif_client_register_refcnt(&priv->chnl, chnl_hold, chnl_put);
 		priv->state = CAIF_CONNECTED;
+		priv->reattach = false;
 		priv->flowenabled = true;
-		netif_wake_queue(priv->netdev);
+		netif_carrier_on(priv->netdev);
+		netif_tx_wake_all_queues(priv->netdev);
 		wake_up_interruptible(&priv->netmgmt_wq);
 		break;
 	default:
@@ -308,6 +535,7 @@ static int chnl_net_open(struct net_device *dev)
 		mtu = min_t(int, GPRS_PDP_MTU, mtu);
 		dev_set_mtu(dev, mtu);
 		dev_put(lldev);
+		priv->llifindex = llifindex;
 
 		if (mtu < 100) {
 			pr_warn("CAIF Interface MTU too small (%d)\n", mtu);
@@ -345,6 +573,10 @@ static int chnl_net_open(struct net_device *dev)
 		goto error;
 	}
 	pr_debug("CAIF Netdevice connected\n");
+
+	napi_enable(&priv->napi);
+	/* Packets may have been queued already, as soon as we connected. */
+	napi_schedule(&priv->napi);
 	return 0;
 
 error:
@@ -362,7 +594,12 @@ static int chnl_net_stop(struct net_device *dev)
 	ASSERT_RTNL();
 	priv = netdev_priv(dev);
 	priv->state = CAIF_DISCONNECTED;
+	priv->reattach = false;
 	caif_disconnect_client(dev_net(dev), &priv->chnl);
+
+	napi_disable(&priv->napi);
+	skb_queue_purge(&priv->rx_queue);
+	priv->rx_flow_off = false;
 	return 0;
 }
 
@@ -395,6 +632,7 @@ static void chnl_net_destructor(struct net_device *dev)
 {
 	struct chnl_net *priv = netdev_priv(dev);
 	caif_free_client(&priv->chnl);
+	skb_queue_purge(&priv->rx_queue);
 	free_netdev(dev);
 }
 
@@ -410,6 +648,7 @@ static void ipcaif_net_setup(struct net_device *dev)
 
 	priv = netdev_priv(dev);
 	priv->chnl.receive = chnl_recv_cb;
+	priv->chnl.receive_list = chnl_recv_list_cb;
 	priv->chnl.ctrlcmd = chnl_flowctrl_cb;
 	priv->netdev = dev;
 	priv->conn_req.protocol = CAIFPROTO_DATAGRAM;
@@ -419,6 +658,9 @@ static void ipcaif_net_setup(struct net_device *dev)
 	priv->conn_req.sockaddr.u.dgm.connection_id = UNDEF_CONNID;
 	priv->flowenabled = false;
 
+	skb_queue_head_init(&priv->rx_queue);
+	netif_napi_add(dev, &priv->napi, chnl_net_poll, napi_weight);
+
 	init_waitqueue_head(&priv->netmgmt_wq);
 }
 
@@ -510,6 +752,17 @@ static size_t ipcaif_get_size(const struct net_device *dev)
 		0;
 }
 
+/*
+ * A channel's packets go down the CAIF stack from whichever CPU sends them,
+ * without any serialization, so give each CPU a TX queue of its own (up to
+ * CAIF_NET_MAX_TX_QUEUES, unless set otherwise upon creation), for XPS to
+ * steer transmissions with. Channel flow control applies to all queues.
+ */
+static unsigned int chnl_net_num_tx_queues(void)
+{
+	return min_t(unsigned int, num_online_cpus(), CAIF_NET_MAX_TX_QUEUES);
+}
+
 static const struct nla_policy ipcaif_policy[IFLA_CAIF_MAX + 1] = {
 	[IFLA_CAIF_IPV4_CONNID]	      = { .type = NLA_U32 },
 	[IFLA_CAIF_IPV6_CONNID]	      = { .type = NLA_U32 },
@@ -527,12 +780,47 @@ static struct rtnl_link_ops ipcaif_link_ops __read_mostly = {
 	.changelink	= ipcaif_changelink,
 	.get_size	= ipcaif_get_size,
 	.fill_info	= ipcaif_fill_info,
+	.get_num_tx_queues = chnl_net_num_tx_queues,
 
 };
 
+/* reconnect the channels waiting for their link layer device to be back */
+static int chnl_net_device_notify(struct notifier_block *me,
+				  unsigned long what, void *arg)
+{
+	struct net_device *dev = arg;
+
+	if (dev->type != ARPHRD_CAIF)
+		return NOTIFY_DONE;
+
+	switch (what) {
+	case NETDEV_CHANGE:
+	case NETDEV_DOWN:
+	case NETDEV_UNREGISTER:
+		schedule_work(&reattach_worker);
+		break;
+	}
+
+	return NOTIFY_DONE;
+}
+
+static struct notifier_block chnl_net_device_notifier = {
+	.notifier_call = chnl_net_device_notify,
+};
+
 static int __init chnl_init_module(void)
 {
-	return rtnl_link_register(&ipcaif_link_ops);
+	int err;
+
+	err = register_netdevice_notifier(&chnl_net_device_notifier);
+	if (err)
+		return err;
+
+	err = rtnl_link_register(&ipcaif_link_ops);
+	if (err)
+		unregister_netdevice_notifier(&chnl_net_device_notifier);
+
+	return err;
 }
 
 static void __exit chnl_exit_module(void)
@@ -540,6 +828,8 @@ static void __exit chnl_exit_module(void)
 	struct chnl_net *dev = NULL;
 	struct list_head *list_node;
 	struct list_head *_tmp;
+	unregister_netdevice_notifier(&chnl_net_device_notifier);
+	cancel_work_sync(&reattach_worker);
 	rtnl_link_unregister(&ipcaif_link_ops);
 	rtnl_lock();
 	list_for_each_safe(list_node, _tmp, &chnl_net_list) {
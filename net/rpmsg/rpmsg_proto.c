@@ -0,0 +1,576 @@
+/*
+ * AF_RPMSG: remote processor messaging sockets
+ *
+ * Every "rpmsg-proto" channel announced by a remote processor is given a
+ * vproc_id, and user space can then bind()/connect() datagram sockets to
+ * rpmsg addresses of that remote processor. Each socket is backed by its
+ * own rpmsg endpoint, so the usual socket machinery (poll/epoll,
+ * sendmmsg/recvmmsg, ...) works on rpmsg traffic too.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#define pr_fmt(fmt) "%s: " fmt, __func__
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/idr.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/skbuff.h>
+#include <linux/rpmsg.h>
+#include <linux/rpmsg_socket.h>
+#include <net/sock.h>
+#include <net/tcp_states.h>
+
+/* no rpmsg buffer can carry a bigger payload than that */
+#define RPMSG_SOCK_MAX_MSG	(64 * 1024)
+
+/*
+ * states of an rpmsg socket. These are kept apart from sk_state, which
+ * the generic datagram code expects to hold TCP_* values: it's
+ * TCP_ESTABLISHED while the socket is attached to a channel, and
+ * TCP_CLOSE otherwise.
+ */
+enum {
+	RPMSG_OPEN = 1,
+	RPMSG_BOUND,
+	RPMSG_CONNECTED,
+	RPMSG_ERROR,
+};
+
+/**
+ * struct rpmsg_proto_chan - an "rpmsg-proto" channel
+ * @rpdev: the rpmsg channel
+ * @id: the vproc_id user space uses to refer to this channel
+ * @socks: the sockets currently attached to this channel
+ */
+struct rpmsg_proto_chan {
+	struct rpmsg_channel *rpdev;
+	int id;
+	struct list_head socks;
+};
+
+/**
+ * struct rpmsg_socket - an rpmsg socket
+ * @sk: the socket
+ * @chan: the channel this socket is attached to, if any
+ * @ept: the endpoint backing this socket, if it is attached to a channel
+ * @vproc_id: the vproc_id of @chan (kept after @chan is gone)
+ * @dst: the remote address, if connected
+ * @state: the rpmsg state of the socket (RPMSG_OPEN, RPMSG_BOUND, ...)
+ * @node: linked into @chan's sockets list
+ *
+ * @chan and @ept are protected by both rpmsg_proto_lock and the socket lock,
+ * so holding either of them is enough to use them.
+ */
+struct rpmsg_socket {
+	struct sock sk;
+	struct rpmsg_proto_chan *chan;
+	struct rpmsg_endpoint *ept;
+	u32 vproc_id;
+	u32 dst;
+	int state;
+	struct list_head node;
+};
+
+#define rpmsg_sk(__sk) container_of(__sk, struct rpmsg_socket, sk)
+
+/* the source address of an incoming message */
+#define RPMSG_CB(skb)	(*(u32 *)&((skb)->cb))
+
+/* channels, indexed by vproc_id */
+static DEFINE_IDR(rpmsg_proto_chans);
+/* protects the channels idr, their sockets lists, and sockets' chan/ept */
+static DEFINE_MUTEX(rpmsg_proto_lock);
+
+static struct proto rpmsg_proto = {
+	.name		= "RPMSG",
+	.owner		= THIS_MODULE,
+	.obj_size	= sizeof(struct rpmsg_socket),
+};
+
+/* queue an incoming message until user space reads it */
+static void rpmsg_sock_cb(struct rpmsg_channel *rpdev, void *data, int len,
+							void *priv, u32 src)
+{
+	struct sock *sk = priv;
+	struct sk_buff *skb;
+
+	skb = alloc_skb(len, GFP_ATOMIC);
+	if (!skb) {
+		dev_err_ratelimited(&rpdev->dev, "dropping a %d bytes msg\n",
+									len);
+		return;
+	}
+
+	memcpy(skb_put(skb, len), data, len);
+	RPMSG_CB(skb) = src;
+
+	/* this takes care of the socket's rx memory accounting */
+	if (sock_queue_rcv_skb(sk, skb))
+		kfree_skb(skb);
+}
+
+/* attach an open socket to a channel; called with the socket lock held */
+static int rpmsg_sock_attach(struct sock *sk, u32 vproc_id, u32 src, u32 dst,
+								int state)
+{
+	struct rpmsg_socket *rsk = rpmsg_sk(sk);
+	struct rpmsg_proto_chan *chan;
+	struct rpmsg_endpoint *ept;
+
+	chan = idr_find(&rpmsg_proto_chans, vproc_id);
+	if (!chan)
+		return -ENODEV;
+
+	ept = rpmsg_create_ept(chan->rpdev, rpmsg_sock_cb, sk, src);
+	if (!ept)
+		return src == RPMSG_ADDR_ANY ? -ENOMEM : -EADDRINUSE;
+
+	rsk->chan = chan;
+	rsk->ept = ept;
+	rsk->vproc_id = vproc_id;
+	rsk->dst = dst;
+	list_add_tail(&rsk->node, &chan->socks);
+
+	rsk->state = state;
+	sk->sk_state = TCP_ESTABLISHED;
+
+	return 0;
+}
+
+/*
+ * detach a socket from its channel, if any; called with both
+ * rpmsg_proto_lock and the socket lock held
+ */
+static void rpmsg_sock_detach(struct sock *sk)
+{
+	struct rpmsg_socket *rsk = rpmsg_sk(sk);
+
+	if (!rsk->chan)
+		return;
+
+	rpmsg_destroy_ept(rsk->ept);
+	list_del(&rsk->node);
+	rsk->ept = NULL;
+	rsk->chan = NULL;
+}
+
+static int rpmsg_sock_release(struct socket *sock)
+{
+	struct sock *sk = sock->sk;
+
+	if (!sk)
+		return 0;
+
+	mutex_lock(&rpmsg_proto_lock);
+	lock_sock(sk);
+	rpmsg_sock_detach(sk);
+	sock_orphan(sk);
+	release_sock(sk);
+	mutex_unlock(&rpmsg_proto_lock);
+
+	skb_queue_purge(&sk->sk_receive_queue);
+
+	sock->sk = NULL;
+	sock_put(sk);
+
+	return 0;
+}
+
+static int rpmsg_sock_bind(struct socket *sock, struct sockaddr *uaddr,
+								int len)
+{
+	struct sockaddr_rpmsg *sa = (struct sockaddr_rpmsg *)uaddr;
+	struct sock *sk = sock->sk;
+	int ret;
+
+	if (len < sizeof(*sa) || sa->family != AF_RPMSG)
+		return -EINVAL;
+
+	mutex_lock(&rpmsg_proto_lock);
+	lock_sock(sk);
+
+	if (rpmsg_sk(sk)->state != RPMSG_OPEN) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	ret = rpmsg_sock_attach(sk, sa->vproc_id, sa->addr, RPMSG_ADDR_ANY,
+								RPMSG_BOUND);
+
+out:
+	release_sock(sk);
+	mutex_unlock(&rpmsg_proto_lock);
+	return ret;
+}
+
+static int rpmsg_sock_connect(struct socket *sock, struct sockaddr *uaddr,
+							int len, int flags)
+{
+	struct sockaddr_rpmsg *sa = (struct sockaddr_rpmsg *)uaddr;
+	struct sock *sk = sock->sk;
+	struct rpmsg_socket *rsk = rpmsg_sk(sk);
+	int ret = 0;
+
+	if (len < sizeof(*sa) || sa->family != AF_RPMSG)
+		return -EINVAL;
+
+	mutex_lock(&rpmsg_proto_lock);
+	lock_sock(sk);
+
+	switch (rsk->state) {
+	case RPMSG_OPEN:
+		/* let the bus pick a local address */
+		ret = rpmsg_sock_attach(sk, sa->vproc_id, RPMSG_ADDR_ANY,
+						sa->addr, RPMSG_CONNECTED);
+		break;
+	case RPMSG_BOUND:
+	case RPMSG_CONNECTED:
+		/* keep our local address, just (re)set the remote one */
+		if (sa->vproc_id != rsk->vproc_id) {
+			ret = -EINVAL;
+			break;
+		}
+		rsk->dst = sa->addr;
+		rsk->state = RPMSG_CONNECTED;
+		break;
+	default:
+		ret = -ENOLINK;
+		break;
+	}
+
+	if (!ret)
+		sock->state = SS_CONNECTED;
+
+	release_sock(sk);
+	mutex_unlock(&rpmsg_proto_lock);
+	return ret;
+}
+
+static int rpmsg_sock_getname(struct socket *sock, struct sockaddr *uaddr,
+							int *len, int peer)
+{
+	struct sockaddr_rpmsg *sa = (struct sockaddr_rpmsg *)uaddr;
+	struct sock *sk = sock->sk;
+	struct rpmsg_socket *rsk = rpmsg_sk(sk);
+	int ret = 0;
+
+	lock_sock(sk);
+
+	memset(sa, 0, sizeof(*sa));
+	sa->family = AF_RPMSG;
+	sa->vproc_id = rsk->vproc_id;
+
+	if (peer) {
+		if (rsk->state != RPMSG_CONNECTED)
+			ret = -ENOTCONN;
+		sa->addr = rsk->dst;
+	} else {
+		sa->addr = rsk->ept ? rsk->ept->addr : RPMSG_SOCK_ADDR_ANY;
+	}
+
+	release_sock(sk);
+
+	*len = sizeof(*sa);
+
+	return ret;
+}
+
+static int rpmsg_sock_sendmsg(struct kiocb *iocb, struct socket *sock,
+					struct msghdr *msg, size_t len)
+{
+	struct sockaddr_rpmsg *sa = msg->msg_name;
+	struct sock *sk = sock->sk;
+	struct rpmsg_socket *rsk = rpmsg_sk(sk);
+	bool noblock = msg->msg_flags & MSG_DONTWAIT;
+	void *buf;
+	u32 dst;
+	int ret;
+
+	if (msg->msg_flags & MSG_OOB)
+		return -EOPNOTSUPP;
+
+	if (len > RPMSG_SOCK_MAX_MSG)
+		return -EMSGSIZE;
+
+	buf = kmalloc(len, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	ret = memcpy_fromiovec(buf, msg->msg_iov, len);
+	if (ret)
+		goto free_buf;
+
+	lock_sock(sk);
+
+	if (!rsk->ept) {
+		ret = rsk->state == RPMSG_ERROR ? -ENOLINK : -ENOTCONN;
+		goto unlock;
+	}
+
+	if (sa) {
+		if (msg->msg_namelen < sizeof(*sa) || sa->family != AF_RPMSG ||
+					sa->vproc_id != rsk->vproc_id) {
+			ret = -EINVAL;
+			goto unlock;
+		}
+		dst = sa->addr;
+	} else if (rsk->state == RPMSG_CONNECTED) {
+		dst = rsk->dst;
+	} else {
+		ret = -EDESTADDRREQ;
+		goto unlock;
+	}
+
+	if (noblock)
+		ret = rpmsg_trysend_offchannel(rsk->chan->rpdev, rsk->ept->addr,
+							dst, buf, len);
+	else
+		ret = rpmsg_send_offchannel(rsk->chan->rpdev, rsk->ept->addr,
+							dst, buf, len);
+
+unlock:
+	release_sock(sk);
+free_buf:
+	kfree(buf);
+	return ret ? ret : len;
+}
+
+static int rpmsg_sock_recvmsg(struct kiocb *iocb, struct socket *sock,
+				struct msghdr *msg, size_t len, int flags)
+{
+	struct sockaddr_rpmsg *sa = msg->msg_name;
+	struct sock *sk = sock->sk;
+	struct sk_buff *skb;
+	int copied, ret;
+
+	if (flags & MSG_OOB)
+		return -EOPNOTSUPP;
+
+	msg->msg_namelen = 0;
+
+	skb = skb_recv_datagram(sk, flags, flags & MSG_DONTWAIT, &ret);
+	if (!skb)
+		return ret;
+
+	copied = skb->len;
+	if (len < copied) {
+		msg->msg_flags |= MSG_TRUNC;
+		copied = len;
+	}
+
+	ret = skb_copy_datagram_iovec(skb, 0, msg->msg_iov, copied);
+	if (ret)
+		goto out;
+
+	if (sa) {
+		memset(sa, 0, sizeof(*sa));
+		sa->family = AF_RPMSG;
+		sa->vproc_id = rpmsg_sk(sk)->vproc_id;
+		sa->addr = RPMSG_CB(skb);
+		msg->msg_namelen = sizeof(*sa);
+	}
+
+	if (flags & MSG_TRUNC)
+		copied = skb->len;
+
+out:
+	skb_free_datagram(sk, skb);
+	return ret ? ret : copied;
+}
+
+static const struct proto_ops rpmsg_sock_ops = {
+	.family		= PF_RPMSG,
+	.owner		= THIS_MODULE,
+	.release	= rpmsg_sock_release,
+	.bind		= rpmsg_sock_bind,
+	.connect	= rpmsg_sock_connect,
+	.socketpair	= sock_no_socketpair,
+	.accept		= sock_no_accept,
+	.getname	= rpmsg_sock_getname,
+	.poll		= datagram_poll,
+	.ioctl		= sock_no_ioctl,
+	.listen		= sock_no_listen,
+	.shutdown	= sock_no_shutdown,
+	.setsockopt	= sock_no_setsockopt,
+	.getsockopt	= sock_no_getsockopt,
+	.sendmsg	= rpmsg_sock_sendmsg,
+	.recvmsg	= rpmsg_sock_recvmsg,
+	.mmap		= sock_no_mmap,
+	.sendpage	= sock_no_sendpage,
+};
+
+static int rpmsg_sock_create(struct net *net, struct socket *sock,
+							int protocol, int kern)
+{
+	struct sock *sk;
+
+	if (sock->type != SOCK_SEQPACKET && sock->type != SOCK_DGRAM)
+		return -ESOCKTNOSUPPORT;
+
+	if (protocol)
+		return -EPROTONOSUPPORT;
+
+	sk = sk_alloc(net, PF_RPMSG, GFP_KERNEL, &rpmsg_proto);
+	if (!sk)
+		return -ENOMEM;
+
+	sock->ops = &rpmsg_sock_ops;
+	sock->state = SS_UNCONNECTED;
+
+	/* this also sets sk_state to TCP_CLOSE, until the socket is attached */
+	sock_init_data(sock, sk);
+
+	rpmsg_sk(sk)->state = RPMSG_OPEN;
+	rpmsg_sk(sk)->vproc_id = RPMSG_SOCK_ADDR_ANY;
+
+	return 0;
+}
+
+static const struct net_proto_family rpmsg_proto_family = {
+	.family	= PF_RPMSG,
+	.create	= rpmsg_sock_create,
+	.owner	= THIS_MODULE,
+};
+
+/* nothing is expected on the channel's own address */
+static void rpmsg_proto_cb(struct rpmsg_channel *rpdev, void *data, int len,
+							void *priv, u32 src)
+{
+	dev_warn_ratelimited(&rpdev->dev, "unexpected msg from 0x%x\n", src);
+}
+
+static int rpmsg_proto_probe(struct rpmsg_channel *rpdev)
+{
+	struct rpmsg_proto_chan *chan;
+	int ret;
+
+	chan = kzalloc(sizeof(*chan), GFP_KERNEL);
+	if (!chan)
+		return -ENOMEM;
+
+	chan->rpdev = rpdev;
+	INIT_LIST_HEAD(&chan->socks);
+
+	if (!idr_pre_get(&rpmsg_proto_chans, GFP_KERNEL)) {
+		ret = -ENOMEM;
+		goto free_chan;
+	}
+
+	mutex_lock(&rpmsg_proto_lock);
+	ret = idr_get_new(&rpmsg_proto_chans, chan, &chan->id);
+	mutex_unlock(&rpmsg_proto_lock);
+	if (ret) {
+		dev_err(&rpdev->dev, "idr_get_new failed: %d\n", ret);
+		goto free_chan;
+	}
+
+	dev_set_drvdata(&rpdev->dev, chan);
+
+	dev_info(&rpdev->dev, "new rpmsg sockets channel: vproc_id %d\n",
+								chan->id);
+
+	return 0;
+
+free_chan:
+	kfree(chan);
+	return ret;
+}
+
+static void __devexit rpmsg_proto_remove(struct rpmsg_channel *rpdev)
+{
+	struct rpmsg_proto_chan *chan = dev_get_drvdata(&rpdev->dev);
+	struct rpmsg_socket *rsk, *tmp;
+
+	mutex_lock(&rpmsg_proto_lock);
+
+	/* the remote processor is gone: let the sockets' users know */
+	list_for_each_entry_safe(rsk, tmp, &chan->socks, node) {
+		struct sock *sk = &rsk->sk;
+
+		lock_sock(sk);
+		rpmsg_sock_detach(sk);
+		rsk->state = RPMSG_ERROR;
+		sk->sk_state = TCP_CLOSE;
+		sk->sk_shutdown = SHUTDOWN_MASK;
+		sk->sk_err = ENOLINK;
+		sk->sk_error_report(sk);
+		release_sock(sk);
+	}
+
+	idr_remove(&rpmsg_proto_chans, chan->id);
+
+	mutex_unlock(&rpmsg_proto_lock);
+
+	kfree(chan);
+}
+
+static struct rpmsg_device_id rpmsg_proto_id_table[] = {
+	{ .name	= "rpmsg-proto" },
+	{ },
+};
+MODULE_DEVICE_TABLE(rpmsg, rpmsg_proto_id_table);
+
+static struct rpmsg_driver rpmsg_proto_driver = {
+	.drv.name	= KBUILD_MODNAME,
+	.drv.owner	= THIS_MODULE,
+	.id_table	= rpmsg_proto_id_table,
+	.probe		= rpmsg_proto_probe,
+	.callback	= rpmsg_proto_cb,
+	.remove		= __devexit_p(rpmsg_proto_remove),
+};
+
+static int __init rpmsg_proto_init(void)
+{
+	int ret;
+
+	ret = proto_register(&rpmsg_proto, 0);
+	if (ret) {
+		pr_err("proto_register failed: %d\n", ret);
+		return ret;
+	}
+
+	ret = sock_register(&rpmsg_proto_family);
+	if (ret) {
+		pr_err("sock_register failed: %d\n", ret);
+		goto proto_unreg;
+	}
+
+	ret = register_rpmsg_driver(&rpmsg_proto_driver);
+	if (ret) {
+		pr_err("register_rpmsg_driver failed: %d\n", ret);
+		goto sock_unreg;
+	}
+
+	return 0;
+
+sock_unreg:
+	sock_unregister(PF_RPMSG);
+proto_unreg:
+	proto_unregister(&rpmsg_proto);
+	return ret;
+}
+module_init(rpmsg_proto_init);
+
+static void __exit rpmsg_proto_exit(void)
+{
+	unregister_rpmsg_driver(&rpmsg_proto_driver);
+	sock_unregister(PF_RPMSG);
+	proto_unregister(&rpmsg_proto);
+	idr_destroy(&rpmsg_proto_chans);
+}
+module_exit(rpmsg_proto_exit);
+
+MODULE_DESCRIPTION("Remote processor messaging sockets");
+MODULE_LICENSE("GPL v2");
+MODULE_ALIAS_NETPROTO(AF_RPMSG);
@@ -0,0 +1,632 @@
+/*
+ * Remote processor messaging - benchmark driver
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * This driver binds to "rpmsg-bench" channels, and measures the latency
+ * and the throughput of rpmsg, between the host and the remote side of
+ * the channel.
+ *
+ * Every message it sends starts with a struct rpmsg_bench_hdr, and is
+ * padded to the size being measured. The remote side must send the
+ * messages which have RPMSG_BENCH_ECHO set back to their source address,
+ * as they are (except for @remote_ts, see below), and just drop the other
+ * ones. Remote sides which stamp the messages they echo, with the time
+ * they got them, in ticks of their remoteproc trace clock (see
+ * rproc_ops->trace_clock()), let the one-way latencies be measured too.
+ * The simulated remote processor (see drivers/remoteproc/sim_remoteproc.c)
+ * does all that, which lets rpmsg be benchmarked without any hardware.
+ *
+ * A benchmark is run by writing its parameters to the "run" debugfs entry
+ * of the channel (in rpmsg_bench/, under debugfs):
+ *
+ *   <mode> <size> <count> [<endpoints> [<threads>]]
+ *
+ * where <mode> is either "rtt" (every thread sends <count> messages of
+ * <size> bytes, waiting for each one to be echoed before it sends the
+ * next one) or "stream" (every thread sends <count> messages back to
+ * back, and only the last one is echoed, to tell when they all went
+ * through). The threads spread over <endpoints> endpoints, which are
+ * created for the run. The write returns once the run is over, and its
+ * results are then shown by reading the entry.
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/rpmsg.h>
+#include <linux/remoteproc.h>
+#include <linux/virtio.h>
+#include <linux/debugfs.h>
+#include <linux/kthread.h>
+#include <linux/completion.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/sort.h>
+#include <linux/sched.h>
+#include <linux/ktime.h>
+#include <linux/uaccess.h>
+
+/* the message is to be echoed back to its source */
+#define RPMSG_BENCH_ECHO	(1 << 0)
+
+/**
+ * struct rpmsg_bench_hdr - header of the benchmark messages
+ * @seq: sequence number of the message, in its thread
+ * @thread: index of the thread which sent the message
+ * @flags: RPMSG_BENCH_ECHO, or zero
+ * @remote_ts: when the remote side got the message, in ticks of its trace
+ *	       clock, as it echoes it (zero if it doesn't stamp messages)
+ */
+struct rpmsg_bench_hdr {
+	u32 seq;
+	u16 thread;
+	u16 flags;
+	u64 remote_ts;
+} __packed;
+
+#define RPMSG_BENCH_MAX_SIZE		4096
+#define RPMSG_BENCH_MAX_COUNT		1000000
+#define RPMSG_BENCH_MAX_EPTS		16
+#define RPMSG_BENCH_MAX_THREADS		64
+/* most latencies a single run may record, of each kind */
+#define RPMSG_BENCH_MAX_SAMPLES		(1 << 22)
+/* how long (in msecs) an echo may take before the run is given up */
+#define RPMSG_BENCH_TIMEOUT_MS		5000
+
+enum rpmsg_bench_mode {
+	RPMSG_BENCH_RTT,
+	RPMSG_BENCH_STREAM,
+};
+
+struct rpmsg_bench;
+
+/**
+ * struct rpmsg_bench_thread - a sending thread of a benchmark run
+ * @bench: the benchmark
+ * @index: index of the thread
+ * @ept: the endpoint the thread sends from
+ * @task: the thread itself
+ * @buf: the message the thread sends
+ * @seq: sequence number of the echo the thread waits for
+ * @echoed: completed when that echo comes back
+ * @echo_ns: when the echo came back, in sched_clock() nsecs
+ * @echo_ktime: when the echo came back
+ * @remote_ts: the remote side's stamp of the echoed message
+ * @rtt: round-trip latencies, in nsecs
+ * @tx: host to remote latencies, in nsecs
+ * @rx: remote to host latencies, in nsecs
+ * @nrtt: number of entries in @rtt
+ * @noneway: number of entries in @tx and @rx
+ * @ret: how the thread's run went
+ */
+struct rpmsg_bench_thread {
+	struct rpmsg_bench *bench;
+	int index;
+	struct rpmsg_endpoint *ept;
+	struct task_struct *task;
+	struct rpmsg_bench_hdr *buf;
+	u32 seq;
+	struct completion echoed;
+	u64 echo_ns;
+	ktime_t echo_ktime;
+	u64 remote_ts;
+	u32 *rtt, *tx, *rx;
+	unsigned int nrtt, noneway;
+	int ret;
+};
+
+/**
+ * struct rpmsg_bench - the benchmark state of a channel
+ * @rpdev: the channel
+ * @rproc: the remote processor of the channel
+ * @dbg_dir: the debugfs directory of the channel
+ * @lock: serializes the runs, and protects @results
+ * @mode: the mode of the current run
+ * @size: size of the messages of the current run
+ * @count: number of messages each thread sends in the current run
+ * @nepts: number of endpoints of the current run
+ * @epts: the endpoints of the current run
+ * @nthreads: number of threads of the current run
+ * @threads: the threads of the current run
+ * @start: completed once all the threads of the current run are ready
+ * @running: number of threads of the current run which aren't done yet
+ * @done: completed once they're all done
+ * @results: what the last run measured, as text
+ */
+struct rpmsg_bench {
+	struct rpmsg_channel *rpdev;
+	struct rproc *rproc;
+	struct dentry *dbg_dir;
+	struct mutex lock;
+	enum rpmsg_bench_mode mode;
+	unsigned int size;
+	unsigned int count;
+	unsigned int nepts;
+	struct rpmsg_endpoint *epts[RPMSG_BENCH_MAX_EPTS];
+	unsigned int nthreads;
+	struct rpmsg_bench_thread *threads;
+	struct completion start;
+	atomic_t running;
+	struct completion done;
+	char results[1024];
+};
+
+static struct dentry *rpmsg_bench_dbg;
+
+/* the echoes come back here, right from the rx path */
+static void rpmsg_bench_cb(struct rpmsg_channel *rpdev, void *data, int len,
+						void *priv, u32 src)
+{
+	struct rpmsg_bench *bench = priv;
+	struct rpmsg_bench_hdr *hdr = data;
+	struct rpmsg_bench_thread *t;
+	u64 now = sched_clock();
+	ktime_t know = ktime_get();
+
+	if (len < sizeof(*hdr) || hdr->thread >= bench->nthreads)
+		return;
+
+	t = &bench->threads[hdr->thread];
+	if (hdr->seq != ACCESS_ONCE(t->seq))
+		return;
+
+	t->echo_ns = now;
+	t->echo_ktime = know;
+	t->remote_ts = hdr->remote_ts;
+	complete(&t->echoed);
+}
+
+/* send a message, and wait for its echo, if it's to be echoed */
+static int rpmsg_bench_send(struct rpmsg_bench_thread *t, u16 flags)
+{
+	struct rpmsg_bench *bench = t->bench;
+	unsigned long timeout = msecs_to_jiffies(RPMSG_BENCH_TIMEOUT_MS);
+	struct rpmsg_channel *rpdev = bench->rpdev;
+	ktime_t sent;
+	u64 sent_ns, at;
+	int ret;
+
+	t->buf->seq = ++t->seq;
+	t->buf->flags = flags;
+	t->buf->remote_ts = 0;
+
+	if (flags & RPMSG_BENCH_ECHO)
+		INIT_COMPLETION(t->echoed);
+
+	sent_ns = sched_clock();
+	sent = ktime_get();
+
+	ret = rpmsg_send_offchannel(rpdev, t->ept->addr, rpdev->dst, t->buf,
+								bench->size);
+	if (ret) {
+		dev_err(&rpdev->dev, "rpmsg_send failed: %d\n", ret);
+		return ret;
+	}
+
+	if (!(flags & RPMSG_BENCH_ECHO))
+		return 0;
+
+	if (!wait_for_completion_timeout(&t->echoed, timeout)) {
+		dev_err(&rpdev->dev, "message %u of thread %d wasn't echoed\n",
+							t->seq, t->index);
+		return -ETIMEDOUT;
+	}
+
+	if (bench->mode != RPMSG_BENCH_RTT)
+		return 0;
+
+	t->rtt[t->nrtt++] = ktime_to_ns(ktime_sub(t->echo_ktime, sent));
+
+	/* the one-way latencies need the remote side's stamps */
+	at = t->remote_ts ? rproc_trace_clock_to_host(bench->rproc,
+							t->remote_ts) : 0;
+	if (at > sent_ns && at < t->echo_ns) {
+		t->tx[t->noneway] = at - sent_ns;
+		t->rx[t->noneway] = t->echo_ns - at;
+		t->noneway++;
+	}
+
+	return 0;
+}
+
+static int rpmsg_bench_thread_fn(void *data)
+{
+	struct rpmsg_bench_thread *t = data;
+	struct rpmsg_bench *bench = t->bench;
+	unsigned int i;
+	u16 flags;
+	int ret = 0;
+
+	wait_for_completion(&bench->start);
+
+	for (i = 0; i < bench->count; i++) {
+		/* streams are only echoed at their end */
+		flags = bench->mode == RPMSG_BENCH_RTT ||
+				i == bench->count - 1 ? RPMSG_BENCH_ECHO : 0;
+
+		ret = rpmsg_bench_send(t, flags);
+		if (ret)
+			break;
+	}
+
+	t->ret = ret;
+	if (atomic_dec_and_test(&bench->running))
+		complete(&bench->done);
+
+	return 0;
+}
+
+static int rpmsg_bench_cmp(const void *a, const void *b)
+{
+	u32 x = *(const u32 *)a, y = *(const u32 *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* gather the latencies of all the threads, and sum them up into the results */
+static int rpmsg_bench_latency(struct rpmsg_bench *bench, const char *name,
+				size_t off, bool oneway, char *buf, int len)
+{
+	struct rpmsg_bench_thread *t;
+	unsigned int n = 0, i;
+	u64 sum = 0;
+	u32 *lat;
+
+	for (i = 0; i < bench->nthreads; i++) {
+		t = &bench->threads[i];
+		n += oneway ? t->noneway : t->nrtt;
+	}
+
+	if (!n)
+		return 0;
+
+	lat = vmalloc(n * sizeof(*lat));
+	if (!lat)
+		return scnprintf(buf, len, "%s: out of memory\n", name);
+
+	for (n = 0, i = 0; i < bench->nthreads; i++) {
+		t = &bench->threads[i];
+		memcpy(lat + n, *(u32 **)((void *)t + off),
+			(oneway ? t->noneway : t->nrtt) * sizeof(*lat));
+		n += oneway ? t->noneway : t->nrtt;
+	}
+
+	sort(lat, n, sizeof(*lat), rpmsg_bench_cmp, NULL);
+
+	for (i = 0; i < n; i++)
+		sum += lat[i];
+
+	len = scnprintf(buf, len,
+		"%s ns: min %u avg %llu p50 %u p99 %u max %u (%u samples)\n",
+		name, lat[0], div_u64(sum, n),
+		lat[DIV_ROUND_UP(n * 50, 100) - 1],
+		lat[DIV_ROUND_UP(n * 99, 100) - 1], lat[n - 1], n);
+
+	vfree(lat);
+	return len;
+}
+
+/* sum the run up into bench->results */
+static void rpmsg_bench_report(struct rpmsg_bench *bench, s64 elapsed_ns)
+{
+	char *buf = bench->results;
+	int len = sizeof(bench->results), i;
+	u64 msgs = (u64)bench->count * bench->nthreads;
+	u64 us = max_t(u64, div_u64(elapsed_ns, NSEC_PER_USEC), 1);
+
+	i = scnprintf(buf, len, "mode: %s size: %u count: %u endpoints: %u "
+			"threads: %u\n",
+			bench->mode == RPMSG_BENCH_RTT ? "rtt" : "stream",
+			bench->size, bench->count, bench->nepts,
+			bench->nthreads);
+
+	i += scnprintf(buf + i, len - i, "elapsed: %llu us, %llu msgs/s, "
+			"%llu KB/s\n", us, div64_u64(msgs * USEC_PER_SEC, us),
+			div64_u64(msgs * bench->size * USEC_PER_SEC, us) >> 10);
+
+	if (bench->mode != RPMSG_BENCH_RTT)
+		return;
+
+	i += rpmsg_bench_latency(bench, "rtt",
+			offsetof(struct rpmsg_bench_thread, rtt), false,
+			buf + i, len - i);
+	i += rpmsg_bench_latency(bench, "tx",
+			offsetof(struct rpmsg_bench_thread, tx), true,
+			buf + i, len - i);
+	rpmsg_bench_latency(bench, "rx",
+			offsetof(struct rpmsg_bench_thread, rx), true,
+			buf + i, len - i);
+}
+
+static void rpmsg_bench_free_threads(struct rpmsg_bench *bench)
+{
+	struct rpmsg_bench_thread *t;
+	unsigned int i;
+
+	for (i = 0; i < bench->nthreads; i++) {
+		t = &bench->threads[i];
+		kfree(t->buf);
+		vfree(t->rtt);
+		vfree(t->tx);
+		vfree(t->rx);
+	}
+
+	for (i = 0; i < bench->nepts; i++)
+		rpmsg_destroy_ept(bench->epts[i]);
+
+	kfree(bench->threads);
+	bench->threads = NULL;
+	bench->nthreads = 0;
+	bench->nepts = 0;
+}
+
+/* run a benchmark, with the parameters that were set in @bench */
+static int rpmsg_bench_run(struct rpmsg_bench *bench, unsigned int nepts,
+						unsigned int nthreads)
+{
+	struct device *dev = &bench->rpdev->dev;
+	struct rpmsg_bench_thread *t;
+	size_t samples = bench->mode == RPMSG_BENCH_RTT ?
+					bench->count * sizeof(u32) : 0;
+	unsigned int i, started = 0;
+	ktime_t begin;
+	int ret = 0;
+
+	bench->threads = kcalloc(nthreads, sizeof(*t), GFP_KERNEL);
+	if (!bench->threads)
+		return -ENOMEM;
+
+	for (i = 0; i < nepts; i++) {
+		bench->epts[i] = rpmsg_create_atomic_ept(bench->rpdev,
+				rpmsg_bench_cb, bench, RPMSG_ADDR_ANY);
+		if (!bench->epts[i]) {
+			dev_err(dev, "rpmsg_create_atomic_ept failed\n");
+			ret = -ENOMEM;
+			goto free;
+		}
+		bench->nepts++;
+	}
+
+	init_completion(&bench->start);
+	init_completion(&bench->done);
+
+	for (i = 0; i < nthreads; i++) {
+		t = &bench->threads[i];
+		t->bench = bench;
+		t->index = i;
+		t->ept = bench->epts[i % nepts];
+		init_completion(&t->echoed);
+		bench->nthreads++;
+
+		t->buf = kzalloc(bench->size, GFP_KERNEL);
+		if (!t->buf) {
+			ret = -ENOMEM;
+			goto free;
+		}
+		t->buf->thread = i;
+
+		if (samples) {
+			t->rtt = vmalloc(samples);
+			t->tx = vmalloc(samples);
+			t->rx = vmalloc(samples);
+			if (!t->rtt || !t->tx || !t->rx) {
+				ret = -ENOMEM;
+				goto free;
+			}
+		}
+	}
+
+	atomic_set(&bench->running, nthreads);
+
+	for (i = 0; i < nthreads; i++) {
+		t = &bench->threads[i];
+		t->task = kthread_run(rpmsg_bench_thread_fn, t,
+							"rpmsg_bench/%u", i);
+		if (IS_ERR(t->task)) {
+			ret = PTR_ERR(t->task);
+			dev_err(dev, "kthread_run failed: %d\n", ret);
+			break;
+		}
+		started++;
+	}
+
+	/* the threads that didn't start are done */
+	for (i = started; i < nthreads; i++)
+		if (atomic_dec_and_test(&bench->running))
+			complete(&bench->done);
+
+	begin = ktime_get();
+	complete_all(&bench->start);
+	wait_for_completion(&bench->done);
+
+	if (ret)
+		goto free;
+
+	for (i = 0; i < nthreads; i++) {
+		if (bench->threads[i].ret) {
+			ret = bench->threads[i].ret;
+			goto free;
+		}
+	}
+
+	rpmsg_bench_report(bench, ktime_to_ns(ktime_sub(ktime_get(), begin)));
+
+free:
+	rpmsg_bench_free_threads(bench);
+	return ret;
+}
+
+static ssize_t rpmsg_bench_read(struct file *filp, char __user *userbuf,
+						size_t count, loff_t *ppos)
+{
+	struct rpmsg_bench *bench = filp->private_data;
+	ssize_t ret;
+
+	ret = mutex_lock_interruptible(&bench->lock);
+	if (ret)
+		return ret;
+
+	ret = simple_read_from_buffer(userbuf, count, ppos, bench->results,
+						strlen(bench->results));
+
+	mutex_unlock(&bench->lock);
+	return ret;
+}
+
+static ssize_t rpmsg_bench_write(struct file *filp, const char __user *userbuf,
+						size_t count, loff_t *ppos)
+{
+	struct rpmsg_bench *bench = filp->private_data;
+	unsigned int size, msgs, nepts = 1, nthreads = 1;
+	char buf[64], mode[8];
+	int ret;
+
+	if (count >= sizeof(buf))
+		return -EINVAL;
+
+	if (copy_from_user(buf, userbuf, count))
+		return -EFAULT;
+	buf[count] = '\0';
+
+	if (sscanf(buf, "%7s %u %u %u %u", mode, &size, &msgs, &nepts,
+							&nthreads) < 3)
+		return -EINVAL;
+
+	if (size < sizeof(struct rpmsg_bench_hdr) ||
+			size > RPMSG_BENCH_MAX_SIZE ||
+			!msgs || msgs > RPMSG_BENCH_MAX_COUNT ||
+			!nepts || nepts > RPMSG_BENCH_MAX_EPTS ||
+			!nthreads || nthreads > RPMSG_BENCH_MAX_THREADS ||
+			(u64)msgs * nthreads > RPMSG_BENCH_MAX_SAMPLES)
+		return -EINVAL;
+
+	ret = mutex_lock_interruptible(&bench->lock);
+	if (ret)
+		return ret;
+
+	if (!strcmp(mode, "rtt")) {
+		bench->mode = RPMSG_BENCH_RTT;
+	} else if (!strcmp(mode, "stream")) {
+		bench->mode = RPMSG_BENCH_STREAM;
+	} else {
+		ret = -EINVAL;
+		goto unlock;
+	}
+
+	bench->size = size;
+	bench->count = msgs;
+	bench->results[0] = '\0';
+
+	ret = rpmsg_bench_run(bench, nepts, nthreads);
+
+unlock:
+	mutex_unlock(&bench->lock);
+	return ret ? ret : count;
+}
+
+static const struct file_operations rpmsg_bench_ops = {
+	.read = rpmsg_bench_read,
+	.write = rpmsg_bench_write,
+	.open = simple_open,
+	.llseek = generic_file_llseek,
+};
+
+static void rpmsg_bench_unused_cb(struct rpmsg_channel *rpdev, void *data,
+					int len, void *priv, u32 src)
+{
+	dev_dbg(&rpdev->dev, "unexpected message from 0x%x\n", src);
+}
+
+static int rpmsg_bench_probe(struct rpmsg_channel *rpdev)
+{
+	struct device *dev = rpdev->dev.parent;
+	struct rpmsg_bench *bench;
+
+	bench = kzalloc(sizeof(*bench), GFP_KERNEL);
+	if (!bench)
+		return -ENOMEM;
+
+	bench->rpdev = rpdev;
+	/* rpmsg channels sit on the virtio devices of remote processors */
+	bench->rproc = vdev_to_rproc(dev_to_virtio(dev));
+	mutex_init(&bench->lock);
+
+	bench->dbg_dir = debugfs_create_dir(dev_name(&rpdev->dev),
+							rpmsg_bench_dbg);
+	if (!bench->dbg_dir) {
+		dev_err(&rpdev->dev, "can't create debugfs dir\n");
+		kfree(bench);
+		return -ENOMEM;
+	}
+
+	debugfs_create_file("run", 0600, bench->dbg_dir, bench,
+							&rpmsg_bench_ops);
+
+	dev_set_drvdata(&rpdev->dev, bench);
+
+	dev_info(&rpdev->dev, "new channel: 0x%x -> 0x%x!\n",
+					rpdev->src, rpdev->dst);
+
+	return 0;
+}
+
+static void __devexit rpmsg_bench_remove(struct rpmsg_channel *rpdev)
+{
+	struct rpmsg_bench *bench = dev_get_drvdata(&rpdev->dev);
+
+	/* let a run that is going on end first */
+	debugfs_remove_recursive(bench->dbg_dir);
+	mutex_lock(&bench->lock);
+	mutex_unlock(&bench->lock);
+
+	kfree(bench);
+}
+
+static struct rpmsg_device_id rpmsg_bench_id_table[] = {
+	{ .name	= "rpmsg-bench" },
+	{ },
+};
+MODULE_DEVICE_TABLE(rpmsg, rpmsg_bench_id_table);
+
+static struct rpmsg_driver rpmsg_bench_driver = {
+	.drv.name	= KBUILD_MODNAME,
+	.drv.owner	= THIS_MODULE,
+	.id_table	= rpmsg_bench_id_table,
+	.probe		= rpmsg_bench_probe,
+	.callback	= rpmsg_bench_unused_cb,
+	.remove		= __devexit_p(rpmsg_bench_remove),
+};
+
+static int __init rpmsg_bench_init(void)
+{
+	int ret;
+
+	rpmsg_bench_dbg = debugfs_create_dir(KBUILD_MODNAME, NULL);
+
+	ret = register_rpmsg_driver(&rpmsg_bench_driver);
+	if (ret)
+		debugfs_remove(rpmsg_bench_dbg);
+
+	return ret;
+}
+module_init(rpmsg_bench_init);
+
+static void __exit rpmsg_bench_fini(void)
+{
+	unregister_rpmsg_driver(&rpmsg_bench_driver);
+	debugfs_remove(rpmsg_bench_dbg);
+}
+module_exit(rpmsg_bench_fini);
+
+MODULE_DESCRIPTION("Remote processor messaging benchmark driver");
+MODULE_LICENSE("GPL v2");
@@ -0,0 +1,37 @@
+#!/bin/sh
+#
+# Sweep the rpmsg benchmark over message sizes and concurrency levels.
+#
+# usage: rpmsg_bench.sh [<channel> [<count>]]
+#
+# <channel> is the name of an rpmsg-bench channel, as it shows in
+# rpmsg_bench/ under debugfs, and defaults to the first one found.
+# rpmsg_bench.ko must be loaded, and debugfs mounted. The largest size that fits in an rpmsg buffer is swept
+# last; runs whose messages don't fit fail, and are reported as such.
+
+DBG=${DEBUGFS:-/sys/kernel/debug}/rpmsg_bench
+CHANNEL=${1:-$(ls $DBG 2>/dev/null | head -n 1)}
+COUNT=${2:-10000}
+SIZES="16 32 64 128 256 496"
+LEVELS="1:1 1:4 4:4 16:16"
+
+RUN=$DBG/$CHANNEL/run
+if [ -z "$CHANNEL" ] || [ ! -w $RUN ]; then
+	echo "no rpmsg-bench channel in $DBG" >&2
+	exit 1
+fi
+
+for mode in rtt stream; do
+	for level in $LEVELS; do
+		epts=${level%:*}
+		threads=${level#*:}
+		for size in $SIZES; do
+			if echo "$mode $size $COUNT $epts $threads" > $RUN; then
+				cat $RUN
+			else
+				echo "$mode $size $COUNT $epts $threads: failed"
+			fi
+			echo
+		done
+	done
+done
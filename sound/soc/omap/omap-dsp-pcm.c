@@ -0,0 +1,850 @@
+/*
+ * omap-dsp-pcm.c  --  ALSA PCM and compressed offload to the OMAP audio DSP
+ *
+ * The audio DSP, which remoteproc boots, announces an "omap-dsp-audio"
+ * rpmsg channel. Streams opened on the platform this driver registers for
+ * that channel are then played (or captured) by the DSP itself, which
+ * decodes and mixes them: the host only hands it buffers, in memory the
+ * DSP reaches just like the rpmsg buffers (see rpmsg_get_dma_dev()), and
+ * is only woken up as periods (resp. fragments) elapse, if at all.
+ *
+ * Streams are opened, set up and closed with rpc calls to the DSP (see
+ * <linux/rpmsg_rpc.h>); triggers and compressed writes are one-way
+ * messages sent on the channel, so they never wait for a reply, and the
+ * DSP signals elapsed periods with events on the channel. The DSP keeps
+ * the position of each stream up to date in a table of the host, so the
+ * pointer callbacks don't have to ask for it.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/uaccess.h>
+#include <linux/dma-mapping.h>
+#include <linux/rpmsg.h>
+#include <linux/rpmsg_rpc.h>
+#include <sound/core.h>
+#include <sound/pcm.h>
+#include <sound/pcm_params.h>
+#include <sound/compress_driver.h>
+#include <sound/soc.h>
+
+/* the most streams the DSP runs at once */
+#define OMAP_DSP_MAX_STREAMS	8
+
+/* how long the DSP may take to answer a call */
+#define OMAP_DSP_TIMEOUT	msecs_to_jiffies(1000)
+
+#define OMAP_DSP_BUFFER_BYTES	(128 * 1024)
+
+/* the calls of the host, and its one-way messages (OMAP_DSP_TRIGGER on) */
+enum omap_dsp_cmd {
+	OMAP_DSP_OPEN		= 0,
+	OMAP_DSP_CLOSE		= 1,
+	OMAP_DSP_SET_PARAMS	= 2,
+	OMAP_DSP_TRIGGER	= 3,
+	OMAP_DSP_WRITE		= 4,
+};
+
+/* OMAP_DSP_OPEN flags */
+#define OMAP_DSP_F_CAPTURE	(1 << 0)
+#define OMAP_DSP_F_COMPR	(1 << 1)
+
+/* omap_dsp_params flags: don't send period events */
+#define OMAP_DSP_P_NO_WAKEUP	(1 << 0)
+
+/* the codec of PCM streams; compressed ones use their SND_AUDIOCODEC_ id */
+#define OMAP_DSP_CODEC_PCM	0
+
+/* the events of the DSP */
+#define OMAP_DSP_EVT_PERIOD	0
+
+/**
+ * struct omap_dsp_params - how a stream is set up (OMAP_DSP_SET_PARAMS)
+ * @codec: OMAP_DSP_CODEC_PCM, or the SND_AUDIOCODEC_* of the stream
+ * @format: the snd_pcm_format_t of PCM streams
+ * @rate: sample rate, in Hz
+ * @channels: number of channels
+ * @buf_da: address of the (ring) buffer of the stream
+ * @buf_size: size of the buffer, in bytes
+ * @period_size: size of a period (resp. fragment), in bytes
+ * @pos_da: address of the position of the stream, in bytes, which the DSP
+ *	    keeps up to date (free-running)
+ * @flags: OMAP_DSP_P_* bits
+ */
+struct omap_dsp_params {
+	u32 codec;
+	u32 format;
+	u32 rate;
+	u32 channels;
+	u32 buf_da;
+	u32 buf_size;
+	u32 period_size;
+	u32 pos_da;
+	u32 flags;
+} __packed;
+
+/**
+ * struct omap_dsp_req - a request of the host
+ * @cmd: the OMAP_DSP_* command
+ * @stream: the stream, as numbered by the DSP when it was opened
+ * @flags: OMAP_DSP_F_* bits (OMAP_DSP_OPEN)
+ * @params: the setup of the stream (OMAP_DSP_SET_PARAMS)
+ * @trigger: the SNDRV_PCM_TRIGGER_* (or SND_COMPR_TRIGGER_*) command
+ *	     (OMAP_DSP_TRIGGER)
+ * @written: how many bytes the host ever wrote to the buffer of the
+ *	     (compressed) stream (OMAP_DSP_WRITE, free-running)
+ */
+struct omap_dsp_req {
+	u32 cmd;
+	u32 stream;
+	union {
+		u32 flags;
+		struct omap_dsp_params params;
+		u32 trigger;
+		u32 written;
+	};
+} __packed;
+
+/**
+ * struct omap_dsp_reply - the reply of the DSP to a call
+ * @status: 0 on success, or a negative error code
+ * @stream: the number of the stream that was opened (OMAP_DSP_OPEN)
+ */
+struct omap_dsp_reply {
+	s32 status;
+	u32 stream;
+} __packed;
+
+/**
+ * struct omap_dsp_event - an event of the DSP
+ * @event: OMAP_DSP_EVT_PERIOD
+ * @stream: the stream it's about
+ */
+struct omap_dsp_event {
+	u32 event;
+	u32 stream;
+} __packed;
+
+struct omap_dsp;
+
+/**
+ * struct omap_dsp_stream - a stream the DSP runs
+ * @dsp: the DSP
+ * @id: the number of the stream, as picked by the DSP
+ * @substream: the PCM substream, for PCM streams
+ * @cstream: the compressed stream, for compressed ones
+ * @area: kernel address of the buffer of a compressed stream
+ * @dma: dma address of @area
+ * @size: size of @area, in bytes
+ * @rate: sample rate of a compressed stream
+ * @written: how many bytes were ever written to @area
+ * @last_pos: the position of a compressed stream when last looked at
+ * @consumed: how many bytes of @area the DSP ever consumed
+ */
+struct omap_dsp_stream {
+	struct omap_dsp *dsp;
+	u32 id;
+	struct snd_pcm_substream *substream;
+	struct snd_compr_stream *cstream;
+	void *area;
+	dma_addr_t dma;
+	size_t size;
+	u32 rate;
+	u64 written;
+	u32 last_pos;
+	u64 consumed;
+};
+
+/**
+ * struct omap_dsp - the audio DSP
+ * @rpdev: the rpmsg channel of the DSP
+ * @rpc: the rpc endpoint the streams are set up with
+ * @dma_dev: the device the memory shared with the DSP is allocated with
+ * @pos: the positions of the streams, indexed by their number, which the
+ *	 DSP keeps up to date
+ * @pos_dma: dma address of @pos
+ * @lock: protects @streams
+ * @streams: the open streams, indexed by their number
+ */
+struct omap_dsp {
+	struct rpmsg_channel *rpdev;
+	struct rpmsg_rpc *rpc;
+	struct device *dma_dev;
+	u32 *pos;
+	dma_addr_t pos_dma;
+	spinlock_t lock;
+	struct omap_dsp_stream *streams[OMAP_DSP_MAX_STREAMS];
+};
+
+static const struct snd_pcm_hardware omap_dsp_pcm_hardware = {
+	.info			= SNDRV_PCM_INFO_MMAP |
+				  SNDRV_PCM_INFO_MMAP_VALID |
+				  SNDRV_PCM_INFO_INTERLEAVED |
+				  SNDRV_PCM_INFO_PAUSE |
+				  SNDRV_PCM_INFO_NO_PERIOD_WAKEUP,
+	.formats		= SNDRV_PCM_FMTBIT_S16_LE |
+				  SNDRV_PCM_FMTBIT_S32_LE,
+	.rates			= SNDRV_PCM_RATE_8000_48000,
+	.rate_min		= 8000,
+	.rate_max		= 48000,
+	.channels_min		= 1,
+	.channels_max		= 8,
+	.period_bytes_min	= 256,
+	.period_bytes_max	= 64 * 1024,
+	.periods_min		= 2,
+	.periods_max		= 32,
+	.buffer_bytes_max	= OMAP_DSP_BUFFER_BYTES,
+};
+
+/* call the DSP, and turn its reply into an error code */
+static int omap_dsp_call(struct omap_dsp *dsp, struct omap_dsp_req *req,
+							int len, u32 *stream)
+{
+	struct omap_dsp_reply reply;
+	int ret;
+
+	ret = rpmsg_rpc_call(dsp->rpc, req, len, &reply, sizeof(reply),
+							OMAP_DSP_TIMEOUT);
+	if (ret < 0)
+		return ret;
+
+	if (ret < sizeof(reply))
+		return -EPROTO;
+
+	if (stream)
+		*stream = reply.stream;
+
+	return reply.status;
+}
+
+/* send a one-way request, which possibly can't wait for a tx buffer */
+static int omap_dsp_notify(struct omap_dsp_stream *s, u32 cmd, u32 arg,
+								bool atomic)
+{
+	struct omap_dsp_req req = {
+		.cmd = cmd,
+		.stream = s->id,
+		.trigger = arg,
+	};
+	int len = offsetof(struct omap_dsp_req, trigger) + sizeof(req.trigger);
+
+	if (atomic)
+		return rpmsg_trysend(s->dsp->rpdev, &req, len);
+
+	return rpmsg_send(s->dsp->rpdev, &req, len);
+}
+
+/* open a stream on the DSP, and track its events */
+static struct omap_dsp_stream *omap_dsp_open(struct omap_dsp *dsp, u32 flags)
+{
+	struct omap_dsp_req req = {
+		.cmd = OMAP_DSP_OPEN,
+		.flags = flags,
+	};
+	int len = offsetof(struct omap_dsp_req, flags) + sizeof(req.flags);
+	struct device *dev = &dsp->rpdev->dev;
+	struct omap_dsp_stream *s;
+	int ret;
+
+	s = kzalloc(sizeof(*s), GFP_KERNEL);
+	if (!s)
+		return ERR_PTR(-ENOMEM);
+
+	s->dsp = dsp;
+
+	ret = omap_dsp_call(dsp, &req, len, &s->id);
+	if (ret) {
+		dev_err(dev, "can't open stream: %d\n", ret);
+		goto free_stream;
+	}
+
+	ret = -EPROTO;
+	if (s->id >= OMAP_DSP_MAX_STREAMS) {
+		dev_err(dev, "bad stream %u\n", s->id);
+		goto close;
+	}
+
+	spin_lock_irq(&dsp->lock);
+	if (!dsp->streams[s->id]) {
+		dsp->streams[s->id] = s;
+		ret = 0;
+	}
+	spin_unlock_irq(&dsp->lock);
+
+	if (ret) {
+		dev_err(dev, "stream %u is open already\n", s->id);
+		goto close;
+	}
+
+	dsp->pos[s->id] = 0;
+
+	return s;
+
+close:
+	req.cmd = OMAP_DSP_CLOSE;
+	req.stream = s->id;
+	omap_dsp_call(dsp, &req, offsetof(struct omap_dsp_req, flags), NULL);
+free_stream:
+	kfree(s);
+	return ERR_PTR(ret);
+}
+
+static void omap_dsp_close(struct omap_dsp_stream *s)
+{
+	struct omap_dsp *dsp = s->dsp;
+	struct omap_dsp_req req = {
+		.cmd = OMAP_DSP_CLOSE,
+		.stream = s->id,
+	};
+	int ret;
+
+	ret = omap_dsp_call(dsp, &req, offsetof(struct omap_dsp_req, flags),
+									NULL);
+	if (ret)
+		dev_err(&dsp->rpdev->dev, "can't close stream %u: %d\n", s->id,
+									ret);
+
+	spin_lock_irq(&dsp->lock);
+	dsp->streams[s->id] = NULL;
+	spin_unlock_irq(&dsp->lock);
+
+	kfree(s);
+}
+
+static int omap_dsp_set_params(struct omap_dsp_stream *s,
+					struct omap_dsp_params *params)
+{
+	struct omap_dsp_req req = {
+		.cmd = OMAP_DSP_SET_PARAMS,
+		.stream = s->id,
+		.params = *params,
+	};
+	int len = offsetof(struct omap_dsp_req, params) + sizeof(req.params);
+
+	req.params.pos_da = s->dsp->pos_dma + s->id * sizeof(u32);
+	s->dsp->pos[s->id] = 0;
+
+	return omap_dsp_call(s->dsp, &req, len, NULL);
+}
+
+static u32 omap_dsp_pos(struct omap_dsp_stream *s)
+{
+	return ACCESS_ONCE(s->dsp->pos[s->id]);
+}
+
+static int omap_dsp_pcm_open(struct snd_pcm_substream *substream)
+{
+	struct snd_soc_pcm_runtime *rtd = substream->private_data;
+	struct omap_dsp *dsp = snd_soc_platform_get_drvdata(rtd->platform);
+	struct snd_pcm_runtime *runtime = substream->runtime;
+	struct omap_dsp_stream *s;
+	int ret;
+
+	snd_soc_set_runtime_hwparams(substream, &omap_dsp_pcm_hardware);
+
+	ret = snd_pcm_hw_constraint_integer(runtime,
+					    SNDRV_PCM_HW_PARAM_PERIODS);
+	if (ret < 0)
+		return ret;
+
+	s = omap_dsp_open(dsp, substream->stream == SNDRV_PCM_STREAM_CAPTURE ?
+							OMAP_DSP_F_CAPTURE : 0);
+	if (IS_ERR(s))
+		return PTR_ERR(s);
+
+	s->substream = substream;
+	runtime->private_data = s;
+
+	return 0;
+}
+
+static int omap_dsp_pcm_close(struct snd_pcm_substream *substream)
+{
+	omap_dsp_close(substream->runtime->private_data);
+
+	return 0;
+}
+
+static int omap_dsp_pcm_hw_params(struct snd_pcm_substream *substream,
+				struct snd_pcm_hw_params *params)
+{
+	return snd_pcm_lib_malloc_pages(substream, params_buffer_bytes(params));
+}
+
+static int omap_dsp_pcm_hw_free(struct snd_pcm_substream *substream)
+{
+	return snd_pcm_lib_free_pages(substream);
+}
+
+static int omap_dsp_pcm_prepare(struct snd_pcm_substream *substream)
+{
+	struct snd_pcm_runtime *runtime = substream->runtime;
+	struct omap_dsp_stream *s = runtime->private_data;
+	struct omap_dsp_params params = {
+		.codec = OMAP_DSP_CODEC_PCM,
+		.format = runtime->format,
+		.rate = runtime->rate,
+		.channels = runtime->channels,
+		.buf_da = runtime->dma_addr,
+		.buf_size = snd_pcm_lib_buffer_bytes(substream),
+		.period_size = snd_pcm_lib_period_bytes(substream),
+		.flags = runtime->no_period_wakeup ? OMAP_DSP_P_NO_WAKEUP : 0,
+	};
+
+	return omap_dsp_set_params(s, &params);
+}
+
+static int omap_dsp_pcm_trigger(struct snd_pcm_substream *substream, int cmd)
+{
+	switch (cmd) {
+	case SNDRV_PCM_TRIGGER_START:
+	case SNDRV_PCM_TRIGGER_STOP:
+	case SNDRV_PCM_TRIGGER_PAUSE_PUSH:
+	case SNDRV_PCM_TRIGGER_PAUSE_RELEASE:
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	/* we're called with the stream lock held */
+	return omap_dsp_notify(substream->runtime->private_data,
+						OMAP_DSP_TRIGGER, cmd, true);
+}
+
+static snd_pcm_uframes_t
+omap_dsp_pcm_pointer(struct snd_pcm_substream *substream)
+{
+	struct snd_pcm_runtime *runtime = substream->runtime;
+	u32 pos = omap_dsp_pos(runtime->private_data);
+
+	pos %= snd_pcm_lib_buffer_bytes(substream);
+
+	return bytes_to_frames(runtime, pos);
+}
+
+static struct snd_pcm_ops omap_dsp_pcm_ops = {
+	.open		= omap_dsp_pcm_open,
+	.close		= omap_dsp_pcm_close,
+	.ioctl		= snd_pcm_lib_ioctl,
+	.hw_params	= omap_dsp_pcm_hw_params,
+	.hw_free	= omap_dsp_pcm_hw_free,
+	.prepare	= omap_dsp_pcm_prepare,
+	.trigger	= omap_dsp_pcm_trigger,
+	.pointer	= omap_dsp_pcm_pointer,
+};
+
+static int omap_dsp_pcm_new(struct snd_soc_pcm_runtime *rtd)
+{
+	struct omap_dsp *dsp = snd_soc_platform_get_drvdata(rtd->platform);
+
+	/* the buffers come from memory the DSP can reach */
+	return snd_pcm_lib_preallocate_pages_for_all(rtd->pcm,
+				SNDRV_DMA_TYPE_DEV, dsp->dma_dev,
+				OMAP_DSP_BUFFER_BYTES, OMAP_DSP_BUFFER_BYTES);
+}
+
+static void omap_dsp_pcm_free(struct snd_pcm *pcm)
+{
+	snd_pcm_lib_preallocate_free_for_all(pcm);
+}
+
+static const u32 omap_dsp_codecs[] = {
+	SND_AUDIOCODEC_MP3,
+	SND_AUDIOCODEC_AAC,
+};
+
+static int omap_dsp_compr_open(struct snd_compr_stream *cstream)
+{
+	struct snd_soc_pcm_runtime *rtd = cstream->private_data;
+	struct omap_dsp *dsp = snd_soc_platform_get_drvdata(rtd->platform);
+	struct omap_dsp_stream *s;
+
+	if (cstream->direction != SND_COMPRESS_PLAYBACK)
+		return -EINVAL;
+
+	s = omap_dsp_open(dsp, OMAP_DSP_F_COMPR);
+	if (IS_ERR(s))
+		return PTR_ERR(s);
+
+	s->cstream = cstream;
+	cstream->runtime->private_data = s;
+
+	return 0;
+}
+
+static int omap_dsp_compr_free(struct snd_compr_stream *cstream)
+{
+	struct omap_dsp_stream *s = cstream->runtime->private_data;
+	struct device *dma_dev = s->dsp->dma_dev;
+	void *area = s->area;
+	dma_addr_t dma = s->dma;
+	size_t size = s->size;
+
+	omap_dsp_close(s);
+
+	if (area)
+		dma_free_coherent(dma_dev, size, area, dma);
+
+	return 0;
+}
+
+/*
+ * the ring buffer of the stream is allocated here, in memory the DSP can
+ * reach, as the core leaves that to drivers that provide ->copy()
+ */
+static int omap_dsp_compr_set_params(struct snd_compr_stream *cstream,
+					struct snd_compr_params *cparams)
+{
+	struct snd_compr_runtime *runtime = cstream->runtime;
+	struct omap_dsp_stream *s = runtime->private_data;
+	struct omap_dsp_params params = {
+		.codec = cparams->codec.id,
+		.rate = cparams->codec.sample_rate,
+		.channels = cparams->codec.ch_in,
+		.period_size = runtime->fragment_size,
+	};
+	int i, ret;
+
+	for (i = 0; i < ARRAY_SIZE(omap_dsp_codecs); i++)
+		if (cparams->codec.id == omap_dsp_codecs[i])
+			break;
+	if (i == ARRAY_SIZE(omap_dsp_codecs))
+		return -EINVAL;
+
+	if (s->area) {
+		dma_free_coherent(s->dsp->dma_dev, s->size, s->area, s->dma);
+		s->area = NULL;
+	}
+
+	s->size = runtime->buffer_size;
+	s->area = dma_alloc_coherent(s->dsp->dma_dev, s->size, &s->dma,
+								GFP_KERNEL);
+	if (!s->area)
+		return -ENOMEM;
+
+	s->rate = cparams->codec.sample_rate;
+	s->written = 0;
+	s->last_pos = 0;
+	s->consumed = 0;
+
+	params.buf_da = s->dma;
+	params.buf_size = s->size;
+
+	ret = omap_dsp_set_params(s, &params);
+	if (ret) {
+		dma_free_coherent(s->dsp->dma_dev, s->size, s->area, s->dma);
+		s->area = NULL;
+	}
+
+	return ret;
+}
+
+static int omap_dsp_compr_trigger(struct snd_compr_stream *cstream, int cmd)
+{
+	return omap_dsp_notify(cstream->runtime->private_data,
+						OMAP_DSP_TRIGGER, cmd, false);
+}
+
+static int omap_dsp_compr_pointer(struct snd_compr_stream *cstream,
+					struct snd_compr_tstamp *tstamp)
+{
+	struct omap_dsp_stream *s = cstream->runtime->private_data;
+	u32 pos = omap_dsp_pos(s);
+	u32 offset = 0;
+
+	s->consumed += pos - s->last_pos;
+	s->last_pos = pos;
+
+	if (s->size)
+		div_u64_rem(s->consumed, s->size, &offset);
+
+	tstamp->byte_offset = offset;
+	tstamp->copied_total = s->consumed;
+	tstamp->sampling_rate = s->rate;
+
+	return 0;
+}
+
+/* copy what user space writes into the ring, and tell the DSP about it */
+static int omap_dsp_compr_copy(struct snd_compr_stream *cstream,
+					const char __user *buf, size_t count)
+{
+	struct snd_compr_runtime *runtime = cstream->runtime;
+	struct omap_dsp_stream *s = runtime->private_data;
+	u32 offset, chunk;
+	int ret;
+
+	if (!s->area)
+		return -EBADFD;
+
+	div_u64_rem(s->written, s->size, &offset);
+	chunk = min_t(size_t, count, s->size - offset);
+
+	if (copy_from_user(s->area + offset, buf, chunk) ||
+	    copy_from_user(s->area, buf + chunk, count - chunk))
+		return -EFAULT;
+
+	s->written += count;
+	div_u64_rem(s->written, s->size, &offset);
+	runtime->app_pointer = offset;
+
+	ret = omap_dsp_notify(s, OMAP_DSP_WRITE, (u32)s->written, false);
+	if (ret)
+		return ret;
+
+	return count;
+}
+
+static int omap_dsp_compr_get_caps(struct snd_compr_stream *cstream,
+					struct snd_compr_caps *caps)
+{
+	int i;
+
+	caps->direction = SND_COMPRESS_PLAYBACK;
+	caps->min_fragment_size = omap_dsp_pcm_hardware.period_bytes_min;
+	caps->max_fragment_size = omap_dsp_pcm_hardware.period_bytes_max;
+	caps->min_fragments = omap_dsp_pcm_hardware.periods_min;
+	caps->max_fragments = omap_dsp_pcm_hardware.periods_max;
+	caps->num_codecs = ARRAY_SIZE(omap_dsp_codecs);
+	for (i = 0; i < ARRAY_SIZE(omap_dsp_codecs); i++)
+		caps->codecs[i] = omap_dsp_codecs[i];
+
+	return 0;
+}
+
+static int omap_dsp_compr_get_codec_caps(struct snd_compr_stream *cstream,
+					struct snd_compr_codec_caps *codec)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(omap_dsp_codecs); i++)
+		if (codec->codec == omap_dsp_codecs[i])
+			break;
+	if (i == ARRAY_SIZE(omap_dsp_codecs))
+		return -EINVAL;
+
+	codec->num_descriptors = 1;
+	codec->descriptor[0].max_ch = 2;
+	codec->descriptor[0].sample_rates = SNDRV_PCM_RATE_8000_48000;
+
+	return 0;
+}
+
+static struct snd_compr_ops omap_dsp_compr_ops = {
+	.open		= omap_dsp_compr_open,
+	.free		= omap_dsp_compr_free,
+	.set_params	= omap_dsp_compr_set_params,
+	.trigger	= omap_dsp_compr_trigger,
+	.pointer	= omap_dsp_compr_pointer,
+	.copy		= omap_dsp_compr_copy,
+	.get_caps	= omap_dsp_compr_get_caps,
+	.get_codec_caps	= omap_dsp_compr_get_codec_caps,
+};
+
+static struct snd_soc_platform_driver omap_dsp_platform = {
+	.ops		= &omap_dsp_pcm_ops,
+	.compr_ops	= &omap_dsp_compr_ops,
+	.pcm_new	= omap_dsp_pcm_new,
+	.pcm_free	= omap_dsp_pcm_free,
+};
+
+/* the front ends of the DSP, which machine drivers link to its back ends */
+static struct snd_soc_dai_driver omap_dsp_dais[] = {
+	{
+		.name = "omap-dsp-pcm",
+		.playback = {
+			.channels_min = 1,
+			.channels_max = 8,
+			.rates = SNDRV_PCM_RATE_8000_48000,
+			.formats = SNDRV_PCM_FMTBIT_S16_LE |
+				   SNDRV_PCM_FMTBIT_S32_LE,
+		},
+		.capture = {
+			.channels_min = 1,
+			.channels_max = 8,
+			.rates = SNDRV_PCM_RATE_8000_48000,
+			.formats = SNDRV_PCM_FMTBIT_S16_LE |
+				   SNDRV_PCM_FMTBIT_S32_LE,
+		},
+	},
+	{
+		.name = "omap-dsp-compr",
+		.compress_dai = 1,
+		.playback = {
+			.channels_min = 1,
+			.channels_max = 2,
+			.rates = SNDRV_PCM_RATE_8000_48000,
+			.formats = SNDRV_PCM_FMTBIT_S16_LE,
+		},
+	},
+};
+
+/* an elapsed period (resp. fragment) of a stream */
+static void omap_dsp_cb(struct rpmsg_channel *rpdev, void *data, int len,
+							void *priv, u32 src)
+{
+	struct omap_dsp *dsp = dev_get_drvdata(&rpdev->dev);
+	struct omap_dsp_event *evt = data;
+	struct omap_dsp_stream *s;
+	unsigned long flags;
+
+	if (!dsp || len < sizeof(*evt) || evt->event != OMAP_DSP_EVT_PERIOD ||
+					evt->stream >= OMAP_DSP_MAX_STREAMS) {
+		dev_warn(&rpdev->dev, "unexpected message, len %d\n", len);
+		return;
+	}
+
+	spin_lock_irqsave(&dsp->lock, flags);
+
+	s = dsp->streams[evt->stream];
+	if (s && s->substream)
+		snd_pcm_period_elapsed(s->substream);
+	else if (s && s->cstream)
+		snd_compr_fragment_elapsed(s->cstream);
+
+	spin_unlock_irqrestore(&dsp->lock, flags);
+}
+
+/* the DSP was restarted: its streams are gone */
+static void omap_dsp_reset(struct rpmsg_channel *rpdev)
+{
+	struct omap_dsp *dsp = dev_get_drvdata(&rpdev->dev);
+	struct omap_dsp_stream *s;
+	unsigned long flags;
+	int i;
+
+	spin_lock_irq(&dsp->lock);
+
+	for (i = 0; i < OMAP_DSP_MAX_STREAMS; i++) {
+		s = dsp->streams[i];
+		if (!s || !s->substream)
+			continue;
+
+		snd_pcm_stream_lock_irqsave(s->substream, flags);
+		if (snd_pcm_running(s->substream))
+			snd_pcm_stop(s->substream, SNDRV_PCM_STATE_XRUN);
+		snd_pcm_stream_unlock_irqrestore(s->substream, flags);
+	}
+
+	spin_unlock_irq(&dsp->lock);
+
+	dev_warn(&rpdev->dev, "audio DSP was restarted\n");
+}
+
+static int omap_dsp_probe(struct rpmsg_channel *rpdev)
+{
+	struct device *dev = &rpdev->dev;
+	struct omap_dsp *dsp;
+	int ret;
+
+	dsp = devm_kzalloc(dev, sizeof(*dsp), GFP_KERNEL);
+	if (!dsp)
+		return -ENOMEM;
+
+	dsp->rpdev = rpdev;
+	dsp->dma_dev = rpmsg_get_dma_dev(rpdev);
+	spin_lock_init(&dsp->lock);
+
+	dsp->pos = dma_alloc_coherent(dsp->dma_dev,
+				OMAP_DSP_MAX_STREAMS * sizeof(*dsp->pos),
+				&dsp->pos_dma, GFP_KERNEL);
+	if (!dsp->pos)
+		return -ENOMEM;
+
+	dsp->rpc = rpmsg_rpc_create(rpdev, rpdev->dst, OMAP_DSP_MAX_STREAMS,
+								NULL, NULL);
+	if (IS_ERR(dsp->rpc)) {
+		ret = PTR_ERR(dsp->rpc);
+		dev_err(dev, "can't create rpc endpoint: %d\n", ret);
+		goto free_pos;
+	}
+
+	/* the callback may fire as soon as the streams are opened */
+	dev_set_drvdata(dev, dsp);
+
+	ret = snd_soc_register_platform(dev, &omap_dsp_platform);
+	if (ret) {
+		dev_err(dev, "can't register platform: %d\n", ret);
+		goto destroy_rpc;
+	}
+
+	ret = snd_soc_register_dais(dev, omap_dsp_dais,
+						ARRAY_SIZE(omap_dsp_dais));
+	if (ret) {
+		dev_err(dev, "can't register dais: %d\n", ret);
+		goto unregister_platform;
+	}
+
+	dev_info(dev, "audio DSP: 0x%x -> 0x%x\n", rpdev->src, rpdev->dst);
+
+	return 0;
+
+unregister_platform:
+	snd_soc_unregister_platform(dev);
+destroy_rpc:
+	dev_set_drvdata(dev, NULL);
+	rpmsg_rpc_destroy(dsp->rpc);
+free_pos:
+	dma_free_coherent(dsp->dma_dev, OMAP_DSP_MAX_STREAMS *
+				sizeof(*dsp->pos), dsp->pos, dsp->pos_dma);
+	return ret;
+}
+
+static void __devexit omap_dsp_remove(struct rpmsg_channel *rpdev)
+{
+	struct device *dev = &rpdev->dev;
+	struct omap_dsp *dsp = dev_get_drvdata(dev);
+
+	snd_soc_unregister_dais(dev, ARRAY_SIZE(omap_dsp_dais));
+	snd_soc_unregister_platform(dev);
+
+	/* the callback must not touch the DSP anymore (see rpmsg_char) */
+	mutex_lock(&rpdev->ept->cb_lock);
+	dev_set_drvdata(dev, NULL);
+	mutex_unlock(&rpdev->ept->cb_lock);
+
+	rpmsg_rpc_destroy(dsp->rpc);
+	dma_free_coherent(dsp->dma_dev, OMAP_DSP_MAX_STREAMS *
+				sizeof(*dsp->pos), dsp->pos, dsp->pos_dma);
+}
+
+static struct rpmsg_device_id omap_dsp_id_table[] = {
+	{ .name	= "omap-dsp-audio" },
+	{ },
+};
+MODULE_DEVICE_TABLE(rpmsg, omap_dsp_id_table);
+
+static struct rpmsg_driver omap_dsp_driver = {
+	.drv.name	= KBUILD_MODNAME,
+	.drv.owner	= THIS_MODULE,
+	.id_table	= omap_dsp_id_table,
+	.probe		= omap_dsp_probe,
+	.callback	= omap_dsp_cb,
+	.reset		= omap_dsp_reset,
+	.remove		= __devexit_p(omap_dsp_remove),
+};
+
+static int __init omap_dsp_init(void)
+{
+	return register_rpmsg_driver(&omap_dsp_driver);
+}
+module_init(omap_dsp_init);
+
+static void __exit omap_dsp_exit(void)
+{
+	unregister_rpmsg_driver(&omap_dsp_driver);
+}
+module_exit(omap_dsp_exit);
+
+MODULE_DESCRIPTION("ALSA SoC offload to the OMAP audio DSP");
+MODULE_LICENSE("GPL v2");
@@ -0,0 +1,167 @@
+#!/bin/bash
+#
+# rpmsg performance regression test
+#
+# Runs the rpmsg benchmark (samples/rpmsg/rpmsg_bench.c) against the
+# simulated remote processor (drivers/remoteproc/sim_remoteproc.c), and
+# compares the throughput and the p99 round-trip latency of every case with
+# a stored baseline: the test fails if any of them regressed by more than
+# THRESHOLD percent. Without a baseline (or with UPDATE set), the results
+# are recorded as the new baseline instead. Both CONFIG_SIM_REMOTEPROC and
+# CONFIG_SAMPLE_RPMSG_BENCH are needed (as modules, or built in).
+#
+# A baseline only makes sense for the machine (and config) it was recorded
+# on, so keep it around across kernel upgrades, e.g. with BASELINE.
+#
+# BASELINE	baseline file (default: rpmsg-bench.baseline, by this script)
+# THRESHOLD	tolerated regression, in percent (default: 15)
+# COUNT		messages each thread sends, per run (default: 10000)
+# RUNS		runs per case, the best of which is kept (default: 3)
+# UPDATE	record the results as the new baseline
+
+BASELINE=${BASELINE:-$(dirname $0)/rpmsg-bench.baseline}
+THRESHOLD=${THRESHOLD:-15}
+COUNT=${COUNT:-10000}
+RUNS=${RUNS:-3}
+
+# <mode> <size> <endpoints> <threads>
+CASES="rtt 16 1 1
+rtt 496 1 1
+rtt 64 4 4
+stream 64 1 1
+stream 496 1 1
+stream 64 4 4"
+
+RUN=
+
+prerequisite()
+{
+	local msg="skip all tests:"
+	local debugfs chan i
+
+	if [ $UID != 0 ]; then
+		echo $msg must be run as root >&2
+		exit 0
+	fi
+
+	debugfs=`mount -t debugfs | head -1 | awk '{ print $3 }'`
+
+	if [ ! -d "$debugfs" ]; then
+		echo $msg debugfs is not mounted >&2
+		exit 0
+	fi
+
+	/sbin/modprobe -q sim_remoteproc
+	/sbin/modprobe -q rpmsg_bench
+
+	if [ ! -d $debugfs/rpmsg_bench ]; then
+		echo $msg rpmsg_bench is not available >&2
+		exit 0
+	fi
+
+	# the channel shows up once the simulated remote processor booted
+	for i in `seq 50`; do
+		chan=`ls $debugfs/rpmsg_bench | head -n 1`
+		[ -n "$chan" ] && break
+		sleep 0.1
+	done
+
+	if [ -z "$chan" ]; then
+		echo $msg no rpmsg-bench channel showed up >&2
+		exit 0
+	fi
+
+	RUN=$debugfs/rpmsg_bench/$chan/run
+}
+
+#
+# run a case RUNS times, and print the best throughput (in msgs/s) and the
+# best p99 round-trip latency (in ns, or 0 for streams) out of those runs
+#
+run_case()
+{
+	local best_rate=0 best_p99=0
+	local num='\([0-9]*\)'
+	local out rate p99 i
+
+	for i in `seq $RUNS`; do
+		echo "$1 $2 $COUNT $3 $4" > $RUN || return 1
+		out=`cat $RUN`
+
+		rate=`echo "$out" | sed -n "s/^elapsed: .*, $num msgs.*/\1/p"`
+		p99=`echo "$out" | sed -n "s/^rtt ns: .* p99 $num .*/\1/p"`
+		[ -z "$rate" ] && return 1
+		p99=${p99:-0}
+
+		[ $rate -gt $best_rate ] && best_rate=$rate
+		if [ $best_p99 -eq 0 ] || [ $p99 -lt $best_p99 ]; then
+			best_p99=$p99
+		fi
+	done
+
+	echo $best_rate $best_p99
+}
+
+#
+# compare a case's results with its baseline, if it has one
+#
+check_case()
+{
+	local name=$1 rate=$2 p99=$3
+	local base_rate base_p99 ret=0
+
+	set -- `grep "^$name " $BASELINE`
+	if [ $# -ne 3 ]; then
+		echo "$name: no baseline, skipped"
+		return 0
+	fi
+	base_rate=$2
+	base_p99=$3
+
+	if [ $((rate * 100)) -lt $((base_rate * (100 - THRESHOLD))) ]; then
+		echo "$name: throughput regressed: $rate msgs/s," \
+			"baseline $base_rate msgs/s" >&2
+		ret=1
+	fi
+
+	if [ $base_p99 -gt 0 ] &&
+	   [ $((p99 * 100)) -gt $((base_p99 * (100 + THRESHOLD))) ]; then
+		echo "$name: p99 latency regressed: $p99 ns," \
+			"baseline $base_p99 ns" >&2
+		ret=1
+	fi
+
+	[ $ret -eq 0 ] && echo "$name: ok ($rate msgs/s, p99 $p99 ns)"
+
+	return $ret
+}
+
+prerequisite
+
+results=`mktemp`
+ret=0
+
+while read mode size epts threads; do
+	name=$mode-$size-$epts-$threads
+
+	if ! res=`run_case $mode $size $epts $threads`; then
+		echo "$name: failed to run" >&2
+		ret=1
+		continue
+	fi
+
+	echo $name $res >> $results
+done <<< "$CASES"
+
+if [ -n "$UPDATE" ] || [ ! -f $BASELINE ]; then
+	cp $results $BASELINE
+	echo "baseline recorded in $BASELINE:"
+	cat $BASELINE
+else
+	while read name rate p99; do
+		check_case $name $rate $p99 || ret=1
+	done < $results
+fi
+
+rm -f $results
+exit $ret
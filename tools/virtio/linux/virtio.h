@@ -107,6 +107,8 @@ static inline void kfree(void *p)
 
 #define uninitialized_var(x) x = x
 
+#define ACCESS_ONCE(x) (*(volatile typeof(x) *)&(x))
+
 # ifndef likely
 #  define likely(x)	(__builtin_expect(!!(x), 1))
 # endif
@@ -181,9 +183,9 @@ struct virtqueue {
 #define smp_mb()	mb()
 # define smp_rmb()	barrier()
 # define smp_wmb()	barrier()
-/* Weak barriers should be used. If not - it's a bug */
-# define rmb()	abort()
-# define wmb()	abort()
+/* Mandatory barriers, for rings that aren't weakly ordered (remoteproc's) */
+# define rmb()	asm volatile("lfence" ::: "memory")
+# define wmb()	asm volatile("sfence" ::: "memory")
 #else
 #error Please fill in barrier macros
 #endif
@@ -198,6 +200,10 @@ int virtqueue_add_buf(struct virtqueue *vq,
 
 void virtqueue_kick(struct virtqueue *vq);
 
+bool virtqueue_kick_prepare(struct virtqueue *vq);
+
+void virtqueue_notify(struct virtqueue *vq);
+
 void *virtqueue_get_buf(struct virtqueue *vq, unsigned int *len);
 
 void virtqueue_disable_cb(struct virtqueue *vq);
@@ -206,7 +212,8 @@ bool virtqueue_enable_cb(struct virtqueue *vq);
 bool virtqueue_enable_cb_delayed(struct virtqueue *vq);
 
 void *virtqueue_detach_unused_buf(struct virtqueue *vq);
-struct virtqueue *vring_new_virtqueue(unsigned int num,
+struct virtqueue *vring_new_virtqueue(unsigned int index,
+				      unsigned int num,
 				      unsigned int vring_align,
 				      struct virtio_device *vdev,
 				      bool weak_barriers,
@@ -15,6 +15,10 @@
 #include <linux/virtio_ring.h>
 #include "../../drivers/vhost/test.h"
 
+/* what remoteproc's rp_find_vq() sets rpmsg's vrings up with */
+#define RPROC_VRING_NUM		256
+#define RPMSG_BUF_SIZE		512
+
 struct vq_info {
 	int kick;
 	int call;
@@ -26,6 +30,12 @@ struct vq_info {
 	struct virtqueue *vq;
 };
 
+/* cycles spent in the ring operations, and how many of them there were */
+struct vq_stats {
+	unsigned long long add_buf, kick_prepare, notify, get_buf;
+	long long adds, kicks, notifies, gets;
+};
+
 struct vdev_info {
 	struct virtio_device vdev;
 	int control;
@@ -35,8 +45,17 @@ struct vdev_info {
 	void *buf;
 	size_t buf_size;
 	struct vhost_memory *mem;
+	struct vq_stats stats;
 };
 
+static inline unsigned long long cycles(void)
+{
+	unsigned int lo, hi;
+
+	asm volatile("rdtsc" : "=a" (lo), "=d" (hi));
+	return ((unsigned long long)hi << 32) | lo;
+}
+
 void vq_notify(struct virtqueue *vq)
 {
 	struct vq_info *info = vq->priv;
@@ -81,19 +100,21 @@ void vhost_vq_setup(struct vdev_info *dev, struct vq_info *info)
 	assert(r >= 0);
 }
 
-static void vq_info_add(struct vdev_info *dev, int num)
+static void vq_info_add(struct vdev_info *dev, int num, int align,
+			bool weak_barriers)
 {
 	struct vq_info *info = &dev->vqs[dev->nvqs];
 	int r;
 	info->idx = dev->nvqs;
 	info->kick = eventfd(0, EFD_NONBLOCK);
 	info->call = eventfd(0, EFD_NONBLOCK);
-	r = posix_memalign(&info->ring, 4096, vring_size(num, 4096));
+	r = posix_memalign(&info->ring, align > 4096 ? align : 4096,
+			   vring_size(num, align));
 	assert(r >= 0);
-	memset(info->ring, 0, vring_size(num, 4096));
-	vring_init(&info->vring, num, info->ring, 4096);
-	info->vq = vring_new_virtqueue(info->vring.num, 4096, &dev->vdev,
-				       true, info->ring,
+	memset(info->ring, 0, vring_size(num, align));
+	vring_init(&info->vring, num, info->ring, align);
+	info->vq = vring_new_virtqueue(info->idx, info->vring.num, align,
+				       &dev->vdev, weak_barriers, info->ring,
 				       vq_notify, vq_callback, "test");
 	assert(info->vq);
 	info->vq->priv = info;
@@ -103,13 +124,14 @@ static void vq_info_add(struct vdev_info *dev, int num)
 	dev->nvqs++;
 }
 
-static void vdev_info_init(struct vdev_info* dev, unsigned long long features)
+static void vdev_info_init(struct vdev_info* dev, unsigned long long features,
+			   size_t buf_size)
 {
 	int r;
 	memset(dev, 0, sizeof *dev);
 	dev->vdev.features[0] = features;
 	dev->vdev.features[1] = features >> 32;
-	dev->buf_size = 1024;
+	dev->buf_size = buf_size;
 	dev->buf = malloc(dev->buf_size);
 	assert(dev->buf);
         dev->control = open("/dev/vhost-test", O_RDWR);
@@ -147,12 +169,16 @@ static void wait_for_interrupt(struct vdev_info *dev)
 static void run_test(struct vdev_info *dev, struct vq_info *vq,
 		     bool delayed, int bufs)
 {
+	struct vq_stats *stats = &dev->stats;
 	struct scatterlist sl;
 	long started = 0, completed = 0;
 	long completed_before;
 	int r, test = 1;
 	unsigned len;
 	long long spurious = 0;
+	unsigned long long t;
+	bool kick;
+	void *buf;
 	r = ioctl(dev->control, VHOST_TEST_RUN, &test);
 	assert(r >= 0);
 	for (;;) {
@@ -161,18 +187,34 @@ static void run_test(struct vdev_info *dev, struct vq_info *vq,
 		do {
 			if (started < bufs) {
 				sg_init_one(&sl, dev->buf, dev->buf_size);
+				t = cycles();
 				r = virtqueue_add_buf(vq->vq, &sl, 1, 0,
 						      dev->buf + started,
 						      GFP_ATOMIC);
+				stats->add_buf += cycles() - t;
+				stats->adds++;
 				if (likely(r >= 0)) {
 					++started;
-					virtqueue_kick(vq->vq);
+					t = cycles();
+					kick = virtqueue_kick_prepare(vq->vq);
+					stats->kick_prepare += cycles() - t;
+					stats->kicks++;
+					if (kick) {
+						t = cycles();
+						virtqueue_notify(vq->vq);
+						stats->notify += cycles() - t;
+						stats->notifies++;
+					}
 				}
 			} else
 				r = -1;
 
 			/* Flush out completed bufs if any */
-			if (virtqueue_get_buf(vq->vq, &len)) {
+			t = cycles();
+			buf = virtqueue_get_buf(vq->vq, &len);
+			stats->get_buf += cycles() - t;
+			stats->gets++;
+			if (buf) {
 				++completed;
 				r = 0;
 			}
@@ -196,6 +238,14 @@ static void run_test(struct vdev_info *dev, struct vq_info *vq,
 	r = ioctl(dev->control, VHOST_TEST_RUN, &test);
 	assert(r >= 0);
 	fprintf(stderr, "spurious wakeus: 0x%llx\n", spurious);
+	fprintf(stderr, "add_buf: %lld calls, %llu cycles/call\n",
+		stats->adds, stats->add_buf / (stats->adds ? : 1));
+	fprintf(stderr, "kick_prepare: %lld calls, %llu cycles/call\n",
+		stats->kicks, stats->kick_prepare / (stats->kicks ? : 1));
+	fprintf(stderr, "notify: %lld calls, %llu cycles/call\n",
+		stats->notifies, stats->notify / (stats->notifies ? : 1));
+	fprintf(stderr, "get_buf: %lld calls, %llu cycles/call\n",
+		stats->gets, stats->get_buf / (stats->gets ? : 1));
 }
 
 const char optstring[] = "h";
@@ -228,6 +278,15 @@ const struct option longopts[] = {
 		.name = "no-delayed-interrupt",
 		.val = 'd',
 	},
+	{
+		.name = "remoteproc",
+		.val = 'R',
+	},
+	{
+		.name = "vring-align",
+		.has_arg = required_argument,
+		.val = 'A',
+	},
 	{
 	}
 };
@@ -238,6 +297,8 @@ static void help()
 		" [--no-indirect]"
 		" [--no-event-idx]"
 		" [--delayed-interrupt]"
+		" [--remoteproc]"
+		" [--vring-align=N]"
 		"\n");
 }
 
@@ -248,6 +309,9 @@ int main(int argc, char **argv)
 		(1ULL << VIRTIO_RING_F_EVENT_IDX);
 	int o;
 	bool delayed = false;
+	bool remoteproc = false;
+	int num = 256, align = 4096;
+	size_t buf_size = 1024;
 
 	for (;;) {
 		o = getopt_long(argc, argv, optstring, longopts, NULL);
@@ -269,6 +333,27 @@ int main(int argc, char **argv)
 		case 'D':
 			delayed = true;
 			break;
+		case 'R':
+			/*
+			 * set the ring up as rp_find_vq() does for rpmsg:
+			 * mandatory barriers, since the other side is a
+			 * remote processor rather than an SMP peer, no
+			 * indirect descriptors (which firmwares don't
+			 * offer), and single buffers of rpmsg's size.
+			 */
+			remoteproc = true;
+			features &= ~(1ULL << VIRTIO_RING_F_INDIRECT_DESC);
+			num = RPROC_VRING_NUM;
+			buf_size = RPMSG_BUF_SIZE;
+			break;
+		case 'A':
+			/* the firmware chooses it, in its vdev resource */
+			align = atoi(optarg);
+			if (align < 4 || (align & (align - 1))) {
+				help();
+				exit(2);
+			}
+			break;
 		default:
 			assert(0);
 			break;
@@ -276,8 +361,8 @@ int main(int argc, char **argv)
 	}
 
 done:
-	vdev_info_init(&dev, features);
-	vq_info_add(&dev, 256);
+	vdev_info_init(&dev, features, buf_size);
+	vq_info_add(&dev, num, align, !remoteproc);
 	run_test(&dev, &dev.vqs[0], delayed, 0x100000);
 	return 0;
 }